@@ -0,0 +1,357 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file main.cpp
+ * @date 2018
+ * Micro-benchmarks of the CPU side primitives: the light cache, DAG items,
+ * light evaluation, Keccak and the FixedHash helpers.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <libdevcore/FixedHash.h>
+#include <libdevcore/SHA3.h>
+#include <libethash/ethash.h>
+#include <libethash/internal.h>
+#include <libethash/sha3.h>
+#include <libethash/simd.h>
+#include "BuildInfo.h"
+
+using namespace std;
+using namespace dev;
+
+namespace
+{
+
+/// Keeps the compiler from dropping a computation whose result is unused.
+volatile uint8_t g_sink;
+
+inline void keep(void const* _p, size_t _size)
+{
+	g_sink ^= static_cast<uint8_t const*>(_p)[_size - 1];
+}
+
+struct Options
+{
+	string filter;
+	double minSeconds = 0.5;	///< Of each repetition.
+	unsigned repetitions = 5;
+	uint64_t block = 0;			///< Of the light cache and DAG items.
+	string json;
+};
+
+struct Result
+{
+	string name;
+	uint64_t iterations = 0;	///< Of each repetition.
+	double nsPerOp = 0;			///< Median of the repetitions.
+	double minNsPerOp = 0;
+	double maxNsPerOp = 0;
+	uint64_t bytesPerOp = 0;	///< 0 if throughput in bytes makes no sense.
+};
+
+/**
+ * Times @a _op, @a _batch operations per call: calls it until a repetition
+ * lasts Options::minSeconds, then repeats that many calls. Reports the
+ * median time per operation.
+ */
+class Bench
+{
+public:
+	explicit Bench(Options const& _options): m_options(_options) {}
+
+	void run(string const& _name, uint64_t _batch, uint64_t _bytesPerOp, function<void()> const& _op)
+	{
+		if (!m_options.filter.empty() && _name.find(m_options.filter) == string::npos)
+			return;
+
+		uint64_t calls = 1;
+		while (true)
+		{
+			double const seconds = time(calls, _op);
+			if (seconds >= m_options.minSeconds || calls >= (uint64_t(1) << 40))
+				break;
+			// Aim a little past the minimum, growing at most tenfold a step.
+			double const scale = seconds > 0 ? m_options.minSeconds * 1.2 / seconds : 10;
+			calls = max(calls + 1, uint64_t(calls * min(scale, 10.0)));
+		}
+
+		vector<double> ns;
+		for (unsigned r = 0; r < max(m_options.repetitions, 1u); ++r)
+			ns.push_back(time(calls, _op) * 1e9 / (calls * _batch));
+		sort(ns.begin(), ns.end());
+
+		Result result;
+		result.name = _name;
+		result.iterations = calls * _batch;
+		result.nsPerOp = ns[ns.size() / 2];
+		result.minNsPerOp = ns.front();
+		result.maxNsPerOp = ns.back();
+		result.bytesPerOp = _bytesPerOp;
+		print(result);
+		m_results.push_back(result);
+	}
+
+	vector<Result> const& results() const { return m_results; }
+
+private:
+	static double time(uint64_t _calls, function<void()> const& _op)
+	{
+		auto const start = chrono::steady_clock::now();
+		for (uint64_t i = 0; i < _calls; ++i)
+			_op();
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+	static void print(Result const& _r)
+	{
+		cout << left << setw(36) << _r.name << right << fixed << setprecision(1)
+			<< setw(16) << _r.nsPerOp << " ns" << setw(14) << 1e9 / _r.nsPerOp << " /s";
+		if (_r.bytesPerOp)
+			cout << setw(12) << _r.bytesPerOp / _r.nsPerOp * 1e9 / (1 << 20) << " MiB/s";
+		cout << "   (" << setprecision(1) << (_r.maxNsPerOp - _r.minNsPerOp) * 100 / _r.nsPerOp << "% spread)" << endl;
+	}
+
+	Options const& m_options;
+	vector<Result> m_results;
+};
+
+string cpuModel()
+{
+#if defined(__linux__)
+	ifstream in("/proc/cpuinfo");
+	string line;
+	while (getline(in, line))
+		if (line.compare(0, 10, "model name") == 0)
+		{
+			size_t const colon = line.find(':');
+			return colon == string::npos ? line : line.substr(line.find_first_not_of(" \t", colon + 1));
+		}
+#endif
+	return "unknown";
+}
+
+string cpuFeatures()
+{
+	string features;
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1"))
+		features += " sse4.1";
+	if (__builtin_cpu_supports("avx"))
+		features += " avx";
+	if (__builtin_cpu_supports("avx2"))
+		features += " avx2";
+	if (__builtin_cpu_supports("avx512f"))
+		features += " avx512f";
+#endif
+	return features.empty() ? " unknown" : features;
+}
+
+void writeJson(string const& _file, Options const& _options, vector<Result> const& _results)
+{
+	ofstream out(_file);
+	out << "{\n  \"version\": \"" << ETH_PROJECT_VERSION << "\",\n  \"cpu\": \"";
+	for (char c: cpuModel())
+		if (c != '"' && c != '\\')
+			out << c;
+	out << "\",\n  \"features\": \"" << cpuFeatures().substr(1) << "\",\n  \"simd\": \"" << ethash_simd_level_name()
+		<< "\",\n  \"block\": " << _options.block << ",\n  \"results\": [";
+	out << setprecision(10);
+	for (size_t i = 0; i < _results.size(); ++i)
+	{
+		Result const& r = _results[i];
+		out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+			<< ", \"ns_per_op\": " << r.nsPerOp << ", \"min_ns_per_op\": " << r.minNsPerOp << ", \"max_ns_per_op\": " << r.maxNsPerOp
+			<< ", \"bytes_per_op\": " << r.bytesPerOp << "}";
+	}
+	out << "\n  ]\n}\n";
+	if (!out)
+		cerr << "Cannot write " << _file << endl;
+}
+
+void help()
+{
+	cout
+		<< "Usage ethash-bench [OPTIONS]" << endl
+		<< "    --filter <text>  Only run the benchmarks whose name contains this." << endl
+		<< "    --min-time <seconds>  Least duration of each repetition (default: 0.5)." << endl
+		<< "    --repetitions <n>  Repetitions of each benchmark, the median is reported (default: 5)." << endl
+		<< "    --block <n>  Block of the light cache and DAG items (default: 0)." << endl
+		<< "    --simd <none|sse41|avx2|avx512>  Cap the vector kernels libethash picks." << endl
+		<< "    --json <file>  Also write the results to this file as JSON." << endl;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; ++i)
+	{
+		string const arg = argv[i];
+		if (arg == "--filter" && i + 1 < argc)
+			options.filter = argv[++i];
+		else if (arg == "--min-time" && i + 1 < argc)
+			options.minSeconds = atof(argv[++i]);
+		else if (arg == "--repetitions" && i + 1 < argc)
+			options.repetitions = unsigned(atoi(argv[++i]));
+		else if (arg == "--block" && i + 1 < argc)
+			options.block = strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--json" && i + 1 < argc)
+			options.json = argv[++i];
+		else if (arg == "--simd" && i + 1 < argc)
+		{
+			string const level = argv[++i];
+			if (level == "none")
+				ethash_simd_init(ETHASH_SIMD_NONE);
+			else if (level == "sse41")
+				ethash_simd_init(ETHASH_SIMD_SSE41);
+			else if (level == "avx2")
+				ethash_simd_init(ETHASH_SIMD_AVX2);
+			else if (level == "avx512")
+				ethash_simd_init(ETHASH_SIMD_AVX512);
+			else
+			{
+				cerr << "Bad " << arg << " option: " << level << endl;
+				return 1;
+			}
+		}
+		else
+		{
+			help();
+			return arg == "-h" || arg == "--help" ? 0 : 1;
+		}
+	}
+	if (options.minSeconds <= 0 || !options.repetitions)
+	{
+		cerr << "Bad --min-time or --repetitions option" << endl;
+		return 1;
+	}
+
+	cout << "ethash-bench " << ETH_PROJECT_VERSION << endl;
+	cout << "CPU: " << cpuModel() << endl;
+	cout << "Features:" << cpuFeatures() << endl;
+	cout << "libethash vector kernels: " << ethash_simd_level_name() << endl;
+	cout << "Block #" << options.block << ": cache " << ethash_get_cachesize(options.block) / (1 << 20) << " MiB, DAG "
+		<< ethash_get_datasize(options.block) / (1 << 20) << " MiB" << endl << endl;
+
+	Bench bench(options);
+
+	// Keccak over a header, a node and a page.
+	vector<uint8_t> page(4096);
+	for (size_t i = 0; i < page.size(); ++i)
+		page[i] = uint8_t(i * 7 + 1);
+	ethash_h256_t h;
+	uint8_t h512[64];
+	for (size_t bytes: {size_t(32), size_t(64), page.size()})
+	{
+		string const size = to_string(bytes);
+		bench.run("ethash SHA3_256/" + size, 1, bytes, [&]() { SHA3_256(&h, page.data(), bytes); keep(&h, 32); });
+		bench.run("ethash SHA3_512/" + size, 1, bytes, [&]() { SHA3_512(h512, page.data(), bytes); keep(h512, 64); });
+		bench.run("dev::sha3/" + size, 1, bytes, [&]() { h256 const d = sha3(bytesConstRef(page.data(), bytes)); keep(d.data(), 32); });
+	}
+
+	// The multi-buffer Keccak, eight nodes to a call as in the DAG item batches.
+	uint8_t inputs[8][64];
+	uint8_t* lanes[8];
+	for (unsigned l = 0; l < 8; ++l)
+	{
+		memcpy(inputs[l], page.data() + l * 64, 64);
+		lanes[l] = inputs[l];
+	}
+	bench.run("ethash SHA3_256_xN/8x64", 8, 64, [&]() { SHA3_256_xN(lanes, lanes, 64, 8); keep(inputs, 32); });
+	bench.run("ethash SHA3_512_xN/8x64", 8, 64, [&]() { SHA3_512_xN(lanes, lanes, 64, 8); keep(inputs, 64); });
+
+	// FixedHash hex both ways and its comparisons.
+	h256 const a = sha3(bytesConstRef(page.data(), 32));
+	h256 b = a;
+	b[31] ^= 1;
+	string const hex = a.hex();
+	bench.run("FixedHash hex", 1, 32, [&]() { string const s = a.hex(); keep(s.data(), s.size()); });
+	bench.run("FixedHash from hex", 1, 32, [&]() { h256 const p(hex); keep(p.data(), 32); });
+	bench.run("FixedHash ==", 1, 32, [&]() { bool const e = a == b; keep(&e, 1); });
+	bench.run("FixedHash <", 1, 32, [&]() { bool const l = a < b; keep(&l, 1); });
+
+	// The light cache of the block; each build takes most of a second.
+	uint64_t const cacheSize = ethash_get_cachesize(options.block);
+	ethash_h256_t const seed = ethash_get_seedhash(options.block);
+	bench.run("light cache build", 1, cacheSize, [&]()
+	{
+		ethash_light_t l = ethash_light_new_internal(cacheSize, &seed);
+		keep(l->cache, 1);
+		ethash_light_delete(l);
+	});
+
+	ethash_light_t light = ethash_light_new(options.block);
+	if (!light)
+	{
+		cerr << "Cannot build the light cache of block #" << options.block << endl;
+		return 1;
+	}
+
+	// One item alone, and a run of them through the batched range path.
+	uint32_t const items = uint32_t(ethash_get_datasize(options.block) / sizeof(node));
+	uint32_t item = 0;
+	node n;
+	bench.run("ethash_calculate_dag_item", 1, sizeof(node), [&]()
+	{
+		ethash_calculate_dag_item(&n, item, light);
+		item = (item + 7919) % items;
+		keep(&n, sizeof(n));
+	});
+	// The range is written at its node numbers: the first ones, so as not to
+	// hold the whole DAG. Their parents are as scattered as any others'.
+	uint32_t const range = min<uint32_t>(4096, items);
+	vector<node> nodes(range);
+	bench.run("ethash_calculate_dag_range/" + to_string(range), range, sizeof(node), [&]()
+	{
+		ethash_calculate_dag_range(nodes.data(), 0, range, light);
+		keep(&nodes.back(), sizeof(node));
+	});
+
+	// Light evaluation, one nonce and lock step batches.
+	ethash_h256_t header;
+	memcpy(&header, a.data(), 32);
+	uint64_t nonce = 0;
+	bench.run("ethash_light_compute", 1, 0, [&]()
+	{
+		ethash_return_value_t const r = ethash_light_compute(light, header, nonce++);
+		keep(&r.result, 32);
+	});
+	uint64_t nonces[ETHASH_BATCH_LANES];
+	ethash_return_value_t results[ETHASH_BATCH_LANES];
+	bench.run("ethash_light_compute_batch/" + to_string(ETHASH_BATCH_LANES), ETHASH_BATCH_LANES, 0, [&]()
+	{
+		for (uint64_t& n: nonces)
+			n = nonce++;
+		ethash_light_compute_batch(light, header, nonces, ETHASH_BATCH_LANES, results);
+		keep(&results[ETHASH_BATCH_LANES - 1].result, 32);
+	});
+	ethash_light_delete(light);
+
+	if (!options.json.empty())
+		writeJson(options.json, options, bench.results());
+	return 0;
+}
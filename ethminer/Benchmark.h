@@ -0,0 +1,508 @@
+#pragma once
+
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Benchmark.h
+ * @date 2018
+ * The figures of a benchmark run, see MinerCLI::doBenchmark().
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <json/json.h>
+#include <libethcore/Miner.h>
+
+namespace dev
+{
+namespace eth
+{
+
+/// Summary of the trials of one device on one epoch.
+struct BenchmarkStats
+{
+	size_t count = 0;
+	double mean = 0;
+	double stddev = 0;		///< Of the sample, 0 for fewer than 2 trials.
+	double min = 0;
+	double median = 0;
+	double max = 0;
+	double ci95 = 0;		///< Half width of the 95% confidence interval of the mean.
+
+	static BenchmarkStats of(std::vector<double> _samples)
+	{
+		BenchmarkStats s;
+		s.count = _samples.size();
+		if (!s.count)
+			return s;
+		std::sort(_samples.begin(), _samples.end());
+		s.min = _samples.front();
+		s.max = _samples.back();
+		s.median = s.count % 2 ? _samples[s.count / 2] : (_samples[s.count / 2 - 1] + _samples[s.count / 2]) / 2;
+		for (double x: _samples)
+			s.mean += x;
+		s.mean /= s.count;
+		if (s.count < 2)
+			return s;
+		double squares = 0;
+		for (double x: _samples)
+			squares += (x - s.mean) * (x - s.mean);
+		s.stddev = std::sqrt(squares / (s.count - 1));
+		s.ci95 = studentT95(s.count - 1) * s.stddev / std::sqrt(double(s.count));
+		return s;
+	}
+
+	/// Two sided 95% quantile of Student's t for @a _df degrees of freedom.
+	static double studentT95(size_t _df)
+	{
+		static const double c_t[] = {
+			12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+			2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+			2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+		if (!_df)
+			return 0;
+		if (_df <= sizeof(c_t) / sizeof(c_t[0]))
+			return c_t[_df - 1];
+		return _df <= 60 ? 2.000 : _df <= 120 ? 1.980 : 1.960;
+	}
+};
+
+/// One device on one epoch.
+struct BenchmarkRun
+{
+	unsigned epoch = 0;
+	unsigned device = 0;
+	std::string name;
+	MinerTuning tuning;
+	double readyMs = 0;			///< From the work of the epoch until the device hashed, -1 if it did not.
+	double dagMs = 0;			///< The generation of its DAG, as the miner timed it; 0 if it did not.
+	std::vector<double> rates;	///< H/s of each trial.
+	KernelProfile profile;		///< After the last trial.
+
+	BenchmarkStats stats() const { return BenchmarkStats::of(rates); }
+	/// Share of the device's time in the search kernels, -1 if not profiled.
+	double kernelShare() const
+	{
+		double const total = profile.searchMs + profile.gapMs;
+		return profile.enabled && total > 0 ? profile.searchMs / total : -1;
+	}
+};
+
+/**
+ * @brief The runs of a benchmark and the settings they ran with, as a table,
+ * JSON or CSV. A report read back from its JSON is a baseline for
+ * regressions() of a later one on the same devices.
+ */
+class BenchmarkReport
+{
+public:
+	std::string version;
+	std::string platform;
+	std::string started;		///< UTC, ISO 8601.
+	unsigned warmup = 0;		///< Seconds.
+	unsigned trial = 0;			///< Seconds.
+	unsigned trials = 0;
+	std::vector<BenchmarkRun> runs;
+
+	void print(std::ostream& _out) const
+	{
+		_out << std::left << std::setw(6) << "epoch" << std::setw(4) << "dev" << std::setw(28) << "name" << std::right
+			<< std::setw(10) << "ready s" << std::setw(9) << "dag s" << std::setw(12) << "mean MH/s"
+			<< std::setw(10) << "+-95%" << std::setw(10) << "min" << std::setw(10) << "max" << std::setw(9) << "kernel" << std::endl;
+		for (BenchmarkRun const& r: runs)
+		{
+			BenchmarkStats const s = r.stats();
+			_out << std::left << std::setw(6) << r.epoch << std::setw(4) << r.device << std::setw(28) << r.name.substr(0, 27) << std::right
+				<< std::fixed << std::setprecision(2)
+				<< std::setw(10) << r.readyMs / 1000 << std::setw(9) << r.dagMs / 1000 << std::setw(12) << s.mean / 1e6
+				<< std::setw(10) << s.ci95 / 1e6 << std::setw(10) << s.min / 1e6 << std::setw(10) << s.max / 1e6;
+			if (r.kernelShare() < 0)
+				_out << std::setw(9) << "n/a";
+			else
+				_out << std::setw(8) << r.kernelShare() * 100 << "%";
+			_out << std::endl;
+		}
+	}
+
+	Json::Value toJson() const
+	{
+		Json::Value report;
+		report["version"] = version;
+		report["platform"] = platform;
+		report["started"] = started;
+		report["warmup_s"] = warmup;
+		report["trial_s"] = trial;
+		report["trials"] = trials;
+		Json::Value list(Json::arrayValue);
+		for (BenchmarkRun const& r: runs)
+		{
+			Json::Value run;
+			run["epoch"] = r.epoch;
+			run["device"] = r.device;
+			run["name"] = r.name;
+			Json::Value tuning(Json::objectValue);
+			for (auto const& t: r.tuning)
+				tuning[t.first] = t.second;
+			run["tuning"] = tuning;
+			run["ready_ms"] = r.readyMs;
+			run["dag_ms"] = r.dagMs;
+			Json::Value rates(Json::arrayValue);
+			for (double rate: r.rates)
+				rates.append(rate);
+			run["rates"] = rates;
+			BenchmarkStats const s = r.stats();
+			run["mean"] = s.mean;
+			run["stddev"] = s.stddev;
+			run["min"] = s.min;
+			run["median"] = s.median;
+			run["max"] = s.max;
+			run["ci95"] = s.ci95;
+			Json::Value kernel;
+			kernel["enabled"] = r.profile.enabled;
+			if (r.profile.enabled)
+			{
+				kernel["search_ms"] = r.profile.searchMs;
+				kernel["gap_ms"] = r.profile.gapMs;
+				kernel["share"] = r.kernelShare();
+				kernel["bandwidth_gbs"] = r.profile.bandwidth;
+				kernel["dag_ms"] = r.profile.dagMs;
+			}
+			run["kernel"] = kernel;
+			list.append(run);
+		}
+		report["runs"] = list;
+		return report;
+	}
+
+	/// One line per run, rates in H/s, times in ms; kernel columns empty if not profiled.
+	std::string toCsv() const
+	{
+		std::ostringstream out;
+		out << "version,platform,started,epoch,device,name,ready_ms,dag_ms,trials,mean,stddev,min,median,max,ci95,kernel_search_ms,kernel_gap_ms,kernel_share\n";
+		out << std::setprecision(10);
+		for (BenchmarkRun const& r: runs)
+		{
+			BenchmarkStats const s = r.stats();
+			out << quoted(version) << ',' << quoted(platform) << ',' << started << ',' << r.epoch << ',' << r.device << ',' << quoted(r.name) << ','
+				<< r.readyMs << ',' << r.dagMs << ',' << s.count << ',' << s.mean << ',' << s.stddev << ','
+				<< s.min << ',' << s.median << ',' << s.max << ',' << s.ci95 << ',';
+			if (r.profile.enabled)
+				out << r.profile.searchMs << ',' << r.profile.gapMs << ',' << r.kernelShare();
+			else
+				out << ",,";
+			out << '\n';
+		}
+		return out.str();
+	}
+
+	/// Prints how the runs compare to those of @a _baseline on the same
+	/// device and epoch; a run is a regression if its confidence interval
+	/// lies wholly below the baseline's. @return the regressions.
+	unsigned regressions(Json::Value const& _baseline, std::ostream& _out) const
+	{
+		unsigned regressed = 0;
+		for (BenchmarkRun const& r: runs)
+		{
+			Json::Value const* base = nullptr;
+			for (Json::Value const& b: _baseline["runs"])
+				if (b["epoch"].asUInt() == r.epoch && b["device"].asUInt() == r.device && b["name"].asString() == r.name)
+					base = &b;
+			if (!base || (*base)["mean"].asDouble() <= 0)
+			{
+				_out << "epoch " << r.epoch << " device " << r.device << ": not in the baseline" << std::endl;
+				continue;
+			}
+			BenchmarkStats const s = r.stats();
+			double const mean = (*base)["mean"].asDouble();
+			bool const worse = s.mean + s.ci95 < mean - (*base)["ci95"].asDouble();
+			_out << "epoch " << r.epoch << " device " << r.device << ": " << std::fixed << std::setprecision(2)
+				<< std::showpos << (s.mean - mean) * 100 / mean << std::noshowpos << "% against the baseline"
+				<< (worse ? ", REGRESSION" : "") << std::endl;
+			if (worse)
+				++regressed;
+		}
+		return regressed;
+	}
+
+private:
+	static std::string quoted(std::string const& _s)
+	{
+		std::string q = "\"";
+		for (char c: _s)
+			if (c == '"')
+				q += "\"\"";
+			else
+				q += c;
+		return q + '"';
+	}
+};
+
+/// One device, or the host DAG engine, getting the DAG of one epoch.
+struct DagBenchmarkRun
+{
+	unsigned epoch = 0;
+	int device = 0;					///< -1 for the host DAG engine.
+	std::string name;
+	std::string mode;				///< How the devices loaded their DAGs: parallel, sequential or single.
+	double readyMs = 0;				///< From the work of the epoch until the device hashed, -1 if it did not.
+	std::vector<DagStage> stages;	///< As the miner reported them.
+};
+
+/**
+ * @brief The DAG builds of a --benchmark-dag run, stage by stage, as a table
+ * or JSON: how long an epoch switch keeps each device from hashing, and
+ * where that time goes.
+ */
+class DagBenchmarkReport
+{
+public:
+	std::string version;
+	std::string platform;
+	std::string started;		///< UTC, ISO 8601.
+	std::vector<DagBenchmarkRun> runs;
+
+	void print(std::ostream& _out) const
+	{
+		_out << std::left << std::setw(6) << "epoch" << std::setw(5) << "dev" << std::setw(28) << "name" << std::setw(11) << "load" << std::setw(11) << "stage" << std::right
+			<< std::setw(10) << "MB" << std::setw(10) << "wall s" << std::setw(9) << "GB/s" << std::endl;
+		for (DagBenchmarkRun const& r: runs)
+		{
+			std::string const device = r.device < 0 ? "host" : std::to_string(r.device);
+			for (DagStage const& s: r.stages)
+				_out << std::left << std::setw(6) << r.epoch << std::setw(5) << device << std::setw(28) << r.name.substr(0, 27) << std::setw(11) << r.mode << std::setw(11) << s.name << std::right
+					<< std::fixed << std::setprecision(2) << std::setw(10) << s.bytes / 1e6 << std::setw(10) << s.ms / 1000 << std::setw(9) << s.bandwidth() << std::endl;
+			if (r.device >= 0)
+			{
+				_out << std::left << std::setw(6) << r.epoch << std::setw(5) << device << std::setw(28) << r.name.substr(0, 27) << std::setw(11) << r.mode << std::setw(11) << "ready" << std::right
+					<< std::setw(10) << "";
+				if (r.readyMs < 0)
+					_out << std::setw(10) << "timeout";
+				else
+					_out << std::fixed << std::setprecision(2) << std::setw(10) << r.readyMs / 1000;
+				_out << std::endl;
+			}
+		}
+	}
+
+	Json::Value toJson() const
+	{
+		Json::Value report;
+		report["version"] = version;
+		report["platform"] = platform;
+		report["started"] = started;
+		Json::Value list(Json::arrayValue);
+		for (DagBenchmarkRun const& r: runs)
+		{
+			Json::Value run;
+			run["epoch"] = r.epoch;
+			run["device"] = r.device;
+			run["name"] = r.name;
+			run["mode"] = r.mode;
+			if (r.device >= 0)
+				run["ready_ms"] = r.readyMs;
+			Json::Value stages(Json::arrayValue);
+			for (DagStage const& s: r.stages)
+			{
+				Json::Value stage;
+				stage["name"] = s.name;
+				stage["bytes"] = Json::UInt64(s.bytes);
+				stage["ms"] = s.ms;
+				stage["gbs"] = s.bandwidth();
+				stages.append(stage);
+			}
+			run["stages"] = stages;
+			list.append(run);
+		}
+		report["runs"] = list;
+		return report;
+	}
+};
+
+/// One host loop configuration of one device, see HostBenchmarkReport.
+struct HostBenchmarkRun
+{
+	int device = 0;
+	std::string name;
+	std::string config;				///< baseline, no-readback, null-work, pipeline n or streams n.
+	MinerTuning tuning;				///< In effect during the run.
+	double seconds = 0;
+	double rate = 0;				///< Hashes per second.
+	HostLoopStats loop;				///< Over the run.
+	double launches() const { return seconds > 0 ? loop.launches / seconds : 0; }
+	/// Share of the run the device had no search in flight.
+	double idle() const { return seconds > 0 ? std::min(1.0, loop.idleNs / 1e9 / seconds) : 0; }
+};
+
+/**
+ * @brief The host loop runs of a --benchmark-host run, as a table or JSON:
+ * what each launch costs the host and how long the device waits for the
+ * next one, with the results read back or not, with launches so small the
+ * loop is all there is, and with more or fewer searches in flight.
+ */
+class HostBenchmarkReport
+{
+public:
+	std::string version;
+	std::string platform;
+	std::string started;		///< UTC, ISO 8601.
+	unsigned epoch = 0;
+	std::vector<HostBenchmarkRun> runs;
+
+	void print(std::ostream& _out) const
+	{
+		_out << std::left << std::setw(5) << "dev" << std::setw(28) << "name" << std::setw(13) << "config" << std::right
+			<< std::setw(10) << "MH/s" << std::setw(11) << "launch/s" << std::setw(12) << "host us" << std::setw(8) << "idle %" << std::endl;
+		for (HostBenchmarkRun const& r: runs)
+			_out << std::left << std::setw(5) << r.device << std::setw(28) << r.name.substr(0, 27) << std::setw(13) << r.config << std::right
+				<< std::fixed << std::setprecision(2) << std::setw(10) << r.rate / 1e6 << std::setw(11) << r.launches()
+				<< std::setw(12) << r.loop.hostUs() << std::setw(8) << r.idle() * 100 << std::endl;
+	}
+
+	Json::Value toJson() const
+	{
+		Json::Value report;
+		report["version"] = version;
+		report["platform"] = platform;
+		report["started"] = started;
+		report["epoch"] = epoch;
+		Json::Value list(Json::arrayValue);
+		for (HostBenchmarkRun const& r: runs)
+		{
+			Json::Value run;
+			run["device"] = r.device;
+			run["name"] = r.name;
+			run["config"] = r.config;
+			Json::Value tuning(Json::objectValue);
+			for (auto const& t: r.tuning)
+				tuning[t.first] = t.second;
+			run["tuning"] = tuning;
+			run["seconds"] = r.seconds;
+			run["rate"] = r.rate;
+			run["launches"] = Json::UInt64(r.loop.launches);
+			run["host_us_per_launch"] = r.loop.hostUs();
+			run["idle"] = r.idle();
+			list.append(run);
+		}
+		report["runs"] = list;
+		return report;
+	}
+};
+
+/// One kernel variant of one device on one epoch, its hits checked on the CPU.
+struct ValidationRun
+{
+	unsigned epoch = 0;
+	unsigned device = 0;
+	std::string name;
+	std::string variant;
+	std::string error;			///< Why the variant did not run, empty if it did.
+	double seconds = 0;
+	double rate = 0;			///< H/s.
+	uint64_t hits = 0;			///< Solutions the device submitted.
+	uint64_t mismatches = 0;	///< Of the hits, those the CPU found wrong.
+	uint64_t failed = 0;		///< Results the miner itself dropped as wrong.
+	uint64_t overflows = 0;		///< Searches finding more hits than they could store.
+	double verifyMs = 0;		///< CPU time of checking the hits.
+
+	bool ok() const { return error.empty() && !mismatches && !failed; }
+};
+
+/**
+ * @brief The kernel variants of a --validate run against the CPU, as a table
+ * or JSON.
+ */
+class ValidationReport
+{
+public:
+	std::string version;
+	std::string platform;
+	std::string started;		///< UTC, ISO 8601.
+	double difficulty = 0;		///< Hashes per hit.
+	unsigned trial = 0;			///< Seconds per variant.
+	std::vector<ValidationRun> runs;
+
+	/// Runs with a wrong result.
+	unsigned failures() const
+	{
+		unsigned n = 0;
+		for (ValidationRun const& r: runs)
+			n += r.error.empty() && !r.ok();
+		return n;
+	}
+
+	void print(std::ostream& _out) const
+	{
+		_out << std::left << std::setw(6) << "epoch" << std::setw(4) << "dev" << std::setw(28) << "name" << std::setw(18) << "variant" << std::right
+			<< std::setw(11) << "MH/s" << std::setw(8) << "hits" << std::setw(8) << "wrong" << std::setw(8) << "failed"
+			<< std::setw(10) << "overflow" << std::setw(12) << "verify/s" << std::endl;
+		for (ValidationRun const& r: runs)
+		{
+			_out << std::left << std::setw(6) << r.epoch << std::setw(4) << r.device << std::setw(28) << r.name.substr(0, 27)
+				<< std::setw(18) << r.variant.substr(0, 17) << std::right;
+			if (!r.error.empty())
+			{
+				_out << "  not run: " << r.error << std::endl;
+				continue;
+			}
+			_out << std::fixed << std::setprecision(2) << std::setw(11) << r.rate / 1e6 << std::setw(8) << r.hits << std::setw(8) << r.mismatches
+				<< std::setw(8) << r.failed << std::setw(10) << r.overflows << std::setprecision(0)
+				<< std::setw(12) << (r.verifyMs > 0 ? r.hits * 1000 / r.verifyMs : 0) << (r.ok() ? "" : "  FAIL") << std::endl;
+		}
+	}
+
+	Json::Value toJson() const
+	{
+		Json::Value report;
+		report["version"] = version;
+		report["platform"] = platform;
+		report["started"] = started;
+		report["difficulty"] = difficulty;
+		report["trial_s"] = trial;
+		Json::Value list(Json::arrayValue);
+		for (ValidationRun const& r: runs)
+		{
+			Json::Value run;
+			run["epoch"] = r.epoch;
+			run["device"] = r.device;
+			run["name"] = r.name;
+			run["variant"] = r.variant;
+			if (!r.error.empty())
+				run["error"] = r.error;
+			else
+			{
+				run["seconds"] = r.seconds;
+				run["rate"] = r.rate;
+				run["hits"] = Json::UInt64(r.hits);
+				run["mismatches"] = Json::UInt64(r.mismatches);
+				run["failed"] = Json::UInt64(r.failed);
+				run["overflows"] = Json::UInt64(r.overflows);
+				run["verify_ms"] = r.verifyMs;
+				run["ok"] = r.ok();
+			}
+			list.append(run);
+		}
+		report["runs"] = list;
+		return report;
+	}
+};
+
+}
+}
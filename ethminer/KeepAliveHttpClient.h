@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <jsonrpccpp/client/iclientconnector.h>
+#include <jsonrpccpp/common/exception.h>
+
+/// An HTTP/1.1 JSON-RPC connector for getwork that keeps its connection to
+/// the node open between requests, which jsonrpc::HttpClient does not do
+/// reliably. Blocking like HttpClient, with a timeout per request; use one
+/// per thread.
+class KeepAliveHttpClient: public jsonrpc::IClientConnector
+{
+public:
+	explicit KeepAliveHttpClient(std::string const& _url, unsigned _timeoutMs = 10000):
+		m_timeoutMs(_timeoutMs),
+		m_socket(m_io),
+		m_timer(m_io)
+	{
+		std::string rest = _url.compare(0, 7, "http://") == 0 ? _url.substr(7) : _url;
+		size_t const slash = rest.find('/');
+		m_path = slash == std::string::npos ? "/" : rest.substr(slash);
+		rest = rest.substr(0, slash);
+		size_t const colon = rest.find(':');
+		m_host = rest.substr(0, colon);
+		m_port = colon == std::string::npos ? "80" : rest.substr(colon + 1);
+	}
+
+	void SendRPCMessage(std::string const& _message, std::string& _result) throw (jsonrpc::JsonRpcException) override
+	{
+		// The node may have closed a kept-alive connection meanwhile; such a
+		// request is retried once on a fresh one.
+		for (bool retry = m_socket.is_open(); ; retry = false)
+		{
+			boost::system::error_code ec = request(_message, _result);
+			if (!ec)
+				return;
+			close();
+			if (!retry)
+				throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_CONNECTOR, "Could not reach " + m_host + ":" + m_port + ", " + ec.message());
+		}
+	}
+
+private:
+	boost::system::error_code request(std::string const& _message, std::string& _result)
+	{
+		namespace asio = boost::asio;
+		boost::system::error_code ec;
+		if (!m_socket.is_open())
+		{
+			asio::ip::tcp::resolver resolver(m_io);
+			auto endpoints = resolver.resolve(asio::ip::tcp::resolver::query(m_host, m_port), ec);
+			if (ec)
+				return ec;
+			for (asio::ip::tcp::resolver::iterator i = endpoints; i != asio::ip::tcp::resolver::iterator(); ++i)
+			{
+				close();
+				asio::ip::tcp::endpoint const endpoint = *i;
+				run([&](Done _done) { m_socket.async_connect(endpoint, _done); }, ec);
+				if (!ec)
+					break;
+			}
+			if (ec)
+				return ec;
+			m_socket.set_option(asio::ip::tcp::no_delay(true), ec);
+			m_in.consume(m_in.size());
+		}
+
+		std::string const head = "POST " + m_path + " HTTP/1.1\r\nHost: " + m_host + ":" + m_port + "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(_message.size()) + "\r\nConnection: keep-alive\r\n\r\n";
+		std::vector<asio::const_buffer> out{asio::buffer(head), asio::buffer(_message)};
+		run([&](Done _done) { asio::async_write(m_socket, out, [=](boost::system::error_code const& _ec, size_t) { _done(_ec); }); }, ec);
+		if (ec)
+			return ec;
+
+		size_t n = 0;
+		run([&](Done _done) { asio::async_read_until(m_socket, m_in, "\r\n\r\n", [=, &n](boost::system::error_code const& _ec, size_t _n) { n = _n; _done(_ec); }); }, ec);
+		if (ec)
+			return ec;
+		std::string headers(asio::buffer_cast<char const*>(m_in.data()), n);
+		m_in.consume(n);
+		std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+		int const status = headers.size() > 12 ? atoi(headers.c_str() + 9) : 0;
+		bool const chunked = headers.find("\r\ntransfer-encoding: chunked") != std::string::npos;
+		bool const closing = headers.find("\r\nconnection: close") != std::string::npos;
+		size_t const lengthAt = headers.find("\r\ncontent-length:");
+
+		_result.clear();
+		if (chunked)
+		{
+			while (true)
+			{
+				run([&](Done _done) { asio::async_read_until(m_socket, m_in, "\r\n", [=, &n](boost::system::error_code const& _ec, size_t _n) { n = _n; _done(_ec); }); }, ec);
+				if (ec)
+					return ec;
+				size_t const size = strtoul(asio::buffer_cast<char const*>(m_in.data()), nullptr, 16);
+				m_in.consume(n);
+				// The chunk and its CRLF; the last, empty chunk has no trailers from JSON-RPC servers.
+				if (!readBody(size + 2, _result, ec))
+					return ec;
+				_result.resize(_result.size() - 2);
+				if (!size)
+					break;
+			}
+		}
+		else if (lengthAt != std::string::npos)
+		{
+			if (!readBody(strtoul(headers.c_str() + lengthAt + 17, nullptr, 10), _result, ec))
+				return ec;
+		}
+		else
+		{
+			// No length: the body runs to the end of the connection.
+			run([&](Done _done) { asio::async_read(m_socket, m_in, [=](boost::system::error_code const& _ec, size_t) { _done(_ec); }); }, ec);
+			if (ec != asio::error::eof)
+				return ec;
+			_result.assign(asio::buffer_cast<char const*>(m_in.data()), m_in.size());
+			m_in.consume(m_in.size());
+			close();
+		}
+		if (closing)
+			close();
+		if (status != 200)
+			throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_CONNECTOR, "HTTP " + std::to_string(status) + " from " + m_host + ":" + m_port);
+		return boost::system::error_code();
+	}
+
+	bool readBody(size_t _size, std::string& _out, boost::system::error_code& _ec)
+	{
+		if (m_in.size() < _size)
+			run([&](Done _done) { boost::asio::async_read(m_socket, m_in, boost::asio::transfer_exactly(_size - m_in.size()), [=](boost::system::error_code const& _e, size_t) { _done(_e); }); }, _ec);
+		if (_ec)
+			return false;
+		_out.append(boost::asio::buffer_cast<char const*>(m_in.data()), _size);
+		m_in.consume(_size);
+		return true;
+	}
+
+	typedef std::function<void(boost::system::error_code const&)> Done;
+
+	/// Runs the operation _start starts until it is done or times out.
+	void run(std::function<void(Done)> const& _start, boost::system::error_code& _ec)
+	{
+		bool done = false;
+		m_io.reset();
+		_start([&](boost::system::error_code const& _e) { _ec = _e; done = true; });
+		m_timer.expires_from_now(boost::posix_time::milliseconds(m_timeoutMs));
+		m_timer.async_wait([this](boost::system::error_code const& _e)
+		{
+			// Closing makes the operation fail with operation_aborted.
+			if (!_e)
+				close();
+		});
+		while (!done && m_io.run_one())
+			;
+		m_timer.cancel();
+		m_io.run();
+	}
+
+	void close()
+	{
+		boost::system::error_code ec;
+		m_socket.close(ec);
+	}
+
+	std::string m_host;
+	std::string m_port;
+	std::string m_path;
+	unsigned const m_timeoutMs;
+	boost::asio::io_service m_io;
+	boost::asio::ip::tcp::socket m_socket;
+	boost::asio::deadline_timer m_timer;
+	boost::asio::streambuf m_in;
+};
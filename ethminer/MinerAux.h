@@ -41,6 +41,9 @@
 #include <libdevcore/SHA3.h>
 #include <libethcore/EthashAux.h>
 #include <libethcore/Farm.h>
+#include <libdevcore/Affinity.h>
+#include <libdevcore/MpscQueue.h>
+#include <libhwmon/HwMonSampler.h>
 #if ETH_ETHASHCL
 #include <libethash-cl/CLMiner.h>
 #endif
@@ -51,10 +54,20 @@
 #if ETH_ETHASHCUDA
 #include <libethash-cuda/CUDAMiner.h>
 #endif
+#if ETH_ETHASHCPU
+#include <libethash-cpu/CPUMiner.h>
+#endif
 #include <jsonrpccpp/client/connectors/httpclient.h>
+#include "BuildInfo.h"
+#include "Benchmark.h"
 #include "FarmClient.h"
+#include "KeepAliveHttpClient.h"
 #include <libstratum/EthStratumClient.h>
 #include <libstratum/EthStratumClientV2.h>
+#include <libstratum/StratumProxy.h>
+#include <libstratum/StratumReplay.h>
+#include <libstratum/SessionRecorder.h>
+#include <libstratum/GetworkSubscription.h>
 #if ETH_DBUS
 #include "DBusInt.h"
 #endif
@@ -93,7 +106,9 @@ public:
 		Benchmark,
 		Simulation,
 		Farm,
-		Stratum
+		Stratum,
+		Replay,
+		Validate
 	};
 
 	MinerCLI(OperationMode _mode = OperationMode::None): mode(_mode) {
@@ -136,6 +151,10 @@ public:
 				m_farmFailOverURL = url;
 			}
 		}
+		else if (arg == "--farm-ipc" && i + 1 < argc)
+		{
+			m_farmIpc = argv[++i];
+		}
 		else if (arg == "--farm-recheck" && i + 1 < argc)
 			try {
 				m_farmRecheckSet = true;
@@ -146,6 +165,37 @@ public:
 				cerr << "Bad " << arg << " option: " << argv[i] << endl;
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
+		else if (arg == "--watchdog" && i + 1 < argc)
+			try {
+				m_watchdogSeconds = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		else if (arg == "--invalid-limit" && i + 1 < argc)
+		{
+			m_invalidLimit = atof(argv[++i]);
+			if (m_invalidLimit < 0 || m_invalidLimit > 100)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--invalid-action" && i + 1 < argc)
+		{
+			string action = argv[++i];
+			if (action == "throttle")
+				m_invalidAction = Farm::InvalidAction::Throttle;
+			else if (action == "reinit")
+				m_invalidAction = Farm::InvalidAction::Reinit;
+			else
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
 		else if (arg == "--farm-retries" && i + 1 < argc)
 			try {
 				m_maxFarmRetries = stol(argv[++i]);
@@ -192,6 +242,85 @@ public:
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
 		}
+		else if (arg == "--stratum-hot-standby")
+		{
+			m_stratumHotStandby = true;
+		}
+		else if (arg == "--stratum-tls")
+		{
+			m_stratumTls = true;
+		}
+		else if (arg == "--stratum-tls-noverify")
+		{
+			m_stratumTls = true;
+			m_stratumTlsVerify = false;
+		}
+		else if (arg == "--stratum-candidates" && i + 1 < argc)
+		{
+			string list = argv[++i];
+			for (size_t b = 0, e; b <= list.size(); b = e + 1)
+			{
+				e = min(list.find(',', b), list.size());
+				string const candidate = list.substr(b, e - b);
+				size_t const p = candidate.find_last_of(":");
+				if (p == string::npos || p == 0 || p + 1 == candidate.size())
+				{
+					cerr << "Bad " << arg << " option: " << argv[i] << endl;
+					BOOST_THROW_EXCEPTION(BadArgument());
+				}
+				m_stratumCandidates.push_back(PoolProber::Endpoint{candidate.substr(0, p), candidate.substr(p + 1)});
+			}
+		}
+		else if (arg == "--stratum-proxy" && i + 1 < argc)
+		{
+			try {
+				m_stratumProxyPort = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			if (m_stratumProxyPort <= 0 || m_stratumProxyPort > 65535)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--stratum-proxy-bind" && i + 1 < argc)
+		{
+			m_stratumProxyAddress = argv[++i];
+			boost::system::error_code ec;
+			boost::asio::ip::address::from_string(m_stratumProxyAddress, ec);
+			if (ec)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--stratum-record" && i + 1 < argc)
+			SessionRecorder::setPrefix(argv[++i]);
+		else if (arg == "--stratum-replay" && i + 1 < argc)
+		{
+			mode = OperationMode::Replay;
+			m_replayFile = argv[++i];
+		}
+		else if (arg == "--replay-speed" && i + 1 < argc)
+		{
+			try {
+				m_replaySpeed = stod(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			if (!(m_replaySpeed > 0))
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
 		else if ((arg == "-SP" || arg == "--stratum-protocol") && i + 1 < argc)
 		{
 			try {
@@ -258,12 +387,89 @@ public:
 		{
 			m_show_hwmonitors = true;
 		}
+		else if ((arg == "--hwmon-interval") && i + 1 < argc)
+		{
+			int const ms = atoi(argv[++i]);
+			if (ms < 100)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			HwMonSampler::setInterval((unsigned)ms);
+		}
+		else if ((arg == "--host-threads") && i + 1 < argc)
+		{
+			int const n = atoi(argv[++i]);
+			if (n < 1 || n > 64)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			m_hostThreads = unsigned(n);
+		}
+		else if (arg == "--affinity")
+		{
+			setMinerAffinity(true);
+		}
+		else if ((arg == "--stratum-cpus" || arg == "--verify-cpus") && i + 1 < argc)
+		{
+			vector<unsigned> const cpus = parseCpuList(argv[++i]);
+			if (cpus.empty())
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			if (arg == "--stratum-cpus")
+				setStratumCpus(cpus);
+			else
+				setVerifyCpus(cpus);
+		}
+		else if ((arg == "--target-temp" || arg == "--target-power") && i + 1 < argc)
+		{
+			int const v = atoi(argv[++i]);
+			if (v <= 0)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			(arg == "--target-temp" ? m_targetTemp : m_targetPower) = unsigned(v);
+		}
 
 #if API_CORE
 		else if ((arg == "--api-port") && i + 1 < argc)
 		{
 			m_api_port = atoi(argv[++i]);
 		}
+		else if ((arg == "--metrics-port") && i + 1 < argc)
+		{
+			int const port = atoi(argv[++i]);
+			if (port <= 0 || port > 65535)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			m_metrics_port = (unsigned short)port;
+		}
+		else if ((arg == "--stats-port") && i + 1 < argc)
+		{
+			int const port = atoi(argv[++i]);
+			if (port <= 0 || port > 65535)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			m_stats_port = (unsigned short)port;
+		}
+		else if ((arg == "--stats-interval") && i + 1 < argc)
+		{
+			int const ms = atoi(argv[++i]);
+			if (ms < 100)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			m_stats_interval = (unsigned)ms;
+		}
 #endif
 #if ETH_ETHASHCL
 		else if (arg == "--opencl-platform" && i + 1 < argc)
@@ -302,6 +508,91 @@ public:
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
 		}
+		else if (arg == "--cl-hashes-per-thread" && i + 1 < argc)
+		{
+			try
+			{
+				m_openclHashesPerThread = stol(argv[++i]);
+				if (m_openclHashesPerThread != 1 && m_openclHashesPerThread != 2 &&
+					m_openclHashesPerThread != 4 && m_openclHashesPerThread != 8)
+				{
+					BOOST_THROW_EXCEPTION(BadArgument());
+				}
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--cl-pipeline" && i + 1 < argc)
+		{
+			try
+			{
+				m_openclPipelineDepth = stol(argv[++i]);
+				if (m_openclPipelineDepth < 1 || m_openclPipelineDepth > 8)
+					BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--cl-kernel-ms" && i + 1 < argc)
+		{
+			try
+			{
+				m_openclKernelTargetMs = stol(argv[++i]);
+				if (m_openclKernelTargetMs > 10000)
+					BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--cl-verify" && i + 1 < argc)
+		{
+			try
+			{
+				m_openclVerifyEvery = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--cl-kernel-dir" && i + 1 < argc)
+			m_openclKernelDirectory = argv[++i];
+		else if (arg == "--cl-init-budget" && i + 1 < argc)
+		{
+			try
+			{
+				m_openclInitBudget = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--cl-profile")
+			m_openclProfiling = true;
+		else if (arg == "--cl-persistent" && i + 1 < argc)
+		{
+			try
+			{
+				m_openclPersistentRounds = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
 		else if (arg == "--cl-kernel" && i + 1 < argc)
 		{
 			try
@@ -327,6 +618,30 @@ public:
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
 		}
+		else if (arg == "--cl-dag-prebuild" && i + 1 < argc)
+		{
+			try
+			{
+				m_dagPrebuild = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
+		else if (arg == "--cl-dag-global-work" && i + 1 < argc)
+		{
+			try
+			{
+				m_dagGlobalWorkSizeMultiplier = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		}
 		else if ( arg == "--cl-local-work" && i + 1 < argc)
 			try
 			{
@@ -401,6 +716,11 @@ public:
 			else if (mode == "spin") m_cudaSchedule = 1;
 			else if (mode == "yield") m_cudaSchedule = 2;
 			else if (mode == "sync") m_cudaSchedule = 4;
+			else if (mode == "events")
+			{
+				m_cudaSchedule = 4;
+				m_cudaEventCollect = true;
+			}
 			else
 			{
 				cerr << "Bad " << arg << " option: " << argv[i] << endl;
@@ -409,67 +729,241 @@ public:
 		}
 		else if (arg == "--cuda-streams" && i + 1 < argc)
 			m_numStreams = stol(argv[++i]);
-#endif
-		else if ((arg == "-L" || arg == "--dag-load-mode") && i + 1 < argc)
+		else if (arg == "--cuda-graph" && i + 1 < argc)
 		{
-			string mode = argv[++i];
-			if (mode == "parallel") m_dagLoadMode = DAG_LOAD_MODE_PARALLEL;
-			else if (mode == "sequential") m_dagLoadMode = DAG_LOAD_MODE_SEQUENTIAL;
-			else if (mode == "single")
+			try
 			{
-				m_dagLoadMode = DAG_LOAD_MODE_SINGLE;
-				m_dagCreateDevice = stol(argv[++i]);
+				m_cudaGraphSearches = stol(argv[++i]);
 			}
-			else
+			catch (...)
 			{
 				cerr << "Bad " << arg << " option: " << argv[i] << endl;
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
 		}
-		else if (arg == "--benchmark-warmup" && i + 1 < argc)
-			try {
-				m_benchmarkWarmup = stol(argv[++i]);
+		else if (arg == "--cuda-rtc")
+			m_cudaRuntimeCompile = true;
+		else if (arg == "--cuda-auto-tune")
+			m_cudaAutoTune = true;
+		else if (arg == "--cuda-host-dag")
+			m_cudaHostDag = true;
+		else if (arg == "--cuda-l2-persist")
+			m_cudaL2Persist = true;
+		else if (arg == "--cuda-instances-per-gpu" && i + 1 < argc)
+		{
+			try
+			{
+				m_cudaInstancesPerDevice = stol(argv[++i]);
 			}
 			catch (...)
 			{
 				cerr << "Bad " << arg << " option: " << argv[i] << endl;
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
-		else if (arg == "--benchmark-trial" && i + 1 < argc)
-			try {
-				m_benchmarkTrial = stol(argv[++i]);
+		}
+		else if (arg == "--cuda-dag-headroom" && i + 1 < argc)
+		{
+			try
+			{
+				m_cudaDagHeadroom = stol(argv[++i]);
 			}
 			catch (...)
 			{
 				cerr << "Bad " << arg << " option: " << argv[i] << endl;
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
-		else if (arg == "--benchmark-trials" && i + 1 < argc)
-			try
+		}
+#endif
+		else if ((arg == "-L" || arg == "--dag-load-mode") && i + 1 < argc)
+		{
+			string mode = argv[++i];
+			if (mode == "parallel") m_dagLoadMode = DAG_LOAD_MODE_PARALLEL;
+			else if (mode == "sequential") m_dagLoadMode = DAG_LOAD_MODE_SEQUENTIAL;
+			else if (mode == "single")
 			{
-				m_benchmarkTrials = stol(argv[++i]);
+				m_dagLoadMode = DAG_LOAD_MODE_SINGLE;
+				m_dagCreateDevice = stol(argv[++i]);
 			}
-			catch (...)
+			else
 			{
 				cerr << "Bad " << arg << " option: " << argv[i] << endl;
 				BOOST_THROW_EXCEPTION(BadArgument());
 			}
-		else if (arg == "-G" || arg == "--opencl")
-			m_minerType = MinerType::CL;
-		else if (arg == "-U" || arg == "--cuda")
-		{
-			m_minerType = MinerType::CUDA;
 		}
-		else if (arg == "-X" || arg == "--cuda-opencl")
+		else if (arg == "--dag-dir" && i + 1 < argc)
+			EthashAux::setDAGDirectory(argv[++i]);
+		else if (arg == "--shared-dag")
+			EthashAux::setSharedMemory(true);
+		else if (arg == "--host-memory" && i + 1 < argc)
 		{
-			m_minerType = MinerType::Mixed;
+			string mb = argv[++i];
+			if (mb.empty() || mb.size() > 9 || mb.find_first_not_of("0123456789") != string::npos)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			HostMemory::setBudget(stoull(mb) * 1024 * 1024);
 		}
-
-#if ETH_ETHASHOCL
-		else if (arg == "--fpga" || arg == "--opencl")
+		else if (arg == "--start-epoch" && i + 1 < argc)
 		{
-			m_minerType = MinerType::Fpga;
+			string epoch = argv[++i];
+			if (epoch == "off")
+				m_startDag = false;
+			else
+			{
+				int const n = atoi(epoch.c_str());
+				if (epoch.empty() || n >= ETHASH_MAX_EPOCHS || epoch.find_first_not_of("0123456789") != string::npos)
+				{
+					cerr << "Bad " << arg << " option: " << argv[i] << endl;
+					BOOST_THROW_EXCEPTION(BadArgument());
+				}
+				m_startEpoch = n;
+			}
+		}
+		else if (arg == "--dual-dag")
+			m_dualDag = true;
+		else if (arg == "--dag-verify" && i + 1 < argc)
+		{
+			int const seconds = atoi(argv[++i]);
+			if (seconds <= 0)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			DagVerifier::setInterval((unsigned)seconds);
+		}
+		else if (arg == "--probe-difficulty" && i + 1 < argc)
+		{
+			int const millions = atoi(argv[++i]);
+			if (millions <= 0)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			Miner::setProbeDifficulty(uint64_t(millions) * 1000000);
+		}
+		else if (arg == "--benchmark-warmup" && i + 1 < argc)
+			try {
+				m_benchmarkWarmup = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		else if (arg == "--benchmark-trial" && i + 1 < argc)
+			try {
+				m_benchmarkTrial = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		else if (arg == "--benchmark-trials" && i + 1 < argc)
+			try
+			{
+				m_benchmarkTrials = stol(argv[++i]);
+				if (!m_benchmarkTrials)
+					BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+		else if (arg == "--benchmark-epochs" && i + 1 < argc)
+		{
+			string const epochs = argv[++i];
+			vector<string> list;
+			boost::split(list, epochs, boost::is_any_of(","));
+			m_benchmarkEpochs.clear();
+			for (string const& e: list)
+			{
+				char* end = nullptr;
+				unsigned long const epoch = strtoul(e.c_str(), &end, 10);
+				if (e.empty() || *end || epoch > 2047)
+				{
+					cerr << "Bad " << arg << " option: " << argv[i] << endl;
+					BOOST_THROW_EXCEPTION(BadArgument());
+				}
+				m_benchmarkEpochs.push_back((unsigned)epoch);
+			}
+		}
+		else if (arg == "--benchmark-json" && i + 1 < argc)
+			m_benchmarkJson = argv[++i];
+		else if (arg == "--benchmark-csv" && i + 1 < argc)
+			m_benchmarkCsv = argv[++i];
+		else if (arg == "--benchmark-baseline" && i + 1 < argc)
+			m_benchmarkBaseline = argv[++i];
+		else if (arg == "--benchmark-dag")
+		{
+			mode = OperationMode::Benchmark;
+			m_benchmarkDag = true;
+		}
+		else if (arg == "--benchmark-host")
+		{
+			mode = OperationMode::Benchmark;
+			m_benchmarkHost = true;
+		}
+		else if (arg == "--validate")
+			mode = OperationMode::Validate;
+		else if ((arg == "--validate-trial" || arg == "--validate-difficulty") && i + 1 < argc)
+		{
+			unsigned long value = 0;
+			try {
+				value = stoul(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			if (!value || (arg == "--validate-difficulty" && value > 40))
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
+			(arg == "--validate-trial" ? m_validateTrial : m_validateDifficulty) = (unsigned)value;
+		}
+		else if (arg == "-G" || arg == "--opencl")
+			m_minerType = MinerType::CL;
+		else if (arg == "-U" || arg == "--cuda")
+		{
+			m_minerType = MinerType::CUDA;
+		}
+		else if (arg == "-X" || arg == "--cuda-opencl")
+		{
+			m_minerType = MinerType::Mixed;
+		}
+		else if (arg == "--cpu")
+		{
+			m_minerType = MinerType::CPU;
+		}
+
+#if ETH_ETHASHOCL
+		else if (arg == "--fpga" || arg == "--opencl")
+		{
+			m_minerType = MinerType::Fpga;
+		}
+		else if (arg == "--fpga-pipelines" && i + 1 < argc)
+		{
+			try
+			{
+				m_fpgaPipelines = stol(argv[++i]);
+			}
+			catch (...)
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				BOOST_THROW_EXCEPTION(BadArgument());
+			}
 		}
+		else if (arg == "--fpga-host-dag")
+		{
+			m_fpgaHostDag = true;
+		}
+		else if (arg == "--fpga-bitstreams" && i + 1 < argc)
+			m_fpgaBitstreams = argv[++i];
 #endif
 		else if (arg == "-M" || arg == "--benchmark")
 		{
@@ -546,6 +1040,10 @@ public:
 #if ETH_ETHASHOCL
 			if (m_minerType == MinerType::Fpga || m_minerType == MinerType::Mixed)
 				OCLMiner::listDevices();
+#endif
+#if ETH_ETHASHCPU
+			if (m_minerType == MinerType::CPU)
+				CPUMiner::listDevices();
 #endif
 			if (m_quit) {
 				exit(0);
@@ -564,6 +1062,18 @@ public:
 
 			CLMiner::setCLKernel(m_openclSelectedKernel);
 			CLMiner::setThreadsPerHash(m_openclThreadsPerHash);
+			CLMiner::setHashesPerThread(m_openclHashesPerThread);
+			CLMiner::setKernelDirectory(m_openclKernelDirectory);
+			// The benchmark reports the kernels' share of device time.
+			CLMiner::setProfiling(m_openclProfiling || mode == OperationMode::Benchmark);
+			CLMiner::setInitBudget(uint64_t(m_openclInitBudget) << 20);
+			CLMiner::setPipelineDepth(m_openclPipelineDepth);
+			CLMiner::setVerifyEvery(m_openclVerifyEvery);
+			CLMiner::setPersistentRounds(m_openclPersistentRounds);
+			CLMiner::setKernelTarget(m_openclKernelTargetMs);
+			CLMiner::setDagGlobalWorkSizeMultiplier(m_dagGlobalWorkSizeMultiplier);
+			CLMiner::setDagPrebuild(m_dagPrebuild);
+			CLMiner::setDualDag(m_dualDag);
 
 			if (!CLMiner::configureGPU(
 					m_localWorkSize,
@@ -590,6 +1100,9 @@ public:
 			}
 
 			CUDAMiner::setNumInstances(m_miningThreads);
+			CUDAMiner::setInstancesPerDevice(m_cudaInstancesPerDevice);
+			CUDAMiner::setHostDag(m_cudaHostDag);
+			CUDAMiner::setDualDag(m_dualDag);
 			if (!CUDAMiner::configureGPU(
 				m_cudaBlockSize,
 				m_cudaGridSize,
@@ -602,6 +1115,13 @@ public:
 				exit(1);
 
 			CUDAMiner::setParallelHash(m_parallelHash);
+			CUDAMiner::setGraphSearches(m_cudaGraphSearches);
+			CUDAMiner::setDagHeadroom(m_cudaDagHeadroom);
+			CUDAMiner::setRuntimeCompile(m_cudaRuntimeCompile);
+			// The pool's threads cannot block on the streams.
+			CUDAMiner::setEventCollection(m_cudaEventCollect || m_hostThreads);
+			CUDAMiner::setAutoTune(m_cudaAutoTune);
+			CUDAMiner::setL2Persist(m_cudaL2Persist);
 #else
 			cerr << "CUDA support disabled. Configure project build with -DETHASHCUDA=ON" << endl;
 			exit(1);
@@ -619,6 +1139,9 @@ public:
 
 			OCLMiner::setCLKernel(m_openclSelectedKernel);
 			OCLMiner::setThreadsPerHash(m_openclThreadsPerHash);
+			OCLMiner::setPipelines(m_fpgaPipelines);
+			OCLMiner::setHostDag(m_fpgaHostDag);
+			OCLMiner::setBitstreams(m_fpgaBitstreams);
 
 			if (!OCLMiner::configureGPU(
 				m_localWorkSize,
@@ -636,7 +1159,23 @@ public:
 #endif
 		}
 
-		if (mode == OperationMode::Benchmark)
+		if (m_minerType == MinerType::CPU)
+		{
+#if ETH_ETHASHCPU
+			CPUMiner::setNumInstances(m_miningThreads);
+#else
+			cerr << "CPU support disabled. Configure project build with -DETHASHCPU=ON" << endl;
+			exit(1);
+#endif
+		}
+
+		Worker::setPoolThreads(hostThreads());
+
+		if (mode == OperationMode::Benchmark && m_benchmarkDag)
+			doBenchmarkDag(m_minerType);
+		else if (mode == OperationMode::Benchmark && m_benchmarkHost)
+			doBenchmarkHost(m_minerType, m_benchmarkWarmup, m_benchmarkTrial * m_benchmarkTrials);
+		else if (mode == OperationMode::Benchmark)
 			doBenchmark(m_minerType, m_benchmarkWarmup, m_benchmarkTrial, m_benchmarkTrials);
 		else if (mode == OperationMode::Farm)
 			doFarm(m_minerType, m_activeFarmURL, m_farmRecheckPeriod);
@@ -644,6 +1183,10 @@ public:
 			doSimulation(m_minerType);
 		else if (mode == OperationMode::Stratum)
 			doStratum();
+		else if (mode == OperationMode::Replay)
+			doReplay();
+		else if (mode == OperationMode::Validate)
+			doValidate(m_minerType);
 	}
 
 	static void streamHelp(ostream& _out)
@@ -659,29 +1202,65 @@ public:
 			<< "    -FO, --failover-userpass <username.workername:password> Failover stratum login credentials (optional, will use normal credentials when omitted)" << endl
 			<< "    --work-timeout <n> reconnect/failover after n seconds of working on the same (stratum) job. Defaults to 180. Don't set lower than max. avg. block time" << endl
 			<< "    -SC, --stratum-client <n>  Stratum client version. Defaults to 1 (async client). Use 2 to use the new synchronous client." << endl
+			<< "    --stratum-hot-standby  Keep the failover pool connected and authorized next to the primary one, and switch to its latest job as soon as the primary fails (client 1 only)." << endl
+			<< "    --stratum-tls  Speak TLS to the pools, resuming the last session on reconnects (client 1 only)." << endl
+			<< "    --stratum-tls-noverify  Speak TLS to the pools without checking their certificates." << endl
+			<< "    --stratum-candidates <host:port,...>  Probe these other endpoints of the primary pool every minute and move to the one answering fastest (client 1 only)." << endl
+			<< "    --stratum-proxy <port>  Serve other rigs EthereumStratum/1.0 on port over this miner's pool connection, each with its own extranonce byte (client 1 and -SP 2 only)." << endl
+			<< "    --stratum-proxy-bind <address>  Address the stratum proxy listens on. Default=127.0.0.1, 0.0.0.0 for all." << endl
+			<< "    --stratum-record <prefix>  Write each stratum session with the time of every line to <prefix>.<n>.log, for --stratum-replay (client 1 only)." << endl
+			<< "    --stratum-replay <file>  Mine against a local pool playing a recorded session, then report which shares it would have taken and the latencies from job to share." << endl
+			<< "    --replay-speed <x>  Play the recorded session x times as fast (default: 1)." << endl
 			<< "    -SP, --stratum-protocol <n> Choose which stratum protocol to use:" << endl
 			<< "        0: official stratum spec: ethpool, ethermine, coinotron, mph, nanopool (default)" << endl
 			<< "        1: eth-proxy compatible: dwarfpool, f2pool, nanopool (required for hashrate reporting to work with nanopool)" << endl
 			<< "        2: EthereumStratum/1.0.0: nicehash" << endl
+			<< "        3: EthereumStratum/2.0.0: compact messages, sessions resumed after reconnects" << endl
 			<< "    -RH, --report-hashrate Report current hashrate to pool (please only enable on pools supporting this)" << endl
 			<< "    -HWMON Displays gpu temp and fan percent." << endl
+			<< "    --hwmon-interval <n> Read the gpu monitors every n ms, on a thread of their own (default: 1000, at least 100)." << endl
+			<< "    --host-threads <n> Drive all gpus from a pool of n threads, woken by the searches completing, rather than a thread per gpu. With CUDA, implies --cuda-schedule events. Raised to a thread per miner with -L sequential or single, or --cuda-instances-per-gpu over 1, whose DAG loads wait on one another" << endl
+			<< "    --affinity Pin each gpu's miner thread to a CPU of the NUMA node the gpu is attached to, its host buffers in that node's memory (Linux)." << endl
+			<< "    --stratum-cpus <list> Pin the networking thread to the CPUs in list, e.g. 0 or 0-1,8 (Linux)." << endl
+			<< "    --verify-cpus <list> Pin the threads computing the light caches, which the solutions are verified with, to the CPUs in list (Linux)." << endl
+			<< "    --target-temp <n> Have each gpu idle part of the time to stay at or under n degrees C." << endl
+			<< "    --target-power <n> Have each gpu idle part of the time to draw at most n W, where its driver tells the power." << endl
 			<< "    -SE, --stratum-email <s> Email address used in eth-proxy (optional)" << endl
 			<< "    --farm-recheck <n>  Leave n ms between checks for changed work (default: 500). When using stratum, use a high value (i.e. 2000) to get more stable hashrate output" << endl
+			<< "    --farm-ipc <path>  Take work from the node's IPC socket, e.g. geth.ipc, as soon as a new head arrives instead of polling -F. Solutions and hashrate still go to -F." << endl
+			<< "    --watchdog <n>  Re-initialise a device that hashed nothing for n seconds, or ran at under half its usual rate for 3n seconds. 0 disables it (default: 60)." << endl
+			<< "    --invalid-limit <percent>  Flag a device once over this percent of its recent solutions fail verification or are rejected though not stale, and act on it. 0 only counts them (default: 0)." << endl
+			<< "    --invalid-action <throttle|reinit>  What to do to such a device: idle it more of the time each time, re-initialising it after three, or re-initialise it at once (default: throttle)." << endl
 			<< endl
 			<< "Benchmarking mode:" << endl
 			<< "    -M [<n>],--benchmark [<n>] Benchmark for mining and exit; Optionally specify block number to benchmark against specific DAG." << endl
 			<< "    --benchmark-warmup <seconds>  Set the duration of warmup for the benchmark tests (default: 3)." << endl
 			<< "    --benchmark-trial <seconds>  Set the duration for each trial for the benchmark tests (default: 3)." << endl
 			<< "    --benchmark-trials <n>  Set the number of benchmark trials to run (default: 5)." << endl
+			<< "    --benchmark-epochs <n,...>  Benchmark each device on each of these epochs in turn, instead of the block of -M." << endl
+			<< "    --benchmark-json <file>  Write the runs, with their trials, statistics and settings, to this file as JSON." << endl
+			<< "    --benchmark-csv <file>  Write one line per device and epoch to this file as CSV." << endl
+			<< "    --benchmark-baseline <file>  Compare to the JSON of an earlier benchmark of the same devices; exit with 2 if a device's 95% interval falls wholly below its baseline's." << endl
+			<< "    --validate  Run every kernel variant of each device on each --benchmark-epochs epoch at an easy target, check all hits on the CPU and exit, with 2 if any was wrong. --benchmark-json writes the runs." << endl
+			<< "    --validate-trial <seconds>  Time each variant mines (default: 10)." << endl
+			<< "    --validate-difficulty <n>  2^n hashes per hit on average, so that there are thousands (default: 18)." << endl
+			<< "    --benchmark-dag  Instead of hashing, time each device getting the DAG of each --benchmark-epochs epoch, stage by stage, then the host DAG engine; with a CUDA rig of several devices also their copies (peer-to-peer or through the host) of one device's DAG. --benchmark-json writes the stages." << endl
+			<< "    --benchmark-host  Instead of the hashrate, measure the host loop of each OpenCL or CUDA device: host time per launch and the share of the time the device waits between launches, as configured, without reading the results back, with one-workgroup (one-block grid) launches, and with 1, 2 and 4 searches in flight. Trials as for -M; --benchmark-json writes the runs." << endl
 			<< "Simulation mode:" << endl
 			<< "    -Z [<n>],--simulation [<n>] Mining test mode. Used to validate kernel optimizations. Optionally specify block number." << endl
 			<< "Mining configuration:" << endl
 			<< "    -G,--opencl  When mining use the GPU via OpenCL." << endl
 #if ETH_ETHASHOCL
 			<< "       --fpga  When mining use the FPGA Accelerator via OpenCL." << endl
+			<< "       --fpga-pipelines <n>  Drive n search kernel instances at once, each with its own queue. Default is one per compute unit of every search kernel in the .aocx" << endl
+			<< "       --fpga-host-dag  Build the DAG on the host CPU (or map its epoch file from --dag-dir) and stream it to the board instead of generating it with the bitstream." << endl
+			<< "       --fpga-bitstreams <file>  Registry of .aocx images, one '<file> <min DAG MB> <max DAG MB> [<board name>]' line each. The best match for the board and DAG is used, else '<board name>.aocx', else 'kernel.aocx' (default: bitstreams.txt). Boards are only reprogrammed when the image changes." << endl
 #endif
 			<< "    -U,--cuda  When mining use the GPU via CUDA." << endl
 			<< "    -X,--cuda-opencl Use OpenCL + CUDA in a system with mixed AMD/Nvidia cards. May require setting --opencl-platform 1" << endl
+#if ETH_ETHASHCPU
+			<< "    --cpu  When mining use the CPU against a host DAG, one thread per core (limit with -t)." << endl
+#endif
 			<< "    --opencl-platform <n>  When mining using -G/--opencl use OpenCL platform n (default: 0)." << endl
 			<< "    --opencl-device <n>  When mining using -G/--opencl use OpenCL device n (default: 0)." << endl
 			<< "    --opencl-devices <0 1 ..n> Select which OpenCL devices to mine on. Default is to use all" << endl
@@ -691,15 +1270,33 @@ public:
 			<< "        parallel    - load DAG on all GPUs at the same time (default)" << endl
 			<< "        sequential  - load DAG on GPUs one after another. Use this when the miner crashes during DAG generation" << endl
 			<< "        single <n>  - generate DAG on device n, then copy to other devices" << endl
+			<< "    --dag-dir <dir> Directory for the host DAG epoch files (default: ~/.ethash). Use \"\" to keep host DAGs in memory only" << endl
+			<< "    --shared-dag    Keep light caches and host DAGs in shared memory, built by the first of several ethminer processes on this machine and attached read-only by the rest" << endl
+			<< "    --host-memory <MB> Budget for the host DAGs, light caches and DAG staging buffers: the light cache of the next epoch is not precomputed, unused host DAGs are dropped and DAG copies between devices go through a ring of pinned memory to stay within it (default: 0, no limit)" << endl
+			<< "    --start-epoch <n|off> With a pool, build the light cache and DAGs of epoch n while connecting, so its first job is hashed right away (default: the epoch of the last run, as kept in --dag-dir)" << endl
+			<< "    --dual-dag      Keep the DAG of the previous epoch on each gpu that has the memory for two, so that switching back to it (e.g. between pools of different coins) takes no regeneration" << endl
+			<< "    --dag-verify <n> Every n s, read back a few random DAG items from each gpu and check them against the CPU's, at low priority; the chunks of corrupt items are regenerated (default: off)" << endl
+			<< "    --probe-difficulty <n> Also count the hashes under a target of n million hashes per hit as pseudo-shares, for an effective hashrate of each gpu independent of pool luck; one a second is checked on the CPU (default: off)" << endl
 #if ETH_ETHASHCL
 			<< " OpenCL configuration:" << endl
 			<< "    --cl-kernel <n>  Use a different OpenCL kernel (default: use stable kernel)" << endl
 			<< "        0: stable kernel" << endl
 			<< "        1: unstable kernel" << endl
 //			<< "        2: experimental kernel" << endl
+			<< "        3: the fastest on each device, timed once and then kept in the DAG directory" << endl
+			<< "    --cl-kernel-dir <dir> Prebuilt binaries the custom kernel is loaded from first, as <device name>[-<driver version>].bin. Default=kernels" << endl
 			<< "    --cl-local-work Set the OpenCL local work size. Default is " << CLMiner::c_defaultLocalWorkSize << endl
 			<< "    --cl-global-work Set the OpenCL global work size as a multiple of the local work size. Default is " << CLMiner::c_defaultGlobalWorkSizeMultiplier << " * " << CLMiner::c_defaultLocalWorkSize << endl
+			<< "    --cl-dag-global-work Set the global work size of the DAG generation chunks as a multiple of the local work size. Default is that of the search" << endl
+			<< "    --cl-dag-prebuild <n> Generate the next epoch's DAG into a second buffer, one chunk after every n searches, if the device has the memory. 0 never does. Default=0" << endl
+			<< "    --cl-init-budget <MB> At most this much DAG is generated at once over all devices, one device always goes ahead. 0 for no bound. Default=0" << endl
 			<< "    --cl-parallel-hash <1 2 ..8> Define how many threads to associate per hash. Default=8" << endl
+			<< "    --cl-hashes-per-thread <1 2 4 8> Hashes the stable kernel mixes at once per group of threads, for more memory loads in flight. Default=1" << endl
+			<< "    --cl-pipeline <1..8> Searches kept in flight per device, read back while the next ones run. Default=2" << endl
+			<< "    --cl-persistent <n> Search n global work sizes of nonces per kernel launch, leaving early on new work. 0 or 1 launches one per search. Default=0" << endl
+			<< "    --cl-kernel-ms <n> Adapt each device's global work size so that a search takes about n ms, starting from --cl-global-work (e.g. 50). 0 keeps it fixed. Default=0" << endl
+			<< "    --cl-profile Time the kernels on the device, for the miner_getkernelprofile API method" << endl
+			<< "    --cl-verify <n> Also evaluate every n-th solution on the CPU before submitting it. 0 never does. Default=0" << endl
 #endif
 #if ETH_ETHASHCUDA
 			<< " CUDA configuration:" << endl
@@ -711,24 +1308,59 @@ public:
 			<< "        spin  - Instruct CUDA to actively spin when waiting for results from the device." << endl
 			<< "        yield - Instruct CUDA to yield its thread when waiting for results from the device." << endl
 			<< "        sync  - Instruct CUDA to block the CPU thread on a synchronization primitive when waiting for the results from the device." << endl
+			<< "        events - Like sync, but one thread waits for the searches of all devices and the miner threads sleep meanwhile. For many GPUs on a weak CPU." << endl
 			<< "    --cuda-devices <0 1 ..n> Select which CUDA GPUs to mine on. Default is to use all" << endl
+			<< "    --cuda-graph <n> Launch n searches at once per stream as a CUDA graph. 0 or 1 launches them one by one. Default=0" << endl
+			<< "    --cuda-dag-headroom <n> Allocate the DAG with room for n more epochs, so epoch changes reuse it. Default=4" << endl
+			<< "    --cuda-rtc Compile the search kernel at run time for each epoch, with the DAG size built in. Cached next to the DAG files. Needs a build with NVRTC" << endl
+			<< "    --cuda-auto-tune Measure the grid and block size, streams and parallel hashes of each GPU after its first DAG load, instead of using the options. Kept per GPU next to the DAG files; delete cuda-tune-*.txt to tune again" << endl
+			<< "    --cuda-host-dag Mine on GPUs with less memory than the DAG, reading the part that does not fit from host memory. Much slower on those GPUs" << endl
+			<< "    --cuda-l2-persist Keep the light cache in the persisting L2 while generating the DAG, on GPUs that have one (Ampere and newer)" << endl
+			<< "    --cuda-instances-per-gpu <1 2 ..4> Run n miners, with their own streams and nonces, on each GPU sharing one DAG. Default=1" << endl
 			<< "    --cuda-parallel-hash <1 2 ..8> Define how many hashes to calculate in a kernel, can be scaled to achieve better performance. Default=4" << endl
 #endif
 #if API_CORE
 			<< " API core configuration:" << endl
 			<< "    --api-port Set the api port, the miner should listen to. Use 0 to disable. Default=0, use negative numbers to run in readonly mode. for example -3333." << endl
+			<< "    --metrics-port Serve Prometheus metrics over HTTP at this port, at /metrics. Default=0 (off)." << endl
+			<< "    --stats-port Push the stats to subscribers at this port, as newline-delimited JSON with only the changes after the first line. Default=0 (off)." << endl
+			<< "    --stats-interval Milliseconds between the stats pushed. Default=1000, at least 100." << endl
 #endif
 			;
 	}
 
 private:
 
+	/// --host-threads, but a thread for every pooled miner when their DAG
+	/// loads wait for one another's: sequential and single loads, and the
+	/// instances of a gpu handing its DAG over. A pool thread blocked on a
+	/// miner that needs another to make progress would hang them.
+	unsigned hostThreads() const
+	{
+		bool waits = m_dagLoadMode != DAG_LOAD_MODE_PARALLEL;
+		unsigned miners = 0;
+#if ETH_ETHASHCL
+		if (m_minerType == MinerType::CL || m_minerType == MinerType::Mixed)
+			miners += CLMiner::instances();
+#endif
+#if ETH_ETHASHCUDA
+		if (m_minerType == MinerType::CUDA || m_minerType == MinerType::Mixed)
+		{
+			miners += CUDAMiner::instances();
+			waits = waits || m_cudaInstancesPerDevice > 1;
+		}
+#endif
+		if (!m_hostThreads || !waits || m_hostThreads >= miners)
+			return m_hostThreads;
+		cwarn << "--host-threads " << m_hostThreads << " raised to " << miners
+			  << ": with this DAG load mode the miners wait on one another while loading";
+		return miners;
+	}
+
 	void doBenchmark(MinerType _m, unsigned _warmupDuration = 15, unsigned _trialDuration = 3, unsigned _trials = 5)
 	{
-		BlockHeader genesis;
-		genesis.setNumber(m_benchmarkBlock);
-		genesis.setDifficulty(1 << 18);
-		cdebug << genesis.boundary();
+		if (m_benchmarkEpochs.empty())
+			m_benchmarkEpochs.push_back(m_benchmarkBlock / ETHASH_EPOCH_LENGTH);
 
 		Farm f;
 		f.set_pool_addresses(m_farmURL, m_port, m_farmFailOverURL, m_fport);
@@ -738,53 +1370,607 @@ private:
 #endif
 #if ETH_ETHASHCUDA
 		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
 #endif
 		f.setSealers(sealers);
 		f.onSolutionFound([&](Solution) { return false; });
 
-		string platformInfo = _m == MinerType::CL ? "CL" : "CUDA";
-		cout << "Benchmarking on platform: " << platformInfo << endl;
+		BenchmarkReport report;
+		report.version = ETH_PROJECT_VERSION;
+		report.platform = _m == MinerType::CL ? "CL" : _m == MinerType::CPU ? "CPU" : "CUDA";
+		time_t const started = time(nullptr);
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&started));
+		report.started = stamp;
+		report.warmup = _warmupDuration;
+		report.trial = _trialDuration;
+		report.trials = _trials;
+		cout << "Benchmarking on platform: " << report.platform << endl;
+
+		bool running = false;
+		for (unsigned epoch: m_benchmarkEpochs)
+		{
+			// The same header on every run, only the epoch differs.
+			BlockHeader genesis;
+			genesis.setNumber(epoch * ETHASH_EPOCH_LENGTH);
+			genesis.setDifficulty(u256(1) << 63);
+			cout << "Preparing DAG for epoch " << epoch << " (block #" << epoch * ETHASH_EPOCH_LENGTH << ")" << endl;
+
+			vector<uint64_t> before = f.minerHashTotals();
+			auto const workSet = chrono::steady_clock::now();
+			if (!running)
+			{
+				if (_m == MinerType::CL)
+					f.start("opencl", false);
+				else if (_m == MinerType::CUDA)
+					f.start("cuda", false);
+				else if (_m == MinerType::CPU)
+					f.start("cpu", false);
+				running = true;
+			}
+			f.setWork(WorkPackage{genesis});
 
-		cout << "Preparing DAG for block #" << m_benchmarkBlock << endl;
-		//genesis.prep();
+			vector<double> const readyMs = waitReady(f, before, workSet);
+
+			cout << "Warming up..." << endl;
+			this_thread::sleep_for(chrono::seconds(_warmupDuration));
+
+			vector<vector<double>> rates(readyMs.size());
+			for (unsigned i = 1; i <= _trials; ++i)
+			{
+				cout << "Trial " << i << "... " << flush;
+				vector<uint64_t> const start = f.minerHashTotals();
+				auto const from = chrono::steady_clock::now();
+				this_thread::sleep_for(chrono::seconds(_trialDuration));
+				vector<uint64_t> const end = f.minerHashTotals();
+				double const seconds = chrono::duration<double>(chrono::steady_clock::now() - from).count();
+				double total = 0;
+				for (size_t d = 0; d < rates.size(); ++d)
+				{
+					double const rate = d < start.size() && d < end.size() ? (end[d] - start[d]) / seconds : 0;
+					rates[d].push_back(rate);
+					total += rate;
+				}
+				cout << uint64_t(total) << endl;
+			}
+
+			f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+			{
+				if (_index >= rates.size())
+					return;
+				BenchmarkRun r;
+				r.epoch = epoch;
+				r.device = _index;
+				r.name = _miner.Name();
+				r.tuning = _miner.tuning();
+				r.readyMs = readyMs[_index];
+				DagProgress const dag = _miner.dagProgress();
+				r.dagMs = dag.size && dag.done == dag.size ? dag.ms : 0;
+				r.rates = rates[_index];
+				r.profile = _miner.kernelProfile();
+				report.runs.push_back(r);
+			});
+		}
+		f.stop();
+
+		cout << endl;
+		report.print(cout);
+		if (!m_benchmarkJson.empty())
+		{
+			ofstream out(m_benchmarkJson);
+			out << Json::StyledWriter().write(report.toJson());
+			if (!out)
+				cerr << "Cannot write " << m_benchmarkJson << endl;
+		}
+		if (!m_benchmarkCsv.empty())
+		{
+			ofstream out(m_benchmarkCsv);
+			out << report.toCsv();
+			if (!out)
+				cerr << "Cannot write " << m_benchmarkCsv << endl;
+		}
+		if (!m_benchmarkBaseline.empty())
+		{
+			ifstream in(m_benchmarkBaseline);
+			Json::Value baseline;
+			if (!Json::Reader().parse(in, baseline))
+			{
+				cerr << "Cannot read the baseline " << m_benchmarkBaseline << endl;
+				exit(1);
+			}
+			if (report.regressions(baseline, cout))
+				exit(2);
+		}
+
+		exit(0);
+	}
+
+	/// Each device is ready once it hashes more than @a _before, the totals
+	/// when the work was set at @a _workSet. @returns the ms each took, -1
+	/// for those not ready within c_benchmarkReadyTimeout.
+	static vector<double> waitReady(Farm& _f, vector<uint64_t> _before, chrono::steady_clock::time_point _workSet)
+	{
+		vector<double> readyMs;
+		for (unsigned waited = 0; waited < c_benchmarkReadyTimeout * 10; ++waited)
+		{
+			vector<uint64_t> const totals = _f.minerHashTotals();
+			_before.resize(totals.size(), 0);
+			readyMs.resize(totals.size(), -1);
+			double const ms = chrono::duration<double, milli>(chrono::steady_clock::now() - _workSet).count();
+			bool all = !totals.empty();
+			for (size_t i = 0; i < totals.size(); ++i)
+				if (readyMs[i] < 0 && totals[i] > _before[i])
+					readyMs[i] = ms;
+				else if (readyMs[i] < 0)
+					all = false;
+			if (all)
+				break;
+			this_thread::sleep_for(chrono::milliseconds(100));
+		}
+		return readyMs;
+	}
+
+	void doBenchmarkDag(MinerType _m)
+	{
+		if (m_benchmarkEpochs.empty())
+			m_benchmarkEpochs.push_back(m_benchmarkBlock / ETHASH_EPOCH_LENGTH);
+
+		Farm f;
+		f.set_pool_addresses(m_farmURL, m_port, m_farmFailOverURL, m_fport);
+		map<string, Farm::SealerDescriptor> sealers;
+#if ETH_ETHASHCL
+		sealers["opencl"] = Farm::SealerDescriptor{&CLMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CLMiner(_farm, _index); }};
+#endif
+#if ETH_ETHASHOCL
+		sealers["fpga"] = Farm::SealerDescriptor{ &OCLMiner::instances, [](FarmFace& _farm, unsigned _index) { return new OCLMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCUDA
+		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
+#endif
+		f.setSealers(sealers);
+		f.onSolutionFound([&](Solution) { return false; });
+		string const sealer = _m == MinerType::Fpga ? "fpga" : _m == MinerType::CUDA ? "cuda" : _m == MinerType::CPU ? "cpu" : "opencl";
+
+		DagBenchmarkReport report;
+		report.version = ETH_PROJECT_VERSION;
+		report.platform = _m == MinerType::Fpga ? "FPGA" : _m == MinerType::CUDA ? "CUDA" : _m == MinerType::CPU ? "CPU" : "CL";
+		time_t const started = time(nullptr);
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&started));
+		report.started = stamp;
+		cout << "Benchmarking the DAG on platform: " << report.platform << endl;
+
+		// Several devices can also take one device's DAG instead of each
+		// generating its own: a second pass, from a fresh start, copies it.
+		vector<unsigned> modes{m_dagLoadMode};
+#if ETH_ETHASHCUDA
+		if (_m == MinerType::CUDA && m_dagLoadMode != DAG_LOAD_MODE_SINGLE && CUDAMiner::instances() > 1)
+			modes.push_back(DAG_LOAD_MODE_SINGLE);
+#endif
+#if ETH_ETHASHCL
+		if (_m == MinerType::CL && m_dagLoadMode != DAG_LOAD_MODE_SINGLE && CLMiner::instances() > 1)
+			modes.push_back(DAG_LOAD_MODE_SINGLE);
+#endif
+		for (unsigned loadMode: modes)
+		{
+			string const modeName = loadMode == DAG_LOAD_MODE_SINGLE ? "single" : loadMode == DAG_LOAD_MODE_SEQUENTIAL ? "sequential" : "parallel";
+			Miner::setDagLoadMode(loadMode);
+			f.start(sealer, false);
+			for (unsigned epoch: m_benchmarkEpochs)
+			{
+				BlockHeader genesis;
+				genesis.setNumber(epoch * ETHASH_EPOCH_LENGTH);
+				genesis.setDifficulty(u256(1) << 63);
+				WorkPackage work(genesis);
+				// New work even where the epoch is the last one's.
+				work.header = h256::random();
+				cout << "Loading the DAG of epoch " << epoch << " (" << modeName << ")" << endl;
+
+				vector<uint64_t> const before = f.minerHashTotals();
+				auto const workSet = chrono::steady_clock::now();
+				f.setWork(work);
+				vector<double> const readyMs = waitReady(f, before, workSet);
+
+				f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+				{
+					DagBenchmarkRun r;
+					r.epoch = epoch;
+					r.device = int(_index);
+					r.name = _miner.Name();
+					r.mode = modeName;
+					r.readyMs = _index < readyMs.size() ? readyMs[_index] : -1;
+					r.stages = _miner.dagStages(epoch);
+					report.runs.push_back(r);
+				});
+			}
+			f.stop();
+		}
+		Miner::setDagLoadMode(m_dagLoadMode);
+
+		// The CPU miners ran it already.
+		if (_m != MinerType::CPU)
+			for (unsigned epoch: m_benchmarkEpochs)
+			{
+				cout << "Generating the DAG of epoch " << epoch << " on the host" << endl;
+				h256 const seed = EthashAux::seedHash(epoch * ETHASH_EPOCH_LENGTH);
+				EthashAux::LightType const light = EthashAux::light(seed);
+				DagBenchmarkRun r;
+				r.epoch = epoch;
+				r.device = -1;
+				r.name = "host DAG engine";
+				r.mode = "-";
+				// Generated, not mapped from an epoch file or a shared segment.
+				string const dir = EthashAux::dagDirectory();
+				bool const shared = EthashAux::sharedMemory();
+				EthashAux::setDAGDirectory("");
+				EthashAux::setSharedMemory(false);
+				try
+				{
+					auto const start = chrono::steady_clock::now();
+					EthashAux::FullAllocation full(seed, light);
+					DagStage stage;
+					stage.name = "host";
+					stage.bytes = full.size;
+					stage.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+					r.stages.push_back(stage);
+				}
+				catch (std::exception const& _e)
+				{
+					cwarn << "Cannot generate the host DAG:" << _e.what();
+				}
+				EthashAux::setDAGDirectory(dir);
+				EthashAux::setSharedMemory(shared);
+				report.runs.push_back(r);
+			}
 
+		cout << endl;
+		report.print(cout);
+		if (!m_benchmarkJson.empty())
+		{
+			ofstream out(m_benchmarkJson);
+			out << Json::StyledWriter().write(report.toJson());
+			if (!out)
+				cerr << "Cannot write " << m_benchmarkJson << endl;
+		}
+		exit(0);
+	}
+
+	void doBenchmarkHost(MinerType _m, unsigned _warmupDuration, unsigned _runDuration)
+	{
+		if (_m != MinerType::CL && _m != MinerType::CUDA)
+		{
+			cerr << "--benchmark-host needs -G or -U" << endl;
+			exit(1);
+		}
+		bool const cuda = _m == MinerType::CUDA;
+		// Each run's tuning, on top of the device's own.
+		vector<pair<string, MinerTuning>> configs{
+			{"baseline", MinerTuning()},
+			{"no-readback", MinerTuning{{"readback", 0}}},
+			{"null-work", MinerTuning{{cuda ? "grid" : "global_work", 1}}}};
+		for (unsigned depth: {1u, 2u, 4u})
+			configs.push_back(make_pair((cuda ? "streams " : "pipeline ") + toString(depth), MinerTuning{{cuda ? "streams" : "pipeline", depth}}));
+
+		Farm f;
+		f.set_pool_addresses(m_farmURL, m_port, m_farmFailOverURL, m_fport);
+		map<string, Farm::SealerDescriptor> sealers;
+#if ETH_ETHASHCL
+		sealers["opencl"] = Farm::SealerDescriptor{&CLMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CLMiner(_farm, _index); }};
+#endif
+#if ETH_ETHASHCUDA
+		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+		// Enough for the stream runs.
+		CUDAMiner::setStreamCapacity(4);
+#endif
+		f.setSealers(sealers);
+		f.onSolutionFound([&](Solution) { return false; });
+
+		HostBenchmarkReport report;
+		report.version = ETH_PROJECT_VERSION;
+		report.platform = cuda ? "CUDA" : "CL";
+		time_t const started = time(nullptr);
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&started));
+		report.started = stamp;
+		report.epoch = m_benchmarkBlock / ETHASH_EPOCH_LENGTH;
+		cout << "Benchmarking the host loop on platform: " << report.platform << endl;
+
+		BlockHeader genesis;
+		genesis.setNumber(m_benchmarkBlock);
 		genesis.setDifficulty(u256(1) << 63);
-		if (_m == MinerType::CL)
-			f.start("opencl", false);
-		else if (_m == MinerType::CUDA)
-			f.start("cuda", false);
+		vector<uint64_t> const before = f.minerHashTotals();
+		auto const workSet = chrono::steady_clock::now();
+		f.start(cuda ? "cuda" : "opencl", false);
 		f.setWork(WorkPackage{genesis});
+		waitReady(f, before, workSet);
+		cout << "Warming up..." << endl;
+		this_thread::sleep_for(chrono::seconds(_warmupDuration));
 
-		map<uint64_t, WorkingProgress> results;
-		uint64_t mean = 0;
-		uint64_t innerMean = 0;
-		for (unsigned i = 0; i <= _trials; ++i)
+		vector<MinerTuning> baseline;
+		f.forEachMiner([&](unsigned, Miner& _miner, HashRateStats const&, uint64_t) { baseline.push_back(_miner.tuning()); });
+		for (auto const& config: configs)
 		{
-			if (!i)
-				cout << "Warming up..." << endl;
-			else
-				cout << "Trial " << i << "... " << flush;
-			this_thread::sleep_for(chrono::seconds(i ? _trialDuration : _warmupDuration));
+			cout << "Running " << config.first << "... " << flush;
+			f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+			{
+				MinerTuning t = _index < baseline.size() ? baseline[_index] : MinerTuning();
+				for (auto const& p: config.second)
+					t[p.first] = p.second;
+				string error;
+				if (!_miner.tune(t, error))
+				{
+					cwarn << _miner.Name() << ": " << error;
+				}
+			});
+			// Taken up between launches, with a new kernel at worst.
+			this_thread::sleep_for(chrono::milliseconds(c_hostBenchmarkSettle * 1000));
+
+			vector<HostLoopStats> loops;
+			f.forEachMiner([&](unsigned, Miner& _miner, HashRateStats const&, uint64_t) { loops.push_back(_miner.hostLoop()); });
+			vector<uint64_t> const start = f.minerHashTotals();
+			auto const from = chrono::steady_clock::now();
+			this_thread::sleep_for(chrono::seconds(_runDuration));
+			vector<uint64_t> const end = f.minerHashTotals();
+			double const seconds = chrono::duration<double>(chrono::steady_clock::now() - from).count();
+			double total = 0;
+			f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+			{
+				if (_index >= loops.size() || _index >= start.size() || _index >= end.size())
+					return;
+				HostLoopStats const now = _miner.hostLoop();
+				HostBenchmarkRun r;
+				r.device = int(_index);
+				r.name = _miner.Name();
+				r.config = config.first;
+				r.tuning = _miner.tuning();
+				r.seconds = seconds;
+				r.rate = (end[_index] - start[_index]) / seconds;
+				r.loop.launches = now.launches - loops[_index].launches;
+				r.loop.hostNs = now.hostNs - loops[_index].hostNs;
+				r.loop.idleNs = now.idleNs - loops[_index].idleNs;
+				total += r.rate;
+				report.runs.push_back(r);
+			});
+			cout << uint64_t(total) << endl;
+		}
+		f.stop();
+
+		cout << endl;
+		report.print(cout);
+		if (!m_benchmarkJson.empty())
+		{
+			ofstream out(m_benchmarkJson);
+			out << Json::StyledWriter().write(report.toJson());
+			if (!out)
+				cerr << "Cannot write " << m_benchmarkJson << endl;
+		}
+		exit(0);
+	}
 
-			auto mp = f.miningProgress();
-			if (!i)
-				continue;
-			auto rate = mp.rate();
+	/// The kernel variants --validate runs on a miner with the tuning() @a _t:
+	/// the OpenCL kernels, or else the parallel hashes, or else its only one.
+	static vector<pair<string, MinerTuning>> validationVariants(MinerTuning const& _t)
+	{
+		vector<pair<string, MinerTuning>> variants;
+		if (_t.count("kernel"))
+		{
+			// The custom kernel is the prebuilt binary where --cl-kernel-dir has one.
+			variants.push_back(make_pair(string("stable"), MinerTuning{{"kernel", 0}}));
+			variants.push_back(make_pair(string("unstable"), MinerTuning{{"kernel", 1}}));
+			variants.push_back(make_pair(string("custom"), MinerTuning{{"kernel", 2}}));
+		}
+		else if (_t.count("parallel_hash"))
+			for (unsigned hashes: {1u, 2u, 4u, 8u})
+				variants.push_back(make_pair("parallel_hash " + toString(hashes), MinerTuning{{"parallel_hash", hashes}}));
+		else
+			variants.push_back(make_pair(string("default"), MinerTuning()));
+		return variants;
+	}
+
+	void doValidate(MinerType _m)
+	{
+		if (m_benchmarkEpochs.empty())
+			m_benchmarkEpochs.push_back(m_benchmarkBlock / ETHASH_EPOCH_LENGTH);
+
+		Farm f;
+		f.set_pool_addresses(m_farmURL, m_port, m_farmFailOverURL, m_fport);
+		map<string, Farm::SealerDescriptor> sealers;
+#if ETH_ETHASHCL
+		sealers["opencl"] = Farm::SealerDescriptor{&CLMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CLMiner(_farm, _index); }};
+#endif
+#if ETH_ETHASHOCL
+		sealers["fpga"] = Farm::SealerDescriptor{ &OCLMiner::instances, [](FarmFace& _farm, unsigned _index) { return new OCLMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCUDA
+		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
+#endif
+		f.setSealers(sealers);
+		// Kept for checking them all at the end of each trial.
+		Mutex x_found;
+		vector<Solution> found;
+		f.onSolutionFound([&](Solution _s)
+		{
+			Guard l(x_found);
+			found.push_back(_s);
+			return false;
+		});
+
+		ValidationReport report;
+		report.version = ETH_PROJECT_VERSION;
+		report.platform = _m == MinerType::Fpga ? "FPGA" : _m == MinerType::CUDA ? "CUDA" : _m == MinerType::CPU ? "CPU" : "CL";
+		time_t const started = time(nullptr);
+		char stamp[32];
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&started));
+		report.started = stamp;
+		report.difficulty = std::ldexp(1.0, int(m_validateDifficulty));
+		report.trial = m_validateTrial;
+		cout << "Validating the kernels on platform: " << report.platform << endl;
+
+		f.start(_m == MinerType::Fpga ? "fpga" : _m == MinerType::CUDA ? "cuda" : _m == MinerType::CPU ? "cpu" : "opencl", false);
+		for (unsigned epoch: m_benchmarkEpochs)
+		{
+			BlockHeader genesis;
+			genesis.setNumber(epoch * ETHASH_EPOCH_LENGTH);
+			genesis.setDifficulty(u256(1) << m_validateDifficulty);
+			WorkPackage work(genesis);
+			work.header = h256::random();
+			cout << "Preparing DAG for epoch " << epoch << endl;
+			vector<uint64_t> const before = f.minerHashTotals();
+			auto const workSet = chrono::steady_clock::now();
+			f.setWork(work);
+			waitReady(f, before, workSet);
+
+			// Each device runs its variants in turn, side by side with the others.
+			vector<MinerTuning> original;
+			vector<vector<pair<string, MinerTuning>>> variants;
+			size_t rounds = 0;
+			f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+			{
+				original.resize(_index + 1);
+				variants.resize(_index + 1);
+				original[_index] = _miner.tuning();
+				variants[_index] = validationVariants(original[_index]);
+				rounds = max(rounds, variants[_index].size());
+			});
+
+			for (size_t v = 0; v < rounds; ++v)
+			{
+				vector<string> errors(variants.size());
+				f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+				{
+					if (_index < variants.size() && v < variants[_index].size())
+						_miner.tune(variants[_index][v].second, errors[_index]);
+				});
+				cout << "Variant " << v + 1 << " of " << rounds << "..." << endl;
+
+				// Applied between two launches, with the kernel rebuilt if need be.
+				vector<bool> applied(variants.size(), false);
+				for (unsigned waited = 0; waited < c_validateTuneTimeout * 10; ++waited)
+				{
+					bool all = true;
+					f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+					{
+						if (_index >= variants.size() || v >= variants[_index].size() || !errors[_index].empty())
+							return;
+						MinerTuning const t = _miner.tuning();
+						applied[_index] = true;
+						for (auto const& p: variants[_index][v].second)
+							applied[_index] = applied[_index] && t.count(p.first) && t.at(p.first) == p.second;
+						all = all && applied[_index];
+					});
+					if (all)
+						break;
+					this_thread::sleep_for(chrono::milliseconds(100));
+				}
+				// The searches launched before the switch are done.
+				this_thread::sleep_for(chrono::seconds(1));
+
+				vector<uint64_t> const start = f.minerHashTotals();
+				vector<uint64_t> failedBefore(variants.size(), 0);
+				vector<uint64_t> overflowsBefore(variants.size(), 0);
+				f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+				{
+					if (_index < variants.size())
+					{
+						failedBefore[_index] = _miner.failedSolutions();
+						overflowsBefore[_index] = _miner.searchResults().overflows;
+					}
+				});
+				{
+					Guard l(x_found);
+					found.clear();
+				}
+				auto const from = chrono::steady_clock::now();
+				this_thread::sleep_for(chrono::seconds(m_validateTrial));
+				vector<uint64_t> const end = f.minerHashTotals();
+				double const seconds = chrono::duration<double>(chrono::steady_clock::now() - from).count();
+				vector<Solution> hits;
+				{
+					Guard l(x_found);
+					hits.swap(found);
+				}
+
+				f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+				{
+					if (_index >= variants.size() || v >= variants[_index].size())
+						return;
+					ValidationRun r;
+					r.epoch = epoch;
+					r.device = _index;
+					r.name = _miner.Name();
+					r.variant = variants[_index][v].first;
+					if (!errors[_index].empty() || !applied[_index])
+					{
+						r.error = errors[_index].empty() ? "not applied within " + toString(c_validateTuneTimeout) + " s" : errors[_index];
+						report.runs.push_back(r);
+						return;
+					}
+					r.seconds = seconds;
+					r.rate = _index < start.size() && _index < end.size() ? (end[_index] - start[_index]) / seconds : 0;
+					r.failed = _miner.failedSolutions() - failedBefore[_index];
+					r.overflows = _miner.searchResults().overflows - overflowsBefore[_index];
+
+					// In one batch per job, on all cores.
+					map<h256, vector<Solution const*>> jobs;
+					for (Solution const& s: hits)
+						if (s.miner == _index)
+							jobs[s.work.header].push_back(&s);
+					auto const verifyStart = chrono::steady_clock::now();
+					for (auto const& j: jobs)
+					{
+						WorkPackage const& w = j.second.front()->work;
+						vector<uint64_t> nonces;
+						for (Solution const* s: j.second)
+							nonces.push_back(s->nonce);
+						vector<Result> const results = EthashAux::eval(w.seed, w.header, nonces);
+						for (size_t i = 0; i < results.size(); ++i)
+							if (results[i].mixHash != j.second[i]->mixHash || !(results[i].value < w.boundary))
+							{
+								++r.mismatches;
+								cwarn << "Wrong hit of" << r.name << r.variant << "on epoch" << epoch << ": nonce" << j.second[i]->nonce;
+							}
+						r.hits += nonces.size();
+					}
+					r.verifyMs = chrono::duration<double, milli>(chrono::steady_clock::now() - verifyStart).count();
+					report.runs.push_back(r);
+				});
+			}
 
-			cout << rate << endl;
-			results[rate] = mp;
-			mean += rate;
+			// Back to what the devices were set up with.
+			f.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const&, uint64_t)
+			{
+				if (_index >= variants.size())
+					return;
+				MinerTuning restore;
+				for (auto const& variant: variants[_index])
+					for (auto const& p: variant.second)
+						if (original[_index].count(p.first))
+							restore[p.first] = original[_index].at(p.first);
+				string error;
+				if (!restore.empty())
+					_miner.tune(restore, error);
+			});
 		}
 		f.stop();
-		int j = -1;
-		for (auto const& r: results)
-			if (++j > 0 && j < (int)_trials - 1)
-				innerMean += r.second.rate();
-		innerMean /= (_trials - 2);
-		cout << "min/mean/max: " << results.begin()->second.rate() << "/" << (mean / _trials) << "/" << results.rbegin()->second.rate() << " H/s" << endl;
-		cout << "inner mean: " << innerMean << " H/s" << endl;
 
-		exit(0);
+		cout << endl;
+		report.print(cout);
+		if (!m_benchmarkJson.empty())
+		{
+			ofstream out(m_benchmarkJson);
+			out << Json::StyledWriter().write(report.toJson());
+			if (!out)
+				cerr << "Cannot write " << m_benchmarkJson << endl;
+		}
+		exit(report.failures() ? 2 : 0);
 	}
 
 	void doSimulation(MinerType _m, int difficulty = 20)
@@ -802,10 +1988,13 @@ private:
 #endif
 #if ETH_ETHASHCUDA
 		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
 #endif
 		f.setSealers(sealers);
 
-		string platformInfo = _m == MinerType::CL ? "CL" : "CUDA";
+		string platformInfo = _m == MinerType::CL ? "CL" : _m == MinerType::CPU ? "CPU" : "CUDA";
 		cout << "Running mining simulation on platform: " << platformInfo << endl;
 
 		cout << "Preparing DAG for block #" << m_benchmarkBlock << endl;
@@ -817,6 +2006,8 @@ private:
 			f.start("opencl", false);
 		else if (_m == MinerType::CUDA)
 			f.start("cuda", false);
+		else if (_m == MinerType::CPU)
+			f.start("cpu", false);
 
 		int time = 0;
 
@@ -877,13 +2068,16 @@ private:
 #endif
 #if ETH_ETHASHCUDA
 		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index) { return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
 #endif
 		(void)_m;
 		(void)_remote;
 		(void)_recheckPeriod;
-		jsonrpc::HttpClient client(m_farmURL);
+		KeepAliveHttpClient client(m_farmURL);
 		::FarmClient rpc(client);
-		jsonrpc::HttpClient failoverClient(m_farmFailOverURL);
+		KeepAliveHttpClient failoverClient(m_farmFailOverURL);
 		::FarmClient rpcFailover(failoverClient);
 
 		FarmClient * prpc = &rpc;
@@ -893,10 +2087,13 @@ private:
 		f.set_pool_addresses(m_farmURL, m_port, m_farmFailOverURL, m_fport);
 
 #if API_CORE
-		Api api(this->m_api_port, f);
+		Api api(this->m_api_port, f, this->m_metrics_port, this->m_stats_port, this->m_stats_interval);
 #endif
 
 		f.setSealers(sealers);
+		f.setWatchdog(m_watchdogSeconds);
+		f.setInvalidLimit(m_invalidLimit, m_invalidAction);
+		f.setGovernor(int(m_targetTemp), m_targetPower);
 
 		if (_m == MinerType::CL) {
 			f.start("opencl", false);
@@ -904,25 +2101,87 @@ private:
 			f.start("cuda", false);
 		} else if (_m == MinerType::Fpga) {
 			f.start("fpga", false);
+		} else if (_m == MinerType::CPU) {
+			f.start("cpu", false);
 		} else if (_m == MinerType::Mixed) {
 			f.start("cuda", false);
 			f.start("opencl", true);
 			f.start("fpga", false);
 		}
 
+		// Solutions go straight from the miner threads to a submitter thread
+		// with its own connections, instead of waiting for the next poll.
+		MpscQueue<Solution> solutions;
+		std::atomic<bool> useFailover = { false };
+		f.onSolutionFound([&](Solution sol)
+		{
+			solutions.push(sol);
+			return true;
+		});
+		std::thread submitter([&]()
+		{
+			setThreadName("submit");
+			KeepAliveHttpClient submitClient(m_farmURL);
+			::FarmClient submitRpc(submitClient);
+			KeepAliveHttpClient submitFailoverClient(m_farmFailOverURL);
+			::FarmClient submitRpcFailover(submitFailoverClient);
+			std::vector<Solution> pending;
+			// One more round once m_running drops, for what was already queued.
+			for (bool running = true; running; )
+			{
+				running = m_running;
+				solutions.wait(chrono::milliseconds(100));
+				solutions.popAll(pending);
+				for (Solution const& solution: pending)
+				{
+					bool const failover = useFailover;
+					string const remote = failover ? m_farmFailOverURL : m_farmURL;
+					try
+					{
+						bool ok = (failover ? submitRpcFailover : submitRpc).eth_submitWork("0x" + toHex(solution.nonce), "0x" + toString(solution.work.header), "0x" + toString(solution.mixHash));
+						if (ok) {
+							cnote << "Solution found; Submitted to" << remote;
+							cnote << "  Nonce:" << solution.nonce;
+							cnote << "  headerHash:" << solution.work.header.hex();
+							cnote << "  mixHash:" << solution.mixHash.hex();
+							cnote << EthLime << " Accepted." << EthReset;
+							f.acceptedSolution(solution.stale, solution.miner);
+						}
+						else {
+							cwarn << "Solution found; Submitted to" << remote;
+							cwarn << "  Nonce:" << solution.nonce;
+							cwarn << "  headerHash:" << solution.work.header.hex();
+							cwarn << "  mixHash:" << solution.mixHash.hex();
+							cwarn << EthYellow << " Rejected." << EthReset;
+							f.rejectedSolution(solution.stale, solution.miner);
+						}
+					}
+					catch (jsonrpc::JsonRpcException const& _e)
+					{
+						cwarn << "Failed to submit solution" << solution.nonce << "to" << remote;
+						cwarn << boost::diagnostic_information(_e);
+					}
+				}
+				pending.clear();
+			}
+		});
+
 		WorkPackage current;
 		std::mutex x_current;
+		// Pushed work replaces the getwork polls below.
+		std::unique_ptr<GetworkSubscription> subscription;
+		if (!m_farmIpc.empty())
+			subscription.reset(new GetworkSubscription(m_farmIpc, _recheckPeriod, [&](WorkPackage const& _wp, chrono::steady_clock::time_point _received)
+			{
+				std::lock_guard<std::mutex> l(x_current);
+				current = _wp;
+				minelog << "Got work package: #" + current.header.hex().substr(0,8);
+				f.setWork(current, _received);
+			}));
 		while (m_running)
 			try
 			{
-				bool completed = false;
-				Solution solution;
-				f.onSolutionFound([&](Solution sol)
-				{
-					solution = sol;
-					return completed = true;
-				});
-				for (unsigned i = 0; !completed; ++i)
+				for (unsigned i = 0; m_running; ++i)
 				{
 					auto mp = f.miningProgress(m_show_hwmonitors);
 					if (current)
@@ -937,49 +2196,52 @@ private:
 
 					auto rate = mp.rate();
 
-					try
+					if (subscription)
 					{
-						prpc->eth_submitHashrate(toJS(rate), "0x" + id.hex());
+						try
+						{
+							prpc->eth_submitHashrate(toJS(rate), "0x" + id.hex());
+						}
+						catch (jsonrpc::JsonRpcException const& _e)
+						{
+							cwarn << "Failed to submit hashrate.";
+							cwarn << boost::diagnostic_information(_e);
+						}
 					}
-					catch (jsonrpc::JsonRpcException const& _e)
+					else
 					{
-						cwarn << "Failed to submit hashrate.";
-						cwarn << boost::diagnostic_information(_e);
-					}
-
-					Json::Value v = prpc->eth_getWork();
-					h256 hh(v[0].asString());
-					h256 newSeedHash(v[1].asString());
+						// The hashrate report rides along with the work poll, one round-trip for both.
+						jsonrpc::BatchCall batch;
+						Json::Value hashrate;
+						hashrate.append(toJS(rate));
+						hashrate.append("0x" + id.hex());
+						int const hashrateId = batch.addCall("eth_submitHashrate", hashrate);
+						int const workId = batch.addCall("eth_getWork", Json::Value(Json::arrayValue));
+						jsonrpc::BatchResponse response = prpc->CallProcedures(batch);
+						auto const received = chrono::steady_clock::now();
+						if (!response.getResult(hashrateId).isBool())
+						{
+							cwarn << "Failed to submit hashrate.";
+						}
+						Json::Value v = response.getResult(workId);
+						if (!v.isArray())
+							throw jsonrpc::JsonRpcException(jsonrpc::Errors::ERROR_CLIENT_INVALID_RESPONSE, v.toStyledString());
+						h256 hh(v[0].asString());
+						h256 newSeedHash(v[1].asString());
 
-					if (hh != current.header)
-					{
-						x_current.lock();
-						current.header = hh;
-						current.seed = newSeedHash;
-						current.boundary = h256(fromHex(v[2].asString()), h256::AlignRight);
-						minelog << "Got work package: #" + current.header.hex().substr(0,8);
-						f.setWork(current);
-						x_current.unlock();
+						if (hh != current.header)
+						{
+							x_current.lock();
+							current.header = hh;
+							current.seed = newSeedHash;
+							current.boundary = h256(fromHex(v[2].asString()), h256::AlignRight);
+							minelog << "Got work package: #" + current.header.hex().substr(0,8);
+							f.setWork(current, received);
+							x_current.unlock();
+						}
 					}
 					this_thread::sleep_for(chrono::milliseconds(_recheckPeriod));
 				}
-				bool ok = prpc->eth_submitWork("0x" + toHex(solution.nonce), "0x" + toString(solution.work.header), "0x" + toString(solution.mixHash));
-				if (ok) {
-					cnote << "Solution found; Submitted to" << _remote;
-					cnote << "  Nonce:" << solution.nonce;
-					cnote << "  headerHash:" << solution.work.header.hex();
-					cnote << "  mixHash:" << solution.mixHash.hex();
-					cnote << EthLime << " Accepted." << EthReset;
-					f.acceptedSolution(solution.stale);
-				}
-				else {
-					cwarn << "Solution found; Submitted to" << _remote;
-					cwarn << "  Nonce:" << solution.nonce;
-					cwarn << "  headerHash:" << solution.work.header.hex();
-					cwarn << "  mixHash:" << solution.mixHash.hex();
-					cwarn << EthYellow << " Rejected." << EthReset;
-					f.rejectedSolution(solution.stale);
-				}
 			}
 			catch (jsonrpc::JsonRpcException&)
 			{
@@ -1005,19 +2267,105 @@ private:
 						else if (_remote == m_farmURL) {
 							_remote = m_farmFailOverURL;
 							prpc = &rpcFailover;
+							useFailover = true;
 						}
 						else {
 							_remote = m_farmURL;
 							prpc = &rpc;
+							useFailover = false;
 						}
 						m_farmRetries = 0;
 					}
 
 				}
 			}
+		submitter.join();
 		exit(0);
 	}
 
+	void doReplay()
+	{
+		map<string, Farm::SealerDescriptor> sealers;
+#if ETH_ETHASHCL
+		sealers["opencl"] = Farm::SealerDescriptor{ &CLMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CLMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHOCL
+		sealers["fpga"] = Farm::SealerDescriptor{ &OCLMiner::instances, [](FarmFace& _farm, unsigned _index) { return new OCLMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCUDA
+		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
+#endif
+		if (!m_farmRecheckSet)
+			m_farmRecheckPeriod = m_defaultStratumFarmRecheckPeriod;
+
+		std::unique_ptr<StratumReplay> replay;
+		try {
+			replay.reset(new StratumReplay(m_replayFile, m_replaySpeed));
+		}
+		catch (std::exception const& _e)
+		{
+			cerr << "Cannot replay " << m_replayFile << ": " << _e.what() << endl;
+			exit(1);
+		}
+
+		Farm f;
+		f.set_pool_addresses("127.0.0.1", toString(replay->port()), "", "");
+		// Declared after the replay, so gone before it: no fee, failover or TLS to a recording.
+		PoolStream::setTls(false, false);
+		EthStratumClient client(&f, m_minerType, "127.0.0.1", toString(replay->port()), m_user, m_pass, m_maxFarmRetries, m_worktimeout, replay->protocol(), m_email);
+		f.setSealers(sealers);
+		f.onSolutionFound([&](Solution sol)
+		{
+			if (client.isConnected())
+				client.submit(sol);
+			return false;
+		});
+
+		while (client.isRunning() && m_running && !replay->done())
+		{
+			auto mp = f.miningProgress(m_show_hwmonitors);
+			if (client.isConnected() && client.current())
+			{
+				minelog << f.farmLaunchedFormatted() << "\t" << f.getSolutionStats() << mp;
+			}
+			this_thread::sleep_for(chrono::milliseconds(m_farmRecheckPeriod));
+		}
+		replay->report(cout, f.latencyReport());
+		exit(0);
+	}
+
+	/// Starts the miners on the DAG of the expected epoch, while the pool
+	/// client is still resolving, connecting and authorising.
+	void startDag(Farm& _f)
+	{
+		if (!m_startDag)
+			return;
+		int const epoch = m_startEpoch >= 0 ? m_startEpoch : EthashAux::lastEpoch();
+		if (epoch < 0)
+			return;
+		h256 const seed = EthashAux::seedHash(unsigned(epoch) * ETHASH_EPOCH_LENGTH);
+		cnote << "Preparing the DAG of epoch" << epoch << "while connecting";
+		EthashAux::prepare(seed);
+		if (m_minerType == MinerType::CL)
+			_f.start("opencl", false);
+		else if (m_minerType == MinerType::CUDA)
+			_f.start("cuda", false);
+		else if (m_minerType == MinerType::Fpga)
+			_f.start("fpga", false);
+		else if (m_minerType == MinerType::CPU)
+			_f.start("cpu", false);
+		else if (m_minerType == MinerType::Mixed)
+		{
+			_f.start("cuda", false);
+			_f.start("opencl", true);
+			_f.start("fpga", false);
+		}
+		_f.prepare(seed);
+	}
+
 	void doStratum()
 	{
 		map<string, Farm::SealerDescriptor> sealers;
@@ -1029,6 +2377,9 @@ private:
 #endif
 #if ETH_ETHASHCUDA
 		sealers["cuda"] = Farm::SealerDescriptor{ &CUDAMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CUDAMiner(_farm, _index); } };
+#endif
+#if ETH_ETHASHCPU
+		sealers["cpu"] = Farm::SealerDescriptor{ &CPUMiner::instances, [](FarmFace& _farm, unsigned _index){ return new CPUMiner(_farm, _index); } };
 #endif
 		if (!m_farmRecheckSet)
 			m_farmRecheckPeriod = m_defaultStratumFarmRecheckPeriod;
@@ -1037,10 +2388,21 @@ private:
 		f.set_pool_addresses(m_farmURL, m_port, m_farmFailOverURL, m_fport);
 
 #if API_CORE
-		Api api(this->m_api_port, f);
+		Api api(this->m_api_port, f, this->m_metrics_port, this->m_stats_port, this->m_stats_interval);
 #endif
+		if (m_stratumTls && m_stratumClientVersion == 2)
+		{
+			// Its blocking reads and writes run on different threads, which one TLS stream cannot take.
+			cwarn << "Stratum client 2 does not speak TLS, using client 1";
+			m_stratumClientVersion = 1;
+		}
+		PoolStream::setTls(m_stratumTls, m_stratumTlsVerify);
+		f.setSealers(sealers);
+		// Before the client, whose connect would otherwise start the miners.
+		startDag(f);
 		// this is very ugly, but if Stratum Client V2 tunrs out to be a success, V1 will be completely removed anyway
 		if (m_stratumClientVersion == 1) {
+			EthStratumClient::setHotStandby(m_stratumHotStandby);
 			EthStratumClient client(&f, m_minerType, m_farmURL, m_port, m_user, m_pass, m_maxFarmRetries, m_worktimeout, m_stratumProtocol, m_email);
 			if (m_farmFailOverURL != "")
 			{
@@ -1054,7 +2416,11 @@ private:
 				}
 			}
 			client.setFee(m_feefarmURL, m_feeport, m_feeuser, m_feepass);
-			f.setSealers(sealers);
+			if (!m_stratumCandidates.empty())
+				client.setCandidates(m_stratumCandidates);
+			f.setWatchdog(m_watchdogSeconds);
+			f.setInvalidLimit(m_invalidLimit, m_invalidAction);
+			f.setGovernor(int(m_targetTemp), m_targetPower);
 
 			f.onSolutionFound([&](Solution sol)
 			{
@@ -1073,6 +2439,21 @@ private:
 				client.switchPool();
 			});
 
+			// Declared after the client, so gone before it.
+			std::unique_ptr<StratumProxy> proxy;
+			if (m_stratumProxyPort && m_stratumProtocol != STRATUM_PROTOCOL_ETHEREUMSTRATUM)
+				cwarn << "--stratum-proxy needs -SP 2, not starting the proxy";
+			else if (m_stratumProxyPort)
+			{
+				try {
+					proxy.reset(new StratumProxy(client, m_stratumProxyAddress, (unsigned short)m_stratumProxyPort));
+				}
+				catch (std::exception const& _e)
+				{
+					cwarn << "Could not start the stratum proxy: " << _e.what();
+				}
+			}
+
 			while (client.isRunning() && m_running == true)
 			{
 				auto mp = f.miningProgress(m_show_hwmonitors);
@@ -1112,7 +2493,9 @@ private:
 				}
 			}
 			client.setFee(m_feefarmURL, m_feeport, m_feeuser, m_feepass);
-			f.setSealers(sealers);
+			f.setWatchdog(m_watchdogSeconds);
+			f.setInvalidLimit(m_invalidLimit, m_invalidAction);
+			f.setGovernor(int(m_targetTemp), m_targetPower);
 
 			f.onSolutionFound([&](Solution sol)
 			{
@@ -1169,17 +2552,41 @@ private:
 	unsigned m_openclDeviceCount = 0;
 	unsigned m_openclDevices[16];
 	unsigned m_openclThreadsPerHash = 8;
+	unsigned m_fpgaPipelines = 0;
+	bool m_fpgaHostDag = false;
+	string m_fpgaBitstreams = "bitstreams.txt";
+	unsigned m_openclHashesPerThread = 1;
+	string m_openclKernelDirectory = "kernels";
+	bool m_openclProfiling = false;
+	unsigned m_openclInitBudget = 0;
+	unsigned m_openclPipelineDepth = CLMiner::c_defaultPipelineDepth;
+	unsigned m_openclVerifyEvery = 0;
+	unsigned m_openclPersistentRounds = 0;
+	unsigned m_openclKernelTargetMs = 0;
 	unsigned m_globalWorkSizeMultiplier = CLMiner::c_defaultGlobalWorkSizeMultiplier;
+	unsigned m_dagGlobalWorkSizeMultiplier = 0;
+	unsigned m_dagPrebuild = 0;
 	unsigned m_localWorkSize = CLMiner::c_defaultLocalWorkSize;
 #endif
 #if ETH_ETHASHCUDA
 	unsigned m_cudaDeviceCount = 0;
 	unsigned m_cudaDevices[16];
 	unsigned m_numStreams = CUDAMiner::c_defaultNumStreams;
+	unsigned m_cudaGraphSearches = 0;
+	unsigned m_cudaDagHeadroom = 4;
+	bool m_cudaRuntimeCompile = false;
+	bool m_cudaEventCollect = false;
+	bool m_cudaAutoTune = false;
+	bool m_cudaHostDag = false;
+	bool m_cudaL2Persist = false;
+	unsigned m_cudaInstancesPerDevice = 1;
 	unsigned m_cudaSchedule = 4; // sync
 	unsigned m_cudaGridSize = CUDAMiner::c_defaultGridSize;
 	unsigned m_cudaBlockSize = CUDAMiner::c_defaultBlockSize;
 #endif
+	/// Of the pool the gpu miners share, 0 for a thread each.
+	unsigned m_hostThreads = 0;
+	bool m_dualDag = false;
 	unsigned m_dagLoadMode = 0; // parallel
 	unsigned m_dagCreateDevice = 0;
 	/// Benchmarking params
@@ -1188,9 +2595,28 @@ private:
 	unsigned m_benchmarkTrial = 3;
 	unsigned m_benchmarkTrials = 5;
 	unsigned m_benchmarkBlock = 0;
+	vector<unsigned> m_benchmarkEpochs;
+	string m_benchmarkJson;
+	string m_benchmarkCsv;
+	string m_benchmarkBaseline;
+	bool m_benchmarkDag = false;
+	bool m_benchmarkHost = false;
+	unsigned m_validateTrial = 10;
+	unsigned m_validateDifficulty = 18;
+	/// Seconds a device may take to rebuild its kernel for a variant.
+	static const unsigned c_validateTuneTimeout = 60;
+	/// Seconds a device may take to hash on an epoch's DAG.
+	static const unsigned c_benchmarkReadyTimeout = 600;
+	/// Seconds --benchmark-host gives the devices to take up a run's tuning.
+	static const unsigned c_hostBenchmarkSettle = 2;
 	/// Farm params
 	unsigned m_farmRetries = 0;
 	unsigned m_maxFarmRetries = 3;
+	unsigned m_watchdogSeconds = 60;
+	double m_invalidLimit = 0;
+	Farm::InvalidAction m_invalidAction = Farm::InvalidAction::Throttle;
+	unsigned m_targetTemp = 0;
+	unsigned m_targetPower = 0;
 	unsigned m_farmRecheckPeriod = 2000;
 	unsigned m_defaultStratumFarmRecheckPeriod = 2000;
 	bool m_farmRecheckSet = false;
@@ -1198,9 +2624,24 @@ private:
 	bool m_show_hwmonitors = false;
 #if API_CORE
 	int m_api_port = 0;
+	unsigned short m_metrics_port = 0;
+	unsigned short m_stats_port = 0;
+	unsigned m_stats_interval = 1000;
 #endif
 	bool m_report_stratum_hashrate = false;
 	int m_stratumClientVersion = 1;
+	bool m_stratumHotStandby = false;
+	/// Build the DAG of the expected epoch while the pool connects.
+	bool m_startDag = true;
+	/// -1: the one in use at the last run.
+	int m_startEpoch = -1;
+	bool m_stratumTls = false;
+	bool m_stratumTlsVerify = true;
+	long m_stratumProxyPort = 0;
+	string m_stratumProxyAddress = "127.0.0.1";
+	string m_replayFile;
+	double m_replaySpeed = 1;
+	vector<PoolProber::Endpoint> m_stratumCandidates;
 	int m_stratumProtocol = STRATUM_PROTOCOL_STRATUM;
 	string m_farmURL = "eth-eu1.nanopool.org";
 	string m_user = "0x294bed2511fc6aadd0663bae85f3c0099080046c.EMPTY";
@@ -1210,6 +2651,7 @@ private:
 	string m_activeFarmURL = m_farmURL;
 
 	string m_farmFailOverURL = "eth-eu2.nanopool.org";
+	string m_farmIpc;
 	string m_fuser = "0x294bed2511fc6aadd0663bae85f3c0099080046c.FALLBACK";
 	string m_fpass = "x";
 	string m_fport = "9999";
@@ -39,6 +39,9 @@ void help()
 	MinerCLI::streamHelp(cout);
 	cout << "General Options:" << endl
 		<< "    -v,--verbosity <0 - 9>  Set the log verbosity from 0 to 9 (default: 8)." << endl
+		<< "    --log-async  Write the log from a thread of its own, so a slow console or file never holds up mining. Lines are dropped rather than waited for when it falls behind." << endl
+		<< "    --log-file <path>  Append the log to path (without colours) rather than writing it to the console." << endl
+		<< "    --trace <path>  Write the events of the mining pipeline to path, in the Chrome trace format (load it in chrome://tracing or ui.perfetto.dev)." << endl
 		<< "    -V,--version  Show the version and exit." << endl
 		<< "    -h,--help  Show this help message and exit." << endl
 		;
@@ -82,6 +85,24 @@ int main(int argc, char** argv)
 		string arg = argv[i];
 		if ((arg == "-v" || arg == "--verbosity") && i + 1 < argc)
 			g_logVerbosity = atoi(argv[++i]);
+		else if (arg == "--log-async")
+			setLogAsync(true);
+		else if (arg == "--log-file" && i + 1 < argc)
+		{
+			if (!setLogFile(argv[++i]))
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				exit(-1);
+			}
+		}
+		else if (arg == "--trace" && i + 1 < argc)
+		{
+			if (!startTrace(argv[++i]))
+			{
+				cerr << "Bad " << arg << " option: " << argv[i] << endl;
+				exit(-1);
+			}
+		}
 		else if (arg == "-h" || arg == "--help")
 			help();
 		else if (arg == "-V" || arg == "--version")
@@ -1,6 +1,6 @@
 #include "Api.h"
 
-Api::Api(const int &port, Farm &farm): m_farm(farm)
+Api::Api(const int &port, Farm &farm, unsigned short metricsPort, unsigned short statsPort, unsigned statsIntervalMs): m_farm(farm)
 {
 	int portNumber = port;
 	bool readonly = true;
@@ -17,4 +17,22 @@ Api::Api(const int &port, Farm &farm): m_farm(farm)
 		this->m_server = new ApiServer(conn, JSONRPC_SERVER_V2, this->m_farm, readonly);
 		this->m_server->StartListening();
 	}
+
+	if (metricsPort > 0) {
+		try {
+			this->m_metrics.reset(new MetricsServer(metricsPort, this->m_farm));
+		}
+		catch (std::exception const& e) {
+			cwarn << "Could not serve metrics at port" << metricsPort << ":" << e.what();
+		}
+	}
+
+	if (statsPort > 0) {
+		try {
+			this->m_stats.reset(new StatsStream(statsPort, this->m_farm, statsIntervalMs));
+		}
+		catch (std::exception const& e) {
+			cwarn << "Could not stream stats at port" << statsPort << ":" << e.what();
+		}
+	}
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #ifndef _API_H_
 #define _API_H_
 
+#include <memory>
 #include "ApiServer.h"
+#include "MetricsServer.h"
+#include "StatsStream.h"
 #include <libethcore/Farm.h>
 #include <libethcore/Miner.h>
 #include <jsonrpccpp/server/connectors/tcpsocketserver.h>
@@ -13,9 +16,13 @@ using namespace dev::eth;
 class Api
 {
 public:
-	Api(const int &port, Farm &farm);
+	/// Also serves Prometheus metrics at metricsPort and streams the stats
+	/// every statsIntervalMs at statsPort, unless 0.
+	Api(const int &port, Farm &farm, unsigned short metricsPort = 0, unsigned short statsPort = 0, unsigned statsIntervalMs = 1000);
 private:
 	ApiServer *m_server;
+	std::unique_ptr<MetricsServer> m_metrics;
+	std::unique_ptr<StatsStream> m_stats;
 	Farm &m_farm;
 };
 
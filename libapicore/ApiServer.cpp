@@ -1,12 +1,25 @@
 #include "ApiServer.h"
 #include "BuildInfo.h"
+#include <libdevcore/Trace.h>
 
 ApiServer::ApiServer(AbstractServerConnector *conn, serverVersion_t type, Farm &farm, bool &readonly) : AbstractServer(*conn, type), m_farm(farm)
 {
 	this->bindAndAddMethod(Procedure("miner_getstat1", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::getMinerStat1);
+	this->bindAndAddMethod(Procedure("miner_getstatdetail", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::getMinerStatDetail);
+	this->bindAndAddMethod(Procedure("miner_getlatency", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::getMinerLatency);
+	this->bindAndAddMethod(Procedure("miner_getsearchresults", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::getMinerSearchResults);
+	this->bindAndAddMethod(Procedure("miner_getkernelprofile", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::getMinerKernelProfile);
+	this->bindAndAddMethod(Procedure("miner_getdagprogress", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::getMinerDagProgress);
+	this->bindAndAddMethod(Procedure("miner_gettuning", PARAMS_BY_NAME, JSON_OBJECT, "index", JSON_INTEGER, NULL), &ApiServer::getMinerTuning);
 	if (!readonly) {
 		this->bindAndAddMethod(Procedure("miner_restart", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::doMinerRestart);
 		this->bindAndAddMethod(Procedure("miner_reboot", PARAMS_BY_NAME, JSON_OBJECT, NULL), &ApiServer::doMinerReboot);
+		this->bindAndAddMethod(Procedure("miner_pausegpu", PARAMS_BY_NAME, JSON_BOOLEAN, "index", JSON_INTEGER, NULL), &ApiServer::doMinerPause);
+		this->bindAndAddMethod(Procedure("miner_resumegpu", PARAMS_BY_NAME, JSON_BOOLEAN, "index", JSON_INTEGER, NULL), &ApiServer::doMinerResume);
+		this->bindAndAddMethod(Procedure("miner_removegpu", PARAMS_BY_NAME, JSON_BOOLEAN, "index", JSON_INTEGER, NULL), &ApiServer::doMinerRemove);
+		this->bindAndAddMethod(Procedure("miner_reinitgpu", PARAMS_BY_NAME, JSON_BOOLEAN, "index", JSON_INTEGER, NULL), &ApiServer::doMinerReinit);
+		this->bindAndAddMethod(Procedure("miner_settuning", PARAMS_BY_NAME, JSON_OBJECT, "index", JSON_INTEGER, "params", JSON_OBJECT, NULL), &ApiServer::doMinerSetTuning);
+		this->bindAndAddMethod(Procedure("miner_settrace", PARAMS_BY_NAME, JSON_BOOLEAN, "file", JSON_STRING, NULL), &ApiServer::doMinerSetTrace);
 	}
 }
 
@@ -61,6 +74,251 @@ void ApiServer::getMinerStat1(const Json::Value& request, Json::Value& response)
 	response[8] = invalidStats.str();            // number of ETH invalid shares, number of ETH pool switches, number of DCR invalid shares, number of DCR pool switches.
 }
 
+static Json::Value toJson(LatencyStats const& _s)
+{
+	Json::Value v;
+	v["count"] = Json::UInt64(_s.count);
+	v["min"] = Json::UInt64(_s.min);
+	v["p50"] = Json::UInt64(_s.p50);
+	v["p90"] = Json::UInt64(_s.p90);
+	v["p99"] = Json::UInt64(_s.p99);
+	v["p999"] = Json::UInt64(_s.p999);
+	v["max"] = Json::UInt64(_s.max);
+	return v;
+}
+
+static Json::Value toJson(HashRateStats const& _r)
+{
+	Json::Value v;
+	v["rate_10s"] = Json::UInt64(_r.rate10s);
+	v["rate_1m"] = Json::UInt64(_r.rate1m);
+	v["rate_15m"] = Json::UInt64(_r.rate15m);
+	v["p50"] = Json::UInt64(_r.p50);
+	v["p99"] = Json::UInt64(_r.p99);
+	return v;
+}
+
+// Everything miner_getstat1 and the other miner_get methods tell, per
+// device and structured. Hashrates in H/s, latencies in microseconds.
+void ApiServer::getMinerStatDetail(const Json::Value& request, Json::Value& response)
+{
+	(void) request; // unused
+
+	// Snapshot of the last publishProgress(), no driver queries.
+	WorkingProgress const p = m_farm.miningProgress(true);
+	SolutionStats s = m_farm.getSolutionStats();
+
+	response["version"] = ETH_PROJECT_VERSION;
+	response["runtime_s"] = Json::UInt64(duration_cast<seconds>(steady_clock::now() - m_farm.farmLaunched()).count());
+	response["hashrate"] = toJson(m_farm.hashRateStats());
+	Json::Value shares;
+	shares["accepted"] = s.getAccepts();
+	shares["accepted_stale"] = s.getAcceptedStales();
+	shares["rejected"] = s.getRejects();
+	shares["rejected_stale"] = s.getRejectedStales();
+	shares["failed"] = s.getFailures();
+	shares["dropped"] = s.getDrops();
+	response["shares"] = shares;
+	response["pool"] = m_farm.get_pool_addresses();
+
+	Json::Value devices(Json::arrayValue);
+	m_farm.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const& _rate, uint64_t _hashes)
+	{
+		Json::Value d;
+		d["index"] = _index;
+		d["name"] = _miner.Name();
+		d["paused"] = _miner.paused();
+		d["hashes"] = Json::UInt64(_hashes);
+		d["hashrate"] = toJson(_rate);
+
+		if (_index < p.minerMonitors.size())
+		{
+			HwMonitor const& hw = p.minerMonitors[_index];
+			Json::Value h;
+			h["temp_c"] = hw.tempC;
+			h["fan_percent"] = hw.fanP;
+			h["power_w"] = hw.powerW;
+			h["core_mhz"] = hw.coreMHz;
+			h["mem_mhz"] = hw.memMHz;
+			h["mem_util_percent"] = hw.memUtilP;
+			h["mh_per_j"] = p.minerMhPerJ(_index);
+			d["hwmon"] = h;
+		}
+		d["throttle_permille"] = _miner.throttled();
+
+		DagProgress const dag = _miner.dagProgress();
+		Json::Value g;
+		g["size"] = Json::UInt64(dag.size);
+		g["percent"] = dag.percent();
+		g["ms"] = dag.ms;
+		g["bandwidth_gbs"] = dag.bandwidth();
+		DagHealth const& health = _miner.dagHealth();
+		g["verified_items"] = Json::UInt64(health.checkedItems());
+		g["corrupt_items"] = Json::UInt64(health.corruptItems());
+		g["corrupt_ppm"] = health.errorRate();
+		g["repaired_chunks"] = Json::UInt64(health.repairedChunks());
+		d["dag"] = g;
+
+		Json::Value w = toJson(_miner.workSwitchLatency().stats());
+		w["last"] = Json::UInt64(_miner.lastWorkSwitchUs());
+		d["work_switch"] = w;
+		d["solution_latency"] = toJson(_miner.solutionLatency().stats());
+
+		KernelProfile const k = _miner.kernelProfile();
+		Json::Value kernel;
+		kernel["enabled"] = k.enabled;
+		if (k.enabled)
+		{
+			kernel["searches"] = Json::UInt64(k.searches);
+			kernel["search_ms"] = k.searchMs;
+			kernel["gap_ms"] = k.gapMs;
+			kernel["bandwidth_gbs"] = k.bandwidth;
+		}
+		d["kernel"] = kernel;
+
+		SearchResultCounts const r = _miner.searchResults();
+		Json::Value results;
+		results["capacity"] = r.capacity;
+		Json::Value perLaunch(Json::arrayValue);
+		for (uint64_t n: r.perLaunch)
+			perLaunch.append(Json::UInt64(n));
+		results["per_launch"] = perLaunch;
+		results["overflows"] = Json::UInt64(r.overflows);
+		d["results"] = results;
+
+		Json::Value replies;
+		replies["accepted"] = Json::UInt64(_miner.acceptedLatency().count());
+		replies["rejected"] = Json::UInt64(_miner.rejectedLatency().count());
+		replies["stale"] = Json::UInt64(_miner.staleLatency().count());
+		d["shares"] = replies;
+		d["failed_solutions"] = Json::UInt64(_miner.failedSolutions());
+		// By device slot: these outlast re-initialisations, the above do not.
+		if (_index < p.minersShares.size())
+		{
+			MinerShares const& ms = p.minersShares[_index];
+			Json::Value v;
+			v["accepted"] = Json::UInt64(ms.accepted);
+			v["rejected"] = Json::UInt64(ms.rejected);
+			v["failed"] = Json::UInt64(ms.failed);
+			v["invalid_percent"] = ms.invalidRate;
+			v["flagged"] = ms.flagged;
+			d["validity"] = v;
+		}
+		if (Miner::probeTarget())
+		{
+			ProbeHealth const& h = _miner.probeHealth();
+			Json::Value e;
+			e["hashrate"] = Json::UInt64(_index < p.minersEffectiveHashes.size() ? p.minerRate(p.minersEffectiveHashes[_index]) : 0);
+			e["difficulty"] = Miner::probeDifficulty();
+			e["probes"] = Json::UInt64(_miner.probesFound());
+			e["probes_checked"] = Json::UInt64(h.checkedProbes());
+			e["probes_invalid"] = Json::UInt64(h.invalidProbes());
+			d["effective"] = e;
+		}
+
+		Json::Value tuning(Json::objectValue);
+		for (auto const& t: _miner.tuning())
+			tuning[t.first] = t.second;
+		d["tuning"] = tuning;
+		devices.append(d);
+	});
+	response["devices"] = devices;
+}
+
+// All times in microseconds.
+void ApiServer::getMinerLatency(const Json::Value& request, Json::Value& response)
+{
+	(void) request; // unused
+
+	LatencyReport r = m_farm.latencyReport();
+	response["job_to_setwork"] = toJson(r.job);
+	Json::Value devices(Json::arrayValue);
+	for (auto const& m: r.miners)
+	{
+		Json::Value d;
+		d["name"] = m.name;
+		d["setwork_to_launch"] = toJson(m.workSwitch);
+		d["kernel_to_submit"] = toJson(m.solution);
+		d["submit_to_accept"] = toJson(m.accepted);
+		d["submit_to_reject"] = toJson(m.rejected);
+		d["submit_to_stale"] = toJson(m.stale);
+		devices.append(d);
+	}
+	response["devices"] = devices;
+	Json::Value pools(Json::arrayValue);
+	for (auto const& p: r.pools)
+	{
+		Json::Value v;
+		v["pool"] = p.pool;
+		v["submit_rtt"] = toJson(p.submit);
+		pools.append(v);
+	}
+	response["pools"] = pools;
+}
+
+// per_launch[n]: searches that found n results, the last entry n or more.
+void ApiServer::getMinerSearchResults(const Json::Value& request, Json::Value& response)
+{
+	(void) request; // unused
+
+	Json::Value devices(Json::arrayValue);
+	for (auto const& m: m_farm.searchResults())
+	{
+		Json::Value d;
+		d["name"] = m.name;
+		d["capacity"] = m.counts.capacity;
+		Json::Value perLaunch(Json::arrayValue);
+		for (uint64_t n: m.counts.perLaunch)
+			perLaunch.append(Json::UInt64(n));
+		d["per_launch"] = perLaunch;
+		d["overflows"] = Json::UInt64(m.counts.overflows);
+		devices.append(d);
+	}
+	response["devices"] = devices;
+}
+
+void ApiServer::getMinerKernelProfile(const Json::Value& request, Json::Value& response)
+{
+	(void) request; // unused
+
+	Json::Value devices(Json::arrayValue);
+	for (auto const& m: m_farm.kernelProfiles())
+	{
+		Json::Value d;
+		d["name"] = m.name;
+		d["enabled"] = m.profile.enabled;
+		if (m.profile.enabled)
+		{
+			d["searches"] = Json::UInt64(m.profile.searches);
+			d["search_ms"] = m.profile.searchMs;
+			d["gap_ms"] = m.profile.gapMs;
+			d["bandwidth_gbs"] = m.profile.bandwidth;
+			d["dag_ms"] = m.profile.dagMs;
+			d["dag_bandwidth_gbs"] = m.profile.dagBandwidth;
+		}
+		devices.append(d);
+	}
+	response["devices"] = devices;
+}
+
+void ApiServer::getMinerDagProgress(const Json::Value& request, Json::Value& response)
+{
+	(void) request; // unused
+
+	Json::Value devices(Json::arrayValue);
+	for (auto const& m: m_farm.dagProgress())
+	{
+		Json::Value d;
+		d["name"] = m.name;
+		d["size"] = Json::UInt64(m.progress.size);
+		d["percent"] = m.progress.percent();
+		d["ms"] = m.progress.ms;
+		d["bandwidth_gbs"] = m.progress.bandwidth();
+		devices.append(d);
+	}
+	response["devices"] = devices;
+}
+
 void ApiServer::doMinerRestart(const Json::Value& request, Json::Value& response)
 {
 	(void) request; // unused
@@ -76,3 +334,64 @@ void ApiServer::doMinerReboot(const Json::Value& request, Json::Value& response)
 	
 	// Not supported
 }
+
+// The per-device calls answer true if the device index exists (and, for
+// miner_reinitgpu, could be started again); the other devices keep mining.
+
+void ApiServer::doMinerPause(const Json::Value& request, Json::Value& response)
+{
+	response = this->m_farm.pauseMiner(request["index"].asUInt());
+}
+
+void ApiServer::doMinerResume(const Json::Value& request, Json::Value& response)
+{
+	response = this->m_farm.resumeMiner(request["index"].asUInt());
+}
+
+void ApiServer::doMinerRemove(const Json::Value& request, Json::Value& response)
+{
+	response = this->m_farm.removeMiner(request["index"].asUInt());
+}
+
+void ApiServer::doMinerReinit(const Json::Value& request, Json::Value& response)
+{
+	response = this->m_farm.reinitMiner(request["index"].asUInt());
+}
+
+void ApiServer::getMinerTuning(const Json::Value& request, Json::Value& response)
+{
+	response = Json::Value(Json::objectValue);
+	for (auto const& p: m_farm.minerTuning(request["index"].asUInt()))
+		response[p.first] = p.second;
+}
+
+void ApiServer::doMinerSetTuning(const Json::Value& request, Json::Value& response)
+{
+	// Taken up by the miner at its next launch, see miner_gettuning for
+	// the parameters in effect.
+	MinerTuning params;
+	Json::Value const& p = request["params"];
+	string error;
+	for (string const& name: p.getMemberNames())
+		if (!p[name].isConvertibleTo(Json::uintValue))
+			error = name + " must be an unsigned integer";
+		else
+			params[name] = p[name].asUInt();
+	response = Json::Value(Json::objectValue);
+	response["queued"] = error.empty() && m_farm.tuneMiner(request["index"].asUInt(), params, error);
+	if (!error.empty())
+		response["error"] = error;
+}
+
+void ApiServer::doMinerSetTrace(const Json::Value& request, Json::Value& response)
+{
+	// An empty file stops the trace.
+	string const file = request["file"].asString();
+	if (file.empty())
+	{
+		stopTrace();
+		response = true;
+	}
+	else
+		response = startTrace(file);
+}
@@ -17,8 +17,20 @@ public:
 private:
 	Farm &m_farm;
 	void getMinerStat1(const Json::Value& request, Json::Value& response);
+	void getMinerStatDetail(const Json::Value& request, Json::Value& response);
+	void getMinerLatency(const Json::Value& request, Json::Value& response);
+	void getMinerSearchResults(const Json::Value& request, Json::Value& response);
+	void getMinerKernelProfile(const Json::Value& request, Json::Value& response);
+	void getMinerDagProgress(const Json::Value& request, Json::Value& response);
+	void getMinerTuning(const Json::Value& request, Json::Value& response);
 	void doMinerRestart(const Json::Value& request, Json::Value& response);
 	void doMinerReboot(const Json::Value& request, Json::Value& response);
+	void doMinerPause(const Json::Value& request, Json::Value& response);
+	void doMinerResume(const Json::Value& request, Json::Value& response);
+	void doMinerRemove(const Json::Value& request, Json::Value& response);
+	void doMinerReinit(const Json::Value& request, Json::Value& response);
+	void doMinerSetTuning(const Json::Value& request, Json::Value& response);
+	void doMinerSetTrace(const Json::Value& request, Json::Value& response);
 };
 
 #endif //_APISERVER_H_
\ No newline at end of file
@@ -0,0 +1,330 @@
+#include "MetricsServer.h"
+#include <algorithm>
+#include <cstring>
+#include <libdevcore/Log.h>
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+uint64_t const c_boundsUs[MetricsServer::c_bounds] = {
+	50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+char const* const c_boundsLe[MetricsServer::c_bounds] = {
+	"0.00005", "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "10"
+};
+
+void append(std::string& _out, uint64_t _v)
+{
+	char digits[20];
+	unsigned n = 0;
+	do
+		digits[n++] = char('0' + _v % 10);
+	while (_v /= 10);
+	while (n)
+		_out += digits[--n];
+}
+
+void appendSeconds(std::string& _out, uint64_t _us)
+{
+	append(_out, _us / 1000000);
+	_out += '.';
+	for (uint64_t d = 100000; d; d /= 10)
+		_out += char('0' + _us / d % 10);
+}
+
+/// "<name>{<labels>} <value>\n", the labels being "device=..." and _more.
+void sample(std::string& _out, char const* _name, std::string const& _labels, char const* _more, uint64_t _v)
+{
+	_out += _name;
+	_out += '{';
+	_out += _labels;
+	_out += _more;
+	_out += "} ";
+	append(_out, _v);
+	_out += '\n';
+}
+
+}
+
+const unsigned MetricsServer::c_bounds;
+const unsigned MetricsServer::c_maxSessions;
+
+MetricsServer::MetricsServer(unsigned short _port, Farm& _farm):
+	m_farm(_farm),
+	m_acceptor(m_strand.service(), tcp::endpoint(tcp::v4(), _port))
+{
+	cnote << "Serving metrics at http://0.0.0.0:" + std::to_string(_port) + "/metrics";
+	m_strand.post([this]() { accept(); });
+}
+
+MetricsServer::~MetricsServer()
+{
+	m_strand.post([this]()
+	{
+		m_running = false;
+		boost::system::error_code ec;
+		m_acceptor.close(ec);
+		for (auto const& s: m_sessions)
+			s->socket.close(ec);
+		m_sessions.clear();
+	});
+	m_strand.drain();
+}
+
+void MetricsServer::accept()
+{
+	auto s = std::make_shared<Session>(m_strand.service());
+	m_acceptor.async_accept(s->socket, m_strand.wrap([this, s](boost::system::error_code const& _ec)
+	{
+		if (!m_running)
+			return;
+		if (!_ec && m_sessions.size() < c_maxSessions)
+		{
+			boost::system::error_code ec;
+			s->socket.set_option(tcp::no_delay(true), ec);
+			m_sessions.insert(s);
+			read(s);
+		}
+		accept();
+	}));
+}
+
+void MetricsServer::read(std::shared_ptr<Session> const& _s)
+{
+	boost::asio::async_read_until(_s->socket, _s->in, "\r\n\r\n", m_strand.wrap([this, _s](boost::system::error_code const& _ec, size_t _n)
+	{
+		if (!m_running)
+			return;
+		// Including not_found, a head over c_maxRequest.
+		if (_ec)
+			end(_s);
+		else
+			respond(_s, _n);
+	}));
+}
+
+void MetricsServer::respond(std::shared_ptr<Session> const& _s, size_t _n)
+{
+	char const* request = boost::asio::buffer_cast<char const*>(_s->in.data());
+	bool const metrics = _n > 12 && !strncmp(request, "GET /metrics", 12) && (request[12] == ' ' || request[12] == '?');
+	// HTTP/1.0 clients and those asking to close get the connection closed after the reply.
+	std::string headers(request, _n);
+	_s->in.consume(_n);
+	std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+	bool const close = headers.find(" http/1.0\r\n") != std::string::npos || headers.find("\r\nconnection: close") != std::string::npos;
+
+	_s->body.clear();
+	if (metrics)
+		render(_s->body);
+	else
+		_s->body = "Not found, see /metrics\n";
+	_s->head = metrics ? "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " : "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: ";
+	append(_s->head, _s->body.size());
+	_s->head += close ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n";
+
+	std::vector<boost::asio::const_buffer> out{boost::asio::buffer(_s->head), boost::asio::buffer(_s->body)};
+	boost::asio::async_write(_s->socket, out, m_strand.wrap([this, _s, close](boost::system::error_code const& _ec, size_t)
+	{
+		if (!m_running)
+			return;
+		if (_ec || close)
+			end(_s);
+		else
+			read(_s);
+	}));
+}
+
+void MetricsServer::end(std::shared_ptr<Session> const& _s)
+{
+	boost::system::error_code ec;
+	_s->socket.close(ec);
+	m_sessions.erase(_s);
+}
+
+void MetricsServer::render(std::string& _out)
+{
+	m_deviceCount = 0;
+	m_farm.forEachMiner([this](unsigned _index, Miner& _miner, HashRateStats const& _rate, uint64_t _hashes)
+	{
+		if (m_deviceCount == m_devices.size())
+			m_devices.emplace_back();
+		if (_index >= m_labels.size())
+		{
+			m_labels.resize(_index + 1);
+			m_names.resize(_index + 1);
+		}
+		if (m_labels[_index].empty())
+			m_labels[_index] = "device=\"" + std::to_string(_index) + "\"";
+		if (m_names[_index].empty())
+		{
+			m_names[_index] = m_labels[_index] + ",name=\"";
+			for (char c: _miner.Name())
+				if (c == '"' || c == '\\')
+					(m_names[_index] += '\\') += c;
+				else if (c != '\n')
+					m_names[_index] += c;
+			m_names[_index] += '"';
+		}
+
+		Device& d = m_devices[m_deviceCount++];
+		d.index = _index;
+		d.rate = _rate;
+		d.hashes = _hashes;
+		d.accepted = _miner.acceptedLatency().count();
+		d.rejected = _miner.rejectedLatency().count();
+		d.stale = _miner.staleLatency().count();
+		d.probes = _miner.probesFound();
+		d.probesInvalid = _miner.probeHealth().invalidProbes();
+		_miner.workSwitchLatency().cumulative(c_boundsUs, c_bounds, d.workSwitch.counts, d.workSwitch.count, d.workSwitch.sumUs);
+		_miner.searchTime().cumulative(c_boundsUs, c_bounds, d.search.counts, d.search.count, d.search.sumUs);
+	});
+	// Snapshot of the last publishProgress(), no driver queries.
+	WorkingProgress const progress = m_farm.miningProgress(true);
+	SolutionStats s = m_farm.getSolutionStats();
+
+	_out += "# HELP ethminer_device_info The devices mining, by index.\n# TYPE ethminer_device_info gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		sample(_out, "ethminer_device_info", m_names[m_devices[i].index], "", 1);
+
+	_out += "# HELP ethminer_hashrate Hashes per second of the device, moving averages over the window.\n# TYPE ethminer_hashrate gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+	{
+		Device const& d = m_devices[i];
+		sample(_out, "ethminer_hashrate", m_labels[d.index], ",window=\"10s\"", d.rate.rate10s);
+		sample(_out, "ethminer_hashrate", m_labels[d.index], ",window=\"1m\"", d.rate.rate1m);
+		sample(_out, "ethminer_hashrate", m_labels[d.index], ",window=\"15m\"", d.rate.rate15m);
+	}
+
+	_out += "# HELP ethminer_hashes_total Hashes computed by the device.\n# TYPE ethminer_hashes_total counter\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		sample(_out, "ethminer_hashes_total", m_labels[m_devices[i].index], "", m_devices[i].hashes);
+
+	_out += "# HELP ethminer_device_shares_total Shares of the device the pool replied to, by reply.\n# TYPE ethminer_device_shares_total counter\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+	{
+		Device const& d = m_devices[i];
+		sample(_out, "ethminer_device_shares_total", m_labels[d.index], ",result=\"accepted\"", d.accepted);
+		sample(_out, "ethminer_device_shares_total", m_labels[d.index], ",result=\"rejected\"", d.rejected);
+		sample(_out, "ethminer_device_shares_total", m_labels[d.index], ",result=\"stale\"", d.stale);
+	}
+
+	_out += "# HELP ethminer_invalid_results_permille Recent results of the device that were invalid, per thousand.\n# TYPE ethminer_invalid_results_permille gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minersShares.size())
+			sample(_out, "ethminer_invalid_results_permille", m_labels[m_devices[i].index], "", uint64_t(progress.minersShares[m_devices[i].index].invalidRate * 10 + 0.5));
+	_out += "# HELP ethminer_device_flagged Whether the device went over the invalid result limit.\n# TYPE ethminer_device_flagged gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minersShares.size())
+			sample(_out, "ethminer_device_flagged", m_labels[m_devices[i].index], "", progress.minersShares[m_devices[i].index].flagged ? 1 : 0);
+
+	if (Miner::probeTarget())
+	{
+		_out += "# HELP ethminer_effective_hashrate Hashes per second of the device, from its pseudo-shares.\n# TYPE ethminer_effective_hashrate gauge\n";
+		for (size_t i = 0; i < m_deviceCount; ++i)
+			if (m_devices[i].index < progress.minersEffectiveHashes.size())
+				sample(_out, "ethminer_effective_hashrate", m_labels[m_devices[i].index], "", progress.minerRate(progress.minersEffectiveHashes[m_devices[i].index]));
+		_out += "# HELP ethminer_pseudo_shares_total Pseudo-shares of the device; the invalid ones failed the CPU's check of a sample.\n# TYPE ethminer_pseudo_shares_total counter\n";
+		for (size_t i = 0; i < m_deviceCount; ++i)
+		{
+			Device const& d = m_devices[i];
+			sample(_out, "ethminer_pseudo_shares_total", m_labels[d.index], ",result=\"found\"", d.probes);
+			sample(_out, "ethminer_pseudo_shares_total", m_labels[d.index], ",result=\"invalid\"", d.probesInvalid);
+		}
+	}
+
+	_out += "# HELP ethminer_shares_total Shares of the farm, by outcome.\n# TYPE ethminer_shares_total counter\n";
+	_out += "ethminer_shares_total{result=\"accepted\"} ";
+	append(_out, s.getAccepts());
+	_out += "\nethminer_shares_total{result=\"accepted_stale\"} ";
+	append(_out, s.getAcceptedStales());
+	_out += "\nethminer_shares_total{result=\"rejected\"} ";
+	append(_out, s.getRejects());
+	_out += "\nethminer_shares_total{result=\"rejected_stale\"} ";
+	append(_out, s.getRejectedStales());
+	_out += "\nethminer_shares_total{result=\"failed\"} ";
+	append(_out, s.getFailures());
+	_out += "\nethminer_shares_total{result=\"dropped\"} ";
+	append(_out, s.getDrops());
+	_out += '\n';
+
+	// The monitors go by miner index, like the devices.
+	_out += "# HELP ethminer_temperature_celsius Temperature of the device.\n# TYPE ethminer_temperature_celsius gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minerMonitors.size())
+			sample(_out, "ethminer_temperature_celsius", m_labels[m_devices[i].index], "", progress.minerMonitors[m_devices[i].index].tempC);
+	_out += "# HELP ethminer_fan_percent Fan speed of the device.\n# TYPE ethminer_fan_percent gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minerMonitors.size())
+			sample(_out, "ethminer_fan_percent", m_labels[m_devices[i].index], "", progress.minerMonitors[m_devices[i].index].fanP);
+	_out += "# HELP ethminer_power_watts Power draw of the device, where the driver tells.\n# TYPE ethminer_power_watts gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minerMonitors.size() && progress.minerMonitors[m_devices[i].index].powerW)
+			sample(_out, "ethminer_power_watts", m_labels[m_devices[i].index], "", progress.minerMonitors[m_devices[i].index].powerW);
+	_out += "# HELP ethminer_core_clock_mhz Core clock of the device, where the driver tells.\n# TYPE ethminer_core_clock_mhz gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minerMonitors.size() && progress.minerMonitors[m_devices[i].index].coreMHz)
+			sample(_out, "ethminer_core_clock_mhz", m_labels[m_devices[i].index], "", progress.minerMonitors[m_devices[i].index].coreMHz);
+	_out += "# HELP ethminer_memory_clock_mhz Memory clock of the device, where the driver tells.\n# TYPE ethminer_memory_clock_mhz gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minerMonitors.size() && progress.minerMonitors[m_devices[i].index].memMHz)
+			sample(_out, "ethminer_memory_clock_mhz", m_labels[m_devices[i].index], "", progress.minerMonitors[m_devices[i].index].memMHz);
+	_out += "# HELP ethminer_memory_utilization_percent Memory controller load of the device, where the driver tells.\n# TYPE ethminer_memory_utilization_percent gauge\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minerMonitors.size() && progress.minerMonitors[m_devices[i].index].memUtilP)
+			sample(_out, "ethminer_memory_utilization_percent", m_labels[m_devices[i].index], "", progress.minerMonitors[m_devices[i].index].memUtilP);
+	// With ethminer_metered_hashes_total, rate() of both gives hashes per joule over any range.
+	_out += "# HELP ethminer_energy_joules_total Energy the device drew while its power was known.\n# TYPE ethminer_energy_joules_total counter\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minersJoules.size() && progress.minersJoules[m_devices[i].index] > 0)
+			sample(_out, "ethminer_energy_joules_total", m_labels[m_devices[i].index], "", uint64_t(progress.minersJoules[m_devices[i].index]));
+	_out += "# HELP ethminer_metered_hashes_total Hashes the device computed while its power was known.\n# TYPE ethminer_metered_hashes_total counter\n";
+	for (size_t i = 0; i < m_deviceCount; ++i)
+		if (m_devices[i].index < progress.minersJoules.size() && progress.minersJoules[m_devices[i].index] > 0)
+			sample(_out, "ethminer_metered_hashes_total", m_labels[m_devices[i].index], "", progress.minersMeteredHashes[m_devices[i].index]);
+
+	_out += "# HELP ethminer_work_switch_seconds From the farm publishing new work to the device's first search on it.\n# TYPE ethminer_work_switch_seconds histogram\n";
+	histogram(_out, "ethminer_work_switch_seconds", &Device::workSwitch);
+	_out += "# HELP ethminer_search_seconds Device time of the search kernels, where profiled.\n# TYPE ethminer_search_seconds histogram\n";
+	histogram(_out, "ethminer_search_seconds", &Device::search);
+}
+
+void MetricsServer::histogram(std::string& _out, char const* _family, Histogram Device::* _h)
+{
+	for (size_t i = 0; i < m_deviceCount; ++i)
+	{
+		Histogram const& h = m_devices[i].*_h;
+		std::string const& labels = m_labels[m_devices[i].index];
+		if (!h.count)
+			continue;
+		for (unsigned b = 0; b < c_bounds; ++b)
+		{
+			_out += _family;
+			_out += "_bucket{";
+			_out += labels;
+			_out += ",le=\"";
+			_out += c_boundsLe[b];
+			_out += "\"} ";
+			append(_out, h.counts[b]);
+			_out += '\n';
+		}
+		_out += _family;
+		_out += "_bucket{";
+		_out += labels;
+		_out += ",le=\"+Inf\"} ";
+		append(_out, h.count);
+		_out += '\n';
+		_out += _family;
+		_out += "_sum{";
+		_out += labels;
+		_out += "} ";
+		appendSeconds(_out, h.sumUs);
+		_out += '\n';
+		_out += _family;
+		_out += "_count{";
+		_out += labels;
+		_out += "} ";
+		append(_out, h.count);
+		_out += '\n';
+	}
+}
@@ -0,0 +1,86 @@
+#ifndef _METRICSSERVER_H_
+#define _METRICSSERVER_H_
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <libdevcore/Reactor.h>
+#include <libethcore/Farm.h>
+
+using namespace dev;
+using namespace dev::eth;
+
+/**
+ * @brief Serves the farm's metrics over HTTP at /metrics, in the Prometheus
+ * text format. The names, help texts and labels are fixed or built once per
+ * device, and a scrape only formats numbers into buffers kept between the
+ * scrapes of a connection, so it costs microseconds however many rigs are
+ * scraped how often.
+ */
+class MetricsServer
+{
+public:
+	/// Latency histogram bucket bounds, in microseconds.
+	static const unsigned c_bounds = 16;
+	/// Connections kept at once; more are turned away.
+	static const unsigned c_maxSessions = 16;
+	/// Longest request head taken; longer ones close the connection.
+	static const size_t c_maxRequest = 8192;
+
+	MetricsServer(unsigned short _port, Farm& _farm);
+	~MetricsServer();
+
+private:
+	struct Session
+	{
+		explicit Session(boost::asio::io_service& _service): socket(_service), in(c_maxRequest) {}
+		boost::asio::ip::tcp::socket socket;
+		boost::asio::streambuf in;
+		std::string head;
+		std::string body;
+	};
+
+	struct Histogram
+	{
+		uint64_t counts[c_bounds];
+		uint64_t count;
+		uint64_t sumUs;
+	};
+
+	/// What a scrape reads of a miner, kept between scrapes.
+	struct Device
+	{
+		unsigned index;
+		HashRateStats rate;
+		uint64_t hashes;
+		uint64_t accepted;
+		uint64_t rejected;
+		uint64_t stale;
+		uint64_t probes;
+		uint64_t probesInvalid;
+		Histogram workSwitch;
+		Histogram search;
+	};
+
+	void accept();
+	void read(std::shared_ptr<Session> const& _s);
+	void respond(std::shared_ptr<Session> const& _s, size_t _n);
+	void end(std::shared_ptr<Session> const& _s);
+	/// Reads the farm into m_devices and formats all metrics to _out.
+	void render(std::string& _out);
+	void histogram(std::string& _out, char const* _family, Histogram Device::* _h);
+
+	Farm& m_farm;
+	ReactorStrand m_strand;  ///< Everything below is only touched on it.
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	bool m_running = true;
+	std::set<std::shared_ptr<Session>> m_sessions;
+	std::vector<Device> m_devices;     ///< The first m_deviceCount are current.
+	size_t m_deviceCount = 0;
+	std::vector<std::string> m_labels; ///< device="<index>", by miner index.
+	std::vector<std::string> m_names;  ///< device="<index>",name="<name>", by miner index.
+};
+
+#endif //_METRICSSERVER_H_
@@ -0,0 +1,239 @@
+#include "StatsStream.h"
+#include <libdevcore/Log.h>
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+char const* const c_farmNames[] = {"rate", "accepted", "rejected", "stale", "failed", "dropped"};
+char const* const c_deviceNames[] = {"rate", "hashes", "temp", "fan", "power", "core", "mem", "memutil", "joules", "accepted", "rejected", "stale"};
+
+std::string quoted(std::string const& _s)
+{
+	std::string ret = "\"";
+	for (char c: _s)
+		if (c == '"' || c == '\\')
+			(ret += '\\') += c;
+		else if (static_cast<unsigned char>(c) >= 0x20)
+			ret += c;
+	return ret + '"';
+}
+
+/// "<name>":<value>, with a comma before unless _first.
+void field(std::string& _out, bool& _first, char const* _name, uint64_t _v)
+{
+	if (!_first)
+		_out += ',';
+	_first = false;
+	_out += '"';
+	_out += _name;
+	_out += "\":";
+	_out += std::to_string(_v);
+}
+
+}
+
+const unsigned StatsStream::c_maxSessions;
+const unsigned StatsStream::c_farmFields;
+const unsigned StatsStream::c_deviceFields;
+
+StatsStream::StatsStream(unsigned short _port, Farm& _farm, unsigned _intervalMs):
+	m_farm(_farm),
+	m_intervalMs(_intervalMs),
+	m_acceptor(m_strand.service(), tcp::endpoint(tcp::v4(), _port)),
+	m_timer(m_strand.service())
+{
+	cnote << "Streaming stats at port" << _port << "every" << _intervalMs << "ms";
+	m_strand.post([this]()
+	{
+		accept();
+		tick();
+	});
+}
+
+StatsStream::~StatsStream()
+{
+	m_strand.post([this]()
+	{
+		m_running = false;
+		boost::system::error_code ec;
+		m_acceptor.close(ec);
+		m_timer.cancel(ec);
+		for (auto const& s: m_sessions)
+			s->socket.close(ec);
+		m_sessions.clear();
+	});
+	m_strand.drain();
+}
+
+void StatsStream::accept()
+{
+	auto s = std::make_shared<Session>(m_strand.service());
+	m_acceptor.async_accept(s->socket, m_strand.wrap([this, s](boost::system::error_code const& _ec)
+	{
+		if (!m_running)
+			return;
+		if (!_ec && m_sessions.size() < c_maxSessions)
+		{
+			boost::system::error_code ec;
+			s->socket.set_option(tcp::no_delay(true), ec);
+			m_sessions.insert(s);
+			read(s);
+			// Else the first tick sends them.
+			if (m_seq)
+				send(s, full());
+		}
+		accept();
+	}));
+}
+
+void StatsStream::read(std::shared_ptr<Session> const& _s)
+{
+	_s->socket.async_read_some(boost::asio::buffer(_s->in), m_strand.wrap([this, _s](boost::system::error_code const& _ec, size_t)
+	{
+		if (!m_running)
+			return;
+		if (_ec)
+			end(_s);
+		else
+			read(_s);
+	}));
+}
+
+void StatsStream::tick()
+{
+	std::swap(m_previous, m_stats);
+	collect(m_stats);
+	++m_seq;
+	m_full.reset();
+	// The positions of the devices change with them.
+	bool const reshaped = m_seq == 1 || m_stats.indexes != m_previous.indexes || m_stats.names != m_previous.names;
+	std::shared_ptr<std::string const> const update = reshaped ? full() : delta(m_previous);
+	for (auto const& s: m_sessions)
+		if (s->writing)
+			s->behind = true;
+		else
+			send(s, s->behind ? full() : update);
+
+	m_timer.expires_from_now(boost::posix_time::milliseconds(m_intervalMs));
+	m_timer.async_wait(m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (!_ec && m_running)
+			tick();
+	}));
+}
+
+void StatsStream::collect(Stats& _s)
+{
+	_s.indexes.clear();
+	_s.devices.clear();
+	size_t named = 0;
+	m_farm.forEachMiner([&](unsigned _index, Miner& _miner, HashRateStats const& _rate, uint64_t _hashes)
+	{
+		_s.indexes.push_back(_index);
+		// Names are taken from the last tick rather than asked for again.
+		bool const known = named < m_previous.indexes.size() && m_previous.indexes[named] == _index;
+		_s.names.resize(named + 1);
+		_s.names[named] = known ? m_previous.names[named] : quoted(_miner.Name());
+		++named;
+		_s.devices.push_back({{_rate.rate10s, _hashes, 0, 0, 0, 0, 0, 0, 0, _miner.acceptedLatency().count(), _miner.rejectedLatency().count(), _miner.staleLatency().count()}});
+	});
+	_s.names.resize(named);
+
+	// The snapshot of the last publishProgress(); no driver is asked here.
+	WorkingProgress const p = m_farm.miningProgress(true);
+	for (size_t i = 0; i < _s.devices.size(); ++i)
+		if (_s.indexes[i] < p.minerMonitors.size())
+		{
+			HwMonitor const& hw = p.minerMonitors[_s.indexes[i]];
+			_s.devices[i][2] = uint64_t(std::max(hw.tempC, 0));
+			_s.devices[i][3] = uint64_t(std::max(hw.fanP, 0));
+			_s.devices[i][4] = hw.powerW;
+			_s.devices[i][5] = hw.coreMHz;
+			_s.devices[i][6] = hw.memMHz;
+			_s.devices[i][7] = hw.memUtilP;
+			if (_s.indexes[i] < p.minersJoules.size())
+				_s.devices[i][8] = uint64_t(p.minersJoules[_s.indexes[i]]);
+		}
+
+	SolutionStats s = m_farm.getSolutionStats();
+	uint64_t const farm[c_farmFields] = {m_farm.hashRateStats().rate10s, s.getAccepts(), s.getRejects(), uint64_t(s.getAcceptedStales()) + s.getRejectedStales(), s.getFailures(), s.getDrops()};
+	std::copy(farm, farm + c_farmFields, _s.farm);
+}
+
+std::shared_ptr<std::string const> StatsStream::full() const
+{
+	if (m_full)
+		return m_full;
+	std::string out = "{\"seq\":" + std::to_string(m_seq) + ",\"full\":true,\"farm\":{";
+	bool first = true;
+	for (unsigned f = 0; f < c_farmFields; ++f)
+		field(out, first, c_farmNames[f], m_stats.farm[f]);
+	out += "},\"devices\":[";
+	for (size_t i = 0; i < m_stats.devices.size(); ++i)
+	{
+		out += i ? ",{" : "{";
+		first = true;
+		field(out, first, "index", m_stats.indexes[i]);
+		out += ",\"name\":" + m_stats.names[i];
+		for (unsigned f = 0; f < c_deviceFields; ++f)
+			field(out, first, c_deviceNames[f], m_stats.devices[i][f]);
+		out += '}';
+	}
+	out += "]}\n";
+	m_full = std::make_shared<std::string const>(std::move(out));
+	return m_full;
+}
+
+std::shared_ptr<std::string const> StatsStream::delta(Stats const& _old) const
+{
+	std::string out = "{\"seq\":" + std::to_string(m_seq);
+	std::string changed;
+	bool first = true;
+	for (unsigned f = 0; f < c_farmFields; ++f)
+		if (m_stats.farm[f] != _old.farm[f])
+			field(changed, first, c_farmNames[f], m_stats.farm[f]);
+	if (!changed.empty())
+		out += ",\"farm\":{" + changed + '}';
+
+	std::string devices;
+	for (size_t i = 0; i < m_stats.devices.size(); ++i)
+	{
+		changed.clear();
+		first = true;
+		for (unsigned f = 0; f < c_deviceFields; ++f)
+			if (m_stats.devices[i][f] != _old.devices[i][f])
+				field(changed, first, c_deviceNames[f], m_stats.devices[i][f]);
+		if (!changed.empty())
+			devices += (devices.empty() ? "\"" : ",\"") + std::to_string(i) + "\":{" + changed + '}';
+	}
+	if (!devices.empty())
+		out += ",\"devices\":{" + devices + '}';
+	out += "}\n";
+	return std::make_shared<std::string const>(std::move(out));
+}
+
+void StatsStream::send(std::shared_ptr<Session> const& _s, std::shared_ptr<std::string const> const& _m)
+{
+	_s->writing = true;
+	_s->behind = false;
+	_s->sending = _m;
+	boost::asio::async_write(_s->socket, boost::asio::buffer(*_m), m_strand.wrap([this, _s](boost::system::error_code const& _ec, size_t)
+	{
+		if (!m_running)
+			return;
+		_s->writing = false;
+		_s->sending.reset();
+		if (_ec)
+			end(_s);
+		else if (_s->behind)
+			send(_s, full());
+	}));
+}
+
+void StatsStream::end(std::shared_ptr<Session> const& _s)
+{
+	boost::system::error_code ec;
+	_s->socket.close(ec);
+	m_sessions.erase(_s);
+}
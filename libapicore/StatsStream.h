@@ -0,0 +1,85 @@
+#ifndef _STATSSTREAM_H_
+#define _STATSSTREAM_H_
+
+#include <array>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <libdevcore/Reactor.h>
+#include <libethcore/Farm.h>
+
+using namespace dev;
+using namespace dev::eth;
+
+/**
+ * @brief Pushes the farm's stats to subscribers, as newline-delimited JSON
+ * over TCP. A subscriber gets the full stats on connecting, then on every
+ * tick only what changed:
+ *
+ *   {"seq":1,"full":true,"farm":{"rate":...,...},"devices":[{"index":0,"name":...,"rate":...,...},...]}
+ *   {"seq":2,"farm":{"accepted":12},"devices":{"1":{"temp":63}}}
+ *
+ * where the devices of an update go by their position in the full stats.
+ *
+ * The stats are read once per tick and the update is built once for all
+ * subscribers, so any number of dashboards cost the same as one. One that
+ * cannot keep up gets the full stats again once it can.
+ */
+class StatsStream
+{
+public:
+	/// Subscribers kept at once; more are turned away.
+	static const unsigned c_maxSessions = 64;
+
+	StatsStream(unsigned short _port, Farm& _farm, unsigned _intervalMs);
+	~StatsStream();
+
+private:
+	static const unsigned c_farmFields = 6;
+	static const unsigned c_deviceFields = 12;
+
+	struct Stats
+	{
+		uint64_t farm[c_farmFields] = {};
+		std::vector<unsigned> indexes;   ///< Of the miners.
+		std::vector<std::string> names;  ///< JSON strings, quoted.
+		std::vector<std::array<uint64_t, c_deviceFields>> devices;
+	};
+
+	struct Session
+	{
+		explicit Session(boost::asio::io_service& _service): socket(_service) {}
+		boost::asio::ip::tcp::socket socket;
+		char in[256];
+		bool writing = false;
+		bool behind = true;  ///< Missed an update, so gets the full stats next.
+		std::shared_ptr<std::string const> sending;
+	};
+
+	void accept();
+	/// Reads and drops whatever the subscriber sends, to see it go.
+	void read(std::shared_ptr<Session> const& _s);
+	void tick();
+	void collect(Stats& _s);
+	std::shared_ptr<std::string const> full() const;
+	std::shared_ptr<std::string const> delta(Stats const& _old) const;
+	void send(std::shared_ptr<Session> const& _s, std::shared_ptr<std::string const> const& _m);
+	void end(std::shared_ptr<Session> const& _s);
+
+	Farm& m_farm;
+	unsigned const m_intervalMs;
+	ReactorStrand m_strand;  ///< Everything below is only touched on it.
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	boost::asio::deadline_timer m_timer;
+	bool m_running = true;
+	std::set<std::shared_ptr<Session>> m_sessions;
+	uint64_t m_seq = 0;
+	Stats m_stats;  ///< As of update m_seq.
+	Stats m_previous;
+	/// The full stats as of m_seq, built on demand.
+	mutable std::shared_ptr<std::string const> m_full;
+};
+
+#endif //_STATSSTREAM_H_
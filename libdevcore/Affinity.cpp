@@ -0,0 +1,217 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Affinity.cpp
+ * @date 2018
+ */
+
+#include "Affinity.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+#include "Guards.h"
+#include "Log.h"
+#include "Reactor.h"
+using namespace std;
+using namespace dev;
+
+namespace
+{
+
+Mutex x_affinity;
+bool s_minerAffinity = false;
+vector<unsigned> s_stratumCpus;
+vector<unsigned> s_verifyCpus;
+map<unsigned, unsigned> s_claims;	///< Miners per CPU.
+
+string readLine(string const& _path)
+{
+	ifstream f(_path);
+	string line;
+	getline(f, line);
+	return line;
+}
+
+string cpuListString(vector<unsigned> const& _cpus)
+{
+	ostringstream s;
+	for (size_t i = 0; i < _cpus.size(); ++i)
+		s << (i ? "," : "") << _cpus[i];
+	return s.str();
+}
+
+/// Prefers the memory of node @a _node for the calling thread's allocations.
+void preferNode(int _node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+	if (_node < 0 || _node >= 64)
+		return;
+	unsigned long mask = 1ul << _node;
+	// MPOL_PREFERRED, without needing libnuma: falls back to the other
+	// nodes once that one is full.
+	syscall(SYS_set_mempolicy, 1, &mask, 64ul);
+#else
+	(void)_node;
+#endif
+}
+
+}
+
+vector<unsigned> dev::parseCpuList(string const& _list)
+{
+	vector<unsigned> cpus;
+	istringstream s(_list);
+	string range;
+	while (getline(s, range, ','))
+	{
+		unsigned first;
+		unsigned last;
+		char dash;
+		istringstream r(range);
+		if (!(r >> first))
+			return {};
+		last = first;
+		if (r >> dash && (dash != '-' || !(r >> last) || last < first))
+			return {};
+		if (!r.eof() && !(r >> ws).eof())
+			return {};
+		for (unsigned c = first; c <= last; ++c)
+			cpus.push_back(c);
+	}
+	sort(cpus.begin(), cpus.end());
+	cpus.erase(unique(cpus.begin(), cpus.end()), cpus.end());
+	return cpus;
+}
+
+string dev::pciBusId(unsigned _domain, unsigned _bus, unsigned _device, unsigned _function)
+{
+	char id[16];
+	snprintf(id, sizeof(id), "%04x:%02x:%02x.%x", _domain & 0xffff, _bus & 0xff, _device & 0x1f, _function & 7);
+	return id;
+}
+
+bool dev::pinThisThread(vector<unsigned> const& _cpus)
+{
+#if defined(__linux__)
+	if (_cpus.empty())
+		return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned c: _cpus)
+		if (c < CPU_SETSIZE)
+			CPU_SET(c, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)_cpus;
+	return false;
+#endif
+}
+
+void dev::setMinerAffinity(bool _affinity)
+{
+	Guard l(x_affinity);
+	s_minerAffinity = _affinity;
+}
+
+void dev::setStratumCpus(vector<unsigned> const& _cpus)
+{
+	{
+		Guard l(x_affinity);
+		s_stratumCpus = _cpus;
+	}
+	if (_cpus.empty())
+		return;
+	Reactor::service().post([_cpus]() {
+		if (pinThisThread(_cpus))
+			cnote << "Networking on CPUs " << cpuListString(_cpus);
+		else
+			cwarn << "Cannot pin the networking thread to CPUs " << cpuListString(_cpus);
+	});
+}
+
+void dev::setVerifyCpus(vector<unsigned> const& _cpus)
+{
+	Guard l(x_affinity);
+	s_verifyCpus = _cpus;
+}
+
+void dev::pinVerifyThread()
+{
+	vector<unsigned> cpus;
+	{
+		Guard l(x_affinity);
+		cpus = s_verifyCpus;
+	}
+	if (!cpus.empty())
+		pinThisThread(cpus);
+}
+
+bool CpuClaim::pinNear(string const& _busId)
+{
+	release();
+	string const dir = "/sys/bus/pci/devices/" + _busId + "/";
+	vector<unsigned> local = parseCpuList(readLine(dir + "local_cpulist"));
+	int const node = atoi(readLine(dir + "numa_node").c_str());
+
+	{
+		Guard l(x_affinity);
+		if (!s_minerAffinity || local.empty())
+			return false;
+		// The CPUs the other threads were given only when there is no other.
+		vector<unsigned> free;
+		for (unsigned c: local)
+			if (find(s_stratumCpus.begin(), s_stratumCpus.end(), c) == s_stratumCpus.end() &&
+				find(s_verifyCpus.begin(), s_verifyCpus.end(), c) == s_verifyCpus.end())
+				free.push_back(c);
+		if (!free.empty())
+			local.swap(free);
+		unsigned best = local.front();
+		for (unsigned c: local)
+			if (s_claims[c] < s_claims[best])
+				best = c;
+		if (!pinThisThread({best}))
+		{
+			cwarn << "Cannot pin to CPU " << best << " near " << _busId;
+			return false;
+		}
+		++s_claims[best];
+		m_cpu = int(best);
+	}
+	preferNode(node);
+	cnote << "On CPU " << m_cpu << (node >= 0 ? ", NUMA node " + to_string(node) : string()) << ", near " << _busId;
+	return true;
+}
+
+void CpuClaim::release()
+{
+	if (m_cpu < 0)
+		return;
+	Guard l(x_affinity);
+	auto it = s_claims.find(unsigned(m_cpu));
+	if (it != s_claims.end() && it->second)
+		--it->second;
+	m_cpu = -1;
+}
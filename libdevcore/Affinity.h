@@ -0,0 +1,80 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Affinity.h
+ * @date 2018
+ *
+ * Placement of the threads on the CPUs, and of their memory on the NUMA
+ * nodes. Only does anything on Linux.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace dev
+{
+
+/// CPUs in the sysfs list format, e.g. "0-7,16-23". Empty if malformed.
+std::vector<unsigned> parseCpuList(std::string const& _list);
+
+/// The sysfs name of a PCI device, e.g. "0000:03:00.0".
+std::string pciBusId(unsigned _domain, unsigned _bus, unsigned _device, unsigned _function);
+
+/// Pins the calling thread to @a _cpus; false if it cannot be.
+bool pinThisThread(std::vector<unsigned> const& _cpus);
+
+/// Has the miners pin their threads near their devices, see CpuClaim.
+void setMinerAffinity(bool _affinity);
+
+/// Pins the networking thread (stratum, API streams) to @a _cpus.
+void setStratumCpus(std::vector<unsigned> const& _cpus);
+
+/// Where the threads computing light caches, for the solutions' CPU
+/// verification, are pinned; empty leaves them be.
+void setVerifyCpus(std::vector<unsigned> const& _cpus);
+/// For such threads to call first.
+void pinVerifyThread();
+
+/**
+ * @brief A CPU of the NUMA node a device is attached to, held by one miner
+ * thread. Each miner takes the CPU of its device's node the fewest miners
+ * hold, keeping off the stratum and verification CPUs while there are
+ * others; its memory allocations are preferred from that node, so the
+ * host buffers the driver allocates for the device are local to it.
+ */
+class CpuClaim
+{
+public:
+	CpuClaim() = default;
+	~CpuClaim() { release(); }
+	CpuClaim(CpuClaim const&) = delete;
+	CpuClaim& operator=(CpuClaim const&) = delete;
+
+	/// Pins the calling thread near the PCI device @a _busId, if enabled by
+	/// setMinerAffinity(). false if not enabled or the device's node is unknown.
+	bool pinNear(std::string const& _busId);
+	void release();
+
+	/// -1 until pinned.
+	int cpu() const { return m_cpu; }
+
+private:
+	int m_cpu = -1;
+};
+
+}
@@ -0,0 +1,53 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file CommonIO.cpp
+ * @date 2018
+ */
+
+#include "CommonIO.h"
+#include <cstdio>
+#include <fstream>
+
+using namespace std;
+
+bool dev::writeFileAtomically(string const& _path, function<void(ostream&)> const& _write)
+{
+	string const tmpPath = _path + ".tmp";
+	{
+		ofstream f(tmpPath, ios::binary | ios::trunc);
+		if (f)
+			_write(f);
+		f.flush();
+		if (!f)
+		{
+			f.close();
+			remove(tmpPath.c_str());
+			return false;
+		}
+	}
+	if (rename(tmpPath.c_str(), _path.c_str()) != 0)
+	{
+		// Windows does not rename over an existing file.
+		remove(_path.c_str());
+		if (rename(tmpPath.c_str(), _path.c_str()) != 0)
+		{
+			remove(tmpPath.c_str());
+			return false;
+		}
+	}
+	return true;
+}
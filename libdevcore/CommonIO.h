@@ -0,0 +1,37 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file CommonIO.h
+ * @date 2018
+ *
+ * File input/output functions.
+ */
+
+#pragma once
+
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace dev
+{
+
+/// Writes a file by calling @a _write with a binary stream to it. Written under
+/// a temporary name and renamed, so readers only ever see complete files.
+/// @return false, leaving nothing behind, if the file could not be written.
+bool writeFileAtomically(std::string const& _path, std::function<void(std::ostream&)> const& _write);
+
+}
@@ -21,6 +21,9 @@
 
 #include "Log.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
 #include <thread>
 #ifdef __APPLE__
 #include <pthread.h>
@@ -33,12 +36,233 @@ using namespace dev;
 
 // Logging
 int dev::g_logVerbosity = 5;
-mutex x_logOverride;
 
-/// Map of Log Channel types to bool, false forces the channel to be disabled, true forces it to be enabled.
-/// If a channel has no entry, then it will output as long as its verbosity (LogChannel::verbosity) is less than
-/// or equal to the currently output verbosity (g_logVerbosity).
-static map<type_info const*, bool> s_logOverride;
+namespace
+{
+
+/// The lines one thread queued for the log thread: single producer, single consumer.
+class LogRing
+{
+public:
+	static const unsigned c_size = 1024;
+
+	/// Producer only. false if full.
+	bool push(uint64_t _seq, string& _line)
+	{
+		uint64_t const head = m_head.load(memory_order_relaxed);
+		if (head - m_tail.load(memory_order_acquire) == c_size)
+		{
+			m_dropped.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		Line& l = m_lines[head % c_size];
+		l.seq = _seq;
+		l.text.swap(_line);
+		m_head.store(head + 1, memory_order_release);
+		return true;
+	}
+
+	/// Consumer only: moves the lines queued to @a _out.
+	void drain(vector<pair<uint64_t, string>>& _out)
+	{
+		uint64_t tail = m_tail.load(memory_order_relaxed);
+		uint64_t const head = m_head.load(memory_order_acquire);
+		for (; tail != head; ++tail)
+		{
+			Line& l = m_lines[tail % c_size];
+			_out.emplace_back(l.seq, string());
+			_out.back().second.swap(l.text);
+		}
+		m_tail.store(tail, memory_order_release);
+	}
+
+	uint64_t takeDropped() { return m_dropped.exchange(0, memory_order_relaxed); }
+	bool empty() const { return m_tail.load(memory_order_relaxed) == m_head.load(memory_order_acquire); }
+
+	atomic<bool> orphaned = {false};	///< Its thread ended.
+
+private:
+	struct Line
+	{
+		uint64_t seq = 0;
+		string text;
+	};
+
+	atomic<uint64_t> m_head = {0};
+	atomic<uint64_t> m_tail = {0};
+	atomic<uint64_t> m_dropped = {0};
+	Line m_lines[c_size];
+};
+
+/// Removes the terminal colours, for files.
+string uncoloured(string const& _s)
+{
+	string r;
+	r.reserve(_s.size());
+	for (size_t i = 0; i < _s.size(); ++i)
+		if (_s[i] == '\x1b' && i + 1 < _s.size() && _s[i + 1] == '[')
+		{
+			i += 2;
+			while (i < _s.size() && !isalpha((unsigned char)_s[i]))
+				++i;
+		}
+		else
+			r += _s[i];
+	return r;
+}
+
+/**
+ * Where the log goes. The producers only touch their own ring and, once per
+ * thread, the list of rings; the log thread wakes up every few milliseconds
+ * and writes all that was queued in one go, in the order it was logged.
+ */
+class LogSink
+{
+public:
+	static LogSink& get()
+	{
+		// Never destroyed: threads may log until the very end.
+		static LogSink* s_sink = new LogSink;
+		return *s_sink;
+	}
+
+	atomic<bool> async = {false};
+
+	void setAsync(bool _async)
+	{
+		unique_lock<Mutex> l(x_rings);
+		if (_async == (m_thread.joinable()))
+			return;
+		if (_async)
+		{
+			m_running = true;
+			m_thread = thread([this]() { run(); });
+			static bool s_atExit = false;
+			if (!s_atExit)
+				atexit([]() { LogSink::get().setAsync(false); });
+			s_atExit = true;
+			async = true;
+		}
+		else
+		{
+			async = false;
+			m_running = false;
+			m_wake.notify_one();
+			thread t;
+			t.swap(m_thread);
+			l.unlock();
+			t.join();
+		}
+	}
+
+	bool setFile(string const& _path)
+	{
+		FILE* f = fopen(_path.c_str(), "a");
+		if (!f)
+			return false;
+		Guard l(x_out);
+		if (m_file)
+			fclose(m_file);
+		m_file = f;
+		return true;
+	}
+
+	void write(string const& _s)
+	{
+		Guard l(x_out);
+		if (m_file)
+		{
+			string const line = uncoloured(_s) + '\n';
+			fwrite(line.data(), 1, line.size(), m_file);
+			fflush(m_file);
+		}
+		else
+			cerr << _s + '\n';
+	}
+
+	void queue(string& _s)
+	{
+		thread_local shared_ptr<LogRing> t_ring;
+		thread_local struct Owner
+		{
+			~Owner() { if (ring) ring->orphaned = true; }
+			LogRing* ring = nullptr;
+		} t_owner;
+		if (!t_ring)
+		{
+			t_ring = make_shared<LogRing>();
+			t_owner.ring = t_ring.get();
+			Guard l(x_rings);
+			m_rings.push_back(t_ring);
+		}
+		t_ring->push(m_seq.fetch_add(1, memory_order_relaxed), _s);
+	}
+
+private:
+	void run()
+	{
+		setThreadName("log");
+		vector<pair<uint64_t, string>> lines;
+		string out;
+		unique_lock<Mutex> l(x_rings);
+		for (bool last = false; !last; )
+		{
+			last = !m_running;
+			uint64_t dropped = 0;
+			for (auto it = m_rings.begin(); it != m_rings.end(); )
+			{
+				bool const orphaned = (*it)->orphaned;
+				(*it)->drain(lines);
+				dropped += (*it)->takeDropped();
+				if (orphaned && (*it)->empty())
+					it = m_rings.erase(it);
+				else
+					++it;
+			}
+			l.unlock();
+
+			sort(lines.begin(), lines.end(), [](pair<uint64_t, string> const& _a, pair<uint64_t, string> const& _b) { return _a.first < _b.first; });
+			if (!lines.empty() || dropped)
+			{
+				Guard o(x_out);
+				out.clear();
+				for (auto const& line: lines)
+					(out += m_file ? uncoloured(line.second) : line.second) += '\n';
+				if (dropped)
+					out += "Log: " + to_string(dropped) + " lines dropped, the log fell behind\n";
+				fwrite(out.data(), 1, out.size(), m_file ? m_file : stderr);
+				fflush(m_file ? m_file : stderr);
+			}
+			lines.clear();
+
+			l.lock();
+			if (m_running)
+				m_wake.wait_for(l, chrono::milliseconds(10));
+		}
+	}
+
+	Mutex x_rings;				///< Guards m_rings, m_running and m_thread.
+	vector<shared_ptr<LogRing>> m_rings;
+	bool m_running = false;
+	condition_variable m_wake;
+	thread m_thread;
+	atomic<uint64_t> m_seq = {0};
+
+	Mutex x_out;
+	FILE* m_file = nullptr;
+};
+
+}
+
+void dev::setLogAsync(bool _async)
+{
+	LogSink::get().setAsync(_async);
+}
+
+bool dev::setLogFile(string const& _path)
+{
+	return LogSink::get().setFile(_path);
+}
 
 #ifdef _WIN32
 const char* LogChannel::name() { return EthGray "..."; }
@@ -56,24 +280,31 @@ const char* NoteChannel::name() { return EthBlue "  ℹ"; }
 const char* DebugChannel::name() { return EthWhite "  ◇"; }
 #endif
 
-LogOutputStreamBase::LogOutputStreamBase(char const* _id, std::type_info const* _info, unsigned _v, bool _autospacing):
+LogOutputStreamBase::LogOutputStreamBase(char const* _id, std::type_info const*, unsigned _v, bool _autospacing):
 	m_autospacing(_autospacing),
 	m_verbosity(_v)
 {
-	Guard l(x_logOverride);
-	auto it = s_logOverride.find(_info);
-	if ((it != s_logOverride.end() && it->second) || (it == s_logOverride.end() && (int)_v <= g_logVerbosity))
+	// The clock is formatted once a second per thread.
+	thread_local time_t t_time = 0;
+	thread_local char t_buf[24] = {};
+	time_t rawTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+	if (rawTime != t_time)
 	{
-		time_t rawTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-		char buf[24];
-		if (strftime(buf, 24, "%X", localtime(&rawTime)) == 0)
-			buf[0] = '\0'; // empty if case strftime fails
-		static char const* c_begin = "  " EthViolet;
-		static char const* c_sep1 = EthReset EthBlack "|" EthNavy;
-		static char const* c_sep2 = EthReset EthBlack "|" EthTeal;
-		static char const* c_end = EthReset "  ";
-		m_sstr << _id << c_begin << buf << c_sep1 << std::left << std::setw(8) << getThreadName() << ThreadContext::join(c_sep2) << c_end;
+		struct tm local;
+#ifdef _WIN32
+		localtime_s(&local, &rawTime);
+#else
+		localtime_r(&rawTime, &local);
+#endif
+		if (strftime(t_buf, 24, "%X", &local) == 0)
+			t_buf[0] = '\0'; // empty if case strftime fails
+		t_time = rawTime;
 	}
+	static char const* c_begin = "  " EthViolet;
+	static char const* c_sep1 = EthReset EthBlack "|" EthNavy;
+	static char const* c_sep2 = EthReset EthBlack "|" EthTeal;
+	static char const* c_end = EthReset "  ";
+	m_sstr << _id << c_begin << t_buf << c_sep1 << std::left << std::setw(8) << getThreadName() << ThreadContext::join(c_sep2) << c_end;
 }
 
 /// Associate a name with each thread for nice logging.
@@ -130,13 +361,19 @@ string dev::ThreadContext::join(string const& _prior)
 	return g_logThreadContext.join(_prior);
 }
 
+/// The name of the thread, as last asked for or set; asking the system is a syscall.
+thread_local static std::string t_threadName;
+
 string dev::getThreadName()
 {
+	if (!t_threadName.empty())
+		return t_threadName;
 #if defined(__linux__) || defined(__APPLE__)
 	char buffer[128];
 	pthread_getname_np(pthread_self(), buffer, 127);
 	buffer[127] = 0;
-	return buffer;
+	t_threadName = buffer;
+	return t_threadName;
 #else
 	return ThreadLocalLogName::name ? ThreadLocalLogName::name : "<unknown>";
 #endif
@@ -151,9 +388,14 @@ void dev::setThreadName(char const* _n)
 #else
 	ThreadLocalLogName::name = _n;
 #endif
+	t_threadName.clear();
 }
 
-void dev::simpleDebugOut(std::string const& _s)
+void dev::simpleDebugOut(std::string _s)
 {
-        std::cerr << _s + '\n';
+	LogSink& sink = LogSink::get();
+	if (sink.async.load(std::memory_order_relaxed))
+		sink.queue(_s);
+	else
+		sink.write(_s);
 }
@@ -43,12 +43,24 @@ public:
 	template <class T> NullOutputStream& operator<<(T const&) { return *this; }
 };
 
-/// A simple log-output function that prints log messages to stdout.
-void simpleDebugOut(std::string const&);
+/// Writes a log line to the log, or queues it for the log thread, see setLogAsync().
+void simpleDebugOut(std::string _s);
 
 /// The logging system's current verbosity.
 extern int g_logVerbosity;
 
+/**
+ * @brief Has the log lines written by a thread of their own. Each logging
+ * thread queues its lines in a ring of its own, without locks or waiting on
+ * the console; lines that find their ring full are dropped and counted.
+ * Off by default; lines queued are written at exit.
+ */
+void setLogAsync(bool _async);
+
+/// Writes the log to @a _path instead of stderr, without the colours.
+/// @return false if it cannot be opened.
+bool setLogFile(std::string const& _path);
+
 class ThreadContext
 {
 public:
@@ -101,6 +113,9 @@ public:
 		m_logTag = LogTag::None;
 	}
 
+	/// Whether the entry ends (or starts) here, for the auto spacing.
+	bool atSpace() const { return !m_buf.last() || m_buf.last() == ' '; }
+
 	void append(unsigned long _t) { m_sstr << EthBlue << _t << EthReset; }
 	void append(long _t) { m_sstr << EthBlue << _t << EthReset; }
 	void append(unsigned int _t) { m_sstr << EthBlue << _t << EthReset; }
@@ -189,9 +204,16 @@ public:
 	}
 
 protected:
+	/// A string buffer that tells its last character without copying itself.
+	struct Buffer: std::stringbuf
+	{
+		char last() const { return pptr() > pbase() ? pptr()[-1] : 0; }
+	};
+
 	bool m_autospacing = false;
 	unsigned m_verbosity = 0;
-	std::stringstream m_sstr;	///< The accrued log entry.
+	Buffer m_buf;
+	std::ostream m_sstr{&m_buf};	///< The accrued log entry.
 	LogTag m_logTag = LogTag::None;
 };
 
@@ -204,15 +226,19 @@ public:
 	/// If _term is true the the prefix info is terminated with a ']' character; if not it ends only with a '|' character.
 	LogOutputStream(): LogOutputStreamBase(Id::name(), &typeid(Id), Id::verbosity, _AutoSpacing) {}
 
-	/// Destructor. Posts the accrued log entry to the g_logPost function.
-	~LogOutputStream() { if (Id::verbosity <= g_logVerbosity) simpleDebugOut(m_sstr.str()); }
+	/// Whether the channel logs at the current verbosity; clog() checks it
+	/// before a stream is made, let alone anything formatted.
+	static bool enabled() { return Id::verbosity <= g_logVerbosity; }
+
+	/// Destructor. Posts the accrued log entry to simpleDebugOut().
+	~LogOutputStream() { simpleDebugOut(m_buf.str()); }
 
-	LogOutputStream& operator<<(std::string const& _t) { if (Id::verbosity <= g_logVerbosity) { if (_AutoSpacing && m_sstr.str().size() && m_sstr.str().back() != ' ') m_sstr << " "; comment(_t); } return *this; }
+	LogOutputStream& operator<<(std::string const& _t) { if (_AutoSpacing && !atSpace()) m_sstr << " "; comment(_t); return *this; }
 
 	LogOutputStream& operator<<(LogTag _t) { m_logTag = _t; return *this; }
 
 	/// Shift arbitrary data to the log. Spaces will be added between items as required.
-	template <class T> LogOutputStream& operator<<(T const& _t) { if (Id::verbosity <= g_logVerbosity) { if (_AutoSpacing && m_sstr.str().size() && m_sstr.str().back() != ' ') m_sstr << " "; append(_t); } return *this; }
+	template <class T> LogOutputStream& operator<<(T const& _t) { if (_AutoSpacing && !atSpace()) m_sstr << " "; append(_t); return *this; }
 };
 
 // Kill all logs when when NLOG is defined.
@@ -221,11 +247,11 @@ public:
 #define cslog(X) nslog(X)
 #else
 #if NDEBUG
-#define clog(X) if (X::debug) {} else dev::LogOutputStream<X, true>()
-#define cslog(X) if (X::debug) {} else dev::LogOutputStream<X, false>()
+#define clog(X) if (X::debug || !dev::LogOutputStream<X, true>::enabled()) {} else dev::LogOutputStream<X, true>()
+#define cslog(X) if (X::debug || !dev::LogOutputStream<X, false>::enabled()) {} else dev::LogOutputStream<X, false>()
 #else
-#define clog(X) dev::LogOutputStream<X, true>()
-#define cslog(X) dev::LogOutputStream<X, false>()
+#define clog(X) if (!dev::LogOutputStream<X, true>::enabled()) {} else dev::LogOutputStream<X, true>()
+#define cslog(X) if (!dev::LogOutputStream<X, false>::enabled()) {} else dev::LogOutputStream<X, false>()
 #endif
 #endif
 
@@ -0,0 +1,179 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file MpscQueue.h
+ * @date 2018
+ *
+ * Queues with any number of producers and one consumer.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Guards.h"
+
+namespace dev
+{
+
+/**
+ * @brief Producers push without locking (a CAS on the list head); the consumer
+ * takes everything queued at once. Meant for a few items in bursts, such as
+ * solutions from miner threads to a submitter thread.
+ */
+template <class T>
+class MpscQueue
+{
+public:
+	MpscQueue() = default;
+	MpscQueue(MpscQueue const&) = delete;
+	MpscQueue& operator=(MpscQueue const&) = delete;
+
+	~MpscQueue()
+	{
+		Node* n = m_head.exchange(nullptr);
+		while (n)
+		{
+			Node* next = n->next;
+			delete n;
+			n = next;
+		}
+	}
+
+	/// Never blocks on the consumer.
+	void push(T const& _item)
+	{
+		Node* n = new Node{_item, m_head.load(std::memory_order_relaxed)};
+		while (!m_head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed))
+		{}
+		// The waiter re-checks the queue under x_wait, so notifying without
+		// holding it cannot lose the wake-up for more than one wait() period.
+		m_wake.notify_one();
+	}
+
+	/// Appends all queued items to @a _out, oldest first. Consumer only.
+	/// @return false if there were none.
+	bool popAll(std::vector<T>& _out)
+	{
+		Node* n = m_head.exchange(nullptr, std::memory_order_acquire);
+		if (!n)
+			return false;
+		size_t const begin = _out.size();
+		while (n)
+		{
+			_out.push_back(std::move(n->item));
+			Node* next = n->next;
+			delete n;
+			n = next;
+		}
+		std::reverse(_out.begin() + begin, _out.end());
+		return true;
+	}
+
+	/// Blocks until something was pushed, for at most @a _timeout.
+	template <class Rep, class Period>
+	void wait(std::chrono::duration<Rep, Period> _timeout)
+	{
+		UniqueGuard l(x_wait);
+		m_wake.wait_for(l, _timeout, [this]() { return m_head.load(std::memory_order_relaxed) != nullptr; });
+	}
+
+private:
+	struct Node
+	{
+		T item;
+		Node* next;
+	};
+
+	std::atomic<Node*> m_head = {nullptr};
+	Mutex x_wait;
+	std::condition_variable m_wake;
+};
+
+/**
+ * @brief Of a fixed capacity, taken once: pushing and popping never allocate.
+ * Producers claim a cell with a CAS on the tail; each cell's sequence number
+ * tells whether it is free, or filled and ready for the consumer.
+ */
+template <class T>
+class BoundedMpscQueue
+{
+public:
+	/// Holds @a _capacity items, rounded up to a power of two.
+	explicit BoundedMpscQueue(size_t _capacity)
+	{
+		size_t size = 2;
+		while (size < _capacity)
+			size *= 2;
+		m_mask = size - 1;
+		m_cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; ++i)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	BoundedMpscQueue(BoundedMpscQueue const&) = delete;
+	BoundedMpscQueue& operator=(BoundedMpscQueue const&) = delete;
+
+	/// Never blocks. @return false if full, leaving @a _item to the caller.
+	bool push(T const& _item)
+	{
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+		Cell* c;
+		while (true)
+		{
+			c = &m_cells[pos & m_mask];
+			intptr_t const diff = (intptr_t)c->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+			if (diff == 0 && m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+			if (diff < 0)
+				return false;
+			if (diff > 0)
+				pos = m_tail.load(std::memory_order_relaxed);
+		}
+		c->item = _item;
+		c->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// Takes the oldest item. Consumer only. @return false if there was none.
+	bool pop(T& _item)
+	{
+		Cell& c = m_cells[m_head & m_mask];
+		if (c.sequence.load(std::memory_order_acquire) != m_head + 1)
+			return false;
+		_item = c.item;
+		c.sequence.store(m_head + m_mask + 1, std::memory_order_release);
+		++m_head;
+		return true;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	std::unique_ptr<Cell[]> m_cells;
+	size_t m_mask = 0;
+	std::atomic<size_t> m_tail = {0};
+	size_t m_head = 0;	///< The consumer's own.
+};
+
+}
@@ -0,0 +1,55 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Reactor.cpp
+ * @date 2018
+ */
+
+#include "Reactor.h"
+
+#include <chrono>
+#include "Log.h"
+using namespace std;
+using namespace dev;
+
+Reactor::Reactor():
+	m_work(m_service),
+	m_thread([this]()
+	{
+		setThreadName("io");
+		m_service.run();
+	})
+{
+}
+
+Reactor::~Reactor()
+{
+	m_service.stop();
+	m_thread.join();
+}
+
+boost::asio::io_service& Reactor::service()
+{
+	static Reactor s_reactor;
+	return s_reactor.m_service;
+}
+
+void ReactorStrand::drain()
+{
+	// Each handler holds a copy of m_guard until asio destroys it.
+	while (m_guard.use_count() > 1)
+		this_thread::sleep_for(chrono::milliseconds(1));
+}
@@ -0,0 +1,161 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Reactor.h
+ * @date 2018
+ *
+ * The io_service shared by pool connections and the farm's timers.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <boost/asio.hpp>
+
+namespace dev
+{
+
+/// Room for one handler at a time, for those posted over and over from threads
+/// other than the Reactor's, whose handlers asio would otherwise allocate on the
+/// heap each time. A handler too large, or posted while the room is taken, is
+/// allocated as usual.
+class HandlerMemory
+{
+public:
+	HandlerMemory() = default;
+	HandlerMemory(HandlerMemory const&) = delete;
+	HandlerMemory& operator=(HandlerMemory const&) = delete;
+
+	void* allocate(std::size_t _size)
+	{
+		if (_size <= sizeof(m_storage) && !m_used.exchange(true, std::memory_order_acquire))
+			return &m_storage;
+		return ::operator new(_size);
+	}
+
+	void deallocate(void* _p)
+	{
+		if (_p == &m_storage)
+			m_used.store(false, std::memory_order_release);
+		else
+			::operator delete(_p);
+	}
+
+private:
+	typename std::aligned_storage<256>::type m_storage;
+	std::atomic<bool> m_used = {false};
+};
+
+/// Hands asio the memory of a HandlerMemory for the handlers it is given with.
+template <class T>
+struct HandlerAllocator
+{
+	using value_type = T;
+
+	explicit HandlerAllocator(HandlerMemory& _memory): memory(&_memory) {}
+	template <class U>
+	HandlerAllocator(HandlerAllocator<U> const& _other): memory(_other.memory) {}
+
+	T* allocate(std::size_t _n) { return static_cast<T*>(memory->allocate(sizeof(T) * _n)); }
+	void deallocate(T* _p, std::size_t) { memory->deallocate(_p); }
+
+	template <class U>
+	bool operator==(HandlerAllocator<U> const& _other) const { return memory == _other.memory; }
+	template <class U>
+	bool operator!=(HandlerAllocator<U> const& _other) const { return memory != _other.memory; }
+
+	HandlerMemory* memory;
+};
+
+/// One io_service and one thread for all asynchronous networking and timers,
+/// rather than a thread per pool connection. Started on first use and
+/// stopped at exit; handlers must not block.
+class Reactor
+{
+public:
+	static boost::asio::io_service& service();
+
+private:
+	Reactor();
+	~Reactor();
+
+	boost::asio::io_service m_service;
+	boost::asio::io_service::work m_work;  ///< Keeps run() going while idle.
+	std::thread m_thread;
+};
+
+/// The handlers of one connection or timer owner, run one at a time on the
+/// Reactor. Counts those handed out, so the owner can wait for them all to
+/// be gone before it is destroyed.
+class ReactorStrand
+{
+	template <class H>
+	struct Guarded
+	{
+		std::shared_ptr<void> guard;
+		H handler;
+		template <class... A>
+		void operator()(A&&... _a) { handler(std::forward<A>(_a)...); }
+
+		using allocator_type = typename boost::asio::associated_allocator<H>::type;
+		allocator_type get_allocator() const { return boost::asio::get_associated_allocator(handler); }
+	};
+
+	template <class H>
+	struct InMemory
+	{
+		HandlerMemory* memory;
+		H handler;
+		template <class... A>
+		void operator()(A&&... _a) { handler(std::forward<A>(_a)...); }
+
+		using allocator_type = HandlerAllocator<void>;
+		allocator_type get_allocator() const { return allocator_type(*memory); }
+	};
+
+public:
+	ReactorStrand(): m_strand(Reactor::service()), m_guard(std::make_shared<char>(0)) {}
+
+	boost::asio::io_service& service() { return Reactor::service(); }
+
+	/// For the completion handlers of async operations.
+	template <class H>
+	auto wrap(H _h) -> decltype(std::declval<boost::asio::io_service::strand&>().wrap(std::declval<Guarded<H>>()))
+	{
+		return m_strand.wrap(Guarded<H>{m_guard, std::move(_h)});
+	}
+
+	template <class H>
+	void post(H _h) { m_strand.post(Guarded<H>{m_guard, std::move(_h)}); }
+	/// Posts _h in _memory, which must outlive it.
+	template <class H>
+	void post(HandlerMemory& _memory, H _h) { post(InMemory<H>{&_memory, std::move(_h)}); }
+
+	/// Blocks until every handler wrapped or posted so far has run or been
+	/// dropped. Cancel the pending operations first; never call from the
+	/// Reactor thread.
+	void drain();
+
+private:
+	boost::asio::io_service::strand m_strand;
+	std::shared_ptr<void> m_guard;
+};
+
+}
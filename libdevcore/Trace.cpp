@@ -0,0 +1,318 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Trace.cpp
+ * @date 2018
+ */
+
+#include "Trace.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "Guards.h"
+#include "Log.h"
+using namespace std;
+using namespace dev;
+
+atomic<bool> dev::g_tracing = {false};
+
+namespace
+{
+
+struct TraceEvent
+{
+	char const* name;
+	char const* argName;
+	uint64_t arg;
+	uint64_t ts;
+	uint64_t dur;
+	char phase;		///< 'X' complete, 'i' instant.
+};
+
+/// The events one thread recorded: single producer, single consumer.
+class TraceRing
+{
+public:
+	static const unsigned c_size = 8192;
+
+	TraceRing(unsigned _tid, string const& _threadName): tid(_tid), threadName(_threadName) {}
+
+	/// Producer only.
+	void push(TraceEvent const& _e)
+	{
+		uint64_t const head = m_head.load(memory_order_relaxed);
+		if (head - m_tail.load(memory_order_acquire) == c_size)
+		{
+			m_dropped.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+		m_events[head % c_size] = _e;
+		m_head.store(head + 1, memory_order_release);
+	}
+
+	/// Consumer only: moves the events queued to @a _out.
+	void drain(vector<TraceEvent>& _out)
+	{
+		uint64_t tail = m_tail.load(memory_order_relaxed);
+		uint64_t const head = m_head.load(memory_order_acquire);
+		for (; tail != head; ++tail)
+			_out.push_back(m_events[tail % c_size]);
+		m_tail.store(tail, memory_order_release);
+	}
+
+	uint64_t takeDropped() { return m_dropped.exchange(0, memory_order_relaxed); }
+	bool empty() const { return m_tail.load(memory_order_relaxed) == m_head.load(memory_order_acquire); }
+
+	unsigned const tid;
+	string const threadName;
+	bool named = false;					///< Consumer only: its name is in the trace.
+	atomic<bool> orphaned = {false};	///< Its thread ended.
+
+private:
+	atomic<uint64_t> m_head = {0};
+	atomic<uint64_t> m_tail = {0};
+	atomic<uint64_t> m_dropped = {0};
+	TraceEvent m_events[c_size];
+};
+
+string escaped(string const& _s)
+{
+	string r;
+	for (char c: _s)
+		if (c == '"' || c == '\\')
+			(r += '\\') += c;
+		else if ((unsigned char)c >= 0x20)
+			r += c;
+	return r;
+}
+
+/**
+ * Writes the events out as a JSON array, flushed every 100 ms. The array is
+ * only closed by stop(); the trace viewers take it unclosed, so the trace
+ * of a miner that crashed still loads.
+ */
+class Tracer
+{
+public:
+	static Tracer& get()
+	{
+		// Never destroyed: threads may trace until the very end.
+		static Tracer* s_tracer = new Tracer;
+		return *s_tracer;
+	}
+
+	bool start(string const& _path)
+	{
+		stop();
+		FILE* f = fopen(_path.c_str(), "w");
+		if (!f)
+			return false;
+		fputs("[\n", f);
+
+		unique_lock<Mutex> l(x_rings);
+		// What was queued after the last trace stopped belongs to none.
+		vector<TraceEvent> stale;
+		collect(stale);
+		m_out.clear();
+		for (auto const& r: m_rings)
+			r->named = false;
+		m_file = f;
+		m_first = true;
+		m_running = true;
+		m_thread = thread([this]() { run(); });
+		if (!m_atExit)
+			atexit([]() { Tracer::get().stop(); });
+		m_atExit = true;
+		g_tracing = true;
+		return true;
+	}
+
+	void stop()
+	{
+		unique_lock<Mutex> l(x_rings);
+		if (!m_thread.joinable())
+			return;
+		g_tracing = false;
+		m_running = false;
+		m_wake.notify_one();
+		thread t;
+		t.swap(m_thread);
+		l.unlock();
+		t.join();
+	}
+
+	void record(TraceEvent const& _e)
+	{
+		thread_local shared_ptr<TraceRing> t_ring;
+		thread_local struct Owner
+		{
+			~Owner() { if (ring) ring->orphaned = true; }
+			TraceRing* ring = nullptr;
+		} t_owner;
+		if (!t_ring)
+		{
+			Guard l(x_rings);
+			t_ring = make_shared<TraceRing>(++m_lastTid, getThreadName());
+			t_owner.ring = t_ring.get();
+			m_rings.push_back(t_ring);
+		}
+		t_ring->push(_e);
+	}
+
+private:
+	/// Drains the rings into @a _events. Call with x_rings held.
+	void collect(vector<TraceEvent>& _events)
+	{
+		for (auto it = m_rings.begin(); it != m_rings.end(); )
+		{
+			TraceRing& r = **it;
+			bool const orphaned = r.orphaned;
+			size_t const first = _events.size();
+			r.drain(_events);
+			uint64_t const dropped = r.takeDropped();
+			if (_events.size() > first || dropped)
+				m_out.push_back({&r, first, _events.size(), dropped});
+			if (orphaned && r.empty())
+			{
+				m_orphans.push_back(*it);
+				it = m_rings.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+
+	void run()
+	{
+		setThreadName("trace");
+		vector<TraceEvent> events;
+		string out;
+		unique_lock<Mutex> l(x_rings);
+		for (bool last = false; !last; )
+		{
+			last = !m_running;
+			events.clear();
+			m_out.clear();
+			collect(events);
+			l.unlock();
+
+			out.clear();
+			for (Span const& s: m_out)
+			{
+				string const tid = to_string(s.ring->tid);
+				if (!s.ring->named)
+				{
+					s.ring->named = true;
+					next(out) += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + tid + ",\"args\":{\"name\":\"" + escaped(s.ring->threadName) + "\"}}";
+				}
+				for (size_t i = s.begin; i < s.end; ++i)
+				{
+					TraceEvent const& e = events[i];
+					next(out) += "{\"name\":\"" + string(e.name) + "\",\"ph\":\"" + e.phase + "\",\"ts\":" + to_string(e.ts);
+					if (e.phase == 'X')
+						out += ",\"dur\":" + to_string(e.dur);
+					else
+						out += ",\"s\":\"t\"";
+					out += ",\"pid\":1,\"tid\":" + tid;
+					if (e.argName)
+						out += ",\"args\":{\"" + string(e.argName) + "\":" + to_string(e.arg) + "}";
+					out += "}";
+				}
+				if (s.dropped)
+					next(out) += "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" + to_string(traceNow()) + ",\"pid\":1,\"tid\":" + tid + ",\"args\":{\"events\":" + to_string(s.dropped) + "}}";
+			}
+			if (last)
+				out += "\n]\n";
+			fwrite(out.data(), 1, out.size(), m_file);
+			fflush(m_file);
+			// The rings of the threads that ended are only let go of once
+			// written out.
+			m_out.clear();
+
+			l.lock();
+			m_orphans.clear();
+			if (m_running)
+				m_wake.wait_for(l, chrono::milliseconds(100));
+		}
+		fclose(m_file);
+		m_file = nullptr;
+	}
+
+	/// Starts the next element of the array.
+	string& next(string& _out)
+	{
+		_out += m_first ? "" : ",\n";
+		m_first = false;
+		return _out;
+	}
+
+	struct Span
+	{
+		TraceRing* ring;
+		size_t begin;
+		size_t end;
+		uint64_t dropped;
+	};
+
+	Mutex x_rings;				///< Guards the rings, m_running and m_thread.
+	vector<shared_ptr<TraceRing>> m_rings;
+	vector<shared_ptr<TraceRing>> m_orphans;	///< Drained, not yet written.
+	vector<Span> m_out;
+	unsigned m_lastTid = 0;
+	bool m_running = false;
+	bool m_atExit = false;
+	condition_variable m_wake;
+	thread m_thread;
+
+	// Only touched by the tracer thread while it runs.
+	FILE* m_file = nullptr;
+	bool m_first = true;
+};
+
+}
+
+bool dev::startTrace(string const& _path)
+{
+	return Tracer::get().start(_path);
+}
+
+void dev::stopTrace()
+{
+	Tracer::get().stop();
+}
+
+uint64_t dev::traceNow()
+{
+	// Never 0: TraceScope takes 0 for not tracing.
+	static chrono::steady_clock::time_point const s_origin = chrono::steady_clock::now();
+	return uint64_t(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - s_origin).count()) + 1;
+}
+
+void dev::traceComplete(char const* _name, uint64_t _beginUs, char const* _argName, uint64_t _arg)
+{
+	uint64_t const now = traceNow();
+	Tracer::get().record(TraceEvent{_name, _argName, _arg, _beginUs, now - _beginUs, 'X'});
+}
+
+void dev::traceInstant(char const* _name, char const* _argName, uint64_t _arg)
+{
+	if (tracing())
+		Tracer::get().record(TraceEvent{_name, _argName, _arg, traceNow(), 0, 'i'});
+}
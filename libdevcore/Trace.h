@@ -0,0 +1,79 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	cpp-ethereum is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Trace.h
+ * @date 2018
+ *
+ * Event tracing of the mining pipeline, in the Chrome trace format
+ * (chrome://tracing, ui.perfetto.dev).
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace dev
+{
+
+extern std::atomic<bool> g_tracing;
+
+/**
+ * @brief Starts writing the trace events to @a _path, replacing a trace
+ * in progress. Each thread queues its events to a ring of its own; a
+ * thread of the tracer writes them out a few times a second. Events a
+ * thread records faster than that are dropped, and the drops marked.
+ * @return false if @a _path cannot be created.
+ */
+bool startTrace(std::string const& _path);
+/// Writes out the events queued and closes the trace.
+void stopTrace();
+
+inline bool tracing() { return g_tracing.load(std::memory_order_relaxed); }
+
+/// Microseconds of the clock the events are timed by.
+uint64_t traceNow();
+
+/// Records that @a _name ran from @a _beginUs to now. The names, and
+/// @a _argName, must outlive the trace: string literals.
+void traceComplete(char const* _name, uint64_t _beginUs, char const* _argName = nullptr, uint64_t _arg = 0);
+/// Records that @a _name happened now.
+void traceInstant(char const* _name, char const* _argName = nullptr, uint64_t _arg = 0);
+
+/// Records the scope it lives in, when tracing. Costs a relaxed load otherwise.
+class TraceScope
+{
+public:
+	explicit TraceScope(char const* _name, char const* _argName = nullptr, uint64_t _arg = 0):
+		m_name(_name), m_argName(_argName), m_arg(_arg), m_begin(tracing() ? traceNow() : 0)
+	{}
+	~TraceScope() { if (m_begin) traceComplete(m_name, m_begin, m_argName, m_arg); }
+
+	/// The argument, once known.
+	void setArg(uint64_t _arg) { m_arg = _arg; }
+
+	TraceScope(TraceScope const&) = delete;
+	TraceScope& operator=(TraceScope const&) = delete;
+
+private:
+	char const* m_name;
+	char const* m_argName;
+	uint64_t m_arg;
+	uint64_t m_begin;
+};
+
+}
@@ -21,34 +21,223 @@
 
 #include "Worker.h"
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
 #include <thread>
+#include <vector>
 #include "Log.h"
 using namespace std;
 using namespace dev;
 
+unsigned Worker::s_poolThreads = 0;
+
+namespace dev
+{
+
+/**
+ * @brief The threads the pooled workers' steps run on, one step of a worker
+ * at a time. Never destroyed: its threads are detached, and idle by the time
+ * the workers are gone.
+ */
+class WorkerPool
+{
+	using Clock = chrono::steady_clock;
+
+public:
+	static WorkerPool& get()
+	{
+		static WorkerPool* s_pool = new WorkerPool(max(Worker::s_poolThreads, 1u));
+		return *s_pool;
+	}
+
+	/// Runs the steps of @a _w, from now on.
+	void add(Worker* _w)
+	{
+		Guard l(x_pool);
+		if (find(m_workers.begin(), m_workers.end(), _w) == m_workers.end())
+			m_workers.push_back(_w);
+		queue(_w);
+	}
+
+	/// Waits for the step of @a _w that runs, if any, and runs no more.
+	void remove(Worker* _w)
+	{
+		UniqueGuard l(x_pool);
+		m_stepped.wait(l, [&]() { return !_w->m_poolRunning; });
+		m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), _w), m_ready.end());
+		m_workers.erase(std::remove(m_workers.begin(), m_workers.end(), _w), m_workers.end());
+	}
+
+	/// Runs a step of @a _w as soon as a thread is free.
+	void schedule(Worker* _w)
+	{
+		Guard l(x_pool);
+		if (find(m_workers.begin(), m_workers.end(), _w) != m_workers.end())
+			queue(_w);
+	}
+
+private:
+	explicit WorkerPool(unsigned _threads)
+	{
+		for (unsigned i = 0; i < _threads; ++i)
+			thread([this, i]() { run(i); }).detach();
+	}
+
+	/// Call with x_pool held.
+	void queue(Worker* _w)
+	{
+		if (_w->m_poolRunning)
+			_w->m_poolRerun = true;
+		else if (!_w->m_poolQueued)
+		{
+			_w->m_poolQueued = true;
+			_w->m_poolDeadline = Clock::time_point::max();
+			m_ready.push_back(_w);
+			m_wake.notify_one();
+		}
+	}
+
+	/// The next worker to step: a ready one, else the first whose wait is up.
+	Worker* next(UniqueGuard& _l)
+	{
+		while (true)
+		{
+			if (!m_ready.empty())
+			{
+				Worker* w = m_ready.front();
+				m_ready.pop_front();
+				return w;
+			}
+			Worker* first = nullptr;
+			for (Worker* w: m_workers)
+				if (!w->m_poolRunning && (!first || w->m_poolDeadline < first->m_poolDeadline))
+					first = w;
+			if (first && first->m_poolDeadline <= Clock::now())
+				return first;
+			if (first && first->m_poolDeadline != Clock::time_point::max())
+				m_wake.wait_until(_l, first->m_poolDeadline);
+			else
+				m_wake.wait(_l);
+		}
+	}
+
+	void run(unsigned _index)
+	{
+		string const name = "host" + to_string(_index);
+		setThreadName(name.c_str());
+		UniqueGuard l(x_pool);
+		while (true)
+		{
+			Worker* w = next(l);
+			w->m_poolQueued = false;
+			w->m_poolRunning = true;
+			w->m_poolRerun = false;
+			w->m_poolDeadline = Clock::time_point::max();
+			l.unlock();
+
+			WorkerState state;
+			{
+				Guard s(w->x_state);
+				state = w->m_state;
+				w->m_woken = false;
+			}
+			chrono::milliseconds wait(0);
+			bool more = false;
+			if (state == WorkerState::Started || state == WorkerState::Stopping)
+			{
+				// Its log lines are its own.
+				setThreadName(w->m_name.c_str());
+				try
+				{
+					more = w->workStep(wait);
+				}
+				catch (std::exception const& _e)
+				{
+					clog(WarnChannel) << "Exception thrown in Worker step: " << _e.what();
+				}
+				setThreadName(name.c_str());
+				if (!more)
+				{
+					Guard s(w->x_state);
+					if (w->m_state != WorkerState::Killing)
+						w->setState(WorkerState::Stopped);
+				}
+			}
+
+			l.lock();
+			w->m_poolRunning = false;
+			if (more)
+			{
+				if (w->m_poolRerun || !wait.count() || w->shouldStop())
+					queue(w);
+				else
+				{
+					w->m_poolDeadline = Clock::now() + wait;
+					// The threads waiting may be waiting for a later one.
+					m_wake.notify_one();
+				}
+			}
+			m_stepped.notify_all();
+		}
+	}
+
+	Mutex x_pool;
+	condition_variable m_wake;		///< A worker is ready, or waits for less.
+	condition_variable m_stepped;	///< A step ended.
+	vector<Worker*> m_workers;
+	deque<Worker*> m_ready;
+};
+
+}
+
+void Worker::setState(WorkerState _state)
+{
+	m_state = _state;
+	m_stateChanged.notify_all();
+}
+
 void Worker::startWorking()
 {
 //	cnote << "startWorking for thread" << m_name;
 	Guard l(x_work);
+	if (!m_work && !m_pooled && s_poolThreads && steppable())
+		m_pooled = true;
+	if (m_pooled)
+	{
+		{
+			Guard s(x_state);
+			if (m_state == WorkerState::Starting || m_state == WorkerState::Stopped)
+				setState(WorkerState::Started);
+		}
+		WorkerPool::get().add(this);
+		return;
+	}
 	if (m_work)
 	{
-		WorkerState ex = WorkerState::Stopped;
-		m_state.compare_exchange_strong(ex, WorkerState::Starting);
+		Guard s(x_state);
+		if (m_state == WorkerState::Stopped)
+			setState(WorkerState::Starting);
 	}
 	else
 	{
-		m_state = WorkerState::Starting;
+		{
+			Guard s(x_state);
+			setState(WorkerState::Starting);
+		}
 		m_work.reset(new thread([&]()
 		{
 			setThreadName(m_name.c_str());
 //			cnote << "Thread begins";
-			while (m_state != WorkerState::Killing)
+			while (true)
 			{
-				WorkerState ex = WorkerState::Starting;
-				bool ok = m_state.compare_exchange_strong(ex, WorkerState::Started);
-//				cnote << "Trying to set Started: Thread was" << (unsigned)ex << "; " << ok;
-				(void)ok;
+				{
+					UniqueGuard s(x_state);
+					m_stateChanged.wait(s, [&]() { return m_state == WorkerState::Starting || m_state == WorkerState::Killing; });
+					if (m_state == WorkerState::Killing)
+						break;
+					setState(WorkerState::Started);
+				}
 
 				try
 				{
@@ -59,43 +248,86 @@ void Worker::startWorking()
 					clog(WarnChannel) << "Exception thrown in Worker thread: " << _e.what();
 				}
 
-//				ex = WorkerState::Stopping;
-//				m_state.compare_exchange_strong(ex, WorkerState::Stopped);
-
-				ex = m_state.exchange(WorkerState::Stopped);
-//				cnote << "State: Stopped: Thread was" << (unsigned)ex;
-				if (ex == WorkerState::Killing || ex == WorkerState::Starting)
-					m_state.exchange(ex);
-
-				while (m_state == WorkerState::Stopped)
-					this_thread::sleep_for(chrono::milliseconds(20));
+				Guard s(x_state);
+				if (m_state != WorkerState::Killing)
+					setState(WorkerState::Stopped);
 			}
 		}));
 //		cnote << "Spawning" << m_name;
 	}
-	while (m_state == WorkerState::Starting)
-		this_thread::sleep_for(chrono::microseconds(20));
+	UniqueGuard s(x_state);
+	m_stateChanged.wait(s, [&]() { return m_state != WorkerState::Starting; });
 }
 
 void Worker::stopWorking()
 {
 	DEV_GUARDED(x_work)
-		if (m_work)
+		if (m_pooled)
 		{
-			WorkerState ex = WorkerState::Started;
-			m_state.compare_exchange_strong(ex, WorkerState::Stopping);
-
-			while (m_state != WorkerState::Stopped)
-				this_thread::sleep_for(chrono::microseconds(20));
+			// Its next step sees it is to stop.
+			DEV_GUARDED(x_state)
+				if (m_state == WorkerState::Started)
+					setState(WorkerState::Stopping);
+			WorkerPool::get().schedule(this);
+			UniqueGuard s(x_state);
+			m_stateChanged.wait(s, [&]() { return m_state == WorkerState::Stopped || m_state == WorkerState::Killing; });
+		}
+		else if (m_work)
+		{
+			UniqueGuard s(x_state);
+			if (m_state == WorkerState::Started)
+				setState(WorkerState::Stopping);
+			m_stateChanged.wait(s, [&]() { return m_state == WorkerState::Stopped || m_state == WorkerState::Killing; });
 		}
 }
 
+void Worker::wake()
+{
+	DEV_GUARDED(x_state)
+	{
+		m_woken = true;
+		m_stateChanged.notify_all();
+	}
+	if (m_pooled)
+		WorkerPool::get().schedule(this);
+}
+
+void Worker::stepLoop()
+{
+	while (true)
+	{
+		chrono::milliseconds wait(0);
+		if (!workStep(wait))
+			break;
+		if (wait.count())
+			waitForWake(wait);
+	}
+}
+
+bool Worker::waitForWake(std::chrono::milliseconds _timeout)
+{
+	UniqueGuard s(x_state);
+	m_stateChanged.wait_for(s, _timeout, [&]() { return m_woken || m_state != WorkerState::Started; });
+	bool const woken = m_woken;
+	m_woken = false;
+	return woken;
+}
+
 Worker::~Worker()
 {
 	DEV_GUARDED(x_work)
-		if (m_work)
+		if (m_pooled)
+		{
+			DEV_GUARDED(x_state)
+				setState(WorkerState::Killing);
+			WorkerPool::get().remove(this);
+		}
+		else if (m_work)
 		{
-			m_state.exchange(WorkerState::Killing);
+			{
+				Guard s(x_state);
+				setState(WorkerState::Killing);
+			}
 			m_work->join();
 			m_work.reset();
 		}
@@ -24,7 +24,9 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <cassert>
+#include <memory>
 #include "Guards.h"
 
 namespace dev
@@ -39,8 +41,21 @@ enum class WorkerState
 	Killing
 };
 
+class WorkerPool;
+
+/**
+ * @brief A thread running workLoop() on demand.
+ * All state changes go through x_state and are signalled on m_stateChanged,
+ * so starting, stopping and waking the thread never poll.
+ *
+ * Workers with a workStep() can instead share the threads of a pool, see
+ * setPoolThreads(): their steps are run when woken, or when the wait they
+ * asked for is up.
+ */
 class Worker
 {
+	friend class WorkerPool;
+
 public:
 	Worker(std::string const& _name): m_name(_name) {}
 
@@ -57,14 +72,62 @@ public:
 
 	bool shouldStop() const { return m_state != WorkerState::Started; }
 
+	/// Runs the workers with a workStep() on @a _threads threads they all
+	/// share; 0, the default, for a thread each. Set before starting any.
+	static void setPoolThreads(unsigned _threads) { s_poolThreads = _threads; }
+
+protected:
+	/// Ends the current (or next) waitForWake() of the worker thread.
+	void wake();
+
+	/**
+	 * @brief For workLoop() to idle until there is something to do.
+	 * @return true if woken by wake(), false after @a _timeout or when the
+	 * worker is being stopped.
+	 */
+	bool waitForWake(std::chrono::milliseconds _timeout);
+
+	/// Whether it runs on the pool's threads rather than one of its own.
+	bool pooled() const { return m_pooled; }
+
+	/**
+	 * @brief One step of the work, for a worker that can run on the pool.
+	 * Must not block on the devices nor wait for wake(): what it would wait
+	 * for is the next step's to see to.
+	 * @param _wait Set to how long to wait for wake() before the next step,
+	 * 0 for none.
+	 * @return false when done, as when workLoop() returns.
+	 */
+	virtual bool workStep(std::chrono::milliseconds& _wait) { (void)_wait; return false; }
+	virtual bool steppable() const { return false; }
+
+	/// The workLoop() of a worker with a workStep(), when on a thread of its own.
+	void stepLoop();
+
 private:
 	virtual void workLoop() = 0;
 
+	/// Sets m_state and tells the waiters. Call with x_state held.
+	void setState(WorkerState _state);
+
 	std::string m_name;
 
 	mutable Mutex x_work;						///< Lock for the network existance.
 	std::unique_ptr<std::thread> m_work;		///< The network thread.
 	std::atomic<WorkerState> m_state = {WorkerState::Starting};
+
+	Mutex x_state;								///< Guards the changes of m_state and m_woken.
+	std::condition_variable m_stateChanged;
+	bool m_woken = false;
+
+	bool m_pooled = false;			///< Set before its first step.
+	// Guarded by the pool's lock.
+	bool m_poolQueued = false;		///< In the pool's ready queue.
+	bool m_poolRunning = false;		///< A pool thread is in its workStep().
+	bool m_poolRerun = false;		///< Woken while running.
+	std::chrono::steady_clock::time_point m_poolDeadline;	///< Of its wait; max() for none.
+
+	static unsigned s_poolThreads;
 };
 
 }
@@ -5,12 +5,19 @@
 
 #include "CLMiner.h"
 #include <libethash/internal.h>
+#include <libethash/sha3.h>
+#include <libdevcore/CommonIO.h>
 #include "CLMiner_kernel_stable.h"
 #include "CLMiner_kernel_unstable.h"
 
 #include <string>
 #include <fstream>
 #include <streambuf>
+#include <deque>
+#include <future>
+#include <map>
+#include <cmath>
+#include <set>
 
 using namespace dev;
 using namespace eth;
@@ -22,10 +29,49 @@ namespace eth
 
 unsigned CLMiner::s_workgroupSize = CLMiner::c_defaultLocalWorkSize;
 unsigned CLMiner::s_initialGlobalWorkSize = CLMiner::c_defaultGlobalWorkSizeMultiplier * CLMiner::c_defaultLocalWorkSize;
+unsigned CLMiner::s_dagGlobalWorkSizeMultiplier = 0;
+unsigned CLMiner::s_dagPrebuild = 0;
+bool CLMiner::s_dualDag = false;
 unsigned CLMiner::s_threadsPerHash = 8;
-CLKernelName CLMiner::s_clKernelName = CLMiner::c_defaultKernelName;
+unsigned CLMiner::s_hashesPerThread = 1;
+string CLMiner::s_kernelDirectory = "kernels";
+unsigned CLMiner::s_pipelineDepth = CLMiner::c_defaultPipelineDepth;
+unsigned CLMiner::s_verifyEvery = 0;
+unsigned CLMiner::s_persistentRounds = 0;
+unsigned CLMiner::s_kernelTargetMs = 0;
+bool CLMiner::s_profiling = false;
+uint64_t CLMiner::s_initBudget = 0;
+Mutex CLMiner::x_initBudget;
+std::condition_variable CLMiner::s_initBudgetFreed;
+uint64_t CLMiner::s_initBudgetUsed = 0;
+
+CLMiner::InitBudget::InitBudget(uint64_t _cost)
+{
+	bool const sequential = s_dagLoadMode == DAG_LOAD_MODE_SEQUENTIAL;
+	if (!_cost || (!sequential && !s_initBudget))
+		return;
+	UniqueGuard l(x_initBudget);
+	// One alone always goes ahead, however much it takes.
+	s_initBudgetFreed.wait(l, [&]() {
+		return !s_initBudgetUsed || (!sequential && s_initBudgetUsed + _cost <= s_initBudget);
+	});
+	s_initBudgetUsed += _cost;
+	m_cost = _cost;
+}
 
-constexpr size_t c_maxSearchResults = 1;
+CLMiner::InitBudget::~InitBudget()
+{
+	if (!m_cost)
+		return;
+	{
+		Guard l(x_initBudget);
+		s_initBudgetUsed -= m_cost;
+	}
+	s_initBudgetFreed.notify_all();
+}
+CLKernelName CLMiner::s_clKernelName = CLMiner::c_defaultKernelName;
+const unsigned CLMiner::c_maxSearchResults;
+constexpr size_t CLMiner::c_searchBufferSize;
 
 struct CLChannel: public LogChannel
 {
@@ -212,12 +258,22 @@ void addDefinition(string& _source, char const* _id, unsigned _value)
 	_source.insert(_source.begin(), buf, buf + strlen(buf));
 }
 
+/// The platforms and their GPUs are enumerated once for all miners: the
+/// drivers are slow at it on rigs with many devices.
+Mutex x_platforms;
+vector<cl::Platform> s_platforms;
+std::map<unsigned, vector<cl::Device>> s_platformDevices;
+
 std::vector<cl::Platform> getPlatforms()
 {
+	Guard l(x_platforms);
+	if (!s_platforms.empty())
+		return s_platforms;
 	vector<cl::Platform> platforms;
 	try
 	{
 		cl::Platform::get(&platforms);
+		s_platforms = platforms;
 	}
 	catch(cl::Error const& err)
 	{
@@ -235,12 +291,17 @@ std::vector<cl::Device> getDevices(std::vector<cl::Platform> const& _platforms,
 {
 	vector<cl::Device> devices;
 	size_t platform_num = min<size_t>(_platformId, _platforms.size() - 1);
+	Guard l(x_platforms);
+	auto it = s_platformDevices.find(platform_num);
+	if (it != s_platformDevices.end())
+		return it->second;
 	try
 	{
 		_platforms[platform_num].getDevices(
 			CL_DEVICE_TYPE_GPU,
 			&devices
 		);
+		s_platformDevices[platform_num] = devices;
 	}
 	catch (cl::Error const& err)
 	{
@@ -251,6 +312,49 @@ std::vector<cl::Device> getDevices(std::vector<cl::Platform> const& _platforms,
 	return devices;
 }
 
+char const* kernelVariantName(CLKernelName _kernel)
+{
+	switch (_kernel)
+	{
+	case CLKernelName::Stable: return "stable";
+	case CLKernelName::Unstable: return "unstable";
+	case CLKernelName::Custom: return "custom";
+	default: return "auto";
+	}
+}
+
+/// Compiled programs by programKey(), or the compile of them in progress.
+/// Devices of the same model and driver share them.
+Mutex x_programs;
+std::map<h256, std::shared_future<bytes>> s_programs;
+
+/// Identifies a program binary: the patched source holds the kernel variant
+/// and all definitions, the rest decides what the driver compiles it to.
+h256 programKey(cl::Device const& _device, string const& _options, string const& _code)
+{
+	string key = _device.getInfo<CL_DEVICE_NAME>();
+	for (string const& s: {_device.getInfo<CL_DEVICE_VENDOR>(), _device.getInfo<CL_DRIVER_VERSION>(),
+			_device.getInfo<CL_DEVICE_VERSION>(), _options, _code})
+		key += '\0' + s;
+	return sha3(key);
+}
+
+bytes readProgramBinary(string const& _path)
+{
+	std::ifstream f(_path, std::ios::binary);
+	if (!f)
+		return bytes();
+	return bytes((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+void writeProgramBinary(string const& _path, bytes const& _binary)
+{
+	if (!writeFileAtomically(_path, [&](std::ostream& _f) { _f.write((char const*)_binary.data(), _binary.size()); }))
+	{
+		cwarn << "Cannot write OpenCL program binary" << _path;
+	}
+}
+
 }
 
 }
@@ -259,145 +363,582 @@ std::vector<cl::Device> getDevices(std::vector<cl::Platform> const& _platforms,
 unsigned CLMiner::s_platformId = 0;
 unsigned CLMiner::s_numInstances = 0;
 int CLMiner::s_devices[16] = { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+Mutex CLMiner::x_dagShare;
+std::condition_variable CLMiner::s_dagShareChanged;
+CLMiner::DagShare CLMiner::s_dagShare;
+const uint64_t CLMiner::c_dagShareChunk;
 string CLMiner::s_devicenames[16] = { "CL0", "CL1", "CL2", "CL3", "CL4", "CL5", "CL6", "CL7", "CL8", "CL9", "CL10", "CL11", "CL12", "CL13", "CL14", "CL15" };
 
 CLMiner::CLMiner(FarmFace& _farm, unsigned _index):
 	Miner("cl-", _farm, _index)
-{}
+{
+	m_current.header = h256{1u};
+	m_current.seed = h256{1u};
+}
 
 CLMiner::~CLMiner()
 {
 	kick_miner();
+	stopWorking();
+	releaseSearchSlots();
+	HwMonSampler::get().remove(m_hwSlot);
+}
+
+void CLMiner::createSearchSlots(unsigned _depth)
+{
+	ETHCL_LOG("Creating " << _depth << " mining buffers");
+	m_slots = std::vector<SearchSlot>(_depth);
+	for (SearchSlot& slot: m_slots)
+	{
+		slot.miner = this;
+		slot.buffer = cl::Buffer(m_context, CL_MEM_WRITE_ONLY, c_searchBufferSize);
+		m_queue.enqueueFillBuffer(slot.buffer, 0u, 0, c_searchBufferSize);
+		// Pinned host memory, so the non-blocking reads are plain DMA.
+		slot.staging = cl::Buffer(m_context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, c_searchBufferSize);
+		slot.results = static_cast<SearchResults*>(m_queue.enqueueMapBuffer(slot.staging, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, c_searchBufferSize));
+	}
+	m_nextSlot = 0;
+}
+
+void CLMiner::noteInFlight(WorkSlot::Clock::time_point _at, bool _launched)
+{
+	unsigned const busy = (unsigned)std::count_if(m_slots.begin(), m_slots.end(), [](SearchSlot const& _s) { return _s.busy; });
+	searchesInFlight(busy, _at, _launched);
+}
+
+void CLMiner::releaseSearchSlots()
+{
+	try
+	{
+		abortSearches();
+		for (SearchSlot& slot: m_slots)
+			if (slot.results)
+				m_queue.enqueueUnmapMemObject(slot.staging, slot.results);
+		if (m_controlWord)
+			m_queue.enqueueUnmapMemObject(m_control, const_cast<uint32_t*>(m_controlWord));
+		m_controlWord = nullptr;
+		if (!m_slots.empty())
+			m_queue.finish();
+		// Event callbacks can run after clFinish() returns.
+		for (SearchSlot& slot: m_slots)
+			while (slot.busy && !slot.done.load(std::memory_order_acquire))
+				this_thread::yield();
+	}
+	catch (cl::Error const& _e)
+	{
+		cwarn << ethCLErrorHelper("Releasing search buffers failed", _e);
+	}
+	m_slots.clear();
+}
+
+void CLMiner::abortSearches()
+{
+	if (!m_controlWord)
+		return;
+	*m_controlWord = ++m_generation;
+	if (m_persistent)
+		m_searchKernel.setArg(12, m_generation);
+}
+
+void CL_CALLBACK CLMiner::searchRead(cl_event, cl_int, void* _slot)
+{
+	// The slot may be released as soon as done is seen.
+	SearchSlot* slot = static_cast<SearchSlot*>(_slot);
+	CLMiner* miner = slot->miner;
+	slot->completed = WorkSlot::Clock::now();
+	slot->done.store(true, std::memory_order_release);
+	miner->wake();
 }
 
-void CLMiner::report(uint64_t _nonce, WorkPackage const& _w)
+void CLMiner::report(uint64_t _nonce, h256 const& _mix, WorkPackage const& _w, WorkSlot::Clock::time_point _kernelDone)
 {
 	assert(_nonce != 0);
-	// TODO: Why re-evaluating?
-	Result r = EthashAux::eval(_w.seed, _w.header, _nonce);
-	if (r.value < _w.boundary)
-		farm.submitProof(Solution{_nonce, r.mixHash, _w, false});
+	// The kernel only compared the upper 64 bits of the hash. The final hash
+	// follows from its mix with two Keccaks, no light evaluation needed.
+	bool valid = EthashAux::quickHash(_w.header, _nonce, _mix) < _w.boundary;
+	if (valid && s_verifyEvery && ++m_reported % s_verifyEvery == 0)
+	{
+		TraceScope trace("verify");
+		Result r = EthashAux::eval(_w.seed, _w.header, _nonce);
+		valid = r.mixHash == _mix && r.value < _w.boundary;
+	}
+	if (valid)
+		submitProof(Solution{_nonce, _mix, _w, false, (unsigned)index}, _kernelDone);
 	else {
-		farm.failedSolution();
+		solutionFailed();
 		cwarn << "FAILURE: GPU gave incorrect result!";
 	}
 }
 
-void CLMiner::workLoop()
+bool CLMiner::loadProgram(cl::Program& _program, cl::Device const& _device, string const& _options, bytes const& _binary)
 {
-	// Memory for zero-ing buffers. Cannot be static because crashes on macOS.
-	uint32_t const c_zero = 0;
+	try
+	{
+		_program = cl::Program(m_context, {_device}, cl::Program::Binaries{_binary});
+		_program.build({_device}, _options.c_str());
+		return true;
+	}
+	catch (cl::Error const& err)
+	{
+		cllog << ethCLErrorHelper("Cached OpenCL program binary rejected", err);
+		return false;
+	}
+}
 
-	uint64_t startNonce = 0;
+bool CLMiner::buildProgram(cl::Program& _program, cl::Device const& _device, string const& _options, string const& _code)
+{
+	h256 const key = programKey(_device, _options, _code);
+	string const dir = EthashAux::dagDirectory();
+	string const path = dir.empty() ? string() : dir + "/cl-" + key.hex();
 
-	// The work package currently processed by GPU.
-	WorkPackage current;
-	current.header = h256{1u};
-	current.seed = h256{1u};
+	// Wait for a compile of the same program by another device, or claim it.
+	std::promise<bytes> compiled;
+	std::shared_future<bytes> pending;
+	{
+		Guard l(x_programs);
+		auto it = s_programs.find(key);
+		if (it != s_programs.end())
+			pending = it->second;
+		else
+			s_programs[key] = compiled.get_future().share();
+	}
+	if (pending.valid())
+	{
+		bytes binary;
+		try
+		{
+			binary = pending.get();
+		}
+		catch (...) {}
+		if (!binary.empty() && loadProgram(_program, _device, _options, binary))
+			return true;
+		// Build it ourselves, without sharing.
+	}
+	else if (!path.empty())
+	{
+		bytes binary = readProgramBinary(path);
+		if (!binary.empty() && loadProgram(_program, _device, _options, binary))
+		{
+			cllog << "Loaded OpenCL program binary" << path;
+			compiled.set_value(move(binary));
+			return true;
+		}
+	}
 
-	try {
-		while (true)
+	bytes binary;
+	try
+	{
+		cl::Program::Sources sources{_code};
+		_program = cl::Program(m_context, sources);
+		try
+		{
+			_program.build({_device}, _options.c_str());
+			cllog << "Build info:" << _program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(_device);
+		}
+		catch (cl::Error const&)
+		{
+			cwarn << "Build info:" << _program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(_device);
+			throw;
+		}
+		// One binary per device of the program, i.e. one.
+		cl::Program::Binaries binaries = _program.getInfo<CL_PROGRAM_BINARIES>();
+		if (!binaries.empty())
+			binary = move(binaries[0]);
+	}
+	catch (cl::Error const&)
+	{
+		if (!pending.valid())
 		{
-			const WorkPackage w = work();
+			// Let a later init try again.
+			Guard l(x_programs);
+			s_programs.erase(key);
+			compiled.set_value(bytes());
+		}
+		return false;
+	}
 
-			if (current.header != w.header)
-			{
-				// New work received. Update GPU data.
-				auto localSwitchStart = std::chrono::high_resolution_clock::now();
+	if (!binary.empty() && !path.empty())
+		writeProgramBinary(path, binary);
+	if (!pending.valid())
+		compiled.set_value(move(binary));
+	return true;
+}
 
-				if (!w)
-				{
-					cllog << "No work. Pause for 3 s.";
-					std::this_thread::sleep_for(std::chrono::seconds(3));
-					continue;
-				}
+void CLMiner::workLoop()
+{
+	stepLoop();
+}
+
+bool CLMiner::workStep(chrono::milliseconds& _wait)
+{
+	auto const start = WorkSlot::Clock::now();
+	try
+	{
+		bool const running = stepSearches(_wait);
+		hostStepped(WorkSlot::Clock::now() - start);
+		if (running)
+			return true;
+	}
+	catch (cl::Error const& _e)
+	{
+		cwarn << ethCLErrorHelper("OpenCL Error", _e);
+	}
+	// Started again, it takes up the work afresh.
+	m_current.header = h256{1u};
+	m_current.seed = h256{1u};
+	return false;
+}
 
-				cllog << "New work: header" << w.header << "target" << w.boundary.hex();
+bool CLMiner::stepSearches(chrono::milliseconds& _wait)
+{
+	// The work package currently processed by GPU.
+	WorkPackage& current = m_current;
 
-				if (current.seed != w.seed)
-				{
-					if (s_dagLoadMode == DAG_LOAD_MODE_SEQUENTIAL)
-					{
-						while (s_dagLoadIndex < index)
-							this_thread::sleep_for(chrono::seconds(1));
-						++s_dagLoadIndex;
-					}
+	if (tuningPending() && m_context())
+	{
+		// Taken up once the searches in flight are in and reported.
+		abortSearches();
+		if (std::none_of(m_slots.begin(), m_slots.end(), [](SearchSlot const& _s) { return _s.busy; }))
+		{
+			if (!applyTuning())
+				return false;
+			// The rebuilt kernel gets the header and target again.
+			current.header = h256{1u};
+		}
+	}
 
-					cllog << "New seed" << w.seed;
-					init(w.seed);
-				}
+	WorkPackage const& w = work();
 
-				// Upper 64 bits of the boundary.
-				const uint64_t target = (uint64_t)(u64)((u256)w.boundary >> 192);
-				assert(target > 0);
+	if (current.header != w.header)
+	{
+		// New work received. Update GPU data.
+		TraceScope trace("switch");
+		auto localSwitchStart = std::chrono::high_resolution_clock::now();
+
+		// Persistent searches on the old work need not run to the end.
+		abortSearches();
 
-				// Update header constant buffer.
-				m_queue.enqueueWriteBuffer(m_header, CL_FALSE, 0, w.header.size, w.header.data());
-				m_queue.enqueueWriteBuffer(m_searchBuffer, CL_FALSE, 0, sizeof(c_zero), &c_zero);
+		// A package with a seed but no header only asks for the DAG, ahead
+		// of the pool's first job.
+		if (!w && (!w.seed || current.seed == w.seed))
+		{
+			if (shouldStop())
+				return false;
+			cllog << "No work. Pause for 3 s.";
+			_wait = std::chrono::seconds(3);
+			return true;
+		}
 
-				m_searchKernel.setArg(0, m_searchBuffer);  // Supply output buffer to kernel.
-				m_searchKernel.setArg(4, target);
+		if (w)
+		{
+			cllog << "New work: header" << w.header << "target" << w.boundary.hex();
+		}
 
-				// FIXME: This logic should be move out of here.
-				if (w.exSizeBits >= 0)
-					startNonce = w.startNonce | ((uint64_t)index << (64 - 4 - w.exSizeBits)); // This can support up to 16 devices.
-				else
-					startNonce = get_start_nonce();
+		if (current.seed != w.seed)
+		{
+			cllog << "New seed" << w.seed;
+			init(w.seed);
+		}
+		if (!w)
+		{
+			current.seed = w.seed;
+			return true;
+		}
 
-				auto switchEnd = std::chrono::high_resolution_clock::now();
-				auto globalSwitchTime = std::chrono::duration_cast<std::chrono::milliseconds>(switchEnd - workSwitchStart).count();
-				auto localSwitchTime = std::chrono::duration_cast<std::chrono::microseconds>(switchEnd - localSwitchStart).count();
-				cllog << "Switch time" << globalSwitchTime << "ms /" << localSwitchTime << "us";
-			}
+		// Upper 64 bits of the boundary.
+		const uint64_t target = (uint64_t)(u64)((u256)w.boundary >> 192);
+		assert(target > 0);
+
+		// Update header constant buffer.
+		// Searches in flight are ahead of it in the queue and still
+		// see the old header. Blocking, as m_jobConstants is rewritten by
+		// the next switch: a few hundred bytes once per job.
+		memcpy(m_jobConstants.header, w.header.data(), sizeof(m_jobConstants.header));
+		ethash_keccak_job(m_jobConstants.header, m_jobConstants.lanes, m_jobConstants.chi);
+		m_queue.enqueueWriteBuffer(m_header, CL_TRUE, 0, sizeof(m_jobConstants), &m_jobConstants);
+
+		m_searchKernel.setArg(4, target);
+		current = w;
+
+		auto switchEnd = std::chrono::high_resolution_clock::now();
+		auto globalSwitchTime = std::chrono::duration_cast<std::chrono::milliseconds>(switchEnd - workSwitchStart).count();
+		auto localSwitchTime = std::chrono::duration_cast<std::chrono::microseconds>(switchEnd - localSwitchStart).count();
+		cllog << "Switch time" << globalSwitchTime << "ms /" << localSwitchTime << "us";
+	}
 
-			// Read results.
-			// TODO: could use pinned host pointer instead.
-			uint32_t results[c_maxSearchResults + 1];
-			m_queue.enqueueReadBuffer(m_searchBuffer, CL_TRUE, 0, sizeof(results), &results);
+	// The oldest of the s_pipelineDepth searches in flight: the kernels
+	// queued after it keep the device busy while its results come back.
+	SearchSlot& slot = m_slots[m_nextSlot];
+	if (slot.busy && !slot.done.load(std::memory_order_acquire))
+	{
+		if (shouldStop())
+		{
+			abortSearches();
+			m_queue.finish();
+			return false;
+		}
+		// Its read's callback wakes the miner.
+		_wait = chrono::milliseconds(100);
+		return true;
+	}
+	m_nextSlot = (m_nextSlot + 1) % m_slots.size();
 
-			uint64_t nonce = 0;
-			if (results[0] > 0)
+	unsigned found = 0;
+	uint64_t nonces[c_maxSearchResults];
+	h256 mixes[c_maxSearchResults];
+	WorkSlot::Clock::time_point kernelDone;
+	if (slot.busy)
+	{
+		TraceScope trace("wait", "results", 0);
+		kernelDone = WorkSlot::Clock::now();
+		slot.busy = false;
+		noteInFlight(slot.completed, false);
+		// Unread, persistent searches count as having run all their rounds.
+		unsigned const rounds = !m_persistent ? 1 : slot.readBack ? slot.results->rounds : m_rounds;
+		if (m_persistent)
+			addHashCount(uint64_t(rounds) * m_globalWorkSize);
+		if (s_profiling)
+			profileSearch(slot.kernel, uint64_t(rounds) * slot.size);
+		if (s_kernelTargetMs && !m_persistent)
+			adaptWorkSize(slot);
+		// Copied out before the slot's next read overwrites them.
+		unsigned const count = slot.readBack ? slot.results->count : 0;
+		countResults(count, c_maxSearchResults);
+		trace.setArg(count);
+		if (count > 0)
+		{
+			found = std::min<unsigned>(count, c_maxSearchResults);
+			for (unsigned i = 0; i < found; ++i)
 			{
-				// Ignore results except the first one.
-				nonce = current.startNonce + results[1];
-				// Reset search buffer if any solution found.
-				m_queue.enqueueWriteBuffer(m_searchBuffer, CL_FALSE, 0, sizeof(c_zero), &c_zero);
+				nonces[i] = slot.startNonce + slot.results->result[i].gid;
+				mixes[i] = h256(reinterpret_cast<byte const*>(slot.results->result[i].mix), h256::ConstructFromPointer);
 			}
+			// Reset search buffer if any solution found.
+			m_queue.enqueueWriteBuffer(slot.buffer, CL_FALSE, 0, sizeof(m_zero), &m_zero);
+		}
+		if (unsigned const probes = slot.readBack ? slot.results->probes : 0)
+		{
+			probesCounted(probes, slot.startNonce + slot.results->probeGid, slot.work);
+			m_queue.enqueueWriteBuffer(slot.buffer, CL_FALSE, offsetof(SearchResults, probes), sizeof(m_zero), &m_zero);
+		}
+	}
+	WorkPackage const searched = found ? slot.work : WorkPackage();
 
-			// Run the kernel.
-			m_searchKernel.setArg(3, startNonce);
-			m_queue.enqueueNDRangeKernel(m_searchKernel, cl::NullRange, m_globalWorkSize, m_workgroupSize);
+	// Run the kernel, unless there are no nonces left to search for now.
+	uint64_t startNonce = 0;
+	bool const launched = !tuningPending() && nextNonces(uint64_t(m_globalWorkSize) * (m_persistent ? m_rounds : 1), startNonce);
+	if (launched)
+	{
+		TraceScope trace("launch");
+		m_searchKernel.setArg(0, slot.buffer);
+		m_searchKernel.setArg(3, startNonce);
+		m_queue.enqueueNDRangeKernel(m_searchKernel, cl::NullRange, m_globalWorkSize, m_workgroupSize,
+			nullptr, s_profiling ? &slot.kernel : nullptr);
+		slot.done.store(false, std::memory_order_relaxed);
+		// Without the read back, a marker tells of the search's end.
+		if (m_readback)
+			m_queue.enqueueReadBuffer(slot.buffer, CL_FALSE, 0, c_searchBufferSize, slot.results, nullptr, &slot.read);
+		else
+			m_queue.enqueueMarkerWithWaitList(nullptr, &slot.read);
+		slot.read.setCallback(CL_COMPLETE, &CLMiner::searchRead, &slot);
+		slot.busy = true;
+		slot.readBack = m_readback;
+		slot.startNonce = startNonce;
+		slot.work = w;
+		slot.size = m_globalWorkSize;
+		slot.launched = WorkSlot::Clock::now();
+		noteInFlight(slot.launched, true);
+	}
 
-			// Report results while the kernel is running.
-			// It takes some time because ethash must be re-evaluated on CPU.
-			if (nonce != 0)
-				report(nonce, current);
+	if (launched)
+	{
+		stepPrebuild();
+		stepDagCheck();
+	}
 
-			current = w;        // kernel now processing newest work
-			current.startNonce = startNonce;
-			// Increase start nonce for following kernel execution.
-			startNonce += m_globalWorkSize;
+	// Report results while the kernel is running.
+	for (unsigned i = 0; i < found; ++i)
+		report(nonces[i], mixes[i], searched, kernelDone);
 
-			// Report hash count
-			addHashCount(m_globalWorkSize);
+	// Report hash count
+	if (launched && !m_persistent)
+		addHashCount(m_globalWorkSize);
+	else if (!launched)
+		_wait = restWait();
 
-			// Check if we should stop.
-			if (shouldStop())
-			{
-				// Make sure the last buffer write has finished --
-				// it reads local variable.
-				m_queue.finish();
-				break;
-			}
+	// Check if we should stop.
+	if (shouldStop())
+	{
+		abortSearches();
+		m_queue.finish();
+		return false;
+	}
+	return true;
+}
+
+void CLMiner::adaptWorkSize(SearchSlot const& _slot)
+{
+	// Queued behind another search, it started once that one was done.
+	auto const start = std::max(_slot.launched, m_lastCompleted);
+	m_lastCompleted = std::max(m_lastCompleted, _slot.completed);
+	if (_slot.size != m_globalWorkSize || _slot.completed <= start)
+		return;
+	double const us = chrono::duration<double, micro>(_slot.completed - start).count();
+	m_searchUs = m_searchSamples++ ? m_searchUs * 0.75 + us * 0.25 : us;
+	if (m_searchSamples < c_adaptSamples)
+		return;
+	double const ratio = s_kernelTargetMs * 1000.0 / m_searchUs;
+	// Within 10% is on target: no resizing back and forth over noise.
+	if (ratio > 0.9 && ratio < 1.1)
+		return;
+	unsigned const multiplier = m_globalWorkSize / m_workgroupSize;
+	// At most halved or doubled at a time, gid staying within 32 bits.
+	uint64_t next = (uint64_t)llround(multiplier * std::max(0.5, std::min(ratio, 2.0)));
+	next = std::max<uint64_t>(1, std::min<uint64_t>(next, 0xffffffffu / m_workgroupSize));
+	if (next == multiplier)
+		return;
+	cllog << "Search took" << unsigned(m_searchUs / 1000) << "ms, global work size" << m_globalWorkSize << "->" << next * m_workgroupSize;
+	m_globalWorkSize = unsigned(next * m_workgroupSize);
+	m_searchSamples = 0;
+	publishTuning();
+}
+
+void CLMiner::kick_miner() {}
+
+bool CLMiner::checkTuning(string const& _name, unsigned _value, string& _error) const
+{
+	if (_name == "local_work")
+	{
+		// Each hash is shared by s_threadsPerHash work items.
+		if (_value && _value <= 1024 && _value % 8 == 0)
+			return true;
+		_error = "local_work must be a multiple of 8, up to 1024";
+	}
+	else if (_name == "global_work")
+	{
+		if (_value)
+			return true;
+		_error = "global_work must be at least 1";
+	}
+	else if (_name == "kernel")
+	{
+		// Auto calibrates once per device, at its first DAG.
+		if (_value <= CLKernelName::Custom)
+			return true;
+		_error = "kernel must be 0 (stable), 1 (unstable) or 2 (custom)";
+	}
+	else if (_name == "parallel_hash")
+	{
+		if (_value == 1 || _value == 2 || _value == 4 || _value == 8)
+			return true;
+		_error = "parallel_hash must be 1, 2, 4 or 8";
+	}
+	else if (_name == "pipeline")
+	{
+		if (_value && _value <= 8)
+			return true;
+		_error = "pipeline must be 1 to 8";
+	}
+	else if (_name == "readback")
+	{
+		if (_value <= 1)
+			return true;
+		_error = "readback must be 0 or 1";
+	}
+	else
+		_error = "Unknown parameter " + _name;
+	return false;
+}
+
+bool CLMiner::applyTuning()
+{
+	MinerTuning const t = takeTuning();
+	unsigned const oldGroupSize = m_workgroupSize;
+	unsigned const oldMultiplier = m_globalWorkSize / m_workgroupSize;
+	CLKernelName const oldKernel = m_kernelName;
+	unsigned const oldHashes = m_hashesPerThread;
+	unsigned groupSize = oldGroupSize;
+	unsigned multiplier = oldMultiplier;
+	CLKernelName kernel = oldKernel;
+	unsigned hashes = oldHashes;
+	unsigned depth = (unsigned)m_slots.size();
+	bool const readback = m_readback;
+	for (auto const& p: t)
+		if (p.first == "local_work")
+			groupSize = p.second;
+		else if (p.first == "global_work")
+			multiplier = p.second;
+		else if (p.first == "kernel")
+			kernel = (CLKernelName)p.second;
+		else if (p.first == "parallel_hash")
+			hashes = p.second;
+		else if (p.first == "pipeline")
+			depth = p.second;
+		else if (p.first == "readback")
+			m_readback = p.second != 0;
+	// gid, the nonce's offset in a launch, is 32 bits in the kernels.
+	multiplier = (unsigned)std::min<uint64_t>(multiplier, 0xffffffffu / groupSize);
+
+	auto const set = [&](unsigned _groupSize, unsigned _multiplier, CLKernelName _kernel, unsigned _hashes) {
+		bool const rebuild = _groupSize != m_workgroupSize || _kernel != m_kernelName || _hashes != m_hashesPerThread;
+		m_workgroupSize = _groupSize;
+		m_globalWorkSize = _multiplier * _groupSize;
+		m_dagGlobalWorkSize = s_dagGlobalWorkSizeMultiplier ? s_dagGlobalWorkSizeMultiplier * m_workgroupSize : m_globalWorkSize;
+		m_kernelName = _kernel;
+		m_hashesPerThread = _hashes;
+		if (m_controlWord)
+			m_rounds = std::min<unsigned>(s_persistentRounds, 0xffffffffu / m_globalWorkSize);
+		// Through the program cache, so going back to earlier parameters
+		// takes no compiling.
+		if (rebuild && !initProgram(m_dagSize128, m_lightSize64))
+			return false;
+		if (rebuild)
+			setKernelArgs(m_dagSize128, m_lightSize64);
+		else if (m_persistent)
+			m_searchKernel.setArg(13, m_rounds);
+		return true;
+	};
+	try
+	{
+		m_calibrate = false;
+		m_searchSamples = 0;
+		// None is busy, see stepSearches().
+		if (depth != m_slots.size())
+		{
+			for (SearchSlot& slot: m_slots)
+				if (slot.results)
+					m_queue.enqueueUnmapMemObject(slot.staging, slot.results);
+			m_queue.finish();
+			createSearchSlots(depth);
+		}
+		// What the unread searches found is of no launch still known.
+		else if (m_readback && !readback)
+			for (SearchSlot& slot: m_slots)
+				m_queue.enqueueFillBuffer(slot.buffer, 0u, 0, c_searchBufferSize);
+		if (!set(groupSize, multiplier, kernel, hashes))
+		{
+			cwarn << "OpenCL kernel: cannot build with the new parameters, keeping the old ones";
+			if (!set(oldGroupSize, oldMultiplier, oldKernel, oldHashes))
+				return false;
 		}
 	}
 	catch (cl::Error const& _e)
 	{
-		cwarn << ethCLErrorHelper("OpenCL Error", _e);
+		cwarn << ethCLErrorHelper("OpenCL tuning failed", _e);
+		return false;
 	}
+	publishTuning();
+	cnote << "OpenCL kernel:" << kernelVariantName(m_kernelName) << "local work size" << m_workgroupSize
+		<< "global work size" << m_globalWorkSize << "parallel hash" << m_hashesPerThread;
+	return true;
 }
 
-void CLMiner::kick_miner() {}
+void CLMiner::publishTuning()
+{
+	setTuning({{"local_work", m_workgroupSize}, {"global_work", m_globalWorkSize / m_workgroupSize},
+		{"kernel", (unsigned)m_kernelName}, {"parallel_hash", m_hashesPerThread},
+		{"pipeline", (unsigned)m_slots.size()}, {"readback", m_readback ? 1u : 0u}});
+}
 
 unsigned CLMiner::getNumDevices()
 {
@@ -526,24 +1067,48 @@ bool CLMiner::configureGPU(
 
 HwMonitor CLMiner::hwmon()
 {
+	HwReading r = HwMonSampler::get().reading(m_hwSlot);
 	HwMonitor hw;
-	unsigned int tempC = 0, fanpcnt = 0;
+	hw.tempC = r.tempC;
+	hw.fanP = r.fanP;
+	hw.powerW = r.powerW;
+	hw.coreMHz = r.coreMHz;
+	hw.memMHz = r.memMHz;
+	hw.memUtilP = r.memUtilP;
+	return hw;
+}
+
+HwReading CLMiner::readHw()
+{
+	HwReading hw;
+	unsigned int tempC = 0, fanpcnt = 0, powerMw = 0, coreMHz = 0, memMHz = 0, memUtil = 0;
 	if (nvmlh) {
 		wrap_nvml_get_tempC(nvmlh, index, &tempC);
 		wrap_nvml_get_fanpcnt(nvmlh, index, &fanpcnt);
+		wrap_nvml_get_power_usage(nvmlh, index, &powerMw);
+		wrap_nvml_get_clocks(nvmlh, index, &coreMHz, &memMHz);
+		wrap_nvml_get_mem_utilization(nvmlh, index, &memUtil);
 	}
 	if (adlh) {
 		wrap_adl_get_tempC(adlh, index, &tempC);
 		wrap_adl_get_fanpcnt(adlh, index, &fanpcnt);
+		wrap_adl_get_clocks(adlh, index, &coreMHz, &memMHz);
 	}
 #if defined(__linux)
 	if (sysfsh) {
 		wrap_amdsysfs_get_tempC(sysfsh, index, &tempC);
 		wrap_amdsysfs_get_fanpcnt(sysfsh, index, &fanpcnt);
+		wrap_amdsysfs_get_power_usage(sysfsh, index, &powerMw);
+		wrap_amdsysfs_get_clocks(sysfsh, index, &coreMHz, &memMHz);
+		wrap_amdsysfs_get_mem_utilization(sysfsh, index, &memUtil);
 	}
 #endif
 	hw.tempC = tempC;
 	hw.fanP = fanpcnt;
+	hw.powerW = powerMw / 1000;
+	hw.coreMHz = coreMHz;
+	hw.memMHz = memMHz;
+	hw.memUtilP = memUtil;
 	return hw;
 }
 
@@ -551,11 +1116,32 @@ string CLMiner::Name() {
 	return s_devicenames[index];
 }
 
-bool CLMiner::init(const h256& seed)
+string CLMiner::pciBusId()
 {
-	EthashAux::LightType light = EthashAux::light(seed);
+	if (m_platformId == OPENCL_PLATFORM_NVIDIA)
+	{
+		cl_uint bus = 0;
+		cl_uint slot = 0;
+		if (clGetDeviceInfo(m_device(), CL_DEVICE_PCI_BUS_ID_NV, sizeof(bus), &bus, NULL) != CL_SUCCESS ||
+			clGetDeviceInfo(m_device(), CL_DEVICE_PCI_SLOT_ID_NV, sizeof(slot), &slot, NULL) != CL_SUCCESS)
+			return string();
+		return dev::pciBusId(0, bus, slot >> 3, slot & 7);
+	}
+	if (m_platformId == OPENCL_PLATFORM_AMD)
+	{
+		// cl_device_topology_amd: a 4 byte type, 1 for PCIe, then 17 bytes of
+		// padding and the bus, device and function.
+		unsigned char topology[24] = {};
+		if (clGetDeviceInfo(m_device(), CL_DEVICE_TOPOLOGY_AMD, sizeof(topology), topology, NULL) != CL_SUCCESS ||
+			topology[0] != 1)
+			return string();
+		return dev::pciBusId(0, topology[21], topology[22], topology[23]);
+	}
+	return string();
+}
 
-	// get all platforms
+bool CLMiner::initDevice()
+{
 	try
 	{
 		vector<cl::Platform> platforms = getPlatforms();
@@ -568,30 +1154,44 @@ bool CLMiner::init(const h256& seed)
 		string platformName = platforms[platformIdx].getInfo<CL_PLATFORM_NAME>();
 		ETHCL_LOG("Platform: " << platformName);
 
-		int platformId = OPENCL_PLATFORM_UNKNOWN;
 		{
 			// this mutex prevents race conditions when calling the adl wrapper since it is apparently not thread safe
 			static std::mutex mtx;
 			std::lock_guard<std::mutex> lock(mtx);
 
+			// The monitoring handles cover all GPUs (they are queried by
+			// index), so one of each is created for all miners.
+			static wrap_nvml_handle* s_nvmlh = nullptr;
+			static wrap_adl_handle* s_adlh = nullptr;
+#if defined(__linux)
+			static wrap_amdsysfs_handle* s_sysfsh = nullptr;
+#endif
 			if (platformName == "NVIDIA CUDA")
 			{
-				platformId = OPENCL_PLATFORM_NVIDIA;
-				nvmlh = wrap_nvml_create();
+				m_platformId = OPENCL_PLATFORM_NVIDIA;
+				if (!s_nvmlh)
+					s_nvmlh = wrap_nvml_create();
+				nvmlh = s_nvmlh;
 			}
 			else if (platformName == "AMD Accelerated Parallel Processing")
 			{
-				platformId = OPENCL_PLATFORM_AMD;
-				adlh = wrap_adl_create();
+				m_platformId = OPENCL_PLATFORM_AMD;
+				if (!s_adlh)
+					s_adlh = wrap_adl_create();
+				adlh = s_adlh;
 #if defined(__linux)
-				sysfsh = wrap_amdsysfs_create();
+				if (!s_sysfsh)
+					s_sysfsh = wrap_amdsysfs_create();
+				sysfsh = s_sysfsh;
 #endif
 			}
 			else if (platformName == "Clover")
 			{
-				platformId = OPENCL_PLATFORM_CLOVER;
+				m_platformId = OPENCL_PLATFORM_CLOVER;
 			}
 		}
+		if (m_hwSlot == HwMonSampler::c_slots)
+			m_hwSlot = HwMonSampler::get().add([this]() { return readHw(); });
 
 		// get GPU device of the default platform
 		vector<cl::Device> devices = getDevices(platforms, platformIdx);
@@ -602,8 +1202,8 @@ bool CLMiner::init(const h256& seed)
 		}
 
 		// use selected device
-		unsigned deviceId = s_devices[index] > -1 ? s_devices[index] : index;
-		cl::Device& device = devices[min<unsigned>(deviceId, devices.size() - 1)];
+		m_device = devices[min<unsigned>(deviceId(), devices.size() - 1)];
+		cl::Device& device = m_device;
 		string device_version = device.getInfo<CL_DEVICE_VERSION>();
 
 		string device_name = device.getInfo<CL_DEVICE_NAME>() + "\t" 
@@ -615,7 +1215,7 @@ bool CLMiner::init(const h256& seed)
 		string clVer = device_version.substr(7, 3);
 		if (clVer == "1.0" || clVer == "1.1")
 		{
-			if (platformId == OPENCL_PLATFORM_CLOVER)
+			if (m_platformId == OPENCL_PLATFORM_CLOVER)
 			{
 				ETHCL_LOG("OpenCL " << clVer << " not supported, but platform Clover might work nevertheless. USE AT OWN RISK!");
 			}
@@ -626,178 +1226,1073 @@ bool CLMiner::init(const h256& seed)
 			}
 		}
 
-		char options[256];
-		int computeCapability = 0;
-		if (platformId == OPENCL_PLATFORM_NVIDIA) {
+		if (m_platformId == OPENCL_PLATFORM_NVIDIA) {
 			cl_uint computeCapabilityMajor;
 			cl_uint computeCapabilityMinor;
 			clGetDeviceInfo(device(), CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV, sizeof(cl_uint), &computeCapabilityMajor, NULL);
 			clGetDeviceInfo(device(), CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV, sizeof(cl_uint), &computeCapabilityMinor, NULL);
 
-			computeCapability = computeCapabilityMajor * 10 + computeCapabilityMinor;
-			int maxregs = computeCapability >= 35 ? 72 : 63;
-			sprintf(options, "-cl-nv-maxrregcount=%d", maxregs);
+			m_computeCapability = computeCapabilityMajor * 10 + computeCapabilityMinor;
+			int maxregs = m_computeCapability >= 35 ? 72 : 63;
+			m_buildOptions = "-cl-nv-maxrregcount=" + to_string(maxregs);
 		}
-		else {
-			sprintf(options, "%s", "");
+		// Before the context: the driver allocates its host buffers as the
+		// context and its queues are created.
+		// The pool's threads are the devices' in common.
+		if (m_cpu.cpu() < 0 && !pooled())
+		{
+			string const busId = pciBusId();
+			if (!busId.empty())
+				m_cpu.pinNear(busId);
 		}
+
 		// create context
 		m_context = cl::Context(vector<cl::Device>(&device, &device + 1));
-		m_queue = cl::CommandQueue(m_context, device);
+		m_queue = cl::CommandQueue(m_context, device, s_profiling ? CL_QUEUE_PROFILING_ENABLE : 0);
 
 		// make sure that global work size is evenly divisible by the local workgroup size
 		m_workgroupSize = s_workgroupSize;
 		m_globalWorkSize = s_initialGlobalWorkSize;
 		if (m_globalWorkSize % m_workgroupSize != 0)
 			m_globalWorkSize = ((m_globalWorkSize / m_workgroupSize) + 1) * m_workgroupSize;
+		m_dagGlobalWorkSize = s_dagGlobalWorkSizeMultiplier ? s_dagGlobalWorkSizeMultiplier * m_workgroupSize : m_globalWorkSize;
+		m_hashesPerThread = s_hashesPerThread;
 
-		uint64_t dagSize = ethash_get_datasize(light->light->block_number);
-		uint32_t dagSize128 = (unsigned)(dagSize / ETHASH_MIX_BYTES);
-		uint32_t lightSize64 = (unsigned)(light->data().size() / sizeof(node));
-
-		// patch source code
-		// note: The kernels here are simply compiled version of the respective .cl kernels
-		// into a byte array by bin2h.cmake. There is no need to load the file by hand in runtime
-		// See libethash-cl/CMakeLists.txt: add_custom_command()
-		// TODO: Just use C++ raw string literal.
-		string code;
-
-		if(s_clKernelName == CLKernelName::Stable) {
-			cllog << "OpenCL kernel: Stable kernel";
-			code = string(CLMiner_kernel_stable, CLMiner_kernel_stable + sizeof(CLMiner_kernel_stable));
-		} else if ( s_clKernelName == CLKernelName::Unstable ) {
-			cllog << "OpenCL kernel: Unstable kernel";
-			code = string(CLMiner_kernel_unstable, CLMiner_kernel_unstable + sizeof(CLMiner_kernel_unstable));
-		} else if (s_clKernelName == CLKernelName::Custom) {
-			string kernelname = device.getInfo<CL_DEVICE_NAME>() + ".cl";
-			cllog << "OpenCL kernel: Custom '" + kernelname + "'";
-			std::ifstream t(kernelname);
-			if (t.good()) {
-				std::string ckernel;
-				t.seekg(0, std::ios::end);
-				ckernel.reserve(t.tellg());
-				t.seekg(0, std::ios::beg);
-				ckernel.assign((std::istreambuf_iterator<char>(t)),
-				std::istreambuf_iterator<char>());
-				code = ckernel;
-				cllog << "OpenCL kernel: Custom '" + kernelname +"'";
-			} else {
-				cllog << "OpenCL kernel: Custom '" + kernelname + "' not found";
-				std::ifstream t("kernel.cl");
-				if (t.good()) {
-					std::string ckernel;
-					t.seekg(0, std::ios::end);
-					ckernel.reserve(t.tellg());
-					t.seekg(0, std::ios::beg);
-					ckernel.assign((std::istreambuf_iterator<char>(t)),
-					std::istreambuf_iterator<char>());
-					code = ckernel;
-					cllog << "OpenCL kernel: Fallback 'kernel.cl'";
-				} else {
-					cllog << "OpenCL kernel: Fallback 'kernel.cl' not found";
-					cllog << "OpenCL kernel: Stable kernel";
-					code = string(CLMiner_kernel_stable, CLMiner_kernel_stable + sizeof(CLMiner_kernel_stable));
-				}
-			}
-		} else {
-			cllog << "OpenCL kernel: Default Stable kernel";
-			code = string(CLMiner_kernel_stable, CLMiner_kernel_stable + sizeof(CLMiner_kernel_stable));
-		}
-
-		cllog << "OpenCL kernel: GROUP_SIZE" << m_workgroupSize;
-		addDefinition(code, "GROUP_SIZE", m_workgroupSize);
-		cllog << "OpenCL kernel: DAG_SIZE" << dagSize128;
-		addDefinition(code, "DAG_SIZE", dagSize128);
-		cllog << "OpenCL kernel: LIGHT_SIZE" << lightSize64;
-		addDefinition(code, "LIGHT_SIZE", lightSize64);
-		cllog << "OpenCL kernel: ACCESSES" << ETHASH_ACCESSES;
-		addDefinition(code, "ACCESSES", ETHASH_ACCESSES);
-		cllog << "OpenCL kernel: MAX_OUTPUTS" << c_maxSearchResults;
-		addDefinition(code, "MAX_OUTPUTS", c_maxSearchResults);
-		cllog << "OpenCL kernel: PLATFORM" << platformId;
-		addDefinition(code, "PLATFORM", platformId);
-		cllog << "OpenCL kernel: COMPUTE" << computeCapability;
-		addDefinition(code, "COMPUTE", computeCapability);
-		cllog << "OpenCL kernel: THREADS_PER_HASH" << s_threadsPerHash;
-		addDefinition(code, "THREADS_PER_HASH", s_threadsPerHash);
-
-		// create miner OpenCL program
-		cl::Program::Sources sources{{code.data(), code.size()}};
-		cl::Program program(m_context, sources);
-		try
+		m_kernelName = s_clKernelName;
+		if (m_kernelName == CLKernelName::Auto)
 		{
-			program.build({device}, options);
-			cllog << "Build info:" << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+			m_kernelName = CLKernelName::Stable;
+			m_calibrate = true;
+			string const path = kernelProfilePath();
+			unsigned stored = 0;
+			if (!path.empty() && (std::ifstream(path) >> stored) && stored <= CLKernelName::Custom)
+			{
+				m_kernelName = (CLKernelName)stored;
+				m_calibrate = false;
+				cllog << "OpenCL kernel: calibrated" << kernelVariantName(m_kernelName) << "from" << path;
+			}
 		}
-		catch (cl::Error const&)
+
+		// create buffer for header
+		ETHCL_LOG("Creating buffer for header.");
+		m_header = cl::Buffer(m_context, CL_MEM_READ_ONLY, sizeof(JobConstants));
+
+		// create mining buffers
+		createSearchSlots(s_pipelineDepth);
+
+		if (s_persistentRounds > 1)
 		{
-			cwarn << "Build info:" << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-			return false;
+			// gid, the nonce's offset in a launch, is 32 bits in the kernels.
+			m_rounds = std::min<unsigned>(s_persistentRounds, 0xffffffffu / m_globalWorkSize);
+			m_control = cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, sizeof(uint32_t));
+			m_controlWord = static_cast<uint32_t*>(m_queue.enqueueMapBuffer(m_control, CL_TRUE, CL_MAP_WRITE, 0, sizeof(uint32_t)));
+			*m_controlWord = m_generation;
 		}
-
-		//check whether the current dag fits in memory everytime we recreate the DAG
+	}
+	catch (cl::Error const& err)
+	{
+		cwarn << ethCLErrorHelper("OpenCL device init failed", err);
+		releaseSearchSlots();
+		m_context = cl::Context();
+		return false;
+	}
+	return true;
+}
+
+bool CLMiner::initProgram(uint32_t _dagSize128, uint32_t _lightSize64)
+{
+	// patch source code
+	// note: The kernels here are simply compiled version of the respective .cl kernels
+	// into a byte array by bin2h.cmake. There is no need to load the file by hand in runtime
+	// See libethash-cl/CMakeLists.txt: add_custom_command()
+	// TODO: Just use C++ raw string literal.
+	string code;
+	bool custom = false;
+
+	// A prebuilt binary of the custom kernel comes before its sources. It has
+	// its definitions compiled in, so it is taken as built for an unsplit
+	// DAG and must take the DAG and light sizes as arguments.
+	string const binaryPath = m_kernelName == CLKernelName::Custom ? kernelBinaryPath() : string();
+	if (!binaryPath.empty() && m_splitDag)
+		cllog << "OpenCL kernel: binary" << binaryPath << "skipped, the DAG is split";
+	else if (!binaryPath.empty())
+	{
+		cl::Program program;
+		bytes const binary = readProgramBinary(binaryPath);
+		if (!binary.empty() && loadProgram(program, m_device, m_buildOptions, binary) &&
+			loadKernels(program, _dagSize128, _lightSize64))
+		{
+			if (!m_programSizes)
+			{
+				cllog << "OpenCL kernel: binary" << binaryPath;
+				return true;
+			}
+			cwarn << "OpenCL kernel binary" << binaryPath << "does not take the DAG size as an argument";
+		}
+		else
+			cwarn << "Cannot load OpenCL kernel binary" << binaryPath;
+	}
+
+	if(m_kernelName == CLKernelName::Stable) {
+		cllog << "OpenCL kernel: Stable kernel";
+		code = string(CLMiner_kernel_stable, CLMiner_kernel_stable + sizeof(CLMiner_kernel_stable));
+	} else if ( m_kernelName == CLKernelName::Unstable ) {
+		cllog << "OpenCL kernel: Unstable kernel";
+		code = string(CLMiner_kernel_unstable, CLMiner_kernel_unstable + sizeof(CLMiner_kernel_unstable));
+	} else if (m_kernelName == CLKernelName::Custom) {
+		string kernelname = m_device.getInfo<CL_DEVICE_NAME>() + ".cl";
+		cllog << "OpenCL kernel: Custom '" + kernelname + "'";
+		std::ifstream t(kernelname);
+		if (t.good()) {
+			std::string ckernel;
+			t.seekg(0, std::ios::end);
+			ckernel.reserve(t.tellg());
+			t.seekg(0, std::ios::beg);
+			ckernel.assign((std::istreambuf_iterator<char>(t)),
+			std::istreambuf_iterator<char>());
+			code = ckernel;
+			custom = true;
+			cllog << "OpenCL kernel: Custom '" + kernelname +"'";
+		} else {
+			cllog << "OpenCL kernel: Custom '" + kernelname + "' not found";
+			std::ifstream t("kernel.cl");
+			if (t.good()) {
+				std::string ckernel;
+				t.seekg(0, std::ios::end);
+				ckernel.reserve(t.tellg());
+				t.seekg(0, std::ios::beg);
+				ckernel.assign((std::istreambuf_iterator<char>(t)),
+				std::istreambuf_iterator<char>());
+				code = ckernel;
+				custom = true;
+				cllog << "OpenCL kernel: Fallback 'kernel.cl'";
+			} else {
+				cllog << "OpenCL kernel: Fallback 'kernel.cl' not found";
+				cllog << "OpenCL kernel: Stable kernel";
+				code = string(CLMiner_kernel_stable, CLMiner_kernel_stable + sizeof(CLMiner_kernel_stable));
+			}
+		}
+	} else {
+		cllog << "OpenCL kernel: Default Stable kernel";
+		code = string(CLMiner_kernel_stable, CLMiner_kernel_stable + sizeof(CLMiner_kernel_stable));
+	}
+
+	cllog << "OpenCL kernel: GROUP_SIZE" << m_workgroupSize;
+	addDefinition(code, "GROUP_SIZE", m_workgroupSize);
+	// The built-in kernels take the sizes as arguments, so they are built once
+	// per device. Custom kernels may still expect them defined.
+	if (custom)
+	{
+		cllog << "OpenCL kernel: DAG_SIZE" << _dagSize128;
+		addDefinition(code, "DAG_SIZE", _dagSize128);
+		cllog << "OpenCL kernel: LIGHT_SIZE" << _lightSize64;
+		addDefinition(code, "LIGHT_SIZE", _lightSize64);
+	}
+	cllog << "OpenCL kernel: DAG_SEGMENTS" << (m_splitDag ? c_maxDagSegments : 1);
+	addDefinition(code, "DAG_SEGMENTS", m_splitDag ? c_maxDagSegments : 1);
+	cllog << "OpenCL kernel: ACCESSES" << ETHASH_ACCESSES;
+	addDefinition(code, "ACCESSES", ETHASH_ACCESSES);
+	cllog << "OpenCL kernel: MAX_OUTPUTS" << c_maxSearchResults;
+	addDefinition(code, "MAX_OUTPUTS", c_maxSearchResults);
+	cllog << "OpenCL kernel: PLATFORM" << m_platformId;
+	addDefinition(code, "PLATFORM", m_platformId);
+	cllog << "OpenCL kernel: COMPUTE" << m_computeCapability;
+	addDefinition(code, "COMPUTE", m_computeCapability);
+	cllog << "OpenCL kernel: THREADS_PER_HASH" << s_threadsPerHash;
+	addDefinition(code, "THREADS_PER_HASH", s_threadsPerHash);
+	cllog << "OpenCL kernel: PARALLEL_HASH" << m_hashesPerThread;
+	addDefinition(code, "PARALLEL_HASH", m_hashesPerThread);
+	cllog << "OpenCL kernel: PERSISTENT" << (m_controlWord ? 1 : 0);
+	addDefinition(code, "PERSISTENT", m_controlWord ? 1 : 0);
+	if (uint64_t const probeTarget = Miner::probeTarget())
+	{
+		cllog << "OpenCL kernel: PROBE_TARGET" << probeTarget;
+		code.insert(0, "#define PROBE_TARGET " + to_string(probeTarget) + "UL\n");
+	}
+	// The stable kernel trades its local memory exchanges for sub-group
+	// shuffles where the device has them.
+	string options = m_buildOptions;
+	if (!custom && m_kernelName != CLKernelName::Unstable)
+	{
+		string const extensions = m_device.getInfo<CL_DEVICE_EXTENSIONS>();
+		int shuffle = 0;
+		if (extensions.find("cl_intel_subgroups") != string::npos)
+			shuffle = 1;
+		else if (extensions.find("cl_khr_subgroups") != string::npos && extensions.find("cl_khr_subgroup_shuffle") != string::npos)
+			shuffle = 2;
+		cllog << "OpenCL kernel: SHUFFLE" << shuffle;
+		addDefinition(code, "SHUFFLE", shuffle);
+		// The cl_khr_subgroups built-ins are OpenCL C 2.0.
+		if (shuffle == 2)
+			options += " -cl-std=CL2.0";
+	}
+
+	// create miner OpenCL program
+	cl::Program program;
+	if (!buildProgram(program, m_device, options, code))
+		return false;
+	return loadKernels(program, _dagSize128, _lightSize64);
+}
+
+bool CLMiner::loadKernels(cl::Program const& _program, uint32_t _dagSize128, uint32_t _lightSize64)
+{
+	cllog << "Loading kernels";
+	m_searchKernel = cl::Kernel(_program, "ethash_search");
+	m_dagKernel = cl::Kernel(_program, "ethash_calculate_dag_item");
+	// Binaries may have been built for another work group size.
+	size_t const groupSize = m_searchKernel.getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(m_device)[0];
+	if (groupSize && groupSize != m_workgroupSize)
+	{
+		cllog << "OpenCL kernel: local work size" << groupSize;
+		m_workgroupSize = (unsigned)groupSize;
+		m_globalWorkSize = (m_globalWorkSize + m_workgroupSize - 1) / m_workgroupSize * m_workgroupSize;
+		m_dagGlobalWorkSize = (m_dagGlobalWorkSize + m_workgroupSize - 1) / m_workgroupSize * m_workgroupSize;
+	}
+	m_searchKernel.setArg(5, ~0u);  // Pass this to stop the compiler unrolling the loops.
+	m_dagKernel.setArg(3, ~0u);
+	// Those without the size arguments need a rebuild when the sizes change.
+	cl_uint const args = m_searchKernel.getInfo<CL_KERNEL_NUM_ARGS>();
+	m_programSizes = args > 6 ? 0 : uint64_t(_dagSize128) << 32 | _lightSize64;
+	m_segmentArgs = args > 7 && m_dagKernel.getInfo<CL_KERNEL_NUM_ARGS>() > 6;
+	if (m_splitDag && !m_segmentArgs)
+	{
+		cwarn << "The OpenCL kernel does not support a DAG split over several buffers";
+		return false;
+	}
+	m_persistent = m_controlWord && args > 11;
+	if (m_controlWord && !m_persistent)
+	{
+		cwarn << "The OpenCL kernel does not support persistent searches, launching one per global work size";
+	}
+	if (m_persistent)
+	{
+		m_searchKernel.setArg(11, m_control);
+		m_searchKernel.setArg(12, m_generation);
+		m_searchKernel.setArg(13, m_rounds);
+	}
+	return true;
+}
+
+void CLMiner::generateDAG(uint64_t _dagSize)
+{
+	uint32_t const work = (uint32_t)(_dagSize / sizeof(node));
+	uint32_t const runs = (work + m_dagGlobalWorkSize - 1) / m_dagGlobalWorkSize;
+	// The chunks are queued in c_dagBatches batches, each ending in a marker.
+	// Only the marker of the batch before the last queued one is waited for,
+	// so the device always has a batch to run while the host catches up.
+	uint32_t const batchRuns = (runs + c_dagBatches - 1) / c_dagBatches;
+	std::deque<cl::Event> batches;
+	uint32_t done = 0;
+	// The first and last chunks, when profiling.
+	cl::Event first;
+	cl::Event last;
+	auto const start = chrono::steady_clock::now();
+	dagProgressed(0, _dagSize, 0);
+	for (uint32_t i = 0; i < runs; i++)
+	{
+		m_dagKernel.setArg(0, i * m_dagGlobalWorkSize);
+		cl::Event* timed = !s_profiling ? nullptr : i == 0 ? &first : i + 1 == runs ? &last : nullptr;
+		m_queue.enqueueNDRangeKernel(m_dagKernel, cl::NullRange, m_dagGlobalWorkSize, m_workgroupSize, nullptr, timed);
+		if ((i + 1) % batchRuns != 0 && i + 1 != runs)
+			continue;
+		batches.emplace_back();
+		m_queue.enqueueMarkerWithWaitList(nullptr, &batches.back());
+		m_queue.flush();
+		while (batches.size() > 2 || (i + 1 == runs && !batches.empty()))
+		{
+			batches.front().wait();
+			batches.pop_front();
+			done = std::min(done + batchRuns, runs);
+			double const ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			dagProgressed(std::min<uint64_t>(uint64_t(done) * m_dagGlobalWorkSize * sizeof(node), _dagSize), _dagSize, ms);
+			cllog << "DAG" << done * 100 / runs << "%";
+		}
+	}
+	if (s_profiling && runs)
+		profileDag(first, runs == 1 ? first : last, _dagSize);
+}
+
+void CLMiner::profileSearch(cl::Event const& _kernel, uint64_t _hashes)
+{
+	cl_ulong const start = _kernel.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	cl_ulong const end = _kernel.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	double const ms = (end - start) / 1e6;
+	// Searches overlapping on the device have no gap.
+	double const gapMs = m_lastSearchEnd && start > m_lastSearchEnd ? (start - m_lastSearchEnd) / 1e6 : 0;
+	double const bytes = double(_hashes) * ETHASH_ACCESSES * ETHASH_MIX_BYTES;
+	searchTimed((end - start) / 1000);
+
+	Guard l(x_profile);
+	m_lastSearchEnd = end;
+	m_profile.enabled = true;
+	++m_profile.searches;
+	double const weight = 1.0 / std::min<uint64_t>(m_profile.searches, c_profileAverage);
+	m_profile.searchMs += (ms - m_profile.searchMs) * weight;
+	m_profile.gapMs += (gapMs - m_profile.gapMs) * weight;
+	if (ms > 0)
+		m_profile.bandwidth += (bytes / (ms * 1e6) - m_profile.bandwidth) * weight;
+}
+
+void CLMiner::profileDag(cl::Event const& _first, cl::Event const& _last, uint64_t _dagSize)
+{
+	cl_ulong const start = _first.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	cl_ulong const end = _last.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	double const ms = (end - start) / 1e6;
+
+	Guard l(x_profile);
+	// The wait for the DAG is not the host starving the searches.
+	m_lastSearchEnd = 0;
+	m_profile.enabled = true;
+	m_profile.dagMs = ms;
+	m_profile.dagBandwidth = ms > 0 ? _dagSize / (ms * 1e6) : 0;
+	cllog << "DAG kernels ran for" << ms << "ms," << m_profile.dagBandwidth << "GB/s";
+}
+
+KernelProfile CLMiner::kernelProfile() const
+{
+	Guard l(x_profile);
+	return m_profile;
+}
+
+void CLMiner::startPrebuild(h256 const& _seed)
+{
+	m_next.seed = h256();
+	m_next.ready = false;
+	m_next.light.reset();
+	// Custom kernels with the sizes compiled in cannot generate another epoch.
+	if (!s_dagPrebuild || m_programSizes)
+		return;
+
+	uint64_t const block = EthashAux::number(_seed) + ETHASH_EPOCH_LENGTH;
+	uint64_t const dagSize = ethash_get_datasize(block);
+	uint64_t const lightSize = ethash_get_cachesize(block);
+	cl_ulong const total = m_device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	if (m_dag.capacity() + m_lightCapacity + m_resident.dag.capacity() + m_resident.lightCapacity +
+		max(m_next.dag.capacity(), dagSize) + max(m_next.lightCapacity, lightSize) >= total / 16 * 15)
+	{
+		cllog << "Not enough memory to prebuild the next DAG";
+		m_next.dag = DagBuffers();
+		m_next.lightBuffer = cl::Buffer();
+		m_next.lightCapacity = 0;
+		return;
+	}
+
+	h256 const seed = EthashAux::seedHash((unsigned)block);
+	m_next.seed = seed;
+	m_next.runs = 0;
+	m_next.pending = std::async(std::launch::async, [seed]() { pinVerifyThread(); return EthashAux::light(seed); });
+}
+
+void CLMiner::stepPrebuild()
+{
+	if (!m_next.seed || m_next.ready || ++m_next.searches % s_dagPrebuild != 0)
+		return;
+
+	if (!m_next.light)
+	{
+		if (m_next.pending.wait_for(chrono::seconds(0)) != std::future_status::ready)
+			return;
+		try
+		{
+			m_next.light = m_next.pending.get();
+			uint64_t const dagSize = ethash_get_datasize(m_next.light->light->block_number);
+			uint64_t const lightSize = m_next.light->data().size();
+			// Switching to a split DAG needs a program rebuild: left to init().
+			if (dagSize > m_next.dag.capacity() && (!allocateDag(m_next.dag, dagSize) || (m_next.dag.segments.size() > 1 && !m_splitDag)))
+				throw std::runtime_error("the DAG needs more buffers than the program supports");
+			if (lightSize > m_next.lightCapacity)
+			{
+				m_next.lightBuffer = cl::Buffer();
+				m_next.lightBuffer = cl::Buffer(m_context, CL_MEM_READ_ONLY, lightSize);
+				m_next.lightCapacity = lightSize;
+			}
+			// Blocking, once per epoch: behind the searches in flight.
+			m_queue.enqueueWriteBuffer(m_next.lightBuffer, CL_TRUE, 0, lightSize, m_next.light->data().data());
+			m_next.run = 0;
+			m_next.runs = (uint32_t)((dagSize / sizeof(node) + m_dagGlobalWorkSize - 1) / m_dagGlobalWorkSize);
+			cllog << "Prebuilding the DAG of epoch" << m_next.light->epoch();
+		}
+		catch (std::exception const& _e)
+		{
+			cwarn << "Cannot prebuild the next DAG:" << _e.what();
+			m_next.dag = DagBuffers();
+			m_next.lightBuffer = cl::Buffer();
+			m_next.lightCapacity = 0;
+			m_next.seed = h256();
+			m_next.light.reset();
+			return;
+		}
+	}
+
+	// The arguments are set again by init() before it generates a DAG.
+	m_dagKernel.setArg(0, m_next.run * m_dagGlobalWorkSize);
+	m_dagKernel.setArg(1, m_next.lightBuffer);
+	setDagArgs(m_dagKernel, 2, 6, m_next.dag);
+	m_dagKernel.setArg(4, (uint32_t)(ethash_get_datasize(m_next.light->light->block_number) / ETHASH_MIX_BYTES));
+	m_dagKernel.setArg(5, (uint32_t)(m_next.light->data().size() / sizeof(node)));
+	m_queue.enqueueNDRangeKernel(m_dagKernel, cl::NullRange, m_dagGlobalWorkSize, m_workgroupSize);
+	if (++m_next.run == m_next.runs)
+	{
+		m_next.ready = true;
+		cllog << "Next DAG queued";
+	}
+}
+
+void CLMiner::keepResidentDag(uint64_t _dagSize, uint64_t _lightSize)
+{
+	// The one kept before goes either way: it is the older of the two.
+	m_resident = ResidentDag();
+	cl_ulong const total = m_device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	if (m_dag.capacity() + m_lightCapacity + m_next.dag.capacity() + m_next.lightCapacity + _dagSize + _lightSize >= total / 16 * 15)
+	{
+		cllog << "Not enough memory to keep the DAG of epoch" << EthashAux::number(m_dagSeed) / ETHASH_EPOCH_LENGTH << "on the device";
+		return;
+	}
+	cllog << "Keeping the DAG of epoch" << EthashAux::number(m_dagSeed) / ETHASH_EPOCH_LENGTH << "on the device";
+	m_resident.seed = m_dagSeed;
+	swap(m_resident.dag, m_dag);
+	swap(m_resident.light, m_light);
+	swap(m_resident.lightCapacity, m_lightCapacity);
+}
+
+bool CLMiner::dagShared() const
+{
+	if (s_dagLoadMode != DAG_LOAD_MODE_SINGLE || instances() < 2)
+		return false;
+	// Only if the creator is one of the miners, or the others would wait for it.
+	for (unsigned i = 0; i < instances(); ++i)
+		if ((s_devices[i] > -1 ? (unsigned)s_devices[i] : i) == s_dagCreateDevice)
+			return true;
+	return false;
+}
+
+bool CLMiner::dagCreator() const
+{
+	return deviceId() == s_dagCreateDevice;
+}
+
+void CLMiner::announceSharedDag(h256 const& _seed, uint64_t _size, bool _staging)
+{
+	{
+		UniqueGuard l(x_dagShare);
+		s_dagShareChanged.wait(l, [&]() { return !s_dagShare.users; });
+		freeSharedDag();
+		s_dagShare.seed = _seed;
+		s_dagShare.staging = _staging;
+		s_dagShare.failed = false;
+		s_dagShare.size = _size;
+		s_dagShare.staged = 0;
+		s_dagShare.passed = 0;
+		s_dagShare.wrapped = false;
+	}
+	s_dagShareChanged.notify_all();
+}
+
+void CLMiner::shareDag(unsigned _epoch, uint64_t _size)
+{
+	auto const start = chrono::steady_clock::now();
+	{
+		Guard l(x_dagShare);
+		if (s_dagShare.passed >= instances() - 1)
+			return;
+	}
+	try
+	{
+		HostMemory::Reservation memory = HostMemory::reserve(HostMemory::Staging, _size, min(_size, 2 * c_dagShareChunk));
+		uint64_t const ring = memory.bytes();
+		cl::Buffer pinned(m_context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, ring);
+		uint8_t* host = (uint8_t*)m_queue.enqueueMapBuffer(pinned, CL_TRUE, CL_MAP_WRITE, 0, ring);
+		{
+			Guard l(x_dagShare);
+			s_dagShare.pinned = pinned;
+			s_dagShare.queue = m_queue;
+			s_dagShare.host = host;
+			s_dagShare.ring = ring;
+			s_dagShare.memory = std::move(memory);
+		}
+		if (ring < _size)
+			cllog << "Copying DAG from device" << deviceId() << "to host through" << ring / (1024 * 1024)
+				  << "MB, within the host memory budget";
+		else
+			cllog << "Copying DAG from device" << deviceId() << "to host";
+		auto const joinDeadline = chrono::steady_clock::now() + chrono::seconds(c_dagShareWaitSeconds);
+		// Two chunks in flight: the one read back is published while the next
+		// is still on the bus.
+		uint64_t const segmentBytes = uint64_t(m_dag.segmentItems) * ETHASH_MIX_BYTES;
+		std::deque<std::pair<cl::Event, uint64_t>> reads;
+		for (uint64_t offset = 0; offset < _size || !reads.empty();)
+		{
+			if (offset < _size && reads.size() < 2)
+			{
+				uint64_t const within = offset % segmentBytes;
+				uint64_t const n = min(min(c_dagShareChunk, ring - offset % ring), min(segmentBytes - within, _size - offset));
+				if (offset + n > ring)
+				{
+					// Over bytes of the ring's last round: once the others have
+					// joined, or were given long enough to, and uploaded those.
+					// What is read back must be published for them first.
+					for (; !reads.empty(); reads.pop_front())
+					{
+						reads.front().first.wait();
+						{
+							Guard l(x_dagShare);
+							s_dagShare.staged = reads.front().second;
+						}
+						s_dagShareChanged.notify_all();
+					}
+					UniqueGuard l(x_dagShare);
+					auto const drained = [&]()
+					{
+						if (s_dagShare.users + s_dagShare.passed < instances() - 1 && chrono::steady_clock::now() < joinDeadline)
+							return false;
+						for (auto const& u: s_dagShare.uploaded)
+							if (u.second < offset + n - ring)
+								return false;
+						return true;
+					};
+					while (!s_dagShareChanged.wait_for(l, chrono::seconds(1), drained))
+						if (shouldStop())
+							throw cl::Error(CL_INVALID_OPERATION, "stopped");
+					s_dagShare.wrapped = true;
+				}
+				reads.emplace_back(cl::Event(), offset + n);
+				m_queue.enqueueReadBuffer(m_dag.segments[offset / segmentBytes], CL_FALSE, within, n, host + offset % ring,
+					nullptr, &reads.back().first);
+				m_queue.flush();
+				offset += n;
+				continue;
+			}
+			reads.front().first.wait();
+			{
+				Guard l(x_dagShare);
+				s_dagShare.staged = reads.front().second;
+			}
+			s_dagShareChanged.notify_all();
+			reads.pop_front();
+		}
+	}
+	catch (cl::Error const& err)
+	{
+		cwarn << ethCLErrorHelper("Cannot stage the DAG for the other devices", err);
+		failSharedDag();
+		return;
+	}
+	{
+		// All may have had their own after all.
+		Guard l(x_dagShare);
+		if (s_dagShare.passed >= instances() - 1 && !s_dagShare.users)
+			freeSharedDag();
+	}
+	dagStaged(_epoch, "download", _size, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+}
+
+bool CLMiner::copySharedDag(unsigned _epoch, h256 const& _seed, uint64_t _size)
+{
+	{
+		UniqueGuard l(x_dagShare);
+		auto const deadline = chrono::steady_clock::now() + chrono::seconds(c_dagShareWaitSeconds);
+		while (!s_dagShareChanged.wait_for(l, chrono::seconds(1), [&]() { return s_dagShare.seed == _seed; }))
+			if (shouldStop() || chrono::steady_clock::now() > deadline)
+				return false;
+		if (!s_dagShare.staging || s_dagShare.failed || s_dagShare.size != _size || s_dagShare.wrapped)
+		{
+			++s_dagShare.passed;
+			return false;
+		}
+		++s_dagShare.users;
+		s_dagShare.uploaded[index] = 0;
+	}
+
+	// From once the creator decided: the wait for the read back is the generation's.
+	auto const start = chrono::steady_clock::now();
+	cllog << "Copying DAG from host to device" << deviceId();
+	uint64_t const segmentBytes = uint64_t(m_dag.segmentItems) * ETHASH_MIX_BYTES;
+	bool copied = true;
+	try
+	{
+		std::deque<std::pair<cl::Event, uint64_t>> writes;
+		for (uint64_t offset = 0; offset < _size;)
+		{
+			uint8_t const* host;
+			uint64_t ring;
+			uint64_t staged;
+			if (!writes.empty())
+			{
+				// Caught up: what is in flight must be done before the
+				// creator can read back over it.
+				for (; !writes.empty(); writes.pop_front())
+					writes.front().first.wait();
+				{
+					Guard l(x_dagShare);
+					s_dagShare.uploaded[index] = offset;
+				}
+				s_dagShareChanged.notify_all();
+			}
+			{
+				UniqueGuard l(x_dagShare);
+				while (!s_dagShareChanged.wait_for(l, chrono::seconds(1), [&]() { return s_dagShare.staged > offset || s_dagShare.failed; }))
+					if (shouldStop())
+						break;
+				if (s_dagShare.failed || s_dagShare.staged <= offset)
+				{
+					copied = false;
+					break;
+				}
+				host = s_dagShare.host;
+				ring = s_dagShare.ring;
+				staged = s_dagShare.staged;
+			}
+			for (; offset < staged; m_queue.flush())
+			{
+				uint64_t const within = offset % segmentBytes;
+				uint64_t const n = min(min(c_dagShareChunk, ring - offset % ring), min(segmentBytes - within, staged - offset));
+				writes.emplace_back(cl::Event(), offset + n);
+				m_queue.enqueueWriteBuffer(m_dag.segments[offset / segmentBytes], CL_FALSE, within, n, host + offset % ring,
+					nullptr, &writes.back().first);
+				offset += n;
+				// Two in flight, as in shareDag(). What is uploaded of a ring
+				// may be read back over.
+				while (writes.size() > 2)
+				{
+					writes.front().first.wait();
+					if (ring < _size)
+					{
+						{
+							Guard l(x_dagShare);
+							s_dagShare.uploaded[index] = writes.front().second;
+						}
+						s_dagShareChanged.notify_all();
+					}
+					writes.pop_front();
+				}
+			}
+		}
+		// Also on failure: the host buffer must not go while a write reads it.
+		m_queue.finish();
+	}
+	catch (cl::Error const& err)
+	{
+		cwarn << ethCLErrorHelper("Cannot upload the shared DAG", err);
+		copied = false;
+		try
+		{
+			m_queue.finish();
+		}
+		catch (cl::Error const&)
+		{
+		}
+	}
+	{
+		Guard l(x_dagShare);
+		--s_dagShare.users;
+		s_dagShare.uploaded.erase(index);
+	}
+	passSharedDag(_seed);
+	if (copied)
+		dagStaged(_epoch, "host-copy", _size, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	return copied;
+}
+
+void CLMiner::passSharedDag(h256 const& _seed)
+{
+	{
+		Guard l(x_dagShare);
+		if (s_dagShare.seed != _seed)
+			return;
+		// The creator is not one of the others.
+		if (++s_dagShare.passed >= instances() - 1 && !s_dagShare.users)
+			freeSharedDag();
+	}
+	s_dagShareChanged.notify_all();
+}
+
+void CLMiner::failSharedDag()
+{
+	{
+		Guard l(x_dagShare);
+		s_dagShare.failed = true;
+		if (!s_dagShare.users)
+			freeSharedDag();
+	}
+	s_dagShareChanged.notify_all();
+}
+
+void CLMiner::freeSharedDag()
+{
+	if (!s_dagShare.host)
+		return;
+	cnote << "Freeing DAG from host";
+	try
+	{
+		s_dagShare.queue.enqueueUnmapMemObject(s_dagShare.pinned, s_dagShare.host);
+		s_dagShare.queue.flush();
+	}
+	catch (cl::Error const& err)
+	{
+		cwarn << ethCLErrorHelper("Cannot unmap the shared DAG", err);
+	}
+	s_dagShare.host = nullptr;
+	s_dagShare.pinned = cl::Buffer();
+	s_dagShare.queue = cl::CommandQueue();
+	s_dagShare.ring = 0;
+	s_dagShare.memory.release();
+}
+
+void CLMiner::stepDagCheck()
+{
+	DagReadBack& r = m_dagReadBack;
+	if (r.pending)
+	{
+		cl_int const status = r.read.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+		if (status > CL_COMPLETE)
+			return;
+		r.pending = false;
+		if (status == CL_COMPLETE)
+			checkDag(r.seed, move(r.items), move(r.data));
+	}
+
+	vector<uint32_t> const corrupt = corruptDagItems(m_current.seed);
+	if (!corrupt.empty())
+	{
+		// Behind the searches in flight; those queued after see it whole.
+		setKernelArgs(m_dagSize128, m_lightSize64);
+		std::set<uint32_t> runs;
+		for (uint32_t item: corrupt)
+			runs.insert(item * 2 / m_dagGlobalWorkSize);
+		for (uint32_t run: runs)
+		{
+			m_dagKernel.setArg(0, run * m_dagGlobalWorkSize);
+			m_queue.enqueueNDRangeKernel(m_dagKernel, cl::NullRange, m_dagGlobalWorkSize, m_workgroupSize);
+		}
+		dagHealthRepaired((unsigned)runs.size());
+		cwarn << "Regenerated" << runs.size() << "DAG chunks of" << corrupt.size() << "corrupt items";
+	}
+
+	if (!m_dagSize128 || m_dag.segments.empty() || !dagCheckDue())
+		return;
+	r.seed = m_current.seed;
+	r.items = DagVerifier::pickItems(m_dagSize128, DagVerifier::c_items);
+	r.data.resize(r.items.size() * ETHASH_MIX_BYTES);
+	for (size_t i = 0; i < r.items.size(); ++i)
+	{
+		uint32_t const item = r.items[i];
+		m_queue.enqueueReadBuffer(m_dag.segments[item / m_dag.segmentItems], CL_FALSE,
+			uint64_t(item % m_dag.segmentItems) * ETHASH_MIX_BYTES, ETHASH_MIX_BYTES, r.data.data() + i * ETHASH_MIX_BYTES,
+			nullptr, i + 1 == r.items.size() ? &r.read : nullptr);
+	}
+	r.pending = true;
+}
+
+bool CLMiner::allocateDag(DagBuffers& _dag, uint64_t _size)
+{
+	// Released first, there may not be room for both.
+	_dag = DagBuffers();
+	uint64_t const maxAlloc = m_device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	uint64_t const items = (_size + ETHASH_MIX_BYTES - 1) / ETHASH_MIX_BYTES;
+	uint64_t const maxItems = maxAlloc / ETHASH_MIX_BYTES;
+	uint64_t const segments = (items + maxItems - 1) / maxItems;
+	if (segments > c_maxDagSegments)
+		return false;
+	_dag.segmentItems = (uint32_t)((items + segments - 1) / segments);
+	for (uint64_t i = 0; i < segments; ++i)
+		_dag.segments.push_back(cl::Buffer(m_context, CL_MEM_READ_ONLY, uint64_t(_dag.segmentItems) * ETHASH_MIX_BYTES));
+	return true;
+}
+
+void CLMiner::setDagArgs(cl::Kernel& _kernel, unsigned _first, unsigned _segment, DagBuffers const& _dag)
+{
+	_kernel.setArg(_first, _dag.segments[0]);
+	if (!m_segmentArgs)
+		return;
+	// Unused segments get the last buffer: they are never indexed.
+	_kernel.setArg(_segment, _dag.segmentItems);
+	for (unsigned i = 1; i < c_maxDagSegments; ++i)
+		_kernel.setArg(_segment + i, _dag.segments[min<size_t>(i, _dag.segments.size() - 1)]);
+}
+
+uint64_t CLMiner::reserveSize(uint64_t _size, uint64_t _headroom) const
+{
+	// Sized for the next epochs too, where the device has memory to spare.
+	cl_ulong const total = m_device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	return _headroom < total / 16 * 15 ? _headroom : _size;
+}
+
+void CLMiner::setKernelArgs(uint32_t _dagSize128, uint32_t _lightSize64)
+{
+	m_searchKernel.setArg(1, m_header);
+	setDagArgs(m_searchKernel, 2, 7, m_dag);
+	setDagArgs(m_dagKernel, 2, 6, m_dag);
+	if (!m_programSizes)
+	{
+		m_searchKernel.setArg(6, _dagSize128);
+		m_dagKernel.setArg(4, _dagSize128);
+		m_dagKernel.setArg(5, _lightSize64);
+	}
+	m_dagKernel.setArg(1, m_light);
+}
+
+string CLMiner::kernelBinaryPath() const
+{
+	// The device name is the gfx ID on recent AMD drivers.
+	string name = m_device.getInfo<CL_DEVICE_NAME>();
+	string driver = m_device.getInfo<CL_DRIVER_VERSION>();
+	for (string* s: {&name, &driver})
+		for (char& c: *s)
+			if (!isalnum((unsigned char)c) && c != '.' && c != '-')
+				c = '_';
+	for (string const& path: {s_kernelDirectory + "/" + name + "-" + driver + ".bin", s_kernelDirectory + "/" + name + ".bin"})
+		if (std::ifstream(path).good())
+			return path;
+	return string();
+}
+
+string CLMiner::kernelProfilePath() const
+{
+	// The fastest variant depends on the device and driver, and on the work
+	// sizes it is run with.
+	string const dir = EthashAux::dagDirectory();
+	if (dir.empty())
+		return string();
+	string key = m_device.getInfo<CL_DEVICE_NAME>();
+	for (string const& s: {m_device.getInfo<CL_DEVICE_VENDOR>(), m_device.getInfo<CL_DRIVER_VERSION>(),
+			m_device.getInfo<CL_DEVICE_VERSION>(), to_string(m_workgroupSize), to_string(m_globalWorkSize),
+			to_string(s_threadsPerHash), to_string(m_hashesPerThread), to_string(s_persistentRounds > 1 ? s_persistentRounds : 1)})
+		key += '\0' + s;
+	return dir + "/cl-kernel-" + sha3(key).hex();
+}
+
+void CLMiner::calibrateKernel(uint32_t _dagSize128, uint32_t _lightSize64)
+{
+	m_calibrate = false;
+	vector<CLKernelName> variants{CLKernelName::Stable, CLKernelName::Unstable};
+	// Without its file the custom kernel falls back to the stable one.
+	if (!kernelBinaryPath().empty() || std::ifstream(m_device.getInfo<CL_DEVICE_NAME>() + ".cl").good() ||
+		std::ifstream("kernel.cl").good())
+		variants.push_back(CLKernelName::Custom);
+
+	// A target of 0 finds nothing, so the output buffer is never written.
+	cl::Buffer output(m_context, CL_MEM_WRITE_ONLY, c_searchBufferSize);
+	m_queue.enqueueFillBuffer(output, 0u, 0, c_searchBufferSize);
+	m_queue.enqueueFillBuffer(m_header, 0u, 0, sizeof(JobConstants));
+
+	CLKernelName best = m_kernelName;
+	double bestRate = 0;
+	for (CLKernelName variant: variants)
+	{
+		m_kernelName = variant;
+		try
+		{
+			if (!initProgram(_dagSize128, _lightSize64))
+				continue;
+			setKernelArgs(_dagSize128, _lightSize64);
+			m_searchKernel.setArg(0, output);
+			m_searchKernel.setArg(3, uint64_t(0));
+			m_searchKernel.setArg(4, uint64_t(0));
+			uint64_t const launch = uint64_t(m_globalWorkSize) * (m_persistent ? m_rounds : 1);
+
+			// The first launch pays for the driver's first use, it is not timed.
+			m_queue.enqueueNDRangeKernel(m_searchKernel, cl::NullRange, m_globalWorkSize, m_workgroupSize);
+			m_queue.finish();
+			uint64_t hashes = 0;
+			auto const start = std::chrono::steady_clock::now();
+			std::chrono::steady_clock::duration elapsed;
+			do
+			{
+				// A few at a time, so the queue does not run dry between them.
+				for (unsigned i = 0; i < s_pipelineDepth; ++i)
+					m_queue.enqueueNDRangeKernel(m_searchKernel, cl::NullRange, m_globalWorkSize, m_workgroupSize);
+				m_queue.finish();
+				hashes += launch * s_pipelineDepth;
+				elapsed = std::chrono::steady_clock::now() - start;
+			}
+			while (elapsed < std::chrono::milliseconds(c_calibrationMs) && !shouldStop());
+
+			double const rate = hashes / std::chrono::duration<double>(elapsed).count();
+			cnote << "OpenCL kernel:" << kernelVariantName(variant) << rate / 1e6 << "MH/s";
+			if (rate > bestRate)
+			{
+				best = variant;
+				bestRate = rate;
+			}
+		}
+		catch (cl::Error const& _e)
+		{
+			cwarn << ethCLErrorHelper("OpenCL kernel calibration failed", _e);
+		}
+	}
+	m_kernelName = best;
+	if (!bestRate)
+		return;
+	cnote << "OpenCL kernel: selected" << kernelVariantName(best);
+
+	string const path = kernelProfilePath();
+	if (path.empty())
+		return;
+	if (!writeFileAtomically(path, [&](std::ostream& _f) { _f << (unsigned)best << '\n'; }))
+	{
+		cwarn << "Cannot write OpenCL kernel profile" << path;
+	}
+}
+
+bool CLMiner::init(const h256& seed)
+{
+	unsigned const epoch = unsigned(EthashAux::number(seed) / ETHASH_EPOCH_LENGTH);
+	auto const lightStart = chrono::steady_clock::now();
+	EthashAux::LightType light = EthashAux::light(seed);
+	dagStaged(epoch, "light", light->data().size(), chrono::duration<double, milli>(chrono::steady_clock::now() - lightStart).count());
+
+	try
+	{
+		if (!m_context() && !initDevice())
+			return false;
+
+		uint64_t dagSize = ethash_get_datasize(light->light->block_number);
+		uint32_t dagSize128 = (unsigned)(dagSize / ETHASH_MIX_BYTES);
+		uint32_t lightSize64 = (unsigned)(light->data().size() / sizeof(node));
+
+		//check whether the current dag fits in memory everytime we recreate the DAG
 		cl_ulong result = 0;
-		device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &result);
+		m_device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &result);
 		if (result < dagSize)
 		{
 			cnote <<
-			"OpenCL device " << device.getInfo<CL_DEVICE_NAME>()
+			"OpenCL device " << m_device.getInfo<CL_DEVICE_NAME>()
 							 << " has insufficient GPU memory." << result <<
 							 " bytes of memory found < " << dagSize << " bytes of memory required";	
 			return false;
 		}
 
-		// create buffer for dag
+		// Searches still queued on the previous epoch run before the buffers
+		// below are touched: the queue is in order.
+		bool const prebuilt = m_next.ready && m_next.seed == seed;
+		bool const resident = !prebuilt && m_resident.seed == seed;
+		if (s_dualDag && !prebuilt && !resident && m_dagSeed && m_dagSeed != seed)
+			keepResidentDag(dagSize, light->data().size());
+		h256 const previous = m_dagSeed;
+		m_dagSeed = h256();
+		bool const shared = dagShared();
+		bool const creator = shared && dagCreator();
+		// Held until the DAG is generated, see setInitBudget(). The others
+		// upload the creator's, and only take it when they generate their own.
+		InitBudget budget(prebuilt || resident || (shared && !creator) ? 0 : dagSize);
+		if (creator)
+			announceSharedDag(seed, dagSize, !prebuilt && !resident);
+		else if (shared && (prebuilt || resident))
+			passSharedDag(seed);
+		// Unless shareDag() is reached, the others must not wait for it.
+		struct ShareGuard
+		{
+			bool armed;
+			~ShareGuard() { if (armed) failSharedDag(); }
+		} shareGuard{creator && !prebuilt && !resident};
 		try
 		{
-			cllog << "Creating light cache buffer, size" << light->data().size();
-			m_light = cl::Buffer(m_context, CL_MEM_READ_ONLY, light->data().size());
-			cllog << "Creating DAG buffer, size" << dagSize;
-			m_dag = cl::Buffer(m_context, CL_MEM_READ_ONLY, dagSize);
-			cllog << "Loading kernels";
-			m_searchKernel = cl::Kernel(program, "ethash_search");
-			m_dagKernel = cl::Kernel(program, "ethash_calculate_dag_item");
-			cllog << "Writing light cache buffer";
-			m_queue.enqueueWriteBuffer(m_light, CL_TRUE, 0, light->data().size(), light->data().data());
+			if (prebuilt)
+			{
+				cnote << "Switching to the prebuilt DAG of epoch" << epoch;
+				dagStaged(epoch, "prebuilt", 0, 0);
+				// The old buffers take the epoch after this one.
+				swap(m_dag, m_next.dag);
+				swap(m_light, m_next.lightBuffer);
+				swap(m_lightCapacity, m_next.lightCapacity);
+			}
+			else if (resident)
+			{
+				cnote << "Switching to the DAG of epoch" << epoch << "kept on the device";
+				dagStaged(epoch, "kept", 0, 0);
+				// The one in use is kept in its place.
+				swap(m_dag, m_resident.dag);
+				swap(m_light, m_resident.light);
+				swap(m_lightCapacity, m_resident.lightCapacity);
+				m_resident.seed = previous;
+			}
+			else
+			{
+				if (light->data().size() > m_lightCapacity)
+				{
+					m_lightCapacity = reserveSize(light->data().size(),
+						ethash_get_cachesize(light->light->block_number + c_bufferHeadroomEpochs * ETHASH_EPOCH_LENGTH));
+					cllog << "Creating light cache buffer, size" << m_lightCapacity;
+					m_light = cl::Buffer();
+					m_light = cl::Buffer(m_context, CL_MEM_READ_ONLY, m_lightCapacity);
+				}
+				if (dagSize > m_dag.capacity())
+				{
+					uint64_t const capacity = reserveSize(dagSize,
+						ethash_get_datasize(light->light->block_number + c_bufferHeadroomEpochs * ETHASH_EPOCH_LENGTH));
+					if (!allocateDag(m_dag, capacity) && !allocateDag(m_dag, dagSize))
+					{
+						cwarn << "The DAG needs more than" << c_maxDagSegments << "buffers on this device";
+						return false;
+					}
+					cllog << "Creating DAG buffer, size" << m_dag.capacity() << "in" << m_dag.segments.size() << "segments";
+				}
+				cllog << "Writing light cache buffer";
+				m_queue.enqueueWriteBuffer(m_light, CL_TRUE, 0, light->data().size(), light->data().data());
+			}
 		}
 		catch (cl::Error const& err)
 		{
 			cwarn << ethCLErrorHelper("Creating DAG buffer failed", err);
+			m_dag = DagBuffers();
+			m_light = cl::Buffer();
+			m_lightCapacity = 0;
+			// Room for the next attempt.
+			m_resident = ResidentDag();
 			return false;
 		}
-		// create buffer for header
-		ETHCL_LOG("Creating buffer for header.");
-		m_header = cl::Buffer(m_context, CL_MEM_READ_ONLY, 32);
 
-		m_searchKernel.setArg(1, m_header);
-		m_searchKernel.setArg(2, m_dag);
-		m_searchKernel.setArg(5, ~0u);  // Pass this to stop the compiler unrolling the loops.
-
-		// create mining buffers
-		ETHCL_LOG("Creating mining buffer");
-		m_searchBuffer = cl::Buffer(m_context, CL_MEM_WRITE_ONLY, (c_maxSearchResults + 1) * sizeof(uint32_t));
+		bool const split = m_dag.segments.size() > 1;
+		if (!m_searchKernel() || (split && !m_splitDag) || (m_programSizes && m_programSizes != (uint64_t(dagSize128) << 32 | lightSize64)))
+		{
+			m_splitDag = m_splitDag || split;
+			if (!initProgram(dagSize128, lightSize64))
+				return false;
+		}
 
-		uint32_t const work = (uint32_t)(dagSize / sizeof(node));
-		uint32_t fullRuns = work / m_globalWorkSize;
-		uint32_t const restWork = work % m_globalWorkSize;
-		if (restWork > 0) fullRuns++;
+		setKernelArgs(dagSize128, lightSize64);
+		m_dagSize128 = dagSize128;
+		m_lightSize64 = lightSize64;
 
-		m_dagKernel.setArg(1, m_light);
-		m_dagKernel.setArg(2, m_dag);
-		m_dagKernel.setArg(3, ~0u);
+		if (!prebuilt && !resident)
+		{
+			auto startDAG = std::chrono::steady_clock::now();
+			if (shared && !creator && copySharedDag(epoch, seed, dagSize))
+			{
+				auto dagTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startDAG);
+				cnote << "DAG copied from device" << s_dagCreateDevice << "in" << dagTime.count() << "ms.";
+			}
+			else
+			{
+				if (shouldStop())
+					return false;
+				InitBudget own(shared && !creator ? dagSize : 0);
+				generateDAG(dagSize);
+				auto endDAG = std::chrono::steady_clock::now();
+
+				auto dagTime = std::chrono::duration_cast<std::chrono::milliseconds>(endDAG-startDAG);
+				float gb = (float)dagSize / (1024 * 1024 * 1024);
+				cnote << gb << " GB of DAG data generated in" << dagTime.count() << "ms.";
+				dagStaged(epoch, "generate", dagSize, std::chrono::duration<double, std::milli>(endDAG - startDAG).count());
+				if (creator)
+				{
+					shareGuard.armed = false;
+					shareDag(epoch, dagSize);
+				}
+			}
+		}
 
-		auto startDAG = std::chrono::steady_clock::now();
-		for (uint32_t i = 0; i < fullRuns; i++)
+		if (m_calibrate)
 		{
-			m_dagKernel.setArg(0, i * m_globalWorkSize);
-			m_queue.enqueueNDRangeKernel(m_dagKernel, cl::NullRange, m_globalWorkSize, m_workgroupSize);
-			m_queue.finish();
+			calibrateKernel(dagSize128, lightSize64);
+			if (!initProgram(dagSize128, lightSize64))
+				return false;
+			setKernelArgs(dagSize128, lightSize64);
 		}
-		auto endDAG = std::chrono::steady_clock::now();
+		publishTuning();
+		m_dagSeed = seed;
 
-		auto dagTime = std::chrono::duration_cast<std::chrono::milliseconds>(endDAG-startDAG);
-		float gb = (float)dagSize / (1024 * 1024 * 1024);
-		cnote << gb << " GB of DAG data generated in" << dagTime.count() << "ms.";
+		startPrebuild(seed);
 	}
 	catch (cl::Error const& err)
 	{
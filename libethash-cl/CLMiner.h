@@ -5,9 +5,13 @@
 
 #pragma once
 
+#include <future>
+#include <map>
+#include <libdevcore/Affinity.h>
 #include <libdevcore/Worker.h>
 #include <libethcore/EthashAux.h>
 #include <libethcore/Miner.h>
+#include <libhwmon/HwMonSampler.h>
 #include <libhwmon/wrapnvml.h>
 #include <libhwmon/wrapadl.h>
 #if defined(__linux)
@@ -30,6 +34,18 @@
 #define CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV       0x4001
 #endif
 
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+#define CL_DEVICE_PCI_BUS_ID_NV                     0x4008
+#endif
+
+#ifndef CL_DEVICE_PCI_SLOT_ID_NV
+#define CL_DEVICE_PCI_SLOT_ID_NV                    0x4009
+#endif
+
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+#define CL_DEVICE_TOPOLOGY_AMD                      0x4037
+#endif
+
 #define OPENCL_PLATFORM_UNKNOWN 0
 #define OPENCL_PLATFORM_NVIDIA  1
 #define OPENCL_PLATFORM_AMD     2
@@ -47,6 +63,8 @@ enum CLKernelName {
 	Stable,
 	Unstable,
 	Custom,
+	/// The fastest of the others on the device, see CLMiner::calibrateKernel().
+	Auto,
 };
 
 class CLMiner: public Miner
@@ -62,6 +80,9 @@ public:
 	/// Default value of the kernel is the original one
 	static const CLKernelName c_defaultKernelName = CLKernelName::Stable;
 
+	/// Default number of searches in flight, see setPipelineDepth().
+	static const unsigned c_defaultPipelineDepth = 2;
+
 	CLMiner(FarmFace& _farm, unsigned _index);
 	~CLMiner();
 
@@ -78,6 +99,33 @@ public:
 	);
 	static void setNumInstances(unsigned _instances) { s_numInstances = std::min<unsigned>(_instances, getNumDevices()); }
 	static void setThreadsPerHash(unsigned _threadsPerHash){s_threadsPerHash = _threadsPerHash; }
+	/// PARALLEL_HASH of the stable kernel, which always uses 8 threads per hash.
+	static void setHashesPerThread(unsigned _hashes) { s_hashesPerThread = _hashes; }
+	/// Global work size of each DAG generation chunk, as a multiple of the
+	/// local work size. 0 uses the search's global work size.
+	/// Generates the next epoch's DAG into a second buffer ahead of time, one
+	/// chunk after every _every-th search, if the device has the memory. 0 never does.
+	static void setDagPrebuild(unsigned _every) { s_dagPrebuild = _every; }
+	/// Keeps the DAG of the last other epoch on the device when the work
+	/// moves to a new one, if it has the memory for both, so that switching
+	/// back (pools on different coins) takes no regeneration.
+	static void setDualDag(bool _dual) { s_dualDag = _dual; }
+	static void setDagGlobalWorkSizeMultiplier(unsigned _multiplier) { s_dagGlobalWorkSizeMultiplier = _multiplier; }
+	/// Searches queued at once; their results are read back while the next
+	/// ones run. 1 waits for each search before launching the next.
+	static void setPipelineDepth(unsigned _depth) { s_pipelineDepth = std::max(1u, std::min(_depth, 8u)); }
+	/// Solutions are submitted with the mix hash found by the GPU. Every
+	/// _every-th one is also fully evaluated on the CPU; 0 never does.
+	static void setVerifyEvery(unsigned _every) { s_verifyEvery = _every; }
+	/// Each search launch runs _rounds global work sizes of nonces, its work
+	/// items striding through them, and stops early once newer work arrives.
+	/// 0 or 1 launches the kernel once per global work size.
+	static void setPersistentRounds(unsigned _rounds) { s_persistentRounds = _rounds; }
+	/// Grows or shrinks each device's global work size, in multiples of the
+	/// local work size, so that a search takes about _ms of wall time: fewer
+	/// launches on fast devices, quick work switches on slow ones. 0 keeps
+	/// the size given. Not for persistent searches.
+	static void setKernelTarget(unsigned _ms) { s_kernelTargetMs = _ms; }
 	static void setDevices(unsigned * _devices, unsigned _selectedDeviceCount)
 	{
 		for (unsigned i = 0; i < _selectedDeviceCount; i++)
@@ -95,37 +143,362 @@ public:
 		else if (_clKernel == 2) {
 			s_clKernelName = CLKernelName::Custom;
 		}
+		else if (_clKernel == 3) {
+			s_clKernelName = CLKernelName::Auto;
+		}
 		else {
 			s_clKernelName = CLKernelName::Stable;
 		}
 	}
+	/// Where the custom kernel looks for prebuilt binaries first, as
+	/// <device name>-<driver version>.bin or <device name>.bin. They must have
+	/// the argument lists of the stable kernel and MAX_OUTPUTS of c_maxSearchResults.
+	static void setKernelDirectory(string const& _dir) { s_kernelDirectory = _dir; }
+	/// Bounds the DAG bytes generated at once by all devices, 0 for no bound.
+	/// One device always goes ahead; with --dag-load-mode sequential no
+	/// other does meanwhile.
+	static void setInitBudget(uint64_t _bytes) { s_initBudget = _bytes; }
+	/// Creates the queues with CL_QUEUE_PROFILING_ENABLE and times the search
+	/// and DAG kernels on the device, see kernelProfile().
+	static void setProfiling(bool _profiling) { s_profiling = _profiling; }
+	KernelProfile kernelProfile() const override;
 	HwMonitor hwmon() override;
 	string Name() override;
 protected:
 	void kick_miner() override;
+	/// local_work and global_work as --cl-local-work and --cl-global-work,
+	/// kernel as --cl-kernel (but auto) and parallel_hash.
+	bool checkTuning(std::string const& _name, unsigned _value, std::string& _error) const override;
 
 private:
 	void workLoop() override;
-	void report(uint64_t _nonce, WorkPackage const& _w);
+	bool workStep(std::chrono::milliseconds& _wait) override;
+	bool steppable() const override { return true; }
+	/// workStep() but for its errors.
+	bool stepSearches(std::chrono::milliseconds& _wait);
+	void report(uint64_t _nonce, h256 const& _mix, WorkPackage const& _w, WorkSlot::Clock::time_point _kernelDone);
+	/// Takes the parameters queued by tune(), with no searches in flight,
+	/// rebuilding the program if need be. false if it cannot be built with
+	/// either the new or the old parameters.
+	bool applyTuning();
+	void publishTuning();
 
+	/// Per epoch: (re)fills the light cache and DAG buffers, allocating them
+	/// and building the program only the first time or when they do not fit.
 	bool init(const h256& seed);
+	/// Platform, device, context, queue and search buffers, once per miner.
+	bool initDevice();
+	/// The sysfs name of m_device, empty if the platform does not tell.
+	std::string pciBusId();
+	bool initProgram(uint32_t _dagSize128, uint32_t _lightSize64);
+	/// Takes the kernels of @a _program and checks which arguments they have.
+	bool loadKernels(cl::Program const& _program, uint32_t _dagSize128, uint32_t _lightSize64);
+	/// The custom kernel's prebuilt binary for this device, empty if there is none.
+	string kernelBinaryPath() const;
+	/// Points the kernels at the header, DAG and light buffers.
+	void setKernelArgs(uint32_t _dagSize128, uint32_t _lightSize64);
+	/// Times each kernel variant on the generated DAG for c_calibrationMs and
+	/// stores the fastest in the device's profile as m_kernelName. The caller
+	/// rebuilds the program with it.
+	void calibrateKernel(uint32_t _dagSize128, uint32_t _lightSize64);
+	/// File the calibrated variant is kept in, empty without a DAG directory.
+	string kernelProfilePath() const;
+	/// Fills a DAG through m_dagKernel, whose buffer and size arguments are set.
+	void generateDAG(uint64_t _dagSize);
+	/// Starts preparing the DAG of the epoch after @a _seed's, see setDagPrebuild().
+	void startPrebuild(h256 const& _seed);
+	/// Queues the next chunk of the prebuilt DAG when it is due.
+	void stepPrebuild();
+	/// Moves the DAG in use to m_resident, in place of the one there, if
+	/// the device can hold a new one of @a _dagSize and @a _lightSize besides.
+	void keepResidentDag(uint64_t _dagSize, uint64_t _lightSize);
+	/// @a _headroom if the device can hold it, else @a _size.
+	uint64_t reserveSize(uint64_t _size, uint64_t _headroom) const;
+	/// Builds @a _code for @a _device, going through the on-disk binary cache
+	/// in the DAG directory, see programKey().
+	bool buildProgram(cl::Program& _program, cl::Device const& _device, string const& _options, string const& _code);
+	bool loadProgram(cl::Program& _program, cl::Device const& _device, string const& _options, bytes const& _binary);
 
+	/// As SEARCH_RESULTS of the CUDA kernel.
+	static const unsigned c_maxSearchResults = 4;
+
+	/// Output buffer of ethash_search. count may exceed c_maxSearchResults,
+	/// the hits beyond it are not stored.
+	struct SearchResults
+	{
+		uint32_t count;
+		struct
+		{
+			uint32_t gid;
+			uint32_t mix[8];
+		} result[c_maxSearchResults];
+		/// Rounds the first work group of a persistent launch got through.
+		uint32_t rounds;
+		/// Pseudo-shares found, the gid of the first one, see
+		/// Miner::setProbeDifficulty(). Zero for custom kernels without them.
+		uint32_t probes;
+		uint32_t probeGid;
+	};
+	static constexpr size_t c_searchBufferSize = sizeof(SearchResults);
+
+	/// One search in flight: its output buffer, pinned host copy and job.
+	struct SearchSlot
+	{
+		CLMiner* miner = nullptr;
+		cl::Buffer buffer;			///< Written by the search kernel.
+		cl::Buffer staging;			///< CL_MEM_ALLOC_HOST_PTR memory mapped at results.
+		SearchResults* results = nullptr;
+		cl::Event read;
+		cl::Event kernel;			///< The search, when profiling.
+		std::atomic<bool> done = {false};	///< Set by searchRead().
+		bool busy = false;
+		bool readBack = true;		///< Its results are read into results.
+		uint64_t startNonce = 0;
+		WorkPackage work;
+		unsigned size = 0;			///< The global work size it ran.
+		WorkSlot::Clock::time_point launched;
+		WorkSlot::Clock::time_point completed;	///< Set by searchRead() before done.
+	};
+
+	/// Allocates @a _depth slots, none of them busy, in place of m_slots.
+	void createSearchSlots(unsigned _depth);
+	void releaseSearchSlots();
+	/// Passes the number of busy slots, as from @a _at, to searchesInFlight().
+	void noteInFlight(WorkSlot::Clock::time_point _at, bool _launched);
+	/// Adds a completed search of @a _hashes nonces to m_profile.
+	void profileSearch(cl::Event const& _kernel, uint64_t _hashes);
+	/// Records a DAG generation, the chunks from @a _first to @a _last.
+	void profileDag(cl::Event const& _first, cl::Event const& _last, uint64_t _dagSize);
+	/// Tells persistent searches still running to leave at their next round.
+	void abortSearches();
+	static void CL_CALLBACK searchRead(cl_event, cl_int, void* _slot);
+	/// Times a completed search for setKernelTarget(), resizing the next
+	/// launches once c_adaptSamples of them are off the target.
+	void adaptWorkSize(SearchSlot const& _slot);
+	static const unsigned c_adaptSamples = 8;
+
+	/// Buffers are allocated for the size this many epochs ahead.
+	static const unsigned c_bufferHeadroomEpochs = 8;
+	/// DAG generation waits on (and reports progress for) this many batches.
+	static const unsigned c_dagBatches = 32;
+	/// A share of s_initBudget, taken (waiting for it if need be) for as long
+	/// as it lives.
+	struct InitBudget
+	{
+		explicit InitBudget(uint64_t _cost);
+		~InitBudget();
+		InitBudget(InitBudget const&) = delete;
+		InitBudget& operator=(InitBudget const&) = delete;
+		uint64_t m_cost = 0;
+	};
+
+	/// Searches the profile's moving averages are taken over.
+	static const unsigned c_profileAverage = 16;
+	/// Time each variant is run for by calibrateKernel().
+	static const unsigned c_calibrationMs = 2000;
+
+	/// The DAG, in up to c_maxDagSegments buffers of segmentItems 128 byte items
+	/// each on devices capping single allocations below its size.
+	struct DagBuffers
+	{
+		std::vector<cl::Buffer> segments;
+		uint32_t segmentItems = 0;
+		uint64_t capacity() const { return uint64_t(segmentItems) * ETHASH_MIX_BYTES * segments.size(); }
+	};
+	static const unsigned c_maxDagSegments = 4;
+
+	/// DAG items being read back for DagVerifier.
+	struct DagReadBack
+	{
+		h256 seed;
+		std::vector<uint32_t> items;
+		bytes data;
+		cl::Event read;		///< Of the last item.
+		bool pending = false;
+	};
+	DagReadBack m_dagReadBack;
+	/// Between searches: regenerates the chunks of the corrupt DAG items found,
+	/// hands the items read back to DagVerifier and reads back more when due.
+	void stepDagCheck();
+
+	/// Replaces @a _dag with buffers holding @a _size bytes.
+	/// @return false if that takes more than c_maxDagSegments allocations.
+	bool allocateDag(DagBuffers& _dag, uint64_t _size);
+	/// Sets the DAG arguments of @a _kernel: the first buffer at @a _first,
+	/// the segment size and other buffers from @a _segment on.
+	void setDagArgs(cl::Kernel& _kernel, unsigned _first, unsigned _segment, DagBuffers const& _dag);
+
+	/// The next epoch's DAG, generated between searches on the same queue:
+	/// once all its chunks are queued, searches queued later see it complete.
+	struct DagPrebuild
+	{
+		h256 seed;
+		std::future<EthashAux::LightType> pending;	///< Its light cache, computed off the miner thread.
+		EthashAux::LightType light;				///< Set once pending is, and uploaded.
+		DagBuffers dag;
+		cl::Buffer lightBuffer;
+		uint64_t lightCapacity = 0;
+		uint32_t run = 0;
+		uint32_t runs = 0;
+		unsigned searches = 0;
+		bool ready = false;
+	};
+
+	/// The DAG of another epoch kept with setDualDag(), the least recently
+	/// used of the two.
+	struct ResidentDag
+	{
+		h256 seed;
+		DagBuffers dag;
+		cl::Buffer light;
+		uint64_t lightCapacity = 0;
+	};
+
+	/// In DAG_LOAD_MODE_SINGLE, s_dagCreateDevice's DAG, read back into pinned
+	/// host memory of its context for the other devices to upload, see shareDag().
+	struct DagShare
+	{
+		/// The epoch the creator decided for, and whether it is staging it;
+		/// if not, the others generate their own.
+		h256 seed;
+		bool staging = false;
+		bool failed = false;
+		uint64_t size = 0;
+		cl::Buffer pinned;
+		cl::CommandQueue queue;		///< The creator's, which mapped pinned.
+		uint8_t* host = nullptr;
+		/// Bytes at host: the DAG's, or within the host memory budget fewer,
+		/// a ring the chunks go round once every upload is past them.
+		uint64_t ring = 0;
+		HostMemory::Reservation memory;
+		/// The ring went round once: a device joining now is too late.
+		bool wrapped = false;
+		/// Bytes of host already read back.
+		uint64_t staged = 0;
+		/// Devices uploading from host now, and done with seed either way.
+		unsigned users = 0;
+		unsigned passed = 0;
+		/// Bytes each of the users, by miner index, has uploaded so far.
+		std::map<unsigned, uint64_t> uploaded;
+	};
+	static Mutex x_dagShare;
+	static std::condition_variable s_dagShareChanged;
+	static DagShare s_dagShare;
+	/// Bytes read back or uploaded at once.
+	static const uint64_t c_dagShareChunk = 64 * 1024 * 1024;
+	/// Longest the other devices wait for the creator to get to a new epoch.
+	static const unsigned c_dagShareWaitSeconds = 30;
+	/// The device of this miner, of the platform's.
+	unsigned deviceId() const { return s_devices[index] > -1 ? s_devices[index] : index; }
+	/// This miner generates the DAG for the others, or they do for it.
+	bool dagCreator() const;
+	bool dagShared() const;
+	/// The creator's part: tells the others whether it will stage @a _seed's DAG,
+	/// once none is still uploading the previous one.
+	void announceSharedDag(h256 const& _seed, uint64_t _size, bool _staging);
+	/// Reads the generated DAG back into the pinned host buffer, chunk by chunk,
+	/// waiting for the uploads to catch up if it is a ring.
+	void shareDag(unsigned _epoch, uint64_t _size);
+	/// The others' part: uploads the creator's DAG of @a _seed, with the chunks
+	/// overlapped. False (and nothing done) if it is not staged or the creator
+	/// takes too long to say; the DAG must then be generated here.
+	bool copySharedDag(unsigned _epoch, h256 const& _seed, uint64_t _size);
+	/// Done with the share of @a _seed, copied or not: the last frees it.
+	static void passSharedDag(h256 const& _seed);
+	/// The creator will not stage the DAG it announced after all.
+	static void failSharedDag();
+	/// The pinned host buffer goes; x_dagShare is held.
+	static void freeSharedDag();
+
+	cl::Device m_device;
+	/// The variant built, s_clKernelName unless that is Auto.
+	CLKernelName m_kernelName = CLKernelName::Stable;
+	/// Auto without a stored profile: calibrate once the DAG is there.
+	bool m_calibrate = false;
+	string m_buildOptions;
+	int m_platformId = OPENCL_PLATFORM_UNKNOWN;
+	int m_computeCapability = 0;
+	/// DAG and light sizes compiled into the program, 0 if they are arguments.
+	uint64_t m_programSizes = 0;
+	/// The program was built for a DAG in segments, see DagBuffers.
+	bool m_splitDag = false;
+	/// The kernels take the segment arguments, whether split or not.
+	bool m_segmentArgs = false;
+	uint64_t m_lightCapacity = 0;
+	DagPrebuild m_next;
+	ResidentDag m_resident;
+	/// Of the DAG in m_dag, once it is generated.
+	h256 m_dagSeed;
 	cl::Context m_context;
 	cl::CommandQueue m_queue;
 	cl::Kernel m_searchKernel;
 	cl::Kernel m_dagKernel;
-	cl::Buffer m_dag;
+	DagBuffers m_dag;
 	cl::Buffer m_light;
+	/// m_header's contents: the header, then the job's part of the first
+	/// Keccak round of every hash, see ethash_keccak_job(). Custom kernels
+	/// may read the header only.
+	struct JobConstants
+	{
+		uint8_t header[32];
+		uint64_t lanes[25];
+		uint64_t chi[5];
+	};
 	cl::Buffer m_header;
-	cl::Buffer m_searchBuffer;
+	JobConstants m_jobConstants;
+	std::vector<SearchSlot> m_slots;
+	unsigned m_nextSlot = 0;
+	/// Searches have their results read back; without, as for measuring the
+	/// host loop, they only count their hashes. See the "readback" tuning.
+	bool m_readback = true;
+	/// The work the searches are set up for.
+	WorkPackage m_current;
+	/// Read by the writes resetting the search buffers. Cannot be static
+	/// because crashes on macOS.
+	uint32_t const m_zero = 0;
+	/// Solutions reported, for s_verifyEvery.
+	unsigned m_reported = 0;
 	unsigned m_globalWorkSize = 0;
 	unsigned m_workgroupSize = 0;
+	unsigned m_hashesPerThread = 1;
+	/// Of the DAG and light the kernels are set up for.
+	uint32_t m_dagSize128 = 0;
+	uint32_t m_lightSize64 = 0;
+	unsigned m_dagGlobalWorkSize = 0;
+	/// Persistent searches, see setPersistentRounds(), poll the mapped
+	/// m_control word and leave once it differs from m_generation. It is
+	/// pinned host memory written directly, as the queue is busy with them.
+	bool m_persistent = false;
+	unsigned m_rounds = 1;
+	cl::Buffer m_control;
+	uint32_t volatile* m_controlWord = nullptr;
+	uint32_t m_generation = 0;
+	mutable Mutex x_profile;
+	KernelProfile m_profile;
+	/// Device time the last timed search ended, 0 after a DAG generation.
+	cl_ulong m_lastSearchEnd = 0;
+	/// Of adaptWorkSize(): the last search seen done, and the smoothed wall
+	/// time of those since the size last changed.
+	WorkSlot::Clock::time_point m_lastCompleted;
+	double m_searchUs = 0;
+	unsigned m_searchSamples = 0;
 
 	static unsigned s_platformId;
 	static unsigned s_numInstances;
 	static unsigned s_threadsPerHash;
+	static unsigned s_hashesPerThread;
+	static unsigned s_pipelineDepth;
+	static unsigned s_verifyEvery;
+	static unsigned s_persistentRounds;
+	static unsigned s_kernelTargetMs;
+	static bool s_profiling;
+	static uint64_t s_initBudget;
+	static Mutex x_initBudget;
+	static std::condition_variable s_initBudgetFreed;
+	static uint64_t s_initBudgetUsed;
 	static CLKernelName s_clKernelName;
 	static int s_devices[16];
+	static string s_kernelDirectory;
 
 	static string s_devicenames[16];
 
@@ -133,12 +506,22 @@ private:
 	static unsigned s_workgroupSize;
 	/// The initial global work size for the searches
 	static unsigned s_initialGlobalWorkSize;
+	/// Of the DAG generation chunks, 0 for s_initialGlobalWorkSize.
+	static unsigned s_dagGlobalWorkSizeMultiplier;
+	static unsigned s_dagPrebuild;
+	static bool s_dualDag;
+
+	/// The driver queries of hwmon(), made on the sampler thread.
+	HwReading readHw();
 
 	wrap_nvml_handle *nvmlh = NULL;
 	wrap_adl_handle *adlh = NULL;
 #if defined(__linux)
 	wrap_amdsysfs_handle *sysfsh = NULL;
 #endif
+	/// Of the HwMonSampler, c_slots until registered.
+	unsigned m_hwSlot = HwMonSampler::c_slots;
+	CpuClaim m_cpu;
 };
 
 }
@@ -19,12 +19,25 @@
 #define PLATFORM OPENCL_PLATFORM_AMD
 #endif
 
-#ifndef DAG_SIZE
-#define DAG_SIZE 8388593
+// 1 for cl_intel_subgroups, 2 for cl_khr_subgroup_shuffle: the 8 work items
+// of a hash exchange their state through sub-group shuffles instead of local
+// memory and barriers. Sub-groups must be a multiple of 8 wide.
+#ifndef SHUFFLE
+#define SHUFFLE 0
 #endif
 
-#ifndef LIGHT_SIZE
-#define LIGHT_SIZE 262139
+#if SHUFFLE == 1
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#define SUB_GROUP_SHUFFLE(x, i) intel_sub_group_shuffle(x, i)
+#elif SHUFFLE == 2
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#pragma OPENCL EXTENSION cl_khr_subgroup_shuffle : enable
+#define SUB_GROUP_SHUFFLE(x, i) sub_group_shuffle(x, i)
+#endif
+
+#if SHUFFLE
+// x of work item l of this one's hash, as __shfl(x, l, 8) in CUDA.
+#define SHFL8(x, l) SUB_GROUP_SHUFFLE(x, (get_sub_group_local_id() & ~7u) | (l))
 #endif
 
 #define ETHASH_DATASET_PARENTS 256
@@ -37,6 +50,15 @@
 #endif
 
 #define THREADS_PER_HASH (128 / 16)
+
+// Hashes each group of THREADS_PER_HASH work items mixes at once, for more
+// DAG loads in flight per work item. 1, 2, 4 or 8.
+#ifndef PARALLEL_HASH
+#define PARALLEL_HASH 1
+#endif
+#if PARALLEL_HASH != 1 && PARALLEL_HASH != 2 && PARALLEL_HASH != 4 && PARALLEL_HASH != 8
+#error "Invalid PARALLEL_HASH, it needs to be 1, 2, 4 or 8"
+#endif
 #define HASHES_PER_LOOP (GROUP_SIZE / THREADS_PER_HASH)
 #define FNV_PRIME	0x01000193
 
@@ -210,7 +232,8 @@ static void keccak_f1600_round(uint2* a, uint r)
 	chi(a, 20, t);
 }
 
-static void keccak_f1600_no_absorb(uint2* a, uint out_size, uint isolate)
+// Rounds r to 23; 0 for the whole permutation.
+static void keccak_f1600_no_absorb(uint2* a, uint r, uint out_size, uint isolate)
 {
 	// Originally I unrolled the first and last rounds to interface
 	// better with surrounding code, however I haven't done this
@@ -218,7 +241,7 @@ static void keccak_f1600_no_absorb(uint2* a, uint out_size, uint isolate)
 
 	
 	//uint o = 25;
-	for (uint r = 0; r < 24;)
+	for (; r < 24;)
 	{
 		// This dynamic branch stops the AMD compiler unrolling the loop
 		// and additionally saves about 33% of the VGPRs, enough to gain another
@@ -261,6 +284,64 @@ typedef struct
 	ulong ulongs[32 / sizeof(ulong)];
 } hash32_t;
 
+// What CLMiner writes to the header buffer: the header, then the job's part
+// of the first Keccak round of sha3_512(header .. nonce), see ethash_keccak_job().
+typedef struct
+{
+	ulong header[4];
+	ulong lanes[25];
+	ulong chi[5];
+} job_t;
+
+// keccak_f1600_round(a, 0) of sha3_512(header .. nonce) from the job's
+// lanes: only the nonce's rotations and the chi of the lanes they reach are left.
+static void keccak_f1600_first_round(uint2* a, __constant job_t const* job, uint2 const n)
+{
+	uint2 t[25];
+	for (uint i = 0; i != 25; ++i)
+	{
+		t[i] = as_uint2(job->lanes[i]);
+	}
+	t[0] ^= n;
+	t[3] ^= ROL2(n, 22);
+	t[5] ^= ROL2(n, 29);
+	t[7] ^= ROL2(n, 3);
+	t[12] ^= ROL2(n, 26);
+	t[14] ^= ROL2(n, 18);
+	t[15] ^= ROL2(n, 27);
+	t[16] ^= ROL2(n, 36);
+	t[19] ^= ROL2(n, 57);
+	t[21] ^= ROL2(n, 56);
+	t[23] ^= ROL2(n, 41);
+
+	// Chi, with the job's terms of the lanes without the nonce
+	a[0] = t[0] ^ as_uint2(job->chi[0]) ^ Keccak_f1600_RC[0];
+	a[1] = bitselect(t[1] ^ t[3], t[1], t[2]);
+	a[2] = bitselect(t[2] ^ t[4], t[2], t[3]);
+	a[3] = bitselect(t[3] ^ t[0], t[3], t[4]);
+	a[4] = bitselect(t[4] ^ t[1], t[4], t[0]);
+	a[5] = bitselect(t[5] ^ t[7], t[5], t[6]);
+	a[6] = bitselect(t[6] ^ t[8], t[6], t[7]);
+	a[7] = t[7] ^ as_uint2(job->chi[1]);
+	a[8] = bitselect(t[8] ^ t[5], t[8], t[9]);
+	a[9] = bitselect(t[9] ^ t[6], t[9], t[5]);
+	a[10] = bitselect(t[10] ^ t[12], t[10], t[11]);
+	a[11] = bitselect(t[11] ^ t[13], t[11], t[12]);
+	a[12] = bitselect(t[12] ^ t[14], t[12], t[13]);
+	a[13] = bitselect(t[13] ^ t[10], t[13], t[14]);
+	a[14] = t[14] ^ as_uint2(job->chi[2]);
+	a[15] = bitselect(t[15] ^ t[17], t[15], t[16]);
+	a[16] = t[16] ^ as_uint2(job->chi[3]);
+	a[17] = bitselect(t[17] ^ t[19], t[17], t[18]);
+	a[18] = bitselect(t[18] ^ t[15], t[18], t[19]);
+	a[19] = bitselect(t[19] ^ t[16], t[19], t[15]);
+	a[20] = bitselect(t[20] ^ t[22], t[20], t[21]);
+	a[21] = bitselect(t[21] ^ t[23], t[21], t[22]);
+	a[22] = bitselect(t[22] ^ t[24], t[22], t[23]);
+	a[23] = t[23] ^ as_uint2(job->chi[4]);
+	a[24] = bitselect(t[24] ^ t[21], t[24], t[20]);
+}
+
 typedef union {
 	uint	 words[64 / sizeof(uint)];
 	uint2	 uint2s[64 / sizeof(uint2)];
@@ -284,85 +365,189 @@ typedef union {
 	uint  uints[16];
 } compute_hash_share;
 
-#if PLATFORM != OPENCL_PLATFORM_NVIDIA // use maxrregs on nv
-__attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+#ifndef DAG_SEGMENTS
+#define DAG_SEGMENTS 1
 #endif
-__kernel void ethash_search(
+
+// With DAG_SEGMENTS > 1 the DAG is split over g_dag, g_dag1, g_dag2 and g_dag3,
+// dag_segment 128 byte items each, for devices capping single allocations.
+#if DAG_SEGMENTS > 1
+static __global hash128_t const* dag_item(
+	__global hash128_t const* g_dag0, __global hash128_t const* g_dag1,
+	__global hash128_t const* g_dag2, __global hash128_t const* g_dag3,
+	uint segment, uint i)
+{
+	if (i < segment)
+		return g_dag0 + i;
+	if (i < 2 * segment)
+		return g_dag1 + (i - segment);
+	if (i < 3 * segment)
+		return g_dag2 + (i - 2 * segment);
+	return g_dag3 + (i - 3 * segment);
+}
+
+static __global hash64_t* dag_node(
+	__global hash64_t* g_dag0, __global hash64_t* g_dag1,
+	__global hash64_t* g_dag2, __global hash64_t* g_dag3,
+	uint segment, uint i)
+{
+	if (i < segment)
+		return g_dag0 + i;
+	if (i < 2 * segment)
+		return g_dag1 + (i - segment);
+	if (i < 3 * segment)
+		return g_dag2 + (i - 2 * segment);
+	return g_dag3 + (i - 3 * segment);
+}
+
+#define DAG_ITEM(i) (*dag_item(g_dag, g_dag1, g_dag2, g_dag3, dag_segment, (i)))
+#define DAG_NODE(i) (*dag_node(g_dag, g_dag1, g_dag2, g_dag3, dag_segment * 2, (i)))
+#else
+#define DAG_ITEM(i) g_dag[i]
+#define DAG_NODE(i) g_dag[i]
+#endif
+
+#ifndef PERSISTENT
+#define PERSISTENT 0
+#endif
+
+// Hashes at most PROBE_TARGET are pseudo-shares, see CLMiner::SearchResults::probes.
+#ifndef PROBE_TARGET
+#define PROBE_TARGET 0UL
+#endif
+
+// One nonce, start_nonce + gid. Every work item of a group must take part.
+static void search_nonce(
 	__global volatile uint* restrict g_output,
 	__constant hash32_t const* g_header,
 	__global hash128_t const* g_dag,
 	ulong start_nonce,
 	ulong target,
-	uint isolate
+	uint isolate,
+	uint dag_size,
+	uint dag_segment,
+	__global hash128_t const* g_dag1,
+	__global hash128_t const* g_dag2,
+	__global hash128_t const* g_dag3,
+	__local compute_hash_share* share,
+	uint const gid
 	)
 {
-	__local compute_hash_share share[HASHES_PER_LOOP];
-
-	uint const gid = get_global_id(0);
-
 	// Compute one init hash per work item.
 
 	// sha3_512(header .. nonce)
 	ulong state[25];
-	copy(state, g_header->ulongs, 4);
-	state[4] = start_nonce + gid;
-
-	for (uint i = 6; i != 25; ++i)
-	{
-		state[i] = 0;
-	}
-	state[5] = 0x0000000000000001;
-	state[8] = 0x8000000000000000;
-
-	keccak_f1600_no_absorb((uint2*)state, 8, isolate);
+	keccak_f1600_first_round((uint2*)state, (__constant job_t const*)g_header, as_uint2(start_nonce + gid));
+	keccak_f1600_no_absorb((uint2*)state, 1, 8, isolate);
 	
 	// Threads work together in this phase in groups of 8.
 	uint const thread_id = gid & 7;
 	uint const hash_id = (gid % GROUP_SIZE) >> 3;
 
-	for (int i = 0; i < THREADS_PER_HASH; i++)
+#if SHUFFLE
+	for (uint i = 0; i < THREADS_PER_HASH; i += PARALLEL_HASH)
 	{
-		// share init with other threads
-		if (i == thread_id)
-			copy(share[hash_id].ulongs, state, 8);
+		// The hashes of work items i .. i + PARALLEL_HASH - 1 are mixed
+		// together, so that their DAG loads are in flight at once.
+		uint4 mix[PARALLEL_HASH];
+		uint init0[PARALLEL_HASH];
+		for (uint p = 0; p != PARALLEL_HASH; ++p)
+		{
+			// Work item i + p's init state, of which this one mixes a quarter.
+			uint2 s[8];
+			for (uint j = 0; j != 8; ++j)
+			{
+				uint2 const v = as_uint2(state[j]);
+				s[j] = (uint2)(SHFL8(v.x, i + p), SHFL8(v.y, i + p));
+			}
+			switch (thread_id & 3)
+			{
+			case 0: mix[p] = (uint4)(s[0], s[1]); break;
+			case 1: mix[p] = (uint4)(s[2], s[3]); break;
+			case 2: mix[p] = (uint4)(s[4], s[5]); break;
+			default: mix[p] = (uint4)(s[6], s[7]); break;
+			}
+			init0[p] = s[0].x;
+		}
 
-		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint a = 0; a < ACCESSES; a += 4)
+		{
+			uint const t = (a >> 2) & (THREADS_PER_HASH - 1);
 
-		uint4 mix = share[hash_id].uint4s[thread_id & 3];
-		barrier(CLK_LOCAL_MEM_FENCE);
+			for (uint b = 0; b != 4; ++b)
+			{
+				uint offset[PARALLEL_HASH];
+				for (uint p = 0; p != PARALLEL_HASH; ++p)
+					offset[p] = SHFL8(fnv(init0[p] ^ (a + b), ((uint *)&mix[p])[b]) % dag_size, t);
+				for (uint p = 0; p != PARALLEL_HASH; ++p)
+					mix[p] = fnv4(mix[p], DAG_ITEM(offset[p]).uint4s[thread_id]);
+			}
+		}
 
-		__local uint *share0 = share[hash_id].uints;
+		for (uint p = 0; p != PARALLEL_HASH; ++p)
+		{
+			uint const reduced = fnv_reduce(mix[p]);
+			uint2 r[4];
+			for (uint j = 0; j != 4; ++j)
+				r[j] = (uint2)(SHFL8(reduced, 2 * j), SHFL8(reduced, 2 * j + 1));
+			if (i + p == thread_id)
+			{
+				for (uint j = 0; j != 4; ++j)
+					state[8 + j] = as_ulong(r[j]);
+			}
+		}
+	}
+#else
+	for (uint i = 0; i < THREADS_PER_HASH; i += PARALLEL_HASH)
+	{
+		// As above, PARALLEL_HASH hashes at once: each barrier of the
+		// access loop is shared by all of them.
+		uint4 mix[PARALLEL_HASH];
+		uint init0[PARALLEL_HASH];
+		for (uint p = 0; p != PARALLEL_HASH; ++p)
+		{
+			// share init with other threads
+			if (i + p == thread_id)
+				copy(share[hash_id].ulongs, state, 8);
 
-		// share init0
-		if (thread_id == 0)
-			*share0 = mix.x;
-		barrier(CLK_LOCAL_MEM_FENCE);
-		uint init0 = *share0;
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			mix[p] = share[hash_id].uint4s[thread_id & 3];
+			init0[p] = share[hash_id].uints[0];
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
 
 		for (uint a = 0; a < ACCESSES; a += 4)
 		{
 			bool update_share = thread_id == ((a >> 2) & (THREADS_PER_HASH - 1));
 
-			for (uint i = 0; i != 4; ++i)
+			for (uint b = 0; b != 4; ++b)
 			{
+				// The offsets of the hashes in the first uints of the share.
 				if (update_share)
 				{
-					*share0 = fnv(init0 ^ (a + i), ((uint *)&mix)[i]) % DAG_SIZE;
+					for (uint p = 0; p != PARALLEL_HASH; ++p)
+						share[hash_id].uints[p] = fnv(init0[p] ^ (a + b), ((uint *)&mix[p])[b]) % dag_size;
 				}
 				barrier(CLK_LOCAL_MEM_FENCE);
 
-				mix = fnv4(mix, g_dag[*share0].uint4s[thread_id]);
+				for (uint p = 0; p != PARALLEL_HASH; ++p)
+					mix[p] = fnv4(mix[p], DAG_ITEM(share[hash_id].uints[p]).uint4s[thread_id]);
 			}
 		}
 
-		share[hash_id].uints[thread_id] = fnv_reduce(mix);
-		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint p = 0; p != PARALLEL_HASH; ++p)
+		{
+			share[hash_id].uints[thread_id] = fnv_reduce(mix[p]);
+			barrier(CLK_LOCAL_MEM_FENCE);
 
-		if (i == thread_id)
-			copy(state + 8, share[hash_id].ulongs, 4);
+			if (i + p == thread_id)
+				copy(state + 8, share[hash_id].ulongs, 4);
 
-		barrier(CLK_LOCAL_MEM_FENCE);
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
 	}
+#endif
 
 	for (uint i = 13; i != 25; ++i)
 	{
@@ -371,14 +556,84 @@ __kernel void ethash_search(
 	state[12] = 0x0000000000000001;
 	state[16] = 0x8000000000000000;
 
+	ulong4 const mix_hash = (ulong4)(state[8], state[9], state[10], state[11]);
+
 	// keccak_256(keccak_512(header..nonce) .. mix);
-	keccak_f1600_no_absorb((uint2*)state, 1, isolate);
+	keccak_f1600_no_absorb((uint2*)state, 0, 1, isolate);
 
-	if (as_ulong(as_uchar8(state[0]).s76543210) < target)
+	ulong const hash = as_ulong(as_uchar8(state[0]).s76543210);
+	if (hash < target)
+	{
+		// g_output[0] counts hits; each one is its gid and mix hash, see
+		// CLMiner::SearchResults. The host finishes the boundary check.
+		uint slot = atomic_inc(&g_output[0]);
+		if (slot < MAX_OUTPUTS)
+		{
+			__global volatile uint* out = g_output + 1 + slot * 9;
+			uint8 const m = as_uint8(mix_hash);
+			out[0] = gid;
+			out[1] = m.s0; out[2] = m.s1; out[3] = m.s2; out[4] = m.s3;
+			out[5] = m.s4; out[6] = m.s5; out[7] = m.s6; out[8] = m.s7;
+		}
+	}
+#if PROBE_TARGET
+	else if (hash <= PROBE_TARGET)
 	{
-		uint slot = min(MAX_OUTPUTS, atomic_inc(&g_output[0]) + 1);
-		g_output[slot] = gid;
+		// Counted, the first one's gid kept for the CPU to check.
+		if (atomic_inc(&g_output[2 + MAX_OUTPUTS * 9]) == 0)
+			g_output[3 + MAX_OUTPUTS * 9] = gid;
 	}
+#endif
+}
+
+#if PLATFORM != OPENCL_PLATFORM_NVIDIA // use maxrregs on nv
+__attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+#endif
+__kernel void ethash_search(
+	__global volatile uint* restrict g_output,
+	__constant hash32_t const* g_header,
+	__global hash128_t const* g_dag,
+	ulong start_nonce,
+	ulong target,
+	uint isolate,
+	uint dag_size,
+	uint dag_segment,
+	__global hash128_t const* g_dag1,
+	__global hash128_t const* g_dag2,
+	__global hash128_t const* g_dag3
+#if PERSISTENT
+	, __global volatile uint const* g_control,
+	uint generation,
+	uint rounds
+#endif
+	)
+{
+	__local compute_hash_share share[HASHES_PER_LOOP];
+
+#if PERSISTENT
+	// The work items stride over rounds global sizes of nonces, until the
+	// host moves *g_control on from generation. The check is made once per
+	// group so that all its work items leave at the same round.
+	__local uint leave;
+	uint round = 0;
+	for (; round < rounds; ++round)
+	{
+		if (get_local_id(0) == 0)
+			leave = *g_control != generation;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (leave)
+			break;
+		search_nonce(g_output, g_header, g_dag, start_nonce, target, isolate, dag_size,
+			dag_segment, g_dag1, g_dag2, g_dag3, share, get_global_id(0) + round * get_global_size(0));
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	// See CLMiner::SearchResults::rounds.
+	if (get_global_id(0) == 0)
+		g_output[1 + MAX_OUTPUTS * 9] = round;
+#else
+	search_nonce(g_output, g_header, g_dag, start_nonce, target, isolate, dag_size,
+		dag_segment, g_dag1, g_dag2, g_dag3, share, get_global_id(0));
+#endif
 }
 
 static void SHA3_512(uint2* s, uint isolate)
@@ -389,26 +644,27 @@ static void SHA3_512(uint2* s, uint isolate)
 	}
 	s[8].x = 0x00000001;
 	s[8].y = 0x80000000;
-	keccak_f1600_no_absorb(s, 8, isolate);
+	keccak_f1600_no_absorb(s, 0, 8, isolate);
 }
 
-__kernel void ethash_calculate_dag_item(uint start, __global hash64_t const* g_light, __global hash64_t * g_dag, uint isolate)
+__kernel void ethash_calculate_dag_item(uint start, __global hash64_t const* g_light, __global hash64_t * g_dag, uint isolate, uint dag_size, uint light_size,
+	uint dag_segment, __global hash64_t* g_dag1, __global hash64_t* g_dag2, __global hash64_t* g_dag3)
 {
 	uint const node_index = start + get_global_id(0);
-	if (node_index > DAG_SIZE * 2) return;
+	if (node_index >= dag_size * 2) return;
 
 	hash200_t dag_node;
-	copy(dag_node.uint4s, g_light[node_index % LIGHT_SIZE].uint4s, 4);
+	copy(dag_node.uint4s, g_light[node_index % light_size].uint4s, 4);
 	dag_node.words[0] ^= node_index;
 	SHA3_512(dag_node.uint2s, isolate);
 
 	for (uint i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
-		uint parent_index = fnv(node_index ^ i, dag_node.words[i % NODE_WORDS]) % LIGHT_SIZE;
+		uint parent_index = fnv(node_index ^ i, dag_node.words[i % NODE_WORDS]) % light_size;
 
 		for (uint w = 0; w != 4; ++w) {
 			dag_node.uint4s[w] = fnv4(dag_node.uint4s[w], g_light[parent_index].uint4s[w]);
 		}
 	}
 	SHA3_512(dag_node.uint2s, isolate);
-	copy(g_dag[node_index].uint4s, dag_node.uint4s, 4);
+	copy(DAG_NODE(node_index).uint4s, dag_node.uint4s, 4);
 }
@@ -19,14 +19,6 @@
     #define PLATFORM OPENCL_PLATFORM_AMD
 #endif
 
-#ifndef DAG_SIZE
-    #define DAG_SIZE 8388593
-#endif
-
-#ifndef LIGHT_SIZE
-    #define LIGHT_SIZE 262139
-#endif
-
 #define ETHASH_DATASET_PARENTS 256
 #define NODE_WORDS (64/4)
 
@@ -221,8 +213,11 @@ static void keccak_f1600_round(ulong* a, const uint r, const uint outsz) {
     keccak_f1600(s, 8); \
 }
 
-#define keccak_f1600(a, outsz) { \
-    for (uint r = 0; r < 23;) {\
+#define keccak_f1600(a, outsz) keccak_f1600_from(a, 0, outsz)
+
+// Rounds first to 23.
+#define keccak_f1600_from(a, first, outsz) { \
+    for (uint r = first; r < 23;) {\
         keccak_f1600_round(a, r++, 25); \
     }\
     keccak_f1600_round(a, 23, outsz);\
@@ -233,6 +228,75 @@ typedef struct
 	ulong ulongs[32 / sizeof(ulong)];
 } hash32_t;
 
+// What CLMiner writes to the header buffer: the header, then the job's part
+// of the first Keccak round of sha3_512(header .. nonce), see ethash_keccak_job().
+typedef struct
+{
+    ulong header[4];
+    ulong lanes[25];
+    ulong chi[5];
+} job_t;
+
+// keccak_f1600_round(a, 0, 25) of sha3_512(header .. nonce) from the job's
+// lanes: only the nonce's rotations and the chi of the lanes they reach are left.
+static void keccak_f1600_first_round(ulong* a, __constant job_t const* job, const ulong n) {
+    for (uint i = 0; i != 25; ++i) {
+        a[i] = job->lanes[i];
+    }
+    a[0] ^= n;
+    a[3] ^= ROTL64_1(n, 22);
+    a[5] ^= ROTL64_1(n, 29);
+    a[7] ^= ROTL64_1(n, 3);
+    a[12] ^= ROTL64_1(n, 26);
+    a[14] ^= ROTL64_1(n, 18);
+    a[15] ^= ROTL64_1(n, 27);
+    a[16] ^= ROTL64_2(n, 4);
+    a[19] ^= ROTL64_2(n, 25);
+    a[21] ^= ROTL64_2(n, 24);
+    a[23] ^= ROTL64_2(n, 9);
+
+    // Chi, with the job's terms of the lanes without the nonce
+    ulong m5 = a[0];
+    ulong m6 = a[1];
+    a[0] ^= job->chi[0] ^ Keccak_f1600_RC[0];
+    a[1] = bitselect(a[1]^a[3],a[1],a[2]);
+    a[2] = bitselect(a[2]^a[4],a[2],a[3]);
+    a[3] = bitselect(a[3]^m5,a[3],a[4]);
+    a[4] = bitselect(a[4]^m6,a[4],m5);
+
+    m5 = a[5];
+    m6 = a[6];
+    a[5] = bitselect(a[5]^a[7],a[5],a[6]);
+    a[6] = bitselect(a[6]^a[8],a[6],a[7]);
+    a[7] ^= job->chi[1];
+    a[8] = bitselect(a[8]^m5,a[8],a[9]);
+    a[9] = bitselect(a[9]^m6,a[9],m5);
+
+    m5 = a[10];
+    m6 = a[11];
+    a[10] = bitselect(a[10]^a[12],a[10],a[11]);
+    a[11] = bitselect(a[11]^a[13],a[11],a[12]);
+    a[12] = bitselect(a[12]^a[14],a[12],a[13]);
+    a[13] = bitselect(a[13]^m5,a[13],a[14]);
+    a[14] ^= job->chi[2];
+
+    m5 = a[15];
+    m6 = a[16];
+    a[15] = bitselect(a[15]^a[17],a[15],a[16]);
+    a[16] ^= job->chi[3];
+    a[17] = bitselect(a[17]^a[19],a[17],a[18]);
+    a[18] = bitselect(a[18]^m5,a[18],a[19]);
+    a[19] = bitselect(a[19]^m6,a[19],m5);
+
+    m5 = a[20];
+    m6 = a[21];
+    a[20] = bitselect(a[20]^a[22],a[20],a[21]);
+    a[21] = bitselect(a[21]^a[23],a[21],a[22]);
+    a[22] = bitselect(a[22]^a[24],a[22],a[23]);
+    a[23] ^= job->chi[4];
+    a[24] = bitselect(a[24]^m6,a[24],m5);
+}
+
 typedef union {
     ulong   ulongs[64 / sizeof(ulong)];
     ulong4  ulong4s[64 / sizeof(ulong4)];
@@ -267,40 +331,83 @@ typedef union {
 } hash200_t;
 
 
-#if PLATFORM != OPENCL_PLATFORM_NVIDIA // use maxrregs on nv
-__attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+#ifndef DAG_SEGMENTS
+#define DAG_SEGMENTS 1
 #endif
-__kernel void ethash_search(
+
+// With DAG_SEGMENTS > 1 the DAG is split over g_dag, g_dag1, g_dag2 and g_dag3,
+// dag_segment 128 byte items each, for devices capping single allocations.
+#if DAG_SEGMENTS > 1
+static __global hash128_t const* dag_item(
+    __global hash128_t const* g_dag0, __global hash128_t const* g_dag1,
+    __global hash128_t const* g_dag2, __global hash128_t const* g_dag3,
+    uint segment, uint i)
+{
+    if (i < segment)
+        return g_dag0 + i;
+    if (i < 2 * segment)
+        return g_dag1 + (i - segment);
+    if (i < 3 * segment)
+        return g_dag2 + (i - 2 * segment);
+    return g_dag3 + (i - 3 * segment);
+}
+
+static __global hash64_t* dag_node(
+    __global hash64_t* g_dag0, __global hash64_t* g_dag1,
+    __global hash64_t* g_dag2, __global hash64_t* g_dag3,
+    uint segment, uint i)
+{
+    if (i < segment)
+        return g_dag0 + i;
+    if (i < 2 * segment)
+        return g_dag1 + (i - segment);
+    if (i < 3 * segment)
+        return g_dag2 + (i - 2 * segment);
+    return g_dag3 + (i - 3 * segment);
+}
+
+#define DAG_ITEM(i) (*dag_item(g_dag, g_dag1, g_dag2, g_dag3, dag_segment, (i)))
+#define DAG_NODE(i) (*dag_node(g_dag, g_dag1, g_dag2, g_dag3, dag_segment * 2, (i)))
+#else
+#define DAG_ITEM(i) g_dag[i]
+#define DAG_NODE(i) g_dag[i]
+#endif
+
+#ifndef PERSISTENT
+#define PERSISTENT 0
+#endif
+
+// Hashes at most PROBE_TARGET are pseudo-shares, see CLMiner::SearchResults::probes.
+#ifndef PROBE_TARGET
+#define PROBE_TARGET 0UL
+#endif
+
+// One nonce, start_nonce + gid. Every work item of a group must take part.
+static void search_nonce(
     __global volatile uint* restrict g_output,
     __constant hash32_t const* g_header,
     __global hash128_t const* g_dag,
     ulong start_nonce,
     ulong target,
-    uint isolate
+    uint isolate,
+    uint dag_size,
+    uint dag_segment,
+    __global hash128_t const* g_dag1,
+    __global hash128_t const* g_dag2,
+    __global hash128_t const* g_dag3,
+    __local hash64_t* sharebuf,
+    uint const gid
     )
 {
-
-    uint const gid = get_global_id(0);
     uint const thread_id = gid & (THREADS_PER_HASH - 1);
     uint const hash_id = (gid % GROUP_SIZE) >> LN_THREAD_PER_HASH;
  
-    __local hash64_t sharebuf[HASHES_PER_LOOP];
     __local hash64_t * const share = sharebuf + hash_id;
  
     ulong state[25];
  
-    ((ulong4*)state)[0] = ((__constant ulong4*)g_header)[0];
- 
-    state[4] = start_nonce + gid;
- 
-    for (uint i = 6; i != 25; ++i) {
-        state[i] = 0;
-    }
- 
-    state[5] = 0x0000000000000001UL;
-    state[8] = 0x8000000000000000UL;
- 
-    keccak_f1600(state, 8);
+    keccak_f1600_first_round(state, (__constant job_t const*)g_header, start_nonce + gid);
+    keccak_f1600_from(state, 1, 8);
 
 #if THREADS_PER_HASH == 1
     hash128_t mix;
@@ -316,11 +423,11 @@ __kernel void ethash_search(
 
     #pragma unroll
     for(uint i = 0; i < ACCESSES; i++) {
-        uint p = FNV(i ^ init0, mix.uints[i & 31]) % DAG_SIZE;
+        uint p = FNV(i ^ init0, mix.uints[i & 31]) % dag_size;
   
         #pragma unroll
         for(uint j = 0; j < 8; j++) 
-            mix.uint4s[j] = FNV(mix.uint4s[j], g_dag[p].uint4s[j]);
+            mix.uint4s[j] = FNV(mix.uint4s[j], DAG_ITEM(p).uint4s[j]);
     }
 
     #pragma unroll
@@ -362,18 +469,18 @@ __kernel void ethash_search(
             #pragma unroll
             for (uint i = 0; i != ACCESS_INCREMENT; ++i) {
                 if (update_share) {
-                    share->uints[0] = FNV(init0 ^ (a + i), ((uint *)&mix)[i]) % DAG_SIZE;
+                    share->uints[0] = FNV(init0 ^ (a + i), ((uint *)&mix)[i]) % dag_size;
                 }
                 mem_fence(CLK_LOCAL_MEM_FENCE);
 
 #if THREADS_PER_HASH == 2
                 #pragma unroll
                 for(uint i = 0; i < 16; i++) 
-                	((uint *)&mix)[i] = FNV(((uint *)&mix)[i], g_dag[share->uints[0]].uints[16*thread_id + i]);
+                	((uint *)&mix)[i] = FNV(((uint *)&mix)[i], DAG_ITEM(share->uints[0]).uints[16*thread_id + i]);
 #elif THREADS_PER_HASH == 4
-                mix = FNV(mix, g_dag[share->uints[0]].uint8s[thread_id]);
+                mix = FNV(mix, DAG_ITEM(share->uints[0]).uint8s[thread_id]);
 #elif THREADS_PER_HASH == 8
-                mix = FNV(mix, g_dag[share->uints[0]].uint4s[thread_id]);
+                mix = FNV(mix, DAG_ITEM(share->uints[0]).uint4s[thread_id]);
 #endif
                 mem_fence(CLK_LOCAL_MEM_FENCE);
             }
@@ -407,31 +514,98 @@ __kernel void ethash_search(
     state[12] = 0x0000000000000001UL;
     state[16] = 0x8000000000000000UL;
  
+    ulong4 const mix_hash = (ulong4)(state[8], state[9], state[10], state[11]);
+
     keccak_f1600(state, 1);
 
-    if (as_ulong(as_uchar8(state[0]).s76543210) < target)
+    ulong const hash = as_ulong(as_uchar8(state[0]).s76543210);
+    if (hash < target)
     {
-        uint slot = min(MAX_OUTPUTS, atomic_inc(&g_output[0]) + 1);
-        g_output[slot] = gid;
+        // g_output[0] counts hits; each one is its gid and mix hash, see
+        // CLMiner::SearchResults. The host finishes the boundary check.
+        uint slot = atomic_inc(&g_output[0]);
+        if (slot < MAX_OUTPUTS)
+        {
+            __global volatile uint* out = g_output + 1 + slot * 9;
+            uint8 const m = as_uint8(mix_hash);
+            out[0] = gid;
+            out[1] = m.s0; out[2] = m.s1; out[3] = m.s2; out[4] = m.s3;
+            out[5] = m.s4; out[6] = m.s5; out[7] = m.s6; out[8] = m.s7;
+        }
+    }
+#if PROBE_TARGET
+    else if (hash <= PROBE_TARGET)
+    {
+        // Counted, the first one's gid kept for the CPU to check.
+        if (atomic_inc(&g_output[2 + MAX_OUTPUTS * 9]) == 0)
+            g_output[3 + MAX_OUTPUTS * 9] = gid;
+    }
+#endif
+}
+
+#if PLATFORM != OPENCL_PLATFORM_NVIDIA // use maxrregs on nv
+__attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+#endif
+__kernel void ethash_search(
+    __global volatile uint* restrict g_output,
+    __constant hash32_t const* g_header,
+    __global hash128_t const* g_dag,
+    ulong start_nonce,
+    ulong target,
+    uint isolate,
+    uint dag_size,
+    uint dag_segment,
+    __global hash128_t const* g_dag1,
+    __global hash128_t const* g_dag2,
+    __global hash128_t const* g_dag3
+#if PERSISTENT
+    , __global volatile uint const* g_control,
+    uint generation,
+    uint rounds
+#endif
+    )
+{
+    __local hash64_t sharebuf[HASHES_PER_LOOP];
+
+#if PERSISTENT
+    // See the stable kernel.
+    __local uint leave;
+    uint round = 0;
+    for (; round < rounds; ++round) {
+        if (get_local_id(0) == 0)
+            leave = *g_control != generation;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (leave)
+            break;
+        search_nonce(g_output, g_header, g_dag, start_nonce, target, isolate, dag_size,
+            dag_segment, g_dag1, g_dag2, g_dag3, sharebuf, get_global_id(0) + round * get_global_size(0));
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+    if (get_global_id(0) == 0)
+        g_output[1 + MAX_OUTPUTS * 9] = round;
+#else
+    search_nonce(g_output, g_header, g_dag, start_nonce, target, isolate, dag_size,
+        dag_segment, g_dag1, g_dag2, g_dag3, sharebuf, get_global_id(0));
+#endif
 }
 
-__kernel void ethash_calculate_dag_item(uint start, __global hash64_t const* g_light, __global hash64_t * g_dag, uint isolate)
+__kernel void ethash_calculate_dag_item(uint start, __global hash64_t const* g_light, __global hash64_t * g_dag, uint isolate, uint dag_size, uint light_size,
+    uint dag_segment, __global hash64_t* g_dag1, __global hash64_t* g_dag2, __global hash64_t* g_dag3)
 {
     uint const node_index = start + get_global_id(0);
-    if (node_index > DAG_SIZE * 2) return;
+    if (node_index >= dag_size * 2) return;
 
     hash200_t dag_node;
-    dag_node.uint16s[0] = g_light[node_index % LIGHT_SIZE].uint16s[0];
+    dag_node.uint16s[0] = g_light[node_index % light_size].uint16s[0];
     dag_node.uints[0] ^= node_index;
     SHA3_512(dag_node.ulongs);
 
 
     for (uint i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
-        uint parent_index = FNV(node_index ^ i, dag_node.uints[i % NODE_WORDS]) % LIGHT_SIZE;
+        uint parent_index = FNV(node_index ^ i, dag_node.uints[i % NODE_WORDS]) % light_size;
         dag_node.uint16s[0] = FNV(dag_node.uint16s[0], g_light[parent_index].uint16s[0]);
     }
 
     SHA3_512(dag_node.ulongs);
-    g_dag[node_index].uint16s[0] = dag_node.uint16s[0];
+    DAG_NODE(node_index).uint16s[0] = dag_node.uint16s[0];
 }
@@ -0,0 +1,152 @@
+/// CPU miner implementation.
+///
+/// @file
+/// @copyright GNU General Public License
+
+#include "CPUMiner.h"
+#include <libethash/simd.h>
+
+#include <thread>
+
+using namespace dev;
+using namespace eth;
+
+namespace dev
+{
+namespace eth
+{
+
+unsigned CPUMiner::s_numInstances = 0;
+
+struct CPUChannel: public LogChannel
+{
+	static const char* name() { return EthOrange " cpu"; }
+	static const int verbosity = 2;
+	static const bool debug = false;
+};
+#define cpulog clog(CPUChannel)
+
+CPUMiner::CPUMiner(FarmFace& _farm, unsigned _index):
+	Miner("cpu-", _farm, _index)
+{}
+
+CPUMiner::~CPUMiner()
+{
+	stopWorking();
+}
+
+void CPUMiner::workLoop()
+{
+	// The work package currently being hashed.
+	WorkPackage current;
+	current.header = h256{1u};
+	current.seed = h256{1u};
+	EthashAux::FullType dag;
+
+	try {
+		while (true)
+		{
+			WorkPackage const& w = work();
+
+			if (current.header != w.header || current.seed != w.seed)
+			{
+				auto localSwitchStart = std::chrono::high_resolution_clock::now();
+
+				// A package with a seed but no header only asks for the DAG.
+				if (!w && (!w.seed || current.seed == w.seed))
+				{
+					cpulog << "No work. Pause for 3 s.";
+					waitForWake(std::chrono::seconds(3));
+					if (shouldStop())
+						break;
+					continue;
+				}
+
+				if (w)
+				{
+					cpulog << "New work: header" << w.header << "target" << w.boundary.hex();
+				}
+
+				if (current.seed != w.seed)
+				{
+					cpulog << "New seed" << w.seed;
+					dag.reset();
+					auto const dagStart = std::chrono::steady_clock::now();
+					dag = EthashAux::full(w.seed);
+					// Shared by the instances: the later ones only wait for it.
+					dagStaged(dag->epoch, dag->mapped() ? "file" : "host", dag->size,
+						std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - dagStart).count());
+				}
+				if (!w)
+				{
+					current.seed = w.seed;
+					continue;
+				}
+
+				current = w;
+
+				auto switchEnd = std::chrono::high_resolution_clock::now();
+				auto globalSwitchTime = std::chrono::duration_cast<std::chrono::milliseconds>(switchEnd - workSwitchStart).count();
+				auto localSwitchTime = std::chrono::duration_cast<std::chrono::microseconds>(switchEnd - localSwitchStart).count();
+				cpulog << "Switch time" << globalSwitchTime << "ms /" << localSwitchTime << "us";
+			}
+
+			uint64_t nonce;
+			if (!nextNonces(c_batchSize, nonce))
+			{
+				if (shouldStop())
+					break;
+				waitForWake(std::chrono::milliseconds(100));
+				continue;
+			}
+
+			// The nonces belong to w, which can differ from current in more than the header.
+			for (unsigned i = 0; i != c_batchSize; ++i, ++nonce)
+			{
+				Result r = dag->compute(w.header, nonce);
+				if (r.value < w.boundary)
+					submitProof(Solution{nonce, r.mixHash, w, false, (unsigned)index}, WorkSlot::Clock::now());
+			}
+
+			// Report hash count
+			addHashCount(c_batchSize);
+
+			// Check if we should stop.
+			if (shouldStop())
+				break;
+		}
+	}
+	catch (std::exception const& _e)
+	{
+		cwarn << "CPU miner error:" << _e.what();
+	}
+}
+
+void CPUMiner::kick_miner() {}
+
+unsigned CPUMiner::getNumDevices()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void CPUMiner::listDevices()
+{
+	cout << "\nListing CPU devices.\nFORMAT: [deviceID] deviceName\n";
+	cout << "[0] " << getNumDevices() << " hardware threads, " << ethash_simd_level_name() << " hashing\n";
+}
+
+HwMonitor CPUMiner::hwmon()
+{
+	HwMonitor hw;
+	hw.tempC = 0;
+	hw.fanP = 0;
+	return hw;
+}
+
+string CPUMiner::Name()
+{
+	return "cpu" + to_string(index);
+}
+
+}
+}
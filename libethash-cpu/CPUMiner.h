@@ -0,0 +1,44 @@
+/// CPU miner implementation.
+///
+/// @file
+/// @copyright GNU General Public License
+
+#pragma once
+
+#include <libdevcore/Worker.h>
+#include <libethcore/EthashAux.h>
+#include <libethcore/Miner.h>
+
+namespace dev
+{
+namespace eth
+{
+
+/// Hashes against the full host DAG (EthashAux::full()). Every instance is a
+/// separate worker thread, so by default there is one miner per hardware thread.
+class CPUMiner: public Miner
+{
+public:
+	/// Nonces hashed between checks for new work.
+	static const unsigned c_batchSize = 256;
+
+	CPUMiner(FarmFace& _farm, unsigned _index);
+	~CPUMiner();
+
+	static unsigned instances() { return s_numInstances > 0 ? s_numInstances : 1; }
+	static unsigned getNumDevices();
+	static void listDevices();
+	static void setNumInstances(unsigned _instances) { s_numInstances = std::min<unsigned>(_instances, getNumDevices()); }
+	HwMonitor hwmon() override;
+	string Name() override;
+protected:
+	void kick_miner() override;
+
+private:
+	void workLoop() override;
+
+	static unsigned s_numInstances;
+};
+
+}
+}
@@ -19,6 +19,26 @@ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
 #undef max
 
 #include "CUDAMiner.h"
+#include <libethash/hugepages.h>
+#include <libethash/sha3.h>
+#include <libdevcore/CommonIO.h>
+#include <libdevcore/SHA3.h>
+#include <libdevcore/Trace.h>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <set>
+#if ETH_NVRTC
+#include <nvrtc.h>
+#include "rtc_ethash_search_rtc_cuh.h"
+#include "rtc_ethash_search_cuh.h"
+#include "rtc_dagger_shuffled_cuh.h"
+#include "rtc_keccak_cuh.h"
+#include "rtc_fnv_cuh.h"
+#include "rtc_cuda_helper_h.h"
+#include "rtc_ethash_cuda_miner_kernel_h.h"
+#include "rtc_ethash_cuda_miner_kernel_globals_h.h"
+#endif
 
 using namespace std;
 using namespace dev;
@@ -40,14 +60,170 @@ struct CUDAChannel: public LogChannel
 #define cudalog clog(CUDAChannel)
 #define ETHCUDA_LOG(_contents) cudalog << _contents
 
+namespace
+{
+
+/// The job's part of every hash's first Keccak round, see keccak_f1600_init().
+keccak_job_t keccakJob(hash32_t const& _header)
+{
+	keccak_job_t job;
+	ethash_keccak_job(reinterpret_cast<uint8_t const*>(&_header), job.lane, job.chi);
+	return job;
+}
+
+void checkCU(CUresult _result, char const* _what)
+{
+	if (_result == CUDA_SUCCESS)
+		return;
+	char const* error = nullptr;
+	cuGetErrorString(_result, &error);
+	throw std::runtime_error(string(_what) + ": " + (error ? error : "unknown error"));
+}
+
+#if ETH_NVRTC
+/// The files of the run time compiled kernel, the first being the program.
+struct RtcSource
+{
+	char const* name;
+	string code;
+};
+
+#define RTC_SOURCE(_name, _array) RtcSource{_name, string(_array, _array + sizeof(_array))}
+#endif
+
+/**
+ * Waits for the searches of all devices on one thread, for
+ * CUDAMiner::setEventCollection(). Polling the events of a dozen devices
+ * costs that thread next to nothing, where a thread per device either spins
+ * or sleeps on its own synchronization.
+ */
+class Completions
+{
+public:
+	static Completions& get()
+	{
+		static Completions s_completions;
+		return s_completions;
+	}
+
+	/// _done is called on the collector thread, with its lock held, once
+	/// _event completed.
+	void add(void const* _owner, int _device, cudaEvent_t _event, function<void()> _done)
+	{
+		{
+			Guard l(x_pending);
+			m_pending.push_back(Pending{_owner, _device, _event, move(_done)});
+		}
+		m_added.notify_one();
+	}
+
+	/// Drops what _owner added; its callbacks are not called after this.
+	void forget(void const* _owner)
+	{
+		Guard l(x_pending);
+		m_pending.remove_if([&](Pending const& _p) { return _p.owner == _owner; });
+	}
+
+private:
+	struct Pending
+	{
+		void const* owner;
+		int device;
+		cudaEvent_t event;
+		function<void()> done;
+	};
+
+	Completions(): m_thread([this]() { run(); }) {}
+
+	~Completions()
+	{
+		{
+			Guard l(x_pending);
+			m_stop = true;
+		}
+		m_added.notify_one();
+		m_thread.join();
+	}
+
+	void run()
+	{
+		UniqueGuard l(x_pending);
+		while (!m_stop)
+		{
+			bool any = false;
+			for (auto it = m_pending.begin(); it != m_pending.end();)
+			{
+				// Querying needs the event's device current, for old drivers.
+				cudaSetDevice(it->device);
+				cudaError_t const status = cudaEventQuery(it->event);
+				if (status == cudaErrorNotReady)
+				{
+					++it;
+					continue;
+				}
+				if (status != cudaSuccess)
+					cudaGetLastError();	// the miner sees it when collecting
+				it->done();
+				it = m_pending.erase(it);
+				any = true;
+			}
+			if (!any)
+				m_added.wait_for(l, c_poll, [this]() { return m_stop; });
+		}
+	}
+
+	static constexpr chrono::microseconds c_poll{500};
+
+	Mutex x_pending;
+	condition_variable m_added;
+	list<Pending> m_pending;
+	bool m_stop = false;
+	thread m_thread;
+};
+
+constexpr chrono::microseconds Completions::c_poll;
+
+#if ETH_NVRTC
+vector<RtcSource> const& rtcSources()
+{
+	static vector<RtcSource> const sources{
+		RTC_SOURCE("ethash_search_rtc.cuh", rtc_ethash_search_rtc_cuh),
+		RTC_SOURCE("ethash_search.cuh", rtc_ethash_search_cuh),
+		RTC_SOURCE("dagger_shuffled.cuh", rtc_dagger_shuffled_cuh),
+		RTC_SOURCE("keccak.cuh", rtc_keccak_cuh),
+		RTC_SOURCE("fnv.cuh", rtc_fnv_cuh),
+		RTC_SOURCE("cuda_helper.h", rtc_cuda_helper_h),
+		RTC_SOURCE("ethash_cuda_miner_kernel.h", rtc_ethash_cuda_miner_kernel_h),
+		RTC_SOURCE("ethash_cuda_miner_kernel_globals.h", rtc_ethash_cuda_miner_kernel_globals_h),
+	};
+	return sources;
+}
+#endif
+
+}
+
 CUDAMiner::CUDAMiner(FarmFace& _farm, unsigned _index) :
 	Miner("cuda-", _farm, _index),
-	m_light(getNumDevices()) {}
+	m_light(getNumDevices())
+{
+	m_current.header = h256{1u};
+	m_current.seed = h256{1u};
+}
 
 CUDAMiner::~CUDAMiner()
 {
 	stopWorking();
 	kick_miner();
+	HwMonSampler::get().remove(m_hwSlot);
+	Completions::get().forget(this);
+	if (m_dagUser)
+	{
+		{
+			Guard l(x_deviceDags);
+			s_deviceDags[m_device_num].users--;
+		}
+		s_deviceDagChanged.notify_all();
+	}
 }
 
 bool CUDAMiner::init(const h256& seed)
@@ -56,28 +232,21 @@ bool CUDAMiner::init(const h256& seed)
 		if (s_dagLoadMode == DAG_LOAD_MODE_SEQUENTIAL)
 			while (s_dagLoadIndex < index)
 				this_thread::sleep_for(chrono::milliseconds(100));
-		unsigned device = s_devices[index] > -1 ? s_devices[index] : index;
+		unsigned const slot = index / s_instancesPerDevice;
+		unsigned device = s_devices[slot] > -1 ? s_devices[slot] : slot;
+		m_instance = index % s_instancesPerDevice;
 
 		cnote << "Initialising miner " << index;
 
+		auto const lightStart = chrono::steady_clock::now();
 		EthashAux::LightType light;
 		light = EthashAux::light(seed);
 		bytesConstRef lightData = light->data();
+		dagStaged(light->epoch(), "light", lightData.size(), chrono::duration<double, milli>(chrono::steady_clock::now() - lightStart).count());
 
 		cuda_init(getNumDevices(), light->light, lightData.data(), lightData.size(), 
-			device, (s_dagLoadMode == DAG_LOAD_MODE_SINGLE), s_dagInHostMemory, s_dagCreateDevice);
+			device, (s_dagLoadMode == DAG_LOAD_MODE_SINGLE), s_dagCreateDevice);
 		s_dagLoadIndex++;
-    
-		if (s_dagLoadMode == DAG_LOAD_MODE_SINGLE)
-		{
-			if (s_dagLoadIndex >= s_numInstances && s_dagInHostMemory)
-			{
-				// all devices have loaded DAG, we can free now
-				delete[] s_dagInHostMemory;
-				s_dagInHostMemory = NULL;
-				cnote << "Freeing DAG from host";
-			}
-		}
 		return true;
 	}
 	catch (std::runtime_error const& _e)
@@ -89,53 +258,71 @@ bool CUDAMiner::init(const h256& seed)
 
 void CUDAMiner::workLoop()
 {
-	WorkPackage current;
-	current.header = h256{1u};
-	current.seed = h256{1u};
+	stepLoop();
+}
+
+bool CUDAMiner::workStep(chrono::milliseconds& _wait)
+{
+	auto const start = WorkSlot::Clock::now();
 	try
 	{
-		while(true)
-		{
-	                // take local copy of work since it may end up being overwritten.
-			const WorkPackage w = work();
-			
-			if (current.header != w.header || current.seed != w.seed)
-			{
-				if(!w || w.header == h256())
-				{
-					cnote << "No work. Pause for 3 s.";
-					std::this_thread::sleep_for(std::chrono::seconds(3));
-					continue;
-				}
-				if (current.seed != w.seed)
-				{
-					if(!init(w.seed))
-						break;
-				}
-				current = w;
-			}
-			uint64_t upper64OfBoundary = (uint64_t)(u64)((u256)current.boundary >> 192);
-			uint64_t startN = current.startNonce;
-			if (current.exSizeBits >= 0) 
-				startN = current.startNonce | ((uint64_t)index << (64 - 4 - current.exSizeBits)); // this can support up to 16 devices
-			search(current.header.data(), upper64OfBoundary, (current.exSizeBits >= 0), startN, w);
-
-			// Check if we should stop.
-			if (shouldStop())
-			{
-				break;
-			}
-		}
+		bool const running = stepSearch(_wait);
+		hostStepped(WorkSlot::Clock::now() - start);
+		if (running)
+			return true;
 	}
 	catch (std::runtime_error const& _e)
 	{
 		cwarn << "Error CUDA mining: " << _e.what();
 	}
+	// Started again, it takes up the work afresh.
+	m_current.header = h256{1u};
+	m_current.seed = h256{1u};
+	return false;
+}
+
+bool CUDAMiner::stepSearch(chrono::milliseconds& _wait)
+{
+	// The device is current per thread, and the pool's are all the devices'.
+	if (pooled() && m_configured)
+		CUDA_SAFE_CALL(cudaSetDevice(m_device_num));
+
+	if (tuningPending() && m_configured)
+		applyTuning();
+
+	// work() only copies when a new package was published; the
+	// reference stays valid until the next call.
+	WorkPackage const& w = work();
+
+	if (m_current.header != w.header || m_current.seed != w.seed)
+	{
+		// A package with a seed but no header only asks for the DAG.
+		if (!w && (!w.seed || m_current.seed == w.seed))
+		{
+			if (shouldStop())
+				return false;
+			cnote << "No work. Pause for 3 s.";
+			_wait = std::chrono::seconds(3);
+			return true;
+		}
+		if (m_current.seed != w.seed && !init(w.seed))
+			return false;
+		if (!w)
+		{
+			m_current.seed = w.seed;
+			return true;
+		}
+		m_current = w;
+	}
+	uint64_t upper64OfBoundary = (uint64_t)(u64)((u256)m_current.boundary >> 192);
+	search(m_current.header.data(), upper64OfBoundary, w, _wait);
+
+	// Check if we should stop.
+	return !shouldStop();
 }
 
 void CUDAMiner::kick_miner()
 {
-	m_abort.store(true, std::memory_order_relaxed);
 }
 
 void CUDAMiner::setNumInstances(unsigned _instances)
@@ -192,15 +379,42 @@ void CUDAMiner::listDevices()
 	}
 }
 
+string CUDAMiner::Name()
+{
+	Guard l(x_deviceName);
+	return m_deviceName.empty() ? "cuda-" + to_string(index) : m_deviceName;
+}
+
 HwMonitor CUDAMiner::hwmon()
 {
+	HwReading r = HwMonSampler::get().reading(m_hwSlot);
 	dev::eth::HwMonitor hw;
+	hw.tempC = r.tempC;
+	hw.fanP = r.fanP;
+	hw.powerW = r.powerW;
+	hw.coreMHz = r.coreMHz;
+	hw.memMHz = r.memMHz;
+	hw.memUtilP = r.memUtilP;
+	return hw;
+}
+
+HwReading CUDAMiner::readHw()
+{
+	HwReading hw;
 	if (nvmlh) {
-		unsigned int tempC = 0, fanpcnt = 0;
-		wrap_nvml_get_tempC(nvmlh, nvmlh->cuda_nvml_device_id[m_device_num], &tempC);
-		wrap_nvml_get_fanpcnt(nvmlh, nvmlh->cuda_nvml_device_id[m_device_num], &fanpcnt);
+		int const id = nvmlh->cuda_nvml_device_id[m_device_num];
+		unsigned int tempC = 0, fanpcnt = 0, powerMw = 0, coreMHz = 0, memMHz = 0, memUtil = 0;
+		wrap_nvml_get_tempC(nvmlh, id, &tempC);
+		wrap_nvml_get_fanpcnt(nvmlh, id, &fanpcnt);
+		wrap_nvml_get_power_usage(nvmlh, id, &powerMw);
+		wrap_nvml_get_clocks(nvmlh, id, &coreMHz, &memMHz);
+		wrap_nvml_get_mem_utilization(nvmlh, id, &memUtil);
 		hw.tempC = tempC;
 		hw.fanP = fanpcnt;
+		hw.powerW = powerMw / 1000;
+		hw.coreMHz = coreMHz;
+		hw.memMHz = memMHz;
+		hw.memUtilP = memUtil;
 	}
 	return hw;
 }
@@ -276,6 +490,11 @@ bool CUDAMiner::cuda_configureGPU(
 				{
 					cudalog <<  "Found suitable CUDA device [" << string(props.name) << "] with " << props.totalGlobalMem << " bytes of GPU memory";
 				}
+				else if (s_hostDag && props.canMapHostMemory)
+				{
+					cudalog << "CUDA device " << string(props.name) << " has " << props.totalGlobalMem << " bytes of GPU memory, "
+							<< "the rest of the " << dagSize << " bytes of the DAG will be read from host memory";
+				}
 				else
 				{
 					cudalog <<  "CUDA device " << string(props.name) << " has insufficient GPU memory." << props.totalGlobalMem << " bytes of memory found < " << dagSize << " bytes of memory required";
@@ -296,6 +515,28 @@ unsigned CUDAMiner::s_blockSize = CUDAMiner::c_defaultBlockSize;
 unsigned CUDAMiner::s_gridSize = CUDAMiner::c_defaultGridSize;
 unsigned CUDAMiner::s_numStreams = CUDAMiner::c_defaultNumStreams;
 unsigned CUDAMiner::s_scheduleFlag = 0;
+unsigned CUDAMiner::s_graphSearches = 0;
+unsigned CUDAMiner::s_dagHeadroom = 4;
+unsigned CUDAMiner::s_streamCapacity = 0;
+bool CUDAMiner::s_rtc = false;
+bool CUDAMiner::s_eventCollect = false;
+bool CUDAMiner::s_autoTune = false;
+bool CUDAMiner::s_hostDag = false;
+bool CUDAMiner::s_dualDag = false;
+bool CUDAMiner::s_l2Persist = false;
+uint64_t const CUDAMiner::c_vramReserve = 64 * 1024 * 1024;
+unsigned const CUDAMiner::c_tuneMaxStreams = 4;
+unsigned const CUDAMiner::c_tuneTrialMs = 250;
+Mutex CUDAMiner::x_deviceDags;
+std::condition_variable CUDAMiner::s_deviceDagChanged;
+std::map<unsigned, CUDAMiner::DeviceDag> CUDAMiner::s_deviceDags;
+unsigned CUDAMiner::s_instancesPerDevice = 1;
+Mutex CUDAMiner::x_dagShare;
+std::condition_variable CUDAMiner::s_dagShareChanged;
+CUDAMiner::DagShare CUDAMiner::s_dagShare;
+HostMemory::Reservation CUDAMiner::s_dagShareMemory;
+uint64_t const CUDAMiner::c_dagChunk = 64 * 1024 * 1024;
+unsigned const CUDAMiner::c_dagChunksPerStream = 2;
 
 bool CUDAMiner::cuda_init(
 	size_t numDevices,
@@ -304,7 +545,6 @@ bool CUDAMiner::cuda_init(
 	uint64_t _lightSize,
 	unsigned _deviceId,
 	bool _cpyToHost,
-	uint8_t* &hostDAG,
 	unsigned dagCreateDevice)
 {
 	try
@@ -314,106 +554,291 @@ bool CUDAMiner::cuda_init(
 
 		// use selected device
 		m_device_num = _deviceId < numDevices -1 ? _deviceId : numDevices - 1;
-		nvmlh = wrap_nvml_create();
+		if (_cpyToHost && m_device_num == dagCreateDevice && m_instance == 0)
+		{
+			// The other devices may still be copying the previous DAG off this one.
+			UniqueGuard l(x_dagShare);
+			s_dagShareChanged.wait(l, []() { return s_dagShare.pending == 0; });
+		}
+		if (!nvmlh)
+			nvmlh = wrap_nvml_create();
+		if (m_hwSlot == HwMonSampler::c_slots)
+			m_hwSlot = HwMonSampler::get().add([this]() { return readHw(); });
 
 		cudaDeviceProp device_props;
 		CUDA_SAFE_CALL(cudaGetDeviceProperties(&device_props, m_device_num));
 
 		cudalog << "Using device: " << device_props.name << " (Compute " + to_string(device_props.major) + "." + to_string(device_props.minor) + ")";
 
-		m_search_buf = new volatile search_results *[s_numStreams];
-		m_streams = new cudaStream_t[s_numStreams];
-
 		uint64_t dagSize = ethash_get_datasize(_light->block_number);
 		uint32_t dagSize128   = (unsigned)(dagSize / ETHASH_MIX_BYTES);
 		uint32_t lightSize64 = (unsigned)(_lightSize / sizeof(node));
 
-		
-		
+		//Check whether the current device has sufficient memory everytime we recreate the dag
+		if (device_props.totalGlobalMem < dagSize && !(s_hostDag && device_props.canMapHostMemory))
+		{
+			cudalog <<  "CUDA device " << string(device_props.name) << " has insufficient GPU memory." << device_props.totalGlobalMem << " bytes of memory found < " << dagSize << " bytes of memory required";
+			return false;
+		}
+
 		CUDA_SAFE_CALL(cudaSetDevice(m_device_num));
 		cudalog << "Set Device to current";
-		if(dagSize128 != m_dag_size || !m_dag)
+		hash128_t* dag = nullptr;
+		if (m_instance > 0)
 		{
-			//Check whether the current device has sufficient memory everytime we recreate the dag
-			if (device_props.totalGlobalMem < dagSize)
+			// Once the first instance set the device up, and with this one's
+			// searches no longer reading the DAG it replaces.
+			for (unsigned i = 0; m_streams && i != m_streamCount; ++i)
+				if (m_stream_busy[i])
+					collectResults(i);
+			dag = useDeviceDag(dagSize);
+		}
+		if (!m_streams)
+		{
+			// Only once: the context, its streams and buffers are kept for
+			// the following epochs. The reset is so the flags still apply.
+			if (m_instance == 0)
 			{
-				cudalog <<  "CUDA device " << string(device_props.name) << " has insufficient GPU memory." << device_props.totalGlobalMem << " bytes of memory found < " << dagSize << " bytes of memory required";
-				return false;
+				CUDA_SAFE_CALL(cudaDeviceReset());
+				CUDA_SAFE_CALL(cudaSetDeviceFlags(s_scheduleFlag | cudaDeviceMapHost));
+				CUDA_SAFE_CALL(cudaDeviceSetCacheConfig(cudaFuncCachePreferL1));
 			}
-			//We need to reset the device and recreate the dag  
-			cudalog << "Resetting device";
-			CUDA_SAFE_CALL(cudaDeviceReset());
-			CUDA_SAFE_CALL(cudaSetDeviceFlags(s_scheduleFlag));
-			CUDA_SAFE_CALL(cudaDeviceSetCacheConfig(cudaFuncCachePreferL1));
-			//We need to reset the light and the Dag for the following code to reallocate
-			//since cudaDeviceReset() free's all previous allocated memory
-			m_light[m_device_num] = nullptr;
-			m_dag = nullptr; 
-		}
-		// create buffer for cache
-		hash128_t * dag = m_dag;
-		hash64_t * light = m_light[m_device_num];
-
-		if(!light){ 
-			cudalog << "Allocating light with size: " << _lightSize;
-			CUDA_SAFE_CALL(cudaMalloc(reinterpret_cast<void**>(&light), _lightSize));
-		}
-		// copy lightData to device
-		CUDA_SAFE_CALL(cudaMemcpy(reinterpret_cast<void*>(light), _lightData, _lightSize, cudaMemcpyHostToDevice));
-		m_light[m_device_num] = light;
-		
-		if(dagSize128 != m_dag_size || !dag) // create buffer for dag
-			CUDA_SAFE_CALL(cudaMalloc(reinterpret_cast<void**>(&dag), dagSize));
-			
-		set_constants(dag, dagSize128, light, lightSize64); //in ethash_cuda_miner_kernel.cu
-		
-		if(dagSize128 != m_dag_size || !dag)
-		{
+
+			// Before the host buffers, so they are on the device's node.
+			if (!pooled())
+				m_cpu.pinNear(pciBusId(device_props.pciDomainID, device_props.pciBusID, device_props.pciDeviceID, 0));
+
+			m_gridSize = s_gridSize;
+			m_blockSize = s_blockSize;
+			m_numStreams = s_numStreams;
+			m_threadHashes = m_parallelHash;
+			m_tune = s_autoTune && !loadProfile(device_props);
+			m_streamCount = max(m_tune ? max(m_numStreams, c_tuneMaxStreams) : m_numStreams, s_streamCapacity);
+
 			// create mining buffers
-			cudalog << "Generating mining buffers"; //TODO whats up with this?
-			for (unsigned i = 0; i != s_numStreams; ++i)
+			cudalog << "Generating mining buffers";
+			m_search_buf = new volatile search_results *[m_streamCount];
+			m_search_dev.assign(m_streamCount, nullptr);
+			m_streams = new cudaStream_t[m_streamCount];
+			m_stream_nonce.assign(m_streamCount, 0);
+			m_stream_job.assign(m_streamCount, 0);
+			m_stream_busy.assign(m_streamCount, false);
+			for (unsigned i = 0; i != m_streamCount; ++i)
 			{
-				CUDA_SAFE_CALL(cudaMallocHost(&m_search_buf[i], sizeof(search_results)));
+				// Mapped, so the kernels write their results straight to the host.
+				void* buffer;
+				CUDA_SAFE_CALL(cudaHostAlloc(&buffer, sizeof(search_results), cudaHostAllocMapped));
+				m_search_buf[i] = static_cast<search_results*>(buffer);
+				m_search_buf[i]->count = 0;
+				m_search_buf[i]->probes = 0;
+				CUDA_SAFE_CALL(cudaHostGetDevicePointer(&buffer, buffer, 0));
+				m_search_dev[i] = static_cast<search_results*>(buffer);
 				CUDA_SAFE_CALL(cudaStreamCreate(&m_streams[i]));
 			}
-			
-			memset(&m_current_header, 0, sizeof(hash32_t));
-			m_current_target = 0;
-			m_current_nonce = 0;
-			m_current_index = 0;
+			if (s_eventCollect)
+			{
+				m_stream_event.resize(m_streamCount);
+				for (cudaEvent_t& e: m_stream_event)
+					CUDA_SAFE_CALL(cudaEventCreateWithFlags(&e, cudaEventBlockingSync | cudaEventDisableTiming));
+				m_stream_done.reset(new atomic<bool>[m_streamCount]());
+			}
+			// Job updates go on their own stream, so they never wait for searches.
+			CUDA_SAFE_CALL(cudaStreamCreateWithFlags(&m_jobStream, cudaStreamNonBlocking));
+			CUDA_SAFE_CALL(cudaEventCreateWithFlags(&m_jobWritten, cudaEventDisableTiming));
+			m_dagChunks.resize(m_streamCount * c_dagChunksPerStream);
+			for (cudaEvent_t& e: m_dagChunks)
+				CUDA_SAFE_CALL(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+			void* readBack;
+			CUDA_SAFE_CALL(cudaHostAlloc(&readBack, DagVerifier::c_items * sizeof(hash128_t), cudaHostAllocDefault));
+			m_dagReadBack.host = static_cast<uint8_t*>(readBack);
+			CUDA_SAFE_CALL(cudaEventCreateWithFlags(&m_dagReadBack.read, cudaEventDisableTiming));
+		}
+		else
+		{
+			// Not ordered with the generation of the DAG that replaces it.
+			if (m_dagReadBack.pending)
+				CUDA_SAFE_CALL(cudaEventSynchronize(m_dagReadBack.read));
+			m_dagReadBack.pending = false;
+			// The previous epoch's searches read the DAG about to be replaced.
+			for (unsigned i = 0; i != m_streamCount; ++i)
+				if (m_stream_busy[i])
+					collectResults(i);
+		}
+		if (m_instance == 0 && s_instancesPerDevice > 1)
+		{
+			// Nor may the other instances' searches.
+			UniqueGuard l(x_deviceDags);
+			DeviceDag& d = s_deviceDags[m_device_num];
+			d.size = 0;
+			while (!s_deviceDagChanged.wait_for(l, chrono::seconds(1), [&]() { return d.users == 0; }))
+				if (shouldStop())
+					throw std::runtime_error("Stopped while replacing the DAG");
+		}
 
-			if (!hostDAG)
+		if (m_instance > 0)
+		{
+			if (dagSize128 != m_dag_size || dag != m_dag)
+			{
+				if (s_rtc)
+					compileSearch(dag, dagSize128);
+				memset(&m_current_header, 0, sizeof(hash32_t));
+				m_current_target = 0;
+				m_current_index = 0;
+			}
+			m_dag = dag;
+			m_dag_size = dagSize128;
+		}
+		else
+		{
+			// Sized for s_dagHeadroom more epochs, so that the following ones
+			// reuse the allocations.
+			uint64_t const headroomBlock = _light->block_number + uint64_t(s_dagHeadroom) * ETHASH_EPOCH_LENGTH;
+			unsigned const epoch = unsigned(_light->block_number / ETHASH_EPOCH_LENGTH);
+			bool const resident = s_dualDag && !_cpyToHost && !m_dagTail && m_dag && m_dagEpoch != ~0u && m_dagEpoch != epoch &&
+				swapResidentDag(epoch, dagSize, _lightSize);
+			m_dagEpoch = ~0u;
+			hash64_t * light = m_light[m_device_num];
+			if (!resident)
 			{
-				if((m_device_num == dagCreateDevice) || !_cpyToHost){ //if !cpyToHost -> All devices shall generate their DAG
-					cudalog << "Generating DAG for GPU #" << m_device_num << " with dagSize: " 
-							<< dagSize <<" gridSize: " << s_gridSize << " &m_streams[0]: " << &m_streams[0];
-					ethash_generate_dag(dagSize, s_gridSize, s_blockSize, m_streams[0], m_device_num);
+				if (!light || _lightSize > m_lightCapacity)
+				{
+					if (light)
+						CUDA_SAFE_CALL(cudaFree(light));
+					m_lightCapacity = max<uint64_t>(_lightSize, ethash_get_cachesize(headroomBlock));
+					cudalog << "Allocating light with size: " << m_lightCapacity;
+					CUDA_SAFE_CALL(cudaMalloc(reinterpret_cast<void**>(&light), m_lightCapacity));
+				}
+				// copy lightData to device
+				CUDA_SAFE_CALL(cudaMemcpy(reinterpret_cast<void*>(light), _lightData, _lightSize, cudaMemcpyHostToDevice));
+			}
+			m_light[m_device_num] = light;
+			m_lightSize = _lightSize;
 
-					if (_cpyToHost)
-					{
-						uint8_t* memoryDAG = new uint8_t[dagSize];
-						cudalog << "Copying DAG from GPU #" << m_device_num << " to host";
-						CUDA_SAFE_CALL(cudaMemcpy(reinterpret_cast<void*>(memoryDAG), dag, dagSize, cudaMemcpyDeviceToHost));
+			dag = m_dag;
+			if (!dag || dagSize > m_dagCapacity + m_dagTailCapacity)
+			{
+				if (dag)
+					CUDA_SAFE_CALL(cudaFree(dag));
+				if (m_dagTail)
+				{
+					CUDA_SAFE_CALL(cudaFreeHost(m_dagTail));
+					m_dagTail = nullptr;
+					m_dagTailDev = nullptr;
+					m_dagTailCapacity = 0;
+					m_dagTailMemory.release();
+				}
+				size_t freeMem, totalMem;
+				CUDA_SAFE_CALL(cudaMemGetInfo(&freeMem, &totalMem));
+				uint64_t const headroomSize = ethash_get_datasize(headroomBlock);
+				if (s_hostDag && dagSize + c_vramReserve > freeMem)
+				{
+					// Whole items in VRAM, the rest with the headroom in host memory.
+					uint64_t const vram = freeMem > c_vramReserve + ETHASH_MIX_BYTES ? freeMem - c_vramReserve : ETHASH_MIX_BYTES;
+					m_dagCapacity = vram / ETHASH_MIX_BYTES * ETHASH_MIX_BYTES;
+					m_dagTailCapacity = max(headroomSize, dagSize) - m_dagCapacity;
+					cwarn << "GPU #" << m_device_num << " holds " << m_dagCapacity << " bytes of the DAG, mapping "
+						  << m_dagTailCapacity << " bytes from host memory";
+					// The kernels read it: no less will do, over the budget or not.
+					m_dagTailMemory = HostMemory::reserve(HostMemory::Dag, m_dagTailCapacity, m_dagTailCapacity);
+					void* tail;
+					CUDA_SAFE_CALL(cudaHostAlloc(&tail, m_dagTailCapacity, cudaHostAllocMapped));
+					m_dagTail = static_cast<uint8_t*>(tail);
+					CUDA_SAFE_CALL(cudaHostGetDevicePointer(&tail, tail, 0));
+					m_dagTailDev = static_cast<hash128_t*>(tail);
+				}
+				else
+					m_dagCapacity = max<uint64_t>(dagSize, min<uint64_t>(headroomSize, freeMem));
+				cudalog << "Allocating DAG with size: " << m_dagCapacity;
+				CUDA_SAFE_CALL(cudaMalloc(reinterpret_cast<void**>(&dag), m_dagCapacity));
+			}
+			m_dagSplit = (uint32_t)min<uint64_t>(dagSize128, m_dagCapacity / ETHASH_MIX_BYTES);
+
+			set_constants(dag, dagSize128, light, lightSize64, m_dagTailDev, m_dagSplit); //in ethash_cuda_miner_kernel.cu
+			set_probe_target(Miner::probeTarget());
+
+			if (resident || dagSize128 != m_dag_size || dag != m_dag)
+			{
+				if (s_rtc)
+					compileSearch(dag, dagSize128);
+				memset(&m_current_header, 0, sizeof(hash32_t));
+				m_current_target = 0;
+				m_current_index = 0;
 
-						hostDAG = memoryDAG;
+				if (resident)
+				{
+					cudalog << "Switching to the DAG of epoch " << epoch << " kept on the device";
+					dagStaged(epoch, "kept", 0, 0);
+				}
+				else if (_cpyToHost && m_device_num != dagCreateDevice && m_dagSplit < dagSize128)
+				{
+					// The copies are of one allocation; this DAG is in two.
+					{
+						UniqueGuard l(x_dagShare);
+						s_dagShareChanged.wait(l, [&]() { return s_dagShare.size == dagSize; });
 					}
-				}else{
-					while(!hostDAG)
-						this_thread::sleep_for(chrono::milliseconds(100)); 
-					goto cpyDag;
+					generateDag(dagSize);
+					dagStaged(epoch, "generate", dagSize, dagProgress().ms);
+					releaseSharedDag();
+				}
+				else if (_cpyToHost && m_device_num != dagCreateDevice)
+					copySharedDag(epoch, dag, dagSize);
+				else
+				{
+					//if !cpyToHost -> All devices shall generate their DAG
+					generateDag(dagSize);
+					dagStaged(epoch, "generate", dagSize, dagProgress().ms);
+					if (_cpyToHost)
+						shareDag(epoch, dag, dagSize);
 				}
 			}
-			else
+			m_dag = dag;
+			m_dag_size = dagSize128;
+			m_dagEpoch = epoch;
+		}
+
+		{
+			ostringstream name;
+			name << device_props.name;
+			if (s_instancesPerDevice > 1)
+				name << " #" << m_instance;
+			if (m_dagSplit < dagSize128)
+				name << " (" << (dagSize128 - m_dagSplit) * 100 / dagSize128 << "% host DAG)";
+			Guard l(x_deviceName);
+			m_deviceName = name.str();
+		}
+
+		if (!m_configured)
+		{
+			// On the loaded DAG, so that the searches measured are real ones.
+			if (m_tune)
+			{
+				unsigned const hashes = m_threadHashes;
+				autoTune(device_props);
+				saveProfile(device_props);
+				if (s_rtc && m_threadHashes != hashes)
+					compileSearch(m_dag, m_dag_size);
+			}
+			cudalog << "GPU #" << m_device_num << " uses grid size " << m_gridSize << ", block size " << m_blockSize
+					<< ", " << m_numStreams << " streams and " << m_threadHashes << " parallel hashes";
+			createGraphs();
+			publishTuning();
+			m_configured = true;
+		}
+
+		if (m_instance == 0 && s_instancesPerDevice > 1)
+		{
 			{
-cpyDag:
-				cudalog << "Copying DAG from host to GPU #" << m_device_num;
-				const void* hdag = (const void*)hostDAG;
-				CUDA_SAFE_CALL(cudaMemcpy(reinterpret_cast<void*>(dag), hdag, dagSize, cudaMemcpyHostToDevice));
+				Guard l(x_deviceDags);
+				DeviceDag& d = s_deviceDags[m_device_num];
+				d.size = dagSize;
+				d.dag = m_dag;
+				d.split = m_dagSplit;
+				d.tail = m_dagTailDev;
+				d.light = m_light[m_device_num];
+				d.lightSize = m_lightSize;
 			}
+			s_deviceDagChanged.notify_all();
 		}
-    
-		m_dag = dag;
-		m_dag_size = dagSize128;
 		return true;
 	}
 	catch (runtime_error const&)
@@ -422,107 +847,920 @@ cpyDag:
 	}
 }
 
-void CUDAMiner::search(
-	uint8_t const* header,
-	uint64_t target,
-	bool _ethStratum,
-	uint64_t _startN,
-	const dev::eth::WorkPackage& w)
+bool CUDAMiner::swapResidentDag(unsigned _epoch, uint64_t _dagSize, uint64_t _lightSize)
 {
-	bool initialize = false;
-	if (memcmp(&m_current_header, header, sizeof(hash32_t)))
+	ResidentDag current;
+	current.epoch = m_dagEpoch;
+	current.dag = m_dag;
+	current.capacity = m_dagCapacity;
+	current.light = m_light[m_device_num];
+	current.lightCapacity = m_lightCapacity;
+	ResidentDag& r = m_resident;
+	if (r.dag && r.epoch == _epoch && _dagSize <= r.capacity && _lightSize <= r.lightCapacity)
 	{
-		m_current_header = *reinterpret_cast<hash32_t const *>(header);
-		set_header(m_current_header);
-		initialize = true;
+		m_dag = r.dag;
+		m_dagCapacity = r.capacity;
+		m_light[m_device_num] = r.light;
+		m_lightCapacity = r.lightCapacity;
+		r = current;
+		return true;
+	}
+
+	// The one kept before goes either way: it is the older of the two.
+	size_t freeMem, totalMem;
+	CUDA_SAFE_CALL(cudaMemGetInfo(&freeMem, &totalMem));
+	if (r.dag)
+	{
+		CUDA_SAFE_CALL(cudaFree(r.dag));
+		CUDA_SAFE_CALL(cudaFree(r.light));
+		freeMem += r.capacity + r.lightCapacity;
+		r = ResidentDag();
 	}
-	if (m_current_target != target)
+	if (_dagSize + _lightSize + c_vramReserve > freeMem)
 	{
-		m_current_target = target;
-		set_target(m_current_target);
-		initialize = true;
+		cudalog << "Not enough memory to keep the DAG of epoch " << m_dagEpoch << " on the device";
+		return false;
+	}
+	cudalog << "Keeping the DAG of epoch " << m_dagEpoch << " on the device";
+	r = current;
+	m_dag = nullptr;
+	m_dagCapacity = 0;
+	m_light[m_device_num] = nullptr;
+	m_lightCapacity = 0;
+	return false;
+}
+
+void CUDAMiner::setRuntimeCompile(bool _rtc)
+{
+#if ETH_NVRTC
+	s_rtc = _rtc;
+#else
+	if (_rtc)
+	{
+		cwarn << "Built without NVRTC: --cuda-rtc ignored, using the built-in kernel";
+	}
+#endif
+}
+
+#if ETH_NVRTC
+void CUDAMiner::compileSearch(hash128_t* _dag, uint32_t _dagSize128)
+{
+	if (m_module)
+	{
+		cuModuleUnload(m_module);
+		m_module = nullptr;
+		m_rtcSearch = nullptr;
+	}
+	cudaDeviceProp props;
+	CUDA_SAFE_CALL(cudaGetDeviceProperties(&props, m_device_num));
+	string const arch = "--gpu-architecture=sm_" + to_string(props.major) + to_string(props.minor);
+	string const dagSize = "-DDAG_SIZE=" + to_string(_dagSize128) + "U";
+	string const parallelHash = "-DPARALLEL_HASH=" + to_string(m_threadHashes);
+	vector<char const*> const options{arch.c_str(), dagSize.c_str(), parallelHash.c_str(), "--use_fast_math", "-default-device"};
+
+	// Cached per architecture, epoch and source, next to the DAG files.
+	int nvrtcMajor = 0;
+	int nvrtcMinor = 0;
+	nvrtcVersion(&nvrtcMajor, &nvrtcMinor);
+	string key = to_string(nvrtcMajor) + "." + to_string(nvrtcMinor);
+	for (char const* o: options)
+		key += '\0' + string(o);
+	for (RtcSource const& source: rtcSources())
+		key += '\0' + source.code;
+	string const dir = EthashAux::dagDirectory();
+	string const path = dir.empty() ? string() : dir + "/cuda-sm_" + to_string(props.major) + to_string(props.minor) + "-" + sha3(key).hex() + ".cubin";
+
+	string cubin;
+	if (!path.empty())
+	{
+		std::ifstream f(path, std::ios::binary);
+		cubin.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
 	}
-	if (_ethStratum)
+	auto const compile = [&]()
 	{
-		if (initialize)
+		cudalog << "Compiling the search kernel for " << arch.substr(arch.find('=') + 1) << " and DAG size " << _dagSize128;
+		vector<char const*> headers;
+		vector<char const*> names;
+		for (size_t i = 1; i < rtcSources().size(); i++)
 		{
-			m_starting_nonce = 0;
-			m_current_index = 0;
-			CUDA_SAFE_CALL(cudaDeviceSynchronize());
-			for (unsigned int i = 0; i < s_numStreams; i++)
-				m_search_buf[i]->count = 0;
+			headers.push_back(rtcSources()[i].code.c_str());
+			names.push_back(rtcSources()[i].name);
+		}
+		nvrtcProgram program;
+		if (nvrtcCreateProgram(&program, rtcSources()[0].code.c_str(), rtcSources()[0].name, (int)headers.size(), headers.data(), names.data()) != NVRTC_SUCCESS)
+		{
+			cwarn << "Cannot create the NVRTC program, using the built-in kernel";
+			return false;
+		}
+		nvrtcResult const result = nvrtcCompileProgram(program, (int)options.size(), options.data());
+		if (result != NVRTC_SUCCESS)
+		{
+			size_t size = 0;
+			nvrtcGetProgramLogSize(program, &size);
+			string log(size, '\0');
+			nvrtcGetProgramLog(program, &log[0]);
+			cwarn << "Compiling the search kernel failed, using the built-in one: " << nvrtcGetErrorString(result) << "\n" << log;
+			nvrtcDestroyProgram(&program);
+			return false;
 		}
-		if (m_starting_nonce != _startN)
+		size_t size = 0;
+		nvrtcGetCUBINSize(program, &size);
+		cubin.resize(size);
+		nvrtcGetCUBIN(program, &cubin[0]);
+		nvrtcDestroyProgram(&program);
+		if (!path.empty() && !writeFileAtomically(path, [&](std::ostream& _f) { _f.write(cubin.data(), cubin.size()); }))
 		{
-			// reset nonce counter
-			m_starting_nonce = _startN;
-			m_current_nonce = m_starting_nonce;
+			cwarn << "Cannot write the search kernel " << path;
 		}
+		return true;
+	};
+	bool const cached = !cubin.empty();
+	if (cached)
+	{
+		cudalog << "Loaded search kernel " << path;
 	}
+	else if (!compile())
+		return;
+
+	CUresult loaded = cuModuleLoadData(&m_module, cubin.data());
+	if (loaded != CUDA_SUCCESS && cached)
+	{
+		// A damaged file: compiled again in its place.
+		cwarn << "Cannot load the search kernel " << path << ", compiling it again";
+		std::remove(path.c_str());
+		if (!compile())
+			return;
+		loaded = cuModuleLoadData(&m_module, cubin.data());
+	}
+	checkCU(loaded, "cuModuleLoadData");
+	checkCU(cuModuleGetFunction(&m_rtcSearch, m_module, "ethash_search_rtc"), "cuModuleGetFunction");
+	size_t size;
+	checkCU(cuModuleGetGlobal(&m_rtcHeader, &size, m_module, "d_header"), "cuModuleGetGlobal");
+	checkCU(cuModuleGetGlobal(&m_rtcKeccak, &size, m_module, "d_keccak"), "cuModuleGetGlobal");
+	checkCU(cuModuleGetGlobal(&m_rtcTarget, &size, m_module, "d_target"), "cuModuleGetGlobal");
+	CUdeviceptr dag;
+	checkCU(cuModuleGetGlobal(&dag, &size, m_module, "d_dag"), "cuModuleGetGlobal");
+	checkCU(cuMemcpyHtoD(dag, &_dag, sizeof(_dag)), "cuMemcpyHtoD");
+	// As set_constants() does.
+	hash128_t* const tail = (hash128_t*)((uintptr_t)m_dagTailDev - uintptr_t(m_dagSplit) * sizeof(hash128_t));
+	checkCU(cuModuleGetGlobal(&dag, &size, m_module, "d_dag_tail"), "cuModuleGetGlobal");
+	checkCU(cuMemcpyHtoD(dag, &tail, sizeof(tail)), "cuMemcpyHtoD");
+	checkCU(cuModuleGetGlobal(&dag, &size, m_module, "d_dag_split"), "cuModuleGetGlobal");
+	checkCU(cuMemcpyHtoD(dag, &m_dagSplit, sizeof(m_dagSplit)), "cuMemcpyHtoD");
+	uint64_t const probeTarget = Miner::probeTarget();
+	checkCU(cuModuleGetGlobal(&dag, &size, m_module, "d_probe_target"), "cuModuleGetGlobal");
+	checkCU(cuMemcpyHtoD(dag, &probeTarget, sizeof(probeTarget)), "cuMemcpyHtoD");
+}
+#else
+void CUDAMiner::compileSearch(hash128_t*, uint32_t)
+{
+	// Never reached: s_rtc stays false without NVRTC.
+}
+#endif
+
+void CUDAMiner::generateDag(uint64_t _dagSize)
+{
+	uint32_t blocks;
+	uint32_t threads;
+	ethash_dag_geometry(&blocks, &threads);
+	uint32_t const work = (uint32_t)(_dagSize / sizeof(hash64_t));
+	uint32_t const chunk = blocks * threads;
+	uint32_t const runs = (work + chunk - 1) / chunk;
+	cudalog << "Generating DAG for GPU #" << m_device_num << " with dagSize: " << _dagSize
+			<< " in " << runs << " chunks of " << blocks << "x" << threads << " on " << m_streamCount << " streams";
+
+	// The chunks go round the streams, each with up to c_dagChunksPerStream
+	// queued, so every stream has one to run while the host waits for the
+	// oldest. The events are recorded and waited for in the same order.
+	bool const persisting = s_l2Persist && persistLight(true);
+	auto const start = chrono::steady_clock::now();
+	dagProgressed(0, _dagSize, 0);
+	std::deque<cudaEvent_t> pending;
+	uint32_t queued = 0;
+	uint32_t done = 0;
+	while (done < runs)
+	{
+		while (queued < runs && pending.size() < m_dagChunks.size())
+		{
+			cudaStream_t const stream = m_streams[queued % m_streamCount];
+			cudaEvent_t const e = m_dagChunks[queued % m_dagChunks.size()];
+			ethash_generate_dag_chunk(queued * chunk, blocks, threads, stream);
+			CUDA_SAFE_CALL(cudaEventRecord(e, stream));
+			pending.push_back(e);
+			queued++;
+		}
+		CUDA_SAFE_CALL(cudaEventSynchronize(pending.front()));
+		pending.pop_front();
+		done++;
+		double const ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		dagProgressed(min<uint64_t>(uint64_t(done) * chunk * sizeof(hash64_t), _dagSize), _dagSize, ms);
+		if (done * 10 / runs != (done - 1) * 10 / runs)
+		{
+			cudalog << "DAG" << done * 100 / runs << "%";
+		}
+	}
+	// The searches stream through the DAG; the light must not crowd it out.
+	if (persisting)
+		persistLight(false);
+	DagProgress const p = dagProgress();
+	cudalog << "Generated DAG in " << unsigned(p.ms) << " ms, " << p.bandwidth() << " GB/s";
+}
+
+bool CUDAMiner::persistLight(bool _persist)
+{
+#if CUDART_VERSION >= 11000
+	int setAside = 0;
+	int maxWindow = 0;
+	CUDA_SAFE_CALL(cudaDeviceGetAttribute(&setAside, cudaDevAttrMaxPersistingL2CacheSize, m_device_num));
+	CUDA_SAFE_CALL(cudaDeviceGetAttribute(&maxWindow, cudaDevAttrMaxAccessPolicyWindowSize, m_device_num));
+	if (setAside <= 0 || maxWindow <= 0)
+	{
+		if (_persist)
+		{
+			cudalog << "GPU #" << m_device_num << " has no persisting L2, the light is read as usual";
+		}
+		return false;
+	}
+	cudaStreamAttrValue attr;
+	memset(&attr, 0, sizeof(attr));
+	if (_persist)
+	{
+		size_t const window = min<size_t>(m_lightSize, size_t(maxWindow));
+		size_t const persisting = min<size_t>(window, size_t(setAside));
+		CUDA_SAFE_CALL(cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, persisting));
+		attr.accessPolicyWindow.base_ptr = m_light[m_device_num];
+		attr.accessPolicyWindow.num_bytes = window;
+		// Only as much of the window persists as the set-aside holds, the
+		// rest would evict itself.
+		attr.accessPolicyWindow.hitRatio = float(persisting) / float(window);
+		attr.accessPolicyWindow.hitProp = cudaAccessPropertyPersisting;
+		attr.accessPolicyWindow.missProp = cudaAccessPropertyStreaming;
+		cudalog << "Persisting " << persisting << " bytes of the light in L2 for the DAG generation";
+	}
+	for (unsigned i = 0; i != m_streamCount; ++i)
+		CUDA_SAFE_CALL(cudaStreamSetAttribute(m_streams[i], cudaStreamAttributeAccessPolicyWindow, &attr));
+	if (!_persist)
+	{
+		// The lines already persisting stay so until reset.
+		CUDA_SAFE_CALL(cudaCtxResetPersistingL2Cache());
+		CUDA_SAFE_CALL(cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, 0));
+	}
+	return true;
+#else
+	if (_persist)
+		cudalog << "L2 persistence needs CUDA 11, the light is read as usual";
+	return false;
+#endif
+}
+
+void CUDAMiner::shareDag(unsigned _epoch, hash128_t const* _dag, uint64_t _size)
+{
+	// Host staging only if some device cannot read this one's memory, or
+	// part of it is in host memory already.
+	unsigned const numDevices = getNumDevices();
+	uint64_t const vram = uint64_t(m_dagSplit) * ETHASH_MIX_BYTES;
+	bool p2p = vram >= _size;
+	for (unsigned i = 0; i < s_numInstances; i++)
+	{
+		unsigned device = s_devices[i] > -1 ? s_devices[i] : i;
+		device = device < numDevices - 1 ? device : numDevices - 1;
+		int can = 0;
+		if (device == m_device_num)
+			continue;
+		if (cudaDeviceCanAccessPeer(&can, device, m_device_num) != cudaSuccess)
+			cudaGetLastError();
+		p2p = p2p && can;
+	}
+	uint8_t* host = nullptr;
+	HostMemory::Reservation memory;
+	if (!p2p)
+	{
+		// Huge pages and a pinned registration, so that the chunks go at full
+		// DMA rate and the uploads can be queued asynchronously.
+		memory = HostMemory::reserve(HostMemory::Staging, _size, min(_size, 2 * c_dagChunk));
+		host = (uint8_t*)ethash_huge_alloc(memory.bytes());
+		if (!host)
+			throw std::runtime_error("Cannot allocate the host DAG");
+		if (cudaHostRegister(host, memory.bytes(), cudaHostRegisterPortable) != cudaSuccess)
+		{
+			cudaGetLastError();
+			cudalog << "Cannot pin the host DAG, uploads will be staged";
+		}
+	}
+	uint64_t const ring = memory.bytes();
+	{
+		Guard l(x_dagShare);
+		s_dagShare.size = _size;
+		s_dagShare.device = m_device_num;
+		s_dagShare.dag = _dag;
+		s_dagShare.vram = min(vram, _size);
+		s_dagShare.host = host;
+		s_dagShare.ring = ring;
+		s_dagShare.staged = 0;
+		s_dagShare.pending = s_numInstances - 1;
+		s_dagShare.uploaded.clear();
+		s_dagShareMemory = std::move(memory);
+	}
+	s_dagShareChanged.notify_all();
+	if (!host)
+		return;
+
+	// In chunks, so that the other devices upload one while the next is
+	// downloaded.
+	if (ring < _size)
+		cudalog << "Copying DAG from GPU #" << m_device_num << " to host through " << ring / (1024 * 1024)
+				<< " MB, within the host memory budget";
 	else
+		cudalog << "Copying DAG from GPU #" << m_device_num << " to host";
+	auto const start = chrono::steady_clock::now();
+	for (uint64_t offset = 0; offset < _size;)
 	{
-		if (initialize)
+		uint64_t n = min(c_dagChunk, ring - offset % ring);
+		if (offset + n > ring)
 		{
-			m_current_nonce = get_start_nonce();
-			m_current_index = 0;
-			CUDA_SAFE_CALL(cudaDeviceSynchronize());
-			for (unsigned int i = 0; i < s_numStreams; i++)
-				m_search_buf[i]->count = 0;
+			// Over bytes of the ring's last round: once every device still
+			// pending has uploaded them.
+			UniqueGuard l(x_dagShare);
+			s_dagShareChanged.wait(l, [&]()
+			{
+				if (s_dagShare.uploaded.size() < s_dagShare.pending)
+					return false;
+				for (auto const& u: s_dagShare.uploaded)
+					if (u.second < offset + n - ring)
+						return false;
+				return true;
+			});
+		}
+		if (offset < vram)
+		{
+			n = min(n, vram - offset);
+			CUDA_SAFE_CALL(cudaMemcpyAsync(host + offset % ring, (uint8_t const*)_dag + offset, n, cudaMemcpyDeviceToHost, m_streams[0]));
+			CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[0]));
+		}
+		else
+		{
+			n = min(n, _size - offset);
+			memcpy(host + offset % ring, m_dagTail + (offset - vram), n);
+		}
+		offset += n;
+		{
+			Guard l(x_dagShare);
+			s_dagShare.staged = offset;
 		}
+		s_dagShareChanged.notify_all();
 	}
-	uint64_t batch_size = s_gridSize * s_blockSize;
-	while (true)
-	{
-		m_current_index++;
-		m_current_nonce += batch_size;
-		auto stream_index = m_current_index % s_numStreams;
-		cudaStream_t stream = m_streams[stream_index];
-		volatile search_results* buffer = m_search_buf[stream_index];
-		uint32_t found_count = 0;
-		uint64_t nonces[SEARCH_RESULTS];
-		uint32_t mixes[SEARCH_RESULTS][8];
-		uint64_t nonce_base = m_current_nonce - s_numStreams * batch_size;
-		if (m_current_index >= s_numStreams)
-		{
-			CUDA_SAFE_CALL(cudaStreamSynchronize(stream));
-			found_count = buffer->count;
-			if (found_count) {
-				buffer->count = 0;
-				if (found_count > SEARCH_RESULTS)
-					found_count = SEARCH_RESULTS;
-				for (unsigned int j = 0; j < found_count; j++) {
-					nonces[j] = nonce_base + buffer->result[j].gid;
-					mixes[j][0] = buffer->result[j].mix[0];
-					mixes[j][1] = buffer->result[j].mix[1];
-					mixes[j][2] = buffer->result[j].mix[2];
-					mixes[j][3] = buffer->result[j].mix[3];
-					mixes[j][4] = buffer->result[j].mix[4];
-					mixes[j][5] = buffer->result[j].mix[5];
-					mixes[j][6] = buffer->result[j].mix[6];
-					mixes[j][7] = buffer->result[j].mix[7];
+	dagStaged(_epoch, "download", _size, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+}
+
+void CUDAMiner::copySharedDag(unsigned _epoch, hash128_t* _dag, uint64_t _size)
+{
+	DagShare share;
+	{
+		UniqueGuard l(x_dagShare);
+		s_dagShareChanged.wait(l, [&]() { return s_dagShare.size == _size; });
+		share = s_dagShare;
+	}
+	// From once the DAG is published: the wait for it is the generation's.
+	auto const start = chrono::steady_clock::now();
+	char const* stage = "p2p";
+	try
+	{
+		int can = 0;
+		if (cudaDeviceCanAccessPeer(&can, m_device_num, share.device) != cudaSuccess)
+			cudaGetLastError();
+		if (can && share.vram == _size)
+		{
+			// A device reset drops the peer mappings, so this is done every time.
+			cudaError_t const err = cudaDeviceEnablePeerAccess(share.device, 0);
+			if (err == cudaErrorPeerAccessAlreadyEnabled)
+				cudaGetLastError();
+			else
+				CUDA_SAFE_CALL(err);
+			cudalog << "Copying DAG from GPU #" << share.device << " to GPU #" << m_device_num << " peer-to-peer";
+			CUDA_SAFE_CALL(cudaMemcpyPeerAsync(_dag, m_device_num, share.dag, share.device, _size, m_streams[0]));
+		}
+		else
+		{
+			if (!share.host)
+				throw std::runtime_error("No host copy of the DAG");
+			cudalog << "Copying DAG from host to GPU #" << m_device_num;
+			stage = "host-copy";
+			bool const ring = share.ring < _size;
+			uint64_t copied = 0;
+			while (copied < _size)
+			{
+				if (ring)
+				{
+					// Caught up: done before the creator downloads over it.
+					CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[0]));
+					{
+						Guard l(x_dagShare);
+						s_dagShare.uploaded[index] = copied;
+					}
+					s_dagShareChanged.notify_all();
+				}
+				uint64_t staged;
+				{
+					UniqueGuard l(x_dagShare);
+					s_dagShareChanged.wait(l, [&]() { return s_dagShare.staged > copied; });
+					staged = s_dagShare.staged;
+				}
+				for (uint64_t n; copied < staged; copied += n)
+				{
+					n = min(staged - copied, share.ring - copied % share.ring);
+					CUDA_SAFE_CALL(cudaMemcpyAsync((uint8_t*)_dag + copied, share.host + copied % share.ring, n, cudaMemcpyHostToDevice, m_streams[0]));
 				}
 			}
 		}
-		run_ethash_search(s_gridSize, s_blockSize, stream, buffer, m_current_nonce, m_parallelHash);
-		if (m_current_index >= s_numStreams)
-		{
-			if (found_count)
-				for (uint32_t i = 0; i < found_count; i++)
-					farm.submitProof(
-						Solution{nonces[i],
-						*((const h256 *)mixes[i]),
-						w,
-						m_abort});
-			addHashCount(batch_size);
-			bool t = true;
-			if (m_abort.compare_exchange_strong(t, false))
-				break;
-			if (shouldStop())
+		CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[0]));
+	}
+	catch (std::runtime_error const&)
+	{
+		releaseSharedDag();
+		throw;
+	}
+	releaseSharedDag();
+	dagStaged(_epoch, stage, _size, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+}
+
+void CUDAMiner::releaseSharedDag()
+{
+	{
+		Guard l(x_dagShare);
+		s_dagShare.uploaded.erase(index);
+		if (--s_dagShare.pending == 0 && s_dagShare.host)
+		{
+			// all devices have loaded DAG, we can free now
+			if (cudaHostUnregister(s_dagShare.host) != cudaSuccess)
+				cudaGetLastError();  // it was never pinned
+			ethash_huge_free(s_dagShare.host, s_dagShare.ring);
+			s_dagShare.host = nullptr;
+			s_dagShareMemory.release();
+			cnote << "Freeing DAG from host";
+		}
+	}
+	s_dagShareChanged.notify_all();
+}
+
+hash128_t* CUDAMiner::useDeviceDag(uint64_t _dagSize)
+{
+	UniqueGuard l(x_deviceDags);
+	DeviceDag& d = s_deviceDags[m_device_num];
+	if (m_dagUser)
+	{
+		d.users--;
+		m_dagUser = false;
+		s_deviceDagChanged.notify_all();
+	}
+	while (!s_deviceDagChanged.wait_for(l, chrono::seconds(1), [&]() { return d.size == _dagSize; }))
+		if (shouldStop())
+			throw std::runtime_error("Stopped while waiting for the DAG");
+	d.users++;
+	m_dagUser = true;
+	m_light[m_device_num] = d.light;
+	m_lightSize = d.lightSize;
+	m_dagSplit = d.split;
+	m_dagTailDev = d.tail;
+	return d.dag;
+}
+
+void CUDAMiner::search(
+	uint8_t const* header,
+	uint64_t target,
+	const dev::eth::WorkPackage& w,
+	chrono::milliseconds& _wait)
+{
+	if (memcmp(&m_current_header, header, sizeof(hash32_t)) || m_current_target != target)
+	{
+		TraceScope trace("switch");
+		m_current_header = *reinterpret_cast<hash32_t const *>(header);
+		m_current_target = target;
+		// Only searches from two jobs ago still read the slot about to be
+		// written; the previous job's keep running alongside the new one.
+		unsigned const slot = (m_job + 1) % JOB_SLOTS;
+		for (unsigned i = 0; i < m_numStreams; i++)
+			if (m_stream_busy[i] && m_stream_job[i] % JOB_SLOTS == slot)
+				collectResults(i);
+		m_job++;
+		m_jobWork[slot] = w;
+		unsigned const deviceSlot = m_instance * JOB_SLOTS + slot;
+		keccak_job_t const keccak = keccakJob(m_current_header);
+		if (m_rtcSearch)
+		{
+			// The same as set_job(), into the run time compiled module.
+			CUDA_SAFE_CALL(cudaMemcpyAsync((void*)(m_rtcHeader + deviceSlot * sizeof(hash32_t)), &m_current_header, sizeof(hash32_t), cudaMemcpyHostToDevice, m_jobStream));
+			CUDA_SAFE_CALL(cudaMemcpyAsync((void*)(m_rtcKeccak + deviceSlot * sizeof(keccak_job_t)), &keccak, sizeof(keccak_job_t), cudaMemcpyHostToDevice, m_jobStream));
+			CUDA_SAFE_CALL(cudaMemcpyAsync((void*)(m_rtcTarget + deviceSlot * sizeof(uint64_t)), &m_current_target, sizeof(uint64_t), cudaMemcpyHostToDevice, m_jobStream));
+			CUDA_SAFE_CALL(cudaEventRecord(m_jobWritten, m_jobStream));
+		}
+		else
+			set_job(deviceSlot, m_current_header, keccak, m_current_target, m_jobStream, m_jobWritten);
+	}
+	uint64_t batch_size = uint64_t(m_gridSize) * m_blockSize * m_launchSearches;
+	auto stream_index = (m_current_index + 1) % m_numStreams;
+	cudaStream_t stream = m_streams[stream_index];
+	if (m_stream_busy[stream_index])
+	{
+		// Woken by the collector thread when the search is done.
+		if (s_eventCollect && !m_stream_done[stream_index].load(std::memory_order_acquire))
+		{
+			_wait = chrono::milliseconds(100);
+			return;
+		}
+		TraceScope trace("wait");
+		collectResults(stream_index);
+	}
+	m_current_index++;
+	uint64_t start_nonce;
+	if (!nextNonces(batch_size, start_nonce))
+	{
+		// Newer work was published or this one's nonces are used up; the
+		// next step picks up whatever comes next.
+		_wait = restWait();
+		return;
+	}
+
+	TraceScope trace("launch");
+	unsigned const slot = m_instance * JOB_SLOTS + m_job % JOB_SLOTS;
+	if (m_stream_job[stream_index] != m_job)
+		CUDA_SAFE_CALL(cudaStreamWaitEvent(stream, m_jobWritten, 0));
+	if (m_rtcSearch)
+	{
+		volatile search_results* buffer = m_search_dev[stream_index];
+		uint32_t gidBase = 0;
+		uint32_t job = slot;
+		void* args[] = {&buffer, &start_nonce, &gidBase, &job};
+		checkCU(cuLaunchKernel(m_rtcSearch, m_gridSize, 1, 1, m_blockSize, 1, 1, 0, stream, args, nullptr), "cuLaunchKernel");
+	}
+	else if (m_graphs.empty())
+		run_ethash_search(m_gridSize, m_blockSize, stream, m_search_dev[stream_index], start_nonce, m_threadHashes, slot);
+	else
+		launch_search_graph(m_graphs[stream_index], stream, start_nonce, slot);
+	if (s_eventCollect)
+	{
+		m_stream_done[stream_index].store(false, std::memory_order_relaxed);
+		CUDA_SAFE_CALL(cudaEventRecord(m_stream_event[stream_index], stream));
+		atomic<bool>* done = &m_stream_done[stream_index];
+		Completions::get().add(this, m_device_num, m_stream_event[stream_index], [this, done]() {
+			done->store(true, std::memory_order_release);
+			wake();
+		});
+	}
+	m_stream_nonce[stream_index] = start_nonce;
+	m_stream_job[stream_index] = m_job;
+	m_stream_busy[stream_index] = true;
+	noteInFlight(WorkSlot::Clock::now(), true);
+	stepDagCheck();
+}
+
+void CUDAMiner::noteInFlight(WorkSlot::Clock::time_point _at, bool _launched)
+{
+	unsigned const busy = (unsigned)count(m_stream_busy.begin(), m_stream_busy.end(), true);
+	searchesInFlight(busy, _at, _launched);
+}
+
+void CUDAMiner::stepDagCheck()
+{
+	DagReadBack& r = m_dagReadBack;
+	if (m_instance != 0 || !r.host)
+		return;
+	if (r.pending)
+	{
+		cudaError_t const status = cudaEventQuery(r.read);
+		if (status == cudaErrorNotReady)
+			return;
+		CUDA_SAFE_CALL(status);
+		r.pending = false;
+		checkDag(r.seed, move(r.items), bytes(r.host, r.host + r.items.size() * sizeof(hash128_t)));
+	}
+
+	vector<uint32_t> const corrupt = corruptDagItems(m_current.seed);
+	if (!corrupt.empty())
+	{
+		// Alongside the searches in flight, which may still see the corrupt
+		// items; their solutions are verified.
+		uint32_t blocks;
+		uint32_t threads;
+		ethash_dag_geometry(&blocks, &threads);
+		uint32_t const chunk = blocks * threads;
+		std::set<uint32_t> runs;
+		for (uint32_t item: corrupt)
+			runs.insert(item * 2 / chunk);
+		for (uint32_t run: runs)
+			ethash_generate_dag_chunk(run * chunk, blocks, threads, m_jobStream);
+		dagHealthRepaired((unsigned)runs.size());
+		cudalog << "Regenerated " << runs.size() << " DAG chunks of " << corrupt.size() << " corrupt items";
+	}
+
+	if (!m_dagSplit || !dagCheckDue())
+		return;
+	r.seed = m_current.seed;
+	r.items = DagVerifier::pickItems(m_dagSplit, DagVerifier::c_items);
+	for (size_t i = 0; i < r.items.size(); ++i)
+		CUDA_SAFE_CALL(cudaMemcpyAsync(r.host + i * sizeof(hash128_t), m_dag + r.items[i], sizeof(hash128_t), cudaMemcpyDeviceToHost, m_jobStream));
+	CUDA_SAFE_CALL(cudaEventRecord(r.read, m_jobStream));
+	r.pending = true;
+}
+
+void CUDAMiner::collectResults(unsigned _stream)
+{
+	TraceScope trace("collect", "results", 0);
+	volatile search_results* buffer = m_search_buf[_stream];
+	if (s_eventCollect)
+		CUDA_SAFE_CALL(cudaEventSynchronize(m_stream_event[_stream]));
+	else
+		CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[_stream]));
+	WorkSlot::Clock::time_point const kernelDone = WorkSlot::Clock::now();
+	m_stream_busy[_stream] = false;
+	noteInFlight(kernelDone, false);
+	uint64_t const hashes = uint64_t(m_gridSize) * m_blockSize * m_launchSearches;
+	if (!m_readback)
+	{
+		addHashCount(hashes);
+		return;
+	}
+	uint32_t found_count = buffer->count;
+	countResults(found_count, SEARCH_RESULTS);
+	trace.setArg(found_count);
+	if (found_count)
+	{
+		buffer->count = 0;
+		if (found_count > SEARCH_RESULTS)
+			found_count = SEARCH_RESULTS;
+		// The nonces of a stream's launches are not contiguous with the
+		// other streams', they come from the farm's leases.
+		uint64_t const nonce_base = m_stream_nonce[_stream];
+		uint64_t const job = m_stream_job[_stream];
+		for (uint32_t i = 0; i < found_count; i++)
+		{
+			uint32_t mix[8];
+			for (unsigned j = 0; j < 8; j++)
+				mix[j] = buffer->result[i].mix[j];
+			// Found on a job that was replaced while the search ran.
+			submitProof(
+				Solution{nonce_base + buffer->result[i].gid,
+				*((const h256 *)mix),
+				m_jobWork[job % JOB_SLOTS],
+				job != m_job,
+				(unsigned)index},
+				kernelDone);
+		}
+	}
+	if (uint32_t const probes = buffer->probes)
+	{
+		buffer->probes = 0;
+		probesCounted(probes, m_stream_nonce[_stream] + buffer->probe_gid, m_jobWork[m_stream_job[_stream] % JOB_SLOTS]);
+	}
+	addHashCount(hashes);
+}
+
+void CUDAMiner::createGraphs()
+{
+	// The gids of a launch's searches are 32 bits.
+	uint64_t const batch = uint64_t(m_gridSize) * m_blockSize;
+	m_launchSearches = (unsigned)min<uint64_t>(max(s_graphSearches, 1u), 0xffffffffu / batch);
+	if (m_launchSearches > 1 && s_rtc)
+	{
+		cudalog << "CUDA graphs are not used with the run time compiled kernel";
+		m_launchSearches = 1;
+	}
+	if (m_launchSearches > 1)
+	{
+		cudalog << "Capturing " << m_launchSearches << " searches per CUDA graph";
+		for (unsigned i = 0; i != m_numStreams; ++i)
+			m_graphs.push_back(create_search_graph(m_gridSize, m_blockSize, m_search_dev[i], m_threadHashes, m_launchSearches));
+	}
+}
+
+bool CUDAMiner::checkTuning(string const& _name, unsigned _value, string& _error) const
+{
+	if (_name == "grid")
+	{
+		if (_value)
+			return true;
+		_error = "grid must be at least 1";
+	}
+	else if (_name == "block")
+	{
+		if (_value && _value <= 1024 && _value % 32 == 0)
+			return true;
+		_error = "block must be a multiple of 32, up to 1024";
+	}
+	else if (_name == "streams")
+	{
+		if (_value)
+			return true;
+		_error = "streams must be at least 1";
+	}
+	else if (_name == "parallel_hash")
+	{
+		if (_value == 1 || _value == 2 || _value == 4 || _value == 8)
+			return true;
+		_error = "parallel_hash must be 1, 2, 4 or 8";
+	}
+	else if (_name == "readback")
+	{
+		if (_value <= 1)
+			return true;
+		_error = "readback must be 0 or 1";
+	}
+	else
+		_error = "Unknown parameter " + _name;
+	return false;
+}
+
+void CUDAMiner::applyTuning()
+{
+	MinerTuning const t = takeTuning();
+	// The searches in flight complete on the geometry they were launched with.
+	for (unsigned i = 0; i != m_streamCount; ++i)
+		if (m_stream_busy[i])
+			collectResults(i);
+	unsigned const hashes = m_threadHashes;
+	bool const readback = m_readback;
+	for (auto const& p: t)
+		if (p.first == "grid")
+			m_gridSize = p.second;
+		else if (p.first == "block")
+			m_blockSize = p.second;
+		else if (p.first == "streams")
+		{
+			if (p.second > m_streamCount)
 			{
-				m_abort.store(false, std::memory_order_relaxed);
-				break;
+				cwarn << "GPU #" << m_device_num << " has " << m_streamCount << " streams allocated, not " << p.second;
 			}
+			m_numStreams = min(p.second, m_streamCount);
+		}
+		else if (p.first == "parallel_hash")
+			m_threadHashes = p.second;
+		else if (p.first == "readback")
+			m_readback = p.second != 0;
+	// The gids of a launch's searches are 32 bits.
+	m_gridSize = (unsigned)min<uint64_t>(m_gridSize, 0xffffffffu / m_blockSize);
+	// What the unread searches found is of no launch still known.
+	if (m_readback && !readback)
+		for (unsigned i = 0; i != m_streamCount; ++i)
+		{
+			m_search_buf[i]->count = 0;
+			m_search_buf[i]->probes = 0;
 		}
+
+	// Through the cubin cache, so going back to earlier parameters takes no compiling.
+	if (s_rtc && m_threadHashes != hashes)
+	{
+		compileSearch(m_dag, m_dag_size);
+		// Its job slots are the new module's, search() writes them again.
+		memset(&m_current_header, 0, sizeof(hash32_t));
+		m_current_target = 0;
+	}
+	for (search_graph* g: m_graphs)
+		destroy_search_graph(g);
+	m_graphs.clear();
+	createGraphs();
+	publishTuning();
+	cudalog << "GPU #" << m_device_num << " uses grid size " << m_gridSize << ", block size " << m_blockSize
+			<< ", " << m_numStreams << " streams and " << m_threadHashes << " parallel hashes";
+}
+
+void CUDAMiner::publishTuning()
+{
+	setTuning({{"grid", m_gridSize}, {"block", m_blockSize}, {"streams", m_numStreams}, {"parallel_hash", m_threadHashes},
+		{"readback", m_readback ? 1u : 0u}});
+}
+
+string CUDAMiner::profilePath(cudaDeviceProp const& _props) const
+{
+	string const dir = EthashAux::dagDirectory();
+	if (dir.empty())
+		return dir;
+	// By PCI address, so the same cards in other slots are tuned separately.
+	ostringstream path;
+	path << dir << "/cuda-tune-" << hex << setfill('0') << setw(4) << _props.pciDomainID << '-' << setw(2)
+		<< _props.pciBusID << '-' << setw(2) << _props.pciDeviceID << ".txt";
+	return path.str();
+}
+
+bool CUDAMiner::loadProfile(cudaDeviceProp const& _props)
+{
+	string const path = profilePath(_props);
+	if (path.empty())
+		return false;
+	std::ifstream f(path);
+	string name;
+	unsigned gridSize = 0;
+	unsigned blockSize = 0;
+	unsigned numStreams = 0;
+	unsigned hashes = 0;
+	// Another card in that slot is tuned again.
+	if (!getline(f, name) || name != _props.name || !(f >> gridSize >> blockSize >> numStreams >> hashes)
+		|| !gridSize || !blockSize || !numStreams || !hashes)
+		return false;
+	m_gridSize = gridSize;
+	m_blockSize = blockSize;
+	m_numStreams = numStreams;
+	m_threadHashes = hashes;
+	cudalog << "Loaded the launch profile " << path;
+	return true;
+}
+
+void CUDAMiner::saveProfile(cudaDeviceProp const& _props) const
+{
+	string const path = profilePath(_props);
+	if (path.empty())
+		return;
+	bool const written = writeFileAtomically(path, [&](std::ostream& _f)
+	{
+		_f << _props.name << '\n' << m_gridSize << ' ' << m_blockSize << ' ' << m_numStreams << ' ' << m_threadHashes << '\n';
+	});
+	if (!written)
+	{
+		cwarn << "Cannot write the launch profile " << path;
 	}
 }
 
+void CUDAMiner::autoTune(cudaDeviceProp const& _props)
+{
+	// A search that cannot find anything. No job was written yet, and these
+	// searches all complete before one is.
+	unsigned const slot = m_instance * JOB_SLOTS + m_job % JOB_SLOTS;
+	hash32_t header;
+	memset(&header, 0, sizeof(header));
+	set_job(slot, header, keccakJob(header), 0, m_jobStream, m_jobWritten);
+	for (unsigned i = 0; i != m_streamCount; ++i)
+		CUDA_SAFE_CALL(cudaStreamWaitEvent(m_streams[i], m_jobWritten, 0));
+
+	// Starting from full occupancy of every SM, for some waves of blocks.
+	unsigned const sms = max(_props.multiProcessorCount, 1);
+	unsigned const maxBlock = max(_props.maxThreadsPerBlock, _props.warpSize);
+	auto const grid = [&](unsigned _block, unsigned _waves) {
+		unsigned const perSM = max(unsigned(_props.maxThreadsPerMultiProcessor) / _block, 1u);
+		return (unsigned)min<uint64_t>(uint64_t(sms) * perSM * _waves, 0xffffffffu / _block);
+	};
+	unsigned waves = 16;
+	m_blockSize = min(128u, maxBlock);
+	m_gridSize = grid(m_blockSize, waves);
+	cudalog << "Tuning GPU #" << m_device_num << " (" << _props.name << ", " << sms << " SMs, compute "
+			<< _props.major << "." << _props.minor << ")";
+
+	double best = measureSearches(m_gridSize, m_blockSize, m_numStreams, m_threadHashes);
+	auto const trial = [&](unsigned _grid, unsigned _block, unsigned _streams, unsigned _hashes) {
+		double const rate = measureSearches(_grid, _block, _streams, _hashes);
+		cudalog << "  grid " << _grid << " block " << _block << " streams " << _streams << " hashes " << _hashes
+				<< ": " << rate / 1e6 << " MH/s";
+		if (rate <= best)
+			return false;
+		best = rate;
+		m_gridSize = _grid;
+		m_blockSize = _block;
+		m_numStreams = _streams;
+		m_threadHashes = _hashes;
+		return true;
+	};
+	// One parameter at a time, most influential first.
+	for (unsigned hashes: {1u, 2u, 4u, 8u})
+		trial(m_gridSize, m_blockSize, m_numStreams, hashes);
+	for (unsigned block = _props.warpSize * 2; block <= min(512u, maxBlock); block *= 2)
+		trial(grid(block, waves), block, m_numStreams, m_threadHashes);
+	for (unsigned w: {4u, 8u, 16u, 32u, 64u})
+		if (trial(grid(m_blockSize, w), m_blockSize, m_numStreams, m_threadHashes))
+			waves = w;
+	for (unsigned streams = 1; streams <= m_streamCount; streams++)
+		trial(m_gridSize, m_blockSize, streams, m_threadHashes);
+	cudalog << "Tuned GPU #" << m_device_num << " to " << best / 1e6 << " MH/s";
+}
+
+double CUDAMiner::measureSearches(unsigned _gridSize, unsigned _blockSize, unsigned _numStreams, unsigned _hashes)
+{
+	unsigned const slot = m_instance * JOB_SLOTS + m_job % JOB_SLOTS;
+	uint64_t const batch = uint64_t(_gridSize) * _blockSize;
+	uint64_t nonce = 0;
+	uint64_t hashes = 0;
+	auto const launch = [&](unsigned _stream) {
+		run_ethash_search(_gridSize, _blockSize, m_streams[_stream], m_search_dev[_stream], nonce, _hashes, slot);
+		nonce += batch;
+	};
+	// The first round is not counted, it may include loading the kernel.
+	for (unsigned i = 0; i != _numStreams; ++i)
+		launch(i);
+	for (unsigned i = 0; i != _numStreams; ++i)
+		CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[i]));
+	auto const start = chrono::steady_clock::now();
+	auto const end = start + chrono::milliseconds(c_tuneTrialMs);
+	for (unsigned i = 0; i != _numStreams; ++i)
+		launch(i);
+	for (unsigned i = 0; chrono::steady_clock::now() < end; i = (i + 1) % _numStreams)
+	{
+		CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[i]));
+		hashes += batch;
+		launch(i);
+	}
+	for (unsigned i = 0; i != _numStreams; ++i)
+	{
+		CUDA_SAFE_CALL(cudaStreamSynchronize(m_streams[i]));
+		hashes += batch;
+		m_search_buf[i]->count = 0;
+		m_search_buf[i]->probes = 0;
+	}
+	double const seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return hashes / seconds;
+}
@@ -20,13 +20,19 @@ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <time.h>
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <memory>
 #include <libethash/ethash.h>
+#include <libdevcore/Affinity.h>
 #include <libdevcore/Worker.h>
 #include <libethcore/EthashAux.h>
 #include <libethcore/Miner.h>
 #include <libethcore/Miner.h>
+#include <libhwmon/HwMonSampler.h>
 #include <libhwmon/wrapnvml.h>
+#include <cuda.h>
 #include "ethash_cuda_miner_kernel.h"
 #include "libethash/internal.h"
 
@@ -44,11 +50,49 @@ public:
 
 	static unsigned instances()
 	{
-		return s_numInstances > 0 ? s_numInstances : 1;
+		return (s_numInstances > 0 ? s_numInstances : 1) * s_instancesPerDevice;
+	}
+	/// Runs _instances miners on each device, with their own streams and
+	/// nonces but one DAG, so one's host gaps are filled by the others'
+	/// searches. Miner index n is instance n % _instances of device
+	/// n / _instances.
+	static void setInstancesPerDevice(unsigned _instances)
+	{
+		s_instancesPerDevice = std::max(1u, std::min<unsigned>(_instances, MAX_DEVICE_INSTANCES));
 	}
 	static unsigned getNumDevices();
 	static void listDevices();
 	static void setParallelHash(unsigned _parallelHash);
+	/// Each stream launches _count searches at once as a CUDA graph. 0 or 1
+	/// launches them one by one.
+	static void setGraphSearches(unsigned _count) { s_graphSearches = _count; }
+	/// The DAG and light allocations have room for _epochs more epochs, so
+	/// an epoch change does not reallocate them or reset the device.
+	static void setDagHeadroom(unsigned _epochs) { s_dagHeadroom = _epochs; }
+	/// Compile the search kernel with NVRTC for each epoch, the DAG size a
+	/// literal in it. Only in builds with NVRTC (ETH_NVRTC).
+	static void setRuntimeCompile(bool _rtc);
+	/// Rather than each miner thread synchronizing its streams, one thread
+	/// polls the searches' events for all devices and wakes the miners.
+	static void setEventCollection(bool _events) { s_eventCollect = _events; }
+	/// Each device measures its own grid and block size, stream count and
+	/// parallel hashes after its first DAG load, and keeps them in a profile
+	/// next to the DAG files that later runs load instead.
+	static void setAutoTune(bool _tune) { s_autoTune = _tune; }
+	/// Each device allocates at least _streams streams, for tune() to take
+	/// the number in use up to later.
+	static void setStreamCapacity(unsigned _streams) { s_streamCapacity = _streams; }
+	/// Devices with less memory than the DAG keep what fits in VRAM and
+	/// read the rest from mapped host memory, at a fraction of the hashrate.
+	static void setHostDag(bool _hostDag) { s_hostDag = _hostDag; }
+	/// Keep the light cache persisting in L2 while the DAG is generated, on
+	/// devices that have a persisting L2 set-aside (Ampere and newer).
+	static void setL2Persist(bool _persist) { s_l2Persist = _persist; }
+	/// Keeps the DAG of the last other epoch on the device when the work
+	/// moves to a new one, if it has the memory for both, so that switching
+	/// back (pools on different coins) takes no regeneration. Not with a
+	/// host DAG or the DAG copied from another device.
+	static void setDualDag(bool _dual) { s_dualDag = _dual; }
 	static bool configureGPU(
 		unsigned _blockSize,
 		unsigned _gridSize,
@@ -61,6 +105,8 @@ public:
 	static void setNumInstances(unsigned _instances);
 	static void setDevices(const unsigned* _devices, unsigned _selectedDeviceCount);
 	HwMonitor hwmon() override;
+	/// The device, and how much of its DAG is in host memory if any.
+	string Name() override;
 	static bool cuda_configureGPU(
 		size_t numDevices,
 		const int* _devices,
@@ -80,15 +126,15 @@ public:
 		uint64_t _lightSize,
 		unsigned _deviceId,
 		bool _cpyToHost,
-		uint8_t * &hostDAG,
 		unsigned dagCreateDevice);
 
+	/// One search, on the next stream once its previous one is collected.
+	/// Sets @a _wait when there is to be none yet.
 	void search(
 		uint8_t const* header,
 		uint64_t target,
-		bool _ethStratum,
-		uint64_t _startN,
-		const dev::eth::WorkPackage& w);
+		const dev::eth::WorkPackage& w,
+		std::chrono::milliseconds& _wait);
 		dev::eth::HwMonitor cuda_hwmon();
 
 	/* -- default values -- */
@@ -101,28 +147,169 @@ public:
 
 protected:
 	void kick_miner() override;
+	/// grid, block and streams as --cuda-grid-size, --cuda-block-size and
+	/// --cuda-streams, and parallel_hash. Streams go up to those allocated:
+	/// --cuda-streams, and 4 with --cuda-tune.
+	bool checkTuning(std::string const& _name, unsigned _value, std::string& _error) const override;
 
 private:
-	atomic<bool> m_abort = {false};
-
 	void workLoop() override;
+	bool workStep(std::chrono::milliseconds& _wait) override;
+	bool steppable() const override { return true; }
+	/// workStep() but for its errors.
+	bool stepSearch(std::chrono::milliseconds& _wait);
+	/// The work the searches are set up for.
+	WorkPackage m_current;
 
 	bool init(const h256& seed);
+	/// Waits for the search in flight on _stream and submits what it found.
+	void collectResults(unsigned _stream);
+	/// Passes the number of busy streams, as from @a _at, to searchesInFlight().
+	void noteInFlight(WorkSlot::Clock::time_point _at, bool _launched);
+	/// Compiles and loads the search for the DAG at _dag, or leaves the
+	/// built-in one in use if that fails.
+	void compileSearch(hash128_t* _dag, uint32_t _dagSize128);
+	/// Generates the DAG of _size bytes on all the streams, see dagProgress().
+	void generateDag(uint64_t _size);
+	/// Sets or clears the persisting access policy window over the light on
+	/// all the streams, see setL2Persist(). Returns whether it was set.
+	bool persistLight(bool _persist);
+	/// Publishes the DAG of _epoch this device generated for the other
+	/// devices, see DagShare.
+	void shareDag(unsigned _epoch, hash128_t const* _dag, uint64_t _size);
+	/// Copies the published DAG of _size bytes, peer-to-peer if possible.
+	void copySharedDag(unsigned _epoch, hash128_t* _dag, uint64_t _size);
+	void releaseSharedDag();
+	/// For the instances after the first on a device: waits for the first
+	/// to publish the DAG of _dagSize bytes and uses it, see DeviceDag.
+	hash128_t* useDeviceDag(uint64_t _dagSize);
+	/// The profile of this device's launch geometry, see setAutoTune().
+	std::string profilePath(cudaDeviceProp const& _props) const;
+	bool loadProfile(cudaDeviceProp const& _props);
+	void saveProfile(cudaDeviceProp const& _props) const;
+	/// Picks m_gridSize, m_blockSize, m_numStreams and m_threadHashes by
+	/// measuring searches on the loaded DAG, one parameter at a time.
+	void autoTune(cudaDeviceProp const& _props);
+	/// Hashes per second of searches with the given geometry.
+	double measureSearches(unsigned _gridSize, unsigned _blockSize, unsigned _numStreams, unsigned _hashes);
+	/// Sets m_launchSearches and captures the graphs for the geometry.
+	void createGraphs();
+	/// Takes the geometry queued by tune(), once the searches in flight are in.
+	void applyTuning();
+	void publishTuning();
 
 	hash32_t m_current_header;
 	uint64_t m_current_target;
-	uint64_t m_current_nonce;
-	uint64_t m_starting_nonce;
 	uint64_t m_current_index;
+	/// Start nonce of each stream's launch in flight, if m_stream_busy.
+	std::vector<uint64_t> m_stream_nonce;
+	/// The job of each stream's launch in flight, see m_job.
+	std::vector<uint64_t> m_stream_job;
+	std::vector<bool> m_stream_busy;
+
+	/// Counts the jobs written; job n is in slot n % JOB_SLOTS.
+	uint64_t m_job = 0;
+	WorkPackage m_jobWork[JOB_SLOTS];
+	/// Writes the job slots, m_jobWritten is recorded after the latest.
+	cudaStream_t m_jobStream;
+	cudaEvent_t m_jobWritten;
+	/// The run time compiled search, see s_rtc, and its job slots.
+	CUmodule m_module = nullptr;
+	CUfunction m_rtcSearch = nullptr;
+	CUdeviceptr m_rtcHeader = 0;
+	CUdeviceptr m_rtcKeccak = 0;
+	CUdeviceptr m_rtcTarget = 0;
+	/// DAG items being read back for DagVerifier, on m_jobStream.
+	struct DagReadBack
+	{
+		h256 seed;
+		std::vector<uint32_t> items;
+		uint8_t* host = nullptr;	///< Pinned, room for DagVerifier::c_items.
+		cudaEvent_t read;
+		bool pending = false;
+	};
+	DagReadBack m_dagReadBack;
+	/// Between searches: regenerates the chunks of the corrupt DAG items found,
+	/// hands the items read back to DagVerifier and reads back more when due.
+	/// Only the VRAM of the instance owning the DAG is checked.
+	void stepDagCheck();
+
+	/// Completion of the DAG generation chunks in flight, see generateDag().
+	std::vector<cudaEvent_t> m_dagChunks;
+	static unsigned const c_dagChunksPerStream;
 
 	///Constants on GPU
 	hash128_t* m_dag = nullptr;
 	std::vector<hash64_t*> m_light;
 	uint32_t m_dag_size = -1;
+	/// Bytes allocated at m_dag and m_light, see s_dagHeadroom.
+	uint64_t m_dagCapacity = 0;
+	uint64_t m_lightCapacity = 0;
+	/// Bytes of the light in use at m_light.
+	uint64_t m_lightSize = 0;
+	/// With s_hostDag, the DAG items from m_dagSplit on are in m_dagTail,
+	/// mapped host memory of m_dagTailCapacity bytes, at m_dagTailDev for
+	/// the kernels. m_dagSplit is m_dag_size if the DAG is all in VRAM.
+	uint8_t* m_dagTail = nullptr;
+	hash128_t* m_dagTailDev = nullptr;
+	uint64_t m_dagTailCapacity = 0;
+	HostMemory::Reservation m_dagTailMemory;
+	uint32_t m_dagSplit = 0;
+	/// Of m_dag once generated, ~0u before.
+	unsigned m_dagEpoch = ~0u;
+	/// The DAG of another epoch kept with setDualDag(), the least recently
+	/// used of the two.
+	struct ResidentDag
+	{
+		unsigned epoch = ~0u;
+		hash128_t* dag = nullptr;
+		uint64_t capacity = 0;
+		hash64_t* light = nullptr;
+		uint64_t lightCapacity = 0;
+	};
+	ResidentDag m_resident;
+	/// Swaps in the resident DAG if it is of @a _epoch; else keeps the one in
+	/// use resident in its place, and clears m_dag for a new allocation, if
+	/// the device has the memory for @a _dagSize and @a _lightSize besides.
+	/// @return Whether m_dag is now that of @a _epoch.
+	bool swapResidentDag(unsigned _epoch, uint64_t _dagSize, uint64_t _lightSize);
 	uint32_t m_device_num;
+	/// Of the instances on m_device_num, see setInstancesPerDevice(). The
+	/// first one owns the context and the DAG.
+	unsigned m_instance = 0;
+	/// This instance is counted in its DeviceDag's users.
+	bool m_dagUser = false;
+	mutable Mutex x_deviceName;
+	string m_deviceName;
 
-	volatile search_results** m_search_buf;
-	cudaStream_t  * m_streams;
+	volatile search_results** m_search_buf = nullptr;
+	/// The device addresses of the mapped m_search_buf.
+	std::vector<volatile search_results*> m_search_dev;
+	/// Recorded after each stream's search, with s_eventCollect, and set
+	/// once it completed.
+	std::vector<cudaEvent_t> m_stream_event;
+	std::unique_ptr<std::atomic<bool>[]> m_stream_done;
+	cudaStream_t  * m_streams = nullptr;
+	/// One per stream with s_graphSearches, else empty.
+	std::vector<search_graph*> m_graphs;
+	/// Searches in one launch of a stream.
+	unsigned m_launchSearches = 1;
+
+	/// This device's launch geometry: the s_ values, or its profile with
+	/// s_autoTune.
+	unsigned m_gridSize = 0;
+	unsigned m_blockSize = 0;
+	unsigned m_numStreams = 0;
+	unsigned m_threadHashes = 0;
+	/// Streams allocated, more than m_numStreams while they are tuned.
+	unsigned m_streamCount = 0;
+	/// No profile was found, autoTune() runs after the first DAG load.
+	bool m_tune = false;
+	/// The geometry is final and the graphs are captured.
+	bool m_configured = false;
+	/// Searches have their results read back; without, as for measuring the
+	/// host loop, they only count their hashes. See the "readback" tuning.
+	bool m_readback = true;
 
 	/// The local work size for the search
 	static unsigned s_blockSize;
@@ -132,10 +319,79 @@ private:
 	static unsigned s_numStreams;
 	/// CUDA schedule flag
 	static unsigned s_scheduleFlag;
+	static unsigned s_graphSearches;
+	static unsigned s_dagHeadroom;
+	static unsigned s_streamCapacity;
+	static bool s_rtc;
+	static bool s_eventCollect;
+	static bool s_autoTune;
+	static bool s_hostDag;
+	static bool s_dualDag;
+	static bool s_l2Persist;
+	/// VRAM left free next to a partial DAG.
+	static uint64_t const c_vramReserve;
+	/// The most streams autoTune() tries.
+	static unsigned const c_tuneMaxStreams;
+	/// How long autoTune() measures each candidate.
+	static unsigned const c_tuneTrialMs;
+
+	/// The DAG dagCreateDevice generated in DAG_LOAD_MODE_SINGLE. Devices with
+	/// peer access to it copy it directly, the others through host memory
+	/// that is filled in chunks while they upload.
+	struct DagShare
+	{
+		/// Of the DAG being shared, identifying its epoch.
+		uint64_t size = 0;
+		int device = -1;
+		hash128_t const* dag = nullptr;
+		/// Bytes at dag, the rest is only in host.
+		uint64_t vram = 0;
+		/// Pinned staging, null if every device has peer access.
+		uint8_t* host = nullptr;
+		/// Bytes at host: size, or within the host memory budget fewer, a
+		/// ring the chunks go round once every upload is past them.
+		uint64_t ring = 0;
+		/// Bytes of host already downloaded.
+		uint64_t staged = 0;
+		/// Devices still copying; the DAG must stay until there are none.
+		unsigned pending = 0;
+		/// Bytes each device uploading through a ring, by miner index, has
+		/// uploaded so far.
+		std::map<unsigned, uint64_t> uploaded;
+	};
+	static Mutex x_dagShare;
+	static std::condition_variable s_dagShareChanged;
+	static DagShare s_dagShare;
+	static HostMemory::Reservation s_dagShareMemory;
+	static uint64_t const c_dagChunk;
+
+	/// What the first instance on a device shares with the others. It
+	/// withdraws the DAG (size 0) and waits for no users before replacing
+	/// it, the others wait for the size of their epoch.
+	struct DeviceDag
+	{
+		uint64_t size = 0;
+		hash128_t* dag = nullptr;
+		uint32_t split = 0;
+		hash128_t* tail = nullptr;
+		hash64_t* light = nullptr;
+		uint64_t lightSize = 0;
+		unsigned users = 0;
+	};
+	static Mutex x_deviceDags;
+	static std::condition_variable s_deviceDagChanged;
+	static std::map<unsigned, DeviceDag> s_deviceDags;
+	static unsigned s_instancesPerDevice;
 
 	static unsigned m_parallelHash;
 
+	/// The driver queries of hwmon(), made on the sampler thread.
+	HwReading readHw();
+
 	wrap_nvml_handle *nvmlh = nullptr;
+	/// Of the HwMonSampler, c_slots until registered.
+	unsigned m_hwSlot = HwMonSampler::c_slots;
+	CpuClaim m_cpu;
 
 	static unsigned s_numInstances;
 	static int s_devices[16];
@@ -1,8 +1,10 @@
 #ifndef CUDA_HELPER_H
 #define CUDA_HELPER_H
 
+#ifndef __CUDACC_RTC__
 #include <cuda.h>
 #include <cuda_runtime.h>
+#endif
 
 #ifdef __INTELLISENSE__
 /* reduce vstudio warnings (__byteperm, blockIdx...) */
@@ -28,6 +30,7 @@ void __syncthreads(void);
 void __threadfence(void);
 #endif
 
+#ifndef __CUDACC_RTC__
 #include <stdint.h>
 
 #ifndef MAX_GPUS
@@ -53,6 +56,7 @@ extern const uint3 threadIdx;
 #endif
 
 extern cudaError_t MyStreamSynchronize(cudaStream_t stream, int situation, int thr_id);
+#endif
 
 
 #ifndef SPH_C32
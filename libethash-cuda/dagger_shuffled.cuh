@@ -2,10 +2,35 @@
 #include "ethash_cuda_miner_kernel.h"
 #include "cuda_helper.h"
 
+// x % m.divisor for any 32 bit x, a multiply-high in place of the division
+// (which the GPUs do not have). The quotient is the rounded up reciprocal
+// method's, exact as make_fast_mod() chose the multiplier and shift.
+__device__ __forceinline__ uint32_t fast_mod(uint32_t x, fast_mod_t const& m)
+{
+	uint32_t const t = __umulhi(x, m.multiplier);
+	uint32_t const q = (t + ((x - t) >> 1)) >> m.shift;
+	return x - q * m.divisor;
+}
+
+// A literal in the run time compiled kernel (see ethash_search_rtc.cuh),
+// which the compiler reduces by itself.
+#ifdef DAG_SIZE
+#define DAG_MOD(x) ((x) % DAG_SIZE)
+#else
+#define DAG_MOD(x) fast_mod(x, d_dag_mod)
+#endif
+
+// A select between two pointers, so that the whole DAG being in VRAM costs
+// next to nothing.
+__device__ __forceinline__ hash128_t const& dag_item(uint32_t i)
+{
+	return (i < d_dag_split ? d_dag : d_dag_tail)[i];
+}
+
 template <uint32_t _PARALLEL_HASH>
-__device__ __forceinline__ bool compute_hash(
+__device__ __forceinline__ uint64_t compute_hash(
 	uint64_t nonce,
-	uint64_t target,
+	uint32_t job,
 	uint2 *mix_hash
 	)
 {
@@ -14,7 +39,7 @@ __device__ __forceinline__ bool compute_hash(
 	
 	state[4] = vectorize(nonce);
 
-	keccak_f1600_init(state);
+	keccak_f1600_init(state, job);
 	
 	// Threads work together in this phase in groups of 8.
 	const int thread_id  = threadIdx.x &  (THREADS_PER_HASH - 1);
@@ -53,7 +78,7 @@ __device__ __forceinline__ bool compute_hash(
 			{
 				for (int p = 0; p < _PARALLEL_HASH; p++)
 				{
-					offset[p] = fnv(init0[p] ^ (a + b), ((uint32_t *)&mix[p])[b]) % d_dag_size;
+					offset[p] = DAG_MOD(fnv(init0[p] ^ (a + b), ((uint32_t *)&mix[p])[b]));
 					offset[p] = __shfl_sync(0xFFFFFFFF,offset[p], t, THREADS_PER_HASH);
 				}
 				#pragma unroll
@@ -61,7 +86,7 @@ __device__ __forceinline__ bool compute_hash(
 				{
                                         //if(blockIdx.x == 0 && threadIdx.x==0 && offset[p] > (d_dag_size>>1)) //larger than half
                                         //    printf("d_dag_size = %d offset[p] = %d\n", d_dag_size, offset[p]);
-					mix[p] = fnv4(mix[p], d_dag[offset[p]].uint4s[thread_id]);
+					mix[p] = fnv4(mix[p], dag_item(offset[p]).uint4s[thread_id]);
 				}
 
                                 
@@ -94,14 +119,14 @@ __device__ __forceinline__ bool compute_hash(
 	}
 
 	// keccak_256(keccak_512(header..nonce) .. mix);
-	if (cuda_swab64(keccak_f1600_final(state)) > target)
-		return true;
+	uint64_t const hash = cuda_swab64(keccak_f1600_final(state));
 
 	mix_hash[0] = state[8];
 	mix_hash[1] = state[9];
 	mix_hash[2] = state[10];
 	mix_hash[3] = state[11];
 
-	return false;
+	// The upper 64 bits, which the target and d_probe_target are of.
+	return hash;
 }
 
@@ -8,36 +8,28 @@
 #include "ethash_cuda_miner_kernel_globals.h"
 #include "cuda_helper.h"
 
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 #include "fnv.cuh"
 
 #define copy(dst, src, count) for (int i = 0; i != count; ++i) { (dst)[i] = (src)[i]; }
 
 #include "keccak.cuh"
 #include "dagger_shuffled.cuh"
+#include "ethash_search.cuh"
 
 template <uint32_t _PARALLEL_HASH>
 __global__ void 
 ethash_search(
 	volatile search_results* g_output,
-	uint64_t start_nonce
+	uint64_t start_nonce,
+	uint32_t gid_base,
+	uint32_t job
 	)
 {
-	uint32_t const gid = blockIdx.x * blockDim.x + threadIdx.x;
-	uint2 mix[4];
-        if (compute_hash<_PARALLEL_HASH>(start_nonce + gid, d_target, mix))
-		return;
-	uint32_t index = atomicInc((uint32_t *)&g_output->count, 0xffffffff);
-	if (index >= SEARCH_RESULTS)
-		return;
-	g_output->result[index].gid = gid;
-	g_output->result[index].mix[0] = mix[0].x;
-	g_output->result[index].mix[1] = mix[0].y;
-	g_output->result[index].mix[2] = mix[1].x;
-	g_output->result[index].mix[3] = mix[1].y;
-	g_output->result[index].mix[4] = mix[2].x;
-	g_output->result[index].mix[5] = mix[2].y;
-	g_output->result[index].mix[6] = mix[3].x;
-	g_output->result[index].mix[7] = mix[3].y;
+	search<_PARALLEL_HASH>(g_output, start_nonce, gid_base, job);
 }
 
 void run_ethash_search(
@@ -46,20 +38,114 @@ void run_ethash_search(
 	cudaStream_t stream,
 	volatile search_results* g_output,
 	uint64_t start_nonce,
-	uint32_t parallelHash
+	uint32_t parallelHash,
+	uint32_t job
 )
 {
 	switch (parallelHash)
 	{
-		case 1: ethash_search <1> <<<blocks, threads, 0, stream >>>(g_output, start_nonce); break;
-		case 2: ethash_search <2> <<<blocks, threads, 0, stream >>>(g_output, start_nonce); break;
-		case 4: ethash_search <4> <<<blocks, threads, 0, stream >>>(g_output, start_nonce); break;
-		case 8: ethash_search <8> <<<blocks, threads, 0, stream >>>(g_output, start_nonce); break;
-		default: ethash_search <4> <<<blocks, threads, 0, stream >>>(g_output, start_nonce); break;
+		case 1: ethash_search <1> <<<blocks, threads, 0, stream >>>(g_output, start_nonce, 0, job); break;
+		case 2: ethash_search <2> <<<blocks, threads, 0, stream >>>(g_output, start_nonce, 0, job); break;
+		case 4: ethash_search <4> <<<blocks, threads, 0, stream >>>(g_output, start_nonce, 0, job); break;
+		case 8: ethash_search <8> <<<blocks, threads, 0, stream >>>(g_output, start_nonce, 0, job); break;
+		default: ethash_search <4> <<<blocks, threads, 0, stream >>>(g_output, start_nonce, 0, job); break;
 	}
 	CUDA_SAFE_CALL(cudaGetLastError());
 }
 
+struct search_graph
+{
+	cudaGraph_t graph;
+	cudaGraphExec_t exec;
+	std::vector<cudaGraphNode_t> nodes;
+	uint64_t batch;
+	/// The arguments of the node being added or updated, see params.
+	volatile search_results* output;
+	uint64_t start_nonce;
+	uint32_t gid_base;
+	uint32_t job;
+	void* args[4];
+	cudaKernelNodeParams params;
+};
+
+search_graph* create_search_graph(
+	uint32_t blocks,
+	uint32_t threads,
+	volatile search_results* g_output,
+	uint32_t parallelHash,
+	uint32_t count
+)
+{
+	search_graph* g = new search_graph;
+	g->batch = uint64_t(blocks) * threads;
+	g->output = g_output;
+	g->start_nonce = 0;
+	g->gid_base = 0;
+	g->job = 0;
+	g->args[0] = &g->output;
+	g->args[1] = &g->start_nonce;
+	g->args[2] = &g->gid_base;
+	g->args[3] = &g->job;
+	switch (parallelHash)
+	{
+		case 1: g->params.func = (void*)ethash_search<1>; break;
+		case 2: g->params.func = (void*)ethash_search<2>; break;
+		case 8: g->params.func = (void*)ethash_search<8>; break;
+		default: g->params.func = (void*)ethash_search<4>; break;
+	}
+	g->params.gridDim = dim3(blocks);
+	g->params.blockDim = dim3(threads);
+	g->params.sharedMemBytes = 0;
+	g->params.kernelParams = g->args;
+	g->params.extra = nullptr;
+
+	try
+	{
+		CUDA_SAFE_CALL(cudaGraphCreate(&g->graph, 0));
+		// A chain, so the searches run in order like separate launches would.
+		g->nodes.resize(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			g->start_nonce = g->gid_base = uint32_t(i * g->batch);
+			CUDA_SAFE_CALL(cudaGraphAddKernelNode(&g->nodes[i], g->graph, i ? &g->nodes[i - 1] : nullptr, i ? 1 : 0, &g->params));
+		}
+		CUDA_SAFE_CALL(cudaGraphInstantiate(&g->exec, g->graph, nullptr, nullptr, 0));
+	}
+	catch (std::runtime_error const&)
+	{
+		delete g;
+		throw;
+	}
+	return g;
+}
+
+void launch_search_graph(
+	search_graph* graph,
+	cudaStream_t stream,
+	uint64_t start_nonce,
+	uint32_t job
+)
+{
+	// Launches already queued keep the parameters they were queued with.
+	graph->job = job;
+	for (size_t i = 0; i < graph->nodes.size(); ++i)
+	{
+		graph->gid_base = uint32_t(i * graph->batch);
+		graph->start_nonce = start_nonce + graph->gid_base;
+		CUDA_SAFE_CALL(cudaGraphExecKernelNodeSetParams(graph->exec, graph->nodes[i], &graph->params));
+	}
+	CUDA_SAFE_CALL(cudaGraphLaunch(graph->exec, stream));
+}
+
+void destroy_search_graph(
+	search_graph* graph
+)
+{
+	cudaGraphExecDestroy(graph->exec);
+	cudaGraphDestroy(graph->graph);
+	delete graph;
+}
+
 #define ETHASH_DATASET_PARENTS 256
 #define NODE_WORDS (64/4)
 
@@ -71,14 +157,14 @@ ethash_calculate_dag_item(uint32_t start)
 	if (node_index > d_dag_size * 2) return;
 
 	hash200_t dag_node;
-	copy(dag_node.uint4s, d_light[node_index % d_light_size].uint4s, 4);
+	copy(dag_node.uint4s, d_light[fast_mod(node_index, d_light_mod)].uint4s, 4);
 	dag_node.words[0] ^= node_index;
 	SHA3_512(dag_node.uint2s);
 
 	const int thread_id = threadIdx.x & 3;
 
 	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
-		uint32_t parent_index = fnv(node_index ^ i, dag_node.words[i % NODE_WORDS]) % d_light_size;
+		uint32_t parent_index = fast_mod(fnv(node_index ^ i, dag_node.words[i % NODE_WORDS]), d_light_mod);
 		for (uint32_t t = 0; t < 4; t++) {
 
 			uint32_t shuffle_index = __shfl_sync(0xFFFFFFFF,parent_index, t, 4);
@@ -94,10 +180,9 @@ ethash_calculate_dag_item(uint32_t start)
 		}
 	}
 	SHA3_512(dag_node.uint2s);
-	hash64_t * dag_nodes = (hash64_t *)d_dag;
-
 	for (uint32_t t = 0; t < 4; t++) {
 		uint32_t shuffle_index = __shfl_sync(0xFFFFFFFF,node_index, t, 4);
+		hash64_t * dag_nodes = (hash64_t *)(shuffle_index / 2 < d_dag_split ? d_dag : d_dag_tail);
 		uint4 s[4];
 		for (uint32_t w = 0; w < 4; w++) {
 			s[w] = make_uint4(__shfl_sync(0xFFFFFFFF,dag_node.uint4s[w].x, t, 4), __shfl_sync(0xFFFFFFFF,dag_node.uint4s[w].y, t, 4), __shfl_sync(0xFFFFFFFF,dag_node.uint4s[w].z, t, 4), __shfl_sync(0xFFFFFFFF,dag_node.uint4s[w].w, t, 4));
@@ -127,17 +212,87 @@ void ethash_generate_dag(
 	CUDA_SAFE_CALL(cudaGetLastError());
 }
 
+void ethash_dag_geometry(
+	uint32_t* blocks,
+	uint32_t* threads
+	)
+{
+	int minGrid = 0;
+	int block = 0;
+	CUDA_SAFE_CALL(cudaOccupancyMaxPotentialBlockSize(&minGrid, &block, ethash_calculate_dag_item, 0, 0));
+	// A few waves per chunk, so the launches are not what paces the host.
+	*blocks = minGrid * 4;
+	*threads = block;
+}
+
+void ethash_generate_dag_chunk(
+	uint32_t start,
+	uint32_t blocks,
+	uint32_t threads,
+	cudaStream_t stream
+	)
+{
+	ethash_calculate_dag_item <<<blocks, threads, 0, stream >>>(start);
+	CUDA_SAFE_CALL(cudaGetLastError());
+}
+
+fast_mod_t make_fast_mod(
+	uint32_t _divisor
+	)
+{
+	if (_divisor < 2)
+		throw std::runtime_error("No reciprocal for a divisor below 2");
+	// l = ceil(log2(d)), multiplier = floor(2^32 * (2^l - d) / d) + 1, see
+	// fast_mod(). 2^l - d < 2^31, so the product fits 64 bits.
+	uint32_t l = 0;
+	while ((uint64_t(1) << l) < _divisor)
+		l++;
+	fast_mod_t m;
+	m.divisor = _divisor;
+	m.multiplier = uint32_t(((((uint64_t(1) << l) - _divisor) << 32) / _divisor) + 1);
+	m.shift = l - 1;
+
+	// The same arithmetic on the host, at the edges of the quotients and at
+	// spread out values, against the real modulo.
+	auto const mod = [&](uint32_t x) {
+		uint32_t const t = uint32_t((uint64_t(x) * m.multiplier) >> 32);
+		uint32_t const q = (t + ((x - t) >> 1)) >> m.shift;
+		return x - q * m.divisor;
+	};
+	uint32_t x = 0x9e3779b9;
+	for (uint32_t i = 0; i < (1 << 16); i++)
+	{
+		uint32_t const k = uint32_t(uint64_t(0xffffffffu / _divisor) * i >> 16);
+		uint64_t const edge = uint64_t(k) * _divisor;
+		x = x * 1664525 + 1013904223;
+		for (uint64_t v: {edge, edge + 1, edge + _divisor - 1, uint64_t(x), uint64_t(0xffffffffu - i)})
+			if (v <= 0xffffffffu && mod(uint32_t(v)) != uint32_t(v) % _divisor)
+				throw std::runtime_error("Inexact reciprocal of " + std::to_string(_divisor));
+	}
+	return m;
+}
+
 void set_constants(
 	hash128_t* _dag,
 	uint32_t _dag_size,
 	hash64_t * _light,
-	uint32_t _light_size
+	uint32_t _light_size,
+	hash128_t* _dag_tail,
+	uint32_t _dag_split
 	)
 {
+	// Offset by the items in VRAM, see dag_item().
+	hash128_t* const tail = (hash128_t*)((uintptr_t)_dag_tail - uintptr_t(_dag_split) * sizeof(hash128_t));
 	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_dag, &_dag, sizeof(hash128_t *)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_dag_split, &_dag_split, sizeof(uint32_t)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_dag_tail, &tail, sizeof(hash128_t *)));
 	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_dag_size, &_dag_size, sizeof(uint32_t)));
 	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_light, &_light, sizeof(hash64_t *)));
 	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_light_size, &_light_size, sizeof(uint32_t)));
+	fast_mod_t const dag_mod = make_fast_mod(_dag_size);
+	fast_mod_t const light_mod = make_fast_mod(_light_size);
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_dag_mod, &dag_mod, sizeof(fast_mod_t)));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_light_mod, &light_mod, sizeof(fast_mod_t)));
 }
 
 void set_header(
@@ -153,3 +308,27 @@ void set_target(
 {
 	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_target, &_target, sizeof(uint64_t)));
 }
+
+void set_probe_target(
+	uint64_t _target
+	)
+{
+	CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_probe_target, &_target, sizeof(uint64_t)));
+}
+
+void set_job(
+	uint32_t _slot,
+	hash32_t _header,
+	keccak_job_t const& _keccak,
+	uint64_t _target,
+	cudaStream_t _stream,
+	cudaEvent_t _written
+	)
+{
+	// From pageable memory the copies return once the arguments are staged,
+	// so they may go out of scope.
+	CUDA_SAFE_CALL(cudaMemcpyToSymbolAsync(d_header, &_header, sizeof(hash32_t), _slot * sizeof(hash32_t), cudaMemcpyHostToDevice, _stream));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbolAsync(d_keccak, &_keccak, sizeof(keccak_job_t), _slot * sizeof(keccak_job_t), cudaMemcpyHostToDevice, _stream));
+	CUDA_SAFE_CALL(cudaMemcpyToSymbolAsync(d_target, &_target, sizeof(uint64_t), _slot * sizeof(uint64_t), cudaMemcpyHostToDevice, _stream));
+	CUDA_SAFE_CALL(cudaEventRecord(_written, _stream));
+}
@@ -1,9 +1,11 @@
 #ifndef _ETHASH_CUDA_MINER_KERNEL_H_
 #define _ETHASH_CUDA_MINER_KERNEL_H_
 
+#ifndef __CUDACC_RTC__
 #include <stdio.h>
 #include <stdint.h>
 #include <cuda_runtime.h>
+#endif
 
 // It is virtually impossible to get more than
 // one solution per stream hash calculation
@@ -11,6 +13,14 @@
 // of 2 here will yield better CUDA optimization
 #define SEARCH_RESULTS 4
 
+// Header and target slots on the device, so that the next job can be
+// written while searches of the previous one still run.
+#define JOB_SLOTS 2
+
+// Searches sharing a device, see CUDAMiner::setInstancesPerDevice(). Each
+// has JOB_SLOTS of its own, from instance * JOB_SLOTS.
+#define MAX_DEVICE_INSTANCES 4
+
 typedef struct {
 	uint32_t count;
 	struct {
@@ -19,6 +29,9 @@ typedef struct {
 		uint32_t mix[8];
 		uint32_t pad[7]; // pad to size power of 2
 	} result[SEARCH_RESULTS];
+	// Pseudo-shares found, the gid of the first one, see d_probe_target.
+	uint32_t probes;
+	uint32_t probe_gid;
 } search_results;
 
 #define ACCESSES 64
@@ -29,6 +42,14 @@ typedef struct
 	uint4 uint4s[32 / sizeof(uint4)];
 } hash32_t;
 
+/// A job's first Keccak round of sha3_512(header .. nonce) but for the
+/// nonce, as ethash_keccak_job() computes it; see keccak_f1600_init().
+typedef struct
+{
+	uint64_t lane[25];
+	uint64_t chi[5];
+} keccak_job_t;
+
 typedef struct
 {
 	uint4	 uint4s[128 / sizeof(uint4)];
@@ -40,19 +61,41 @@ typedef union {
 	uint4	 uint4s[64 / sizeof(uint4)];
 } hash64_t;
 
+/// A divisor with its reciprocal, see fast_mod() and make_fast_mod().
+typedef struct
+{
+	uint32_t divisor;
+	uint32_t multiplier;
+	uint32_t shift;
+} fast_mod_t;
+
 typedef union {
 	uint32_t words[200 / sizeof(uint32_t)];
 	uint2	 uint2s[200 / sizeof(uint2)];
 	uint4	 uint4s[200 / sizeof(uint4)];
 } hash200_t;
 
+// The rest is the host side, which the run time compiled kernel leaves out.
+#ifndef __CUDACC_RTC__
+
+/// The reciprocal of _divisor for fast_mod(), checked against % on the host.
+fast_mod_t make_fast_mod(
+	uint32_t _divisor
+	);
+
+/// Items from _dag_split on are read from and generated into _dag_tail, the
+/// device address of mapped host memory. _dag_split is _dag_size if the DAG
+/// is all in VRAM.
 void set_constants(
 	hash128_t* _dag,
 	uint32_t _dag_size,
 	hash64_t * _light,
-	uint32_t _light_size
+	uint32_t _light_size,
+	hash128_t* _dag_tail,
+	uint32_t _dag_split
 	);
 
+/// Write slot 0 synchronously.
 void set_header(
 	hash32_t _header
 	);
@@ -61,13 +104,56 @@ void set_target(
 	uint64_t _target
 	);
 
+/// Hashes at most _target count as pseudo-shares, 0 for none.
+void set_probe_target(
+	uint64_t _target
+	);
+
+/// Queue writing job slot _slot on _stream and record _written after it.
+/// Searches of that slot must wait for _written, and no search still
+/// running may use it.
+void set_job(
+	uint32_t _slot,
+	hash32_t _header,
+	keccak_job_t const& _keccak,
+	uint64_t _target,
+	cudaStream_t _stream,
+	cudaEvent_t _written
+	);
+
 void run_ethash_search(
 	uint32_t search_batch_size,
 	uint32_t workgroup_size,
 	cudaStream_t stream,
 	volatile search_results* g_output,
 	uint64_t start_nonce,
-	uint32_t parallelHash
+	uint32_t parallelHash,
+	uint32_t job
+	);
+
+/// count searches of blocks * threads nonces each, the ones after the first
+/// continuing where the previous ended, as one CUDA graph launch. The gids
+/// they report are relative to the first one's start nonce, so count such
+/// searches must fit 32 bits.
+typedef struct search_graph search_graph;
+
+search_graph* create_search_graph(
+	uint32_t blocks,
+	uint32_t threads,
+	volatile search_results* g_output,
+	uint32_t parallelHash,
+	uint32_t count
+	);
+
+void launch_search_graph(
+	search_graph* graph,
+	cudaStream_t stream,
+	uint64_t start_nonce,
+	uint32_t job
+	);
+
+void destroy_search_graph(
+	search_graph* graph
 	);
 
 void ethash_generate_dag(
@@ -78,6 +164,21 @@ void ethash_generate_dag(
 	int device
 	);
 
+/// The launch geometry for ethash_generate_dag_chunk(): full occupancy,
+/// independently of the search's.
+void ethash_dag_geometry(
+	uint32_t* blocks,
+	uint32_t* threads
+	);
+
+/// Queues the blocks * threads DAG items from start on stream.
+void ethash_generate_dag_chunk(
+	uint32_t start,
+	uint32_t blocks,
+	uint32_t threads,
+	cudaStream_t stream
+	);
+
 
 #define CUDA_SAFE_CALL(call)						\
 do {									\
@@ -92,3 +193,5 @@ do {									\
 } while (0)
 
 #endif
+
+#endif
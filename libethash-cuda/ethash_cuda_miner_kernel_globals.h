@@ -3,9 +3,21 @@
 
 __constant__ uint32_t d_dag_size;
 __constant__ hash128_t* d_dag;
+// Items from d_dag_split on are in mapped host memory, at d_dag_tail, which
+// is offset so that it takes the same indices as d_dag. See dag_item().
+__constant__ uint32_t d_dag_split;
+__constant__ hash128_t* d_dag_tail;
 __constant__ uint32_t d_light_size;
 __constant__ hash64_t* d_light;
-__constant__ hash32_t d_header;
-__constant__ uint64_t d_target;
+// d_dag_size and d_light_size for fast_mod().
+__constant__ fast_mod_t d_dag_mod;
+__constant__ fast_mod_t d_light_mod;
+// Job slots, see set_job(); a search reads the one it was launched with.
+__constant__ hash32_t d_header[JOB_SLOTS * MAX_DEVICE_INSTANCES];
+__constant__ uint64_t d_target[JOB_SLOTS * MAX_DEVICE_INSTANCES];
+__constant__ keccak_job_t d_keccak[JOB_SLOTS * MAX_DEVICE_INSTANCES];
+// Hashes at most this are pseudo-shares, see CUDAMiner::setProbeDifficulty();
+// 0 for none.
+__constant__ uint64_t d_probe_target;
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef _ETHASH_SEARCH_CUH_
+#define _ETHASH_SEARCH_CUH_
+
+// The search, shared by the kernels built with the library and the one
+// compiled at run time (see ethash_search_rtc.cuh).
+template <uint32_t _PARALLEL_HASH>
+__device__ __forceinline__ void search(
+	volatile search_results* g_output,
+	uint64_t start_nonce,
+	uint32_t gid_base,
+	uint32_t job
+	)
+{
+	uint32_t const gid = blockIdx.x * blockDim.x + threadIdx.x;
+	uint2 mix[4];
+	uint64_t const hash = compute_hash<_PARALLEL_HASH>(start_nonce + gid, job, mix);
+	if (hash > d_target[job])
+	{
+		// Pseudo-shares are counted, the first one's gid kept for the CPU to check.
+		if (hash <= d_probe_target && atomicInc((uint32_t *)&g_output->probes, 0xffffffff) == 0)
+			g_output->probe_gid = gid_base + gid;
+		return;
+	}
+	uint32_t index = atomicInc((uint32_t *)&g_output->count, 0xffffffff);
+	if (index >= SEARCH_RESULTS)
+		return;
+	// Relative to the first of the searches sharing g_output, see search_graph.
+	g_output->result[index].gid = gid_base + gid;
+	g_output->result[index].mix[0] = mix[0].x;
+	g_output->result[index].mix[1] = mix[0].y;
+	g_output->result[index].mix[2] = mix[1].x;
+	g_output->result[index].mix[3] = mix[1].y;
+	g_output->result[index].mix[4] = mix[2].x;
+	g_output->result[index].mix[5] = mix[2].y;
+	g_output->result[index].mix[6] = mix[3].x;
+	g_output->result[index].mix[7] = mix[3].y;
+}
+
+#endif
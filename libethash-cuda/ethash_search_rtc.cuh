@@ -0,0 +1,29 @@
+// The search kernel compiled with NVRTC, see CUDAMiner::compileSearch().
+// DAG_SIZE and PARALLEL_HASH are defined on the command line; with the DAG
+// size a literal, the modulo in compute_hash() becomes a multiply and shift.
+// NVRTC has no standard headers, the ones included here leave them out.
+
+typedef unsigned char uint8_t;
+typedef unsigned int uint32_t;
+typedef int int32_t;
+typedef unsigned long long uint64_t;
+typedef long long int64_t;
+
+#include "ethash_cuda_miner_kernel.h"
+#include "ethash_cuda_miner_kernel_globals.h"
+#include "cuda_helper.h"
+#include "fnv.cuh"
+#include "keccak.cuh"
+#include "dagger_shuffled.cuh"
+#include "ethash_search.cuh"
+
+extern "C" __global__ void
+ethash_search_rtc(
+	volatile search_results* g_output,
+	uint64_t start_nonce,
+	uint32_t gid_base,
+	uint32_t job
+	)
+{
+	search<PARALLEL_HASH>(g_output, start_nonce, gid_base, job);
+}
@@ -25,102 +25,31 @@ uint2 chi(const uint2 a, const uint2 b, const uint2 c) {
 	return a ^ (~b) & c;
 }
 
-__device__ __forceinline__ void keccak_f1600_init(uint2* state)
+__device__ __forceinline__ void keccak_f1600_init(uint2* state, uint32_t job)
 {
 	uint2 s[25];
 	uint2 t[5], u, v;
-
-	s[4] = state[4];
-
-	devectorize2(d_header.uint4s[0], s[0], s[1]);
-	devectorize2(d_header.uint4s[1], s[2], s[3]);
-
-	for (uint32_t i = 5; i < 25; i++)
-	{
-		s[i] = make_uint2(0, 0);
-	}
-	s[5].x = 1;
-	s[8].y = 0x80000000;
-
-	/* theta: c = a[0,i] ^ a[1,i] ^ .. a[4,i] */
-	t[0].x = s[0].x ^ s[5].x;
-	t[0].y = s[0].y;
-	t[1] = s[1];
-	t[2] = s[2];
-	t[3].x = s[3].x;
-	t[3].y = s[3].y ^ s[8].y;
-	t[4] = s[4];
-
-	/* theta: d[i] = c[i+4] ^ rotl(c[i+1],1) */
-	/* theta: a[0,i], a[1,i], .. a[4,i] ^= d[i] */
-
-	u = ROL2(t[1], 1);
-	s[0] = xor3(s[0], t[4], u);
-	s[5] = xor3(s[5], t[4], u);
-	s[10] = xor3(s[10], t[4], u);
-	s[15] = xor3(s[15], t[4], u);
-	s[20] = xor3(s[20], t[4], u);
-
-	u = ROL2(t[2], 1);
-	s[1] = xor3(s[1], t[0], u);
-	s[6] = xor3(s[6], t[0], u);
-	s[11] = xor3(s[11], t[0], u);
-	s[16] = xor3(s[16], t[0], u);
-	s[21] = xor3(s[21], t[0], u);
-
-	u = ROL2(t[3], 1);
-	s[2] = xor3(s[2], t[1], u);
-	s[7] = xor3(s[7], t[1], u);
-	s[12] = xor3(s[12], t[1], u);
-	s[17] = xor3(s[17], t[1], u);
-	s[22] = xor3(s[22], t[1], u);
-
-	u = ROL2(t[4], 1);
-	s[3] = xor3(s[3], t[2], u);
-	s[8] = xor3(s[8], t[2], u);
-	s[13] = xor3(s[13], t[2], u);
-	s[18] = xor3(s[18], t[2], u);
-	s[23] = xor3(s[23], t[2], u);
-
-	u = ROL2(t[0], 1);
-	s[4] = xor3(s[4], t[3], u);
-	s[9] = xor3(s[9], t[3], u);
-	s[14] = xor3(s[14], t[3], u);
-	s[19] = xor3(s[19], t[3], u);
-	s[24] = xor3(s[24], t[3], u);
-
-	/* rho pi: b[..] = rotl(a[..], ..) */
-	u = s[1];
-
-	s[1] = ROL2(s[6], 44);
-	s[6] = ROL2(s[9], 20);
-	s[9] = ROL2(s[22], 61);
-	s[22] = ROL2(s[14], 39);
-	s[14] = ROL2(s[20], 18);
-	s[20] = ROL2(s[2], 62);
-	s[2] = ROL2(s[12], 43);
-	s[12] = ROL2(s[13], 25);
-	s[13] = ROL2(s[19], 8);
-	s[19] = ROL2(s[23], 56);
-	s[23] = ROL2(s[15], 41);
-	s[15] = ROL2(s[4], 27);
-	s[4] = ROL2(s[24], 14);
-	s[24] = ROL2(s[21], 2);
-	s[21] = ROL2(s[8], 55);
-	s[8] = ROL2(s[16], 45);
-	s[16] = ROL2(s[5], 36);
-	s[5] = ROL2(s[3], 28);
-	s[3] = ROL2(s[18], 21);
-	s[18] = ROL2(s[17], 15);
-	s[17] = ROL2(s[11], 10);
-	s[11] = ROL2(s[7], 6);
-	s[7] = ROL2(s[10], 3);
-	s[10] = ROL2(u, 1);
-
-	/* chi: a[i,j] ^= ~b[i,j+1] & b[i,j+2] */
+	uint2 const n = state[4];
+
+	/* theta rho pi: the job's lanes, see ethash_keccak_job(), and the nonce's rotations */
+	for (uint32_t i = 0; i < 25; i++)
+		s[i] = vectorize(d_keccak[job].lane[i]);
+	s[0] ^= n;
+	s[3] ^= ROL2(n, 22);
+	s[5] ^= ROL2(n, 29);
+	s[7] ^= ROL2(n, 3);
+	s[12] ^= ROL2(n, 26);
+	s[14] ^= ROL2(n, 18);
+	s[15] ^= ROL2(n, 27);
+	s[16] ^= ROL2(n, 36);
+	s[19] ^= ROL2(n, 57);
+	s[21] ^= ROL2(n, 56);
+	s[23] ^= ROL2(n, 41);
+
+	/* chi: a[i,j] ^= ~b[i,j+1] & b[i,j+2], the job's where neither has the nonce */
 
 	u = s[0]; v = s[1];
-	s[0] = chi(s[0], s[1], s[2]);
+	s[0] ^= vectorize(d_keccak[job].chi[0]);
 	s[1] = chi(s[1], s[2], s[3]);
 	s[2] = chi(s[2], s[3], s[4]);
 	s[3] = chi(s[3], s[4], u);
@@ -129,7 +58,7 @@ __device__ __forceinline__ void keccak_f1600_init(uint2* state)
 	u = s[5]; v = s[6];
 	s[5] = chi(s[5], s[6], s[7]);
 	s[6] = chi(s[6], s[7], s[8]);
-	s[7] = chi(s[7], s[8], s[9]);
+	s[7] ^= vectorize(d_keccak[job].chi[1]);
 	s[8] = chi(s[8], s[9], u);
 	s[9] = chi(s[9], u, v);
 
@@ -138,11 +67,11 @@ __device__ __forceinline__ void keccak_f1600_init(uint2* state)
 	s[11] = chi(s[11], s[12], s[13]);
 	s[12] = chi(s[12], s[13], s[14]);
 	s[13] = chi(s[13], s[14], u);
-	s[14] = chi(s[14], u, v);
+	s[14] ^= vectorize(d_keccak[job].chi[2]);
 
 	u = s[15]; v = s[16];
 	s[15] = chi(s[15], s[16], s[17]);
-	s[16] = chi(s[16], s[17], s[18]);
+	s[16] ^= vectorize(d_keccak[job].chi[3]);
 	s[17] = chi(s[17], s[18], s[19]);
 	s[18] = chi(s[18], s[19], u);
 	s[19] = chi(s[19], u, v);
@@ -151,7 +80,7 @@ __device__ __forceinline__ void keccak_f1600_init(uint2* state)
 	s[20] = chi(s[20], s[21], s[22]);
 	s[21] = chi(s[21], s[22], s[23]);
 	s[22] = chi(s[22], s[23], s[24]);
-	s[23] = chi(s[23], s[24], u);
+	s[23] ^= vectorize(d_keccak[job].chi[4]);
 	s[24] = chi(s[24], u, v);
 
 	/* iota: a[0,0] ^= round constant */
@@ -9,6 +9,8 @@
 #include <string>
 #include <fstream>
 #include <streambuf>
+#include <sstream>
+#include <sys/stat.h>
 
 using namespace dev;
 using namespace eth;
@@ -21,8 +23,14 @@ namespace eth
 unsigned OCLMiner::s_workgroupSize = OCLMiner::c_defaultLocalWorkSize;
 unsigned OCLMiner::s_initialGlobalWorkSize = OCLMiner::c_defaultGlobalWorkSizeMultiplier * OCLMiner::c_defaultLocalWorkSize;
 unsigned OCLMiner::s_threadsPerHash = 8;
+unsigned OCLMiner::s_pipelines = 0;
+bool OCLMiner::s_hostDag = false;
+string OCLMiner::s_bitstreams = "bitstreams.txt";
+Mutex OCLMiner::x_programmed;
+std::map<unsigned, OCLMiner::Programmed> OCLMiner::s_programmed;
 OCLKernelName OCLMiner::s_clKernelName = OCLMiner::c_defaultKernelName;
 
+// Fixed by the MAX_OUTPUTS the FPGA binary was built with.
 constexpr size_t c_maxSearchResults = 1;
 
 struct CLChannel: public LogChannel
@@ -203,11 +211,67 @@ static std::string ethCLErrorHelper(const char *msg, cl::Error const &clerr) {
 namespace
 {
 
-void addDefinition(string& _source, char const* _id, unsigned _value)
+/// An .aocx image and the DAG sizes it was built for.
+struct Bitstream
 {
-	char buf[256];
-	sprintf(buf, "#define %s %uu\n", _id, _value);
-	_source.insert(_source.begin(), buf, buf + strlen(buf));
+	string path;
+	string board;  ///< Empty for any board.
+	uint64_t minDag = 0;
+	uint64_t maxDag = ~uint64_t(0);
+};
+
+/// Reads the bitstream registry: one "<file> <min DAG MB> <max DAG MB> [<board name>]"
+/// line per image, '#' starting a comment.
+std::vector<Bitstream> readBitstreams(string const& _registry)
+{
+	std::vector<Bitstream> ret;
+	std::ifstream f(_registry);
+	for (string line; std::getline(f, line);)
+	{
+		line = line.substr(0, line.find('#'));
+		std::istringstream in(line);
+		Bitstream b;
+		uint64_t minMB, maxMB;
+		if (!(in >> b.path >> minMB >> maxMB))
+			continue;
+		std::getline(in >> std::ws, b.board);
+		b.minDag = minMB << 20;
+		b.maxDag = (maxMB + 1) << 20;
+		ret.push_back(b);
+	}
+	return ret;
+}
+
+bool readable(string const& _path)
+{
+	return std::ifstream(_path).good();
+}
+
+/// The best image for _board and a DAG of _dagSize bytes: a registered one
+/// covering the DAG, for this board before any board and the narrowest range
+/// first, else "<board>.aocx", else "kernel.aocx".
+Bitstream selectBitstream(string const& _registry, string const& _board, uint64_t _dagSize)
+{
+	Bitstream best;
+	bool found = false;
+	for (Bitstream const& b: readBitstreams(_registry))
+	{
+		if (_dagSize < b.minDag || _dagSize >= b.maxDag || (!b.board.empty() && b.board != _board) || !readable(b.path))
+			continue;
+		if (!found || (best.board.empty() && !b.board.empty())
+			|| (best.board.empty() == b.board.empty() && b.maxDag - b.minDag < best.maxDag - best.minDag))
+			best = b;
+		found = true;
+	}
+	if (found)
+		return best;
+	for (string const& path: {_board + ".aocx", string("kernel.aocx")})
+		if (readable(path))
+		{
+			best.path = path;
+			return best;
+		}
+	return Bitstream();
 }
 
 std::vector<cl::Platform> getPlatforms()
@@ -267,26 +331,25 @@ OCLMiner::~OCLMiner()
 	kick_miner();
 }
 
-void OCLMiner::report(uint64_t _nonce, WorkPackage const& _w)
+void OCLMiner::report(std::vector<uint64_t> const& _nonces, WorkPackage const& _w, bool _stale, WorkSlot::Clock::time_point _kernelDone)
 {
-	assert(_nonce != 0);
-	// TODO: Why re-evaluating?
-	Result r = EthashAux::eval(_w.seed, _w.header, _nonce);
-	if (r.value < _w.boundary)
-		farm.submitProof(Solution{_nonce, r.mixHash, _w, false});
-	else {
-		farm.failedSolution();
-		cwarn << "FAILURE: FPGA gave incorrect result!";
+	// The kernel only outputs gids and compared the upper 64 bits of the hash:
+	// evaluate all hits of the search in one batch.
+	std::vector<Result> const r = EthashAux::eval(_w.seed, _w.header, _nonces);
+	for (size_t i = 0; i < _nonces.size(); ++i)
+	{
+		assert(_nonces[i] != 0);
+		if (r[i].value < _w.boundary)
+			submitProof(Solution{_nonces[i], r[i].mixHash, _w, _stale, (unsigned)index}, _kernelDone);
+		else {
+			solutionFailed();
+			cwarn << "FAILURE: FPGA gave incorrect result!";
+		}
 	}
 }
 
 void OCLMiner::workLoop()
 {
-	// Memory for zero-ing buffers. Cannot be static because crashes on macOS.
-	uint32_t const c_zero = 0;
-
-	uint64_t startNonce = 0;
-
 	// The work package currently processed by GPU.
 	WorkPackage current;
 	current.header = h256{1u};
@@ -295,21 +358,27 @@ void OCLMiner::workLoop()
 	try {
 		while (true)
 		{
-			const WorkPackage w = work();
+			WorkPackage const& w = work();
 
 			if (current.header != w.header)
 			{
 				// New work received. Update GPU data.
 				auto localSwitchStart = std::chrono::high_resolution_clock::now();
 
-				if (!w)
+				// A package with a seed but no header only asks for the DAG.
+				if (!w && (!w.seed || current.seed == w.seed))
 				{
 					cllog << "No work. Pause for 3 s.";
-					std::this_thread::sleep_for(std::chrono::seconds(3));
+					waitForWake(std::chrono::seconds(3));
+					if (shouldStop())
+						break;
 					continue;
 				}
 
-				cllog << "New work: header" << w.header << "target" << w.boundary.hex();
+				if (w)
+				{
+					cllog << "New work: header" << w.header << "target" << w.boundary.hex();
+				}
 
 				if (current.seed != w.seed)
 				{
@@ -321,69 +390,68 @@ void OCLMiner::workLoop()
 					}
 
 					cllog << "New seed" << w.seed;
-					init(w.seed);
+					if (!init(w.seed))
+						break;
 				}
+				if (!w)
+				{
+					current.seed = w.seed;
+					continue;
+				}
+				current = w;
 
-				// Upper 64 bits of the boundary.
-				const uint64_t target = (uint64_t)(u64)((u256)w.boundary >> 192);
-				assert(target > 0);
-
-				// Update header constant buffer.
-				m_queue.enqueueWriteBuffer(m_header, CL_FALSE, 0, w.header.size, w.header.data());
-				m_queue.enqueueWriteBuffer(m_searchBuffer, CL_FALSE, 0, sizeof(c_zero), &c_zero);
-
-				m_searchKernel.setArg(0, m_searchBuffer);  // Supply output buffer to kernel.
-				m_searchKernel.setArg(4, target);
-
-				// FIXME: This logic should be move out of here.
-				if (w.exSizeBits >= 0)
-					startNonce = w.startNonce | ((uint64_t)index << (64 - 4 - w.exSizeBits)); // This can support up to 16 devices.
-				else
-					startNonce = get_start_nonce();
-
+				// The launches pick the new header up as they are reissued.
 				auto switchEnd = std::chrono::high_resolution_clock::now();
 				auto globalSwitchTime = std::chrono::duration_cast<std::chrono::milliseconds>(switchEnd - workSwitchStart).count();
 				auto localSwitchTime = std::chrono::duration_cast<std::chrono::microseconds>(switchEnd - localSwitchStart).count();
 				cllog << "Switch time" << globalSwitchTime << "ms /" << localSwitchTime << "us";
 			}
 
-			// Read results.
-			// TODO: could use pinned host pointer instead.
-			uint32_t results[c_maxSearchResults + 1];
-			m_queue.enqueueReadBuffer(m_searchBuffer, CL_TRUE, 0, sizeof(results), &results);
-
-			uint64_t nonce = 0;
-			if (results[0] > 0)
+			// The lanes' launches in turn, so that each lane has its other
+			// launch running while this one's results are handled.
+			Lane& lane = m_lanes[m_nextLane];
+			m_nextLane = (m_nextLane + 1) % m_lanes.size();
+			Lane::Launch& launch = lane.launches[lane.next];
+			lane.next ^= 1;
+			if (launch.busy)
+				collect(lane, launch, current);
+
+			// Run the kernel, unless there are no nonces left to search for now.
+			uint64_t startNonce = 0;
+			bool const launched = nextNonces(m_globalWorkSize, startNonce);
+			if (launched)
 			{
-				// Ignore results except the first one.
-				nonce = current.startNonce + results[1];
-				// Reset search buffer if any solution found.
-				m_queue.enqueueWriteBuffer(m_searchBuffer, CL_FALSE, 0, sizeof(c_zero), &c_zero);
+				// Only the previous launch of this buffer pair read them, and it
+				// has been collected. Written from launch.work, which stays put
+				// until then; current is reassigned by the next switch.
+				bool const newHeader = launch.work.header != current.header;
+				launch.work = current;
+				if (newHeader)
+					lane.queue.enqueueWriteBuffer(launch.header, CL_FALSE, 0, launch.work.header.size, launch.work.header.data());
+				// Upper 64 bits of the boundary.
+				uint64_t const target = (uint64_t)(u64)((u256)current.boundary >> 192);
+				assert(target > 0);
+				lane.kernel.setArg(0, launch.results);
+				lane.kernel.setArg(1, launch.header);
+				lane.kernel.setArg(3, startNonce);
+				lane.kernel.setArg(4, target);
+				lane.queue.enqueueNDRangeKernel(lane.kernel, cl::NullRange, m_globalWorkSize, m_workgroupSize);
+				lane.queue.enqueueReadBuffer(launch.results, CL_FALSE, 0, launch.found.size() * sizeof(uint32_t), launch.found.data(), nullptr, &launch.read);
+				lane.queue.flush();
+				launch.startNonce = startNonce;
+				launch.busy = true;
+				addHashCount(m_globalWorkSize);
 			}
-
-			// Run the kernel.
-			m_searchKernel.setArg(3, startNonce);
-			m_queue.enqueueNDRangeKernel(m_searchKernel, cl::NullRange, m_globalWorkSize, m_workgroupSize);
-
-			// Report results while the kernel is running.
-			// It takes some time because ethash must be re-evaluated on CPU.
-			if (nonce != 0)
-				report(nonce, current);
-
-			current = w;        // kernel now processing newest work
-			current.startNonce = startNonce;
-			// Increase start nonce for following kernel execution.
-			startNonce += m_globalWorkSize;
-
-			// Report hash count
-			addHashCount(m_globalWorkSize);
+			else
+				waitForWake(chrono::milliseconds(100));
 
 			// Check if we should stop.
 			if (shouldStop())
 			{
-				// Make sure the last buffer write has finished --
-				// it reads local variable.
-				m_queue.finish();
+				// Make sure the last buffer writes have finished --
+				// they read the launches' work and lane.zero.
+				for (Lane& l: m_lanes)
+					l.queue.finish();
 				break;
 			}
 		}
@@ -394,6 +462,100 @@ void OCLMiner::workLoop()
 	}
 }
 
+void OCLMiner::collect(Lane& _lane, Lane::Launch& _launch, WorkPackage const& _current)
+{
+	_launch.read.wait();
+	auto const kernelDone = WorkSlot::Clock::now();
+	_launch.busy = false;
+
+	std::vector<uint64_t> nonces;
+	unsigned const count = _launch.found[0];
+	countResults(count, c_maxSearchResults);
+	if (count > 0)
+	{
+		for (unsigned i = 0; i < std::min<unsigned>(count, c_maxSearchResults); ++i)
+			nonces.push_back(_launch.startNonce + _launch.found[i + 1]);
+		// Reset search buffer if any solution found.
+		_lane.queue.enqueueWriteBuffer(_launch.results, CL_FALSE, 0, sizeof(_lane.zero), &_lane.zero);
+		// It takes some time because ethash must be re-evaluated on CPU,
+		// while the lanes' other launches keep running.
+		report(nonces, _launch.work, _launch.work.header != _current.header, kernelDone);
+	}
+}
+
+void OCLMiner::createLanes(cl::Program& _program, cl::Device const& _device)
+{
+	// Every search kernel of the binary, with its compute units. Autorun
+	// kernels start by themselves and are fed through their channels by the
+	// kernels that are launched.
+	vector<pair<string, unsigned>> kernels;
+	string names;
+	try
+	{
+		names = _program.getInfo<CL_PROGRAM_KERNEL_NAMES>();
+	}
+	catch (cl::Error const&)
+	{
+		names = "ethash_search";
+	}
+	std::istringstream in(names);
+	for (string name; getline(in, name, ';');)
+	{
+		if (name.compare(0, 13, "ethash_search") != 0)
+			continue;
+		string attributes;
+		try
+		{
+			attributes = cl::Kernel(_program, name.c_str()).getInfo<CL_KERNEL_ATTRIBUTES>();
+		}
+		catch (cl::Error const&)
+		{
+			// Not reported by every runtime.
+		}
+		if (attributes.find("autorun") != string::npos)
+		{
+			cllog << "OpenCL kernel: " << name << " runs by itself";
+			continue;
+		}
+		unsigned units = 1;
+		size_t const at = attributes.find("num_compute_units(");
+		if (at != string::npos)
+			units = max(1u, (unsigned)strtoul(attributes.c_str() + at + 18, nullptr, 10));
+		cllog << "OpenCL kernel: " << name << " with " << units << " compute units";
+		kernels.emplace_back(name, units);
+	}
+	if (kernels.empty())
+		kernels.emplace_back("ethash_search", 1);
+
+	vector<string> instances;
+	for (auto const& k: kernels)
+		instances.insert(instances.end(), k.second, k.first);
+	unsigned const count = s_pipelines ? s_pipelines : (unsigned)instances.size();
+
+	// The previous epoch's reads write into the launches.
+	for (Lane& l: m_lanes)
+		l.queue.finish();
+	m_lanes.clear();
+	m_lanes.resize(count);
+	m_nextLane = 0;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		Lane& lane = m_lanes[i];
+		lane.queue = cl::CommandQueue(m_context, _device);
+		lane.kernel = cl::Kernel(_program, instances[i % instances.size()].c_str());
+		lane.kernel.setArg(2, m_dag);
+		lane.kernel.setArg(5, ~0u);  // Pass this to stop the compiler unrolling the loops.
+		for (Lane::Launch& launch: lane.launches)
+		{
+			launch.header = cl::Buffer(m_context, CL_MEM_READ_ONLY, 32);
+			launch.results = cl::Buffer(m_context, CL_MEM_WRITE_ONLY, (c_maxSearchResults + 1) * sizeof(uint32_t));
+			launch.found.assign(c_maxSearchResults + 1, 0);
+			lane.queue.enqueueWriteBuffer(launch.results, CL_TRUE, 0, sizeof(lane.zero), &lane.zero);
+		}
+	}
+	cllog << "Searching with " << count << " kernel instances, two launches each";
+}
+
 void OCLMiner::kick_miner() {}
 
 unsigned OCLMiner::getNumDevices()
@@ -521,9 +683,105 @@ string OCLMiner::Name() {
 	return s_devicenames[index];
 }
 
+void OCLMiner::uploadDag(h256 const& _seed, EthashAux::LightType const& _light, uint64_t _dagSize)
+{
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&]() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); };
+	// Shared with other processes, the DAG is built once on the host for all of
+	// them, rather than streamed in chunks by each; unless that is over the
+	// host memory budget.
+	bool const stored = EthashAux::fullStored(_seed) || (EthashAux::sharedMemory() && HostMemory::fits(_dagSize));
+	// Within the budget the two staging chunks may be smaller.
+	HostMemory::Reservation memory;
+	if (!stored)
+		memory = HostMemory::reserve(HostMemory::Staging, 2 * std::min<uint64_t>(c_hostDagChunk, _dagSize),
+			2 * std::min<uint64_t>(c_minHostDagChunk, _dagSize));
+	size_t const chunk = stored ? (size_t)std::min<uint64_t>(c_hostDagChunk, _dagSize) :
+		(size_t)(memory.bytes() / 2 / sizeof(node) * sizeof(node));
+	uint64_t const chunks = (_dagSize + chunk - 1) / chunk;
+	// Each of the two slots has one chunk in flight: the board takes one while
+	// the host prepares the other.
+	cl::Event written[2];
+	dagProgressed(0, _dagSize, 0);
+
+	if (stored)
+	{
+		// Straight out of the mapped epoch file or segment, kept alive until the writes are done.
+		EthashAux::FullType full = EthashAux::full(_seed);
+		byte const* data = full->data().data();
+		for (uint64_t k = 0; k < chunks; ++k)
+		{
+			cl::Event& ev = written[k % 2];
+			if (k >= 2)
+			{
+				ev.wait();
+				dagProgressed((k - 1) * chunk, _dagSize, elapsed());
+			}
+			uint64_t const offset = k * chunk;
+			m_queue.enqueueWriteBuffer(m_dag, CL_FALSE, offset, std::min<uint64_t>(chunk, _dagSize - offset), data + offset, nullptr, &ev);
+			m_queue.flush();
+		}
+		m_queue.finish();
+	}
+	else
+	{
+		// Pinned staging chunks the host DAG engine builds into on all cores.
+		cl::Buffer staging[2];
+		node* stage[2];
+		for (unsigned i = 0; i < 2; ++i)
+		{
+			staging[i] = cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, chunk);
+			stage[i] = (node*)m_queue.enqueueMapBuffer(staging[i], CL_TRUE, CL_MAP_WRITE, 0, chunk);
+		}
+		uint32_t const nodes = (uint32_t)(_dagSize / sizeof(node));
+		uint32_t const chunkNodes = (uint32_t)(chunk / sizeof(node));
+		unsigned const threads = std::max(1u, std::thread::hardware_concurrency());
+		for (uint64_t k = 0; k < chunks; ++k)
+		{
+			cl::Event& ev = written[k % 2];
+			if (k >= 2)
+			{
+				ev.wait();
+				dagProgressed((k - 1) * chunk, _dagSize, elapsed());
+			}
+			uint32_t const first = (uint32_t)k * chunkNodes;
+			uint32_t const last = std::min(first + chunkNodes, nodes);
+			// The range is written at its absolute node index, so the staging
+			// chunk is offset back by its first node.
+			node* base = stage[k % 2] - first;
+			std::atomic<uint32_t> next(first);
+			auto build = [&]()
+			{
+				for (uint32_t b; (b = next.fetch_add(1 << 14)) < last;)
+					ethash_calculate_dag_range(base, b, std::min(b + (1 << 14), last), _light->light);
+			};
+			std::vector<std::thread> workers;
+			for (unsigned i = 1; i < threads; ++i)
+				workers.emplace_back(build);
+			build();
+			for (auto& t: workers)
+				t.join();
+			m_queue.enqueueWriteBuffer(m_dag, CL_FALSE, k * chunk, (uint64_t)(last - first) * sizeof(node), stage[k % 2], nullptr, &ev);
+			m_queue.flush();
+		}
+		m_queue.finish();
+		for (unsigned i = 0; i < 2; ++i)
+			m_queue.enqueueUnmapMemObject(staging[i], stage[i]);
+		m_queue.finish();
+	}
+
+	double const ms = elapsed();
+	dagProgressed(_dagSize, _dagSize, ms);
+	dagStaged(_light->epoch(), stored ? "file" : "host", _dagSize, ms);
+	float gb = (float)_dagSize / (1024 * 1024 * 1024);
+	cnote << gb << " GB of host DAG data streamed in" << (uint64_t)ms << "ms," << (ms > 0 ? gb * 1000 / ms : 0) << "GB/s";
+}
+
 bool OCLMiner::init(const h256& seed)
 {
+	auto const lightStart = std::chrono::steady_clock::now();
 	EthashAux::LightType light = EthashAux::light(seed);
+	dagStaged(light->epoch(), "light", light->data().size(), std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lightStart).count());
 
 	// get all platforms
 	try
@@ -572,13 +830,6 @@ bool OCLMiner::init(const h256& seed)
 		s_devicenames[index] = device_name;
 		ETHCL_LOG("Device:   " << device_name << " / " << device_version);
 
-		char options[256];
-		int computeCapability = 0;
-		
-		// create context
-		m_context = cl::Context(vector<cl::Device>(&device, &device + 1));
-		m_queue = cl::CommandQueue(m_context, device);
-
 		// make sure that global work size is evenly divisible by the local workgroup size
 		m_workgroupSize = s_workgroupSize;
 		m_globalWorkSize = s_initialGlobalWorkSize;
@@ -589,77 +840,63 @@ bool OCLMiner::init(const h256& seed)
 		uint32_t dagSize128 = (unsigned)(dagSize / ETHASH_MIX_BYTES);
 		uint32_t lightSize64 = (unsigned)(light->data().size() / sizeof(node));
 
-		// patch source code
-		// note: The kernels here are simply compiled version of the respective .cl kernels
-		// into a byte array by bin2h.cmake. There is no need to load the file by hand in runtime
-		// See libethash-cl/CMakeLists.txt: add_custom_command()
-		// TODO: Just use C++ raw string literal.
-		string code;
-
-		if (s_clKernelName == OCLKernelName::Fpga) {
-			string kernelname = device.getInfo<CL_DEVICE_NAME>() + ".aocx";
-			cllog << "OpenCL kernel: Custom '" + kernelname + "'";
-			std::ifstream t(kernelname);
-			if (t.good()) {
-				std::string ckernel;
-				t.seekg(0, std::ios::end);
-				ckernel.reserve(t.tellg());
-				t.seekg(0, std::ios::beg);
-				ckernel.assign((std::istreambuf_iterator<char>(t)),
-				std::istreambuf_iterator<char>());
-				code = ckernel;
-				cllog << "OpenCL kernel: Custom '" + kernelname +"'";
-			} else {
-				cllog << "OpenCL kernel: Custom '" + kernelname + "' not found";
-				std::ifstream t("kernel.aocx");
-				if (t.good()) {
-					std::string ckernel;
-					t.seekg(0, std::ios::end);
-					ckernel.reserve(t.tellg());
-					t.seekg(0, std::ios::beg);
-					ckernel.assign((std::istreambuf_iterator<char>(t)),
-					std::istreambuf_iterator<char>());
-					code = ckernel;
-					cllog << "OpenCL kernel: Fallback 'kernel.aocx'";
-				} else {
-					cllog << "OpenCL kernel: Fallback 'kernel.aocx' not found";
-					code = "";
-				}
-			}
-		} else {
-			code = "";
+		// The parameters are baked into the bitstream; only pick the image.
+		Bitstream const image = selectBitstream(s_bitstreams, device.getInfo<CL_DEVICE_NAME>(), dagSize);
+		if (image.path.empty())
+		{
+			cwarn << "No FPGA bitstream for" << device.getInfo<CL_DEVICE_NAME>() << "and a DAG of" << dagSize / (1024 * 1024) << "MB";
+			return false;
 		}
-
-		cllog << "OpenCL kernel: GROUP_SIZE" << m_workgroupSize;
-		addDefinition(code, "GROUP_SIZE", m_workgroupSize);
-		cllog << "OpenCL kernel: DAG_SIZE" << dagSize128;
-		addDefinition(code, "DAG_SIZE", dagSize128);
-		cllog << "OpenCL kernel: LIGHT_SIZE" << lightSize64;
-		addDefinition(code, "LIGHT_SIZE", lightSize64);
-		cllog << "OpenCL kernel: ACCESSES" << ETHASH_ACCESSES;
-		addDefinition(code, "ACCESSES", ETHASH_ACCESSES);
-		cllog << "OpenCL kernel: MAX_OUTPUTS" << c_maxSearchResults;
-		addDefinition(code, "MAX_OUTPUTS", c_maxSearchResults);
-		cllog << "OpenCL kernel: PLATFORM" << platformId;
-		addDefinition(code, "PLATFORM", platformId);
-		cllog << "OpenCL kernel: COMPUTE" << computeCapability;
-		addDefinition(code, "COMPUTE", computeCapability);
-		cllog << "OpenCL kernel: THREADS_PER_HASH" << s_threadsPerHash;
-		addDefinition(code, "THREADS_PER_HASH", s_threadsPerHash);
-
-		// create miner OpenCL program
-		cl::Program::Sources sources{{code.data(), code.size()}};
-		cl::Program program(m_context, sources);
-		try
+		Programmed board;
 		{
-			program.build({device}, options);
-			cllog << "Build info:" << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+			Guard l(x_programmed);
+			board = s_programmed[deviceId];
 		}
-		catch (cl::Error const&)
+		struct stat st = {};
+		if (stat(image.path.c_str(), &st) == 0 && board.path == image.path
+			&& board.size == (uint64_t)st.st_size && board.modified == st.st_mtime)
 		{
-			cwarn << "Build info:" << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-			return false;
+			cllog << "OpenCL kernel: '" + image.path + "' already programmed";
+			m_context = board.context;
+		}
+		else
+		{
+			std::ifstream t(image.path, std::ios::binary);
+			std::vector<unsigned char> binary((std::istreambuf_iterator<char>(t)), std::istreambuf_iterator<char>());
+			if (binary.empty())
+			{
+				cwarn << "Cannot read FPGA bitstream" << image.path;
+				return false;
+			}
+			{
+				// Whatever ran before is gone once programming starts.
+				Guard l(x_programmed);
+				s_programmed.erase(deviceId);
+			}
+			cnote << "Programming" << device.getInfo<CL_DEVICE_NAME>() << "with" << image.path;
+			// A fresh context, so the previous image goes with the old one.
+			m_context = cl::Context(vector<cl::Device>(&device, &device + 1));
+			board.program = cl::Program(m_context, {device}, cl::Program::Binaries{binary});
+			try
+			{
+				board.program.build({device});
+				cllog << "Build info:" << board.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+			}
+			catch (cl::Error const&)
+			{
+				cwarn << "Build info:" << board.program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+				return false;
+			}
+			board.path = image.path;
+			board.size = (uint64_t)st.st_size;
+			board.modified = st.st_mtime;
+			board.context = m_context;
+			Guard l(x_programmed);
+			s_programmed[deviceId] = board;
 		}
+		cl::Program program = board.program;
+		m_queue = cl::CommandQueue(m_context, device);
+		cllog << "OpenCL kernel: PLATFORM" << platformId << "DAG_SIZE" << dagSize128 << "LIGHT_SIZE" << lightSize64;
 
 		// create buffer for dag
 		try
@@ -668,9 +905,11 @@ bool OCLMiner::init(const h256& seed)
 			m_light = cl::Buffer(m_context, CL_MEM_READ_ONLY, light->data().size());
 			cllog << "Creating DAG buffer, size" << dagSize;
 			m_dag = cl::Buffer(m_context, CL_MEM_READ_ONLY, dagSize);
-			cllog << "Loading kernels";
-			m_searchKernel = cl::Kernel(program, "ethash_search");
-			m_dagKernel = cl::Kernel(program, "ethash_calculate_dag_item");
+			if (!s_hostDag)
+			{
+				cllog << "Loading kernels";
+				m_dagKernel = cl::Kernel(program, "ethash_calculate_dag_item");
+			}
 			cllog << "Writing light cache buffer";
 			m_queue.enqueueWriteBuffer(m_light, CL_TRUE, 0, light->data().size(), light->data().data());
 		}
@@ -679,17 +918,15 @@ bool OCLMiner::init(const h256& seed)
 			cwarn << ethCLErrorHelper("Creating DAG buffer failed", err);
 			return false;
 		}
-		// create buffer for header
-		ETHCL_LOG("Creating buffer for header.");
-		m_header = cl::Buffer(m_context, CL_MEM_READ_ONLY, 32);
-
-		m_searchKernel.setArg(1, m_header);
-		m_searchKernel.setArg(2, m_dag);
-		m_searchKernel.setArg(5, ~0u);  // Pass this to stop the compiler unrolling the loops.
+		// create the search kernel instances and their buffers
+		ETHCL_LOG("Creating search lanes");
+		createLanes(program, device);
 
-		// create mining buffers
-		ETHCL_LOG("Creating mining buffer");
-		m_searchBuffer = cl::Buffer(m_context, CL_MEM_WRITE_ONLY, (c_maxSearchResults + 1) * sizeof(uint32_t));
+		if (s_hostDag)
+		{
+			uploadDag(seed, light, dagSize);
+			return true;
+		}
 
 		uint32_t const work = (uint32_t)(dagSize / sizeof(node));
 		uint32_t fullRuns = work / m_globalWorkSize;
@@ -712,6 +949,7 @@ bool OCLMiner::init(const h256& seed)
 		auto dagTime = std::chrono::duration_cast<std::chrono::milliseconds>(endDAG-startDAG);
 		float gb = (float)dagSize / (1024 * 1024 * 1024);
 		cnote << gb << " GB of DAG data generated in" << dagTime.count() << "ms.";
+		dagStaged(light->epoch(), "generate", dagSize, std::chrono::duration<double, std::milli>(endDAG - startDAG).count());
 	}
 	catch (cl::Error const& err)
 	{
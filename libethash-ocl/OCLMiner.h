@@ -5,6 +5,8 @@
 
 #pragma once
 
+#include <map>
+
 #include <libdevcore/Worker.h>
 #include <libethcore/EthashAux.h>
 #include <libethcore/Miner.h>
@@ -81,6 +83,16 @@ public:
 			s_devices[i] = _devices[i];
 		}
 	}
+	/// The search kernel instances driven at once, each through its own
+	/// queue. 0 drives one per compute unit of every search kernel in the
+	/// binary.
+	static void setPipelines(unsigned _pipelines) { s_pipelines = _pipelines; }
+	/// Builds the DAG on the host (or maps it from its epoch file) and streams
+	/// it to the board instead of running the bitstream's DAG kernel.
+	static void setHostDag(bool _hostDag) { s_hostDag = _hostDag; }
+	/// The registry of .aocx images to pick from per board and DAG size, see
+	/// selectBitstream() in OCLMiner.cpp.
+	static void setBitstreams(string const& _registry) { s_bitstreams = _registry; }
 	static void setCLKernel(unsigned _clKernel) { 
 		s_clKernelName = OCLKernelName::Fpga;
 	}
@@ -91,28 +103,77 @@ protected:
 
 private:
 	void workLoop() override;
-	void report(uint64_t _nonce, WorkPackage const& _w);
+	void report(std::vector<uint64_t> const& _nonces, WorkPackage const& _w, bool _stale, WorkSlot::Clock::time_point _kernelDone);
 
 	bool init(const h256& seed);
 
+	/// One search kernel instance with its own queue. It has two launches,
+	/// each with its own header and results, so one is queued while the
+	/// host handles the other's results.
+	struct Lane
+	{
+		struct Launch
+		{
+			cl::Buffer header;
+			cl::Buffer results;
+			/// Read back into here; valid once read completed.
+			std::vector<uint32_t> found;
+			cl::Event read;
+			WorkPackage work;
+			uint64_t startNonce = 0;
+			bool busy = false;
+		};
+		cl::CommandQueue queue;
+		cl::Kernel kernel;
+		Launch launches[2];
+		unsigned next = 0;
+		uint32_t zero = 0;
+	};
+	/// Creates m_lanes for the search kernels of _program, see setPipelines().
+	void createLanes(cl::Program& _program, cl::Device const& _device);
+	/// Waits for _launch's results and reports them.
+	void collect(Lane& _lane, Lane::Launch& _launch, WorkPackage const& _current);
+	/// Fills m_dag from the host, see setHostDag().
+	void uploadDag(h256 const& _seed, EthashAux::LightType const& _light, uint64_t _dagSize);
+
+	/// The image a board was last programmed with, reused while it is
+	/// unchanged, e.g. across epochs: reprogramming takes seconds.
+	struct Programmed
+	{
+		string path;
+		uint64_t size = 0;
+		time_t modified = 0;
+		cl::Context context;
+		cl::Program program;
+	};
+
 	cl::Context m_context;
 	cl::CommandQueue m_queue;
-	cl::Kernel m_searchKernel;
 	cl::Kernel m_dagKernel;
 	cl::Buffer m_dag;
 	cl::Buffer m_light;
-	cl::Buffer m_header;
-	cl::Buffer m_searchBuffer;
+	std::vector<Lane> m_lanes;
+	unsigned m_nextLane = 0;
 	unsigned m_globalWorkSize = 0;
 	unsigned m_workgroupSize = 0;
 
 	static unsigned s_platformId;
 	static unsigned s_numInstances;
 	static unsigned s_threadsPerHash;
+	static unsigned s_pipelines;
+	static bool s_hostDag;
+	static string s_bitstreams;
+	static Mutex x_programmed;
+	static std::map<unsigned, Programmed> s_programmed;
 	static OCLKernelName s_clKernelName;
 	static int s_devices[16];
 	static string s_devicenames[16];
 
+	/// Size of the host staging chunks streamed to the board.
+	static const size_t c_hostDagChunk = 64 * 1024 * 1024;
+	/// The least they are made within the host memory budget.
+	static const size_t c_minHostDagChunk = 4 * 1024 * 1024;
+
 	/// The local work size for the search
 	static unsigned s_workgroupSize;
 	/// The initial global work size for the searches
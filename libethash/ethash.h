@@ -29,7 +29,7 @@
 #define ETHASH_REVISION 23
 #define ETHASH_DATASET_BYTES_INIT 1073741824U // 2**30
 #define ETHASH_DATASET_BYTES_GROWTH 8388608U  // 2**23
-#define ETHASH_CACHE_BYTES_INIT 1073741824U // 2**24
+#define ETHASH_CACHE_BYTES_INIT 16777216U // 2**24
 #define ETHASH_CACHE_BYTES_GROWTH 131072U  // 2**17
 #define ETHASH_EPOCH_LENGTH 30000U
 #define ETHASH_MIX_BYTES 128
@@ -37,6 +37,7 @@
 #define ETHASH_DATASET_PARENTS 256
 #define ETHASH_CACHE_ROUNDS 3
 #define ETHASH_ACCESSES 64
+#define ETHASH_MAX_EPOCHS 32768 // how far ethash_get_epoch() follows the seed chain
 
 #ifdef __cplusplus
 extern "C" {
@@ -81,11 +82,57 @@ ethash_return_value_t ethash_light_compute(
 	uint64_t nonce
 );
 
+/**
+ * Calculate the light client data for several nonces of the same header
+ *
+ * Equivalent to calling @ref ethash_light_compute() for each nonce, but the
+ * nonces are evaluated in lock step so the cache lookups of different nonces
+ * overlap.
+ *
+ * @param light          The light client handler
+ * @param header_hash    The header hash to pack into the mix
+ * @param nonces         The nonces to evaluate
+ * @param count          Number of entries in @a nonces and @a results
+ * @param results        Receives one return value per nonce
+ */
+void ethash_light_compute_batch(
+	ethash_light_t light,
+	ethash_h256_t const header_hash,
+	uint64_t const* nonces,
+	size_t count,
+	ethash_return_value_t* results
+);
+
+/**
+ * Recompute the final hash of a nonce from its mix hash, without the cache or
+ * the DAG: two Keccak invocations. Only as trustworthy as @a mix_hash; a full
+ * evaluation is needed to know that the mix itself is right.
+ *
+ * @param header_hash    The header hash the nonce was searched for
+ * @param nonce          The nonce
+ * @param mix_hash       The mix hash of the nonce, e.g. as reported by a GPU
+ * @return               the final hash, i.e. ethash_return_value_t::result
+ */
+ethash_h256_t ethash_quick_hash(
+	ethash_h256_t const* header_hash,
+	uint64_t const nonce,
+	ethash_h256_t const* mix_hash
+);
+
 /**
  * Calculate the seedhash for a given block number
  */
 ethash_h256_t ethash_get_seedhash(uint64_t block_number);
 
+/**
+ * Look up the epoch a seedhash belongs to: in constant time for the tabulated
+ * epochs, by following the seed chain beyond them
+ *
+ * @return the epoch number, or -1 if @a seedhash is not the seed of any of the
+ *         first ETHASH_MAX_EPOCHS epochs
+ */
+int ethash_get_epoch(ethash_h256_t const seedhash);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,189 @@
+/*
+  This file is part of ethash.
+
+  ethash is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ethash is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with cpp-ethereum.	If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file hugepages.c
+* @date 2018
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "hugepages.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define ETHASH_PAGE_2MB ((size_t)2 << 20)
+#define ETHASH_PAGE_1GB ((size_t)1 << 30)
+
+#if defined(MAP_HUGE_SHIFT) && !defined(MAP_HUGE_1GB)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// Every mapping ends with a footer recording how it was made, placed right
+// after the caller's bytes so that the returned pointer stays page aligned.
+typedef struct ethash_huge_footer {
+	size_t mapped;
+	size_t page;
+} ethash_huge_footer;
+
+static size_t footer_offset(size_t size)
+{
+	return (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static size_t round_up(size_t size, size_t page)
+{
+	return (size + page - 1) / page * page;
+}
+
+static void* finish(void* ptr, size_t size, size_t mapped, size_t page)
+{
+	ethash_huge_footer footer = { mapped, page };
+	memcpy((char*)ptr + footer_offset(size), &footer, sizeof(footer));
+	return ptr;
+}
+
+#if defined(_WIN32)
+
+static size_t base_page_size(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+// Large pages need SeLockMemoryPrivilege, which has to be granted to the user
+// by policy and then enabled in the process token.
+static int enable_lock_memory_privilege(void)
+{
+	static int s_enabled = -1;
+	if (s_enabled >= 0) {
+		return s_enabled;
+	}
+	HANDLE token;
+	TOKEN_PRIVILEGES tp;
+	s_enabled = 0;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+		return s_enabled;
+	}
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) &&
+		GetLastError() == ERROR_SUCCESS) {
+		s_enabled = 1;
+	}
+	CloseHandle(token);
+	return s_enabled;
+}
+
+void* ethash_huge_alloc(size_t size)
+{
+	size_t const needed = footer_offset(size) + sizeof(ethash_huge_footer);
+	size_t const large = GetLargePageMinimum();
+	if (large && size >= large && enable_lock_memory_privilege()) {
+		size_t const mapped = round_up(needed, large);
+		void* ptr = VirtualAlloc(NULL, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (ptr) {
+			return finish(ptr, size, mapped, large);
+		}
+	}
+	size_t const page = base_page_size();
+	size_t const mapped = round_up(needed, page);
+	void* ptr = VirtualAlloc(NULL, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return ptr ? finish(ptr, size, mapped, page) : NULL;
+}
+
+void ethash_huge_free(void* ptr, size_t size)
+{
+	(void)size;
+	if (ptr) {
+		VirtualFree(ptr, 0, MEM_RELEASE);
+	}
+}
+
+#else
+
+static void* map_pages(size_t mapped, int flags)
+{
+	void* ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+void* ethash_huge_alloc(size_t size)
+{
+	size_t const needed = footer_offset(size) + sizeof(ethash_huge_footer);
+	void* ptr;
+
+#if defined(MAP_HUGETLB)
+	// Explicit huge pages only exist if the administrator reserved some
+	// (vm.nr_hugepages); otherwise these simply fail. 1 GB pages are only
+	// worth it when rounding up wastes little of the DAG.
+#if defined(MAP_HUGE_1GB)
+	if (size >= ETHASH_PAGE_1GB && round_up(needed, ETHASH_PAGE_1GB) - size <= size / 16) {
+		size_t const mapped = round_up(needed, ETHASH_PAGE_1GB);
+		if ((ptr = map_pages(mapped, MAP_HUGETLB | MAP_HUGE_1GB))) {
+			return finish(ptr, size, mapped, ETHASH_PAGE_1GB);
+		}
+	}
+#endif
+	if (size >= ETHASH_PAGE_2MB) {
+		size_t const mapped = round_up(needed, ETHASH_PAGE_2MB);
+		if ((ptr = map_pages(mapped, MAP_HUGETLB))) {
+			return finish(ptr, size, mapped, ETHASH_PAGE_2MB);
+		}
+	}
+#endif
+
+	size_t const page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t const mapped = round_up(needed, page);
+	if (!(ptr = map_pages(mapped, 0))) {
+		return NULL;
+	}
+#if defined(MADV_HUGEPAGE)
+	// Ask for transparent huge pages instead; harmless where they are disabled.
+	if (size >= ETHASH_PAGE_2MB) {
+		madvise(ptr, mapped, MADV_HUGEPAGE);
+	}
+#endif
+	return finish(ptr, size, mapped, page);
+}
+
+void ethash_huge_free(void* ptr, size_t size)
+{
+	if (ptr) {
+		ethash_huge_footer footer;
+		memcpy(&footer, (char const*)ptr + footer_offset(size), sizeof(footer));
+		munmap(ptr, footer.mapped);
+	}
+}
+
+#endif
+
+size_t ethash_huge_page_size(void const* ptr, size_t size)
+{
+	ethash_huge_footer footer;
+	memcpy(&footer, (char const*)ptr + footer_offset(size), sizeof(footer));
+	return footer.page;
+}
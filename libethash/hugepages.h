@@ -0,0 +1,55 @@
+/*
+  This file is part of ethash.
+
+  ethash is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ethash is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with cpp-ethereum.	If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file hugepages.h
+* @date 2018
+*
+* Page-granular allocations for the light cache and host DAG buffers, backed by
+* huge pages where the OS provides them: explicit 1 GB / 2 MB pages
+* (MAP_HUGETLB) or transparent huge pages (madvise) on Linux, large pages on
+* Windows. Both buffers are read at random 64 byte offsets, so fewer, larger
+* pages cut TLB misses considerably.
+*/
+
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Allocate @a size bytes of zeroed, page aligned memory, using huge pages when
+ * possible and ordinary pages otherwise.
+ *
+ * @return the memory or NULL if nothing could be mapped. Release it with
+ *         ethash_huge_free() and the same @a size.
+ */
+void* ethash_huge_alloc(size_t size);
+
+/// Release memory from ethash_huge_alloc(). @a ptr may be NULL.
+void ethash_huge_free(void* ptr, size_t size);
+
+/**
+ * The page size backing an allocation from ethash_huge_alloc(): 1 GB or 2 MB
+ * for explicit huge pages, the base page size otherwise (transparent huge
+ * pages, if any, are not reflected).
+ */
+size_t ethash_huge_page_size(void const* ptr, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,18 +28,135 @@
 #include "endian.h"
 #include "internal.h"
 #include "data_sizes.h"
+#include "hugepages.h"
+#include "seed_hashes.h"
 #include "sha3.h"
+#include "simd.h"
+
+#define ETHASH_TABULATED_SIZES (sizeof(dag_sizes) / sizeof(dag_sizes[0]))
+#define ETHASH_SIZE_MEMO 64
+
+#if defined(__SIZEOF_INT128__)
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+	return (uint64_t)(((unsigned __int128)a * b) % m);
+}
+#else
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+	uint64_t r = 0;
+	for (a %= m; b; b >>= 1) {
+		if (b & 1) {
+			r = r >= m - a ? r - (m - a) : r + a;
+		}
+		a = a >= m - a ? a - (m - a) : a + a;
+	}
+	return r;
+}
+#endif
+
+static uint64_t powmod(uint64_t b, uint64_t e, uint64_t m)
+{
+	uint64_t r = 1;
+	for (b %= m; e; e >>= 1) {
+		if (e & 1) {
+			r = mulmod(r, b, m);
+		}
+		b = mulmod(b, b, m);
+	}
+	return r;
+}
+
+// Miller-Rabin with the first 12 prime bases, which is deterministic for all
+// 64 bit integers.
+static bool is_prime(uint64_t n)
+{
+	static uint64_t const bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+	if (n < 2) {
+		return false;
+	}
+	for (unsigned i = 0; i != sizeof(bases) / sizeof(bases[0]); ++i) {
+		if (n % bases[i] == 0) {
+			return n == bases[i];
+		}
+	}
+	uint64_t d = n - 1;
+	unsigned s = 0;
+	for (; !(d & 1); d >>= 1) {
+		++s;
+	}
+	for (unsigned i = 0; i != sizeof(bases) / sizeof(bases[0]); ++i) {
+		uint64_t x = powmod(bases[i], d, n);
+		if (x == 1 || x == n - 1) {
+			continue;
+		}
+		unsigned r = 1;
+		for (; r < s; ++r) {
+			x = mulmod(x, x, n);
+			if (x == n - 1) {
+				break;
+			}
+		}
+		if (r == s) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ethash_load_relaxed(p_) __atomic_load_n((p_), __ATOMIC_RELAXED)
+#define ethash_store_relaxed(p_, v_) __atomic_store_n((p_), (v_), __ATOMIC_RELAXED)
+#else
+#define ethash_load_relaxed(p_) (*(uint64_t volatile*)(p_))
+#define ethash_store_relaxed(p_, v_) (*(uint64_t volatile*)(p_) = (v_))
+#endif
+
+// Sizes of the epochs beyond the tables: the largest multiple of item_bytes
+// below init + growth * epoch whose item count is prime.
+//
+// A size only ever lies a few prime gaps below its epoch's upper bound, far
+// less than one epoch's growth, so a memo slot holding a size identifies the
+// epoch it belongs to by itself. One word per slot is then enough to share the
+// memo between threads without locking.
+static uint64_t ethash_compute_size(
+	uint64_t* memo,
+	uint64_t init,
+	uint64_t growth,
+	uint64_t item_bytes,
+	uint64_t epoch
+)
+{
+	uint64_t* const slot = &memo[epoch % ETHASH_SIZE_MEMO];
+	uint64_t const upper = init + growth * epoch - item_bytes;
+	uint64_t size = ethash_load_relaxed(slot);
+	if (size && size <= upper && upper - size < growth) {
+		return size;
+	}
+	for (size = upper; !is_prime(size / item_bytes); size -= 2 * item_bytes) {}
+	ethash_store_relaxed(slot, size);
+	return size;
+}
+
+static uint64_t dag_size_memo[ETHASH_SIZE_MEMO];
+static uint64_t cache_size_memo[ETHASH_SIZE_MEMO];
 
 uint64_t ethash_get_datasize(uint64_t const block_number)
 {
-	assert(block_number / ETHASH_EPOCH_LENGTH < 2048);
-	return dag_sizes[block_number / ETHASH_EPOCH_LENGTH];
+	uint64_t const epoch = block_number / ETHASH_EPOCH_LENGTH;
+	if (epoch < ETHASH_TABULATED_SIZES) {
+		return dag_sizes[epoch];
+	}
+	return ethash_compute_size(dag_size_memo, ETHASH_DATASET_BYTES_INIT, ETHASH_DATASET_BYTES_GROWTH, ETHASH_MIX_BYTES, epoch);
 }
 
 uint64_t ethash_get_cachesize(uint64_t const block_number)
 {
-	assert(block_number / ETHASH_EPOCH_LENGTH < 2048);
-	return cache_sizes[block_number / ETHASH_EPOCH_LENGTH];
+	uint64_t const epoch = block_number / ETHASH_EPOCH_LENGTH;
+	if (epoch < ETHASH_TABULATED_SIZES) {
+		return cache_sizes[epoch];
+	}
+	return ethash_compute_size(cache_size_memo, ETHASH_CACHE_BYTES_INIT, ETHASH_CACHE_BYTES_GROWTH, ETHASH_HASH_BYTES, epoch);
 }
 
 // Follows Sergio's "STRICT MEMORY HARD HASHING FUNCTIONS" (2014)
@@ -67,9 +184,7 @@ bool static ethash_compute_cache_nodes(
 			uint32_t const idx = nodes[i].words[0] % num_nodes;
 			node data;
 			data = nodes[(num_nodes - 1 + i) % num_nodes];
-			for (uint32_t w = 0; w != NODE_WORDS; ++w) {
-				data.words[w] ^= nodes[idx].words[w];
-			}
+			ethash_xor_nodes(&data, &nodes[idx], 1);
 			SHA3_512(nodes[i].bytes, data.bytes, sizeof(data));
 		}
 	}
@@ -79,56 +194,109 @@ bool static ethash_compute_cache_nodes(
 	return true;
 }
 
+// Computes several DAG items side by side. Their parent lookups are
+// independent, so interleaving them (and prefetching each parent one round
+// ahead) keeps several cache misses in flight instead of one at a time.
+static void ethash_calculate_dag_items(
+	node* const ret,
+	uint32_t const* node_indices,
+	uint32_t count,
+	ethash_light_t const light
+)
+{
+	uint32_t const num_parent_nodes = (uint32_t) (light->cache_size / sizeof(node));
+	node const* cache_nodes = (node const *) light->cache;
+	assert(count <= ETHASH_BATCH_LANES * MIX_NODES);
+
+	uint8_t* items[ETHASH_BATCH_LANES * MIX_NODES];
+	for (uint32_t k = 0; k != count; ++k) {
+		memcpy(&ret[k], &cache_nodes[node_indices[k] % num_parent_nodes], sizeof(node));
+		ret[k].words[0] ^= node_indices[k];
+		items[k] = ret[k].bytes;
+	}
+	SHA3_512_xN(items, (uint8_t const* const*)items, sizeof(node), count);
+	ethash_dag_parents(ret, node_indices, count, cache_nodes, num_parent_nodes);
+	SHA3_512_xN(items, (uint8_t const* const*)items, sizeof(node), count);
+}
+
 void ethash_calculate_dag_item(
 	node* const ret,
 	uint32_t node_index,
 	ethash_light_t const light
 )
 {
-	uint32_t num_parent_nodes = (uint32_t) (light->cache_size / sizeof(node));
-	node const* cache_nodes = (node const *) light->cache;
-	node const* init = &cache_nodes[node_index % num_parent_nodes];
-	memcpy(ret, init, sizeof(node));
-	ret->words[0] ^= node_index;
-	SHA3_512(ret->bytes, ret->bytes, sizeof(node));
-#if defined(_M_X64) && ENABLE_SSE
-	__m128i const fnv_prime = _mm_set1_epi32(FNV_PRIME);
-	__m128i xmm0 = ret->xmm[0];
-	__m128i xmm1 = ret->xmm[1];
-	__m128i xmm2 = ret->xmm[2];
-	__m128i xmm3 = ret->xmm[3];
-#endif
+	ethash_calculate_dag_items(ret, &node_index, 1, light);
+}
 
-	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {
-		uint32_t parent_index = fnv_hash(node_index ^ i, ret->words[i % NODE_WORDS]) % num_parent_nodes;
-		node const *parent = &cache_nodes[parent_index];
-
-#if defined(_M_X64) && ENABLE_SSE
-		{
-			xmm0 = _mm_mullo_epi32(xmm0, fnv_prime);
-			xmm1 = _mm_mullo_epi32(xmm1, fnv_prime);
-			xmm2 = _mm_mullo_epi32(xmm2, fnv_prime);
-			xmm3 = _mm_mullo_epi32(xmm3, fnv_prime);
-			xmm0 = _mm_xor_si128(xmm0, parent->xmm[0]);
-			xmm1 = _mm_xor_si128(xmm1, parent->xmm[1]);
-			xmm2 = _mm_xor_si128(xmm2, parent->xmm[2]);
-			xmm3 = _mm_xor_si128(xmm3, parent->xmm[3]);
-
-			// have to write to ret as values are used to compute index
-			ret->xmm[0] = xmm0;
-			ret->xmm[1] = xmm1;
-			ret->xmm[2] = xmm2;
-			ret->xmm[3] = xmm3;
-		}
-		#else
-		{
-			for (unsigned w = 0; w != NODE_WORDS; ++w) {
-				ret->words[w] = fnv_hash(ret->words[w], parent->words[w]);
-			}
+void ethash_calculate_dag_range(
+	node* const full_nodes,
+	uint32_t begin,
+	uint32_t end,
+	ethash_light_t const light
+)
+{
+	uint32_t items[ETHASH_BATCH_LANES * MIX_NODES];
+	for (uint32_t i = begin; i < end; i += ETHASH_BATCH_LANES * MIX_NODES) {
+		uint32_t const left = end - i;
+		uint32_t const count = left < ETHASH_BATCH_LANES * MIX_NODES ? left : ETHASH_BATCH_LANES * MIX_NODES;
+		for (uint32_t k = 0; k != count; ++k) {
+			items[k] = i + k;
 		}
-#endif
+		ethash_calculate_dag_items(&full_nodes[i], items, count, light);
 	}
-	SHA3_512(ret->bytes, ret->bytes, sizeof(node));
+}
+
+// the seed hash in s_mix[0], replicated across mix
+static void ethash_hash_spread(node* s_mix)
+{
+	fix_endian_arr32(s_mix[0].words, 16);
+
+	node* const mix = s_mix + 1;
+	for (uint32_t w = 0; w != MIX_WORDS; ++w) {
+		mix->words[w] = s_mix[0].words[w % NODE_WORDS];
+	}
+}
+
+// pack hash and nonce together into first 40 bytes of s_mix, hash it and
+// replicate across mix
+static void ethash_hash_init(
+	node* s_mix,
+	ethash_h256_t const* header_hash,
+	uint64_t const nonce
+)
+{
+	memcpy(s_mix[0].bytes, header_hash, 32);
+	fix_endian64(s_mix[0].double_words[4], nonce);
+
+	// compute sha3-512 hash and replicate across mix
+	SHA3_512(s_mix->bytes, s_mix->bytes, 40);
+	ethash_hash_spread(s_mix);
+}
+
+// the compressed mix goes into the mix hash and after the seed hash in
+// s_mix, for the final Keccak-256 over the two
+static void ethash_hash_compress(ethash_return_value_t* ret, node* s_mix)
+{
+	node* const mix = s_mix + 1;
+
+	// compress mix
+	for (uint32_t w = 0; w != MIX_WORDS; w += 4) {
+		uint32_t reduction = mix->words[w + 0];
+		reduction = reduction * FNV_PRIME ^ mix->words[w + 1];
+		reduction = reduction * FNV_PRIME ^ mix->words[w + 2];
+		reduction = reduction * FNV_PRIME ^ mix->words[w + 3];
+		mix->words[w / 4] = reduction;
+	}
+
+	fix_endian_arr32(mix->words, MIX_WORDS / 4);
+	memcpy(&ret->mix_hash, mix->bytes, 32);
+}
+
+static void ethash_hash_final(ethash_return_value_t* ret, node* s_mix)
+{
+	ethash_hash_compress(ret, s_mix);
+	// final Keccak hash
+	SHA3_256(&ret->result, s_mix->bytes, 64 + 32); // Keccak-256(s + compressed_mix)
 }
 
 static bool ethash_hash(
@@ -144,20 +312,10 @@ static bool ethash_hash(
 		return false;
 	}
 
-	// pack hash and nonce together into first 40 bytes of s_mix
 	assert(sizeof(node) * 8 == 512);
 	node s_mix[MIX_NODES + 1];
-	memcpy(s_mix[0].bytes, &header_hash, 32);
-	fix_endian64(s_mix[0].double_words[4], nonce);
-
-	// compute sha3-512 hash and replicate across mix
-	SHA3_512(s_mix->bytes, s_mix->bytes, 40);
-	fix_endian_arr32(s_mix[0].words, 16);
-
+	ethash_hash_init(s_mix, &header_hash, nonce);
 	node* const mix = s_mix + 1;
-	for (uint32_t w = 0; w != MIX_WORDS; ++w) {
-		mix->words[w] = s_mix[0].words[w % NODE_WORDS];
-	}
 
 	unsigned const page_size = sizeof(uint32_t) * MIX_WORDS;
 	unsigned const num_full_pages = (unsigned) (full_size / page_size);
@@ -165,65 +323,105 @@ static bool ethash_hash(
 	for (unsigned i = 0; i != ETHASH_ACCESSES; ++i) {
 		uint32_t const index = fnv_hash(s_mix->words[0] ^ i, mix->words[i % MIX_WORDS]) % num_full_pages;
 
-		for (unsigned n = 0; n != MIX_NODES; ++n) {
-			node const* dag_node;
-			if (full_nodes) {
-				dag_node = &full_nodes[MIX_NODES * index + n];
-			} else {
-				node tmp_node;
-				ethash_calculate_dag_item(&tmp_node, index * MIX_NODES + n, light);
-				dag_node = &tmp_node;
-			}
-
-#if defined(_M_X64) && ENABLE_SSE
-			{
-				__m128i fnv_prime = _mm_set1_epi32(FNV_PRIME);
-				__m128i xmm0 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[0]);
-				__m128i xmm1 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[1]);
-				__m128i xmm2 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[2]);
-				__m128i xmm3 = _mm_mullo_epi32(fnv_prime, mix[n].xmm[3]);
-				mix[n].xmm[0] = _mm_xor_si128(xmm0, dag_node->xmm[0]);
-				mix[n].xmm[1] = _mm_xor_si128(xmm1, dag_node->xmm[1]);
-				mix[n].xmm[2] = _mm_xor_si128(xmm2, dag_node->xmm[2]);
-				mix[n].xmm[3] = _mm_xor_si128(xmm3, dag_node->xmm[3]);
-			}
-			#else
-			{
-				for (unsigned w = 0; w != NODE_WORDS; ++w) {
-					mix[n].words[w] = fnv_hash(mix[n].words[w], dag_node->words[w]);
-				}
+		if (full_nodes) {
+			ethash_fnv_nodes(mix, &full_nodes[MIX_NODES * index], MIX_NODES);
+		} else {
+			node dag_nodes[MIX_NODES];
+			uint32_t items[MIX_NODES];
+			for (unsigned n = 0; n != MIX_NODES; ++n) {
+				items[n] = index * MIX_NODES + n;
 			}
-#endif
+			ethash_calculate_dag_items(dag_nodes, items, MIX_NODES, light);
+			ethash_fnv_nodes(mix, dag_nodes, MIX_NODES);
 		}
+	}
+
+	ethash_hash_final(ret, s_mix);
+	return true;
+}
 
+// Light evaluation of up to ETHASH_BATCH_LANES nonces in lock step: every
+// access round gathers the DAG items of all lanes into a single
+// ethash_calculate_dag_items() call.
+static void ethash_light_hash_lanes(
+	ethash_return_value_t* ret,
+	ethash_light_t const light,
+	unsigned const num_full_pages,
+	ethash_h256_t const* header_hash,
+	uint64_t const* nonces,
+	uint32_t lanes
+)
+{
+	node s_mix[ETHASH_BATCH_LANES][MIX_NODES + 1];
+	node dag_nodes[ETHASH_BATCH_LANES * MIX_NODES];
+	uint32_t items[ETHASH_BATCH_LANES * MIX_NODES];
+	uint8_t* seeds[ETHASH_BATCH_LANES];
+
+	// as ethash_hash_init(), with one multi-buffer hash for all lanes
+	for (uint32_t l = 0; l != lanes; ++l) {
+		memcpy(s_mix[l][0].bytes, header_hash, 32);
+		fix_endian64(s_mix[l][0].double_words[4], nonces[l]);
+		seeds[l] = s_mix[l][0].bytes;
+	}
+	SHA3_512_xN(seeds, (uint8_t const* const*)seeds, 40, lanes);
+	for (uint32_t l = 0; l != lanes; ++l) {
+		ethash_hash_spread(s_mix[l]);
 	}
 
-	// compress mix
-	for (uint32_t w = 0; w != MIX_WORDS; w += 4) {
-		uint32_t reduction = mix->words[w + 0];
-		reduction = reduction * FNV_PRIME ^ mix->words[w + 1];
-		reduction = reduction * FNV_PRIME ^ mix->words[w + 2];
-		reduction = reduction * FNV_PRIME ^ mix->words[w + 3];
-		mix->words[w / 4] = reduction;
+	for (unsigned i = 0; i != ETHASH_ACCESSES; ++i) {
+		for (uint32_t l = 0; l != lanes; ++l) {
+			node const* mix = s_mix[l] + 1;
+			uint32_t const index = fnv_hash(s_mix[l][0].words[0] ^ i, mix->words[i % MIX_WORDS]) % num_full_pages;
+			for (unsigned n = 0; n != MIX_NODES; ++n) {
+				items[l * MIX_NODES + n] = index * MIX_NODES + n;
+			}
+		}
+		ethash_calculate_dag_items(dag_nodes, items, lanes * MIX_NODES, light);
+		for (uint32_t l = 0; l != lanes; ++l) {
+			ethash_fnv_nodes(s_mix[l] + 1, &dag_nodes[l * MIX_NODES], MIX_NODES);
+		}
 	}
 
-	fix_endian_arr32(mix->words, MIX_WORDS / 4);
-	memcpy(&ret->mix_hash, mix->bytes, 32);
-	// final Keccak hash
-	SHA3_256(&ret->result, s_mix->bytes, 64 + 32); // Keccak-256(s + compressed_mix)
-	return true;
+	uint8_t* results[ETHASH_BATCH_LANES];
+	for (uint32_t l = 0; l != lanes; ++l) {
+		ethash_hash_compress(&ret[l], s_mix[l]);
+		results[l] = ret[l].result.b;
+		ret[l].success = true;
+	}
+	SHA3_256_xN(results, (uint8_t const* const*)seeds, 64 + 32, lanes);
 }
 
 ethash_h256_t ethash_get_seedhash(uint64_t block_number)
 {
 	ethash_h256_t ret;
-	ethash_h256_reset(&ret);
 	uint64_t const epochs = block_number / ETHASH_EPOCH_LENGTH;
-	for (uint32_t i = 0; i < epochs; ++i)
+	uint64_t const tabulated = epochs < ETHASH_TABULATED_EPOCHS ? epochs : ETHASH_TABULATED_EPOCHS - 1;
+	memcpy(&ret, seed_hashes[tabulated], 32);
+	for (uint64_t i = tabulated; i < epochs; ++i)
 		SHA3_256(&ret, (uint8_t*)&ret, 32);
 	return ret;
 }
 
+int ethash_get_epoch(ethash_h256_t const seedhash)
+{
+	uint32_t const key = (uint32_t)seedhash.b[0] | (uint32_t)seedhash.b[1] << 8 |
+		(uint32_t)seedhash.b[2] << 16 | (uint32_t)seedhash.b[3] << 24;
+	for (uint32_t slot = key % ETHASH_SEED_INDEX_SIZE; seed_index[slot]; slot = (slot + 1) % ETHASH_SEED_INDEX_SIZE) {
+		int const epoch = seed_index[slot] - 1;
+		if (memcmp(seed_hashes[epoch], seedhash.b, 32) == 0)
+			return epoch;
+	}
+	// Beyond the table: follow the chain on from the last tabulated seed.
+	ethash_h256_t seed;
+	memcpy(&seed, seed_hashes[ETHASH_TABULATED_EPOCHS - 1], 32);
+	for (int epoch = ETHASH_TABULATED_EPOCHS; epoch < ETHASH_MAX_EPOCHS; ++epoch) {
+		SHA3_256(&seed, (uint8_t*)&seed, 32);
+		if (memcmp(seed.b, seedhash.b, 32) == 0)
+			return epoch;
+	}
+	return -1;
+}
+
 ethash_light_t ethash_light_new_internal(uint64_t cache_size, ethash_h256_t const* seed)
 {
 	struct ethash_light *ret;
@@ -231,7 +429,7 @@ ethash_light_t ethash_light_new_internal(uint64_t cache_size, ethash_h256_t cons
 	if (!ret) {
 		return NULL;
 	}
-	ret->cache = malloc((size_t)cache_size);
+	ret->cache = ethash_huge_alloc((size_t)cache_size);
 	if (!ret->cache) {
 		goto fail_free_light;
 	}
@@ -243,7 +441,7 @@ ethash_light_t ethash_light_new_internal(uint64_t cache_size, ethash_h256_t cons
 	return ret;
 
 fail_free_cache_mem:
-	free(ret->cache);
+	ethash_huge_free(ret->cache, (size_t)cache_size);
 fail_free_light:
 	free(ret);
 	return NULL;
@@ -261,7 +459,7 @@ ethash_light_t ethash_light_new(uint64_t block_number)
 void ethash_light_delete(ethash_light_t light)
 {
 	if (light->cache) {
-		free(light->cache);
+		ethash_huge_free(light->cache, (size_t)light->cache_size);
 	}
 	free(light);
 }
@@ -281,6 +479,40 @@ ethash_return_value_t ethash_light_compute_internal(
 	return ret;
 }
 
+ethash_return_value_t ethash_full_compute_internal(
+	void const* full_nodes,
+	uint64_t full_size,
+	ethash_h256_t const header_hash,
+	uint64_t nonce
+)
+{
+	ethash_return_value_t ret;
+	ret.success = true;
+	if (!ethash_hash(&ret, (node const*)full_nodes, NULL, full_size, header_hash, nonce)) {
+		ret.success = false;
+	}
+	return ret;
+}
+
+ethash_h256_t ethash_quick_hash(
+	ethash_h256_t const* header_hash,
+	uint64_t const nonce,
+	ethash_h256_t const* mix_hash
+)
+{
+	// the seed node followed by the compressed mix, as in ethash_hash_final()
+	node s_mix[2];
+	memcpy(s_mix[0].bytes, header_hash, 32);
+	fix_endian64(s_mix[0].double_words[4], nonce);
+	SHA3_512(s_mix->bytes, s_mix->bytes, 40);
+	fix_endian_arr32(s_mix[0].words, 16);
+	memcpy(s_mix[1].bytes, mix_hash, 32);
+
+	ethash_h256_t ret;
+	SHA3_256(&ret, s_mix->bytes, 64 + 32);
+	return ret;
+}
+
 ethash_return_value_t ethash_light_compute(
 	ethash_light_t light,
 	ethash_h256_t const header_hash,
@@ -290,3 +522,26 @@ ethash_return_value_t ethash_light_compute(
 	uint64_t full_size = ethash_get_datasize(light->block_number);
 	return ethash_light_compute_internal(light, full_size, header_hash, nonce);
 }
+
+void ethash_light_compute_batch(
+	ethash_light_t light,
+	ethash_h256_t const header_hash,
+	uint64_t const* nonces,
+	size_t count,
+	ethash_return_value_t* results
+)
+{
+	uint64_t const full_size = ethash_get_datasize(light->block_number);
+	if (full_size % MIX_WORDS != 0) {
+		for (size_t i = 0; i != count; ++i) {
+			results[i].success = false;
+		}
+		return;
+	}
+	unsigned const num_full_pages = (unsigned) (full_size / (sizeof(uint32_t) * MIX_WORDS));
+	for (size_t i = 0; i < count; i += ETHASH_BATCH_LANES) {
+		size_t const left = count - i;
+		uint32_t const lanes = (uint32_t) (left < ETHASH_BATCH_LANES ? left : ETHASH_BATCH_LANES);
+		ethash_light_hash_lanes(&results[i], light, num_full_pages, &header_hash, &nonces[i], lanes);
+	}
+}
@@ -4,12 +4,6 @@
 #include "ethash.h"
 #include <stdio.h>
 
-#define ENABLE_SSE 0
-
-#if defined(_M_X64) && ENABLE_SSE
-#include <smmintrin.h>
-#endif
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,17 +12,20 @@ extern "C" {
 #define NODE_WORDS (64/4)
 #define MIX_WORDS (ETHASH_MIX_BYTES/4)
 #define MIX_NODES (MIX_WORDS / NODE_WORDS)
+// number of nonces evaluated in lock step by ethash_light_compute_batch()
+#define ETHASH_BATCH_LANES 8
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ethash_prefetch(addr_) __builtin_prefetch(addr_)
+#else
+#define ethash_prefetch(addr_) ((void)(addr_))
+#endif
 #include <stdint.h>
 
 typedef union node {
 	uint8_t bytes[NODE_WORDS * 4];
 	uint32_t words[NODE_WORDS];
 	uint64_t double_words[NODE_WORDS / 2];
-
-#if defined(_M_X64) && ENABLE_SSE
-	__m128i xmm[NODE_WORDS/4];
-#endif
-
 } node;
 
 static inline void ethash_h256_reset(ethash_h256_t* hash)
@@ -75,6 +72,38 @@ void ethash_calculate_dag_item(
 	ethash_light_t const cache
 );
 
+/**
+ * Calculate the DAG items [begin, end) into their place in a full DAG buffer.
+ * Disjoint ranges may be computed concurrently from several threads.
+ *
+ * @param full_nodes     The full DAG buffer, indexed by node number
+ * @param begin          First node to compute
+ * @param end            One past the last node to compute
+ * @param light          The light client handler of the DAG's epoch
+ */
+void ethash_calculate_dag_range(
+	node* const full_nodes,
+	uint32_t begin,
+	uint32_t end,
+	ethash_light_t const light
+);
+
+/**
+ * Calculate the hash of a nonce against a complete DAG held in memory.
+ *
+ * @param full_nodes     The full DAG, as produced by @ref ethash_calculate_dag_range()
+ * @param full_size      The size of the full data in bytes.
+ * @param header_hash    The header hash to pack into the mix
+ * @param nonce          The nonce to pack into the mix
+ * @return               The resulting hash.
+ */
+ethash_return_value_t ethash_full_compute_internal(
+	void const* full_nodes,
+	uint64_t full_size,
+	ethash_h256_t const header_hash,
+	uint64_t nonce
+);
+
 uint64_t ethash_get_datasize(uint64_t const block_number);
 uint64_t ethash_get_cachesize(uint64_t const block_number);
 
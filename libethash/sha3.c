@@ -43,29 +43,37 @@ static const uint64_t RC[24] = \
 	v = 0;										\
 	REPEAT5(e; v += s;)
 
+/*** The linear steps of a round: theta, rho and pi ***/
+static inline void theta_rho_pi(uint64_t* a) {
+	uint64_t b[5] = {0};
+	uint64_t t = 0;
+	uint8_t x, y;
+
+	// Theta
+	FOR5(x, 1,
+			b[x] = 0;
+			FOR5(y, 5,
+					b[x] ^= a[x + y]; ))
+	FOR5(x, 1,
+			FOR5(y, 5,
+					a[y + x] ^= b[(x + 4) % 5] ^ rol(b[(x + 1) % 5], 1); ))
+	// Rho and pi
+	t = a[1];
+	x = 0;
+	REPEAT24(b[0] = a[pi[x]];
+			a[pi[x]] = rol(t, rho[x]);
+			t = b[0];
+			x++; )
+}
+
 /*** Keccak-f[1600] ***/
 static inline void keccakf(void* state) {
 	uint64_t* a = (uint64_t*)state;
 	uint64_t b[5] = {0};
-	uint64_t t = 0;
 	uint8_t x, y;
 
 	for (int i = 0; i < 24; i++) {
-		// Theta
-		FOR5(x, 1,
-				b[x] = 0;
-				FOR5(y, 5,
-						b[x] ^= a[x + y]; ))
-		FOR5(x, 1,
-				FOR5(y, 5,
-						a[y + x] ^= b[(x + 4) % 5] ^ rol(b[(x + 1) % 5], 1); ))
-		// Rho and pi
-		t = a[1];
-		x = 0;
-		REPEAT24(b[0] = a[pi[x]];
-				a[pi[x]] = rol(t, rho[x]);
-				t = b[0];
-				x++; )
+		theta_rho_pi(a);
 		// Chi
 		FOR5(y,
 				5,
@@ -149,3 +157,21 @@ static inline int hash(uint8_t* out, size_t outlen,
 /*** FIPS202 SHA3 FOFs ***/
 defsha3(256)
 defsha3(512)
+
+void ethash_keccak_job(uint8_t const* header, uint64_t* lanes, uint64_t* chi)
+{
+	// sha3_512(header .. nonce) with a nonce of 0: theta, rho and pi are
+	// linear, the nonce only adds its rotations to the lanes.
+	uint64_t a[25] = {0};
+	memcpy(a, header, 32);
+	a[5] = 0x01;
+	a[8] = 0x8000000000000000ULL;
+	theta_rho_pi(a);
+	memcpy(lanes, a, sizeof(a));
+	// Of the rows' chi terms, these combine two lanes without the nonce.
+	chi[0] = ~a[1] & a[2];
+	chi[1] = ~a[8] & a[9];
+	chi[2] = ~a[10] & a[11];
+	chi[3] = ~a[17] & a[18];
+	chi[4] = ~a[24] & a[20];
+}
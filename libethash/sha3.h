@@ -26,6 +26,18 @@ static inline void SHA3_512(uint8_t* ret, uint8_t const* data, size_t const size
 	sha3_512(ret, 64, data, size);
 }
 
+/**
+ * The first Keccak-f[1600] round of sha3_512(header .. nonce), as far as it
+ * does not depend on the nonce, for the GPU searches to start from.
+ * @param lanes The 25 lanes after theta, rho and pi for a nonce of 0. The
+ * nonce's share is itself rotated: lane 0 by 0, 3 by 22, 5 by 29, 7 by 3,
+ * 12 by 26, 14 by 18, 15 by 27, 16 by 36, 19 by 57, 21 by 56 and 23 by 41
+ * bits; the others have none.
+ * @param chi The chi terms without the nonce, ~b[x+1] & b[x+2], of the lanes
+ * 0, 7, 14, 16 and 23, one per row.
+ */
+void ethash_keccak_job(uint8_t const* header, uint64_t* lanes, uint64_t* chi);
+
 #ifdef __cplusplus
 }
 #endif
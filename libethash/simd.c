@@ -0,0 +1,472 @@
+/*
+  This file is part of ethash.
+
+  ethash is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ethash is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with cpp-ethereum.	If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file simd.c
+* @date 2018
+*/
+
+#include "simd.h"
+#include "fnv.h"
+#include "sha3.h"
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ETHASH_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define ETHASH_SIMD_X86 0
+#endif
+
+static void fnv_nodes_scalar(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	for (uint32_t n = 0; n != count; ++n) {
+		for (unsigned w = 0; w != NODE_WORDS; ++w) {
+			dst[n].words[w] = fnv_hash(dst[n].words[w], src[n].words[w]);
+		}
+	}
+}
+
+static void xor_nodes_scalar(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	for (uint32_t n = 0; n != count; ++n) {
+		for (unsigned w = 0; w != NODE_WORDS / 2; ++w) {
+			dst[n].double_words[w] ^= src[n].double_words[w];
+		}
+	}
+}
+
+// The DATASET_PARENTS rounds of the DAG item calculation, for several items
+// interleaved (see ethash_calculate_dag_items()). This is the hot loop of the
+// light evaluation, so the FNV step is inlined into a copy of it per target
+// rather than called through ethash_fnv_nodes.
+#define ETHASH_DEFINE_DAG_PARENTS(suffix_, attr_, fnv_node_)														\
+attr_ static void dag_parents_##suffix_(																			\
+	node* ret, uint32_t const* node_indices, uint32_t count, node const* cache_nodes, uint32_t num_parent_nodes)	\
+{																													\
+	uint32_t parents[ETHASH_BATCH_LANES * MIX_NODES];																\
+	for (uint32_t k = 0; k != count; ++k) {																			\
+		parents[k] = fnv_hash(node_indices[k], ret[k].words[0]) % num_parent_nodes;									\
+		ethash_prefetch(&cache_nodes[parents[k]]);																	\
+	}																												\
+	for (uint32_t i = 0; i != ETHASH_DATASET_PARENTS; ++i) {														\
+		uint32_t const next = i + 1;																				\
+		for (uint32_t k = 0; k != count; ++k) {																		\
+			node const* parent = &cache_nodes[parents[k]];															\
+			/* the next index only needs one word: compute it on the scalar side */									\
+			uint32_t const w = next % NODE_WORDS;																	\
+			uint32_t const word = fnv_hash(ret[k].words[w], parent->words[w]);										\
+			fnv_node_(&ret[k], parent);																				\
+			if (next != ETHASH_DATASET_PARENTS) {																	\
+				parents[k] = fnv_hash(node_indices[k] ^ next, word) % num_parent_nodes;								\
+				ethash_prefetch(&cache_nodes[parents[k]]);															\
+			}																										\
+		}																											\
+	}																												\
+}
+
+static inline void fnv_node_scalar(node* restrict dst, node const* restrict src)
+{
+	for (unsigned w = 0; w != NODE_WORDS; ++w) {
+		dst->words[w] = fnv_hash(dst->words[w], src->words[w]);
+	}
+}
+
+ETHASH_DEFINE_DAG_PARENTS(scalar, , fnv_node_scalar)
+
+static void sha3_256_xn_scalar(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count)
+{
+	for (uint32_t i = 0; i != count; ++i) {
+		sha3_256(out[i], 32, in[i], size);
+	}
+}
+
+static void sha3_512_xn_scalar(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count)
+{
+	for (uint32_t i = 0; i != count; ++i) {
+		sha3_512(out[i], 64, in[i], size);
+	}
+}
+
+#if ETHASH_SIMD_X86
+
+// Nodes are only guaranteed 8 byte alignment (they live in caches and
+// on the stack), so all loads and stores below are unaligned.
+
+__attribute__((target("sse4.1")))
+static void fnv_nodes_sse41(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	__m128i const fnv_prime = _mm_set1_epi32(FNV_PRIME);
+	for (uint32_t n = 0; n != count; ++n) {
+		__m128i* d = (__m128i*)dst[n].words;
+		__m128i const* s = (__m128i const*)src[n].words;
+		for (unsigned i = 0; i != NODE_WORDS / 4; ++i) {
+			__m128i x = _mm_mullo_epi32(_mm_loadu_si128(d + i), fnv_prime);
+			_mm_storeu_si128(d + i, _mm_xor_si128(x, _mm_loadu_si128(s + i)));
+		}
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void xor_nodes_sse41(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	for (uint32_t n = 0; n != count; ++n) {
+		__m128i* d = (__m128i*)dst[n].words;
+		__m128i const* s = (__m128i const*)src[n].words;
+		for (unsigned i = 0; i != NODE_WORDS / 4; ++i) {
+			_mm_storeu_si128(d + i, _mm_xor_si128(_mm_loadu_si128(d + i), _mm_loadu_si128(s + i)));
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void fnv_nodes_avx2(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	__m256i const fnv_prime = _mm256_set1_epi32(FNV_PRIME);
+	for (uint32_t n = 0; n != count; ++n) {
+		__m256i* d = (__m256i*)dst[n].words;
+		__m256i const* s = (__m256i const*)src[n].words;
+		__m256i x0 = _mm256_mullo_epi32(_mm256_loadu_si256(d), fnv_prime);
+		__m256i x1 = _mm256_mullo_epi32(_mm256_loadu_si256(d + 1), fnv_prime);
+		_mm256_storeu_si256(d, _mm256_xor_si256(x0, _mm256_loadu_si256(s)));
+		_mm256_storeu_si256(d + 1, _mm256_xor_si256(x1, _mm256_loadu_si256(s + 1)));
+	}
+}
+
+__attribute__((target("avx2")))
+static void xor_nodes_avx2(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	for (uint32_t n = 0; n != count; ++n) {
+		__m256i* d = (__m256i*)dst[n].words;
+		__m256i const* s = (__m256i const*)src[n].words;
+		_mm256_storeu_si256(d, _mm256_xor_si256(_mm256_loadu_si256(d), _mm256_loadu_si256(s)));
+		_mm256_storeu_si256(d + 1, _mm256_xor_si256(_mm256_loadu_si256(d + 1), _mm256_loadu_si256(s + 1)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void fnv_nodes_avx512(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	__m512i const fnv_prime = _mm512_set1_epi32(FNV_PRIME);
+	for (uint32_t n = 0; n != count; ++n) {
+		__m512i x = _mm512_mullo_epi32(_mm512_loadu_si512(dst[n].words), fnv_prime);
+		_mm512_storeu_si512(dst[n].words, _mm512_xor_si512(x, _mm512_loadu_si512(src[n].words)));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void xor_nodes_avx512(node* restrict dst, node const* restrict src, uint32_t count)
+{
+	for (uint32_t n = 0; n != count; ++n) {
+		__m512i x = _mm512_loadu_si512(dst[n].words);
+		_mm512_storeu_si512(dst[n].words, _mm512_xor_si512(x, _mm512_loadu_si512(src[n].words)));
+	}
+}
+
+__attribute__((target("sse4.1")))
+static inline void fnv_node_sse41(node* restrict dst, node const* restrict src)
+{
+	fnv_nodes_sse41(dst, src, 1);
+}
+
+__attribute__((target("avx2")))
+static inline void fnv_node_avx2(node* restrict dst, node const* restrict src)
+{
+	fnv_nodes_avx2(dst, src, 1);
+}
+
+__attribute__((target("avx512f")))
+static inline void fnv_node_avx512(node* restrict dst, node const* restrict src)
+{
+	fnv_nodes_avx512(dst, src, 1);
+}
+
+ETHASH_DEFINE_DAG_PARENTS(sse41, __attribute__((target("sse4.1"))), fnv_node_sse41)
+ETHASH_DEFINE_DAG_PARENTS(avx2, __attribute__((target("avx2"))), fnv_node_avx2)
+ETHASH_DEFINE_DAG_PARENTS(avx512, __attribute__((target("avx512f"))), fnv_node_avx512)
+
+// Multi-buffer Keccak-f[1600]: the states of several inputs side by side,
+// word w of lane l at state[w * lanes + l], so that every vector operation
+// advances all lanes by one step of the permutation. The constants are those
+// of sha3.c.
+static const uint8_t keccak_rho[24] = {
+	1, 3, 6, 10, 15, 21, 28, 36, 45, 55, 2, 14,
+	27, 41, 56, 8, 25, 43, 62, 18, 39, 61, 20, 44
+};
+static const uint8_t keccak_pi[24] = {
+	10, 7, 11, 17, 18, 3, 5, 16, 8, 21, 24, 4,
+	15, 23, 19, 13, 12, 2, 20, 14, 22, 9, 6, 1
+};
+static const uint64_t keccak_rc[24] = {
+	0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+	0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+	0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+	0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+	0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+	0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+// The permutation's inner loops must unroll for the state to stay in
+// registers and for the rotations to be by constants.
+#if defined(__clang__)
+#define ETHASH_UNROLL _Pragma("unroll")
+#else
+#define ETHASH_UNROLL _Pragma("GCC unroll 25")
+#endif
+
+#define ETHASH_DEFINE_KECCAKF(suffix_, attr_, vec_, lanes_, load_, store_, set1_, xor_, xor5_, rol_, chi_)		\
+attr_ static void keccakf_##suffix_(uint64_t* state)																\
+{																													\
+	vec_ a[25], b[5], t, u;																							\
+	for (unsigned i = 0; i != 25; ++i) {																			\
+		a[i] = load_(state + i * lanes_);																			\
+	}																												\
+	for (unsigned r = 0; r != 24; ++r) {																			\
+		/* theta */																									\
+		ETHASH_UNROLL for (unsigned x = 0; x != 5; ++x) {															\
+			b[x] = xor5_(a[x], a[x + 5], a[x + 10], a[x + 15], a[x + 20]);											\
+		}																											\
+		ETHASH_UNROLL for (unsigned x = 0; x != 5; ++x) {															\
+			t = xor_(b[(x + 4) % 5], rol_(b[(x + 1) % 5], 1));														\
+			ETHASH_UNROLL for (unsigned y = 0; y != 25; y += 5) {													\
+				a[y + x] = xor_(a[y + x], t);																		\
+			}																										\
+		}																											\
+		/* rho and pi */																							\
+		t = a[1];																									\
+		ETHASH_UNROLL for (unsigned x = 0; x != 24; ++x) {															\
+			u = a[keccak_pi[x]];																					\
+			a[keccak_pi[x]] = rol_(t, keccak_rho[x]);																\
+			t = u;																									\
+		}																											\
+		/* chi */																									\
+		ETHASH_UNROLL for (unsigned y = 0; y != 25; y += 5) {														\
+			ETHASH_UNROLL for (unsigned x = 0; x != 5; ++x) {														\
+				b[x] = a[y + x];																					\
+			}																										\
+			ETHASH_UNROLL for (unsigned x = 0; x != 5; ++x) {														\
+				a[y + x] = chi_(b[x], b[(x + 1) % 5], b[(x + 2) % 5]);												\
+			}																										\
+		}																											\
+		/* iota */																									\
+		a[0] = xor_(a[0], set1_((long long)keccak_rc[r]));															\
+	}																												\
+	for (unsigned i = 0; i != 25; ++i) {																			\
+		store_(state + i * lanes_, a[i]);																			\
+	}																												\
+}
+
+__attribute__((target("avx2")))
+static inline __m256i keccak_load_avx2(uint64_t const* p) { return _mm256_loadu_si256((__m256i const*)p); }
+__attribute__((target("avx2")))
+static inline void keccak_store_avx2(uint64_t* p, __m256i v) { _mm256_storeu_si256((__m256i*)p, v); }
+__attribute__((target("avx2")))
+static inline __m256i keccak_xor5_avx2(__m256i a, __m256i b, __m256i c, __m256i d, __m256i e)
+{
+	return _mm256_xor_si256(_mm256_xor_si256(_mm256_xor_si256(a, b), _mm256_xor_si256(c, d)), e);
+}
+__attribute__((target("avx2")))
+static inline __m256i keccak_rol_avx2(__m256i v, int s)
+{
+	return _mm256_or_si256(_mm256_slli_epi64(v, s), _mm256_srli_epi64(v, 64 - s));
+}
+// a ^ (~b & c)
+__attribute__((target("avx2")))
+static inline __m256i keccak_chi_avx2(__m256i a, __m256i b, __m256i c)
+{
+	return _mm256_xor_si256(a, _mm256_andnot_si256(b, c));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i keccak_load_avx512(uint64_t const* p) { return _mm512_loadu_si512(p); }
+__attribute__((target("avx512f")))
+static inline void keccak_store_avx512(uint64_t* p, __m512i v) { _mm512_storeu_si512(p, v); }
+__attribute__((target("avx512f")))
+static inline __m512i keccak_xor5_avx512(__m512i a, __m512i b, __m512i c, __m512i d, __m512i e)
+{
+	// 0x96 is the three way xor
+	return _mm512_ternarylogic_epi64(_mm512_ternarylogic_epi64(a, b, c, 0x96), d, e, 0x96);
+}
+__attribute__((target("avx512f")))
+static inline __m512i keccak_rol_avx512(__m512i v, int s)
+{
+	return _mm512_rolv_epi64(v, _mm512_set1_epi64(s));
+}
+__attribute__((target("avx512f")))
+static inline __m512i keccak_chi_avx512(__m512i a, __m512i b, __m512i c)
+{
+	return _mm512_ternarylogic_epi64(a, b, c, 0xd2);
+}
+
+ETHASH_DEFINE_KECCAKF(avx2, __attribute__((target("avx2"))), __m256i, 4, keccak_load_avx2, keccak_store_avx2,
+	_mm256_set1_epi64x, _mm256_xor_si256, keccak_xor5_avx2, keccak_rol_avx2, keccak_chi_avx2)
+ETHASH_DEFINE_KECCAKF(avx512, __attribute__((target("avx512f"))), __m512i, 8, keccak_load_avx512, keccak_store_avx512,
+	_mm512_set1_epi64, _mm512_xor_si512, keccak_xor5_avx512, keccak_rol_avx512, keccak_chi_avx512)
+
+#define ETHASH_SHA3_MAX_LANES 8
+
+// The SHA3 sponge (as hash() in sha3.c) over @a lanes inputs at a time, with a
+// lane-interleaved permutation. A group of one goes to the scalar code, which
+// is quicker for it. x86 only, so the state words are read little endian.
+static void sha3_lanes(
+	void (*permute)(uint64_t*),
+	unsigned lanes,
+	int (*single)(uint8_t*, size_t, uint8_t const*, size_t),
+	uint8_t* const* out,
+	size_t outlen,
+	uint8_t const* const* in,
+	size_t inlen,
+	uint32_t count,
+	size_t rate
+)
+{
+	uint64_t state[25 * ETHASH_SHA3_MAX_LANES];
+	uint8_t block[200];
+	for (uint32_t base = 0; base < count; base += lanes) {
+		uint32_t const n = count - base < lanes ? count - base : lanes;
+		if (n == 1) {
+			single(out[base], outlen, in[base], inlen);
+			continue;
+		}
+		memset(state, 0, sizeof(uint64_t) * 25 * lanes);
+		for (size_t off = 0;; off += rate) {
+			size_t const left = inlen - off;
+			size_t const take = left < rate ? left : rate;
+			for (unsigned l = 0; l != lanes; ++l) {
+				// lanes past the inputs hash the first one again, for nothing
+				uint8_t const* src = in[base + (l < n ? l : 0)] + off;
+				if (take != rate) {
+					memset(block, 0, rate);
+					memcpy(block, src, take);
+					block[take] ^= 0x01;
+					block[rate - 1] ^= 0x80;
+					src = block;
+				}
+				for (size_t w = 0; w != rate / 8; ++w) {
+					uint64_t v;
+					memcpy(&v, src + w * 8, 8);
+					state[w * lanes + l] ^= v;
+				}
+			}
+			permute(state);
+			if (take != rate) {
+				break;
+			}
+		}
+		for (uint32_t l = 0; l != n; ++l) {
+			for (size_t w = 0; w != outlen / 8; ++w) {
+				memcpy(out[base + l] + w * 8, &state[w * lanes + l], 8);
+			}
+		}
+	}
+}
+
+static void sha3_256_xn_avx2(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count)
+{
+	sha3_lanes(keccakf_avx2, 4, sha3_256, out, 32, in, size, count, 200 - 256 / 4);
+}
+
+static void sha3_512_xn_avx2(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count)
+{
+	sha3_lanes(keccakf_avx2, 4, sha3_512, out, 64, in, size, count, 200 - 512 / 4);
+}
+
+static void sha3_256_xn_avx512(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count)
+{
+	sha3_lanes(keccakf_avx512, 8, sha3_256, out, 32, in, size, count, 200 - 256 / 4);
+}
+
+static void sha3_512_xn_avx512(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count)
+{
+	sha3_lanes(keccakf_avx512, 8, sha3_512, out, 64, in, size, count, 200 - 512 / 4);
+}
+
+#endif // ETHASH_SIMD_X86
+
+ethash_fnv_nodes_fn ethash_fnv_nodes = fnv_nodes_scalar;
+ethash_xor_nodes_fn ethash_xor_nodes = xor_nodes_scalar;
+ethash_dag_parents_fn ethash_dag_parents = dag_parents_scalar;
+ethash_sha3_xn_fn ethash_sha3_256_xn = sha3_256_xn_scalar;
+ethash_sha3_xn_fn ethash_sha3_512_xn = sha3_512_xn_scalar;
+static ethash_simd_level_t s_level = ETHASH_SIMD_NONE;
+
+void ethash_simd_init(ethash_simd_level_t max_level)
+{
+	ethash_simd_level_t level = ETHASH_SIMD_NONE;
+	ethash_fnv_nodes_fn fnv = fnv_nodes_scalar;
+	ethash_xor_nodes_fn xorn = xor_nodes_scalar;
+	ethash_dag_parents_fn parents = dag_parents_scalar;
+	// There is no two lane SSE Keccak: it would not beat the scalar one.
+	ethash_sha3_xn_fn sha3_256_xn = sha3_256_xn_scalar;
+	ethash_sha3_xn_fn sha3_512_xn = sha3_512_xn_scalar;
+
+#if ETHASH_SIMD_X86
+	__builtin_cpu_init();
+	if (max_level >= ETHASH_SIMD_AVX512 && __builtin_cpu_supports("avx512f")) {
+		level = ETHASH_SIMD_AVX512;
+		fnv = fnv_nodes_avx512;
+		xorn = xor_nodes_avx512;
+		parents = dag_parents_avx512;
+		sha3_256_xn = sha3_256_xn_avx512;
+		sha3_512_xn = sha3_512_xn_avx512;
+	}
+	else if (max_level >= ETHASH_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+		level = ETHASH_SIMD_AVX2;
+		fnv = fnv_nodes_avx2;
+		xorn = xor_nodes_avx2;
+		parents = dag_parents_avx2;
+		sha3_256_xn = sha3_256_xn_avx2;
+		sha3_512_xn = sha3_512_xn_avx2;
+	}
+	else if (max_level >= ETHASH_SIMD_SSE41 && __builtin_cpu_supports("sse4.1")) {
+		level = ETHASH_SIMD_SSE41;
+		fnv = fnv_nodes_sse41;
+		xorn = xor_nodes_sse41;
+		parents = dag_parents_sse41;
+	}
+#else
+	(void)max_level;
+#endif
+
+	ethash_fnv_nodes = fnv;
+	ethash_xor_nodes = xorn;
+	ethash_dag_parents = parents;
+	ethash_sha3_256_xn = sha3_256_xn;
+	ethash_sha3_512_xn = sha3_512_xn;
+	s_level = level;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor))
+static void ethash_simd_autoinit(void)
+{
+	ethash_simd_init(ETHASH_SIMD_AVX512);
+}
+#endif
+
+ethash_simd_level_t ethash_simd_level(void)
+{
+	return s_level;
+}
+
+char const* ethash_simd_level_name(void)
+{
+	switch (s_level) {
+	case ETHASH_SIMD_AVX512: return "AVX-512";
+	case ETHASH_SIMD_AVX2: return "AVX2";
+	case ETHASH_SIMD_SSE41: return "SSE4.1";
+	default: return "scalar";
+	}
+}
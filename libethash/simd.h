@@ -0,0 +1,94 @@
+/*
+  This file is part of ethash.
+
+  ethash is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  ethash is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with cpp-ethereum.	If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file simd.h
+* @date 2018
+*
+* Runtime dispatched vector kernels for the FNV mixing and node XOR loops and
+* for multi-buffer SHA3.
+* The implementation is picked once, at load time, from what the CPU supports.
+*/
+
+#pragma once
+#include "internal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ethash_simd_level {
+	ETHASH_SIMD_NONE = 0,
+	ETHASH_SIMD_SSE41,
+	ETHASH_SIMD_AVX2,
+	ETHASH_SIMD_AVX512
+} ethash_simd_level_t;
+
+/// dst[i] = dst[i] * FNV_PRIME ^ src[i] for every word of @a count nodes.
+typedef void (*ethash_fnv_nodes_fn)(node* restrict dst, node const* restrict src, uint32_t count);
+/// dst[i] ^= src[i] for every word of @a count nodes.
+typedef void (*ethash_xor_nodes_fn)(node* restrict dst, node const* restrict src, uint32_t count);
+/**
+ * The ETHASH_DATASET_PARENTS mixing rounds of @a count DAG items at once.
+ * @a ret must already hold the seeded (sha3_512'd) items; @a count is at most
+ * ETHASH_BATCH_LANES * MIX_NODES.
+ */
+typedef void (*ethash_dag_parents_fn)(
+	node* ret,
+	uint32_t const* node_indices,
+	uint32_t count,
+	node const* cache_nodes,
+	uint32_t num_parent_nodes
+);
+
+/**
+ * out[i] = sha3(in[i]) for @a count inputs of @a size bytes each, several to a
+ * vectorised Keccak-f[1600] permutation: 4 lanes with AVX2, 8 with AVX-512.
+ * out[i] may be in[i].
+ */
+typedef void (*ethash_sha3_xn_fn)(uint8_t* const* out, uint8_t const* const* in, size_t size, uint32_t count);
+
+extern ethash_fnv_nodes_fn ethash_fnv_nodes;
+extern ethash_xor_nodes_fn ethash_xor_nodes;
+extern ethash_dag_parents_fn ethash_dag_parents;
+extern ethash_sha3_xn_fn ethash_sha3_256_xn;
+extern ethash_sha3_xn_fn ethash_sha3_512_xn;
+
+/// The batched counterparts of SHA3_256() and SHA3_512() in sha3.h.
+static inline void SHA3_256_xN(uint8_t* const* ret, uint8_t const* const* data, size_t size, uint32_t count)
+{
+	ethash_sha3_256_xn(ret, data, size, count);
+}
+
+static inline void SHA3_512_xN(uint8_t* const* ret, uint8_t const* const* data, size_t size, uint32_t count)
+{
+	ethash_sha3_512_xn(ret, data, size, count);
+}
+
+/// The vector level the kernels above were selected for.
+ethash_simd_level_t ethash_simd_level(void);
+/// Printable name of @ref ethash_simd_level().
+char const* ethash_simd_level_name(void);
+
+/**
+ * Re-run the CPU detection, optionally capping the selected level.
+ * Only used to force a slower path (e.g. for diagnostics); it is normally
+ * done automatically at load time with ETHASH_SIMD_AVX512 as the cap.
+ */
+void ethash_simd_init(ethash_simd_level_t max_level);
+
+#ifdef __cplusplus
+}
+#endif
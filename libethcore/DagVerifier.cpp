@@ -0,0 +1,201 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file DagVerifier.cpp
+ * @date 2018
+ */
+
+#include "DagVerifier.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <thread>
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include <libdevcore/Affinity.h>
+#include <libdevcore/Log.h>
+#include <libethash/internal.h>
+#include "EthashAux.h"
+
+using namespace std;
+using namespace dev;
+using namespace eth;
+
+const unsigned DagVerifier::c_items;
+const unsigned DagVerifier::c_maxQueued;
+unsigned DagVerifier::s_interval = 0;
+
+void DagHealth::checked(h256 const& _seed, unsigned _items, vector<uint32_t> const& _corrupt)
+{
+	m_checkedItems.fetch_add(_items, memory_order_relaxed);
+	m_corruptItems.fetch_add(_corrupt.size(), memory_order_relaxed);
+	if (_corrupt.empty())
+		return;
+	Guard l(x_corrupt);
+	if (m_corruptSeed != _seed)
+	{
+		m_corruptSeed = _seed;
+		m_corrupt.clear();
+	}
+	m_corrupt.insert(m_corrupt.end(), _corrupt.begin(), _corrupt.end());
+}
+
+vector<uint32_t> DagHealth::takeCorrupt(h256 const& _seed)
+{
+	vector<uint32_t> corrupt;
+	Guard l(x_corrupt);
+	if (m_corruptSeed == _seed)
+		corrupt.swap(m_corrupt);
+	m_corrupt.clear();
+	return corrupt;
+}
+
+double DagHealth::errorRate() const
+{
+	uint64_t const checked = checkedItems();
+	return checked ? corruptItems() * 1e6 / checked : 0;
+}
+
+DagVerifier& DagVerifier::get()
+{
+	// Never destroyed: its thread is detached.
+	static DagVerifier* s_verifier = new DagVerifier;
+	return *s_verifier;
+}
+
+vector<uint32_t> DagVerifier::pickItems(uint32_t _items, unsigned _count)
+{
+	thread_local mt19937 t_random{random_device{}()};
+	vector<uint32_t> items;
+	if (!_items)
+		return items;
+	uniform_int_distribution<uint32_t> pick(0, _items - 1);
+	_count = min(_count, _items);
+	while (items.size() < _count)
+	{
+		uint32_t const item = pick(t_random);
+		if (find(items.begin(), items.end(), item) == items.end())
+			items.push_back(item);
+	}
+	sort(items.begin(), items.end());
+	return items;
+}
+
+void DagVerifier::submit(Check _check)
+{
+	Guard l(x_queue);
+	if (m_queue.size() >= c_maxQueued)
+		return;
+	m_queue.push_back(move(_check));
+	queued();
+}
+
+void DagVerifier::submit(Probe _probe)
+{
+	Guard l(x_queue);
+	if (m_probes.size() >= c_maxQueued)
+		return;
+	m_probes.push_back(move(_probe));
+	queued();
+}
+
+void DagVerifier::queued()
+{
+	if (!m_started)
+	{
+		m_started = true;
+		thread([this]() { run(); }).detach();
+	}
+	m_queued.notify_one();
+}
+
+void DagVerifier::run()
+{
+	setThreadName("dagcheck");
+	pinVerifyThread();
+#if defined(__linux__)
+	// Per thread on Linux: the miners' threads keep their priority.
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+	while (true)
+	{
+		Check check;
+		Probe probe;
+		{
+			UniqueGuard l(x_queue);
+			m_queued.wait(l, [&]() { return !m_queue.empty() || !m_probes.empty(); });
+			if (!m_probes.empty())
+			{
+				probe = move(m_probes.front());
+				m_probes.erase(m_probes.begin());
+			}
+			else
+			{
+				check = move(m_queue.front());
+				m_queue.erase(m_queue.begin());
+			}
+		}
+		if (probe.health)
+			verify(probe);
+		else
+			verify(check);
+	}
+}
+
+void DagVerifier::verify(Check& _check)
+{
+	if (_check.data.size() < _check.items.size() * ETHASH_MIX_BYTES)
+		return;
+
+	vector<uint32_t> corrupt;
+	try
+	{
+		EthashAux::LightType const light = EthashAux::light(_check.seed);
+		for (size_t i = 0; i < _check.items.size(); ++i)
+		{
+			// An item is the two nodes of its mix, each computed alone.
+			node nodes[2];
+			ethash_calculate_dag_item(&nodes[0], _check.items[i] * 2, light->light);
+			ethash_calculate_dag_item(&nodes[1], _check.items[i] * 2 + 1, light->light);
+			if (memcmp(nodes, _check.data.data() + i * ETHASH_MIX_BYTES, ETHASH_MIX_BYTES))
+				corrupt.push_back(_check.items[i]);
+		}
+	}
+	catch (std::exception const& _e)
+	{
+		cwarn << "Cannot verify the DAG of " << _check.device << ": " << _e.what();
+		return;
+	}
+	for (uint32_t item: corrupt)
+		cwarn << _check.device << " DAG item " << item << " is corrupt";
+	_check.health->checked(_check.seed, (unsigned)_check.items.size(), corrupt);
+}
+
+void DagVerifier::verify(Probe const& _probe)
+{
+	Result const r = EthashAux::eval(_probe.seed, _probe.header, _probe.nonce);
+	if (r.value == ~h256())
+		return;
+	bool const valid = (uint64_t)(u64)((u256)r.value >> 192) <= _probe.target;
+	if (!valid)
+	{
+		cwarn << _probe.device << " pseudo-share of nonce " << _probe.nonce << " does not hash under its target";
+	}
+	_probe.health->checked(valid);
+}
@@ -0,0 +1,166 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file DagVerifier.h
+ * @date 2018
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <libdevcore/Common.h>
+#include <libdevcore/FixedHash.h>
+#include <libdevcore/Guards.h>
+
+namespace dev
+{
+
+namespace eth
+{
+
+/**
+ * @brief What the checks of one device's DAG found. Shared by the miner and
+ * the checks of it still queued, which may outlive it.
+ */
+class DagHealth
+{
+public:
+	/// @a _items of the DAG of @a _seed were checked, @a _corrupt differed.
+	void checked(h256 const& _seed, unsigned _items, std::vector<uint32_t> const& _corrupt);
+	/// The corrupt items of the DAG of @a _seed not yet taken; those of
+	/// other DAGs are dropped.
+	std::vector<uint32_t> takeCorrupt(h256 const& _seed);
+	void repaired(unsigned _chunks) { m_repairedChunks.fetch_add(_chunks, std::memory_order_relaxed); }
+
+	uint64_t checkedItems() const { return m_checkedItems.load(std::memory_order_relaxed); }
+	uint64_t corruptItems() const { return m_corruptItems.load(std::memory_order_relaxed); }
+	uint64_t repairedChunks() const { return m_repairedChunks.load(std::memory_order_relaxed); }
+	/// Corrupt items per million checked.
+	double errorRate() const;
+
+private:
+	std::atomic<uint64_t> m_checkedItems = {0};
+	std::atomic<uint64_t> m_corruptItems = {0};
+	std::atomic<uint64_t> m_repairedChunks = {0};
+	Mutex x_corrupt;
+	h256 m_corruptSeed;
+	std::vector<uint32_t> m_corrupt;
+};
+
+/**
+ * @brief What the CPU found of the pseudo-shares of one device, see
+ * Miner::setProbeDifficulty(): the ones the kernel counted but that do not
+ * hash under the target tell of a broken kernel or DAG.
+ */
+class ProbeHealth
+{
+public:
+	void checked(bool _valid)
+	{
+		m_checked.fetch_add(1, std::memory_order_relaxed);
+		if (!_valid)
+			m_invalid.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t checkedProbes() const { return m_checked.load(std::memory_order_relaxed); }
+	uint64_t invalidProbes() const { return m_invalid.load(std::memory_order_relaxed); }
+	/// Of the checked ones, 1 before any is.
+	double validFraction() const
+	{
+		uint64_t const checked = checkedProbes();
+		return checked ? double(checked - invalidProbes()) / checked : 1;
+	}
+
+private:
+	std::atomic<uint64_t> m_checked = {0};
+	std::atomic<uint64_t> m_invalid = {0};
+};
+
+/**
+ * @brief Checks DAG items the devices read back against the ones the CPU
+ * computes from the light cache, on a thread of its own at the lowest
+ * priority. Memory clocked past what it holds shows as corrupt items long
+ * before the solutions fail their verification; each device regenerates
+ * the chunks they are in. Samples of the devices' pseudo-shares are
+ * evaluated there too.
+ */
+class DagVerifier
+{
+public:
+	/// Items read back from a device.
+	struct Check
+	{
+		std::string device;
+		h256 seed;
+		std::vector<uint32_t> items;
+		bytes data;					///< ETHASH_MIX_BYTES per item.
+		std::shared_ptr<DagHealth> health;
+	};
+
+	/// A pseudo-share to evaluate from the light cache.
+	struct Probe
+	{
+		std::string device;
+		h256 seed;
+		h256 header;
+		uint64_t nonce = 0;
+		uint64_t target = 0;		///< The upper 64 bits of the hash are under it.
+		std::shared_ptr<ProbeHealth> health;
+	};
+
+	/// Items read back per check.
+	static const unsigned c_items = 16;
+	/// Checks queued beyond which more are dropped.
+	static const unsigned c_maxQueued = 64;
+
+	static DagVerifier& get();
+
+	/// Seconds between the checks of each device, 0 (the default) for none.
+	static void setInterval(unsigned _seconds) { s_interval = _seconds; }
+	static unsigned interval() { return s_interval; }
+
+	/// @a _count distinct items, at random, of a DAG of @a _items.
+	static std::vector<uint32_t> pickItems(uint32_t _items, unsigned _count);
+
+	/// Queues @a _check, unless c_maxQueued are.
+	void submit(Check _check);
+	/// Queues @a _probe, unless c_maxQueued are; they go before the checks.
+	void submit(Probe _probe);
+
+private:
+	DagVerifier() = default;
+	void run();
+	/// Starts the thread the first time. Call with x_queue held.
+	void queued();
+	void verify(Check& _check);
+	void verify(Probe const& _probe);
+
+	Mutex x_queue;
+	std::condition_variable m_queued;
+	std::vector<Check> m_queue;
+	std::vector<Probe> m_probes;
+	bool m_started = false;
+
+	static unsigned s_interval;
+};
+
+}
+}
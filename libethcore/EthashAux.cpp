@@ -20,6 +20,25 @@
  */
 
 #include "EthashAux.h"
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#endif
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+#include <libdevcore/Affinity.h>
+#include <libdevcore/CommonIO.h>
+#include <libethash/hugepages.h>
 #include <libethash/internal.h>
 
 using namespace std;
@@ -35,69 +54,545 @@ EthashAux& EthashAux::get()
 
 h256 EthashAux::seedHash(unsigned _number)
 {
-	unsigned epoch = _number / ETHASH_EPOCH_LENGTH;
+	// Tabulated in libethash: no locking or hashing for the first 2048 epochs.
+	ethash_h256_t seed = ethash_get_seedhash(_number);
+	return h256((uint8_t*)&seed, h256::ConstructFromPointer);
+}
+
+uint64_t EthashAux::number(h256 const& _seedHash)
+{
+	int epoch = ethash_get_epoch(*(ethash_h256_t const*)_seedHash.data());
+	if (epoch < 0)
+	{
+		std::ostringstream error;
+		error << "apparent block number for " << _seedHash << " is too high; max is " << ((uint64_t)ETHASH_EPOCH_LENGTH * ETHASH_MAX_EPOCHS);
+		throw std::invalid_argument(error.str());
+	}
+	return (uint64_t)epoch * ETHASH_EPOCH_LENGTH;
+}
+
+EthashAux::LightType EthashAux::light(h256 const& _seedHash)
+{
+	// TODO: Use epoch number instead of seed hash?
+
 	EthashAux& ethash = EthashAux::get();
-	Guard l(ethash.x_epochs);
-	if (epoch >= ethash.m_seedHashes.size())
+	UniqueGuard l(ethash.x_lights);
+	auto it = ethash.m_lights.find(_seedHash);
+	if (it != ethash.m_lights.end())
 	{
-		h256 ret;
-		unsigned n = 0;
-		if (!ethash.m_seedHashes.empty())
+		// May have been precomputed: it becomes the current epoch on first use.
+		LightType ret = it->second;
+		ethash.noteEpoch(ret->epoch());
+		return ret;
+	}
+	if (ethash.m_pendingLight.valid() && ethash.m_pendingSeed == _seedHash)
+	{
+		// Already being built in the background: wait for it rather than building it twice.
+		std::shared_future<LightType> pending = ethash.m_pendingLight;
+		l.unlock();
+		LightType ret = pending.get();
+		l.lock();
+		if (ret)
 		{
-			ret = ethash.m_seedHashes.back();
-			n = ethash.m_seedHashes.size() - 1;
+			ethash.noteEpoch(ret->epoch());
+			return ret;
 		}
-		ethash.m_seedHashes.resize(epoch + 1);
-		for (; n <= epoch; ++n, ret = sha3(ret))
-			ethash.m_seedHashes[n] = ret;
+		if (ethash.m_lights.count(_seedHash))
+			return ethash.m_lights.at(_seedHash);
 	}
-	return ethash.m_seedHashes[epoch];
+	LightType ret = make_shared<LightAllocation>(_seedHash);
+	ethash.m_lights[_seedHash] = ret;
+	ethash.noteEpoch(ret->epoch());
+	return ret;
 }
 
-uint64_t EthashAux::number(h256 const& _seedHash)
+void EthashAux::prepare(h256 const& _seedHash)
 {
 	EthashAux& ethash = EthashAux::get();
-	Guard l(ethash.x_epochs);
-	unsigned epoch = 0;
-	auto epochIter = ethash.m_epochs.find(_seedHash);
-	if (epochIter == ethash.m_epochs.end())
+	Guard l(ethash.x_lights);
+	ethash.precompute(_seedHash);
+}
+
+void EthashAux::noteEpoch(unsigned _epoch)
+{
+	// x_lights is held.
+	if ((int)_epoch <= m_currentEpoch)
+		return;
+	if (m_sharedMemory)
 	{
-		for (h256 h; h != _seedHash && epoch < 2048; ++epoch, h = sha3(h), ethash.m_epochs[h] = epoch) {}
-		if (epoch == 2048)
+		// Unlinked for good: processes still attached keep their mappings, the
+		// rest build the epoch again should they need it.
+		unsigned first = m_currentEpoch < 0 ? _epoch : m_currentEpoch + 1;
+		if (_epoch - first > c_segmentSweep)
+			first = _epoch - c_segmentSweep;
+		for (unsigned e = first; e <= _epoch; ++e)
+			if (e >= c_epochsKept)
+				removeSegments(seedHash((e - c_epochsKept) * ETHASH_EPOCH_LENGTH));
+	}
+	m_currentEpoch = _epoch;
+	recordEpoch(_epoch);
+
+	// Drop our references to old epochs; miners still using them keep them alive.
+	for (auto it = m_lights.begin(); it != m_lights.end();)
+		if (it->second->epoch() + c_epochsKept <= _epoch)
 		{
-			std::ostringstream error;
-			error << "apparent block number for " << _seedHash << " is too high; max is " << (ETHASH_EPOCH_LENGTH * 2048);
-			throw std::invalid_argument(error.str());
+			it = m_lights.erase(it);
+			m_generation.fetch_add(1, memory_order_release);
 		}
+		else
+			++it;
+	{
+		Guard lf(x_fulls);
+		for (auto it = m_fulls.begin(); it != m_fulls.end();)
+			if (it->second->epoch + c_epochsKept <= _epoch)
+				it = m_fulls.erase(it);
+			else
+				++it;
 	}
-	else
-		epoch = epochIter->second;
-	return epoch * ETHASH_EPOCH_LENGTH;
+
+	precompute(seedHash((_epoch + 1) * ETHASH_EPOCH_LENGTH));
 }
 
-EthashAux::LightType EthashAux::light(h256 const& _seedHash)
+void EthashAux::precompute(h256 const& _seedHash)
 {
-	// TODO: Use epoch number instead of seed hash?
+	// x_lights is held. Only one background build at a time.
+	if (m_lights.count(_seedHash) || (m_pendingLight.valid() && m_pendingSeed == _seedHash))
+		return;
+	if (m_pendingLight.valid() && m_pendingLight.wait_for(chrono::seconds(0)) != future_status::ready)
+		return;
+	// Within a tight budget it is built once needed, when the old epoch's may be gone.
+	if (!HostMemory::fits(ethash_get_cachesize(number(_seedHash))))
+	{
+		cnote << "Not precomputing light cache for" << _seedHash << "within the host memory budget";
+		return;
+	}
+	m_pendingSeed = _seedHash;
+	m_pendingLight = std::async(std::launch::async, [_seedHash]() -> LightType
+	{
+		pinVerifyThread();
+		try
+		{
+			LightType ret = make_shared<LightAllocation>(_seedHash);
+			EthashAux& ethash = EthashAux::get();
+			Guard l(ethash.x_lights);
+			ethash.m_lights[_seedHash] = ret;
+			return ret;
+		}
+		catch (...)
+		{
+			cwarn << "Precomputing light cache for" << _seedHash << "failed";
+			return LightType();
+		}
+	}).share();
+}
 
+EthashAux::FullType EthashAux::full(h256 const& _seedHash)
+{
+	// The light cache is taken first: x_lights must never be acquired under x_fulls.
+	LightType l = light(_seedHash);
+	EthashAux& ethash = EthashAux::get();
+	{
+		Guard lf(ethash.x_fulls);
+		if (ethash.m_fulls.count(_seedHash))
+			return ethash.m_fulls.at(_seedHash);
+	}
+	trim(ethash_get_datasize(l->light->block_number));
+	Guard lf(ethash.x_fulls);
+	if (ethash.m_fulls.count(_seedHash))
+		return ethash.m_fulls.at(_seedHash);
+	return (ethash.m_fulls[_seedHash] = make_shared<FullAllocation>(_seedHash, l));
+}
+
+void EthashAux::trim(uint64_t _need)
+{
+	if (HostMemory::fits(_need))
+		return;
 	EthashAux& ethash = EthashAux::get();
 	Guard l(ethash.x_lights);
-	if (ethash.m_lights.count(_seedHash))
-		return ethash.m_lights.at(_seedHash);
-	return (ethash.m_lights[_seedHash] = make_shared<LightAllocation>(_seedHash));
+	{
+		Guard lf(ethash.x_fulls);
+		for (auto it = ethash.m_fulls.begin(); it != ethash.m_fulls.end();)
+			if (it->second.use_count() == 1)
+			{
+				cnote << "Dropping the host DAG of epoch" << it->second->epoch << "for the host memory budget";
+				it = ethash.m_fulls.erase(it);
+			}
+			else
+				++it;
+	}
+	// Miners still using one keep it alive, as in noteEpoch().
+	for (auto it = ethash.m_lights.begin(); it != ethash.m_lights.end();)
+		if ((int)it->second->epoch() != ethash.m_currentEpoch)
+		{
+			it = ethash.m_lights.erase(it);
+			ethash.m_generation.fetch_add(1, memory_order_release);
+		}
+		else
+			++it;
+}
+
+void EthashAux::setDAGDirectory(std::string const& _dir)
+{
+	EthashAux& ethash = EthashAux::get();
+	Guard l(ethash.x_dagDir);
+	ethash.m_dagDir = _dir;
+}
+
+std::string EthashAux::dagDirectory()
+{
+	EthashAux& ethash = EthashAux::get();
+	Guard l(ethash.x_dagDir);
+	return ethash.m_dagDir;
+}
+
+void EthashAux::setSharedMemory(bool _shared)
+{
+	get().m_sharedMemory = _shared;
+}
+
+bool EthashAux::sharedMemory()
+{
+	return get().m_sharedMemory;
+}
+
+std::string EthashAux::defaultDAGDirectory()
+{
+#if defined(_WIN32)
+	char const* base = getenv("LOCALAPPDATA");
+	return base ? std::string(base) + "\\Ethash" : std::string();
+#else
+	char const* base = getenv("HOME");
+	return base ? std::string(base) + "/.ethash" : std::string();
+#endif
+}
+
+namespace
+{
+
+// Same layout as the DAG files of the original ethash library.
+uint64_t const c_dagMagic = 0xFEE1DEADBADDCAFEULL;
+size_t const c_dagHeaderSize = sizeof(c_dagMagic);
+
+bool makeDirectory(std::string const& _dir)
+{
+	struct stat st;
+	if (stat(_dir.c_str(), &st) == 0)
+		return (st.st_mode & S_IFDIR) != 0;
+#if defined(_WIN32)
+	if (_mkdir(_dir.c_str()) == 0)
+		return true;
+#else
+	if (mkdir(_dir.c_str(), 0755) == 0)
+		return true;
+#endif
+	// Another process may have just made it.
+	return stat(_dir.c_str(), &st) == 0 && (st.st_mode & S_IFDIR) != 0;
+}
+
+/// Where the newest epoch in use is kept for the next start.
+std::string lastEpochPath(std::string const& _dir)
+{
+	return _dir + "/last-epoch";
+}
+
+std::string epochFileName(std::string const& _dir, char const* _kind, h256 const& _seedHash)
+{
+	return _dir + "/" + _kind + "-R" + toString(ETHASH_REVISION) + "-" + toHex(_seedHash.ref().cropped(0, 8));
+}
+
+std::string temporaryDirectory()
+{
+#if defined(_WIN32)
+	char const* dir = getenv("TEMP");
+	return dir ? dir : ".";
+#else
+	char const* dir = getenv("TMPDIR");
+	return dir ? dir : "/tmp";
+#endif
+}
+
+/// Held while an epoch's light cache or DAG is looked up and, if missing, built,
+/// so that of several processes wanting it only the first builds it. The lock is
+/// on a file of the epoch's name; an empty path locks nothing. Like all file
+/// locks it does not keep out other threads of this process, which x_lights and
+/// x_fulls do.
+class EpochLock
+{
+public:
+	explicit EpochLock(std::string const& _path)
+	{
+		namespace bi = boost::interprocess;
+		if (_path.empty())
+			return;
+		try
+		{
+			std::ofstream(_path, std::ios::app);
+			m_lock.reset(new bi::file_lock(_path.c_str()));
+			m_lock->lock();
+		}
+		catch (bi::interprocess_exception const& _e)
+		{
+			cwarn << "Cannot lock" << _path << ":" << _e.what();
+			m_lock.reset();
+		}
+	}
+	~EpochLock()
+	{
+		if (m_lock)
+			m_lock->unlock();
+	}
+
+private:
+	std::unique_ptr<boost::interprocess::file_lock> m_lock;
+};
+
+/// The lock file of an epoch's @a _kind, in the DAG directory if there is one.
+std::string lockPath(char const* _kind, h256 const& _seedHash)
+{
+	std::string dir = EthashAux::dagDirectory();
+	if (dir.empty() || !makeDirectory(dir))
+		dir = temporaryDirectory();
+	return epochFileName(dir, _kind, _seedHash) + ".lock";
+}
+
+// Shared memory segments: magic, then size, written once the data after them is
+// complete.
+uint64_t const c_segmentMagic = 0x5348415245444147ULL;
+struct SegmentHeader
+{
+	uint64_t magic;
+	uint64_t size;
+};
+
+std::string segmentName(char const* _kind, h256 const& _seedHash)
+{
+	return std::string("ethash-") + _kind + "-R" + toString(ETHASH_REVISION) + "-" + toHex(_seedHash.ref().cropped(0, 8));
+}
+
+/// The complete segment @a _name of @a _size bytes, mapped read-only, or null.
+std::unique_ptr<boost::interprocess::mapped_region> attachSegment(std::string const& _name, uint64_t _size)
+{
+	namespace bi = boost::interprocess;
+	try
+	{
+		bi::shared_memory_object shm(bi::open_only, _name.c_str(), bi::read_only);
+		bi::offset_t length;
+		if (!shm.get_size(length) || (uint64_t)length != _size + sizeof(SegmentHeader))
+			return nullptr;
+		std::unique_ptr<bi::mapped_region> region(new bi::mapped_region(shm, bi::read_only));
+		SegmentHeader header;
+		memcpy(&header, region->get_address(), sizeof(header));
+		if (header.magic != c_segmentMagic || header.size != _size)
+			return nullptr;
+		return region;
+	}
+	catch (bi::interprocess_exception const&)
+	{
+		return nullptr;
+	}
+}
+
+/// Creates segment @a _name, has @a _build fill its @a _size bytes of data and
+/// maps it read-only, or returns null. Under the epoch's lock: an incomplete
+/// segment of the name is one whose builder died, and goes first.
+std::unique_ptr<boost::interprocess::mapped_region> createSegment(std::string const& _name, uint64_t _size, std::function<void(byte*)> const& _build)
+{
+	namespace bi = boost::interprocess;
+	bi::shared_memory_object::remove(_name.c_str());
+	try
+	{
+		bi::shared_memory_object shm(bi::create_only, _name.c_str(), bi::read_write);
+		uint64_t const length = _size + sizeof(SegmentHeader);
+#if defined(__linux__)
+		// Reserved up front: running out of room in /dev/shm half way through
+		// would be a SIGBUS rather than an error.
+		if (posix_fallocate(shm.get_mapping_handle().handle, 0, (off_t)length) != 0)
+		{
+			cwarn << "Not enough shared memory for" << _name << "(" << length / (1024 * 1024) << "MB)";
+			bi::shared_memory_object::remove(_name.c_str());
+			return nullptr;
+		}
+#endif
+		shm.truncate((bi::offset_t)length);
+		{
+			bi::mapped_region region(shm, bi::read_write);
+			byte* base = (byte*)region.get_address();
+			_build(base + sizeof(SegmentHeader));
+			SegmentHeader const header{c_segmentMagic, _size};
+			memcpy(base, &header, sizeof(header));
+		}
+		return std::unique_ptr<bi::mapped_region>(new bi::mapped_region(shm, bi::read_only));
+	}
+	catch (bi::interprocess_exception const& _e)
+	{
+		cwarn << "Shared memory error for" << _name << ":" << _e.what();
+		bi::shared_memory_object::remove(_name.c_str());
+		return nullptr;
+	}
+}
+
+// Light cache files: magic, cache size, sha3 of the cache, then the cache itself.
+uint64_t const c_cacheMagic = 0xCAC4EDBADDCAFE01ULL;
+struct CacheFileHeader
+{
+	uint64_t magic;
+	uint64_t size;
+	h256 checksum;
+};
+
+}
+
+void EthashAux::removeSegments(h256 const& _seedHash)
+{
+	namespace bi = boost::interprocess;
+	bi::shared_memory_object::remove(segmentName("cache", _seedHash).c_str());
+	bi::shared_memory_object::remove(segmentName("full", _seedHash).c_str());
+}
+
+bool EthashAux::fullStored(h256 const& _seedHash)
+{
+	if (sharedMemory() && attachSegment(segmentName("full", _seedHash), ethash_get_datasize(number(_seedHash))))
+		return true;
+	string dir = dagDirectory();
+	if (dir.empty())
+		return false;
+	struct stat st;
+	string path = epochFileName(dir, "full", _seedHash);
+	return stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == ethash_get_datasize(number(_seedHash)) + c_dagHeaderSize;
+}
+
+int EthashAux::lastEpoch()
+{
+	string dir = dagDirectory();
+	if (dir.empty())
+		return -1;
+	ifstream in(lastEpochPath(dir));
+	int epoch = -1;
+	if (!(in >> epoch) || epoch < 0 || epoch >= ETHASH_MAX_EPOCHS)
+		return -1;
+	return epoch;
+}
+
+void EthashAux::recordEpoch(unsigned _epoch)
+{
+	string dir = dagDirectory();
+	if (dir.empty() || !makeDirectory(dir))
+		return;
+	// Best effort: a start without it only builds the DAG later.
+	writeFileAtomically(lastEpochPath(dir), [&](ostream& _f) { _f << _epoch << '\n'; });
 }
 
 EthashAux::LightAllocation::LightAllocation(h256 const& _seedHash)
 {
 	uint64_t blockNumber = EthashAux::number(_seedHash);
+	size = ethash_get_cachesize(blockNumber);
+	if (EthashAux::sharedMemory() && share(_seedHash, blockNumber))
+	{
+		m_accounted = HostMemory::reserve(HostMemory::Light, size, size);
+		return;
+	}
+	string dir = EthashAux::dagDirectory();
+	string path = dir.empty() || !makeDirectory(dir) ? string() : epochFileName(dir, "cache", _seedHash);
+	// A process starting alongside maps the file this one writes.
+	EpochLock lock(path.empty() ? string() : path + ".lock");
+	if (!path.empty() && map(path, blockNumber))
+		return;
+	m_accounted = HostMemory::reserve(HostMemory::Light, size, size);
 	light = ethash_light_new(blockNumber);
 	if (!light)
 		BOOST_THROW_EXCEPTION(ExternalFunctionFailure("ethash_light_new()"));
-	size = ethash_get_cachesize(blockNumber);
+	if (!path.empty())
+		store(path);
 }
 
 EthashAux::LightAllocation::~LightAllocation()
 {
-	ethash_light_delete(light);
+	if (m_region)
+		free(light);  // the cache itself belongs to the mapping
+	else
+		ethash_light_delete(light);
+}
+
+bool EthashAux::LightAllocation::map(std::string const& _path, uint64_t _blockNumber)
+{
+	namespace bi = boost::interprocess;
+	try
+	{
+		struct stat st;
+		if (stat(_path.c_str(), &st) != 0 || (uint64_t)st.st_size != size + sizeof(CacheFileHeader))
+			return false;
+		bi::file_mapping file(_path.c_str(), bi::read_only);
+		unique_ptr<bi::mapped_region> region(new bi::mapped_region(file, bi::read_only));
+		CacheFileHeader header;
+		memcpy(&header, region->get_address(), sizeof(header));
+		byte const* cache = (byte const*)region->get_address() + sizeof(header);
+		if (header.magic != c_cacheMagic || header.size != size || header.checksum != sha3(bytesConstRef(cache, size)))
+		{
+			cwarn << "Ignoring corrupt light cache file" << _path;
+			return false;
+		}
+		light = (ethash_light_t)calloc(1, sizeof(ethash_light));
+		if (!light)
+			return false;
+		light->cache = (void*)cache;
+		light->cache_size = size;
+		light->block_number = _blockNumber;
+		m_region = move(region);
+		return true;
+	}
+	catch (bi::interprocess_exception const&)
+	{
+		return false;
+	}
+}
+
+bool EthashAux::LightAllocation::share(h256 const& _seedHash, uint64_t _blockNumber)
+{
+	EpochLock lock(lockPath("cache", _seedHash));
+	string const name = segmentName("cache", _seedHash);
+	unique_ptr<boost::interprocess::mapped_region> region = attachSegment(name, size);
+	if (region)
+		cnote << "Attached light cache" << name;
+	else
+	{
+		region = createSegment(name, size, [&](byte* _dest)
+		{
+			ethash_light_t l = ethash_light_new(_blockNumber);
+			if (!l)
+				BOOST_THROW_EXCEPTION(ExternalFunctionFailure("ethash_light_new()"));
+			memcpy(_dest, l->cache, size);
+			ethash_light_delete(l);
+		});
+		if (!region)
+			return false;
+	}
+	light = (ethash_light_t)calloc(1, sizeof(ethash_light));
+	if (!light)
+		return false;
+	light->cache = (byte*)region->get_address() + sizeof(SegmentHeader);
+	light->cache_size = size;
+	light->block_number = _blockNumber;
+	m_region = move(region);
+	return true;
+}
+
+void EthashAux::LightAllocation::store(std::string const& _path) const
+{
+	CacheFileHeader header{c_cacheMagic, size, sha3(data())};
+	bool const written = writeFileAtomically(_path, [&](std::ostream& _f)
+	{
+		_f.write((char const*)&header, sizeof(header));
+		_f.write((char const*)light->cache, size);
+	});
+	if (!written)
+	{
+		cwarn << "Cannot write light cache file" << _path;
+	}
+}
+
+unsigned EthashAux::LightAllocation::epoch() const
+{
+	return (unsigned)(light->block_number / ETHASH_EPOCH_LENGTH);
 }
 
 bytesConstRef EthashAux::LightAllocation::data() const
@@ -113,14 +608,227 @@ Result EthashAux::LightAllocation::compute(h256 const& _headerHash, uint64_t _no
 	return Result{h256((uint8_t*)&r.result, h256::ConstructFromPointer), h256((uint8_t*)&r.mix_hash, h256::ConstructFromPointer)};
 }
 
+std::vector<Result> EthashAux::LightAllocation::compute(h256 const& _headerHash, std::vector<uint64_t> const& _nonces) const
+{
+	std::vector<ethash_return_value_t> r(_nonces.size());
+	ethash_light_compute_batch(light, *(ethash_h256_t*)_headerHash.data(), _nonces.data(), _nonces.size(), r.data());
+	std::vector<Result> ret;
+	ret.reserve(r.size());
+	for (auto const& i: r)
+	{
+		if (!i.success)
+			BOOST_THROW_EXCEPTION(DAGCreationFailure());
+		ret.push_back(Result{h256((uint8_t*)&i.result, h256::ConstructFromPointer), h256((uint8_t*)&i.mix_hash, h256::ConstructFromPointer)});
+	}
+	return ret;
+}
+
+EthashAux::FullAllocation::FullAllocation(h256 const& _seedHash, LightType const& _light)
+{
+	size = ethash_get_datasize(_light->light->block_number);
+	epoch = _light->epoch();
+	if (EthashAux::sharedMemory())
+	{
+		if (share(_seedHash, _light))
+		{
+			m_accounted = HostMemory::reserve(HostMemory::Dag, size, size);
+			return;
+		}
+		cwarn << "Cannot share the DAG of epoch" << epoch << ", keeping it to this process.";
+	}
+	string dir = EthashAux::dagDirectory();
+	if (!dir.empty() && makeDirectory(dir))
+	{
+		string path = epochFileName(dir, "full", _seedHash);
+		// A process starting alongside waits for this one's file rather than
+		// writing its own.
+		EpochLock lock(path + ".lock");
+		if (map(path) || create(path, _light))
+			return;
+		cwarn << "Cannot use DAG file" << path << ", keeping the DAG in memory only.";
+	}
+	m_accounted = HostMemory::reserve(HostMemory::Dag, size, size);
+	m_memory = (byte*)ethash_huge_alloc(size);
+	if (!m_memory)
+		BOOST_THROW_EXCEPTION(ExternalFunctionFailure("ethash_huge_alloc()"));
+	cnote << "Host DAG in" << ethash_huge_page_size(m_memory, size) / 1024 << "kB pages";
+	generate(m_memory, _light);
+	m_data = m_memory;
+}
+
+EthashAux::FullAllocation::~FullAllocation()
+{
+	ethash_huge_free(m_memory, size);
+}
+
+bool EthashAux::FullAllocation::map(std::string const& _path)
+{
+	namespace bi = boost::interprocess;
+	try
+	{
+		struct stat st;
+		if (stat(_path.c_str(), &st) != 0 || (uint64_t)st.st_size != size + c_dagHeaderSize)
+			return false;
+		bi::file_mapping file(_path.c_str(), bi::read_only);
+		unique_ptr<bi::mapped_region> region(new bi::mapped_region(file, bi::read_only));
+		uint64_t magic;
+		memcpy(&magic, region->get_address(), sizeof(magic));
+		if (magic != c_dagMagic)
+			return false;
+		m_region = move(region);
+		m_data = (byte const*)m_region->get_address() + c_dagHeaderSize;
+		cnote << "Mapped DAG file" << _path;
+		return true;
+	}
+	catch (bi::interprocess_exception const&)
+	{
+		return false;
+	}
+}
+
+bool EthashAux::FullAllocation::share(h256 const& _seedHash, LightType const& _light)
+{
+	EpochLock lock(lockPath("full", _seedHash));
+	string const name = segmentName("full", _seedHash);
+	unique_ptr<boost::interprocess::mapped_region> region = attachSegment(name, size);
+	if (region)
+		cnote << "Attached host DAG" << name;
+	else if (!(region = createSegment(name, size, [&](byte* _dest) { generate(_dest, _light); })))
+		return false;
+	m_region = move(region);
+	m_data = (byte const*)m_region->get_address() + sizeof(SegmentHeader);
+	return true;
+}
+
+bool EthashAux::FullAllocation::create(std::string const& _path, LightType const& _light)
+{
+	namespace bi = boost::interprocess;
+	// Generate into a temporary file and only rename it into place once complete,
+	// so a crash mid-generation never leaves a truncated epoch file behind.
+	string tmpPath = _path + ".tmp";
+	try
+	{
+		{
+			std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+			f.seekp(size + c_dagHeaderSize - 1);
+			f.put(0);
+			if (!f)
+				return false;
+		}
+		bi::file_mapping file(tmpPath.c_str(), bi::read_write);
+		unique_ptr<bi::mapped_region> region(new bi::mapped_region(file, bi::read_write));
+		byte* base = (byte*)region->get_address();
+		generate(base + c_dagHeaderSize, _light);
+		memcpy(base, &c_dagMagic, sizeof(c_dagMagic));
+		if (!region->flush())
+			return false;
+		std::remove(_path.c_str());
+		if (std::rename(tmpPath.c_str(), _path.c_str()) != 0)
+			return false;
+		m_region = move(region);
+		m_data = base + c_dagHeaderSize;
+		cnote << "Wrote DAG file" << _path;
+		return true;
+	}
+	catch (bi::interprocess_exception const& _e)
+	{
+		cwarn << "DAG file error:" << _e.what();
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+}
+
+void EthashAux::FullAllocation::generate(byte* _dest, LightType const& _light)
+{
+	// Nodes are handed out in chunks so faster cores pick up more of the work.
+	uint32_t const c_chunk = 1 << 14;
+	uint32_t const nodes = (uint32_t)(size / sizeof(node));
+	unsigned const threads = max(1u, thread::hardware_concurrency());
+	atomic<uint32_t> next(0);
+
+	cnote << "Generating DAG of" << size / (1024 * 1024) << "MB on" << threads << "threads";
+	auto start = chrono::steady_clock::now();
+	auto work = [&]()
+	{
+		for (uint32_t begin; (begin = next.fetch_add(c_chunk)) < nodes;)
+			ethash_calculate_dag_range((node*)_dest, begin, min(begin + c_chunk, nodes), _light->light);
+	};
+	vector<thread> workers;
+	for (unsigned i = 1; i < threads; ++i)
+		workers.emplace_back(work);
+	work();
+	for (auto& t: workers)
+		t.join();
+	cnote << "DAG generated in" << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << "ms";
+}
+
+Result EthashAux::FullAllocation::compute(h256 const& _headerHash, uint64_t _nonce) const
+{
+	ethash_return_value r = ethash_full_compute_internal(m_data, size, *(ethash_h256_t*)_headerHash.data(), _nonce);
+	if (!r.success)
+		BOOST_THROW_EXCEPTION(DAGComputeFailure());
+	return Result{h256((uint8_t*)&r.result, h256::ConstructFromPointer), h256((uint8_t*)&r.mix_hash, h256::ConstructFromPointer)};
+}
+
+namespace
+{
+
+/// The light cache a thread last verified against. Solutions nearly always come
+/// for the same seed as the previous one, so this avoids x_lights and the
+/// shared_ptr refcount on the verification path.
+struct LightSnapshot
+{
+	h256 seed;
+	unsigned generation = 0;
+	EthashAux::LightType light;
+};
+
+thread_local LightSnapshot t_lightSnapshot;
+
+}
+
+EthashAux::LightAllocation const& EthashAux::cachedLight(h256 const& _seedHash)
+{
+	// Read before light(): an eviction racing with the lookup then only causes
+	// one more refresh on the next call.
+	unsigned generation = get().m_generation.load(memory_order_acquire);
+	LightSnapshot& snapshot = t_lightSnapshot;
+	if (!snapshot.light || snapshot.seed != _seedHash || snapshot.generation != generation)
+	{
+		snapshot.light = light(_seedHash);
+		snapshot.seed = _seedHash;
+		snapshot.generation = generation;
+	}
+	return *snapshot.light;
+}
+
 Result EthashAux::eval(h256 const& _seedHash, h256 const& _headerHash, uint64_t _nonce) noexcept
 {
 	try
 	{
-		return get().light(_seedHash)->compute(_headerHash, _nonce);
+		return cachedLight(_seedHash).compute(_headerHash, _nonce);
 	}
 	catch(...)
 	{
 		return Result{~h256(), h256()};
 	}
 }
+
+h256 EthashAux::quickHash(h256 const& _headerHash, uint64_t _nonce, h256 const& _mixHash) noexcept
+{
+	ethash_h256_t const ret = ethash_quick_hash(
+		(ethash_h256_t const*)_headerHash.data(), _nonce, (ethash_h256_t const*)_mixHash.data());
+	return h256((uint8_t const*)&ret, h256::ConstructFromPointer);
+}
+
+std::vector<Result> EthashAux::eval(h256 const& _seedHash, h256 const& _headerHash, std::vector<uint64_t> const& _nonces) noexcept
+{
+	try
+	{
+		return cachedLight(_seedHash).compute(_headerHash, _nonces);
+	}
+	catch(...)
+	{
+		return std::vector<Result>(_nonces.size(), Result{~h256(), h256()});
+	}
+}
@@ -22,10 +22,14 @@
 #pragma once
 
 #include <condition_variable>
+#include <future>
 #include <libethash/ethash.h>
 #include <libdevcore/Log.h>
 #include <libdevcore/Worker.h>
 #include "BlockHeader.h"
+#include "HostMemory.h"
+
+namespace boost { namespace interprocess { class mapped_region; } }
 
 namespace dev
 {
@@ -47,29 +51,131 @@ public:
 		~LightAllocation();
 		bytesConstRef data() const;
 		Result compute(h256 const& _headerHash, uint64_t _nonce) const;
+		std::vector<Result> compute(h256 const& _headerHash, std::vector<uint64_t> const& _nonces) const;
+		/// True if the cache is mapped from a cache file in the DAG directory.
+		bool mapped() const { return !!m_region; }
+		unsigned epoch() const;
 		ethash_light_t light;
 		uint64_t size;
+
+	private:
+		bool map(std::string const& _path, uint64_t _blockNumber);
+		void store(std::string const& _path) const;
+		/// Attaches the epoch's shared memory segment, building it first if no one has.
+		bool share(h256 const& _seedHash, uint64_t _blockNumber);
+
+		std::unique_ptr<boost::interprocess::mapped_region> m_region;
+		/// Unless it is mapped from the cache file.
+		HostMemory::Reservation m_accounted;
 	};
 
 	using LightType = std::shared_ptr<LightAllocation>;
 
+	/// A complete host-side DAG, generated on all cores and backed by an
+	/// epoch file in the DAG directory when one is set.
+	struct FullAllocation
+	{
+		FullAllocation(h256 const& _seedHash, LightType const& _light);
+		~FullAllocation();
+		bytesConstRef data() const { return bytesConstRef(m_data, size); }
+		Result compute(h256 const& _headerHash, uint64_t _nonce) const;
+		/// True if the DAG lives in a mapped epoch file or shared memory segment
+		/// rather than the heap.
+		bool mapped() const { return !!m_region; }
+		uint64_t size;
+		unsigned epoch;
+
+	private:
+		bool map(std::string const& _path);
+		bool create(std::string const& _path, LightType const& _light);
+		bool share(h256 const& _seedHash, LightType const& _light);
+		void generate(byte* _dest, LightType const& _light);
+
+		std::unique_ptr<boost::interprocess::mapped_region> m_region;
+		byte* m_memory = nullptr;  ///< Huge page backed, if the DAG is not in a file.
+		byte const* m_data = nullptr;
+		/// Unless it is mapped from the epoch file.
+		HostMemory::Reservation m_accounted;
+	};
+
+	using FullType = std::shared_ptr<FullAllocation>;
+
 	static h256 seedHash(unsigned _number);
 	static uint64_t number(h256 const& _seedHash);
 
 	static LightType light(h256 const& _seedHash);
+	static FullType full(h256 const& _seedHash);
+	/// True if the DAG of @a _seedHash is complete in its epoch file or shared
+	/// memory segment, so full() would only map it rather than generate it.
+	static bool fullStored(h256 const& _seedHash);
+	/// Over the host memory budget with @a _need bytes more, drops the cached
+	/// host DAGs no miner holds and the light caches of other epochs than the
+	/// current one. full() does before building a DAG.
+	static void trim(uint64_t _need);
+
+	/// Starts building the light cache for @a _seedHash in the background, e.g.
+	/// when a pool advertises the next epoch. The next epoch is also prepared
+	/// automatically whenever a new epoch comes into use.
+	static void prepare(h256 const& _seedHash);
+
+	/// Directory holding the DAG and light cache epoch files. An empty path disables both.
+	static void setDAGDirectory(std::string const& _dir);
+	static std::string dagDirectory();
+	/// The newest epoch an earlier run had in use, as recorded in the DAG
+	/// directory, or -1 if unknown.
+	static int lastEpoch();
+
+	/// Keeps light caches and host DAGs in named shared memory segments, one per
+	/// kind and epoch, instead of in this process' memory or the epoch files. Of
+	/// several processes wanting the same epoch the first builds it under a lock
+	/// file in the DAG directory (or the temporary one) and the rest wait for it,
+	/// then attach read-only. Segments outlive the processes, for the next start,
+	/// until an epoch goes out of use.
+	static void setSharedMemory(bool _shared);
+	static bool sharedMemory();
 
 	static Result eval(h256 const& _seedHash, h256 const& _headerHash, uint64_t  _nonce) noexcept;
+	/// Evaluates a burst of nonces for the same header at once. Failed entries are ~h256().
+	static std::vector<Result> eval(h256 const& _seedHash, h256 const& _headerHash, std::vector<uint64_t> const& _nonces) noexcept;
+
+	/// The final hash of @a _nonce given its mix hash, as found by a miner. Cheap
+	/// (no cache or DAG), but does not prove that @a _mixHash is right.
+	static h256 quickHash(h256 const& _headerHash, uint64_t _nonce, h256 const& _mixHash) noexcept;
+
+	/// Number of most recent epochs whose light caches and DAGs are kept.
+	static const unsigned c_epochsKept = 2;
+	/// Most epochs left behind at once whose shared memory segments are removed.
+	static const unsigned c_segmentSweep = 16;
 
 private:
 	EthashAux() = default;
 	static EthashAux& get();
 
+	/// Lock-free on the common path, see t_lightSnapshot in EthashAux.cpp.
+	static LightAllocation const& cachedLight(h256 const& _seedHash);
+	void noteEpoch(unsigned _epoch);
+	static void removeSegments(h256 const& _seedHash);
+	static void recordEpoch(unsigned _epoch);
+	void precompute(h256 const& _seedHash);
+
 	Mutex x_lights;
 	std::unordered_map<h256, LightType> m_lights;
-
-	Mutex x_epochs;
-	std::unordered_map<h256, unsigned> m_epochs;
-	h256s m_seedHashes;
+	int m_currentEpoch = -1;
+	/// Bumped whenever light caches are evicted, invalidating the per-thread snapshots.
+	std::atomic<unsigned> m_generation{0};
+	h256 m_pendingSeed;
+
+	Mutex x_fulls;
+	std::unordered_map<h256, FullType> m_fulls;
+
+	Mutex x_dagDir;
+	std::string m_dagDir = defaultDAGDirectory();
+	static std::string defaultDAGDirectory();
+	std::atomic<bool> m_sharedMemory{false};
+
+	/// Kept last: destroying it waits for a running precomputation while the
+	/// members it touches are still alive.
+	std::shared_future<LightType> m_pendingLight;
 };
 
 struct WorkPackage
@@ -99,6 +205,7 @@ struct Solution
 	h256 mixHash;
 	WorkPackage work;
 	bool stale;
+	unsigned miner;		///< Index of the miner that found it.
 };
 
 }
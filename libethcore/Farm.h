@@ -27,10 +27,17 @@
 #include <boost/date_time/posix_time/posix_time_io.hpp>
 #include <thread>
 #include <list>
+#include <bitset>
+#include <deque>
+#include <sstream>
 #include <atomic>
 #include <libdevcore/Common.h>
+#include <libdevcore/Reactor.h>
+#include <libdevcore/Trace.h>
 #include <libdevcore/Worker.h>
 #include <libethcore/Miner.h>
+#include <libethcore/Governor.h>
+#include <libethcore/HashRate.h>
 #include <libethcore/BlockHeader.h>
 
 namespace dev
@@ -39,6 +46,61 @@ namespace dev
 namespace eth
 {
 
+/// Latencies of one miner, see Miner::workSwitchLatency() and solutionLatency().
+struct MinerLatencyStats
+{
+	std::string name;
+	LatencyStats workSwitch;
+	LatencyStats solution;
+	LatencyStats accepted;		///< Share sent to the pool's reply, see Miner::shareReplied().
+	LatencyStats rejected;
+	LatencyStats stale;
+};
+
+/// Share submit round trips to one pool, see Farm::shareReplied().
+struct PoolLatencyStats
+{
+	std::string pool;
+	LatencyStats submit;
+};
+
+/// Where the time between a pool sending a job and a share going back is spent.
+struct LatencyReport
+{
+	LatencyStats job;						///< Job received by the pool client to Farm::setWork() done.
+	std::vector<MinerLatencyStats> miners;	///< Empty names where removed.
+	std::vector<PoolLatencyStats> pools;
+};
+
+/// Search result counts of one miner, see Miner::searchResults().
+struct MinerSearchResults
+{
+	std::string name;						///< Empty where removed.
+	SearchResultCounts counts;
+};
+
+/// Kernel timings of one miner, see Miner::kernelProfile().
+struct MinerKernelProfile
+{
+	std::string name;						///< Empty where removed.
+	KernelProfile profile;
+};
+
+/// A miner's DAG generation, see Farm::dagProgress().
+struct MinerDagProgress
+{
+	std::string name;						///< Empty where removed.
+	DagProgress progress;
+};
+
+/// Something the farm's miner watchdog did, see Farm::setWatchdog().
+struct WatchdogEvent
+{
+	std::chrono::system_clock::time_point time;
+	unsigned miner;
+	std::string what;
+};
+
 /**
  * @brief A collective of Miners.
  * Miners ask for work, then submit proofs
@@ -66,24 +128,77 @@ public:
 	~Farm()
 	{
 		stop();
+		m_strand.post([this]()
+		{
+			if (p_feetimer)
+				p_feetimer->cancel();
+		});
+		m_strand.drain();
+		// After stop() a recovery cannot start its miner again, only finish
+		// joining the old one.
+		for (;;)
+		{
+			std::list<Recovery> recoveries;
+			{
+				Guard l(x_recoveries);
+				recoveries.swap(m_recoveries);
+			}
+			if (recoveries.empty())
+				break;
+			for (auto& r: recoveries)
+				r.thread.join();
+		}
+		delete p_feetimer;
+		delete p_hashrateTimer;
 	}
 
 	/**
-	 * @brief Sets the current mining mission.
+	 * @brief Sets the work package to mine.
 	 * @param _wp The work package we wish to be mining.
+	 * @param _received When the pool client got it off the wire, if known.
 	 */
-	void setWork(WorkPackage const& _wp)
+	void setWork(WorkPackage const& _wp, std::chrono::steady_clock::time_point _received = std::chrono::steady_clock::time_point())
 	{
+		TraceScope trace("farm setWork");
 		//Collect hashrate before miner reset their work
 		collectHashRate();
 
-		// Set work to each miner
+		// Publish the work once for all miners, then wake them up
 		Guard l(x_minerWork);
 		if (_wp.header == m_work.header && _wp.startNonce == m_work.startNonce)
 			return;
+		if (_wp.seed != m_work.seed)
+			for (auto& w: m_watch)
+				w.hashed = false;	// DAG generation is no stall
 		m_work = _wp;
+		resetNonces(m_work, m_workSlot.generation() + 1, m_miners.size());
+		m_workSlot.publish(m_work);
 		for (auto const& m: m_miners)
-			m->setWork(m_work);
+			if (m)
+				m->notifyWork();
+		if (_received != std::chrono::steady_clock::time_point())
+			m_jobLatency.record<std::chrono::steady_clock>(_received, std::chrono::steady_clock::now());
+	}
+
+	/**
+	 * @brief Has the miners build the DAG of @a _seed while there is no work yet,
+	 * so the first package of that epoch is hashed right away.
+	 * @return False if work came in first; it is left alone.
+	 */
+	bool prepare(h256 const& _seed)
+	{
+		Guard l(x_minerWork);
+		if (m_work)
+			return false;
+		if (m_work.seed == _seed)
+			return true;
+		m_work.seed = _seed;
+		resetNonces(m_work, m_workSlot.generation() + 1, m_miners.size());
+		m_workSlot.publish(m_work);
+		for (auto const& m: m_miners)
+			if (m)
+				m->notifyWork();
+		return true;
 	}
 
 	void setSealers(std::map<std::string, SealerDescriptor> const& _sealers) { m_sealers = _sealers; }
@@ -102,6 +217,7 @@ public:
 		if (!mixed)
 		{
 			m_miners.clear();
+			m_minerSealers.clear();
 		}
 		auto ins = m_sealers[_sealer].instances();
 		unsigned start = 0;
@@ -119,29 +235,29 @@ public:
 		{
 			// TODO: Improve miners creation, use unique_ptr.
 			m_miners.push_back(std::shared_ptr<Miner>(m_sealers[_sealer].create(*this, i)));
+			m_minerSealers.push_back(_sealer);
 
 			// Start miners' threads. They should pause waiting for new work
 			// package.
 			m_miners.back()->startWorking();
 		}
+		resetHashRates(mixed);
 		m_isMining = true;
 		m_lastSealer = _sealer;
 		b_lastMixed = mixed;
 
-		if (!p_feetimer) {
-			p_feetimer = new boost::asio::deadline_timer(m_io_service, boost::posix_time::seconds(60*5));
-			p_feetimer->async_wait(boost::bind(&Farm::switchPool, this, boost::asio::placeholders::error));
-		}
-		if (!p_hashrateTimer) {
-			p_hashrateTimer = new boost::asio::deadline_timer(m_io_service, boost::posix_time::milliseconds(1000));
-			p_hashrateTimer->async_wait(boost::bind(&Farm::processHashRate, this, boost::asio::placeholders::error));
-			if (m_serviceThread.joinable()) {
-				m_io_service.reset();
-			}
-			else {
-				m_serviceThread = std::thread{ boost::bind(&boost::asio::io_service::run, &m_io_service) };
+		// The timers are only touched on m_strand.
+		m_strand.post([this]()
+		{
+			if (!p_feetimer) {
+				p_feetimer = new boost::asio::deadline_timer(m_strand.service(), boost::posix_time::seconds(60*5));
+				p_feetimer->async_wait(m_strand.wrap(boost::bind(&Farm::switchPool, this, boost::asio::placeholders::error)));
 			}
-		}
+			if (!p_hashrateTimer)
+				p_hashrateTimer = new boost::asio::deadline_timer(m_strand.service());
+			p_hashrateTimer->expires_from_now(boost::posix_time::milliseconds(1000));
+			p_hashrateTimer->async_wait(m_strand.wrap(boost::bind(&Farm::processHashRate, this, boost::asio::placeholders::error)));
+		});
 
 		return true;
 	}
@@ -154,60 +270,84 @@ public:
 		{
 			Guard l(x_minerWork);
 			m_miners.clear();
+			m_minerSealers.clear();
 			m_isMining = false;
 		}
 
-		m_io_service.stop();
-		m_serviceThread.join();
-
-		if (p_hashrateTimer) {
-			p_hashrateTimer->cancel();
-			p_hashrateTimer = nullptr;
-		}
+		// The fee timer keeps running; the pool schedule is not the miners'.
+		m_strand.post([this]()
+		{
+			if (p_hashrateTimer)
+				p_hashrateTimer->cancel();
+		});
 	}
 
     void collectHashRate()
+    {
+        std::vector<unsigned> stalled;
+        collectHashRate(stalled);
+        // Outside x_minerWork; see recoverMiner().
+        for (unsigned i: stalled)
+            recoverMiner(i);
+    }
+
+    void collectHashRate(std::vector<unsigned>& _stalled)
     {
         auto now = std::chrono::steady_clock::now();
 
         std::lock_guard<std::mutex> lock(x_minerWork);
 
-        WorkingProgress p;
-        p.ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_lastStart).count();
+        uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_lastStart).count();
         m_lastStart = now;
-        // Collect
-        for (auto const& i : m_miners)
+        // Collect and reset
+        uint64_t hashes = 0;
+        for (size_t i = 0; i < m_miners.size() && i < m_minerHashCounts.size(); ++i)
         {
-			uint64_t minerHashCount = i->hashCount();
-            p.hashes += minerHashCount;
-            p.minersHashes.push_back(minerHashCount);
+            if (!m_miners[i])
+            {
+                m_minerHashCounts[i] = 0;
+                if (i < m_minerProbeHashes.size())
+                    m_minerProbeHashes[i] = 0;
+                continue;
+            }
+            m_minerHashCounts[i] = m_miners[i]->hashCount();
+            m_miners[i]->resetHashCount();
+            m_minerHashTotals[i] += m_minerHashCounts[i];
+            hashes += m_minerHashCounts[i];
+            if (i < m_minerProbeHashes.size())
+                m_minerProbeHashes[i] = uint64_t(m_miners[i]->takeProbes() * Miner::probeDifficulty());
         }
+        watchMiners(now, ms, _stalled);
 
-        // Reset
-        for (auto const& i : m_miners)
-            i->resetHashCount();
+        // Idle periods are left out, as if the farm had not been running; every
+        // meter gets the same samples so their windows stay aligned.
+        if (hashes == 0)
+            return;
+        m_hashRate.sample(hashes, ms);
+        for (size_t i = 0; i < m_minerHashCounts.size(); ++i)
+            m_minerHashRates[i].sample(m_minerHashCounts[i], ms);
+        if (Miner::probeTarget())
+            for (size_t i = 0; i < m_minerProbeHashes.size(); ++i)
+                m_minerEffectiveRates[i].sample(m_minerProbeHashes[i], ms);
 
-        if (p.hashes > 0)
-            m_lastProgresses.push_back(p);
-
-        // We smooth the hashrate over the last x seconds
-        int allMs = 0;
-        for (auto const& cp : m_lastProgresses)
-            allMs += cp.ms;
-
-        if (allMs > m_hashrateSmoothInterval)
-            m_lastProgresses.erase(m_lastProgresses.begin());
+        Guard n(x_nonces);
+        m_leaseRates.resize(m_minerHashRates.size());
+        for (size_t i = 0; i < m_minerHashRates.size(); ++i)
+            m_leaseRates[i] = m_minerHashRates[i].stats().rate10s;
     }
 
 	void processHashRate(const boost::system::error_code& ec) {
 
+		if (ec == boost::asio::error::operation_aborted)
+			return;
 		if (!ec) {
 			collectHashRate();
+			publishProgress();
 		}
 
 		// Restart timer 	
 		p_hashrateTimer->expires_at(p_hashrateTimer->expires_at() + boost::posix_time::milliseconds(1000));
-		p_hashrateTimer->async_wait(boost::bind(&Farm::processHashRate, this, boost::asio::placeholders::error));
+		p_hashrateTimer->async_wait(m_strand.wrap(boost::bind(&Farm::processHashRate, this, boost::asio::placeholders::error)));
 	}
 	
 	/**
@@ -223,8 +363,238 @@ public:
 		}
 	}
 
+	/**
+	 * @brief Stops miner @a _index from searching, keeping its device state
+	 * and DAG so that resumeMiner() is immediate. The other miners go on.
+	 * @return false if there is no such miner.
+	 */
+	bool pauseMiner(unsigned _index) { return setMinerPaused(_index, true); }
+
+	bool resumeMiner(unsigned _index) { return setMinerPaused(_index, false); }
+
+	/**
+	 * @brief Changes launch parameters of miner @a _index while it mines,
+	 * see Miner::tune().
+	 * @return false, with the reason in @a _error, if there is no such
+	 * miner or it does not take the parameters.
+	 */
+	bool tuneMiner(unsigned _index, MinerTuning const& _params, std::string& _error)
+	{
+		std::shared_ptr<Miner> miner = minerAt(_index);
+		if (!miner)
+		{
+			_error = "No miner " + std::to_string(_index);
+			return false;
+		}
+		if (!miner->tune(_params, _error))
+			return false;
+		cnote << "Tuning miner" << miner->Name() << tuningString(_params);
+		return true;
+	}
+
+	/// The launch parameters of miner @a _index, empty if there is none.
+	MinerTuning minerTuning(unsigned _index) const
+	{
+		std::shared_ptr<Miner> miner = minerAt(_index);
+		return miner ? miner->tuning() : MinerTuning();
+	}
+
+	/**
+	 * @brief Destroys miner @a _index, releasing its device and DAG buffers.
+	 * Its slot is kept, so the other miners keep their indexes and
+	 * reinitMiner() can bring the device back.
+	 * @return false if there is no such miner.
+	 */
+	bool removeMiner(unsigned _index)
+	{
+		std::shared_ptr<Miner> miner;
+		{
+			Guard l(x_minerWork);
+			if (_index >= m_miners.size() || !m_miners[_index])
+				return false;
+			miner.swap(m_miners[_index]);
+		}
+		// Joins its thread, which may be waiting on the farm: not under x_minerWork.
+		cnote << "Removing miner" << miner->Name();
+		miner.reset();
+		return true;
+	}
+
+	/**
+	 * @brief Recreates miner @a _index (removed or not) from its sealer, for a
+	 * device that went bad. Only that device re-initialises: it gets its
+	 * DAG again, the other miners are not touched.
+	 * @return false if the slot was never started.
+	 */
+	bool reinitMiner(unsigned _index)
+	{
+		removeMiner(_index);
+
+		Guard l(x_minerWork);
+		if (_index >= m_miners.size() || m_miners[_index] || !m_sealers.count(m_minerSealers[_index]))
+			return false;
+		m_miners[_index].reset(m_sealers[m_minerSealers[_index]].create(*this, _index));
+		m_miners[_index]->startWorking();
+		if (_index < m_minerHashRates.size())
+		{
+			m_minerHashRates[_index].reset();
+			m_minerEffectiveRates[_index].reset();
+		}
+		cnote << "Restarted miner" << m_miners[_index]->Name();
+		return true;
+	}
+
+	/**
+	 * @brief Has the farm re-initialise a miner that hashed nothing for
+	 * @a _stallSeconds, or ran at under half its 15 minute rate for three
+	 * times as long. Miners that have not hashed yet since they started or
+	 * since the epoch changed (DAG generation) are left alone. Repeated
+	 * recoveries of a device back off exponentially. 0 disables the watchdog.
+	 */
+	void setWatchdog(unsigned _stallSeconds) { m_watchdogMs = _stallSeconds * 1000ull; }
+
+	/// What setInvalidLimit() does to a device over the limit.
+	enum class InvalidAction { Throttle, Reinit };
+
+	/**
+	 * @brief Flags a device once over @a _percent of its recent results, of
+	 * at least c_invalidMinResults, are invalid: its solutions that failed
+	 * their verification on the CPU or that the pool rejected though not
+	 * stale. Throttle then has it idle c_invalidThrottleStep permille more of
+	 * the time, on top of the governor, and re-initialises it once that is
+	 * at c_invalidThrottleMax; Reinit re-initialises it at once. It is judged
+	 * again on the results since, c_invalidHoldOffMs on at the soonest.
+	 * 0 (the default) only counts the results, see WorkingProgress::minersShares.
+	 */
+	void setInvalidLimit(double _percent, InvalidAction _action)
+	{
+		m_invalidLimit = _percent;
+		m_invalidAction = _action;
+	}
+
+	/**
+	 * @brief Has the miners idle part of the time to stay at or under
+	 * @a _tempC and @a _powerW, as their monitors read, see Governor.
+	 * 0 leaves that target out; both 0 run the miners flat out.
+	 */
+	void setGovernor(int _tempC, unsigned _powerW)
+	{
+		m_strand.post([this, _tempC, _powerW]()
+		{
+			m_governor.setTargets(_tempC, _powerW);
+			if (m_governor.enabled())
+				m_wantHwmon = true;
+		});
+	}
+
+	/// Work-switch and solution latencies of the miners, see LatencyReport.
+	LatencyReport latencyReport() const
+	{
+		LatencyReport r;
+		r.job = m_jobLatency.stats();
+		Guard l(x_minerWork);
+		for (auto const& m: m_miners)
+		{
+			MinerLatencyStats s;
+			if (m)
+			{
+				s.name = m->Name();
+				s.workSwitch = m->workSwitchLatency().stats();
+				s.solution = m->solutionLatency().stats();
+				s.accepted = m->acceptedLatency().stats();
+				s.rejected = m->rejectedLatency().stats();
+				s.stale = m->staleLatency().stats();
+			}
+			r.miners.push_back(s);
+		}
+		Guard lp(x_poolLatency);
+		for (auto const& p: m_poolLatency)
+			r.pools.push_back(PoolLatencyStats{p.first, p.second->stats()});
+		return r;
+	}
+
+	/**
+	 * @brief Notes a pool's reply to a share, for latencyReport().
+	 * @param _pool The pool as host:port.
+	 * @param _miner Solution::miner of the share.
+	 * @param _us From sending the share to the reply.
+	 */
+	void shareReplied(std::string const& _pool, unsigned _miner, bool _accepted, bool _stale, uint64_t _us)
+	{
+		{
+			Guard l(x_poolLatency);
+			auto& h = m_poolLatency[_pool];
+			if (!h)
+				h.reset(new LatencyHistogram);
+			h->record(_us);
+		}
+		Guard l(x_minerWork);
+		if (_miner < m_miners.size() && m_miners[_miner])
+			m_miners[_miner]->shareReplied(_accepted, _stale, _us);
+	}
+
+	std::vector<MinerSearchResults> searchResults() const
+	{
+		std::vector<MinerSearchResults> r;
+		Guard l(x_minerWork);
+		for (auto const& m: m_miners)
+		{
+			MinerSearchResults s;
+			if (m)
+			{
+				s.name = m->Name();
+				s.counts = m->searchResults();
+			}
+			r.push_back(s);
+		}
+		return r;
+	}
+
+	std::vector<MinerKernelProfile> kernelProfiles() const
+	{
+		std::vector<MinerKernelProfile> r;
+		Guard l(x_minerWork);
+		for (auto const& m: m_miners)
+		{
+			MinerKernelProfile s;
+			if (m)
+			{
+				s.name = m->Name();
+				s.profile = m->kernelProfile();
+			}
+			r.push_back(s);
+		}
+		return r;
+	}
+
+	std::vector<MinerDagProgress> dagProgress() const
+	{
+		std::vector<MinerDagProgress> r;
+		Guard l(x_minerWork);
+		for (auto const& m: m_miners)
+		{
+			MinerDagProgress s;
+			if (m)
+			{
+				s.name = m->Name();
+				s.progress = m->dagProgress();
+			}
+			r.push_back(s);
+		}
+		return r;
+	}
+
+	/// The watchdog's recent actions, oldest first.
+	std::vector<WatchdogEvent> watchdogEvents() const
+	{
+		Guard l(x_minerWork);
+		return std::vector<WatchdogEvent>(m_watchdogEvents.begin(), m_watchdogEvents.end());
+	}
+
 	void switchPool(const boost::system::error_code& error)
 	{
+		if (error == boost::asio::error::operation_aborted)
+			return;
 		p_feetimer->cancel();
 		if (m_onSwitchPool) {
 			m_onSwitchPool();
@@ -237,7 +607,7 @@ public:
 				p_feetimer->expires_from_now(boost::posix_time::seconds(60*2));
 			}
 		}
-		p_feetimer->async_wait(boost::bind(&Farm::switchPool, this, boost::asio::placeholders::error));
+		p_feetimer->async_wait(m_strand.wrap(boost::bind(&Farm::switchPool, this, boost::asio::placeholders::error)));
 	}
 		
 	bool isMining() const
@@ -250,54 +620,84 @@ public:
 		return m_isFee;
 	}
 
-    /**
-     * @brief Get information on the progress of mining this work package.
-     * @return The progress with mining so far.
-     */
-    WorkingProgress const& miningProgress(bool hwmon = false) const
-    {
-        std::lock_guard<std::mutex> lock(x_minerWork);
-        WorkingProgress p;
-        p.ms = 0;
-        p.hashes = 0;
-		p.fee_mode = m_isFee;
-		if (p_feetimer) {
-			p.fee_timer = p_feetimer->expires_from_now().total_seconds();
-		}
-		else {
-			p.fee_timer = 0;
+	/**
+	 * @brief Get information on the progress of mining this work package.
+	 * Reads the snapshot published by the hashrate timer every second, so
+	 * it never waits on the miners or delays work delivery to them.
+	 * @param hwmon Include the miners' monitors; they are only sampled once
+	 * asked for.
+	 * @return The progress with mining so far.
+	 */
+	WorkingProgress miningProgress(bool hwmon = false) const
+	{
+		if (hwmon)
+			m_wantHwmon = true;
+		std::shared_ptr<WorkingProgress const> snapshot = std::atomic_load(&m_progress);
+		if (!snapshot)
+			return WorkingProgress();
+		WorkingProgress p = *snapshot;
+		if (!hwmon)
+		{
+			p.minerMonitors.clear();
+			p.minersJoules.clear();
+			p.minersMeteredHashes.clear();
 		}
-        for (auto const& i : m_miners)
-        {
-            p.minersHashes.push_back(0);
-			p.minersNames.push_back(i->Name());
-            if (hwmon)
-                p.minerMonitors.push_back(i->hwmon());
-        }
+		return p;
+	}
 
-        for (auto const& cp : m_lastProgresses)
-        {
-            p.ms += cp.ms;
-            p.hashes += cp.hashes;
-            for (unsigned int i = 0; i < cp.minersHashes.size(); i++)
-            {
-                p.minersHashes.at(i) += cp.minersHashes.at(i);
-            }
-        }
+	/// EWMA and percentile hashrates of the whole farm.
+	HashRateStats hashRateStats() const
+	{
+		Guard l(x_minerWork);
+		return m_hashRate.stats();
+	}
 
-        m_progress = p;
-        return m_progress;
-    }
+	/// EWMA and percentile hashrates of miner @a _index.
+	HashRateStats hashRateStats(unsigned _index) const
+	{
+		Guard l(x_minerWork);
+		return _index < m_minerHashRates.size() ? m_minerHashRates[_index].stats() : HashRateStats();
+	}
+
+	/**
+	 * @brief Calls @a _f(index, miner, rates, hashes) for each miner there is,
+	 * @a hashes being its count so far, with the miners locked: for exporting
+	 * them all without copies. @a _f must not call back into the farm.
+	 */
+	template <class F>
+	void forEachMiner(F const& _f) const
+	{
+		Guard l(x_minerWork);
+		for (size_t i = 0; i < m_miners.size() && i < m_minerHashRates.size(); ++i)
+			if (m_miners[i])
+				_f(unsigned(i), *m_miners[i], m_minerHashRates[i].stats(), m_minerHashTotals[i]);
+	}
+
+	/// Hashes of each miner so far, with those the hashrate timer has not
+	/// collected yet: exact at any time, unlike miningProgress().
+	std::vector<uint64_t> minerHashTotals() const
+	{
+		Guard l(x_minerWork);
+		std::vector<uint64_t> totals(m_minerHashTotals.begin(), m_minerHashTotals.end());
+		for (size_t i = 0; i < totals.size() && i < m_miners.size(); ++i)
+			if (m_miners[i])
+				totals[i] += m_miners[i]->hashCount();
+		return totals;
+	}
 
 	SolutionStats getSolutionStats() {
 		return m_solutionStats;
 	}
 
-	void failedSolution() override {
+	void failedSolution(unsigned _miner) override {
 		m_solutionStats.failed();
+		// On the miner's thread, while a stop() may hold x_minerWork waiting
+		// for it: the judging is left to the strand.
+		m_strand.post([this, _miner]() { countSolution(_miner, &MinerShares::failed, true); });
 	}
 
-	void acceptedSolution(bool _stale) {
+	/// The pool's reply to a solution of miner @a _miner (Solution::miner).
+	void acceptedSolution(bool _stale, unsigned _miner) {
 		if (!_stale)
 		{
 			m_solutionStats.accepted();
@@ -306,9 +706,14 @@ public:
 		{
 			m_solutionStats.acceptedStale();
 		}
+		m_strand.post([this, _miner]() { countSolution(_miner, &MinerShares::accepted, false); });
 	}
 
-	void rejectedSolution(bool _stale) {
+	void droppedSolution() {
+		m_solutionStats.dropped();
+	}
+
+	void rejectedSolution(bool _stale, unsigned _miner) {
 		if (!_stale)
 		{
 			m_solutionStats.rejected();
@@ -317,6 +722,8 @@ public:
 		{
 			m_solutionStats.rejectedStale();
 		}
+		// A stale share is the job's fault, not the device's.
+		m_strand.post([this, _miner, _stale]() { countSolution(_miner, &MinerShares::rejected, !_stale, !_stale); });
 	}
 
 	using SolutionFound = std::function<void(Solution const&)>;
@@ -367,7 +774,395 @@ public:
 		return m_nonce_scrambler;
 	}
 
+	WorkSlot const& workSlot() const override { return m_workSlot; }
+
+	NonceLease leaseNonces(unsigned _index, uint64_t _granularity, uint64_t _generation) override
+	{
+		// About c_nonceLeaseMs worth of hashes: fast devices come back as
+		// rarely as slow ones, and nonces are not scattered over idle leases.
+		// Only x_nonces is taken here: miners are destroyed with x_minerWork held.
+		Guard l(x_nonces);
+		uint64_t const rate = _index < m_leaseRates.size() ? m_leaseRates[_index] : 0;
+		uint64_t count = max(rate * c_nonceLeaseMs / 1000, _granularity);
+		count = (count + _granularity - 1) / _granularity * _granularity;
+
+		NonceLease lease;
+		lease.generation = m_nonceGeneration;
+		if (_generation != m_nonceGeneration)
+			return lease;
+
+		// Nor more than the miner's weighted share of what is left: when the
+		// space is narrow a slow device only takes little of it and the last
+		// nonces are spread so that all devices run out at about the same time.
+		bool const weighed = _index < m_leaseWeights.size();
+		long double const weight = weighed ? m_leaseWeights[_index] : m_leaseWeightDefault;
+		long double const share = m_noncesLeft * (weight / (m_leaseWeightTotal + (weighed ? 0 : weight)));
+		if (share < count)
+			count = max(uint64_t(share) / _granularity * _granularity, _granularity);
+		if (count > m_noncesLeft)
+			count = m_noncesLeft / _granularity * _granularity;
+		if (count == 0)
+		{
+			if (!m_noncesExhausted)
+			{
+				cwarn << "All nonces of the current job searched, waiting for the next one.";
+			}
+			m_noncesExhausted = true;
+			return lease;
+		}
+		lease.start = m_nonceNext;
+		lease.count = count;
+		m_nonceNext += count;
+		m_noncesLeft -= count;
+		return lease;
+	}
+
 private:
+	/**
+	 * Starts handing out the nonces of @a _wp, to be published as @a _generation.
+	 * With a pool extranonce only the low 64 - exSizeBits bits are ours to search.
+	 * The lease weights of the @a _miners miners are re-balanced from their last
+	 * measured rates; ones not measured yet count as an average device.
+	 */
+	void resetNonces(WorkPackage const& _wp, uint64_t _generation, size_t _miners)
+	{
+		Guard l(x_nonces);
+		m_nonceGeneration = _generation;
+		m_noncesExhausted = false;
+
+		uint64_t measured = 0;
+		size_t known = 0;
+		for (size_t i = 0; i < _miners && i < m_leaseRates.size(); ++i)
+			if (m_leaseRates[i])
+			{
+				measured += m_leaseRates[i];
+				++known;
+			}
+		m_leaseWeightDefault = known ? measured / known : 1;
+		m_leaseWeights.assign(_miners, m_leaseWeightDefault);
+		for (size_t i = 0; i < _miners && i < m_leaseRates.size(); ++i)
+			if (m_leaseRates[i])
+				m_leaseWeights[i] = m_leaseRates[i];
+		m_leaseWeightTotal = 0;
+		for (uint64_t w: m_leaseWeights)
+			m_leaseWeightTotal += w;
+
+		if (_wp.exSizeBits >= 0)
+		{
+			m_nonceNext = _wp.startNonce;
+			m_noncesLeft = _wp.exSizeBits == 0 ? ~uint64_t(0) : _wp.exSizeBits >= 64 ? 1 : uint64_t(1) << (64 - _wp.exSizeBits);
+		}
+		else
+		{
+			m_nonceNext = m_nonce_scrambler;
+			m_noncesLeft = ~uint64_t(0);
+		}
+	}
+
+	bool setMinerPaused(unsigned _index, bool _paused)
+	{
+		Guard l(x_minerWork);
+		if (_index >= m_miners.size() || !m_miners[_index])
+			return false;
+		m_miners[_index]->pause(_paused);
+		if (_index < m_watch.size())
+			m_watch[_index].hashed = false;
+		cnote << (_paused ? "Paused miner" : "Resumed miner") << m_miners[_index]->Name();
+		return true;
+	}
+
+	std::shared_ptr<Miner> minerAt(unsigned _index) const
+	{
+		Guard l(x_minerWork);
+		return _index < m_miners.size() ? m_miners[_index] : std::shared_ptr<Miner>();
+	}
+
+	static std::string tuningString(MinerTuning const& _t)
+	{
+		std::string s;
+		for (auto const& p: _t)
+			s += (s.empty() ? "" : " ") + p.first + "=" + std::to_string(p.second);
+		return s;
+	}
+
+	/// Builds the next miningProgress() snapshot. The miners' hwmon() return
+	/// the HwMonSampler's last readings, and are made without x_minerWork held.
+	/// Their power is integrated here, once per snapshot, into the energy the
+	/// efficiency is figured from, and the governor is fed the readings.
+	void publishProgress()
+	{
+		std::shared_ptr<WorkingProgress> p = std::make_shared<WorkingProgress>();
+		std::vector<std::shared_ptr<Miner>> miners;
+		std::vector<uint64_t> totals;
+		std::vector<unsigned> backOff;
+		bool hwmon;
+		{
+			Guard l(x_minerWork);
+			p->fee_mode = m_isFee;
+			p->fee_timer = p_feetimer ? p_feetimer->expires_from_now().total_seconds() : 0;
+			// All meters see the same sample intervals, so the farm's window
+			// duration applies to every miner.
+			p->ms = m_hashRate.windowMs();
+			p->hashes = m_hashRate.windowHashes();
+			for (size_t i = 0; i < m_miners.size(); ++i)
+			{
+				p->minersHashes.push_back(i < m_minerHashRates.size() ? m_minerHashRates[i].windowHashes() : 0);
+				if (Miner::probeTarget())
+					p->minersEffectiveHashes.push_back(i < m_minerEffectiveRates.size() && m_miners[i] ?
+						uint64_t(m_minerEffectiveRates[i].windowHashes() * m_miners[i]->probeHealth().validFraction()) : 0);
+				p->minersNames.push_back(m_miners[i] ? m_miners[i]->Name() : std::string("-"));
+				p->minersShares.push_back(i < m_validity.size() ? m_validity[i].shares : MinerShares());
+				backOff.push_back(i < m_validity.size() ? m_validity[i].idlePermille : 0);
+			}
+			hwmon = m_wantHwmon;
+			miners = m_miners;
+			totals = m_minerHashTotals;
+		}
+		if (hwmon)
+			for (auto const& m: miners)
+				p->minerMonitors.push_back(m ? m->hwmon() : HwMonitor());
+
+		auto const now = std::chrono::steady_clock::now();
+		double const seconds = m_lastPublish == std::chrono::steady_clock::time_point() ? 0 : std::chrono::duration<double>(now - m_lastPublish).count();
+		m_lastPublish = now;
+		m_minerEnergy.resize(totals.size());
+		for (size_t i = 0; i < totals.size(); ++i)
+		{
+			MinerEnergy& e = m_minerEnergy[i];
+			uint64_t const hashes = totals[i] >= e.lastTotal ? totals[i] - e.lastTotal : totals[i];
+			e.lastTotal = totals[i];
+			if (i >= p->minerMonitors.size())
+				continue;
+			if (unsigned const watts = p->minerMonitors[i].powerW)
+			{
+				e.joules += watts * seconds;
+				e.hashes += hashes;
+			}
+			p->minersJoules.push_back(e.joules);
+			p->minersMeteredHashes.push_back(e.hashes);
+		}
+		// The invalid-result back-off is applied anew to re-initialised miners.
+		bool const govern = m_governor.enabled() && seconds > 0;
+		for (size_t i = 0; i < miners.size() && i < p->minersHashes.size(); ++i)
+		{
+			if (!miners[i] || (!govern && !backOff[i]))
+				continue;
+			unsigned permille = backOff[i];
+			if (govern)
+			{
+				HwMonitor const& hw = p->minerMonitors[i];
+				permille = std::max(permille, m_governor.update(i, p->minersNames[i], hw.tempC, hw.powerW, p->minerRate(p->minersHashes[i]), seconds));
+			}
+			miners[i]->throttle(permille);
+		}
+		std::atomic_store(&m_progress, std::shared_ptr<WorkingProgress const>(p));
+	}
+
+	/// Energy accounting of one m_miners entry, see publishProgress().
+	struct MinerEnergy
+	{
+		uint64_t lastTotal = 0;	///< m_minerHashTotals entry at the last snapshot.
+		double joules = 0;
+		uint64_t hashes = 0;	///< Computed while the power was known.
+	};
+
+	/// Watchdog state of one m_miners entry.
+	struct MinerWatch
+	{
+		bool hashed = false;		///< Since (re)start, resume or epoch change.
+		bool recovering = false;
+		uint64_t stalledMs = 0;
+		uint64_t slowMs = 0;
+		uint64_t healthyMs = 0;
+		unsigned attempts = 0;		///< Recent recoveries, for the back-off.
+		std::chrono::steady_clock::time_point holdOff;
+	};
+
+	/// Feeds the watchdog one collectHashRate() interval; appends the miners to
+	/// recover to @a _stalled. Call with x_minerWork held.
+	void watchMiners(std::chrono::steady_clock::time_point _now, uint64_t _ms, std::vector<unsigned>& _stalled)
+	{
+		m_watch.resize(m_miners.size());
+		if (!m_watchdogMs || !m_work)
+			return;
+		for (size_t i = 0; i < m_miners.size() && i < m_minerHashCounts.size(); ++i)
+		{
+			MinerWatch& w = m_watch[i];
+			if (!m_miners[i] || m_miners[i]->paused() || w.recovering)
+				continue;
+			uint64_t const hashes = m_minerHashCounts[i];
+			if (!w.hashed)
+			{
+				w.hashed = hashes != 0;
+				w.stalledMs = w.slowMs = 0;
+				continue;
+			}
+
+			HashRateStats const rate = m_minerHashRates[i].stats();
+			w.stalledMs = hashes ? 0 : w.stalledMs + _ms;
+			w.slowMs = rate.rate10s * 2 < rate.rate15m ? w.slowMs + _ms : 0;
+			w.healthyMs = w.stalledMs || w.slowMs ? 0 : w.healthyMs + _ms;
+			if (w.healthyMs >= c_watchdogHealthyMs)
+				w.attempts = 0;
+
+			char const* reason = nullptr;
+			if (w.stalledMs >= m_watchdogMs)
+				reason = "stalled";
+			else if (w.slowMs >= 3 * m_watchdogMs)
+				reason = "slowed down";
+			if (!reason || _now < w.holdOff)
+				continue;
+
+			std::ostringstream what;
+			what << m_miners[i]->Name() << " " << reason << " (" << rate.rate10s << " H/s, usually "
+				<< rate.rate15m << " H/s), re-initialising it, attempt " << w.attempts + 1;
+			cwarn << "Watchdog:" << what.str();
+			m_watchdogEvents.push_back(WatchdogEvent{std::chrono::system_clock::now(), unsigned(i), what.str()});
+			if (m_watchdogEvents.size() > c_watchdogEvents)
+				m_watchdogEvents.pop_front();
+
+			uint64_t const backOff = c_watchdogBackOffMs << min(w.attempts, 6u);
+			w.holdOff = _now + std::chrono::milliseconds(backOff);
+			++w.attempts;
+			w.hashed = false;
+			w.recovering = true;
+			_stalled.push_back(i);
+		}
+	}
+
+	static const unsigned c_invalidWindow = 64;					///< Recent results judged.
+	static const unsigned c_invalidMinResults = 10;
+	static const unsigned c_invalidThrottleStep = 250;
+	static const unsigned c_invalidThrottleMax = 750;
+	static const uint64_t c_invalidHoldOffMs = 10 * 60000;
+
+	/// Invalid-result state of one m_miners entry, kept over its re-initialisations.
+	struct MinerValidity
+	{
+		MinerShares shares;
+		std::bitset<c_invalidWindow> recent;	///< Set for the invalid ones, newest first.
+		unsigned results = 0;					///< In recent, up to c_invalidWindow.
+		unsigned idlePermille = 0;				///< The throttle back-off.
+		std::chrono::steady_clock::time_point holdOff;
+	};
+
+	/// Null for a miner the farm never had. Call with x_minerWork held.
+	MinerValidity* minerValidity(unsigned _miner)
+	{
+		if (_miner >= m_miners.size())
+			return nullptr;
+		if (m_validity.size() < m_miners.size())
+			m_validity.resize(m_miners.size());
+		return &m_validity[_miner];
+	}
+
+	/// Counts a result of miner @a _miner in @a _count and, if @a _judged,
+	/// judges it. On m_strand, never on a miner's thread: it takes x_minerWork.
+	void countSolution(unsigned _miner, uint64_t MinerShares::*_count, bool _invalid, bool _judged = true)
+	{
+		Guard l(x_minerWork);
+		if (MinerValidity* v = minerValidity(_miner))
+		{
+			++(v->shares.*_count);
+			if (_judged)
+				judgeMiner(_miner, *v, _invalid);
+		}
+	}
+
+	/// Adds a result to the recent ones of miner @a _miner and acts on them,
+	/// see setInvalidLimit(). Call with x_minerWork held.
+	void judgeMiner(unsigned _miner, MinerValidity& _v, bool _invalid)
+	{
+		_v.recent <<= 1;
+		_v.recent[0] = _invalid;
+		if (_v.results < c_invalidWindow)
+			++_v.results;
+		_v.shares.invalidRate = 100.0 * _v.recent.count() / _v.results;
+		if (!m_invalidLimit || _v.results < c_invalidMinResults || _v.shares.invalidRate <= m_invalidLimit)
+			return;
+		auto const now = std::chrono::steady_clock::now();
+		if (now < _v.holdOff)
+			return;
+		_v.holdOff = now + std::chrono::milliseconds(uint64_t(c_invalidHoldOffMs));
+		_v.recent.reset();
+		_v.results = 0;
+		_v.shares.flagged = true;
+
+		std::ostringstream what;
+		what << (m_miners[_miner] ? m_miners[_miner]->Name() : std::string("-")) << " had " << std::fixed
+			<< std::setprecision(1) << _v.shares.invalidRate << "% invalid results, over " << m_invalidLimit << "%, ";
+		if (m_invalidAction == InvalidAction::Throttle && _v.idlePermille < c_invalidThrottleMax)
+		{
+			_v.idlePermille += c_invalidThrottleStep;
+			what << "idling it " << _v.idlePermille / 10 << "% of the time";
+		}
+		else
+		{
+			m_watch.resize(m_miners.size());
+			if (m_watch[_miner].recovering)
+				return;
+			m_watch[_miner].recovering = true;
+			what << "re-initialising it";
+			recoverMiner(_miner);
+		}
+		cwarn << "Invalid results:" << what.str();
+		m_watchdogEvents.push_back(WatchdogEvent{std::chrono::system_clock::now(), _miner, what.str()});
+		if (m_watchdogEvents.size() > c_watchdogEvents)
+			m_watchdogEvents.pop_front();
+	}
+
+	/// Re-initialises miner @a _index for the watchdog. On a thread of its own:
+	/// destroying a miner joins its thread, which may never come back from a
+	/// hung kernel, and neither the farm's timers nor its other miners should
+	/// wait for that.
+	void recoverMiner(unsigned _index)
+	{
+		Guard r(x_recoveries);
+		// Those done are joined on the way, the rest by ~Farm.
+		for (auto it = m_recoveries.begin(); it != m_recoveries.end();)
+			if (it->done->load(std::memory_order_acquire))
+			{
+				it->thread.join();
+				it = m_recoveries.erase(it);
+			}
+			else
+				++it;
+		std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+		m_recoveries.push_back(Recovery{std::thread([this, _index, done]()
+		{
+			reinitMiner(_index);
+			{
+				Guard l(x_minerWork);
+				if (_index < m_watch.size())
+					m_watch[_index].recovering = false;
+			}
+			done->store(true, std::memory_order_release);
+		}), done});
+	}
+
+	/// Sizes the hashrate meters for m_miners; keeps the farm's series when
+	/// miners are only being added. Call with x_minerWork held.
+	void resetHashRates(bool _keepTotal)
+	{
+		if (!_keepTotal)
+		{
+			m_hashRate.reset();
+			m_hashRate.setWindow(m_hashrateSmoothInterval);
+			m_lastStart = std::chrono::steady_clock::now();
+		}
+		m_minerHashCounts.assign(m_miners.size(), 0);
+		m_minerHashTotals.resize(m_miners.size());
+		m_minerHashRates.resize(m_miners.size());
+		m_minerEffectiveRates.resize(m_miners.size());
+		m_minerProbeHashes.assign(m_miners.size(), 0);
+		for (auto* meters: {&m_minerHashRates, &m_minerEffectiveRates})
+			for (auto& m: *meters)
+			{
+				m.reset();
+				m.setWindow(m_hashrateSmoothInterval);
+			}
+	}
+
 	/**
 	 * @brief Called from a Miner to note a WorkPackage has a solution.
 	 * @param _p The solution.
@@ -381,13 +1176,16 @@ private:
 	}
 
 	mutable Mutex x_minerWork;
-	std::vector<std::shared_ptr<Miner>> m_miners;
+	std::vector<std::shared_ptr<Miner>> m_miners;	///< Null where removeMiner()'d.
+	std::vector<std::string> m_minerSealers;		///< What each m_miners entry was created from.
 	WorkPackage m_work;
+	WorkSlot m_workSlot;
 
 	std::atomic<bool> m_isMining = { false };
 	std::atomic<bool> m_isFee = { false };
 
-	mutable WorkingProgress m_progress;
+	std::shared_ptr<WorkingProgress const> m_progress;	///< Swapped whole, see publishProgress().
+	mutable std::atomic<bool> m_wantHwmon = { false };
 
 	SolutionFound m_onSolutionFound;
 	MinerRestart m_onMinerRestart;
@@ -399,11 +1197,53 @@ private:
 
 	std::chrono::steady_clock::time_point m_lastStart;
 	int m_hashrateSmoothInterval = 10000;
-	std::thread m_serviceThread;  ///< The IO service thread.
-	boost::asio::io_service m_io_service;
+	ReactorStrand m_strand;  ///< Runs the timers below.
 	boost::asio::deadline_timer * p_hashrateTimer = nullptr;
 	boost::asio::deadline_timer * p_feetimer = nullptr;
-	std::vector<WorkingProgress> m_lastProgresses;
+	LatencyHistogram m_jobLatency;
+	mutable Mutex x_poolLatency;
+	std::map<std::string, std::unique_ptr<LatencyHistogram>> m_poolLatency;
+	HashRateMeter m_hashRate;						///< The whole farm.
+	std::vector<HashRateMeter> m_minerHashRates;	///< One per m_miners entry.
+	std::vector<uint64_t> m_minerHashCounts;		///< Scratch for collectHashRate().
+	/// Of the pseudo-shares, see Miner::setProbeDifficulty(); one per m_miners entry.
+	std::vector<HashRateMeter> m_minerEffectiveRates;
+	std::vector<uint64_t> m_minerProbeHashes;		///< Scratch for collectHashRate().
+	std::vector<uint64_t> m_minerHashTotals;		///< Hashes of each m_miners entry so far.
+	std::vector<MinerEnergy> m_minerEnergy;		///< Only touched by publishProgress().
+	Governor m_governor;						///< Only touched on m_strand.
+	std::chrono::steady_clock::time_point m_lastPublish;
+
+	/// Target lease duration for leaseNonces().
+	static const uint64_t c_nonceLeaseMs = 2000;
+	Mutex x_nonces;							///< Taken after x_minerWork, if both.
+	std::vector<uint64_t> m_leaseRates;		///< rate10s of each miner, for leaseNonces().
+	uint64_t m_nonceGeneration = 0;
+	uint64_t m_nonceNext = 0;
+	uint64_t m_noncesLeft = 0;
+	bool m_noncesExhausted = true;			///< Also before the first work: nothing to warn about.
+	std::vector<uint64_t> m_leaseWeights;	///< Relative speed of each miner for the current job.
+	uint64_t m_leaseWeightDefault = 1;		///< For miners added since.
+	long double m_leaseWeightTotal = 0;
+
+	uint64_t m_watchdogMs = 0;
+	std::vector<MinerWatch> m_watch;			///< One per m_miners entry.
+	/// A thread of recoverMiner(), and whether it is done.
+	struct Recovery
+	{
+		std::thread thread;
+		std::shared_ptr<std::atomic<bool>> done;
+	};
+	Mutex x_recoveries;						///< Taken after x_minerWork, if both.
+	std::list<Recovery> m_recoveries;
+	std::deque<WatchdogEvent> m_watchdogEvents;
+	static const size_t c_watchdogEvents = 64;
+	static const uint64_t c_watchdogBackOffMs = 60000;		///< Doubled per attempt, up to 64 times.
+	static const uint64_t c_watchdogHealthyMs = 30 * 60000;	///< Then the back-off starts over.
+
+	double m_invalidLimit = 0;
+	InvalidAction m_invalidAction = InvalidAction::Throttle;
+	std::vector<MinerValidity> m_validity;		///< One per m_miners entry, see judgeMiner().
 
 	mutable SolutionStats m_solutionStats;
 	std::chrono::steady_clock::time_point m_farm_launched = std::chrono::steady_clock::now();
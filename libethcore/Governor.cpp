@@ -0,0 +1,88 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file Governor.cpp
+ * @date 2018
+ */
+
+#include "Governor.h"
+#include <algorithm>
+#include <libdevcore/Log.h>
+
+using namespace std;
+using namespace dev;
+using namespace eth;
+
+const unsigned Governor::c_stepPermille;
+const unsigned Governor::c_steps;
+const unsigned Governor::c_settleSeconds;
+const unsigned Governor::c_banSeconds;
+
+bool Governor::over(int _tempC, unsigned _powerW, int _tempMargin, double _powerMargin) const
+{
+	return (m_tempC > 0 && _tempC > m_tempC + _tempMargin) || (m_powerW > 0 && _powerW > m_powerW * _powerMargin);
+}
+
+unsigned Governor::update(size_t _index, string const& _name, int _tempC, unsigned _powerW, uint64_t _rate, double _seconds)
+{
+	if (_index >= m_devices.size())
+		m_devices.resize(_index + 1);
+	Device& d = m_devices[_index];
+	for (Step& s: d.steps)
+		s.banned = max(0.0, s.banned - _seconds);
+	d.settled += _seconds;
+
+	Step& current = d.steps[d.step];
+	unsigned next = d.step;
+	if (over(_tempC, _powerW, 0, 1.0))
+	{
+		// A step is only to blame once settled; when well over the governor
+		// backs off sooner, without blaming the steps still catching up.
+		if (d.settled >= c_settleSeconds)
+			current.banned = c_banSeconds;
+		if (d.settled >= c_settleSeconds || (d.settled >= c_settleSeconds / 3 && over(_tempC, _powerW, 5, 1.1)))
+			next = min(d.step + 1, c_steps - 1);
+	}
+	else
+	{
+		if (d.settled >= c_settleSeconds && _powerW && _rate)
+		{
+			double const mhPerW = _rate / 1e6 / _powerW;
+			current.mhPerW = current.mhPerW > 0 ? current.mhPerW * 0.8 + mhPerW * 0.2 : mhPerW;
+		}
+		// Judged after settling and as long again measuring. More duty is only
+		// taken with headroom and when it was not less efficient; less when it
+		// was clearly more efficient.
+		if (d.settled >= 2 * c_settleSeconds)
+		{
+			Step const* faster = d.step > 0 ? &d.steps[d.step - 1] : nullptr;
+			Step const* slower = d.step + 1 < c_steps ? &d.steps[d.step + 1] : nullptr;
+			if (faster && faster->banned <= 0 && !over(_tempC, _powerW, -2, 0.97) &&
+				(faster->mhPerW <= 0 || current.mhPerW <= 0 || faster->mhPerW >= current.mhPerW * 0.98))
+				next = d.step - 1;
+			else if (slower && slower->mhPerW > current.mhPerW * 1.03)
+				next = d.step + 1;
+		}
+	}
+
+	if (next != d.step)
+	{
+		d.step = next;
+		d.settled = 0;
+		cnote << _name << " duty " << (1000 - next * c_stepPermille) / 10 << "% at " << _tempC << "C" << (_powerW ? " " + to_string(_powerW) + "W" : string());
+	}
+	return d.step * c_stepPermille;
+}
@@ -0,0 +1,91 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file Governor.h
+ * @date 2018
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dev
+{
+
+namespace eth
+{
+
+/**
+ * @brief Keeps the devices within a temperature and a power target by
+ * having them idle part of the time (see Miner::throttle()).
+ *
+ * The duty cycle moves in steps of 5%, at most one step per settle period
+ * so the readings catch up with it. A step that broke a target is not
+ * taken again for a while, and of the steps that kept within the targets
+ * the one with the most hashes per watt is kept: a hot device settles
+ * below its limit rather than bouncing off it.
+ */
+class Governor
+{
+public:
+	/// Idle per mille of each step.
+	static const unsigned c_stepPermille = 50;
+	/// Steps up to 90% idle.
+	static const unsigned c_steps = 19;
+	/// Seconds to wait after a step before judging it.
+	static const unsigned c_settleSeconds = 10;
+	/// Seconds a step that broke a target is kept out of.
+	static const unsigned c_banSeconds = 300;
+
+	/// 0 for no target; no targets at all disable the governor.
+	void setTargets(int _tempC, unsigned _powerW) { m_tempC = _tempC; m_powerW = _powerW; }
+	bool enabled() const { return m_tempC > 0 || m_powerW > 0; }
+
+	/**
+	 * @brief Feeds the readings of device @a _index, @a _seconds after its
+	 * previous ones.
+	 * @param _power 0 where the driver does not tell.
+	 * @param _rate Its hashrate, in H/s.
+	 * @return The per mille of the time it should idle.
+	 */
+	unsigned update(size_t _index, std::string const& _name, int _tempC, unsigned _powerW, uint64_t _rate, double _seconds);
+
+private:
+	struct Step
+	{
+		double mhPerW = 0;	///< Moving average, 0 until measured.
+		double banned = 0;	///< Seconds left.
+	};
+
+	struct Device
+	{
+		unsigned step = 0;
+		double settled = 0;		///< Seconds since the last step.
+		std::array<Step, c_steps> steps;
+	};
+
+	bool over(int _tempC, unsigned _powerW, int _tempMargin, double _powerMargin) const;
+
+	int m_tempC = 0;
+	unsigned m_powerW = 0;
+	std::vector<Device> m_devices;
+};
+
+}
+}
@@ -0,0 +1,98 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file HashRate.cpp
+ * @date 2018
+ */
+
+#include "HashRate.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace dev;
+using namespace eth;
+
+namespace
+{
+
+/// Time constants of HashRateStats::rate10s, rate1m and rate15m, in ms.
+double const c_ewmaTau[3] = {10000, 60000, 900000};
+
+}
+
+void HashRateMeter::reset()
+{
+	m_head = m_size = m_windowSize = 0;
+	m_windowHashes = m_windowMs = 0;
+	m_ewma[0] = m_ewma[1] = m_ewma[2] = 0;
+	m_stats = HashRateStats();
+}
+
+void HashRateMeter::sample(uint64_t _hashes, uint64_t _ms)
+{
+	if (_ms == 0)
+		return;
+
+	// A full ring overwrites its oldest sample, which must leave the window first.
+	if (m_size == c_capacity && m_windowSize == c_capacity)
+	{
+		Sample const& oldest = at(c_capacity - 1);
+		m_windowHashes -= oldest.hashes;
+		m_windowMs -= oldest.ms;
+		--m_windowSize;
+	}
+	m_ring[m_head] = Sample{_hashes, _ms};
+	m_head = (m_head + 1) % c_capacity;
+	m_size = min(m_size + 1, c_capacity);
+
+	m_windowHashes += _hashes;
+	m_windowMs += _ms;
+	++m_windowSize;
+	while (m_windowSize > 1 && m_windowMs > m_windowLimit)
+	{
+		Sample const& oldest = at(m_windowSize - 1);
+		m_windowHashes -= oldest.hashes;
+		m_windowMs -= oldest.ms;
+		--m_windowSize;
+	}
+
+	double const rate = _hashes * 1000.0 / _ms;
+	uint64_t* out[3] = {&m_stats.rate10s, &m_stats.rate1m, &m_stats.rate15m};
+	for (unsigned i = 0; i < 3; ++i)
+	{
+		// Irregular intervals (setWork() samples early) are weighted by their length.
+		m_ewma[i] = m_size == 1 ? rate : rate + (m_ewma[i] - rate) * exp(-(double)_ms / c_ewmaTau[i]);
+		*out[i] = (uint64_t)m_ewma[i];
+	}
+
+	updatePercentiles();
+}
+
+void HashRateMeter::updatePercentiles()
+{
+	for (unsigned i = 0; i < m_size; ++i)
+		m_scratch[i] = m_ring[i].hashes * 1000 / m_ring[i].ms;
+	auto begin = m_scratch.begin();
+	auto end = begin + m_size;
+	auto p99 = begin + (m_size - 1) * 99 / 100;
+	nth_element(begin, p99, end);
+	m_stats.p99 = *p99;
+	// The median lies below p99, so the next selection can skip the top part.
+	auto p50 = begin + (m_size - 1) / 2;
+	nth_element(begin, p50, p99 + 1);
+	m_stats.p50 = *p50;
+}
@@ -0,0 +1,96 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file HashRate.h
+ * @date 2018
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace dev
+{
+
+namespace eth
+{
+
+/// Hashrates of one device or of the whole farm, in H/s.
+struct HashRateStats
+{
+	uint64_t rate10s = 0;	///< EWMA with a 10 s time constant.
+	uint64_t rate1m = 0;	///< EWMA with a 1 min time constant.
+	uint64_t rate15m = 0;	///< EWMA with a 15 min time constant.
+	uint64_t p50 = 0;		///< Median of the sample interval rates over the last 15 min.
+	uint64_t p99 = 0;		///< 99th percentile of the sample interval rates over the last 15 min.
+};
+
+/**
+ * @brief Time series of hash counts, sampled about once per second.
+ * The samples live in a fixed-capacity ring. The smoothing window sums and the
+ * EWMAs are kept up to date incrementally, and the percentiles are refreshed
+ * once per sample, so every query is O(1) and nothing allocates after
+ * construction.
+ */
+class HashRateMeter
+{
+public:
+	/// Samples kept: 15 minutes at the Farm's 1 s sampling period.
+	static const unsigned c_capacity = 900;
+
+	void reset();
+
+	/// Records @a _hashes computed over the last @a _ms milliseconds.
+	void sample(uint64_t _hashes, uint64_t _ms);
+
+	/// Sets the span of the window behind windowHashes()/windowMs().
+	void setWindow(uint64_t _ms) { m_windowLimit = _ms; }
+
+	/// Hashes and duration of the samples in the smoothing window.
+	uint64_t windowHashes() const { return m_windowHashes; }
+	uint64_t windowMs() const { return m_windowMs; }
+	uint64_t windowRate() const { return m_windowMs == 0 ? 0 : m_windowHashes * 1000 / m_windowMs; }
+
+	HashRateStats const& stats() const { return m_stats; }
+
+private:
+	struct Sample
+	{
+		uint64_t hashes;
+		uint64_t ms;
+	};
+
+	Sample const& at(unsigned _age) const { return m_ring[(m_head + c_capacity - 1 - _age) % c_capacity]; }
+	void updatePercentiles();
+
+	std::array<Sample, c_capacity> m_ring;
+	unsigned m_head = 0;			///< Where the next sample goes.
+	unsigned m_size = 0;			///< Samples in the ring.
+
+	unsigned m_windowSize = 0;		///< The newest samples that make up the window.
+	uint64_t m_windowHashes = 0;
+	uint64_t m_windowMs = 0;
+	uint64_t m_windowLimit = 10000;
+
+	double m_ewma[3] = {0, 0, 0};
+	HashRateStats m_stats;
+
+	std::array<uint64_t, c_capacity> m_scratch;	///< For the percentile selection.
+};
+
+}
+}
@@ -0,0 +1,152 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file HostMemory.cpp
+ * @date 2018
+ */
+
+#include "HostMemory.h"
+#include <algorithm>
+#include <libdevcore/Guards.h>
+#include <libdevcore/Log.h>
+
+using namespace std;
+using namespace dev;
+using namespace eth;
+
+namespace
+{
+
+Mutex x_hostMemory;
+uint64_t s_budget = 0;
+uint64_t s_used[HostMemory::Kinds] = {};
+
+uint64_t total()
+{
+	// x_hostMemory is held.
+	uint64_t sum = 0;
+	for (uint64_t u: s_used)
+		sum += u;
+	return sum;
+}
+
+uint64_t available()
+{
+	// x_hostMemory is held.
+	if (!s_budget)
+		return ~uint64_t(0);
+	uint64_t const t = total();
+	return t < s_budget ? s_budget - t : 0;
+}
+
+}
+
+HostMemory::Reservation::Reservation(Reservation&& _r) noexcept:
+	m_kind(_r.m_kind),
+	m_bytes(_r.m_bytes)
+{
+	_r.m_bytes = 0;
+}
+
+HostMemory::Reservation& HostMemory::Reservation::operator=(Reservation&& _r) noexcept
+{
+	if (this != &_r)
+	{
+		release();
+		m_kind = _r.m_kind;
+		m_bytes = _r.m_bytes;
+		_r.m_bytes = 0;
+	}
+	return *this;
+}
+
+void HostMemory::Reservation::release()
+{
+	if (!m_bytes)
+		return;
+	Guard l(x_hostMemory);
+	s_used[m_kind] -= m_bytes;
+	m_bytes = 0;
+}
+
+void HostMemory::setBudget(uint64_t _bytes)
+{
+	Guard l(x_hostMemory);
+	s_budget = _bytes;
+}
+
+uint64_t HostMemory::budget()
+{
+	Guard l(x_hostMemory);
+	return s_budget;
+}
+
+uint64_t HostMemory::used()
+{
+	Guard l(x_hostMemory);
+	return total();
+}
+
+uint64_t HostMemory::used(Kind _kind)
+{
+	Guard l(x_hostMemory);
+	return s_used[_kind];
+}
+
+bool HostMemory::fits(uint64_t _bytes)
+{
+	Guard l(x_hostMemory);
+	return _bytes <= available();
+}
+
+HostMemory::Reservation HostMemory::tryReserve(Kind _kind, uint64_t _bytes)
+{
+	Guard l(x_hostMemory);
+	if (_bytes > available())
+		return Reservation();
+	s_used[_kind] += _bytes;
+	return Reservation(_kind, _bytes);
+}
+
+HostMemory::Reservation HostMemory::reserve(Kind _kind, uint64_t _want, uint64_t _least)
+{
+	uint64_t bytes;
+	{
+		Guard l(x_hostMemory);
+		bytes = max(min(_want, available()), min(_least, _want));
+		s_used[_kind] += bytes;
+		if (!s_budget || total() <= s_budget)
+			return Reservation(_kind, bytes);
+	}
+	cwarn << "Host memory budget of" << budget() / (1024 * 1024) << "MB exceeded by the" << name(_kind) << "of"
+		  << bytes / (1024 * 1024) << "MB, now" << used() / (1024 * 1024) << "MB in use";
+	return Reservation(_kind, bytes);
+}
+
+char const* HostMemory::name(Kind _kind)
+{
+	switch (_kind)
+	{
+		case Dag:
+			return "DAG";
+		case Light:
+			return "light cache";
+		case Staging:
+			return "DAG staging";
+		default:
+			return "?";
+	}
+}
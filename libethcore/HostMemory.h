@@ -0,0 +1,92 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file HostMemory.h
+ * @date 2018
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace dev
+{
+
+namespace eth
+{
+
+/**
+ * @brief Accounts the large host allocations of the DAG path: host DAGs,
+ * light caches and the buffers DAGs are staged in for upload. With a budget
+ * set, those that can go in pieces are made smaller to stay within it, so a
+ * rig with little system RAM streams the DAG rather than running out of
+ * memory at an epoch change. Epoch files mapped from the DAG directory are
+ * page cache the kernel can drop, and are not counted.
+ */
+class HostMemory
+{
+public:
+	enum Kind
+	{
+		Dag,
+		Light,
+		Staging,
+		Kinds
+	};
+
+	/// Bytes of one kind, given back when destroyed. Move only.
+	class Reservation
+	{
+	public:
+		Reservation() = default;
+		Reservation(Reservation&& _r) noexcept;
+		Reservation& operator=(Reservation&& _r) noexcept;
+		Reservation(Reservation const&) = delete;
+		Reservation& operator=(Reservation const&) = delete;
+		~Reservation() { release(); }
+
+		uint64_t bytes() const { return m_bytes; }
+		explicit operator bool() const { return m_bytes != 0; }
+		void release();
+
+	private:
+		friend class HostMemory;
+		Reservation(Kind _kind, uint64_t _bytes): m_kind(_kind), m_bytes(_bytes) {}
+
+		Kind m_kind = Staging;
+		uint64_t m_bytes = 0;
+	};
+
+	/// In bytes; 0, the default, is no limit.
+	static void setBudget(uint64_t _bytes);
+	static uint64_t budget();
+	static uint64_t used();
+	static uint64_t used(Kind _kind);
+	/// @a _bytes more would still be within the budget.
+	static bool fits(uint64_t _bytes);
+
+	/// @a _bytes if they fit, else an empty reservation.
+	static Reservation tryReserve(Kind _kind, uint64_t _bytes);
+	/// As much of @a _want as fits, but never less than @a _least, over the
+	/// budget if need be (with a warning): @a _least is what the caller
+	/// cannot do without, e.g. two chunks to stream through.
+	static Reservation reserve(Kind _kind, uint64_t _want, uint64_t _least);
+
+	static char const* name(Kind _kind);
+};
+
+}
+}
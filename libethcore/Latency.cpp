@@ -0,0 +1,122 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file Latency.cpp
+ * @date 2018
+ */
+
+#include "Latency.h"
+
+using namespace std;
+using namespace dev;
+using namespace eth;
+
+void LatencyHistogram::reset()
+{
+	for (auto& c: m_counts)
+		c.store(0, memory_order_relaxed);
+	m_count.store(0, memory_order_relaxed);
+	m_sum.store(0, memory_order_relaxed);
+	m_min.store(~uint64_t(0), memory_order_relaxed);
+	m_max.store(0, memory_order_relaxed);
+}
+
+unsigned LatencyHistogram::bucket(uint64_t _us)
+{
+	if (_us >= uint64_t(1) << c_maxBits)
+		_us = (uint64_t(1) << c_maxBits) - 1;
+	if (_us < (1u << c_subBits))
+		return unsigned(_us);
+	unsigned msb = 63;
+	while (!(_us >> msb))
+		--msb;
+	// The c_subBits bits below the leading one pick the linear sub-bucket.
+	unsigned const shift = msb - c_subBits;
+	return ((shift + 1) << c_subBits) + unsigned((_us >> shift) & ((1u << c_subBits) - 1));
+}
+
+uint64_t LatencyHistogram::bucketValue(unsigned _bucket)
+{
+	if (_bucket < (1u << c_subBits))
+		return _bucket;
+	unsigned const shift = (_bucket >> c_subBits) - 1;
+	uint64_t const low = uint64_t((1u << c_subBits) + (_bucket & ((1u << c_subBits) - 1))) << shift;
+	// The middle of the bucket.
+	return low + ((uint64_t(1) << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t _us)
+{
+	m_counts[bucket(_us)].fetch_add(1, memory_order_relaxed);
+	m_count.fetch_add(1, memory_order_relaxed);
+	m_sum.fetch_add(_us, memory_order_relaxed);
+	uint64_t v = m_min.load(memory_order_relaxed);
+	while (_us < v && !m_min.compare_exchange_weak(v, _us, memory_order_relaxed))
+	{}
+	v = m_max.load(memory_order_relaxed);
+	while (_us > v && !m_max.compare_exchange_weak(v, _us, memory_order_relaxed))
+	{}
+}
+
+LatencyStats LatencyHistogram::stats() const
+{
+	LatencyStats s;
+	uint64_t counts[c_buckets];
+	for (unsigned i = 0; i < c_buckets; ++i)
+	{
+		counts[i] = m_counts[i].load(memory_order_relaxed);
+		s.count += counts[i];
+	}
+	if (!s.count)
+		return s;
+	s.min = m_min.load(memory_order_relaxed);
+	s.max = m_max.load(memory_order_relaxed);
+
+	// Ranks (1-based) of the percentiles, in increasing order.
+	double const fractions[4] = {0.5, 0.9, 0.99, 0.999};
+	uint64_t* const out[4] = {&s.p50, &s.p90, &s.p99, &s.p999};
+	unsigned next = 0;
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < c_buckets && next < 4; ++i)
+	{
+		seen += counts[i];
+		while (next < 4 && seen && seen >= uint64_t(fractions[next] * s.count + 0.5))
+		{
+			// Clamped to what was actually seen, for the exact small values.
+			uint64_t v = bucketValue(i);
+			*out[next++] = v < s.min ? s.min : v > s.max ? s.max : v;
+		}
+	}
+	return s;
+}
+
+void LatencyHistogram::cumulative(uint64_t const* _bounds, unsigned _n, uint64_t* _counts, uint64_t& _count, uint64_t& _sumUs) const
+{
+	_count = 0;
+	unsigned next = 0;
+	for (unsigned i = 0; i < c_buckets; ++i)
+	{
+		uint64_t const c = m_counts[i].load(memory_order_relaxed);
+		if (!c)
+			continue;
+		for (uint64_t const v = bucketValue(i); next < _n && v > _bounds[next]; ++next)
+			_counts[next] = _count;
+		_count += c;
+	}
+	for (; next < _n; ++next)
+		_counts[next] = _count;
+	_sumUs = m_sum.load(memory_order_relaxed);
+}
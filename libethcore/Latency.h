@@ -0,0 +1,96 @@
+/*
+ This file is part of cpp-ethereum.
+
+ cpp-ethereum is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ cpp-ethereum is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with cpp-ethereum.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/** @file Latency.h
+ * @date 2018
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace dev
+{
+
+namespace eth
+{
+
+/// Summary of a LatencyHistogram, in microseconds.
+struct LatencyStats
+{
+	uint64_t count = 0;
+	uint64_t min = 0;
+	uint64_t p50 = 0;
+	uint64_t p90 = 0;
+	uint64_t p99 = 0;
+	uint64_t p999 = 0;
+	uint64_t max = 0;
+};
+
+/**
+ * @brief HDR-style histogram of durations: values up to 16 us are exact,
+ * larger ones go to one of 16 linear sub-buckets of their power of two, so
+ * every percentile is within 1/16 of the true value. Recording is a few
+ * relaxed atomic increments and may be done from any thread.
+ */
+class LatencyHistogram
+{
+public:
+	static const unsigned c_subBits = 4;
+	static const unsigned c_maxBits = 40;	///< About 12 days; longer values are clamped.
+	static const unsigned c_buckets = (c_maxBits - c_subBits + 1) << c_subBits;
+
+	LatencyHistogram() { reset(); }
+	LatencyHistogram(LatencyHistogram const&) = delete;
+	LatencyHistogram& operator=(LatencyHistogram const&) = delete;
+
+	void reset();
+
+	void record(uint64_t _us);
+
+	template <class Clock>
+	void record(typename Clock::time_point _from, typename Clock::time_point _to)
+	{
+		record(_to > _from ? std::chrono::duration_cast<std::chrono::microseconds>(_to - _from).count() : 0);
+	}
+
+	uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+	/// Not a consistent cut while values are being recorded, but close enough.
+	LatencyStats stats() const;
+
+	/**
+	 * @brief The counts of a Prometheus histogram: @a _counts[i] gets how many
+	 * values are at most @a _bounds[i], within the 1/16 of the buckets, for
+	 * the @a _n ascending bounds. Also the count and sum of all values.
+	 */
+	void cumulative(uint64_t const* _bounds, unsigned _n, uint64_t* _counts, uint64_t& _count, uint64_t& _sumUs) const;
+
+private:
+	static unsigned bucket(uint64_t _us);
+	static uint64_t bucketValue(unsigned _bucket);
+
+	std::atomic<uint64_t> m_counts[c_buckets];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_min;
+	std::atomic<uint64_t> m_max;
+};
+
+}
+}
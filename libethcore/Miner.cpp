@@ -10,6 +10,6 @@ unsigned dev::eth::Miner::s_dagLoadIndex = 0;
 
 unsigned dev::eth::Miner::s_dagCreateDevice = 0;
 
-uint8_t* dev::eth::Miner::s_dagInHostMemory = NULL;
+uint64_t dev::eth::Miner::s_probeTarget = 0;
 
 
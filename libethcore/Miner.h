@@ -21,14 +21,23 @@
 
 #pragma once
 
+#include <algorithm>
 #include <thread>
 #include <list>
+#include <map>
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <type_traits>
 #include <boost/timer.hpp>
 #include <libdevcore/Common.h>
 #include <libdevcore/Log.h>
+#include <libdevcore/Trace.h>
 #include <libdevcore/Worker.h>
+#include "DagVerifier.h"
 #include "EthashAux.h"
+#include "Latency.h"
 
 #define MINER_WAIT_STATE_WORK	 1
 
@@ -40,6 +49,7 @@
 #define STRATUM_PROTOCOL_STRATUM		 0
 #define STRATUM_PROTOCOL_ETHPROXY		 1
 #define STRATUM_PROTOCOL_ETHEREUMSTRATUM 2
+#define STRATUM_PROTOCOL_ETHEREUMSTRATUM2 3
 
 using namespace std;
 
@@ -62,19 +72,37 @@ enum class MinerType
 	CL,
 	CUDA,
 	Fpga,
+	CPU,
 };
 
 struct HwMonitor
 {
 	int tempC = 0;
 	int fanP = 0;
+	unsigned powerW = 0;	///< 0 where the driver does not tell, like the below.
+	unsigned coreMHz = 0;
+	unsigned memMHz = 0;
+	unsigned memUtilP = 0;	///< Memory controller load.
 };
 
 inline std::ostream& operator<<(std::ostream& os, HwMonitor _hw)
 {
-	return os <<  std::fixed << std::setw(3) << _hw.tempC << "C " << std::fixed << std::setw(3) << _hw.fanP << "%";
+	os <<  std::fixed << std::setw(3) << _hw.tempC << "C " << std::fixed << std::setw(3) << _hw.fanP << "%";
+	if (_hw.powerW)
+		os << " " << std::setw(3) << _hw.powerW << "W";
+	return os;
 }
 
+/// What became of the solutions of one device, see Farm::setInvalidLimit().
+struct MinerShares
+{
+	uint64_t accepted = 0;		///< Stale ones too.
+	uint64_t rejected = 0;		///< Stale ones too.
+	uint64_t failed = 0;		///< Failed their verification on the CPU.
+	double invalidRate = 0;		///< Percent of its recent results that were invalid.
+	bool flagged = false;		///< Went over the limit, since the start.
+};
+
 /// Describes the progress of a mining operation.
 struct WorkingProgress
 {
@@ -85,8 +113,26 @@ struct WorkingProgress
 	int fee_timer = 0;
 	std::vector<string> minersNames;
 	std::vector<uint64_t> minersHashes;
+	/// Of the pseudo-shares, over the same window, scaled by the share of
+	/// them that were verified; empty without them, see Miner::setProbeDifficulty().
+	std::vector<uint64_t> minersEffectiveHashes;
+	std::vector<MinerShares> minersShares;
 	std::vector<HwMonitor> minerMonitors;
+	/// Energy each miner drew while its power was known, and the hashes it
+	/// computed meanwhile; with the monitors only.
+	std::vector<double> minersJoules;
+	std::vector<uint64_t> minersMeteredHashes;
 	uint64_t minerRate(const uint64_t hashCount) const { return ms == 0 ? 0 : hashCount * 1000 / ms; }
+	/// Megahashes per second per watt drawn now; 0 where the power is unknown.
+	double minerMhPerW(size_t _i) const
+	{
+		return _i < minerMonitors.size() && _i < minersHashes.size() && minerMonitors[_i].powerW ? minerRate(minersHashes[_i]) / 1e6 / minerMonitors[_i].powerW : 0;
+	}
+	/// Megahashes per joule over all of the mining so far; 0 where the power is unknown.
+	double minerMhPerJ(size_t _i) const
+	{
+		return _i < minersJoules.size() && minersJoules[_i] > 0 ? minersMeteredHashes[_i] / 1e6 / minersJoules[_i] : 0;
+	}
 };
 
 inline std::ostream& operator<<(std::ostream& _out, WorkingProgress _p)
@@ -111,6 +157,18 @@ inline std::ostream& operator<<(std::ostream& _out, WorkingProgress _p)
 			_out << EthTeal << std::fixed << std::setw(10) << " " << EthReset;
 		}
 		_out << " - " << EthTeal << std::fixed << std::setw(6) << std::setprecision(2) << mh << "Mh/s " << EthReset;
+		if (i < _p.minersEffectiveHashes.size())
+			_out << "eff " << EthTeal << std::fixed << std::setw(6) << std::setprecision(2) << _p.minerRate(_p.minersEffectiveHashes[i]) / 1000000.0f << "Mh/s " << EthReset;
+		if (double mhj = _p.minerMhPerJ(i))
+			_out << EthTeal << std::fixed << std::setw(6) << std::setprecision(3) << mhj << "Mh/J " << EthReset;
+		if (i < _p.minersShares.size())
+		{
+			MinerShares const& s = _p.minersShares[i];
+			if (s.rejected || s.failed)
+				_out << "A" << s.accepted << ":R" << s.rejected << ":F" << s.failed << " ";
+			if (s.flagged)
+				_out << EthRed << "unstable " << EthReset;
+		}
 		_out << "\n";
 	}
 
@@ -122,18 +180,21 @@ public:
 	void accepted() { accepts++;  }
 	void rejected() { rejects++;  }
 	void failed()   { failures++; }
+	/// A solution not submitted, its job being void already.
+	void dropped()  { drops++; }
 
 	void acceptedStale() { acceptedStales++; }
 	void rejectedStale() { rejectedStales++; }
 
 
-	void reset() { accepts = rejects = failures = acceptedStales = rejectedStales = 0; }
+	void reset() { accepts = rejects = failures = acceptedStales = rejectedStales = drops = 0; }
 
 	unsigned getAccepts()			{ return accepts; }
 	unsigned getRejects()			{ return rejects; }
 	unsigned getFailures()			{ return failures; }
 	unsigned getAcceptedStales()	{ return acceptedStales; }
 	unsigned getRejectedStales()	{ return rejectedStales; }
+	unsigned getDrops()				{ return drops; }
 private:
 	unsigned accepts  = 0;
 	unsigned rejects  = 0;
@@ -141,15 +202,157 @@ private:
 
 	unsigned acceptedStales = 0;
 	unsigned rejectedStales = 0;
+	unsigned drops = 0;
 };
 
 inline std::ostream& operator<<(std::ostream& os, SolutionStats s)
 {
-	return os << "[A" << s.getAccepts() << "+" << s.getAcceptedStales() << ":R" << s.getRejects() << "+" << s.getRejectedStales() << ":F" << s.getFailures() << "]";
+	os << "[A" << s.getAccepts() << "+" << s.getAcceptedStales() << ":R" << s.getRejects() << "+" << s.getRejectedStales() << ":F" << s.getFailures();
+	if (s.getDrops())
+		os << ":D" << s.getDrops();
+	return os << "]";
 }
 
 class Miner;
 
+/// How many results a miner's searches returned, to size the result buffers.
+struct SearchResultCounts
+{
+	static const unsigned c_buckets = 8;
+	unsigned capacity = 0;					///< Results one search can store.
+	uint64_t perLaunch[c_buckets] = {};		///< Searches that found n results; the last entry n or more.
+	uint64_t overflows = 0;					///< Searches that found more than capacity.
+};
+
+/// Device side timings of a miner's kernels, for miners that measure them
+/// (see CLMiner::setProfiling()). The search figures are moving averages.
+struct KernelProfile
+{
+	bool enabled = false;
+	uint64_t searches = 0;		///< Search kernels timed.
+	double searchMs = 0;		///< Device time of one search.
+	double gapMs = 0;			///< Device idle between consecutive searches, i.e. waiting for the host.
+	double bandwidth = 0;		///< DAG bytes the searches read, in GB/s of device time.
+	double dagMs = 0;			///< Device time of the last full DAG generation.
+	double dagBandwidth = 0;	///< DAG bytes written by it, in GB/s.
+};
+
+/// What a miner's host loop cost so far, see Miner::hostLoop(). Totals
+/// since the miner started; the difference of two tells of the time between.
+struct HostLoopStats
+{
+	uint64_t launches = 0;		///< Searches launched.
+	uint64_t hostNs = 0;		///< Host time spent in the miner's steps.
+	uint64_t idleNs = 0;		///< Device time with no search in flight, between launches.
+	/// Host time per launch, in µs.
+	double hostUs() const { return launches ? hostNs / 1e3 / launches : 0; }
+};
+
+/// A miner's DAG generation, the one in progress or the last one.
+struct DagProgress
+{
+	uint64_t size = 0;		///< Bytes of the DAG, 0 if none was generated yet.
+	uint64_t done = 0;		///< Bytes generated so far.
+	double ms = 0;			///< Since the generation started, or how long it took.
+	unsigned percent() const { return size ? unsigned(done * 100 / size) : 0; }
+	/// In GB/s.
+	double bandwidth() const { return ms > 0 ? done / ms / 1e6 : 0; }
+};
+
+/// One step of a miner getting the DAG of an epoch onto its device, see Miner::dagStages().
+struct DagStage
+{
+	std::string name;		///< "light", "generate", "host", "file", "p2p", "host-copy", "download", "kept" or "prebuilt".
+	uint64_t bytes = 0;		///< Moved or generated, 0 for a switch to a DAG already there.
+	double ms = 0;			///< Wall time.
+	/// In GB/s.
+	double bandwidth() const { return ms > 0 ? bytes / ms / 1e6 : 0; }
+};
+
+/// Launch parameters of a miner by name, see Miner::tune().
+using MinerTuning = std::map<std::string, unsigned>;
+
+/// The nonces [start, start + count) of one work package, leased to one miner.
+struct NonceLease
+{
+	uint64_t start = 0;
+	uint64_t count = 0;
+	uint64_t generation = 0;	///< The WorkSlot generation the nonces belong to.
+};
+
+/**
+ * @brief The current WorkPackage, shared by the farm with all its miners.
+ * A seqlock: publish() makes the sequence odd, stores the package word by word
+ * and makes it even again; read() retries until it copied a package without a
+ * publish() overlapping it. Miners poll generation(), a single relaxed load,
+ * and only copy the package when it changed.
+ */
+class WorkSlot
+{
+public:
+	using Clock = std::chrono::high_resolution_clock;
+
+	WorkSlot()
+	{
+		store(WorkPackage(), Clock::time_point());
+	}
+
+	/// Makes @a _wp the current work. Concurrent publish() calls must be serialised by the caller.
+	void publish(WorkPackage const& _wp)
+	{
+		uint64_t const seq = m_sequence.load(std::memory_order_relaxed);
+		m_sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		store(_wp, Clock::now());
+		m_sequence.store(seq + 2, std::memory_order_release);
+	}
+
+	/// Number of packages published so far, including one being published.
+	uint64_t generation() const { return (m_sequence.load(std::memory_order_relaxed) + 1) / 2; }
+
+	/**
+	 * @brief Copies the current work.
+	 * @param _published Set to when the package was published, if not null.
+	 * @return The generation of the package copied.
+	 */
+	uint64_t read(WorkPackage& _wp, Clock::time_point* _published = nullptr) const
+	{
+		uint64_t words[c_words];
+		uint64_t seq;
+		do
+		{
+			while ((seq = m_sequence.load(std::memory_order_acquire)) & 1)
+				std::this_thread::yield();
+			for (unsigned i = 0; i < c_words; ++i)
+				words[i] = m_words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+		}
+		while (m_sequence.load(std::memory_order_relaxed) != seq);
+
+		std::memcpy(&_wp, words, sizeof(WorkPackage));
+		if (_published)
+			*_published = Clock::time_point(Clock::duration(static_cast<Clock::rep>(words[c_words - 1])));
+		return seq / 2;
+	}
+
+private:
+	static_assert(std::is_trivially_copyable<WorkPackage>::value, "WorkPackage is copied as raw words");
+	/// The package followed by its publication time.
+	static const unsigned c_words = (sizeof(WorkPackage) + sizeof(uint64_t) - 1) / sizeof(uint64_t) + 1;
+
+	void store(WorkPackage const& _wp, Clock::time_point _published)
+	{
+		uint64_t words[c_words] = {};
+		std::memcpy(words, &_wp, sizeof(WorkPackage));
+		words[c_words - 1] = static_cast<uint64_t>(_published.time_since_epoch().count());
+		for (unsigned i = 0; i < c_words; ++i)
+			m_words[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> m_sequence = {0};
+	std::atomic<uint64_t> m_words[c_words];
+};
+
 
 /**
  * @brief Class for hosting one or more Miners.
@@ -167,8 +370,22 @@ public:
 	 * @return true iff the solution was good (implying that mining should be .
 	 */
 	virtual void submitProof(Solution const& _p) = 0;
-	virtual void failedSolution() = 0;
+	/// A solution of miner @a _miner failed its verification on the CPU.
+	virtual void failedSolution(unsigned _miner) = 0;
 	virtual uint64_t get_nonce_scrambler() = 0;
+
+	/// Where the farm publishes the current work for its miners.
+	virtual WorkSlot const& workSlot() const = 0;
+
+	/**
+	 * @brief Hands out the next unused nonces of the current work.
+	 * @param _index The asking miner, whose hashrate sizes the lease.
+	 * @param _granularity The lease is a non-zero multiple of this.
+	 * @param _generation The work generation the miner is on.
+	 * @return An empty lease if the work changed in the meantime or its nonce
+	 * space is used up.
+	 */
+	virtual NonceLease leaseNonces(unsigned _index, uint64_t _granularity, uint64_t _generation) = 0;
 };
 
 /**
@@ -186,13 +403,10 @@ public:
 
 	virtual ~Miner() = default;
 
-	void setWork(WorkPackage const& _work)
+	/// Called by the farm after publishing new work to its WorkSlot.
+	void notifyWork()
 	{
-		{
-			Guard l(x_work);
-			m_work = _work;
-			workSwitchStart = std::chrono::high_resolution_clock::now();
-		}
+		wake();
 		kick_miner();
 	}
 
@@ -200,17 +414,155 @@ public:
 
 	void resetHashCount() { m_hashCount.store(0, std::memory_order_relaxed); }
 
+	/// Stops (or resumes) searching; the device, its context and DAG are kept.
+	void pause(bool _paused)
+	{
+		m_paused.store(_paused, std::memory_order_relaxed);
+		if (!_paused)
+			wake();
+	}
+
+	bool paused() const { return m_paused.load(std::memory_order_relaxed); }
+
+	/// Has the miner idle @a _permille of the time, between its launches,
+	/// see Governor. New work ends an idle period at once.
+	void throttle(unsigned _permille) { m_idlePermille.store(std::min(_permille, 900u), std::memory_order_relaxed); }
+
+	unsigned throttled() const { return m_idlePermille.load(std::memory_order_relaxed); }
+
+	/// From the farm publishing new work to the first kernel launch on it.
+	LatencyHistogram const& workSwitchLatency() const { return m_workSwitchLatency; }
+
+	/// Of the last work switch, in microseconds; 0 before the first.
+	uint64_t lastWorkSwitchUs() const { return m_lastWorkSwitchUs.load(std::memory_order_relaxed); }
+
+	/// Solutions of this miner that failed their verification on the CPU.
+	uint64_t failedSolutions() const { return m_failedSolutions.load(std::memory_order_relaxed); }
+
+	/// What DagVerifier found of its DAG.
+	DagHealth const& dagHealth() const { return *m_dagHealth; }
+
+	/**
+	 * @brief Has the search kernels count pseudo-shares: hashes under a
+	 * target @a _hashes times easier than the whole hash space, thus far
+	 * easier than the pool's. They make an effective hashrate of what the
+	 * kernels compute right, independent of pool luck; one per second of
+	 * each device is evaluated on the CPU, see ProbeHealth. 0 (the
+	 * default) has them count none.
+	 */
+	static void setProbeDifficulty(uint64_t _hashes) { s_probeTarget = _hashes > 1 ? ~uint64_t(0) / _hashes : 0; }
+	/// The upper 64 bits of the hashes that are pseudo-shares, at most; 0 for none.
+	static uint64_t probeTarget() { return s_probeTarget; }
+	/// Hashes per pseudo-share on average, 0 without them.
+	static double probeDifficulty() { return s_probeTarget ? 18446744073709551616.0 / (double(s_probeTarget) + 1) : 0; }
+
+	/// Pseudo-shares found since the last call.
+	uint64_t takeProbes() { return m_probes.exchange(0, std::memory_order_relaxed); }
+	/// Pseudo-shares found so far.
+	uint64_t probesFound() const { return m_probesFound.load(std::memory_order_relaxed); }
+	/// What DagVerifier found of them.
+	ProbeHealth const& probeHealth() const { return *m_probeHealth; }
+
+	/// From the kernel that found a solution completing to the farm having
+	/// taken the solution (and handed it to the pool client).
+	LatencyHistogram const& solutionLatency() const { return m_solutionLatency; }
+
+	/// From a share of this miner being sent to the pool to its reply, by outcome.
+	LatencyHistogram const& acceptedLatency() const { return m_acceptedLatency; }
+	LatencyHistogram const& rejectedLatency() const { return m_rejectedLatency; }
+	LatencyHistogram const& staleLatency() const { return m_staleLatency; }
+
+	/// Device time of the search kernels; empty unless the miner profiles them.
+	LatencyHistogram const& searchTime() const { return m_searchTime; }
+
+	/// Notes the pool's reply to a share of this miner, @a _us after sending it.
+	void shareReplied(bool _accepted, bool _stale, uint64_t _us)
+	{
+		(_stale ? m_staleLatency : _accepted ? m_acceptedLatency : m_rejectedLatency).record(_us);
+	}
+
+	SearchResultCounts searchResults() const
+	{
+		SearchResultCounts r;
+		r.capacity = m_resultCapacity.load(std::memory_order_relaxed);
+		for (unsigned i = 0; i < SearchResultCounts::c_buckets; ++i)
+			r.perLaunch[i] = m_resultsPerLaunch[i].load(std::memory_order_relaxed);
+		r.overflows = m_resultOverflows.load(std::memory_order_relaxed);
+		return r;
+	}
+
+	/// Empty (not enabled) unless the miner times its kernels.
+	virtual KernelProfile kernelProfile() const { return KernelProfile(); }
+
+	/// All zero unless the miner accounts for its launches, see searchesInFlight().
+	HostLoopStats hostLoop() const
+	{
+		HostLoopStats r;
+		r.launches = m_hostLaunches.load(std::memory_order_relaxed);
+		r.hostNs = m_hostNs.load(std::memory_order_relaxed);
+		r.idleNs = m_deviceIdleNs.load(std::memory_order_relaxed);
+		return r;
+	}
+
+	/// Empty unless the miner reports its DAG generation.
+	DagProgress dagProgress() const
+	{
+		Guard l(x_dagProgress);
+		return m_dagProgress;
+	}
+
+	/// How the miners started from now on load their DAGs, see
+	/// DAG_LOAD_MODE_PARALLEL; the backends' configureGPU() set it too.
+	static void setDagLoadMode(unsigned _mode)
+	{
+		s_dagLoadMode = _mode;
+		s_dagLoadIndex = 0;
+	}
+
+	/// The steps of the miner's last DAG build, if it was for @a _epoch; in
+	/// the order they finished. Empty unless the miner reports them.
+	std::vector<DagStage> dagStages(unsigned _epoch) const
+	{
+		Guard l(x_dagProgress);
+		return m_dagStagesEpoch == _epoch ? m_dagStages : std::vector<DagStage>();
+	}
+
 	virtual HwMonitor hwmon() = 0;
 
+	/// The launch parameters that can be changed while mining, as in effect.
+	/// Empty until the miner initialised its device.
+	MinerTuning tuning() const
+	{
+		Guard l(x_tuning);
+		return m_tuning;
+	}
+
+	/**
+	 * @brief Changes some of the tuning() parameters. The miner takes them
+	 * up between two launches, once the searches in flight are in; those
+	 * that need the kernel rebuilt have it rebuilt then.
+	 * @return false, with the reason in @a _error, if a name is unknown or
+	 * a value out of range. Then none is changed.
+	 */
+	bool tune(MinerTuning const& _params, std::string& _error)
+	{
+		for (auto const& p: _params)
+			if (!checkTuning(p.first, p.second, _error))
+				return false;
+		{
+			Guard l(x_tuning);
+			for (auto const& p: _params)
+				m_tuningQueued[p.first] = p.second;
+		}
+		m_tuningPending.store(true, std::memory_order_release);
+		notifyWork();
+		return true;
+	}
+
 	virtual string Name() = 0;
 
 	unsigned Index() { return index; };
 
-	uint64_t get_start_nonce()
-	{
-		// Each GPU is given a non-overlapping 2^40 range to search
-		return farm.get_nonce_scrambler() + ((uint64_t) index << 40);
-	}
 
 protected:
 
@@ -219,14 +571,281 @@ protected:
 	 */
 	virtual void kick_miner() = 0;
 
-	WorkPackage work() const { Guard l(x_work); return m_work; }
+	/**
+	 * @brief The current work, as published by the farm.
+	 * Copies it from the farm's WorkSlot only when a new package was published
+	 * since the previous call; the reference is valid until the next call.
+	 * Also updates workSwitchStart then. Only to be called from the miner's thread.
+	 */
+	WorkPackage const& work()
+	{
+		WorkSlot const& slot = farm.workSlot();
+		if (slot.generation() != m_workGeneration)
+		{
+			m_workGeneration = slot.read(m_work, &workSwitchStart);
+			m_workSwitchPending = true;
+			traceInstant("new work", "generation", m_workGeneration);
+		}
+		return m_work;
+	}
+
+	/**
+	 * @brief Reserves the next @a _count nonces of the current work for this miner.
+	 * Nonces come in leases from the farm, so no two miners ever search the
+	 * same nonces, however many there are and whatever extranonce the pool set.
+	 * @return false if there are none for now: newer work was published (call
+	 * work() again), the work's nonce space is used up, the miner is paused
+	 * or, pooled, resting (wait restWait()).
+	 */
+	bool nextNonces(uint64_t _count, uint64_t& _start)
+	{
+		if (paused())
+		{
+			m_lease = NonceLease();
+			return false;
+		}
+		if (!idle())
+			return false;
+		if (m_lease.generation != m_workGeneration || m_lease.count < _count)
+		{
+			m_lease = farm.leaseNonces(index, _count, m_workGeneration);
+			if (m_lease.generation != m_workGeneration || m_lease.count < _count)
+				return false;
+		}
+		_start = m_lease.start;
+		m_lease.start += _count;
+		m_lease.count -= _count;
+		// The caller launches on these, the first time on the new work.
+		if (m_workSwitchPending && m_work)
+		{
+			auto const now = WorkSlot::Clock::now();
+			uint64_t const us = now > workSwitchStart ? std::chrono::duration_cast<std::chrono::microseconds>(now - workSwitchStart).count() : 0;
+			m_workSwitchLatency.record(us);
+			m_lastWorkSwitchUs.store(us, std::memory_order_relaxed);
+		}
+		m_workSwitchPending = false;
+		return true;
+	}
+
+	/**
+	 * @brief Hands a solution to the farm.
+	 * @param _kernelDone When the search that found it was seen to complete.
+	 */
+	void submitProof(Solution const& _s, WorkSlot::Clock::time_point _kernelDone)
+	{
+		TraceScope trace("submit", "miner", index);
+		Solution s = _s;
+		s.miner = (unsigned)index;
+		farm.submitProof(s);
+		m_solutionLatency.record<WorkSlot::Clock>(_kernelDone, WorkSlot::Clock::now());
+	}
 
 	void addHashCount(uint64_t _n) { m_hashCount.fetch_add(_n, std::memory_order_relaxed); }
 
+	/// Counts a solution that failed its verification, for this miner and the farm.
+	/// Its DAG is checked sooner then, see dagCheckDue().
+	void solutionFailed()
+	{
+		m_failedSolutions.fetch_add(1, std::memory_order_relaxed);
+		farm.failedSolution((unsigned)index);
+		m_nextDagCheck = std::chrono::steady_clock::time_point();
+	}
+
+	/// Whether to read back DAG items for DagVerifier now, once every
+	/// DagVerifier::interval() seconds.
+	bool dagCheckDue()
+	{
+		unsigned const interval = DagVerifier::interval();
+		auto const now = std::chrono::steady_clock::now();
+		if (!interval || now < m_nextDagCheck)
+			return false;
+		m_nextDagCheck = now + std::chrono::seconds(interval);
+		return true;
+	}
+	/// Queues what the device read back of @a _items of the DAG of @a _seed.
+	void checkDag(h256 const& _seed, std::vector<uint32_t> _items, bytes _data)
+	{
+		DagVerifier::get().submit(DagVerifier::Check{Name(), _seed, std::move(_items), std::move(_data), m_dagHealth});
+	}
+	/// The corrupt items found of the DAG of @a _seed, for the device to
+	/// regenerate.
+	std::vector<uint32_t> corruptDagItems(h256 const& _seed) { return m_dagHealth->takeCorrupt(_seed); }
+	/// Counts @a _chunks of the DAG regenerated for corrupt items.
+	void dagHealthRepaired(unsigned _chunks) { m_dagHealth->repaired(_chunks); }
+
+	/// Counts @a _count pseudo-shares a search of @a _w found, @a _nonce being
+	/// one of them, which is queued for DagVerifier if none was this second.
+	void probesCounted(unsigned _count, uint64_t _nonce, WorkPackage const& _w)
+	{
+		if (!_count)
+			return;
+		m_probes.fetch_add(_count, std::memory_order_relaxed);
+		m_probesFound.fetch_add(_count, std::memory_order_relaxed);
+		auto const now = std::chrono::steady_clock::now();
+		if (now < m_nextProbeCheck)
+			return;
+		m_nextProbeCheck = now + std::chrono::seconds(1);
+		DagVerifier::Probe p;
+		p.device = Name();
+		p.seed = _w.seed;
+		p.header = _w.header;
+		p.nonce = _nonce;
+		p.target = s_probeTarget;
+		p.health = m_probeHealth;
+		DagVerifier::get().submit(std::move(p));
+	}
+
+	/// The throttle() share of the time since the previous launch, before the
+	/// next. Shares under a millisecond add up until they make one.
+	/// @return false while a pooled miner rests, see restWait().
+	bool idle()
+	{
+		using Clock = WorkSlot::Clock;
+		unsigned const permille = m_idlePermille.load(std::memory_order_relaxed);
+		Clock::time_point const now = Clock::now();
+		if (m_restUntil != Clock::time_point())
+		{
+			// New work is not held up by what was owed on the old.
+			if (now < m_restUntil && m_restGeneration == m_workGeneration)
+				return false;
+			m_restUntil = Clock::time_point();
+			m_lastLaunch = now;
+			return true;
+		}
+		if (!permille || m_lastLaunch == Clock::time_point())
+			m_idleOwed = Clock::duration::zero();
+		else
+			m_idleOwed = std::min<Clock::duration>(m_idleOwed + (now - m_lastLaunch) * permille / (1000 - permille), std::chrono::milliseconds(250));
+		if (m_idleOwed >= std::chrono::milliseconds(1) && pooled())
+		{
+			// No thread of its own to sleep on: its steps wait instead.
+			m_restUntil = now + m_idleOwed;
+			m_restGeneration = m_workGeneration;
+			m_idleOwed = Clock::duration::zero();
+			return false;
+		}
+		if (m_idleOwed >= std::chrono::milliseconds(1))
+		{
+			Clock::time_point const until = now + m_idleOwed;
+			// Wakes meant for the loop (completions, new work) are passed on.
+			bool woken = false;
+			uint64_t const generation = m_workGeneration;
+			while (!shouldStop() && !paused() && farm.workSlot().generation() == generation)
+			{
+				auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(until - Clock::now());
+				if (left.count() <= 0)
+					break;
+				woken = waitForWake(left) || woken;
+			}
+			bool const newWork = farm.workSlot().generation() != generation;
+			if (woken || newWork)
+				wake();
+			// New work is not held up by what was owed on the old.
+			m_idleOwed = newWork ? Clock::duration::zero() : std::max(until - Clock::now(), Clock::duration::zero());
+		}
+		m_lastLaunch = Clock::now();
+		return true;
+	}
+
+	/// How long the step of a miner that launched nothing is to wait for
+	/// wake(): what is left of its rest, if resting.
+	std::chrono::milliseconds restWait() const
+	{
+		auto const c_poll = std::chrono::milliseconds(100);
+		if (m_restUntil == WorkSlot::Clock::time_point())
+			return c_poll;
+		auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(m_restUntil - WorkSlot::Clock::now()) + std::chrono::milliseconds(1);
+		return std::max(std::chrono::milliseconds(1), std::min(left, c_poll));
+	}
+
+	/// Notes the device time of a search kernel, see searchTime().
+	void searchTimed(uint64_t _us) { m_searchTime.record(_us); }
+
+	/// Notes a step of the miner's loop that took @a _d of host time, see hostLoop().
+	void hostStepped(WorkSlot::Clock::duration _d)
+	{
+		m_hostNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(_d).count(), std::memory_order_relaxed);
+	}
+
+	/// Notes that @a _n searches are in flight as from @a _at, after a
+	/// launch (@a _launched) or a completion. The device counts as idle
+	/// from the last completion to the next launch.
+	void searchesInFlight(unsigned _n, WorkSlot::Clock::time_point _at, bool _launched)
+	{
+		if (_launched)
+			m_hostLaunches.fetch_add(1, std::memory_order_relaxed);
+		if (_n && !m_inFlight && m_idleSince != WorkSlot::Clock::time_point() && _at > m_idleSince)
+			m_deviceIdleNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(_at - m_idleSince).count(), std::memory_order_relaxed);
+		if (!_n && m_inFlight)
+			m_idleSince = _at;
+		m_inFlight = _n;
+	}
+
+	/// Counts a completed search that found @a _found results into a buffer
+	/// holding @a _capacity, see searchResults().
+	void countResults(unsigned _found, unsigned _capacity)
+	{
+		m_resultCapacity.store(_capacity, std::memory_order_relaxed);
+		m_resultsPerLaunch[std::min(_found, SearchResultCounts::c_buckets - 1)].fetch_add(1, std::memory_order_relaxed);
+		if (_found > _capacity)
+			m_resultOverflows.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/// Whether @a _value is valid for parameter @a _name, else why not.
+	virtual bool checkTuning(std::string const& _name, unsigned _value, std::string& _error) const
+	{
+		(void)_value;
+		_error = "Unknown parameter " + _name;
+		return false;
+	}
+
+	/// tune() queued parameters since the last takeTuning().
+	bool tuningPending() const { return m_tuningPending.load(std::memory_order_acquire); }
+
+	MinerTuning takeTuning()
+	{
+		m_tuningPending.store(false, std::memory_order_relaxed);
+		Guard l(x_tuning);
+		MinerTuning t;
+		t.swap(m_tuningQueued);
+		return t;
+	}
+
+	/// Publishes the parameters in effect, for tuning().
+	void setTuning(MinerTuning const& _tuning)
+	{
+		Guard l(x_tuning);
+		m_tuning = _tuning;
+	}
+
+	/// Reports @a _done of @a _size DAG bytes generated, @a _ms after starting.
+	void dagProgressed(uint64_t _done, uint64_t _size, double _ms)
+	{
+		Guard l(x_dagProgress);
+		m_dagProgress.size = _size;
+		m_dagProgress.done = _done;
+		m_dagProgress.ms = _ms;
+	}
+
+	/// Reports a step of the DAG build for @a _epoch, see dagStages(). The
+	/// first of another epoch starts a new list.
+	void dagStaged(unsigned _epoch, std::string const& _name, uint64_t _bytes, double _ms)
+	{
+		Guard l(x_dagProgress);
+		if (m_dagStagesEpoch != _epoch)
+			m_dagStages.clear();
+		m_dagStagesEpoch = _epoch;
+		DagStage stage;
+		stage.name = _name;
+		stage.bytes = _bytes;
+		stage.ms = _ms;
+		m_dagStages.push_back(stage);
+	}
+
 	static unsigned s_dagLoadMode;
 	static unsigned s_dagLoadIndex;
 	static unsigned s_dagCreateDevice;
-	static uint8_t* s_dagInHostMemory;
+	static uint64_t s_probeTarget;
 
 	const size_t index = 0;
 	FarmFace& farm;
@@ -234,9 +853,48 @@ protected:
 
 private:
 	std::atomic<uint64_t> m_hashCount = {0};
+	std::atomic<bool> m_paused = {false};
+	std::atomic<unsigned> m_idlePermille = {0};
+	WorkSlot::Clock::time_point m_lastLaunch;
+	WorkSlot::Clock::duration m_idleOwed = WorkSlot::Clock::duration::zero();
+	/// A pooled miner's idle(), while it rests.
+	WorkSlot::Clock::time_point m_restUntil;
+	uint64_t m_restGeneration = 0;
+	bool m_workSwitchPending = false;
+	LatencyHistogram m_workSwitchLatency;
+	std::atomic<uint64_t> m_lastWorkSwitchUs = {0};
+	std::atomic<uint64_t> m_failedSolutions = {0};
+	std::shared_ptr<DagHealth> m_dagHealth = std::make_shared<DagHealth>();
+	std::chrono::steady_clock::time_point m_nextDagCheck;
+	std::atomic<uint64_t> m_probes = {0};
+	std::atomic<uint64_t> m_probesFound = {0};
+	std::shared_ptr<ProbeHealth> m_probeHealth = std::make_shared<ProbeHealth>();
+	std::chrono::steady_clock::time_point m_nextProbeCheck;
+	LatencyHistogram m_solutionLatency;
+	LatencyHistogram m_acceptedLatency;
+	LatencyHistogram m_rejectedLatency;
+	LatencyHistogram m_staleLatency;
+	LatencyHistogram m_searchTime;
+	std::atomic<unsigned> m_resultCapacity = {0};
+	std::atomic<uint64_t> m_resultsPerLaunch[SearchResultCounts::c_buckets] = {};
+	std::atomic<uint64_t> m_resultOverflows = {0};
+	std::atomic<uint64_t> m_hostLaunches = {0};
+	std::atomic<uint64_t> m_hostNs = {0};
+	std::atomic<uint64_t> m_deviceIdleNs = {0};
+	unsigned m_inFlight = 0;
+	WorkSlot::Clock::time_point m_idleSince;
+	mutable Mutex x_dagProgress;
+	DagProgress m_dagProgress;
+	std::vector<DagStage> m_dagStages;
+	unsigned m_dagStagesEpoch = ~0u;
+	mutable Mutex x_tuning;
+	MinerTuning m_tuning;
+	MinerTuning m_tuningQueued;
+	std::atomic<bool> m_tuningPending = {false};
 
 	WorkPackage m_work;
-	mutable Mutex x_work;
+	uint64_t m_workGeneration = ~uint64_t(0);
+	NonceLease m_lease;
 };
 
 }
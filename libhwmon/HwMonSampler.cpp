@@ -0,0 +1,125 @@
+/*
+* Background sampling of the hardware monitors
+*/
+
+#include <chrono>
+#include <libdevcore/Log.h>
+#include "HwMonSampler.h"
+
+using namespace std;
+using namespace dev;
+
+namespace
+{
+
+void store(std::atomic<uint32_t>* _v, HwReading const& _r)
+{
+	uint32_t const values[6] = {uint32_t(_r.tempC), uint32_t(_r.fanP), _r.powerW, _r.coreMHz, _r.memMHz, _r.memUtilP};
+	for (unsigned i = 0; i < 6; ++i)
+		_v[i].store(values[i], memory_order_relaxed);
+}
+
+}
+
+const unsigned HwMonSampler::c_slots;
+atomic<unsigned> HwMonSampler::s_intervalMs = {1000};
+
+HwMonSampler& HwMonSampler::get()
+{
+	static HwMonSampler s_sampler;
+	return s_sampler;
+}
+
+HwMonSampler::HwMonSampler()
+{
+	for (auto& r: m_readings)
+	{
+		r.seq.store(0, memory_order_relaxed);
+		store(r.values, HwReading());
+	}
+	m_thread = thread([this]() { run(); });
+}
+
+HwMonSampler::~HwMonSampler()
+{
+	{
+		lock_guard<mutex> l(x_readers);
+		m_running = false;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+}
+
+unsigned HwMonSampler::add(function<HwReading()> const& _read)
+{
+	lock_guard<mutex> l(x_readers);
+	for (unsigned i = 0; i < c_slots; ++i)
+		if (!m_readers[i])
+		{
+			m_readers[i] = _read;
+			write(i, HwReading());
+			return i;
+		}
+	return c_slots;
+}
+
+void HwMonSampler::remove(unsigned _slot)
+{
+	if (_slot >= c_slots)
+		return;
+	lock_guard<mutex> l(x_readers);
+	m_readers[_slot] = nullptr;
+}
+
+HwReading HwMonSampler::reading(unsigned _slot)
+{
+	if (!m_wanted.load(memory_order_relaxed))
+	{
+		m_wanted.store(true, memory_order_relaxed);
+		// A wake-up missed costs an interval at most.
+		m_wake.notify_one();
+	}
+	HwReading r;
+	if (_slot >= c_slots)
+		return r;
+	Slot const& s = m_readings[_slot];
+	for (;;)
+	{
+		unsigned const seq = s.seq.load(memory_order_acquire);
+		if (seq & 1)
+			continue;
+		r.tempC = int(s.values[0].load(memory_order_relaxed));
+		r.fanP = int(s.values[1].load(memory_order_relaxed));
+		r.powerW = s.values[2].load(memory_order_relaxed);
+		r.coreMHz = s.values[3].load(memory_order_relaxed);
+		r.memMHz = s.values[4].load(memory_order_relaxed);
+		r.memUtilP = s.values[5].load(memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if (s.seq.load(memory_order_relaxed) == seq)
+			return r;
+	}
+}
+
+void HwMonSampler::write(unsigned _slot, HwReading const& _r)
+{
+	Slot& s = m_readings[_slot];
+	unsigned const seq = s.seq.load(memory_order_relaxed);
+	s.seq.store(seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	store(s.values, _r);
+	s.seq.store(seq + 2, memory_order_release);
+}
+
+void HwMonSampler::run()
+{
+	setThreadName("hwmon");
+	unique_lock<mutex> l(x_readers);
+	while (m_running)
+	{
+		if (m_wanted.load(memory_order_relaxed))
+			for (unsigned i = 0; i < c_slots; ++i)
+				if (m_readers[i])
+					write(i, m_readers[i]());
+		m_wake.wait_for(l, chrono::milliseconds(s_intervalMs.load(memory_order_relaxed)));
+	}
+}
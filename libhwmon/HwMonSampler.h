@@ -0,0 +1,85 @@
+/*
+* Background sampling of the hardware monitors
+*/
+
+#ifndef _HWMONSAMPLER_H_
+#define _HWMONSAMPLER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace dev
+{
+
+/// What the monitors of one device read.
+struct HwReading
+{
+	int tempC = 0;
+	int fanP = 0;
+	unsigned powerW = 0;
+	unsigned coreMHz = 0;
+	unsigned memMHz = 0;
+	unsigned memUtilP = 0;  ///< Of the memory controller.
+};
+
+/**
+ * @brief Makes the driver queries of all devices (NVML, ADL, sysfs) on a
+ * thread of its own, at an interval, and caches the readings. Readers get
+ * the last reading without taking a lock, so neither the miners, the farm
+ * nor the API ever wait on a slow driver. Nothing is sampled until the
+ * first reading() asks for one.
+ */
+class HwMonSampler
+{
+public:
+	/// Devices sampled at most.
+	static const unsigned c_slots = 64;
+
+	static HwMonSampler& get();
+
+	/// Milliseconds between the samples of a device.
+	static void setInterval(unsigned _ms) { s_intervalMs.store(_ms, std::memory_order_relaxed); }
+
+	/// Has _read() sample a device from now on, on the sampler thread.
+	/// Returns its slot, c_slots if all are taken.
+	unsigned add(std::function<HwReading()> const& _read);
+	/// Stops sampling _slot; returns once a sample in progress is done.
+	void remove(unsigned _slot);
+
+	/// The last reading of _slot, zero until sampled. Lock-free; only retries
+	/// while the sampler is storing that very reading.
+	HwReading reading(unsigned _slot);
+
+private:
+	HwMonSampler();
+	~HwMonSampler();
+
+	void run();
+	/// Publishes _r as the reading of _slot. Call with x_readers held.
+	void write(unsigned _slot, HwReading const& _r);
+
+	/// A reading behind a sequence lock: odd while written.
+	struct Slot
+	{
+		std::atomic<unsigned> seq;
+		std::atomic<uint32_t> values[6];
+	};
+
+	static std::atomic<unsigned> s_intervalMs;
+
+	std::mutex x_readers;  ///< Guards m_readers; held while sampling.
+	std::function<HwReading()> m_readers[c_slots];
+	Slot m_readings[c_slots];
+	std::atomic<bool> m_wanted = {false};
+	bool m_running = true;
+	std::condition_variable m_wake;
+	std::thread m_thread;
+};
+
+}
+
+#endif
@@ -68,6 +68,8 @@ return NULL;
 		wrap_dlsym(adlh->adl_dll, "ADL_Overdrive5_Temperature_Get");
 	adlh->adlOverdrive5FanSpeedGet = (wrap_adlReturn_t(*)(int, int, ADLFanSpeedValue*))
 		wrap_dlsym(adlh->adl_dll, "ADL_Overdrive5_FanSpeed_Get");
+	adlh->adlOverdrive5CurrentActivityGet = (wrap_adlReturn_t(*)(int, ADLPMActivity*))
+		wrap_dlsym(adlh->adl_dll, "ADL_Overdrive5_CurrentActivity_Get");
 	adlh->adlMainControlRefresh = (wrap_adlReturn_t(*)(void))
 		wrap_dlsym(adlh->adl_dll, "ADL_Main_Control_Refresh");
 	adlh->adlMainControlDestory = (wrap_adlReturn_t(*)(void))
@@ -188,6 +190,21 @@ int wrap_adl_get_fanpcnt(wrap_adl_handle *adlh, int gpuindex, unsigned int *fanp
 	return 0;
 }
 
+int wrap_adl_get_clocks(wrap_adl_handle *adlh, int gpuindex, unsigned int *coreMHz, unsigned int *memMHz)
+{
+	if (gpuindex < 0 || gpuindex >= adlh->adl_gpucount || adlh->adlOverdrive5CurrentActivityGet == NULL)
+		return -1;
+
+	ADLPMActivity activity;
+	memset(&activity, 0, sizeof(activity));
+	activity.iSize = sizeof(activity);
+	if (adlh->adlOverdrive5CurrentActivityGet(adlh->phys_logi_device_id[gpuindex], &activity) != WRAPADL_OK)
+		return -1;
+	*coreMHz = unsigned(activity.iEngineClock / 100);
+	*memMHz = unsigned(activity.iMemoryClock / 100);
+	return 0;
+}
+
 #if defined(__cplusplus)
 }
 #endif
@@ -103,6 +103,30 @@ typedef struct ADLFanSpeedValue
 	int iFlags;
 } ADLFanSpeedValue;
 
+typedef struct ADLPMActivity
+{
+	/// Must be set to the size of the structure
+	int iSize;
+	/// Current engine clock in 10 KHz.
+	int iEngineClock;
+	/// Current memory clock in 10 KHz.
+	int iMemoryClock;
+	/// Current core voltage.
+	int iVddc;
+	/// GPU utilization.
+	int iActivityPercent;
+	/// Performance level index.
+	int iCurrentPerformanceLevel;
+	/// Current PCIE bus speed.
+	int iCurrentBusSpeed;
+	/// Number of PCIE bus lanes.
+	int iCurrentBusLanes;
+	/// Maximum number of PCIE bus lanes.
+	int iMaximumBusLanes;
+	/// Reserved for future purposes.
+	int iReserved;
+} ADLPMActivity;
+
 /*
 * Handle to hold the function pointers for the entry points we need,
 * and the shared library itself.
@@ -118,6 +142,7 @@ typedef struct {
 	wrap_adlReturn_t(*adlAdapterAdapterIdGet)(int, int*);
 	wrap_adlReturn_t(*adlOverdrive5TemperatureGet)(int, int, ADLTemperature*);
 	wrap_adlReturn_t(*adlOverdrive5FanSpeedGet)(int, int, ADLFanSpeedValue*);
+	wrap_adlReturn_t(*adlOverdrive5CurrentActivityGet)(int, ADLPMActivity*);	/* optional */
 	wrap_adlReturn_t(*adlMainControlRefresh)(void);
 	wrap_adlReturn_t(*adlMainControlDestory)(void);
 } wrap_adl_handle;
@@ -133,6 +158,8 @@ int wrap_adl_get_tempC(wrap_adl_handle *adlh, int gpuindex, unsigned int *tempC)
 
 int wrap_adl_get_fanpcnt(wrap_adl_handle *adlh, int gpuindex, unsigned int *fanpcnt);
 
+int wrap_adl_get_clocks(wrap_adl_handle *adlh, int gpuindex, unsigned int *coreMHz, unsigned int *memMHz);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -17,6 +17,8 @@
 #include <sys/types.h>
 #if defined(__linux)
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 #include "wrapamdsysfs.h"
 
@@ -35,6 +37,68 @@ static bool getFileContentValue(const char* filename, unsigned int& value)
 	return (p != p2);
 }
 
+#if defined(__linux)
+// The monitored files stay open, a read is one pread() of the value.
+static bool getFdContentValue(int fd, unsigned int& value)
+{
+	value = 0;
+	if (fd < 0)
+		return false;
+	char buf[32];
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return false;
+	buf[n] = 0;
+	char* p2;
+	errno = 0;
+	value = strtoul(buf, &p2, 0);
+	if (errno != 0)
+		return false;
+	return (buf != p2);
+}
+
+// The pp_dpm_* files list the clock levels, "1: 1000Mhz *" being the current one.
+static bool getFdCurrentLevel(int fd, unsigned int& mhz)
+{
+	mhz = 0;
+	if (fd < 0)
+		return false;
+	char buf[512];
+	ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return false;
+	buf[n] = 0;
+	for (char* line = buf; line && *line; )
+	{
+		char* end = strchr(line, '\n');
+		if (end)
+			*end = 0;
+		const char* colon = strchr(line, ':');
+		if (colon && strchr(line, '*'))
+		{
+			mhz = strtoul(colon + 1, nullptr, 10);
+			return mhz != 0;
+		}
+		line = end ? end + 1 : nullptr;
+	}
+	return false;
+}
+
+static int openDeviceFile(int gpuindex, const char* name)
+{
+	char dbuf[120];
+	snprintf(dbuf, 120, "/sys/class/drm/card%u/device/%s", gpuindex, name);
+	return open(dbuf, O_RDONLY | O_CLOEXEC);
+}
+
+static int openHwmonFile(int gpuindex, int hwmonindex, const char* name)
+{
+	char dbuf[120];
+	snprintf(dbuf, 120, "/sys/class/drm/card%u/device/hwmon/hwmon%u/%s",
+		gpuindex, hwmonindex, name);
+	return open(dbuf, O_RDONLY | O_CLOEXEC);
+}
+#endif
 
 wrap_amdsysfs_handle * wrap_amdsysfs_create()
 {
@@ -140,12 +204,70 @@ wrap_amdsysfs_handle * wrap_amdsysfs_create()
 
 		sysfsh->sysfs_hwmon_id[i] = hwmonIndex;
 	}
+
+	sysfsh->temp_fd = (int*)calloc(gpucount, sizeof(int));
+	sysfsh->pwm_fd = (int*)calloc(gpucount, sizeof(int));
+	sysfsh->power_fd = (int*)calloc(gpucount, sizeof(int));
+	sysfsh->sclk_fd = (int*)calloc(gpucount, sizeof(int));
+	sysfsh->mclk_fd = (int*)calloc(gpucount, sizeof(int));
+	sysfsh->mem_busy_fd = (int*)calloc(gpucount, sizeof(int));
+	sysfsh->pwm_min = (unsigned int*)calloc(gpucount, sizeof(unsigned int));
+	sysfsh->pwm_max = (unsigned int*)calloc(gpucount, sizeof(unsigned int));
+	for (int i = 0; i < sysfsh->sysfs_gpucount; i++)
+	{
+		int gpuindex = sysfsh->card_sysfs_device_id[i];
+		int hwmonindex = sysfsh->sysfs_hwmon_id[i];
+		sysfsh->temp_fd[i] = openHwmonFile(gpuindex, hwmonindex, "temp1_input");
+		sysfsh->pwm_fd[i] = openHwmonFile(gpuindex, hwmonindex, "pwm1");
+		sysfsh->power_fd[i] = openHwmonFile(gpuindex, hwmonindex, "power1_average");
+		sysfsh->sclk_fd[i] = openDeviceFile(gpuindex, "pp_dpm_sclk");
+		sysfsh->mclk_fd[i] = openDeviceFile(gpuindex, "pp_dpm_mclk");
+		sysfsh->mem_busy_fd[i] = openDeviceFile(gpuindex, "mem_busy_percent");
+
+		// The fan range does not change.
+		int fd = openHwmonFile(gpuindex, hwmonindex, "pwm1_min");
+		getFdContentValue(fd, sysfsh->pwm_min[i]);
+		if (fd >= 0)
+			close(fd);
+		fd = openHwmonFile(gpuindex, hwmonindex, "pwm1_max");
+		if (!getFdContentValue(fd, sysfsh->pwm_max[i]))
+			sysfsh->pwm_max[i] = 255;
+		if (fd >= 0)
+			close(fd);
+	}
 #endif
 
 	return sysfsh;
 }
 int wrap_amdsysfs_destory(wrap_amdsysfs_handle *sysfsh)
 {
+#if defined(__linux)
+	for (int i = 0; i < sysfsh->sysfs_gpucount; i++)
+	{
+		if (sysfsh->temp_fd[i] >= 0)
+			close(sysfsh->temp_fd[i]);
+		if (sysfsh->pwm_fd[i] >= 0)
+			close(sysfsh->pwm_fd[i]);
+		if (sysfsh->power_fd[i] >= 0)
+			close(sysfsh->power_fd[i]);
+		if (sysfsh->sclk_fd[i] >= 0)
+			close(sysfsh->sclk_fd[i]);
+		if (sysfsh->mclk_fd[i] >= 0)
+			close(sysfsh->mclk_fd[i]);
+		if (sysfsh->mem_busy_fd[i] >= 0)
+			close(sysfsh->mem_busy_fd[i]);
+	}
+	free(sysfsh->temp_fd);
+	free(sysfsh->pwm_fd);
+	free(sysfsh->power_fd);
+	free(sysfsh->sclk_fd);
+	free(sysfsh->mclk_fd);
+	free(sysfsh->mem_busy_fd);
+	free(sysfsh->pwm_min);
+	free(sysfsh->pwm_max);
+	free(sysfsh->card_sysfs_device_id);
+	free(sysfsh->sysfs_hwmon_id);
+#endif
 	free(sysfsh);
 	return 0;
 }
@@ -158,52 +280,89 @@ int wrap_amdsysfs_get_gpucount(wrap_amdsysfs_handle *sysfsh, int *gpucount)
 
 int wrap_amdsysfs_get_tempC(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *tempC)
 {
-	int gpuindex = sysfsh->card_sysfs_device_id[index];
-	if (gpuindex < 0 || index >= sysfsh->sysfs_gpucount)
-		return -1;
-
-	int hwmonindex = sysfsh->sysfs_hwmon_id[index];
-	if (hwmonindex < 0)
+#if defined(__linux)
+	if (index < 0 || index >= sysfsh->sysfs_gpucount)
 		return -1;
 
-	char dbuf[120];
-	snprintf(dbuf, 120, "/sys/class/drm/card%u/device/hwmon/hwmon%u/temp1_input",
-		gpuindex, hwmonindex);
-
 	unsigned int temp = 0;
-	getFileContentValue(dbuf, temp);
+	if (!getFdContentValue(sysfsh->temp_fd[index], temp))
+		return -1;
 
 	if (temp > 0)
 		*tempC = temp / 1000;
 
 	return 0;
+#else
+	return -1;
+#endif
 }
 
 int wrap_amdsysfs_get_fanpcnt(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *fanpcnt)
 {
-	int gpuindex = sysfsh->card_sysfs_device_id[index];
-	if (gpuindex < 0 || index >= sysfsh->sysfs_gpucount)
+#if defined(__linux)
+	if (index < 0 || index >= sysfsh->sysfs_gpucount)
 		return -1;
 
-	int hwmonindex = sysfsh->sysfs_hwmon_id[index];
-	if (hwmonindex < 0)
+	unsigned int pwm = 0, pwmMax = sysfsh->pwm_max[index], pwmMin = sysfsh->pwm_min[index];
+	if (!getFdContentValue(sysfsh->pwm_fd[index], pwm) || pwmMax <= pwmMin)
 		return -1;
 
-	unsigned int pwm = 0, pwmMax = 255, pwmMin = 0;
+	*fanpcnt = double(pwm - pwmMin) / double(pwmMax - pwmMin) * 100.0;
+	return 0;
+#else
+	return -1;
+#endif
+}
 
-	char dbuf[120];
-	snprintf(dbuf, 120, "/sys/class/drm/card%u/device/hwmon/hwmon%u/pwm1",
-		gpuindex, hwmonindex);
-	getFileContentValue(dbuf, pwm);
+int wrap_amdsysfs_get_power_usage(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *milliwatts)
+{
+#if defined(__linux)
+	if (index < 0 || index >= sysfsh->sysfs_gpucount)
+		return -1;
+
+	// In microwatts.
+	unsigned int power = 0;
+	if (!getFdContentValue(sysfsh->power_fd[index], power))
+		return -1;
+
+	*milliwatts = power / 1000;
+	return 0;
+#else
+	return -1;
+#endif
+}
 
-	snprintf(dbuf, 120, "/sys/class/drm/card%u/device/hwmon/hwmon%u/pwm1_max",
-		gpuindex, hwmonindex);
-	getFileContentValue(dbuf, pwmMax);
+int wrap_amdsysfs_get_clocks(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *coreMHz, unsigned int *memMHz)
+{
+#if defined(__linux)
+	if (index < 0 || index >= sysfsh->sysfs_gpucount)
+		return -1;
 
-	snprintf(dbuf, 120, "/sys/class/drm/card%u/device/hwmon/hwmon%u/pwm1_min",
-		gpuindex, hwmonindex);
-	getFileContentValue(dbuf, pwmMin);
+	unsigned int core = 0, mem = 0;
+	if (!getFdCurrentLevel(sysfsh->sclk_fd[index], core) || !getFdCurrentLevel(sysfsh->mclk_fd[index], mem))
+		return -1;
 
-	*fanpcnt = double(pwm - pwmMin) / double(pwmMax - pwmMin) * 100.0;
+	*coreMHz = core;
+	*memMHz = mem;
 	return 0;
-}
\ No newline at end of file
+#else
+	return -1;
+#endif
+}
+
+int wrap_amdsysfs_get_mem_utilization(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *percent)
+{
+#if defined(__linux)
+	if (index < 0 || index >= sysfsh->sysfs_gpucount)
+		return -1;
+
+	unsigned int busy = 0;
+	if (!getFdContentValue(sysfsh->mem_busy_fd[index], busy))
+		return -1;
+
+	*percent = busy;
+	return 0;
+#else
+	return -1;
+#endif
+}
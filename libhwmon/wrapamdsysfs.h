@@ -11,6 +11,15 @@ typedef struct {
 	int sysfs_gpucount;
 	int *card_sysfs_device_id;  /* map cardidx to filesystem card idx */
 	int *sysfs_hwmon_id;        /* filesystem card idx to filesystem hwmon idx */
+	/* Kept open, by card idx, -1 where missing: the values are read with pread() */
+	int *temp_fd;               /* temp1_input */
+	int *pwm_fd;                /* pwm1 */
+	int *power_fd;              /* power1_average */
+	int *sclk_fd;               /* device/pp_dpm_sclk */
+	int *mclk_fd;               /* device/pp_dpm_mclk */
+	int *mem_busy_fd;           /* device/mem_busy_percent */
+	unsigned int *pwm_min;      /* pwm1_min and pwm1_max, read once */
+	unsigned int *pwm_max;
 } wrap_amdsysfs_handle;
 
 wrap_amdsysfs_handle * wrap_amdsysfs_create();
@@ -22,4 +31,10 @@ int wrap_amdsysfs_get_tempC(wrap_amdsysfs_handle *sysfsh, int index, unsigned in
 
 int wrap_amdsysfs_get_fanpcnt(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *fanpcnt);
 
+int wrap_amdsysfs_get_power_usage(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *milliwatts);
+
+int wrap_amdsysfs_get_clocks(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *coreMHz, unsigned int *memMHz);
+
+int wrap_amdsysfs_get_mem_utilization(wrap_amdsysfs_handle *sysfsh, int index, unsigned int *percent);
+
 #endif
\ No newline at end of file
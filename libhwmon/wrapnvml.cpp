@@ -87,6 +87,10 @@ return NULL;
     wrap_dlsym(nvmlh->nvml_dll, "nvmlDeviceGetFanSpeed");
   nvmlh->nvmlDeviceGetPowerUsage = (wrap_nvmlReturn_t (*)(wrap_nvmlDevice_t, unsigned int *))
     wrap_dlsym(nvmlh->nvml_dll, "nvmlDeviceGetPowerUsage");
+  nvmlh->nvmlDeviceGetClockInfo = (wrap_nvmlReturn_t (*)(wrap_nvmlDevice_t, int, unsigned int *))
+    wrap_dlsym(nvmlh->nvml_dll, "nvmlDeviceGetClockInfo");
+  nvmlh->nvmlDeviceGetUtilizationRates = (wrap_nvmlReturn_t (*)(wrap_nvmlDevice_t, wrap_nvmlUtilization_t *))
+    wrap_dlsym(nvmlh->nvml_dll, "nvmlDeviceGetUtilizationRates");
   nvmlh->nvmlShutdown = (wrap_nvmlReturn_t (*)())
     wrap_dlsym(nvmlh->nvml_dll, "nvmlShutdown");
 
@@ -253,6 +257,36 @@ int wrap_nvml_get_power_usage(wrap_nvml_handle *nvmlh,
 }
 
 
+int wrap_nvml_get_clocks(wrap_nvml_handle *nvmlh,
+                         int gpuindex,
+                         unsigned int *coreMHz,
+                         unsigned int *memMHz) {
+  if (gpuindex < 0 || gpuindex >= nvmlh->nvml_gpucount || nvmlh->nvmlDeviceGetClockInfo == NULL)
+    return -1;
+
+  if (nvmlh->nvmlDeviceGetClockInfo(nvmlh->devs[gpuindex], WRAPNVML_CLOCK_GRAPHICS, coreMHz) != WRAPNVML_SUCCESS ||
+      nvmlh->nvmlDeviceGetClockInfo(nvmlh->devs[gpuindex], WRAPNVML_CLOCK_MEM, memMHz) != WRAPNVML_SUCCESS)
+    return -1;
+
+  return 0;
+}
+
+
+int wrap_nvml_get_mem_utilization(wrap_nvml_handle *nvmlh,
+                                  int gpuindex,
+                                  unsigned int *percent) {
+  if (gpuindex < 0 || gpuindex >= nvmlh->nvml_gpucount || nvmlh->nvmlDeviceGetUtilizationRates == NULL)
+    return -1;
+
+  wrap_nvmlUtilization_t util;
+  if (nvmlh->nvmlDeviceGetUtilizationRates(nvmlh->devs[gpuindex], &util) != WRAPNVML_SUCCESS)
+    return -1;
+
+  *percent = util.memory;
+  return 0;
+}
+
+
 #if defined(__cplusplus)
 }
 #endif
@@ -32,6 +32,16 @@ typedef enum wrap_nvmlReturn_enum {
 
 typedef void * wrap_nvmlDevice_t;
 
+/* nvmlClockType_t */
+#define WRAPNVML_CLOCK_GRAPHICS 0
+#define WRAPNVML_CLOCK_MEM      2
+
+/* our own version of the utilization struct, in percent of the last sample period */
+typedef struct {
+  unsigned int gpu;
+  unsigned int memory;
+} wrap_nvmlUtilization_t;
+
 /* our own version of the PCI info struct */
 typedef struct {
   char bus_id_str[16];             /* string form of bus info */
@@ -69,6 +79,9 @@ typedef struct {
   wrap_nvmlReturn_t (*nvmlDeviceGetTemperature)(wrap_nvmlDevice_t, int, unsigned int *);
   wrap_nvmlReturn_t (*nvmlDeviceGetFanSpeed)(wrap_nvmlDevice_t, unsigned int *);
   wrap_nvmlReturn_t (*nvmlDeviceGetPowerUsage)(wrap_nvmlDevice_t, unsigned int *);
+  /* optional, NULL where the driver lacks them */
+  wrap_nvmlReturn_t (*nvmlDeviceGetClockInfo)(wrap_nvmlDevice_t, int, unsigned int *);
+  wrap_nvmlReturn_t (*nvmlDeviceGetUtilizationRates)(wrap_nvmlDevice_t, wrap_nvmlUtilization_t *);
   wrap_nvmlReturn_t (*nvmlShutdown)(void);
 } wrap_nvml_handle;
 
@@ -119,6 +132,21 @@ int wrap_nvml_get_power_usage(wrap_nvml_handle *nvmlh,
                               int gpuindex,
                               unsigned int *milliwatts);
 
+/*
+ * Query the current GPU core and memory clocks in MHz from the CUDA device ID
+ */
+int wrap_nvml_get_clocks(wrap_nvml_handle *nvmlh,
+                         int gpuindex,
+                         unsigned int *coreMHz,
+                         unsigned int *memMHz);
+
+/*
+ * Query the memory controller utilization (percent) from the CUDA device ID
+ */
+int wrap_nvml_get_mem_utilization(wrap_nvml_handle *nvmlh,
+                                  int gpuindex,
+                                  unsigned int *percent);
+
 
 #if defined(__cplusplus)
 }
@@ -1,6 +1,8 @@
  
 #include "EthStratumClient.h"
+#include "StratumProxy.h"
 #include <libdevcore/Log.h>
+#include <libdevcore/Trace.h>
 #include <libethash/endian.h>
 using boost::asio::ip::tcp;
 
@@ -27,10 +29,18 @@ static void diffToTarget(uint32_t *target, double diff)
 }
 
 
-EthStratumClient::EthStratumClient(Farm* f, MinerType m, string const & host, string const & port, string const & user, string const & pass, int const & retries, int const & worktimeout, int const & protocol, string const & email)
-        :   m_socket(m_io_service),
-	        m_worktimer(m_io_service),
-		    m_switchtimer(m_io_service)
+bool EthStratumClient::s_hotStandby = false;
+const unsigned EthStratumClient::c_hashrateSeconds;
+const size_t EthStratumClient::c_shareQueue;
+
+EthStratumClient::EthStratumClient(Farm* f, MinerType m, string const & host, string const & port, string const & user, string const & pass, int const & retries, int const & worktimeout, int const & protocol, string const & email, bool _standby)
+        :   m_standby(_standby),
+            m_isStandby(_standby),
+            p_serving(this),
+            m_connector(m_strand),
+            m_socket(m_strand),
+	        m_worktimer(m_strand.service()),
+		    m_switchtimer(m_strand.service())
 {
 	m_minerType = m;
 	m_primary.host = host;
@@ -51,13 +61,17 @@ EthStratumClient::EthStratumClient(Farm* f, MinerType m, string const & host, st
 	m_submit_hashrate_id = h256::random().hex();
 	
 	p_farm = f;
-	connect();
+	m_strand.post(boost::bind(&EthStratumClient::connect, this));
 }
 
 EthStratumClient::~EthStratumClient()
 {
-	m_io_service.stop();
-	m_serviceThread.join();
+	m_strand.post([this]()
+	{
+		m_running = false;
+		close();
+	});
+	m_strand.drain();
 }
 
 void EthStratumClient::setFailover(string const & host, string const & port)
@@ -71,6 +85,11 @@ void EthStratumClient::setFailover(string const & host, string const & port, str
 	m_failover.port = port;
 	m_failover.user = user;
 	m_failover.pass = pass;
+	if (s_hotStandby && !m_isStandby && host != "exit")
+	{
+		cnote << "Keeping failover stratum server " + host + ":" + port + " on hot standby";
+		m_hotStandby.reset(new EthStratumClient(p_farm, m_minerType, host, port, user, pass, m_maxRetries, m_worktimeout, m_protocol, m_email, true));
+	}
 }
 
 void EthStratumClient::setFee(string const & host, string const & port, string const & user, string const & pass)
@@ -79,43 +98,91 @@ void EthStratumClient::setFee(string const & host, string const & port, string c
 	m_fee.port = port;
 	m_fee.user = user;
 	m_fee.pass = pass;
+	if (!m_isStandby && !host.empty())
+	{
+		cnote << "Keeping fee stratum server " + host + ":" + port + " on standby";
+		m_feeClient.reset(new EthStratumClient(p_farm, m_minerType, host, port, user, pass, m_maxRetries, m_worktimeout, m_protocol, m_email, true));
+	}
 }
 
-void EthStratumClient::connect()
+void EthStratumClient::setCandidates(vector<PoolProber::Endpoint> const& _candidates)
 {
-	tcp::resolver r(m_io_service);
-	tcp::resolver::query q(p_active->host, p_active->port);
-	
-	r.async_resolve(q, boost::bind(&EthStratumClient::resolve_handler,
-					this, boost::asio::placeholders::error,
-					boost::asio::placeholders::iterator));
+	vector<PoolProber::Endpoint> endpoints{PoolProber::Endpoint{m_primary.host, m_primary.port}};
+	endpoints.insert(endpoints.end(), _candidates.begin(), _candidates.end());
+	m_prober.reset(new PoolProber(endpoints, m_protocol));
+}
 
-	cnote << "Connecting to stratum server " + p_active->host + ":" + p_active->port;
+void EthStratumClient::setProxy(StratumProxy* _proxy)
+{
+	p_proxy = _proxy;
+	if (m_hotStandby)
+		m_hotStandby->setProxy(_proxy);
+	if (m_feeClient)
+		m_feeClient->setProxy(_proxy);
+}
 
-	if (m_serviceThread.joinable())
-	{
-		// If the service thread have been created try to reset the service.
-		m_io_service.reset();
-	}
-	else
+void EthStratumClient::connect()
+{
 	{
-		// Otherwise, if the first time here, create new thread.
-		m_serviceThread = std::thread{boost::bind(&boost::asio::io_service::run, &m_io_service)};
+		// Replies to shares sent on an older connection never come, and
+		// lines not written yet were for it.
+		std::lock_guard<std::mutex> l(x_submits);
+		m_pendingShares.clear();
+		m_submitQueue.clear();
+		m_hashrateQueued.clear();
 	}
+	boost::system::error_code ec;
+	m_socket.close(ec);
+	m_connector.connect(m_socket.lowest_layer(), p_active->host, p_active->port, boost::bind(&EthStratumClient::connect_handler, this, _1, _2));
+
+	cnote << "Connecting to stratum server " + p_active->host + ":" + p_active->port;
 }
 
 #define BOOST_ASIO_ENABLE_CANCELIO 
 
 void EthStratumClient::reconnect()
 {
+	EthStratumClient* s = p_serving.load();
+	s->m_strand.post(boost::bind(&EthStratumClient::doReconnect, s));
+}
+
+void EthStratumClient::activate()
+{
+	m_strand.post([this]()
+	{
+		m_standby.store(false);
+		startFarm();
+		if (m_current)
+		{
+			p_farm->setWork(m_current, std::chrono::steady_clock::now());
+			if (p_proxy)
+				p_proxy->notify(m_current, m_extraNonceHexSize, m_nextWorkDifficulty);
+		}
+	});
+}
+
+void EthStratumClient::doReconnect()
+{
+	if (!m_running)
+		return;
 	m_worktimer.cancel();
 
-	m_io_service.reset();
 	//m_socket.close(); // leads to crashes on Linux
 	m_authorized = false;
 	m_connected.store(false, std::memory_order_relaxed);
-		
-	if (!m_failover.host.empty())
+
+	if (m_hotStandby)
+	{
+		// This pool keeps being retried meanwhile, for workReceived() to take it back.
+		if (p_serving.load() == this && m_hotStandby->ready())
+		{
+			cnote << "Switching to hot standby stratum server " + m_failover.host + ":" + m_failover.port;
+			m_standby.store(true);
+			m_hotStandby->activate();
+			p_serving.store(m_hotStandby.get());
+		}
+	}
+	else if (!m_failover.host.empty())
 	{
 		m_retries++;
 
@@ -137,14 +204,62 @@ void EthStratumClient::reconnect()
 	}
 	
 	cnote << "Reconnecting in 3 seconds...";
-	boost::asio::deadline_timer timer(m_io_service, boost::posix_time::seconds(3));
-	timer.wait();
+	m_switchtimer.expires_from_now(boost::posix_time::seconds(3));
+	m_switchtimer.async_wait(m_strand.wrap(boost::bind(&EthStratumClient::reconnect_handler, this, boost::asio::placeholders::error)));
+}
 
+void EthStratumClient::reconnect_handler(const boost::system::error_code& ec)
+{
+	if (!ec && m_running)
+		connect();
+}
+
+void EthStratumClient::moveTo(size_t _i)
+{
+	if (!m_running || p_active != &m_primary || m_fee_mode)
+		return;
+	PoolProber::Endpoint const& e = m_prober->endpoint(_i);
+	cnote << "Moving to faster stratum server " + e.host + ":" + e.port;
+	m_proberIndex = _i;
+	m_primary.host = e.host;
+	m_primary.port = e.port;
+	m_worktimer.cancel();
+	m_authorized = false;
+	m_connected.store(false, std::memory_order_relaxed);
 	connect();
 }
 
 void EthStratumClient::switchPool()
 {
+	m_strand.post(boost::bind(&EthStratumClient::doSwitchPool, this));
+}
+
+void EthStratumClient::doSwitchPool()
+{
+	if (m_feeClient)
+	{
+		if (!m_fee_mode && m_feeClient->ready())
+		{
+			cnote << "Switching to fee stratum server " + m_fee.host + ":" + m_fee.port;
+			p_beforeFee = p_serving.load();
+			p_beforeFee->deactivate();
+			m_feeClient->activate();
+			p_serving.store(m_feeClient.get());
+			m_fee_mode = true;
+			return;
+		}
+		if (m_fee_mode && p_serving.load() == m_feeClient.get())
+		{
+			cnote << "Switching back from fee stratum server";
+			m_feeClient->deactivate();
+			p_beforeFee->activate();
+			p_serving.store(p_beforeFee);
+			m_fee_mode = false;
+			return;
+		}
+		// Not connected yet: switch the cold way below.
+	}
+
 	m_worktimer.cancel();
 	//m_io_service.reset();
 	//m_socket.close(); // leads to crashes on Linux
@@ -166,55 +281,75 @@ void EthStratumClient::disconnect()
 	cnote << "Disconnecting";
 	m_connected.store(false, std::memory_order_relaxed);
 	m_running = false;
-	if (p_farm->isMining())
+	if (!m_isStandby && p_farm->isMining())
 	{
 		cnote << "Stopping farm";
 		p_farm->stop();
 	}
-	m_socket.close();
-	m_io_service.stop();
+	close();
+}
+
+void EthStratumClient::close()
+{
+	boost::system::error_code ec;
+	m_worktimer.cancel(ec);
+	m_switchtimer.cancel(ec);
+	m_connector.cancel();
+	m_socket.close(ec);
+	m_recorder.close();
+}
+
+void EthStratumClient::startFarm()
+{
+	if (p_farm->isMining())
+		return;
+	cnote << "Starting farm";
+	if (m_minerType == MinerType::CL)
+		p_farm->start("opencl", false);
+	else if (m_minerType == MinerType::CUDA)
+		p_farm->start("cuda", false);
+	else if (m_minerType == MinerType::Fpga)
+		p_farm->start("fpga", false);
+	else if (m_minerType == MinerType::CPU)
+		p_farm->start("cpu", false);
+	else if (m_minerType == MinerType::Mixed) {
+		p_farm->start("cuda", false);
+		p_farm->start("opencl", true);
+		p_farm->start("fpga", false);
+	}
 }
 
-void EthStratumClient::resolve_handler(const boost::system::error_code& ec, tcp::resolver::iterator i)
+void EthStratumClient::connect_handler(const boost::system::error_code& ec, tcp::endpoint const& endpoint)
 {
+
+	dev::setThreadName("stratum");
 	if (!ec)
 	{
-		async_connect(m_socket, i, boost::bind(&EthStratumClient::connect_handler,
-						this, boost::asio::placeholders::error,
-						boost::asio::placeholders::iterator));
+		// Shares are small and late ones go stale: no Nagle delay.
+		boost::system::error_code noDelay;
+		m_socket.lowest_layer().set_option(tcp::no_delay(true), noDelay);
+
+		cnote << "Connected to stratum server " + p_active->host + ":" + p_active->port << "at" << endpoint.address();
+		m_socket.async_handshake(p_active->host, p_active->port, boost::bind(&EthStratumClient::handshake_handler, this, _1));
 	}
 	else
 	{
-		cerr << "Could not resolve host " << p_active->host + ":" + p_active->port + ", " << ec.message();
-		reconnect();
+		cwarn << "Could not connect to stratum server " + p_active->host + ":" + p_active->port + ", " + ec.message();
+		doReconnect();
 	}
+
 }
 
-void EthStratumClient::connect_handler(const boost::system::error_code& ec, tcp::resolver::iterator i)
+void EthStratumClient::handshake_handler(const boost::system::error_code& ec)
 {
-
-	dev::setThreadName("stratum");
+	if (ec == boost::asio::error::operation_aborted)
+		return;
 	if (!ec)
 	{
 		m_connected.store(true, std::memory_order_relaxed);
-
-		cnote << "Connected to stratum server " + i->host_name() + ":" + p_active->port;
-
-		if (!p_farm->isMining())
-		{
-			cnote << "Starting farm";
-			if (m_minerType == MinerType::CL)
-				p_farm->start("opencl", false);
-			else if (m_minerType == MinerType::CUDA)
-				p_farm->start("cuda", false);
-			else if (m_minerType == MinerType::Fpga)
-				p_farm->start("fpga", false);
-			else if (m_minerType == MinerType::Mixed) {
-				p_farm->start("cuda", false);
-				p_farm->start("opencl", true);
-				p_farm->start("fpga", false);
-			}
-		}
+		if (!m_standby)
+			startFarm();
+		m_recorder.open(m_protocol, p_active->host, p_active->port);
 		std::ostream os(&m_requestBuffer);
 
 		string user;
@@ -244,26 +379,42 @@ void EthStratumClient::connect_handler(const boost::system::error_code& ec, tcp:
 			case STRATUM_PROTOCOL_ETHEREUMSTRATUM:
 				os << "{\"id\": 1, \"method\": \"mining.subscribe\", \"params\": [\"ethminer/" << ETH_PROJECT_VERSION << "\",\"EthereumStratum/1.0.0\"]}\n";
 				break;
+			case STRATUM_PROTOCOL_ETHEREUMSTRATUM2:
+				os << "{\"id\":1,\"method\":\"mining.hello\",\"params\":{\"agent\":\"ethminer/" << ETH_PROJECT_VERSION << "\",\"host\":\"" << p_active->host
+					<< "\",\"port\":\"" << std::hex << atoi(p_active->port.c_str()) << std::dec << "\",\"proto\":\"EthereumStratum/2.0.0\"}}\n";
+				break;
 		}
 		
-		async_write(m_socket, m_requestBuffer,
-			boost::bind(&EthStratumClient::handleResponse, this,
-									boost::asio::placeholders::error));
+		writeRequest();
 	}
 	else
 	{
-		cwarn << "Could not connect to stratum server " + p_active->host + ":" + p_active->port + ", " + ec.message();
-		reconnect();
+		cwarn << "Could not secure the connection to stratum server " + p_active->host + ":" + p_active->port + ", " + ec.message();
+		doReconnect();
 	}
 
 }
 
+void EthStratumClient::writeRequest()
+{
+	bool write;
+	{
+		std::lock_guard<std::mutex> l(x_submits);
+		m_submitQueue.append(boost::asio::buffers_begin(m_requestBuffer.data()), boost::asio::buffers_end(m_requestBuffer.data()));
+		m_requestBuffer.consume(m_requestBuffer.size());
+		write = !m_submitWriting;
+		m_submitWriting = true;
+	}
+	if (write)
+		writeSubmits();
+}
+
 void EthStratumClient::readline() {
 	x_pending.lock();
 	if (m_pending == 0) {
 		async_read_until(m_socket, m_responseBuffer, "\n",
-			boost::bind(&EthStratumClient::readResponse, this,
-			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+			m_strand.wrap(boost::bind(&EthStratumClient::readResponse, this,
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	
 		m_pending++;
 		
@@ -292,35 +443,43 @@ void EthStratumClient::readResponse(const boost::system::error_code& ec, std::si
 
 	if (!ec && bytes_transferred)
 	{
-		std::istream is(&m_responseBuffer);
-		std::string response;
-		getline(is, response);
+		m_responseTime = std::chrono::steady_clock::now();
+		// The line is parsed where asio read it, up to but excluding the '\n'.
+		char const* response = boost::asio::buffer_cast<char const*>(m_responseBuffer.data());
+		char const* end = response + bytes_transferred - 1;
+		m_recorder.received(response, bytes_transferred);
 
-		if (!response.empty() && response.front() == '{' && response.back() == '}') 
+		if (end != response && *response == '{' && end[-1] == '}')
 		{
-			Json::Value responseObject;
-			Json::Reader reader;
-			if (reader.parse(response.c_str(), responseObject))
+			TraceScope trace("stratum response", "bytes", bytes_transferred);
+			StratumMessage message;
+			if (!message.parse(response, end) || !processMessage(message))
 			{
-				processReponse(responseObject);
-			}
-			else 
-			{
-				cwarn << "Parse response failed: " + reader.getFormattedErrorMessages();
+				Json::Value responseObject;
+				Json::Reader reader;
+				if (reader.parse(response, end, responseObject))
+				{
+					processReponse(responseObject);
+				}
+				else
+				{
+					cwarn << "Parse response failed: " + reader.getFormattedErrorMessages();
+				}
 			}
 		}
 		else if (m_protocol != STRATUM_PROTOCOL_ETHPROXY)
 		{
 			cwarn << "Discarding incomplete response";
 		}
+		m_responseBuffer.consume(bytes_transferred);
 		if (m_connected.load(std::memory_order_relaxed))
 			readline();
 	}
-	else
+	else if (m_running)
 	{
 		cwarn << "Read response failed: " + ec.message();
 		if (m_connected.load(std::memory_order_relaxed))
-			reconnect();
+			doReconnect();
 	}
 }
 
@@ -341,9 +500,16 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 	{
 		cnote << error.get(1, "Unknown error").asString();
 	}
+	if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2 && processStratum2(responseObject))
+		return;
 	std::ostream os(&m_requestBuffer);
 	Json::Value params;
 	int id = responseObject.get("id", Json::Value::null).asInt();
+	if (id >= (int)PendingShares::c_firstId)
+	{
+		shareReplied(id, responseObject.get("result", false).asBool());
+		return;
+	}
 	switch (id)
 	{
 		case 1:
@@ -369,9 +535,7 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 			m_authorized = true;
 			os << "{\"id\": 5, \"method\": \"eth_getWork\", \"params\": []}\n"; // not strictly required but it does speed up initialization
 		}
-		async_write(m_socket, m_requestBuffer,
-			boost::bind(&EthStratumClient::handleResponse, this,
-			boost::asio::placeholders::error));
+		writeRequest();
 		break;
 	case 2:
 		// nothing to do...
@@ -386,16 +550,6 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 		}
 		cnote << "Authorized worker " + p_active->user;
 		break;
-	case 4:
-		if (responseObject.get("result", false).asBool()) {
-			cnote << EthLime "**Accepted." EthReset;
-			p_farm->acceptedSolution(m_stale);
-		}
-		else {
-			cwarn << EthRed "**Rejected." EthReset;
-			p_farm->rejectedSolution(m_stale);
-		}
-		break;
 	default:
 		string method, workattr;
 		unsigned index;
@@ -426,23 +580,9 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 
 					if (sHeaderHash != "" && sSeedHash != "")
 					{
-						m_worktimer.cancel();
-                        m_worktimer.expires_from_now(boost::posix_time::seconds(m_worktimeout));
-                        m_worktimer.async_wait(boost::bind(&EthStratumClient::work_timeout_handler, this, boost::asio::placeholders::error));
-
-						m_current.header = h256(sHeaderHash);
-						m_current.seed = h256(sSeedHash);
-						m_current.boundary = h256();
-						diffToTarget((uint32_t*)m_current.boundary.data(), m_nextWorkDifficulty);
-						m_current.startNonce = ethash_swap_u64(*((uint64_t*)m_extraNonce.data()));
-						m_current.exSizeBits = m_extraNonceHexSize * 4;
-						m_current.job_len = job.size();
-						if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM)
-							job.resize(64, '0');
-						m_current.job = h256(job);
-
-						p_farm->setWork(m_current);
-						cnote << "Received new job #" EthWhite + job.substr(0, m_current.job_len) + EthReset;
+						string jobHash = job;
+						jobHash.resize(64, '0');
+						workReceived(h256(sHeaderHash), h256(sSeedHash), h256(), h256(jobHash), job.data(), job.size(), params.get((Json::Value::ArrayIndex)3, false) == true);
 					}
 				}
 				else
@@ -450,6 +590,7 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 					string sHeaderHash = params.get((Json::Value::ArrayIndex)index++, "").asString();
 					string sSeedHash = params.get((Json::Value::ArrayIndex)index++, "").asString();
 					string sShareTarget = params.get((Json::Value::ArrayIndex)index++, "").asString();
+					bool const clean = m_protocol == STRATUM_PROTOCOL_STRATUM && params.get((Json::Value::ArrayIndex)index, false) == true;
 
 					// coinmine.pl fix
 					int l = sShareTarget.length();
@@ -458,24 +599,7 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 
 
 					if (sHeaderHash != "" && sSeedHash != "" && sShareTarget != "")
-					{
-						h256 headerHash = h256(sHeaderHash);
-
-						if (headerHash != m_current.header)
-						{
-							m_worktimer.cancel();
-                            m_worktimer.expires_from_now(boost::posix_time::seconds(m_worktimeout));
-                            m_worktimer.async_wait(boost::bind(&EthStratumClient::work_timeout_handler, this, boost::asio::placeholders::error));
-
-							m_current.header = h256(sHeaderHash);
-							m_current.seed = h256(sSeedHash);
-							m_current.boundary = h256(sShareTarget);
-							m_current.job = h256(job);
-
-							p_farm->setWork(m_current);
-							cnote << "Received new job #" EthWhite + job.substr(0, m_current.job_len) + EthReset;
-						}
-					}
+						workReceived(h256(sHeaderHash), h256(sSeedHash), h256(sShareTarget), h256(job), job.data(), job.size(), clean);
 				}
 			}
 		}
@@ -501,71 +625,458 @@ void EthStratumClient::processReponse(Json::Value& responseObject)
 		else if (method == "client.get_version")
 		{
 			os << "{\"error\": null, \"id\" : " << id << ", \"result\" : \"" << ETH_PROJECT_VERSION << "\"}\n";
-			async_write(m_socket, m_requestBuffer,
-				boost::bind(&EthStratumClient::handleResponse, this,
-				boost::asio::placeholders::error));
+			writeRequest();
 		}
 		break;
 	}
 
 }
 
+bool EthStratumClient::processStratum2(Json::Value const& _v)
+{
+	std::ostream os(&m_requestBuffer);
+	Json::Value const& result = _v["result"];
+	string const method = _v.get("method", "").asString();
+	if (method.empty())
+	{
+		switch (_v.get("id", Json::Value::null).asInt())
+		{
+		case 1:
+		{
+			if (!result.isObject() || result.get("proto", "").asString() != "EthereumStratum/2.0.0")
+			{
+				cwarn << "Stratum server does not speak EthereumStratum/2.0.0";
+				disconnect();
+				return true;
+			}
+			Json::Value const resume = result.get("resume", false);
+			m_canResume = resume == "1" || resume == true || resume == 1;
+			subscribeStratum2();
+			return true;
+		}
+		case 2:
+			if (!_v["error"].isNull() || !result.isString())
+			{
+				if (m_resuming)
+				{
+					cnote << "Could not resume session " + m_session + ", starting a new one";
+					m_session.clear();
+					subscribeStratum2();
+				}
+				else
+				{
+					cwarn << "Could not subscribe to stratum server";
+					doReconnect();
+				}
+				return true;
+			}
+			if (m_resuming && result.asString() == m_session)
+				cnote << "Resumed session " + m_session;
+			else
+				cnote << "Subscribed to stratum server, session " + result.asString();
+			m_session = result.asString();
+			m_sessionPool = p_active->host + ":" + p_active->port;
+			os << "{\"id\":3,\"method\":\"mining.authorize\",\"params\":[\"" << p_active->user << "\",\"" << p_active->pass << "\"]}\n";
+			break;
+		case 3:
+			// The result is the worker id to submit with.
+			m_authorized = _v["error"].isNull() && (result.isString() || result == true);
+			if (!m_authorized)
+			{
+				cnote << "Worker not authorized:" + p_active->user;
+				disconnect();
+				return true;
+			}
+			m_worker = result.isString() ? result.asString() : p_active->user;
+			cnote << "Authorized worker " + p_active->user;
+			return true;
+		default:
+			return false;
+		}
+	}
+	else if (method == "mining.set")
+	{
+		Json::Value const& params = _v["params"];
+		if (!params.isObject())
+			return true;
+		try
+		{
+			if (params.isMember("epoch"))
+			{
+				unsigned const epoch = stoul(params["epoch"].asString(), nullptr, 16);
+				m_epochSeed = EthashAux::seedHash(epoch * ETHASH_EPOCH_LENGTH);
+				// A hint to have the next epoch's light cache ready before its first job.
+				if (m_epochSeed != p_farm->work().seed)
+					EthashAux::prepare(m_epochSeed);
+				cnote << "Epoch set to" << epoch;
+			}
+			if (params.isMember("target"))
+			{
+				string target = params["target"].asString();
+				if (!target.compare(0, 2, "0x"))
+					target = target.substr(2);
+				m_nextWorkTarget = h256(fromHex(target), h256::AlignRight);
+				cnote << "Target set to " + m_nextWorkTarget.hex();
+			}
+			if (params.isMember("extranonce"))
+			{
+				string extraNonce = params["extranonce"].asString();
+				processExtranonce(extraNonce);
+			}
+			if (params.get("algo", "ethash").asString() != "ethash")
+			{
+				cwarn << "Stratum server wants algorithm " + params["algo"].asString();
+			}
+		}
+		catch (std::exception const& _e)
+		{
+			cwarn << "Bad mining.set: " << _e.what();
+		}
+		return true;
+	}
+	else if (method == "mining.notify")
+	{
+		Json::Value const& params = _v["params"];
+		if (params.isArray() && params.size() >= 3)
+		{
+			string const job = params[0].asString();
+			string header = params[2].asString();
+			if (!header.compare(0, 2, "0x"))
+				header = header.substr(2);
+			string jobHash = job;
+			jobHash.resize(64, '0');
+			workReceived(h256(string(64 - min<size_t>(header.size(), 64), '0') + header), m_epochSeed, h256(), h256(jobHash), job.data(), job.size(), params.get(3, false) == true);
+		}
+		return true;
+	}
+	else if (method == "mining.ping")
+	{
+		if (!_v["id"].isIntegral())
+			return true;
+		os << "{\"id\":" << _v["id"].asLargestInt() << ",\"result\":\"pong\"}\n";
+	}
+	else if (method == "mining.bye")
+	{
+		cnote << "Stratum server is closing the connection";
+		return true;
+	}
+	else
+		return false;
+
+	writeRequest();
+	return true;
+}
+
+void EthStratumClient::subscribeStratum2()
+{
+	m_resuming = m_canResume && !m_session.empty() && m_sessionPool == p_active->host + ":" + p_active->port;
+	std::ostream os(&m_requestBuffer);
+	os << "{\"id\":2,\"method\":\"mining.subscribe\",\"params\":[" << (m_resuming ? "\"" + m_session + "\"" : string()) << "]}\n";
+	writeRequest();
+}
+
+bool EthStratumClient::processMessage(StratumMessage const& _m)
+{
+	// Errors, handshake replies and the rarer methods are left to jsoncpp.
+	if (_m.error.kind == StratumToken::Array)
+		return false;
+	double id = 0;
+	if (_m.id.kind == StratumToken::Number ? !toNumber(_m.id, id) || id != (int)id : _m.id.kind != StratumToken::Null && _m.id.kind != StratumToken::None)
+		return false;
+	if (id >= PendingShares::c_firstId)
+	{
+		if (_m.result.kind != StratumToken::True && _m.result.kind != StratumToken::False)
+			return false;
+		shareReplied((unsigned)id, _m.result.kind == StratumToken::True);
+		return true;
+	}
+	if (id >= 1 && id <= 3)
+		return false;
+
+	if (m_protocol == STRATUM_PROTOCOL_ETHPROXY)
+	{
+		// Work comes as the result of eth_getWork: header, seed, target.
+		h256 header, seed, target;
+		if (_m.result.kind != StratumToken::Array || _m.resultCount < 3 || !toHash(_m.resultItems[0], header)
+			|| !toHash(_m.resultItems[1], seed) || !shareTarget(_m.resultItems[2], target))
+			return false;
+		// eth-proxy has no clean flag; the node takes shares of the last few headers.
+		workReceived(header, seed, target, header, _m.resultItems[0].begin, _m.resultItems[0].size(), false);
+		return true;
+	}
+	if (_m.params.kind != StratumToken::Array)
+		return false;
+	StratumToken const* p = _m.paramItems;
+	if (_m.method.is("mining.notify"))
+	{
+		h256 header, seed, target, job;
+		bool clean;
+		if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM)
+		{
+			if (_m.paramCount < 3 || !toHash(p[0], job, HexPad::Right) || !toHash(p[1], seed) || !toHash(p[2], header))
+				return false;
+			clean = _m.paramCount > 3 && p[3].kind == StratumToken::True;
+		}
+		else if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2)
+		{
+			// Job id, block number and header; the seed and target come with mining.set.
+			if (_m.paramCount < 3 || !toHash(p[0], job, HexPad::Right) || !toHash(p[2], header, HexPad::Left))
+				return false;
+			seed = m_epochSeed;
+			clean = _m.paramCount > 3 && p[3].kind == StratumToken::True;
+		}
+		else if (_m.paramCount < 4 || !toHash(p[0], job) || !toHash(p[1], header) || !toHash(p[2], seed) || !shareTarget(p[3], target))
+			return false;
+		else
+			clean = _m.paramCount > 4 && p[4].kind == StratumToken::True;
+		workReceived(header, seed, target, job, p[0].begin, p[0].size(), clean);
+		return true;
+	}
+	if (_m.method.is("mining.set_difficulty") && m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM)
+	{
+		if (!_m.paramCount || !toNumber(p[0], m_nextWorkDifficulty))
+			return false;
+		if (m_nextWorkDifficulty <= 0.0001) m_nextWorkDifficulty = 0.0001;
+		cnote << "Difficulty set to "  << m_nextWorkDifficulty;
+		return true;
+	}
+	return false;
+}
+
+bool EthStratumClient::shareTarget(StratumToken const& _t, h256& _target)
+{
+	// coinmine.pl fix: targets may come without their leading zeros.
+	return _t.size() >= 2 && _t.begin[0] == '0' && _t.begin[1] == 'x' && toHash(_t, _target, HexPad::Left);
+}
+
+void EthStratumClient::workReceived(h256 const& _header, h256 const& _seed, h256 const& _target, h256 const& _job, char const* _jobId, size_t _jobIdSize, bool _clean)
+{
+	bool const jobs = m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM || m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2;
+	if (!jobs && _header == m_current.header)
+		return;
+
+	m_worktimer.cancel();
+	m_worktimer.expires_from_now(boost::posix_time::seconds(m_worktimeout));
+	m_worktimer.async_wait(m_strand.wrap(boost::bind(&EthStratumClient::work_timeout_handler, this, boost::asio::placeholders::error)));
+
+	m_current.header = _header;
+	m_current.seed = _seed;
+	m_current.job = _job;
+	if (jobs)
+	{
+		if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2)
+			m_current.boundary = m_nextWorkTarget;
+		else
+		{
+			m_current.boundary = h256();
+			diffToTarget((uint32_t*)m_current.boundary.data(), m_nextWorkDifficulty);
+		}
+		m_current.startNonce = ethash_swap_u64(*((uint64_t*)m_extraNonce.data()));
+		m_current.exSizeBits = m_extraNonceHexSize * 4 + (p_proxy ? StratumProxy::reservedBits(m_extraNonceHexSize) : 0);
+		m_current.job_len = _jobIdSize;
+	}
+	else
+		m_current.boundary = _target;
+
+	{
+		std::lock_guard<std::mutex> l(x_submits);
+		m_nextTemplate ^= 1;
+		m_submitTemplates[m_nextTemplate].render(m_protocol, p_active->user, m_worker, m_current, m_current.job_len, m_extraNonceHexSize);
+		m_recentJobs.add(m_current.header, m_current.job, _clean, m_responseTime);
+	}
+	if (m_hotStandby && p_serving.load() == m_hotStandby.get())
+	{
+		cnote << "Back on stratum server " + p_active->host + ":" + p_active->port;
+		m_hotStandby->deactivate();
+		p_serving.store(this);
+		m_standby.store(false);
+	}
+	if (m_standby)
+	{
+		// Have the light cache ready in case the farm is switched over here.
+		if (m_isStandby && _seed != m_preparedSeed && _seed != p_farm->work().seed)
+		{
+			m_preparedSeed = _seed;
+			EthashAux::prepare(_seed);
+		}
+		return;
+	}
+	p_farm->setWork(m_current, m_responseTime);
+	if (p_proxy)
+		p_proxy->notify(m_current, m_extraNonceHexSize, m_nextWorkDifficulty);
+	cnote << "Received new job #" EthWhite + string(_jobId, min<size_t>(_jobIdSize, m_current.job_len)) + EthReset;
+	if (m_prober && p_active == &m_primary && !m_fee_mode)
+	{
+		// Between jobs is when a reconnect costs the fewest shares.
+		size_t const better = m_prober->better(m_proberIndex);
+		if (better != m_proberIndex)
+			m_strand.post(boost::bind(&EthStratumClient::moveTo, this, better));
+	}
+}
+
+void EthStratumClient::shareReplied(unsigned _id, bool _accepted)
+{
+	PendingShares::Share share;
+	{
+		std::lock_guard<std::mutex> l(x_submits);
+		if (!m_pendingShares.take(_id, share))
+		{
+			cwarn << "Reply to unknown share" << _id;
+			return;
+		}
+	}
+	traceInstant("share reply", "accepted", _accepted);
+	if (share.replied)
+	{
+		cnote << (_accepted ? "Proxied share accepted" : "Proxied share rejected");
+		// Dropped once the proxy has gone.
+		if (p_proxy)
+			share.replied(_accepted);
+		return;
+	}
+	uint64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(m_responseTime - share.sent).count();
+	if (_accepted) {
+		cnote << EthLime "**Accepted" EthReset << "in" << us / 1000 << "ms";
+		p_farm->acceptedSolution(share.stale, share.miner);
+	}
+	else {
+		cwarn << EthRed "**Rejected" EthReset << "in" << us / 1000 << "ms";
+		p_farm->rejectedSolution(share.stale, share.miner);
+	}
+	p_farm->shareReplied(p_active->host + ":" + p_active->port, share.miner, _accepted, share.stale, us);
+}
+
 void EthStratumClient::work_timeout_handler(const boost::system::error_code& ec) {
 	if (!ec) {
 		cnote << "No new work received in " << m_worktimeout << " seconds.";
-		reconnect();
+		doReconnect();
 	}
 }
 
 bool EthStratumClient::submitHashrate(string const & rate) {
+	EthStratumClient* s = p_serving.load();
+	if (s != this)
+		return s->submitHashrate(rate);
+	auto const now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> l(x_submits);
+	if (!m_connected.load(std::memory_order_relaxed) || now - m_hashrateAt < std::chrono::seconds(c_hashrateSeconds))
+		return false;
+	m_hashrateAt = now;
 	// There is no stratum method to submit the hashrate so we use the rpc variant.
-	string json = "{\"id\": 6, \"jsonrpc\":\"2.0\", \"method\": \"eth_submitHashrate\", \"params\": [\"" + rate + "\",\"0x" + this->m_submit_hashrate_id + "\"]}\n";
-	std::ostream os(&m_requestBuffer);
-	os << json;
-	write(m_socket, m_requestBuffer);
+	// A report still waiting is replaced, not sent as well.
+	if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2)
+		m_hashrateQueued = "{\"id\":6,\"method\":\"mining.hashrate\",\"params\":[\"" + (rate.compare(0, 2, "0x") ? rate : rate.substr(2)) + "\",\"" + m_worker + "\"]}\n";
+	else
+		m_hashrateQueued = "{\"id\": 6, \"jsonrpc\":\"2.0\", \"method\": \"eth_submitHashrate\", \"params\": [\"" + rate + "\",\"0x" + this->m_submit_hashrate_id + "\"]}\n";
+	if (!m_submitWriting)
+	{
+		m_submitWriting = true;
+		m_strand.post(boost::bind(&EthStratumClient::writeSubmits, this));
+	}
 	return true;
 }
 
-void EthStratumClient::submit(Solution solution) {
+void EthStratumClient::submit(Solution solution, std::function<void(bool)> const& _replied) {
+	EthStratumClient* s = p_serving.load();
+	if (s != this)
+	{
+		s->submit(solution, _replied);
+		return;
+	}
+	TraceScope trace("stratum submit");
+	if (_replied || !m_shares.push(ShareRecord{solution, std::chrono::steady_clock::now()}))
+	{
+		// The proxy's shares, whose callback cannot be queued, or a burst
+		// beyond c_shareQueue.
+		m_strand.post([this, solution, _replied]() { sendShare(solution, _replied); });
+		return;
+	}
+	if (!m_sharesPosted.exchange(true, std::memory_order_acq_rel))
+		m_strand.post(m_sharesWake, [this]() { takeShares(); });
+}
 
-	string nonceHex = toHex(solution.nonce);
-	string json;
+void EthStratumClient::takeShares()
+{
+	// Cleared first, so a share queued from now on posts again.
+	m_sharesPosted.exchange(false, std::memory_order_acq_rel);
+	ShareRecord r;
+	while (m_shares.pop(r))
+	{
+		traceInstant("stratum share queued", "us", std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - r.queued).count());
+		sendShare(r.solution, nullptr);
+	}
+}
 
-	switch (m_protocol) {
-		case STRATUM_PROTOCOL_STRATUM:
-			json = "{\"id\": 4, \"method\": \"mining.submit\", \"params\": [\"" +
-				p_active->user + "\",\"" + solution.work.job.hex() + "\",\"0x" +
-				nonceHex + "\",\"0x" + solution.work.header.hex() + "\",\"0x" +
-				solution.mixHash.hex() + "\"]}\n";
-			break;
-		case STRATUM_PROTOCOL_ETHPROXY:
-			json = "{\"id\": 4, \"worker\":\"" +
-				m_worker + "\", \"method\": \"eth_submitWork\", \"params\": [\"0x" +
-				nonceHex + "\",\"0x" + solution.work.header.hex() + "\",\"0x" +
-				solution.mixHash.hex() + "\"]}\n";
-			break;
-		case STRATUM_PROTOCOL_ETHEREUMSTRATUM:
-			json = "{\"id\": 4, \"method\": \"mining.submit\", \"params\": [\"" +
-				p_active->user + "\",\"" + solution.work.job.hex().substr(0, solution.work.job_len) + "\",\"" +
-				nonceHex.substr(m_extraNonceHexSize, 16 - m_extraNonceHexSize) + "\"]}\n";
-			break;
+void EthStratumClient::sendShare(Solution solution, std::function<void(bool)> const& _replied)
+{
+	uint64_t ageMs;
+	bool write = false;
+	{
+		std::lock_guard<std::mutex> l(x_submits);
+		RecentJobs::Verdict const verdict = m_recentJobs.check(solution.work, std::chrono::steady_clock::now(), ageMs);
+		if (verdict == RecentJobs::Obsolete)
+		{
+			// The pool voided the job already; sending the share would only get it rejected.
+			cwarn << EthYellow "Dropped solution of an obsolete job" EthReset << (ageMs ? "from " + toString(ageMs) + "ms ago" : string());
+			if (_replied)
+				_replied(false);
+			else
+				p_farm->droppedSolution();
+			return;
+		}
+		solution.stale = solution.stale || verdict == RecentJobs::Stale;
+		SubmitTemplate const* t = nullptr;
+		for (SubmitTemplate const& i: m_submitTemplates)
+			if (i.matches(solution.work))
+				t = &i;
+		SubmitTemplate rendered;
+		if (!t)
+		{
+			rendered.render(m_protocol, p_active->user, m_worker, solution.work, solution.work.job_len, m_extraNonceHexSize);
+			t = &rendered;
+		}
+		t->append(m_submitQueue, m_pendingShares.add(solution, _replied), solution.nonce, solution.mixHash);
+		// Shares found while a write is in flight go out together after it.
+		write = !m_submitWriting;
+		m_submitWriting = true;
 	}
-	std::ostream os(&m_requestBuffer);
-	os << json;
-	m_stale = solution.stale;
-	async_write(m_socket, m_requestBuffer,
-		boost::bind(&EthStratumClient::handleResponse, this,
-		boost::asio::placeholders::error));
-	if (m_stale)
+	// On the strand already: the share goes out before it is logged.
+	if (write)
+		writeSubmits();
+	if (solution.stale)
 	{
-		cwarn << EthYellow "Stale solution submitted to " + p_active->host + EthReset;
+		cwarn << EthYellow "Stale solution submitted to " + p_active->host + EthReset << "for a job from" << ageMs << "ms ago";
 	}
 	else
 	{
-		cnote << "Solution submitted to " + p_active->host;
+		cnote << "Solution submitted to " + p_active->host << "for a job from" << ageMs << "ms ago";
 	}
-	if (m_protocol != STRATUM_PROTOCOL_ETHEREUMSTRATUM) {
-		cnote << "Nonce: 0x" + nonceHex;
+	if (m_protocol != STRATUM_PROTOCOL_ETHEREUMSTRATUM && m_protocol != STRATUM_PROTOCOL_ETHEREUMSTRATUM2) {
+		cnote << "Nonce: 0x" + toHex(solution.nonce);
 	}
 }
 
+void EthStratumClient::writeSubmits()
+{
+	std::lock_guard<std::mutex> l(x_submits);
+	m_submitSending.clear();
+	if (m_submitQueue.empty() && m_hashrateQueued.empty())
+	{
+		m_submitWriting = false;
+		return;
+	}
+	m_submitSending.swap(m_submitQueue);
+	m_submitSending += m_hashrateQueued;
+	m_hashrateQueued.clear();
+	traceInstant("stratum write", "bytes", m_submitSending.size());
+	m_recorder.sent(m_submitSending);
+	async_write(m_socket, boost::asio::buffer(m_submitSending),
+		m_strand.wrap(boost::bind(&EthStratumClient::submitsWritten, this,
+		boost::asio::placeholders::error)));
+}
+
+void EthStratumClient::submitsWritten(const boost::system::error_code& ec)
+{
+	handleResponse(ec);
+	writeSubmits();
+}
@@ -5,47 +5,119 @@
 #include <json/json.h>
 #include <libdevcore/Log.h>
 #include <libdevcore/FixedHash.h>
+#include <libdevcore/MpscQueue.h>
+#include <libdevcore/Reactor.h>
 #include <libethcore/Farm.h>
 #include <libethcore/EthashAux.h>
 #include <libethcore/Miner.h>
 #include "BuildInfo.h"
+#include "PoolConnector.h"
+#include "PoolProber.h"
+#include "PoolStream.h"
+#include "SessionRecorder.h"
+#include "StratumParser.h"
+#include "SubmitTemplate.h"
 
 
 using namespace std;
 using namespace dev;
 using namespace dev::eth;
 
+class StratumProxy;
 
 class EthStratumClient
 {
 public:
-	EthStratumClient(Farm* f, MinerType m, string const & host, string const & port, string const & user, string const & pass, int const & retries, int const & worktimeout, int const & protocol, string const & email);
+	/// A _standby client connects and follows its pool's jobs, but leaves the
+	/// farm alone until activate()d, see setHotStandby().
+	EthStratumClient(Farm* f, MinerType m, string const & host, string const & port, string const & user, string const & pass, int const & retries, int const & worktimeout, int const & protocol, string const & email, bool _standby = false);
 	~EthStratumClient();
 
+	/// Keeps the failover pool connected, subscribed and authorized next to the
+	/// primary one, so a failing pool is left at once for the failover's
+	/// latest job. The primary is taken back once it has work again.
+	static void setHotStandby(bool _hotStandby) { s_hotStandby = _hotStandby; }
+
 	void setFailover(string const & host, string const & port);
 	void setFailover(string const & host, string const & port, string const & user, string const & pass);
+	/// Also keeps the fee pool connected and authorized on standby, so
+	/// switchPool() only hands the farm its latest job.
 	void setFee(string const & host, string const & port, string const & user, string const & pass);
+	/// Probes _candidates, other endpoints of the primary pool, next to it and
+	/// moves the primary connection to the one answering fastest, right after
+	/// a job came in.
+	void setCandidates(vector<PoolProber::Endpoint> const& _candidates);
 	bool isFee() { return m_fee_mode; }
 	bool isRunning() { return m_running; }
-	bool isConnected() { return m_connected.load(std::memory_order_relaxed) && m_authorized; }
-	h256 currentHeaderHash() { return m_current.header; }
-	bool current() { return static_cast<bool>(m_current); }
+	bool isConnected() { EthStratumClient* s = p_serving.load(); return s != this ? s->isConnected() : m_connected.load(std::memory_order_relaxed) && m_authorized; }
+	h256 currentHeaderHash() { EthStratumClient* s = p_serving.load(); return s != this ? s->currentHeaderHash() : m_current.header; }
+	bool current() { EthStratumClient* s = p_serving.load(); return s != this ? s->current() : static_cast<bool>(m_current); }
+	/// Queues the hashrate report behind any shares, without waiting for the
+	/// socket; reports more frequent than c_hashrateSeconds are left out.
+	/// False if this one is.
 	bool submitHashrate(string const & rate);
-	void submit(Solution solution);
+	static const unsigned c_hashrateSeconds = 10;
+	/// _replied, if given, gets the pool's verdict rather than the farm.
+	/// Without it the share goes to the connection's strand through a
+	/// preallocated queue, so the miner thread neither locks nor allocates.
+	void submit(Solution solution, std::function<void(bool)> const& _replied = nullptr);
+	/// Shares waiting for the strand at most; more take the allocating way.
+	static const size_t c_shareQueue = 256;
+	/// Has _proxy fed the jobs of whichever client serves, and the farm leave
+	/// the rigs' extranonce byte alone. Call on the Reactor thread.
+	void setProxy(StratumProxy* _proxy);
 	void reconnect();
 	void switchPool();
 private:
 	void connect();
+	/// reconnect() on the service thread.
+	void doReconnect();
+	void reconnect_handler(const boost::system::error_code& ec);
+	/// Reconnects the primary to candidate endpoint _i, see setCandidates().
+	void moveTo(size_t _i);
+	/// switchPool() on the service thread.
+	void doSwitchPool();
+	/// Has a standby client feed the farm from now on, or stop doing so.
+	void activate();
+	void deactivate() { m_standby.store(true); }
+	void startFarm();
+	/// Connected, authorized and with a job to hand over.
+	bool ready() { return m_running && m_connected.load(std::memory_order_relaxed) && m_authorized && static_cast<bool>(m_current); }
 	
 	void disconnect();
-	void resolve_handler(const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::iterator i);
-	void connect_handler(const boost::system::error_code& ec, boost::asio::ip::tcp::resolver::iterator i);
+	/// Cancels the timers and closes the socket, failing what is pending.
+	void close();
+	void connect_handler(const boost::system::error_code& ec, boost::asio::ip::tcp::endpoint const& endpoint);
+	void handshake_handler(const boost::system::error_code& ec);
 	void work_timeout_handler(const boost::system::error_code& ec);
 
+	/// Queues m_requestBuffer for writeSubmits(), the one writer of the socket.
+	void writeRequest();
 	void readline();
 	void handleResponse(const boost::system::error_code& ec);
 	void readResponse(const boost::system::error_code& ec, std::size_t bytes_transferred);
 	void processReponse(Json::Value& responseObject);
+	/// The hot path for notify, set_difficulty and submit replies, parsed in
+	/// place. False if _m is for processReponse() after all.
+	bool processMessage(StratumMessage const& _m);
+	static bool shareTarget(StratumToken const& _t, h256& _target);
+	/// The EthereumStratum/2.0 handshake replies and notifications. False if
+	/// _v is none of them.
+	bool processStratum2(Json::Value const& _v);
+	/// Resumes the last session if it was with this pool and the pool allows.
+	void subscribeStratum2();
+	/// _clean if the pool voids its older jobs with this one.
+	void workReceived(h256 const& _header, h256 const& _seed, h256 const& _target, h256 const& _job, char const* _jobId, size_t _jobIdSize, bool _clean);
+	/// Accounts the reply to share _id, see PendingShares.
+	void shareReplied(unsigned _id, bool _accepted);
+	/// Takes the shares submit() queued, on the strand.
+	void takeShares();
+	/// Checks the share against the recent jobs and queues its line.
+	void sendShare(Solution _s, std::function<void(bool)> const& _replied);
+	/// Writes the queued lines, if any, in one go, recording them with the
+	/// session.
+	void writeSubmits();
+	void submitsWritten(const boost::system::error_code& ec);
 	
 	MinerType m_minerType;
 
@@ -55,11 +127,30 @@ private:
 	cred_t m_fee;
 	bool m_fee_mode = false;
 
-	string m_worker; // eth-proxy only;
+	string m_worker; // eth-proxy, or the worker id EthereumStratum/2.0 authorization gave;
 
 	bool m_authorized;
 	std::atomic<bool> m_connected = {false};
 	bool m_running = true;
+	/// Jobs are only followed, not given to the farm: a standby client, or
+	/// the primary while its hot standby serves.
+	std::atomic<bool> m_standby = {false};
+	bool const m_isStandby;
+	/// The failover client, with setHotStandby().
+	std::unique_ptr<EthStratumClient> m_hotStandby;
+	/// The fee pool client, kept warm for switchPool().
+	std::unique_ptr<EthStratumClient> m_feeClient;
+	/// The client feeding the farm and taking its shares: this one, m_hotStandby or m_feeClient.
+	std::atomic<EthStratumClient*> p_serving;
+	/// Who served before m_feeClient took over, to hand back to.
+	EthStratumClient* p_beforeFee = nullptr;
+	/// The seed of the last epoch prepared ahead while on standby.
+	h256 m_preparedSeed;
+	StratumProxy* p_proxy = nullptr;
+	/// Of the primary endpoint and its candidates, with setCandidates().
+	std::unique_ptr<PoolProber> m_prober;
+	size_t m_proberIndex = 0;  ///< Of the primary endpoint in use.
+	static bool s_hotStandby;
 
 	int	m_retries = 0;
 	int	m_maxRetries;
@@ -70,13 +161,36 @@ private:
 
 	Farm* p_farm;
 	WorkPackage m_current;
-
-	bool m_stale = false;
-
-	std::thread m_serviceThread;  ///< The IO service thread.
-	boost::asio::io_service m_io_service;
-	boost::asio::ip::tcp::socket m_socket;
-
+	std::chrono::steady_clock::time_point m_responseTime;	///< When the line being processed was read.
+
+	/// A share from a miner thread, as queued for the strand.
+	struct ShareRecord
+	{
+		Solution solution;
+		std::chrono::steady_clock::time_point queued;
+	};
+	BoundedMpscQueue<ShareRecord> m_shares{c_shareQueue};
+	/// takeShares() is posted and has yet to start.
+	std::atomic<bool> m_sharesPosted = {false};
+	HandlerMemory m_sharesWake;  ///< For posting takeShares().
+
+	std::mutex x_submits;
+	/// Submit lines of the current and the previous job.
+	SubmitTemplate m_submitTemplates[2];
+	unsigned m_nextTemplate = 0;
+	RecentJobs m_recentJobs;
+	PendingShares m_pendingShares;
+	string m_submitQueue;    ///< Requests and shares waiting for the write in flight.
+	string m_hashrateQueued; ///< The report waiting, sent after the shares.
+	std::chrono::steady_clock::time_point m_hashrateAt;  ///< When the last report was queued.
+	string m_submitSending;  ///< Lines being written.
+	bool m_submitWriting = false;
+
+	ReactorStrand m_strand;  ///< Runs all handlers of this connection.
+	PoolConnector m_connector;
+	PoolStream m_socket;
+
+	SessionRecorder m_recorder;
 	boost::asio::streambuf m_requestBuffer;
 	boost::asio::streambuf m_responseBuffer;
 
@@ -93,5 +207,13 @@ private:
 	
 	string m_submit_hashrate_id;
 
+	// EthereumStratum/2.0
+	string m_session;      ///< The last session's id, to resume it after a reconnect.
+	string m_sessionPool;  ///< host:port of the pool it is with.
+	bool m_canResume = false;
+	bool m_resuming = false;
+	h256 m_nextWorkTarget; ///< From mining.set, like the seed.
+	h256 m_epochSeed;
+
 	void processExtranonce(std::string& enonce);
 };
@@ -1,6 +1,7 @@
 
 #include "EthStratumClientV2.h"
 #include <libdevcore/Log.h>
+#include <libdevcore/Trace.h>
 #include <libethash/endian.h>
 using boost::asio::ip::tcp;
 
@@ -26,6 +27,8 @@ static void diffToTarget(uint32_t *target, double diff)
 		((uint8_t*)target)[31 - i] = ((uint8_t*)target2)[i];
 }
 
+const unsigned EthStratumClientV2::c_hashrateSeconds;
+
 EthStratumClientV2::EthStratumClientV2(Farm* f, MinerType m, string const & host, string const & port, string const & user, string const & pass, int const & retries, int const & worktimeout, int const & protocol, string const & email)
 	: Worker("stratum"), 
 	  m_socket(m_io_service),
@@ -92,29 +95,34 @@ void EthStratumClientV2::workLoop()
 				//boost::thread t(boost::bind(&boost::asio::io_service::run, &m_io_service));
 				connect();
 			}
-			read_until(m_socket, m_responseBuffer, "\n");
-			std::istream is(&m_responseBuffer);
-			std::string response;
-			getline(is, response);
+			size_t n = read_until(m_socket, m_responseBuffer, "\n");
+			m_responseTime = std::chrono::steady_clock::now();
+			// The line is parsed where asio read it, up to but excluding the '\n'.
+			char const* response = boost::asio::buffer_cast<char const*>(m_responseBuffer.data());
+			char const* end = response + n - 1;
 
-			if (!response.empty() && response.front() == '{' && response.back() == '}')
+			if (end != response && *response == '{' && end[-1] == '}')
 			{
-				Json::Value responseObject;
-				Json::Reader reader;
-				if (reader.parse(response.c_str(), responseObject))
+				StratumMessage message;
+				if (!message.parse(response, end) || !processMessage(message))
 				{
-					processReponse(responseObject);
-					m_response = response;
-				}
-				else
-				{
-					cwarn << "Parse response failed: " << reader.getFormattedErrorMessages();
+					Json::Value responseObject;
+					Json::Reader reader;
+					if (reader.parse(response, end, responseObject))
+					{
+						processReponse(responseObject);
+					}
+					else
+					{
+						cwarn << "Parse response failed: " << reader.getFormattedErrorMessages();
+					}
 				}
 			}
 			else if (m_protocol != STRATUM_PROTOCOL_ETHPROXY)
 			{
 				cwarn << "Discarding incomplete response";
 			}
+			m_responseBuffer.consume(n);
 		}
 		catch (std::exception const& _e) {
 			cwarn << _e.what();
@@ -125,6 +133,11 @@ void EthStratumClientV2::workLoop()
 
 void EthStratumClientV2::connect()
 {
+	{
+		// Replies to shares sent on an older connection never come.
+		std::lock_guard<std::mutex> l(x_submits);
+		m_pendingShares.clear();
+	}
 	cnote << "Connecting to stratumV2 server " << p_active->host + ":" + p_active->port;
 	
 	tcp::resolver r(m_io_service);
@@ -147,6 +160,9 @@ void EthStratumClientV2::connect()
 	{
 		cnote << "Connected!";
 		m_connected = true;
+		// Shares are small and late ones go stale: no Nagle delay.
+		boost::system::error_code noDelay;
+		m_socket.set_option(tcp::no_delay(true), noDelay);
 		
 		if (!p_farm->isMining())
 		{
@@ -157,6 +173,8 @@ void EthStratumClientV2::connect()
 				p_farm->start("cuda", false);
 			else if (m_minerType == MinerType::Fpga)
 				p_farm->start("fpga", false);
+			else if (m_minerType == MinerType::CPU)
+				p_farm->start("cpu", false);
 			else if (m_minerType == MinerType::Mixed) {
 				p_farm->start("cuda", false);
 				p_farm->start("opencl", true);
@@ -194,6 +212,10 @@ void EthStratumClientV2::connect()
 			case STRATUM_PROTOCOL_ETHEREUMSTRATUM:
 				os << "{\"id\": 1, \"method\": \"mining.subscribe\", \"params\": [\"ethminer/" << ETH_PROJECT_VERSION << "\",\"EthereumStratum/1.0.0\"]}\n";
 				break;
+			case STRATUM_PROTOCOL_ETHEREUMSTRATUM2:
+				os << "{\"id\":1,\"method\":\"mining.hello\",\"params\":{\"agent\":\"ethminer/" << ETH_PROJECT_VERSION << "\",\"host\":\"" << p_active->host
+					<< "\",\"port\":\"" << std::hex << atoi(p_active->port.c_str()) << std::dec << "\",\"proto\":\"EthereumStratum/2.0.0\"}}\n";
+				break;
 		}
 
 		write(m_socket, m_requestBuffer);
@@ -277,15 +299,23 @@ void EthStratumClientV2::processExtranonce(std::string& enonce)
 
 void EthStratumClientV2::processReponse(Json::Value& responseObject)
 {
+	TraceScope trace("stratum response");
 	Json::Value error = responseObject.get("error", new Json::Value);
 	if (error.isArray())
 	{
 		string msg = error.get(1, "Unknown error").asString();
 		cnote << msg;
 	}
+	if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2 && processStratum2(responseObject))
+		return;
 	std::ostream os(&m_requestBuffer);
 	Json::Value params;
 	int id = responseObject.get("id", Json::Value::null).asInt();
+	if (id >= (int)PendingShares::c_firstId)
+	{
+		shareReplied(id, responseObject.get("result", false).asBool());
+		return;
+	}
 	switch (id)
 	{
 		case 1:
@@ -328,16 +358,6 @@ void EthStratumClientV2::processReponse(Json::Value& responseObject)
 		}
 		cnote << "Authorized worker " << p_active->user;
 		break;
-	case 4:
-		if (responseObject.get("result", false).asBool()) {
-			cnote << EthLime << "Accepted." << EthReset;
-			p_farm->acceptedSolution(m_stale);
-		}
-		else {
-			cwarn << "Rejected.";
-			p_farm->rejectedSolution(m_stale);
-		}
-		break;
 	default:
 		string method, workattr;
 		unsigned index;
@@ -368,24 +388,7 @@ void EthStratumClientV2::processReponse(Json::Value& responseObject)
 					string sHeaderHash = params.get((Json::Value::ArrayIndex)2, "").asString();
 
 					if (sHeaderHash != "" && sSeedHash != "")
-					{
-                        m_worktimer.cancel();
-                        m_worktimer.expires_from_now(boost::posix_time::seconds(m_worktimeout));
-                        m_worktimer.async_wait(boost::bind(&EthStratumClientV2::work_timeout_handler, this, boost::asio::placeholders::error));
-
-						m_current.header = h256(sHeaderHash);
-						m_current.seed = h256(sSeedHash);
-						m_current.boundary = h256();
-						diffToTarget((uint32_t*)m_current.boundary.data(), m_nextWorkDifficulty);
-						m_current.startNonce = ethash_swap_u64(*((uint64_t*)m_extraNonce.data()));
-						m_current.exSizeBits = m_extraNonceHexSize * 4;
-						m_current.job = h256(job);
-
-						p_farm->setWork(m_current);
-						cnote << "Received new job #" + job.substr(0, 8)
-							<< " seed: " << "#" + m_current.seed.hex().substr(0, 32)
-							<< " target: " << "#" + m_current.boundary.hex().substr(0, 24);
-					}
+						workReceived(h256(sHeaderHash), h256(sSeedHash), h256(), h256(job), job.data(), job.size());
 				}
 				else
 				{
@@ -400,26 +403,7 @@ void EthStratumClientV2::processReponse(Json::Value& responseObject)
 
 
 					if (sHeaderHash != "" && sSeedHash != "" && sShareTarget != "")
-					{
-                        m_worktimer.cancel();
-                        m_worktimer.expires_from_now(boost::posix_time::seconds(m_worktimeout));
-                        m_worktimer.async_wait(boost::bind(&EthStratumClientV2::work_timeout_handler, this, boost::asio::placeholders::error));
-
-						h256 headerHash = h256(sHeaderHash);
-
-						if (headerHash != m_current.header)
-						{
-							m_current.header = h256(sHeaderHash);
-							m_current.seed = h256(sSeedHash);
-							m_current.boundary = h256(sShareTarget);
-							m_current.job = h256(job);
-
-							p_farm->setWork(m_current);
-						}
-						cnote << "Received new job #" + job.substr(0, 8)
-							<< " seed: " << "#" + m_current.seed.hex().substr(0, 32)
-							<< " target: " << "#" + m_current.boundary.hex().substr(0, 24);
-					}
+						workReceived(h256(sHeaderHash), h256(sSeedHash), h256(sShareTarget), h256(job), job.data(), job.size());
 				}
 			}
 		}
@@ -452,6 +436,282 @@ void EthStratumClientV2::processReponse(Json::Value& responseObject)
 
 }
 
+bool EthStratumClientV2::processStratum2(Json::Value const& _v)
+{
+	std::ostream os(&m_requestBuffer);
+	Json::Value const& result = _v["result"];
+	string const method = _v.get("method", "").asString();
+	if (method.empty())
+	{
+		switch (_v.get("id", Json::Value::null).asInt())
+		{
+		case 1:
+		{
+			if (!result.isObject() || result.get("proto", "").asString() != "EthereumStratum/2.0.0")
+			{
+				cwarn << "Stratum server does not speak EthereumStratum/2.0.0";
+				disconnect();
+				return true;
+			}
+			Json::Value const resume = result.get("resume", false);
+			m_canResume = resume == "1" || resume == true || resume == 1;
+			subscribeStratum2();
+			return true;
+		}
+		case 2:
+			if (!_v["error"].isNull() || !result.isString())
+			{
+				if (m_resuming)
+				{
+					cnote << "Could not resume session " + m_session + ", starting a new one";
+					m_session.clear();
+					subscribeStratum2();
+				}
+				else
+				{
+					cwarn << "Could not subscribe to stratum server";
+					reconnect();
+				}
+				return true;
+			}
+			if (m_resuming && result.asString() == m_session)
+				cnote << "Resumed session " + m_session;
+			else
+				cnote << "Subscribed to stratum server, session " + result.asString();
+			m_session = result.asString();
+			m_sessionPool = p_active->host + ":" + p_active->port;
+			os << "{\"id\":3,\"method\":\"mining.authorize\",\"params\":[\"" << p_active->user << "\",\"" << p_active->pass << "\"]}\n";
+			break;
+		case 3:
+			// The result is the worker id to submit with.
+			m_authorized = _v["error"].isNull() && (result.isString() || result == true);
+			if (!m_authorized)
+			{
+				cnote << "Worker not authorized:" + p_active->user;
+				disconnect();
+				return true;
+			}
+			m_worker = result.isString() ? result.asString() : p_active->user;
+			cnote << "Authorized worker " + p_active->user;
+			return true;
+		default:
+			return false;
+		}
+	}
+	else if (method == "mining.set")
+	{
+		Json::Value const& params = _v["params"];
+		if (!params.isObject())
+			return true;
+		try
+		{
+			if (params.isMember("epoch"))
+			{
+				unsigned const epoch = stoul(params["epoch"].asString(), nullptr, 16);
+				m_epochSeed = EthashAux::seedHash(epoch * ETHASH_EPOCH_LENGTH);
+				// A hint to have the next epoch's light cache ready before its first job.
+				if (m_epochSeed != p_farm->work().seed)
+					EthashAux::prepare(m_epochSeed);
+				cnote << "Epoch set to" << epoch;
+			}
+			if (params.isMember("target"))
+			{
+				string target = params["target"].asString();
+				if (!target.compare(0, 2, "0x"))
+					target = target.substr(2);
+				m_nextWorkTarget = h256(fromHex(target), h256::AlignRight);
+				cnote << "Target set to " + m_nextWorkTarget.hex();
+			}
+			if (params.isMember("extranonce"))
+			{
+				string extraNonce = params["extranonce"].asString();
+				processExtranonce(extraNonce);
+			}
+			if (params.get("algo", "ethash").asString() != "ethash")
+			{
+				cwarn << "Stratum server wants algorithm " + params["algo"].asString();
+			}
+		}
+		catch (std::exception const& _e)
+		{
+			cwarn << "Bad mining.set: " << _e.what();
+		}
+		return true;
+	}
+	else if (method == "mining.notify")
+	{
+		Json::Value const& params = _v["params"];
+		if (params.isArray() && params.size() >= 3)
+		{
+			string const job = params[0].asString();
+			string header = params[2].asString();
+			if (!header.compare(0, 2, "0x"))
+				header = header.substr(2);
+			string jobHash = job;
+			jobHash.resize(64, '0');
+			workReceived(h256(string(64 - min<size_t>(header.size(), 64), '0') + header), m_epochSeed, h256(), h256(jobHash), job.data(), job.size());
+		}
+		return true;
+	}
+	else if (method == "mining.ping")
+	{
+		if (!_v["id"].isIntegral())
+			return true;
+		os << "{\"id\":" << _v["id"].asLargestInt() << ",\"result\":\"pong\"}\n";
+	}
+	else if (method == "mining.bye")
+	{
+		cnote << "Stratum server is closing the connection";
+		return true;
+	}
+	else
+		return false;
+
+	write(m_socket, m_requestBuffer);
+	return true;
+}
+
+void EthStratumClientV2::subscribeStratum2()
+{
+	m_resuming = m_canResume && !m_session.empty() && m_sessionPool == p_active->host + ":" + p_active->port;
+	std::ostream os(&m_requestBuffer);
+	os << "{\"id\":2,\"method\":\"mining.subscribe\",\"params\":[" << (m_resuming ? "\"" + m_session + "\"" : string()) << "]}\n";
+	write(m_socket, m_requestBuffer);
+}
+
+bool EthStratumClientV2::processMessage(StratumMessage const& _m)
+{
+	// Errors, handshake replies and the rarer methods are left to jsoncpp.
+	if (_m.error.kind == StratumToken::Array)
+		return false;
+	double id = 0;
+	if (_m.id.kind == StratumToken::Number ? !toNumber(_m.id, id) || id != (int)id : _m.id.kind != StratumToken::Null && _m.id.kind != StratumToken::None)
+		return false;
+	if (id >= PendingShares::c_firstId)
+	{
+		if (_m.result.kind != StratumToken::True && _m.result.kind != StratumToken::False)
+			return false;
+		shareReplied((unsigned)id, _m.result.kind == StratumToken::True);
+		return true;
+	}
+	if (id >= 1 && id <= 3)
+		return false;
+
+	if (m_protocol == STRATUM_PROTOCOL_ETHPROXY)
+	{
+		// Work comes as the result of eth_getWork: header, seed, target.
+		h256 header, seed, target;
+		if (_m.result.kind != StratumToken::Array || _m.resultCount < 3 || !toHash(_m.resultItems[0], header)
+			|| !toHash(_m.resultItems[1], seed) || !shareTarget(_m.resultItems[2], target))
+			return false;
+		workReceived(header, seed, target, header, _m.resultItems[0].begin, _m.resultItems[0].size());
+		return true;
+	}
+	if (_m.params.kind != StratumToken::Array)
+		return false;
+	StratumToken const* p = _m.paramItems;
+	if (_m.method.is("mining.notify"))
+	{
+		h256 header, seed, target, job;
+		if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM)
+		{
+			if (_m.paramCount < 3 || !toHash(p[0], job) || !toHash(p[1], seed) || !toHash(p[2], header))
+				return false;
+		}
+		else if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2)
+		{
+			// Job id, block number and header; the seed and target come with mining.set.
+			if (_m.paramCount < 3 || !toHash(p[0], job, HexPad::Right) || !toHash(p[2], header, HexPad::Left))
+				return false;
+			seed = m_epochSeed;
+		}
+		else if (_m.paramCount < 4 || !toHash(p[0], job) || !toHash(p[1], header) || !toHash(p[2], seed) || !shareTarget(p[3], target))
+			return false;
+		workReceived(header, seed, target, job, p[0].begin, p[0].size());
+		return true;
+	}
+	if (_m.method.is("mining.set_difficulty") && m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM)
+	{
+		if (!_m.paramCount || !toNumber(p[0], m_nextWorkDifficulty))
+			return false;
+		if (m_nextWorkDifficulty <= 0.0001) m_nextWorkDifficulty = 0.0001;
+		cnote << "Difficulty set to " << m_nextWorkDifficulty;
+		return true;
+	}
+	return false;
+}
+
+bool EthStratumClientV2::shareTarget(StratumToken const& _t, h256& _target)
+{
+	// coinmine.pl fix: targets may come without their leading zeros.
+	return _t.size() >= 2 && _t.begin[0] == '0' && _t.begin[1] == 'x' && toHash(_t, _target, HexPad::Left);
+}
+
+void EthStratumClientV2::workReceived(h256 const& _header, h256 const& _seed, h256 const& _target, h256 const& _job, char const* _jobId, size_t _jobIdSize)
+{
+	m_worktimer.cancel();
+	m_worktimer.expires_from_now(boost::posix_time::seconds(m_worktimeout));
+	m_worktimer.async_wait(boost::bind(&EthStratumClientV2::work_timeout_handler, this, boost::asio::placeholders::error));
+
+	bool const jobs = m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM || m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2;
+	bool const changed = jobs || _header != m_current.header;
+	if (changed)
+	{
+		m_current.header = _header;
+		m_current.seed = _seed;
+		m_current.job = _job;
+		if (jobs)
+		{
+			if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2)
+			{
+				m_current.boundary = m_nextWorkTarget;
+				m_current.job_len = _jobIdSize;
+			}
+			else
+			{
+				m_current.boundary = h256();
+				diffToTarget((uint32_t*)m_current.boundary.data(), m_nextWorkDifficulty);
+			}
+			m_current.startNonce = ethash_swap_u64(*((uint64_t*)m_extraNonce.data()));
+			m_current.exSizeBits = m_extraNonceHexSize * 4;
+		}
+		else
+			m_current.boundary = _target;
+		{
+			std::lock_guard<std::mutex> l(x_submits);
+			m_nextTemplate ^= 1;
+			m_submitTemplates[m_nextTemplate].render(m_protocol, p_active->user, m_worker, m_current, m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2 ? _jobIdSize : 64, m_extraNonceHexSize);
+		}
+		p_farm->setWork(m_current, m_responseTime);
+	}
+	cnote << "Received new job #" + string(_jobId, min<size_t>(_jobIdSize, 8))
+		<< " seed: " << "#" + m_current.seed.hex().substr(0, 32)
+		<< " target: " << "#" + m_current.boundary.hex().substr(0, 24);
+}
+
+void EthStratumClientV2::shareReplied(unsigned _id, bool _accepted)
+{
+	PendingShares::Share share;
+	{
+		std::lock_guard<std::mutex> l(x_submits);
+		if (!m_pendingShares.take(_id, share))
+		{
+			cwarn << "Reply to unknown share" << _id;
+			return;
+		}
+	}
+	uint64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(m_responseTime - share.sent).count();
+	if (_accepted) {
+		cnote << EthLime << "Accepted" << EthReset << "in" << us / 1000 << "ms";
+		p_farm->acceptedSolution(share.stale, share.miner);
+	}
+	else {
+		cwarn << "Rejected" << "in" << us / 1000 << "ms";
+		p_farm->rejectedSolution(share.stale, share.miner);
+	}
+	p_farm->shareReplied(p_active->host + ":" + p_active->port, share.miner, _accepted, share.stale, us);
+}
+
 void EthStratumClientV2::work_timeout_handler(const boost::system::error_code& ec) {
 	if (!ec) {
 		cnote << "No new work received in" << m_worktimeout << "seconds.";
@@ -460,39 +720,44 @@ void EthStratumClientV2::work_timeout_handler(const boost::system::error_code& e
 }
 
 bool EthStratumClientV2::submitHashrate(string const & rate) {
+	auto const now = std::chrono::steady_clock::now();
+	if (!isConnected() || now - m_hashrateAt < std::chrono::seconds(c_hashrateSeconds))
+		return false;
+	// Shares are written under the same lock, and come first.
+	std::unique_lock<std::mutex> l(x_submits, std::try_to_lock);
+	if (!l.owns_lock())
+		return false;
+	m_hashrateAt = now;
 	// There is no stratum method to submit the hashrate so we use the rpc variant.
-	string json = "{\"id\": 6, \"jsonrpc\":\"2.0\", \"method\": \"eth_submitHashrate\", \"params\": [\"" + rate + "\",\"0x" + this->m_submit_hashrate_id + "\"]}\n";
-	std::ostream os(&m_requestBuffer);
-	os << json;
-	write(m_socket, m_requestBuffer);
-	return true;
+	// Its own buffer: m_requestBuffer belongs to the work loop.
+	if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2)
+		m_hashrateLine = "{\"id\":6,\"method\":\"mining.hashrate\",\"params\":[\"" + (rate.compare(0, 2, "0x") ? rate : rate.substr(2)) + "\",\"" + m_worker + "\"]}\n";
+	else
+		m_hashrateLine = "{\"id\": 6, \"jsonrpc\":\"2.0\", \"method\": \"eth_submitHashrate\", \"params\": [\"" + rate + "\",\"0x" + this->m_submit_hashrate_id + "\"]}\n";
+	boost::system::error_code ec;
+	write(m_socket, boost::asio::buffer(m_hashrateLine), ec);
+	return !ec;
 }
 
 void EthStratumClientV2::submit(Solution solution) {
-
-	string minernonce;
-	string nonceHex = toHex(solution.nonce);
-	if (m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM) {
-		minernonce = nonceHex.substr(m_extraNonceHexSize, 16 - m_extraNonceHexSize);
-	}
-
-	string json;
-	switch (m_protocol) {
-	case STRATUM_PROTOCOL_STRATUM:
-		json = "{\"id\": 4, \"method\": \"mining.submit\", \"params\": [\"" + p_active->user + "\",\"" + solution.work.job.hex() + "\",\"0x" + nonceHex + "\",\"0x" + solution.work.header.hex() + "\",\"0x" + solution.mixHash.hex() + "\"]}\n";
-		break;
-	case STRATUM_PROTOCOL_ETHPROXY:
-		json = "{\"id\": 4, \"worker\":\"" + m_worker + "\", \"method\": \"eth_submitWork\", \"params\": [\"0x" + nonceHex + "\",\"0x" + solution.work.header.hex() + "\",\"0x" + solution.mixHash.hex() + "\"]}\n";
-		break;
-	case STRATUM_PROTOCOL_ETHEREUMSTRATUM:
-		json = "{\"id\": 4, \"method\": \"mining.submit\", \"params\": [\"" + p_active->user + "\",\"" + solution.work.job.hex() + "\",\"" + minernonce + "\"]}\n";
-		break;
+	TraceScope trace("stratum submit");
+	{
+		std::lock_guard<std::mutex> l(x_submits);
+		SubmitTemplate const* t = nullptr;
+		for (SubmitTemplate const& i: m_submitTemplates)
+			if (i.matches(solution.work))
+				t = &i;
+		SubmitTemplate rendered;
+		if (!t)
+		{
+			rendered.render(m_protocol, p_active->user, m_worker, solution.work, 64, m_extraNonceHexSize);
+			t = &rendered;
+		}
+		m_submitLine.clear();
+		t->append(m_submitLine, m_pendingShares.add(solution), solution.nonce, solution.mixHash);
+		write(m_socket, boost::asio::buffer(m_submitLine));
 	}
-	std::ostream os(&m_requestBuffer);
-	os << json;
-	m_stale = solution.stale;
-	write(m_socket, m_requestBuffer);
-	if (m_stale)
+	if (solution.stale)
 	{
 		cwarn << "Stale solution found; Submitted to" << p_active->host;
 	}
@@ -501,7 +766,6 @@ void EthStratumClientV2::submit(Solution solution) {
 		cnote << "Solution found; Submitted to" << p_active->host;
 	}
 	if (m_protocol != STRATUM_PROTOCOL_ETHEREUMSTRATUM) {
-		cnote << "Nonce:" << "0x" + nonceHex;
+		cnote << "Nonce:" << "0x" + toHex(solution.nonce);
 	}
 }
-
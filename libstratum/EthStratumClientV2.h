@@ -11,6 +11,8 @@
 #include <libethcore/Miner.h>
 
 #include "BuildInfo.h"
+#include "StratumParser.h"
+#include "SubmitTemplate.h"
 
 
 using namespace std;
@@ -32,7 +34,10 @@ public:
 	h256 currentHeaderHash() { return m_current.header; }
 	bool current() { return static_cast<bool>(m_current); }
 	unsigned waitState() { return m_waitState; }
+	/// Skipped rather than waiting for a share being written, and when more
+	/// frequent than c_hashrateSeconds. False if this one is.
 	bool submitHashrate(string const & rate);
+	static const unsigned c_hashrateSeconds = 10;
 	void submit(Solution solution);
 	void reconnect();
 	void switchPool();
@@ -44,6 +49,18 @@ private:
 	void work_timeout_handler(const boost::system::error_code& ec);
 
 	void processReponse(Json::Value& responseObject);
+	/// The hot path for notify, set_difficulty and submit replies, parsed in
+	/// place. False if _m is for processReponse() after all.
+	bool processMessage(StratumMessage const& _m);
+	static bool shareTarget(StratumToken const& _t, h256& _target);
+	/// The EthereumStratum/2.0 handshake replies and notifications. False if
+	/// _v is none of them.
+	bool processStratum2(Json::Value const& _v);
+	/// Resumes the last session if it was with this pool and the pool allows.
+	void subscribeStratum2();
+	void workReceived(h256 const& _header, h256 const& _seed, h256 const& _target, h256 const& _job, char const* _jobId, size_t _jobIdSize);
+	/// Accounts the reply to share _id, see PendingShares.
+	void shareReplied(unsigned _id, bool _accepted);
 	
 	MinerType m_minerType;
 
@@ -53,7 +70,7 @@ private:
 	cred_t m_fee;
 	bool m_fee_mode = false;
 
-	string m_worker; // eth-proxy only;
+	string m_worker; // eth-proxy, or the worker id EthereumStratum/2.0 authorization gave;
 
 	bool m_authorized;
 	bool m_connected;
@@ -65,12 +82,18 @@ private:
 
 	int m_waitState = MINER_WAIT_STATE_WORK;
 
-	string m_response;
-
 	Farm* p_farm;
 	WorkPackage m_current;
+	std::chrono::steady_clock::time_point m_responseTime;	///< When the line being processed was read.
 
-	bool m_stale = false;
+	std::mutex x_submits;
+	/// Submit lines of the current and the previous job.
+	SubmitTemplate m_submitTemplates[2];
+	unsigned m_nextTemplate = 0;
+	PendingShares m_pendingShares;
+	string m_submitLine;
+	string m_hashrateLine;
+	std::chrono::steady_clock::time_point m_hashrateAt;  ///< When the last report was sent.
 
 	boost::asio::io_service m_io_service;
 	boost::asio::ip::tcp::socket m_socket;
@@ -91,5 +114,13 @@ private:
 	
 	string m_submit_hashrate_id;
 
+	// EthereumStratum/2.0
+	string m_session;      ///< The last session's id, to resume it after a reconnect.
+	string m_sessionPool;  ///< host:port of the pool it is with.
+	bool m_canResume = false;
+	bool m_resuming = false;
+	h256 m_nextWorkTarget; ///< From mining.set, like the seed.
+	h256 m_epochSeed;
+
 	void processExtranonce(std::string& enonce);
 };
@@ -0,0 +1,184 @@
+#include "GetworkSubscription.h"
+#include <libdevcore/Log.h>
+
+namespace
+{
+
+char const c_subscribe[] = "{\"id\":1,\"jsonrpc\":\"2.0\",\"method\":\"eth_subscribe\",\"params\":[\"newHeads\"]}\n";
+char const c_getWork[] = "{\"id\":2,\"jsonrpc\":\"2.0\",\"method\":\"eth_getWork\",\"params\":[]}\n";
+
+}
+
+const unsigned GetworkSubscription::c_subscribedPollMs;
+
+GetworkSubscription::GetworkSubscription(string const& _path, unsigned _pollMs, OnWork const& _onWork):
+	m_path(_path),
+	m_pollMs(_pollMs),
+	m_onWork(_onWork),
+	m_socket(m_strand.service()),
+	m_timer(m_strand.service())
+{
+	m_strand.post([this]() { connect(); });
+}
+
+GetworkSubscription::~GetworkSubscription()
+{
+	m_strand.post([this]()
+	{
+		m_running = false;
+		boost::system::error_code ec;
+		m_timer.cancel(ec);
+		m_socket.close(ec);
+	});
+	m_strand.drain();
+}
+
+void GetworkSubscription::connect()
+{
+	m_subscribed = false;
+	m_in.consume(m_in.size());
+	m_queued.clear();
+	m_socket.async_connect(boost::asio::local::stream_protocol::endpoint(m_path), m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (!m_running)
+			return;
+		if (_ec)
+		{
+			cwarn << "Could not connect to node at " + m_path + ", " + _ec.message();
+			retry();
+			return;
+		}
+		cnote << "Connected to node at " + m_path;
+		m_connected = true;
+		send(c_subscribe);
+		send(c_getWork);
+		read();
+		poll();
+	}));
+}
+
+void GetworkSubscription::retry()
+{
+	m_connected = false;
+	boost::system::error_code ec;
+	m_socket.close(ec);
+	cnote << "Reconnecting in 3 seconds...";
+	m_timer.expires_from_now(boost::posix_time::seconds(3));
+	m_timer.async_wait(m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (!_ec && m_running)
+			connect();
+	}));
+}
+
+void GetworkSubscription::poll()
+{
+	m_timer.expires_from_now(boost::posix_time::milliseconds(m_subscribed ? c_subscribedPollMs : m_pollMs));
+	m_timer.async_wait(m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (_ec)
+			return;
+		send(c_getWork);
+		poll();
+	}));
+}
+
+void GetworkSubscription::read()
+{
+	boost::asio::async_read_until(m_socket, m_in, "\n", m_strand.wrap([this](boost::system::error_code const& _ec, size_t _n)
+	{
+		if (_ec)
+		{
+			// Aborted by retry() closing the socket, or by the destructor.
+			if (_ec != boost::asio::error::operation_aborted && m_running)
+			{
+				cwarn << "Node connection lost, " + _ec.message();
+				retry();
+			}
+			return;
+		}
+		auto const received = std::chrono::steady_clock::now();
+		char const* line = boost::asio::buffer_cast<char const*>(m_in.data());
+		Json::Value v;
+		Json::Reader reader;
+		if (reader.parse(line, line + _n, v))
+			process(v, received);
+		else
+			cwarn << "Parse response failed: " + reader.getFormattedErrorMessages();
+		m_in.consume(_n);
+		read();
+	}));
+}
+
+void GetworkSubscription::process(Json::Value const& _v, std::chrono::steady_clock::time_point _received)
+{
+	if (_v.get("method", "").asString() == "eth_subscription")
+	{
+		// A new head; its pending block is what is to be mined.
+		if (m_headAt == std::chrono::steady_clock::time_point())
+			m_headAt = _received;
+		send(c_getWork);
+		return;
+	}
+	Json::Value const& error = _v["error"];
+	switch (_v.get("id", Json::Value::null).asInt())
+	{
+	case 1:
+		if (!error.isNull())
+			cwarn << "Node has no eth_subscribe, polling it every" << m_pollMs << "ms";
+		else
+		{
+			cnote << "Subscribed to new heads";
+			m_subscribed = true;
+		}
+		break;
+	case 2:
+	{
+		Json::Value const& result = _v["result"];
+		auto const at = m_headAt == std::chrono::steady_clock::time_point() ? _received : m_headAt;
+		m_headAt = std::chrono::steady_clock::time_point();
+		if (!result.isArray() || result.size() < 3)
+		{
+			cwarn << "No work from node" << (error.isObject() ? ": " + error.get("message", "").asString() : string());
+			break;
+		}
+		WorkPackage w;
+		w.header = h256(result[0].asString());
+		w.seed = h256(result[1].asString());
+		w.boundary = h256(fromHex(result[2].asString()), h256::AlignRight);
+		if (w.header != m_header)
+		{
+			m_header = w.header;
+			m_onWork(w, at);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void GetworkSubscription::send(string const& _line)
+{
+	m_queued += _line;
+	if (!m_sending.empty())
+		return;
+	m_sending.swap(m_queued);
+	boost::asio::async_write(m_socket, boost::asio::buffer(m_sending), m_strand.wrap(boost::bind(&GetworkSubscription::written, this, boost::asio::placeholders::error)));
+}
+
+void GetworkSubscription::written(boost::system::error_code const& _ec)
+{
+	m_sending.clear();
+	if (_ec)
+	{
+		if (_ec != boost::asio::error::operation_aborted && m_running)
+		{
+			cwarn << "Node connection lost, " + _ec.message();
+			retry();
+		}
+		return;
+	}
+	if (!m_queued.empty())
+		send(string());
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <json/json.h>
+#include <libdevcore/Reactor.h>
+#include <libethcore/EthashAux.h>
+
+using namespace std;
+using namespace dev;
+using namespace dev::eth;
+
+/// Getwork without polling over HTTP: subscribes to newHeads on the node's
+/// IPC socket and asks for work over it the moment a head arrives, so a new
+/// block reaches the farm within milliseconds. Nodes without subscriptions
+/// are polled over the same socket instead.
+class GetworkSubscription
+{
+public:
+	/// Gets each changed work package, on the Reactor thread, with when the
+	/// head announcing it was read.
+	typedef std::function<void(WorkPackage const&, std::chrono::steady_clock::time_point)> OnWork;
+
+	/// With subscriptions, work is still fetched this often to pick up
+	/// the node's recommits of the block being mined.
+	static const unsigned c_subscribedPollMs = 5000;
+
+	/// Connects to the IPC socket at _path; without subscriptions work is
+	/// polled every _pollMs.
+	GetworkSubscription(string const& _path, unsigned _pollMs, OnWork const& _onWork);
+	~GetworkSubscription();
+
+	bool isConnected() const { return m_connected; }
+
+private:
+	void connect();
+	/// Reconnects in a while.
+	void retry();
+	void poll();
+	void read();
+	void process(Json::Value const& _v, std::chrono::steady_clock::time_point _received);
+	void send(string const& _line);
+	void written(boost::system::error_code const& _ec);
+
+	string const m_path;
+	unsigned const m_pollMs;
+	OnWork const m_onWork;
+
+	ReactorStrand m_strand;  ///< Everything below is only touched on it.
+	boost::asio::local::stream_protocol::socket m_socket;
+	boost::asio::deadline_timer m_timer;  ///< The next poll, or reconnect.
+	boost::asio::streambuf m_in;
+	string m_queued;   ///< Requests waiting for the write in flight.
+	string m_sending;  ///< Requests being written.
+	bool m_running = true;
+	std::atomic<bool> m_connected = {false};
+	bool m_subscribed = false;
+	/// When the head being fetched was announced, if it was.
+	std::chrono::steady_clock::time_point m_headAt;
+	h256 m_header;  ///< Of the last work passed on.
+};
@@ -0,0 +1,233 @@
+#include "PoolConnector.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <libdevcore/Log.h>
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+/// The connect time of an address not tried yet, or whose last try failed.
+double const c_untried = -1;
+double const c_failed = 1e9;
+
+struct Address
+{
+	tcp::endpoint endpoint;
+	double ms;  ///< A moving average of the connect times.
+};
+
+struct Lookup
+{
+	vector<Address> addresses;
+	std::chrono::steady_clock::time_point resolved;
+	bool refreshing = false;
+};
+
+/// Shared by all connections, which may be on different strands.
+std::mutex x_lookups;
+std::map<string, Lookup> s_lookups;
+
+/// The addresses of _l, the fastest first, then the untried ones with the
+/// address families alternating, then the failed ones.
+vector<tcp::endpoint> ordered(Lookup const& _l)
+{
+	vector<Address> measured;
+	vector<tcp::endpoint> untried[2];
+	vector<tcp::endpoint> failed;
+	for (Address const& a: _l.addresses)
+		if (a.ms == c_untried)
+			untried[a.endpoint.address().is_v6() == _l.addresses[0].endpoint.address().is_v6() ? 0 : 1].push_back(a.endpoint);
+		else if (a.ms >= c_failed)
+			failed.push_back(a.endpoint);
+		else
+			measured.push_back(a);
+	std::stable_sort(measured.begin(), measured.end(), [](Address const& _a, Address const& _b) { return _a.ms < _b.ms; });
+
+	vector<tcp::endpoint> ret;
+	for (Address const& a: measured)
+		ret.push_back(a.endpoint);
+	for (size_t i = 0; i < max(untried[0].size(), untried[1].size()); ++i)
+		for (auto const& family: untried)
+			if (i < family.size())
+				ret.push_back(family[i]);
+	ret.insert(ret.end(), failed.begin(), failed.end());
+	return ret;
+}
+
+/// Replaces the addresses of _key by those resolved, keeping what is known
+/// of the ones still there.
+vector<tcp::endpoint> store(string const& _key, tcp::resolver::iterator _i)
+{
+	std::lock_guard<std::mutex> l(x_lookups);
+	Lookup& lookup = s_lookups[_key];
+	vector<Address> addresses;
+	for (; _i != tcp::resolver::iterator(); ++_i)
+	{
+		Address a{_i->endpoint(), c_untried};
+		for (Address const& old: lookup.addresses)
+			if (old.endpoint == a.endpoint)
+				a.ms = old.ms;
+		addresses.push_back(a);
+	}
+	lookup.addresses.swap(addresses);
+	lookup.resolved = std::chrono::steady_clock::now();
+	lookup.refreshing = false;
+	return ordered(lookup);
+}
+
+void record(string const& _key, tcp::endpoint const& _endpoint, double _ms)
+{
+	std::lock_guard<std::mutex> l(x_lookups);
+	for (Address& a: s_lookups[_key].addresses)
+		if (a.endpoint == _endpoint)
+			a.ms = a.ms == c_untried || a.ms >= c_failed || _ms >= c_failed ? _ms : (a.ms + _ms) / 2;
+}
+
+/// Resolves _host again in the background, the cached addresses serving meanwhile.
+void refresh(string const& _key, string const& _host, string const& _port)
+{
+	auto resolver = std::make_shared<tcp::resolver>(Reactor::service());
+	resolver->async_resolve(tcp::resolver::query(_host, _port), [resolver, _key](boost::system::error_code const& _ec, tcp::resolver::iterator _i)
+	{
+		if (!_ec && _i != tcp::resolver::iterator())
+		{
+			store(_key, _i);
+			return;
+		}
+		cnote << "Could not refresh the addresses of " + _key + ", keeping the cached ones";
+		std::lock_guard<std::mutex> l(x_lookups);
+		s_lookups[_key].refreshing = false;
+	});
+}
+
+}
+
+const unsigned PoolConnector::c_ttlSeconds;
+const unsigned PoolConnector::c_headStartMs;
+
+PoolConnector::PoolConnector(ReactorStrand& _strand):
+	m_strand(_strand),
+	m_resolver(_strand.service()),
+	m_timer(_strand.service())
+{
+}
+
+void PoolConnector::connect(tcp::socket& _socket, string const& _host, string const& _port, Handler const& _handler)
+{
+	cancel();
+	// Now rather than when the winner is moved in, so the handlers of the
+	// old connection run before any of the new one.
+	boost::system::error_code ec;
+	_socket.close(ec);
+	p_socket = &_socket;
+	m_handler = _handler;
+	m_key = _host + ":" + _port;
+
+	vector<tcp::endpoint> cached;
+	bool stale = false;
+	{
+		std::lock_guard<std::mutex> l(x_lookups);
+		auto i = s_lookups.find(m_key);
+		if (i != s_lookups.end() && !i->second.addresses.empty())
+		{
+			cached = ordered(i->second);
+			stale = !i->second.refreshing && std::chrono::steady_clock::now() - i->second.resolved > std::chrono::seconds(c_ttlSeconds);
+			if (stale)
+				i->second.refreshing = true;
+		}
+	}
+	if (!cached.empty())
+	{
+		if (stale)
+			refresh(m_key, _host, _port);
+		race(cached);
+		return;
+	}
+
+	unsigned const generation = m_generation;
+	m_resolver.async_resolve(tcp::resolver::query(_host, _port), m_strand.wrap([this, generation](boost::system::error_code const& _ec, tcp::resolver::iterator _i)
+	{
+		if (generation != m_generation)
+			return;
+		if (_ec)
+			finish(_ec, tcp::endpoint());
+		else
+			race(store(m_key, _i));
+	}));
+}
+
+void PoolConnector::cancel()
+{
+	++m_generation;
+	boost::system::error_code ec;
+	m_resolver.cancel();
+	m_timer.cancel(ec);
+	for (auto const& a: m_attempts)
+		a->socket.close(ec);
+	m_attempts.clear();
+	m_handler = nullptr;
+}
+
+void PoolConnector::race(vector<tcp::endpoint> const& _endpoints)
+{
+	m_endpoints = _endpoints;
+	m_next = 0;
+	m_lastError = boost::asio::error::host_not_found;
+	next();
+}
+
+void PoolConnector::next()
+{
+	if (m_next == m_endpoints.size())
+	{
+		if (m_attempts.empty())
+			finish(m_lastError, tcp::endpoint());
+		return;
+	}
+	auto a = std::make_shared<Attempt>(m_strand.service(), m_endpoints[m_next++]);
+	a->started = std::chrono::steady_clock::now();
+	m_attempts.push_back(a);
+	unsigned const generation = m_generation;
+	a->socket.async_connect(a->endpoint, m_strand.wrap([this, a, generation](boost::system::error_code const& _ec)
+	{
+		if (generation == m_generation)
+			attempted(a, _ec);
+	}));
+	if (m_next < m_endpoints.size())
+	{
+		m_timer.expires_from_now(boost::posix_time::milliseconds(c_headStartMs));
+		m_timer.async_wait(m_strand.wrap([this, generation](boost::system::error_code const& _ec)
+		{
+			if (!_ec && generation == m_generation)
+				next();
+		}));
+	}
+}
+
+void PoolConnector::attempted(std::shared_ptr<Attempt> const& _a, boost::system::error_code const& _ec)
+{
+	m_attempts.erase(std::find(m_attempts.begin(), m_attempts.end(), _a));
+	if (_ec)
+	{
+		record(m_key, _a->endpoint, c_failed);
+		m_lastError = _ec;
+		// No need to wait out the head start of a failed attempt.
+		next();
+		return;
+	}
+	record(m_key, _a->endpoint, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _a->started).count());
+	*p_socket = std::move(_a->socket);
+	finish(_ec, _a->endpoint);
+}
+
+void PoolConnector::finish(boost::system::error_code const& _ec, tcp::endpoint const& _endpoint)
+{
+	Handler handler;
+	handler.swap(m_handler);
+	// The attempts still in flight lost the race.
+	cancel();
+	if (handler)
+		handler(_ec, _endpoint);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <libdevcore/Reactor.h>
+
+using namespace std;
+using namespace dev;
+
+/// Connects to a pool quickly however flaky its resolver and however many
+/// addresses it has. Lookups are cached for all connections and refreshed
+/// in the background once old, the stale addresses serving meanwhile and
+/// for as long as the resolver fails. The addresses are raced, each getting
+/// a head start before the next is tried as well (happy eyeballs, RFC 8305),
+/// and the one connecting fastest is tried first next time.
+class PoolConnector
+{
+public:
+	/// Gets the outcome and the address connected to.
+	typedef std::function<void(boost::system::error_code const&, boost::asio::ip::tcp::endpoint const&)> Handler;
+
+	/// Lookups older than this are refreshed.
+	static const unsigned c_ttlSeconds = 300;
+	/// How long an attempt has to itself before the next address is tried.
+	static const unsigned c_headStartMs = 250;
+
+	/// Runs its handlers on _strand, the connection's.
+	explicit PoolConnector(ReactorStrand& _strand);
+
+	/// Closes _socket, failing what is pending on it, and connects it to
+	/// _host:_port, calling _handler once done. Cancels a connect in
+	/// progress. Call on the strand.
+	void connect(boost::asio::ip::tcp::socket& _socket, string const& _host, string const& _port, Handler const& _handler);
+	/// Abandons the connect in progress, if any, without calling its handler.
+	void cancel();
+
+private:
+	struct Attempt
+	{
+		Attempt(boost::asio::io_service& _service, boost::asio::ip::tcp::endpoint const& _endpoint): socket(_service), endpoint(_endpoint) {}
+		boost::asio::ip::tcp::socket socket;
+		boost::asio::ip::tcp::endpoint const endpoint;
+		std::chrono::steady_clock::time_point started;
+	};
+
+	void race(vector<boost::asio::ip::tcp::endpoint> const& _endpoints);
+	/// Starts an attempt to the next address, if there is one.
+	void next();
+	void attempted(std::shared_ptr<Attempt> const& _a, boost::system::error_code const& _ec);
+	void finish(boost::system::error_code const& _ec, boost::asio::ip::tcp::endpoint const& _endpoint);
+
+	ReactorStrand& m_strand;
+	boost::asio::ip::tcp::resolver m_resolver;
+	boost::asio::deadline_timer m_timer;  ///< The head start of the newest attempt.
+	unsigned m_generation = 0;  ///< Of the connect in progress; handlers of older ones are ignored.
+	boost::asio::ip::tcp::socket* p_socket = nullptr;
+	Handler m_handler;
+	string m_key;  ///< host:port being connected to.
+	vector<boost::asio::ip::tcp::endpoint> m_endpoints;  ///< In the order to try them.
+	size_t m_next = 0;
+	vector<std::shared_ptr<Attempt>> m_attempts;  ///< In flight.
+	boost::system::error_code m_lastError;
+};
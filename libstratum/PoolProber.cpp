@@ -0,0 +1,162 @@
+#include "PoolProber.h"
+#include <libdevcore/Log.h>
+#include <libethcore/Miner.h>
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+/// How much faster another endpoint has to answer to be worth a reconnect.
+double const c_betterRatio = 0.8;
+double const c_betterMs = 5;
+
+double average(double _old, double _ms)
+{
+	return _old < 0 ? _ms : (_old + _ms) / 2;
+}
+
+}
+
+const unsigned PoolProber::c_roundSeconds;
+const unsigned PoolProber::c_timeoutMs;
+
+PoolProber::PoolProber(vector<Endpoint> const& _endpoints, int _protocol):
+	m_endpoints(_endpoints),
+	// eth-proxy pools may want a login first, but an error is an answer too.
+	m_request(_protocol == STRATUM_PROTOCOL_ETHPROXY ? "{\"id\":1,\"jsonrpc\":\"2.0\",\"method\":\"eth_getWork\",\"params\":[]}\n" : "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"),
+	m_connector(m_strand),
+	m_socket(m_strand),
+	m_timer(m_strand.service()),
+	m_results(_endpoints.size())
+{
+	m_strand.post([this]()
+	{
+		m_roundStarted = std::chrono::steady_clock::now();
+		probe();
+	});
+}
+
+PoolProber::~PoolProber()
+{
+	m_strand.post([this]()
+	{
+		m_running = false;
+		boost::system::error_code ec;
+		m_connector.cancel();
+		m_timer.cancel(ec);
+		m_socket.close(ec);
+	});
+	m_strand.drain();
+}
+
+size_t PoolProber::better(size_t _current) const
+{
+	std::lock_guard<std::mutex> l(x_results);
+	size_t best = _current;
+	for (size_t i = 0; i < m_results.size(); ++i)
+		if (m_results[i].healthy && (!m_results[best].healthy || m_results[i].rttMs < m_results[best].rttMs))
+			best = i;
+	Result const& current = m_results[_current];
+	if (best == _current || (current.healthy && (m_results[best].rttMs > current.rttMs * c_betterRatio || current.rttMs - m_results[best].rttMs < c_betterMs)))
+		return _current;
+	return best;
+}
+
+void PoolProber::probe()
+{
+	unsigned const probe = ++m_probe;
+	m_started = std::chrono::steady_clock::now();
+	m_in.consume(m_in.size());
+	m_connector.connect(m_socket.lowest_layer(), m_endpoints[m_index].host, m_endpoints[m_index].port, [this](boost::system::error_code const& _ec, tcp::endpoint const&) { connected(_ec); });
+	m_timer.expires_from_now(boost::posix_time::milliseconds(c_timeoutMs));
+	m_timer.async_wait(m_strand.wrap([this, probe](boost::system::error_code const& _ec)
+	{
+		if (!_ec && m_running && probe == m_probe)
+			done(false);
+	}));
+}
+
+void PoolProber::connected(boost::system::error_code const& _ec)
+{
+	if (_ec)
+	{
+		done(false);
+		return;
+	}
+	boost::system::error_code ec;
+	m_socket.lowest_layer().set_option(tcp::no_delay(true), ec);
+	m_connectMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_started).count();
+	unsigned const probe = m_probe;
+	m_socket.async_handshake(m_endpoints[m_index].host, m_endpoints[m_index].port, [this, probe](boost::system::error_code const& _ec)
+	{
+		if (m_running && probe == m_probe)
+			secured(_ec);
+	});
+}
+
+void PoolProber::secured(boost::system::error_code const& _ec)
+{
+	if (_ec)
+	{
+		done(false);
+		return;
+	}
+	// The handshake, like the connect, is made once per connection: the
+	// round trip of the request is what shares wait for.
+	m_sent = std::chrono::steady_clock::now();
+	// A failed write fails the read as well.
+	boost::asio::async_write(m_socket, boost::asio::buffer(m_request), m_strand.wrap([](boost::system::error_code const&, size_t) {}));
+	unsigned const probe = m_probe;
+	boost::asio::async_read_until(m_socket, m_in, "\n", m_strand.wrap([this, probe](boost::system::error_code const& _ec, size_t)
+	{
+		// Else taken down by done() already.
+		if (m_running && probe == m_probe)
+			replied(_ec);
+	}));
+}
+
+void PoolProber::replied(boost::system::error_code const& _ec)
+{
+	if (!_ec)
+	{
+		double const rtt = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_sent).count();
+		std::lock_guard<std::mutex> l(x_results);
+		Result& r = m_results[m_index];
+		r.connectMs = average(r.connectMs, m_connectMs);
+		r.rttMs = average(r.rttMs, rtt);
+		cnote << "Stratum server " + m_endpoints[m_index].host + ":" + m_endpoints[m_index].port << "connects in" << (unsigned)r.connectMs << "ms, answers in" << (unsigned)r.rttMs << "ms";
+	}
+	done(!_ec);
+}
+
+void PoolProber::done(bool _ok)
+{
+	boost::system::error_code ec;
+	m_connector.cancel();
+	m_timer.cancel(ec);
+	m_socket.close(ec);
+	if (!_ok)
+	{
+		cnote << "Stratum server " + m_endpoints[m_index].host + ":" + m_endpoints[m_index].port + " did not answer the probe";
+	}
+	{
+		std::lock_guard<std::mutex> l(x_results);
+		m_results[m_index].healthy = _ok;
+	}
+
+	if (++m_index < m_endpoints.size())
+	{
+		probe();
+		return;
+	}
+	m_index = 0;
+	m_roundStarted += std::chrono::seconds(c_roundSeconds);
+	m_timer.expires_from_now(boost::posix_time::milliseconds(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(m_roundStarted - std::chrono::steady_clock::now()).count())));
+	m_timer.async_wait(m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (_ec || !m_running)
+			return;
+		m_roundStarted = std::chrono::steady_clock::now();
+		probe();
+	}));
+}
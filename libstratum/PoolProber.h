@@ -0,0 +1,74 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <libdevcore/Reactor.h>
+#include "PoolConnector.h"
+#include "PoolStream.h"
+
+using namespace std;
+using namespace dev;
+
+/// Measures, over connections of its own, how quickly the endpoints of a
+/// pool answer, so the client can mine on the fastest one: the round trip
+/// of an idle stratum request is what a share's adds to its chance of
+/// going stale. The endpoints are probed one after another, in rounds.
+class PoolProber
+{
+public:
+	struct Endpoint
+	{
+		string host;
+		string port;
+	};
+
+	/// Between the starts of two rounds.
+	static const unsigned c_roundSeconds = 60;
+	/// A probe taking longer fails.
+	static const unsigned c_timeoutMs = 5000;
+
+	/// Starts probing _endpoints, spoken to in stratum _protocol.
+	PoolProber(vector<Endpoint> const& _endpoints, int _protocol);
+	~PoolProber();
+
+	Endpoint const& endpoint(size_t _i) const { return m_endpoints[_i]; }
+	/// The endpoint worth moving to from endpoint _current: the healthy one
+	/// answering fastest, if clearly faster than _current. Else _current.
+	size_t better(size_t _current) const;
+
+private:
+	struct Result
+	{
+		double connectMs = -1;  ///< Moving averages; -1 while unknown.
+		double rttMs = -1;
+		bool healthy = false;   ///< The last probe succeeded.
+	};
+
+	void probe();
+	void connected(boost::system::error_code const& _ec);
+	void secured(boost::system::error_code const& _ec);
+	void replied(boost::system::error_code const& _ec);
+	/// Takes down the probe of m_index and goes on to the next endpoint.
+	void done(bool _ok);
+
+	vector<Endpoint> const m_endpoints;
+	string const m_request;  ///< A benign request any pool answers.
+
+	ReactorStrand m_strand;  ///< Everything below but the results is only touched on it.
+	PoolConnector m_connector;
+	PoolStream m_socket;
+	boost::asio::deadline_timer m_timer;  ///< The probe's timeout, or the next round.
+	boost::asio::streambuf m_in;
+	bool m_running = true;
+	size_t m_index = 0;  ///< Endpoint being probed.
+	unsigned m_probe = 0;  ///< Counts the probes, for handlers to tell theirs is over.
+	std::chrono::steady_clock::time_point m_roundStarted;
+	std::chrono::steady_clock::time_point m_started;  ///< Of the probe.
+	std::chrono::steady_clock::time_point m_sent;     ///< The request.
+	double m_connectMs = 0;
+
+	mutable std::mutex x_results;
+	vector<Result> m_results;
+};
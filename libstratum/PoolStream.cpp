@@ -0,0 +1,152 @@
+#include "PoolStream.h"
+#include <map>
+#include <mutex>
+#include <libdevcore/Log.h>
+namespace ssl = boost::asio::ssl;
+
+namespace
+{
+
+/// The latest session agreed with each host:port, shared by all connections.
+std::mutex x_sessions;
+std::map<string, SSL_SESSION*> s_sessions;
+
+/// Called by OpenSSL with each session a pool hands out, once the handshake
+/// is done or, with TLS 1.3, when its ticket comes in later.
+int keepSession(SSL* _ssl, SSL_SESSION* _session)
+{
+	string const* key = static_cast<string const*>(SSL_get_app_data(_ssl));
+	if (!key)
+		return 0;
+	std::lock_guard<std::mutex> l(x_sessions);
+	SSL_SESSION*& kept = s_sessions[*key];
+	if (kept)
+		SSL_SESSION_free(kept);
+	kept = _session;
+	// Ours now.
+	return 1;
+}
+
+ssl::context& context(bool _verify)
+{
+	static ssl::context* s_context = [_verify]()
+	{
+		ssl::context* c = new ssl::context(ssl::context::sslv23_client);
+		c->set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 | ssl::context::no_sslv3);
+		if (_verify)
+			c->set_default_verify_paths();
+		// OpenSSL keeps no client sessions itself, keepSession() does.
+		SSL_CTX_set_session_cache_mode(c->native_handle(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(c->native_handle(), keepSession);
+		return c;
+	}();
+	return *s_context;
+}
+
+}
+
+bool PoolStream::s_tls = false;
+bool PoolStream::s_verify = true;
+
+PoolStream::PoolStream(ReactorStrand& _strand):
+	m_strand(_strand),
+	m_socket(_strand.service())
+{
+}
+
+PoolStream::~PoolStream()
+{
+	for (Tls* tls: {m_tls.get(), m_retired.get()})
+		if (tls)
+			SSL_set_app_data(tls->native_handle(), nullptr);
+}
+
+void PoolStream::close(boost::system::error_code& _ec)
+{
+	retire();
+	m_socket.close(_ec);
+}
+
+void PoolStream::retire()
+{
+	++m_connection;
+	m_secured = false;
+	if (!m_tls)
+		return;
+	// A pool dropping the connection without a close_notify leaves its
+	// session as good as before, and OpenSSL would forget it.
+	SSL_set_shutdown(m_tls->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_set_app_data(m_tls->native_handle(), nullptr);
+	m_retired = std::move(m_tls);
+}
+
+void PoolStream::async_handshake(string const& _host, string const& _port, std::function<void(boost::system::error_code const&)> const& _handler)
+{
+	if (!s_tls)
+	{
+		_handler(boost::system::error_code());
+		return;
+	}
+
+	if (m_tls)
+		retire();
+	m_tls.reset(new Tls(m_socket, context(s_verify)));
+	m_key = _host + ":" + _port;
+	SSL* ssl = m_tls->native_handle();
+	SSL_set_app_data(ssl, &m_key);
+
+	boost::system::error_code ec;
+	boost::asio::ip::address::from_string(_host, ec);
+	if (ec)
+		SSL_set_tlsext_host_name(ssl, _host.c_str());
+	if (s_verify)
+	{
+		m_tls->set_verify_mode(ssl::verify_peer, ec);
+		m_tls->set_verify_callback(ssl::rfc2818_verification(_host), ec);
+	}
+	else
+		m_tls->set_verify_mode(ssl::verify_none, ec);
+	{
+		std::lock_guard<std::mutex> l(x_sessions);
+		auto i = s_sessions.find(m_key);
+		if (i != s_sessions.end())
+			SSL_set_session(ssl, i->second);
+	}
+
+	unsigned const connection = m_connection;
+	m_tls->async_handshake(ssl::stream_base::client, m_strand.wrap([this, _handler, connection](boost::system::error_code const& _ec)
+	{
+		if (!_ec && connection == m_connection)
+		{
+			m_secured = true;
+			SSL* ssl = m_tls->native_handle();
+			cnote << (SSL_session_reused(ssl) ? "Resumed TLS session with" : "TLS handshake with") << m_key << SSL_get_version(ssl);
+		}
+		_handler(connection == m_connection ? _ec : boost::asio::error::operation_aborted);
+	}));
+}
+
+void PoolStream::writeNext()
+{
+	Write& w = m_writes.front();
+	if (w.connection != m_connection || !m_secured)
+	{
+		m_strand.post([this]()
+		{
+			auto handler = std::move(m_writes.front().handler);
+			m_writes.pop_front();
+			if (!m_writes.empty())
+				writeNext();
+			handler(boost::asio::error::operation_aborted, 0);
+		});
+		return;
+	}
+	m_tls->async_write_some(boost::asio::buffer(*w.data), m_strand.wrap([this](boost::system::error_code const& _ec, size_t _n)
+	{
+		auto handler = std::move(m_writes.front().handler);
+		m_writes.pop_front();
+		if (!m_writes.empty())
+			writeNext();
+		handler(_ec, _n);
+	}));
+}
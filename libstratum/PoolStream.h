@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/version.hpp>
+#include <libdevcore/Reactor.h>
+
+using namespace std;
+using namespace dev;
+
+/// The connection to a pool, in plaintext or, once setTls(), over TLS. An
+/// asio stream, for async_read_until() and async_write(), with the tcp
+/// socket below for connecting. The sessions agreed with each pool are kept
+/// for all connections, so a reconnect resumes its session and saves the
+/// round trips and key exchange of a full handshake.
+class PoolStream
+{
+public:
+	typedef boost::asio::ip::tcp::socket lowest_layer_type;
+
+	/// Speaks TLS to all pools, checking their certificates if _verify.
+	/// Call before the first connection.
+	static void setTls(bool _tls, bool _verify) { s_tls = _tls; s_verify = _verify; }
+	static bool tls() { return s_tls; }
+
+	/// Runs its handlers on _strand, the connection's.
+	explicit PoolStream(ReactorStrand& _strand);
+	~PoolStream();
+
+	lowest_layer_type& lowest_layer() { return m_socket; }
+#if BOOST_VERSION >= 106600
+	typedef lowest_layer_type::executor_type executor_type;
+	executor_type get_executor() { return m_socket.get_executor(); }
+#else
+	boost::asio::io_service& get_io_service() { return m_socket.get_io_service(); }
+#endif
+
+	/// Sets up the connection just made to _host:_port, calling _handler on
+	/// the strand once it can carry requests: at once in plaintext, after the
+	/// handshake with TLS. Call on the strand.
+	void async_handshake(string const& _host, string const& _port, std::function<void(boost::system::error_code const&)> const& _handler);
+	/// Closes the connection, failing what is pending on it. Call on the
+	/// strand, and before connecting the socket again.
+	void close(boost::system::error_code& _ec);
+
+	template <class Buffers, class Handler>
+	void async_read_some(Buffers const& _buffers, Handler&& _handler)
+	{
+		if (m_tls)
+			m_tls->async_read_some(_buffers, std::forward<Handler>(_handler));
+		else
+			m_socket.async_read_some(_buffers, std::forward<Handler>(_handler));
+	}
+
+	template <class Buffers, class Handler>
+	void async_write_some(Buffers const& _buffers, Handler&& _handler)
+	{
+		if (!s_tls)
+		{
+			m_socket.async_write_some(_buffers, std::forward<Handler>(_handler));
+			return;
+		}
+		// A TLS stream takes one write at a time, while a reply may be
+		// written during a share's. The lines are small enough for one record.
+		m_writes.push_back(Write{make_shared<string>(boost::asio::buffers_begin(_buffers), boost::asio::buffers_end(_buffers)), m_connection, std::forward<Handler>(_handler)});
+		if (m_writes.size() == 1)
+			writeNext();
+	}
+
+private:
+	typedef boost::asio::ssl::stream<lowest_layer_type&> Tls;
+
+	struct Write
+	{
+		shared_ptr<string> data;
+		unsigned connection;
+		std::function<void(boost::system::error_code const&, size_t)> handler;
+	};
+
+	/// Ends the TLS stream of the connection going away.
+	void retire();
+	void writeNext();
+
+	static bool s_tls;
+	static bool s_verify;
+
+	ReactorStrand& m_strand;
+	lowest_layer_type m_socket;
+	unique_ptr<Tls> m_tls;
+	/// That of the previous connection, whose aborted operations may still
+	/// be completing.
+	unique_ptr<Tls> m_retired;
+	string m_key;  ///< host:port of the pool, for the sessions kept.
+	unsigned m_connection = 0;  ///< Counts the connections, for writes to tell theirs is gone.
+	bool m_secured = false;  ///< The handshake of this connection is done.
+	deque<Write> m_writes;  ///< The first is in flight.
+};
@@ -0,0 +1,66 @@
+#include "SessionRecorder.h"
+#include <cstring>
+#include <libdevcore/Log.h>
+
+string SessionRecorder::s_prefix;
+std::atomic<unsigned> SessionRecorder::s_sessions = {0};
+
+void SessionRecorder::open(int _protocol, string const& _host, string const& _port)
+{
+	close();
+	if (!enabled())
+		return;
+	string const file = s_prefix + "." + to_string(++s_sessions) + ".log";
+	m_out.open(file, ios::out | ios::trunc);
+	if (!m_out)
+	{
+		cwarn << "Cannot record the stratum session to" << file;
+		return;
+	}
+	cnote << "Recording the stratum session to" << file;
+	m_start = std::chrono::steady_clock::now();
+	string const text = to_string(_protocol) + " " + _host + ":" + _port;
+	write('*', text.data(), text.size());
+	m_out.flush();
+}
+
+void SessionRecorder::close()
+{
+	if (m_out.is_open())
+		m_out.close();
+}
+
+void SessionRecorder::received(char const* _line, size_t _size)
+{
+	if (!m_out.is_open())
+		return;
+	while (_size && (_line[_size - 1] == '\n' || _line[_size - 1] == '\r'))
+		--_size;
+	write('<', _line, _size);
+}
+
+void SessionRecorder::sent(string const& _text)
+{
+	if (!m_out.is_open())
+		return;
+	for (size_t begin = 0; begin < _text.size();)
+	{
+		size_t end = _text.find('\n', begin);
+		if (end == string::npos)
+			end = _text.size();
+		size_t size = end - begin;
+		if (size && _text[begin + size - 1] == '\r')
+			--size;
+		if (size)
+			write('>', _text.data() + begin, size);
+		begin = end + 1;
+	}
+}
+
+void SessionRecorder::write(char _kind, char const* _text, size_t _size)
+{
+	uint64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+	m_out << us << '\t' << _kind << '\t';
+	m_out.write(_text, _size);
+	m_out << '\n';
+}
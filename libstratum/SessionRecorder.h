@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+/// Writes the lines of a stratum session, with the time of each, for
+/// StratumReplay to play back. A file per session, one event per line:
+///
+///     <microseconds since the session began>\t<kind>\t<text>
+///
+/// the kinds being '*' for the session's start, with the protocol and the
+/// pool's host:port as text, '<' for a line from the pool and '>' for one
+/// to it. Not thread safe: a client calls it on its strand only.
+class SessionRecorder
+{
+public:
+	/// Records the sessions of all clients to _prefix.<n>.log, n counting
+	/// them from 1. Empty, the default, records none.
+	static void setPrefix(string const& _prefix) { s_prefix = _prefix; }
+	static bool enabled() { return !s_prefix.empty(); }
+
+	~SessionRecorder() { close(); }
+
+	/// Starts the file of a new session, ending the last one's.
+	void open(int _protocol, string const& _host, string const& _port);
+	void close();
+
+	void received(char const* _line, size_t _size);
+	/// _text may hold several lines.
+	void sent(string const& _text);
+
+private:
+	void write(char _kind, char const* _text, size_t _size);
+
+	static string s_prefix;
+	static std::atomic<unsigned> s_sessions;
+
+	std::ofstream m_out;
+	std::chrono::steady_clock::time_point m_start;
+};
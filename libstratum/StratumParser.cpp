@@ -0,0 +1,218 @@
+#include "StratumParser.h"
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+
+/// Nesting beyond this is not stratum; such lines go to jsoncpp.
+unsigned const c_maxDepth = 8;
+
+int hexDigit(char _c)
+{
+	if (_c >= '0' && _c <= '9')
+		return _c - '0';
+	if (_c >= 'a' && _c <= 'f')
+		return _c - 'a' + 10;
+	if (_c >= 'A' && _c <= 'F')
+		return _c - 'A' + 10;
+	return -1;
+}
+
+bool literal(char const*& _p, char const* _end, char const* _word)
+{
+	size_t n = strlen(_word);
+	if ((size_t)(_end - _p) < n || memcmp(_p, _word, n) != 0)
+		return false;
+	_p += n;
+	return true;
+}
+
+}
+
+bool StratumToken::is(char const* _s) const
+{
+	size_t n = strlen(_s);
+	return kind == String && size() == n && memcmp(begin, _s, n) == 0;
+}
+
+bool StratumMessage::parse(char const* _begin, char const* _end)
+{
+	*this = StratumMessage();
+	m_p = _begin;
+	m_end = _end;
+	skipSpace();
+	if (m_p == m_end || *m_p != '{')
+		return false;
+	++m_p;
+	skipSpace();
+	bool empty = m_p != m_end && *m_p == '}';
+	if (empty)
+		++m_p;
+	while (!empty)
+	{
+		skipSpace();
+		StratumToken key;
+		if (!value(key, nullptr, nullptr, c_maxDepth) || key.kind != StratumToken::String)
+			return false;
+		skipSpace();
+		if (m_p == m_end || *m_p++ != ':')
+			return false;
+		skipSpace();
+
+		StratumToken ignored;
+		StratumToken* t = &ignored;
+		StratumToken* items = nullptr;
+		unsigned* count = nullptr;
+		if (key.is("id"))
+			t = &id;
+		else if (key.is("method"))
+			t = &method;
+		else if (key.is("error"))
+			t = &error;
+		else if (key.is("params"))
+			t = &params, items = paramItems, count = &paramCount;
+		else if (key.is("result"))
+			t = &result, items = resultItems, count = &resultCount;
+		if (!value(*t, items, count, c_maxDepth))
+			return false;
+
+		skipSpace();
+		if (m_p == m_end)
+			return false;
+		char c = *m_p++;
+		if (c == '}')
+			break;
+		if (c != ',')
+			return false;
+	}
+	skipSpace();
+	return m_p == m_end;
+}
+
+bool StratumMessage::value(StratumToken& _t, StratumToken* _items, unsigned* _count, unsigned _depth)
+{
+	if (m_p == m_end || !_depth)
+		return false;
+	_t.begin = m_p;
+	switch (*m_p)
+	{
+	case '"':
+		_t.kind = StratumToken::String;
+		_t.begin = ++m_p;
+		for (; m_p != m_end && *m_p != '"'; ++m_p)
+			if (*m_p == '\\')
+				return false;
+		if (m_p == m_end)
+			return false;
+		_t.end = m_p++;
+		return true;
+	case '[':
+	case '{':
+	{
+		bool const array = *m_p == '[';
+		char const close = array ? ']' : '}';
+		_t.kind = array ? StratumToken::Array : StratumToken::Object;
+		++m_p;
+		skipSpace();
+		if (m_p != m_end && *m_p == close)
+		{
+			_t.end = ++m_p;
+			return true;
+		}
+		while (true)
+		{
+			skipSpace();
+			StratumToken item;
+			if (!value(item, nullptr, nullptr, _depth - 1))
+				return false;
+			skipSpace();
+			if (!array)
+			{
+				if (item.kind != StratumToken::String || m_p == m_end || *m_p++ != ':')
+					return false;
+				skipSpace();
+				if (!value(item, nullptr, nullptr, _depth - 1))
+					return false;
+				skipSpace();
+			}
+			else if (_items && *_count < c_maxItems)
+				_items[(*_count)++] = item;
+			if (m_p == m_end)
+				return false;
+			char c = *m_p++;
+			if (c == close)
+				break;
+			if (c != ',')
+				return false;
+		}
+		_t.end = m_p;
+		return true;
+	}
+	case 't':
+		_t.kind = StratumToken::True;
+		break;
+	case 'f':
+		_t.kind = StratumToken::False;
+		break;
+	case 'n':
+		_t.kind = StratumToken::Null;
+		break;
+	default:
+		_t.kind = StratumToken::Number;
+		while (m_p != m_end && ((*m_p >= '0' && *m_p <= '9') || *m_p == '-' || *m_p == '+' || *m_p == '.' || *m_p == 'e' || *m_p == 'E'))
+			++m_p;
+		_t.end = m_p;
+		return _t.size() > 0;
+	}
+	if (!literal(m_p, m_end, _t.kind == StratumToken::True ? "true" : _t.kind == StratumToken::False ? "false" : "null"))
+		return false;
+	_t.end = m_p;
+	return true;
+}
+
+bool toHash(StratumToken const& _t, h256& _h, HexPad _pad)
+{
+	if (_t.kind != StratumToken::String)
+		return false;
+	char const* b = _t.begin;
+	char const* e = _t.end;
+	bool const prefixed = e - b >= 2 && b[0] == '0' && b[1] == 'x';
+	if (prefixed)
+	{
+		if (_pad == HexPad::Right)
+			return false;
+		b += 2;
+	}
+	size_t digits = e - b;
+	if (_pad == HexPad::Right)
+		digits = std::min<size_t>(digits, 64);
+	if (digits > 64 || (_pad == HexPad::Exact && digits != 64))
+		return false;
+
+	// Digits are placed right-aligned for Left, left-aligned otherwise.
+	byte out[32] = {};
+	size_t const first = _pad == HexPad::Left ? 64 - digits : 0;
+	for (size_t i = 0; i < digits; ++i)
+	{
+		int d = hexDigit(b[i]);
+		if (d < 0)
+			return false;
+		size_t const at = first + i;
+		out[at / 2] |= (byte)(at & 1 ? d : d << 4);
+	}
+	memcpy(_h.data(), out, sizeof(out));
+	return true;
+}
+
+bool toNumber(StratumToken const& _t, double& _d)
+{
+	char buf[64];
+	if (_t.kind != StratumToken::Number || _t.size() >= sizeof(buf))
+		return false;
+	memcpy(buf, _t.begin, _t.size());
+	buf[_t.size()] = 0;
+	char* end;
+	_d = strtod(buf, &end);
+	return end == buf + _t.size();
+}
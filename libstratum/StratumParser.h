@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <libdevcore/FixedHash.h>
+
+using namespace std;
+using namespace dev;
+
+/// A value of the line being scanned, pointing into the read buffer. Strings
+/// exclude their quotes; arrays and objects span their brackets.
+struct StratumToken
+{
+	enum Kind { None, String, Number, True, False, Null, Array, Object };
+
+	bool is(char const* _s) const;
+	size_t size() const { return end - begin; }
+	string str() const { return string(begin, end); }
+
+	char const* begin = nullptr;
+	char const* end = nullptr;
+	Kind kind = None;
+};
+
+/// Scans one stratum line in place, without allocating, and keeps the top
+/// level members the hot path acts on: mining.notify, set_difficulty and
+/// submit replies. Anything it cannot take goes to jsoncpp instead.
+class StratumMessage
+{
+public:
+	/// Elements of params and result kept, further ones are skipped.
+	static const unsigned c_maxItems = 8;
+
+	/// False if the line is not a well-formed object, or has escaped strings.
+	bool parse(char const* _begin, char const* _end);
+
+	StratumToken id;
+	StratumToken method;
+	StratumToken error;
+	StratumToken params;
+	StratumToken result;
+	/// The elements of params and result if they are arrays.
+	StratumToken paramItems[c_maxItems];
+	unsigned paramCount = 0;
+	StratumToken resultItems[c_maxItems];
+	unsigned resultCount = 0;
+
+private:
+	bool value(StratumToken& _t, StratumToken* _items, unsigned* _count, unsigned _depth);
+	void skipSpace() { while (m_p != m_end && (*m_p == ' ' || *m_p == '\t' || *m_p == '\r' || *m_p == '\n')) ++m_p; }
+
+	char const* m_p = nullptr;
+	char const* m_end = nullptr;
+};
+
+/// How a hex string shorter than a hash is taken, matching what the pools send.
+enum class HexPad
+{
+	Exact,  ///< All 64 digits, as h256(string) wants them.
+	Left,   ///< Leading zeros dropped, e.g. share targets.
+	Right   ///< Padded or cut to 64 digits with trailing zeros, e.g. EthereumStratum job ids.
+};
+
+/// Decodes a hex string, 0x-prefixed or not, straight into _h. False, leaving
+/// _h alone, where h256(string) would throw or give a zero hash.
+bool toHash(StratumToken const& _t, h256& _h, HexPad _pad = HexPad::Exact);
+
+/// False unless _t is a number.
+bool toNumber(StratumToken const& _t, double& _d);
@@ -0,0 +1,338 @@
+#include "StratumProxy.h"
+#include <cstring>
+#include <sstream>
+#include <libdevcore/Log.h>
+#include "EthStratumClient.h"
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+/// Recent jobs rigs may still submit shares for.
+size_t const c_jobs = 8;
+
+char const c_hexDigits[] = "0123456789abcdef";
+
+string hexDigits(uint64_t _n, unsigned _digits)
+{
+	string s(_digits, '0');
+	for (unsigned i = _digits; i-- > 0; _n >>= 4)
+		s[i] = c_hexDigits[_n & 0xf];
+	return s;
+}
+
+/// The request id as it is to be echoed.
+string idText(StratumToken const& _id)
+{
+	if (_id.kind == StratumToken::String)
+		return "\"" + _id.str() + "\"";
+	return _id.kind == StratumToken::None ? string("null") : _id.str();
+}
+
+string replyLine(string const& _id, bool _result, char const* _error = nullptr)
+{
+	return "{\"id\":" + _id + ",\"result\":" + (_result ? "true" : "false") + ",\"error\":" + (_error ? string(_error) : string("null")) + "}\n";
+}
+
+}
+
+StratumProxy::StratumProxy(EthStratumClient& _upstream, string const& _address, unsigned short _port):
+	m_upstream(_upstream),
+	m_acceptor(m_strand.service(), tcp::endpoint(boost::asio::ip::address::from_string(_address), _port))
+{
+	cnote << "Stratum proxy listening on" << _address << "port" << _port;
+	m_checker = std::thread([this]() { check(); });
+	m_strand.post([this]()
+	{
+		m_upstream.setProxy(this);
+		accept();
+	});
+}
+
+StratumProxy::~StratumProxy()
+{
+	// First, so that the checker posts nothing after the drain.
+	{
+		Guard l(x_checks);
+		m_stopping = true;
+	}
+	m_checksQueued.notify_one();
+	m_checker.join();
+
+	m_strand.post([this]()
+	{
+		// No upstream handler runs meanwhile, so none calls in after this.
+		m_upstream.setProxy(nullptr);
+		boost::system::error_code ec;
+		m_acceptor.close(ec);
+		for (auto const& s: m_sessions)
+			s.second->socket.close(ec);
+		m_sessions.clear();
+	});
+	m_strand.drain();
+}
+
+void StratumProxy::notify(WorkPackage const& _work, unsigned _extraNonceHexSize, double _difficulty)
+{
+	m_strand.post([=]()
+	{
+		if (!reservedBits(_extraNonceHexSize))
+		{
+			if (!m_jobs.empty() || m_sessions.size())
+			{
+				cwarn << "Upstream extranonce too long to share with rigs";
+			}
+			m_jobs.clear();
+			while (m_sessions.size())
+				close(m_sessions.begin()->second);
+			return;
+		}
+		string const extraNonce = _extraNonceHexSize ? hexDigits(_work.startNonce >> (64 - _extraNonceHexSize * 4), _extraNonceHexSize) : string();
+		bool const changed = !m_jobs.empty() && extraNonce != m_extraNonce;
+		m_extraNonce = extraNonce;
+		m_difficulty = _difficulty;
+
+		m_jobs.push_back(Job{_work.job.hex().substr(0, _work.job_len), _work});
+		if (m_jobs.size() > c_jobs)
+			m_jobs.pop_front();
+
+		string const lines = jobLines();
+		for (auto const& s: m_sessions)
+		{
+			if (changed)
+				send(s.second, "{\"id\":null,\"method\":\"mining.set_extranonce\",\"params\":[\"" + this->extraNonce(*s.second) + "\"]}\n");
+			if (s.second->authorized)
+				send(s.second, lines);
+		}
+	});
+}
+
+void StratumProxy::accept()
+{
+	unsigned byte = 1;
+	while (m_sessions.count(byte))
+		++byte;
+	SessionPtr s = std::make_shared<Session>(m_strand.service(), byte);
+	m_acceptor.async_accept(s->socket, m_strand.wrap([this, s](boost::system::error_code const& _ec)
+	{
+		if (_ec == boost::asio::error::operation_aborted)
+			return;
+		if (!_ec)
+		{
+			boost::system::error_code ec;
+			if (s->byte >> c_sessionBits)
+			{
+				cwarn << "Stratum proxy full, turning away" << s->socket.remote_endpoint(ec);
+				s->socket.close(ec);
+			}
+			else
+			{
+				cnote << "Rig connected to stratum proxy from" << s->socket.remote_endpoint(ec);
+				s->socket.set_option(tcp::no_delay(true), ec);
+				m_sessions[s->byte] = s;
+				read(s);
+			}
+		}
+		accept();
+	}));
+}
+
+void StratumProxy::read(SessionPtr _s)
+{
+	boost::asio::async_read_until(_s->socket, _s->in, "\n", m_strand.wrap([this, _s](boost::system::error_code const& _ec, size_t _n)
+	{
+		if (_ec)
+		{
+			if (_ec == boost::asio::error::not_found)
+			{
+				cwarn << "Stratum proxy rig sent a line over" << c_maxLine << "bytes, closing";
+			}
+			close(_s);
+			return;
+		}
+		char const* line = boost::asio::buffer_cast<char const*>(_s->in.data());
+		char const* end = line + _n - 1;
+		if (end != line && end[-1] == '\r')
+			--end;
+		StratumMessage message;
+		if (message.parse(line, end))
+			process(_s, message);
+		else
+			send(_s, replyLine("null", false, "[20,\"Malformed request\",null]"));
+		_s->in.consume(_n);
+		if (_s->socket.is_open())
+			read(_s);
+	}));
+}
+
+void StratumProxy::process(SessionPtr _s, StratumMessage const& _m)
+{
+	string const id = idText(_m.id);
+	if (_m.method.is("mining.subscribe"))
+	{
+		string const extraNonce = this->extraNonce(*_s);
+		if (extraNonce.empty())
+		{
+			// The rig retries, by then the upstream pool has likely sent a job.
+			send(_s, replyLine(id, false, "[25,\"No upstream work yet\",null]"));
+			close(_s);
+			return;
+		}
+		send(_s, "{\"id\":" + id + ",\"result\":[[\"mining.notify\",\"" + hexDigits(_s->byte, 2) + "\",\"EthereumStratum/1.0.0\"],\"" + extraNonce + "\"],\"error\":null}\n");
+	}
+	else if (_m.method.is("mining.authorize"))
+	{
+		// The rigs mine for the upstream worker; their own names are not checked.
+		send(_s, replyLine(id, true));
+		_s->authorized = true;
+		if (!m_jobs.empty())
+			send(_s, jobLines());
+	}
+	else if (_m.method.is("mining.submit") && _m.paramCount >= 3)
+		submit(_s, _m.id, _m.paramItems[1], _m.paramItems[2]);
+	else if (_m.method.is("mining.extranonce.subscribe") || _m.method.is("eth_submitHashrate"))
+		send(_s, replyLine(id, true));
+	else if (_m.id.kind != StratumToken::Null && _m.id.kind != StratumToken::None)
+		send(_s, replyLine(id, false, "[20,\"Unsupported method\",null]"));
+}
+
+void StratumProxy::submit(SessionPtr _s, StratumToken const& _id, StratumToken const& _job, StratumToken const& _nonce)
+{
+	string const id = idText(_id);
+	Job const* job = nullptr;
+	for (Job const& j: m_jobs)
+		if (_job.kind == StratumToken::String && j.id.size() == _job.size() && j.id.compare(0, string::npos, _job.begin, _job.size()) == 0)
+			job = &j;
+	if (!job || !_s->authorized)
+	{
+		send(_s, replyLine(id, false, job ? "[24,\"Unauthorized worker\",null]" : "[21,\"Job not found\",null]"));
+		return;
+	}
+
+	// The rig sends the digits after its extranonce: upstream's and its own byte.
+	unsigned const suffixBits = 64 - (unsigned)m_extraNonce.size() * 4 - c_sessionBits;
+	uint64_t suffix = 0;
+	bool valid = _nonce.kind == StratumToken::String && _nonce.size() * 4 <= suffixBits;
+	for (char const* p = _nonce.begin; valid && p != _nonce.end; ++p)
+	{
+		char const* d = strchr(c_hexDigits, *p >= 'A' && *p <= 'F' ? *p - 'A' + 'a' : *p);
+		valid = d && *d;
+		if (valid)
+			suffix = suffix << 4 | (uint64_t)(d - c_hexDigits);
+	}
+	if (!valid)
+	{
+		send(_s, replyLine(id, false, "[20,\"Bad nonce\",null]"));
+		return;
+	}
+
+	Solution solution{job->work.startNonce | (uint64_t)_s->byte << suffixBits | suffix, h256(), job->work, job != &m_jobs.back(), ~0u};
+	{
+		Guard l(x_checks);
+		if (m_checks.size() < c_maxChecks)
+		{
+			m_checks.push_back(Check{_s, id, solution});
+			m_checksQueued.notify_one();
+			return;
+		}
+	}
+	send(_s, replyLine(id, false, "[20,\"Too many shares pending\",null]"));
+}
+
+void StratumProxy::checked(std::weak_ptr<Session> _session, string const& _id, Solution const& _solution, bool _valid)
+{
+	SessionPtr s = _session.lock();
+	if (!s)
+		return;
+	if (!_valid)
+	{
+		cwarn << "Stratum proxy rig sent a share above its job's boundary";
+		send(s, replyLine(_id, false, "[23,\"Low difficulty share\",null]"));
+		return;
+	}
+	m_upstream.submit(_solution, [this, _session, _id](bool _accepted)
+	{
+		m_strand.post([this, _session, _id, _accepted]()
+		{
+			if (SessionPtr s = _session.lock())
+				send(s, replyLine(_id, _accepted, _accepted ? nullptr : "[23,\"Rejected by pool\",null]"));
+		});
+	});
+}
+
+void StratumProxy::check()
+{
+	setThreadName("proxycheck");
+	while (true)
+	{
+		Check c;
+		{
+			std::unique_lock<Mutex> l(x_checks);
+			m_checksQueued.wait(l, [this]() { return m_stopping || !m_checks.empty(); });
+			if (m_stopping)
+				return;
+			c = std::move(m_checks.front());
+			m_checks.pop_front();
+		}
+		WorkPackage const& w = c.solution.work;
+		Result const r = EthashAux::eval(w.seed, w.header, c.solution.nonce);
+		bool const valid = r.value <= w.boundary;
+		c.solution.mixHash = r.mixHash;
+		m_strand.post([this, c, valid]()
+		{
+			checked(c.session, c.id, c.solution, valid);
+		});
+	}
+}
+
+void StratumProxy::send(SessionPtr const& _s, string const& _line)
+{
+	if (!_s->socket.is_open())
+		return;
+	_s->queued += _line;
+	if (!_s->sending.empty())
+		return;
+	_s->sending.swap(_s->queued);
+	boost::asio::async_write(_s->socket, boost::asio::buffer(_s->sending), m_strand.wrap(boost::bind(&StratumProxy::written, this, _s, boost::asio::placeholders::error)));
+}
+
+void StratumProxy::written(SessionPtr _s, boost::system::error_code const& _ec)
+{
+	_s->sending.clear();
+	if (_ec)
+	{
+		close(_s);
+		return;
+	}
+	if (!_s->queued.empty())
+		send(_s, string());
+}
+
+void StratumProxy::close(SessionPtr const& _s)
+{
+	auto i = m_sessions.find(_s->byte);
+	if (i != m_sessions.end() && i->second == _s)
+	{
+		cnote << "Rig left stratum proxy";
+		m_sessions.erase(i);
+	}
+	boost::system::error_code ec;
+	_s->socket.close(ec);
+}
+
+string StratumProxy::extraNonce(Session const& _s) const
+{
+	return m_jobs.empty() ? string() : m_extraNonce + hexDigits(_s.byte, 2);
+}
+
+string StratumProxy::jobLines() const
+{
+	if (m_jobs.empty())
+		return string();
+	WorkPackage const& w = m_jobs.back().work;
+	std::ostringstream difficulty;
+	difficulty.precision(17);
+	difficulty << m_difficulty;
+	return "{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[" + difficulty.str() + "]}\n"
+		"{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"" + m_jobs.back().id + "\",\"" + w.seed.hex() + "\",\"" + w.header.hex() + "\",true]}\n";
+}
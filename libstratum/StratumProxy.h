@@ -0,0 +1,114 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <boost/asio.hpp>
+#include <libdevcore/Guards.h>
+#include <libdevcore/Reactor.h>
+#include <libethcore/EthashAux.h>
+#include "StratumParser.h"
+
+using namespace std;
+using namespace dev;
+using namespace dev::eth;
+
+class EthStratumClient;
+
+/// Serves EthereumStratum/1.0 to other rigs over this instance's upstream
+/// connection. A rig gets the upstream extranonce plus one byte of its own,
+/// so the nonce ranges of the rigs and of the local farm, which keeps byte
+/// 0, are disjoint. Jobs are fanned out as they come; shares are checked
+/// against the job's boundary, forwarded upstream and the pool's replies
+/// passed back.
+///
+/// Runs on the Reactor next to the upstream clients; being on its one thread
+/// is what lets the destructor detach from them safely. Shares are hashed on
+/// a thread of the proxy's own, as the light cache evaluation would stall the
+/// Reactor.
+class StratumProxy
+{
+public:
+	/// The extranonce byte added per rig.
+	static const unsigned c_sessionBits = 8;
+	/// Upstream extranonces longer than this leave no room for the rigs' byte.
+	static const unsigned c_maxExtraNonceHexSize = 12;
+	/// Longest line taken from a rig; longer ones close its session.
+	static const size_t c_maxLine = 4096;
+	/// Shares waiting to be checked beyond which more are refused.
+	static const size_t c_maxChecks = 64;
+
+	/// Listens on _address and _port; throws if it cannot. _upstream must
+	/// speak EthereumStratum/1.0 and outlive the proxy.
+	StratumProxy(EthStratumClient& _upstream, string const& _address, unsigned short _port);
+	~StratumProxy();
+
+	/// Extranonce bits the local farm is to leave alone with an upstream
+	/// extranonce of _extraNonceHexSize digits.
+	static unsigned reservedBits(unsigned _extraNonceHexSize) { return _extraNonceHexSize <= c_maxExtraNonceHexSize ? c_sessionBits : 0; }
+
+	/// The serving upstream client's new job, with the length of its
+	/// extranonce and its share difficulty.
+	void notify(WorkPackage const& _work, unsigned _extraNonceHexSize, double _difficulty);
+
+private:
+	struct Session
+	{
+		Session(boost::asio::io_service& _service, unsigned _byte): socket(_service), byte(_byte), in(c_maxLine) {}
+
+		boost::asio::ip::tcp::socket socket;
+		unsigned const byte;  ///< Appended to the upstream extranonce.
+		boost::asio::streambuf in;
+		string queued;   ///< Lines waiting for the write in flight.
+		string sending;  ///< Lines being written.
+		bool authorized = false;
+	};
+	typedef std::shared_ptr<Session> SessionPtr;
+
+	void accept();
+	void read(SessionPtr _s);
+	void process(SessionPtr _s, StratumMessage const& _m);
+	void submit(SessionPtr _s, StratumToken const& _id, StratumToken const& _job, StratumToken const& _nonce);
+	void send(SessionPtr const& _s, string const& _line);
+	void written(SessionPtr _s, boost::system::error_code const& _ec);
+	/// Forwards _solution upstream, or answers the rig itself if it misses
+	/// the job's boundary.
+	void checked(std::weak_ptr<Session> _session, string const& _id, Solution const& _solution, bool _valid);
+	/// The checker thread.
+	void check();
+	void close(SessionPtr const& _s);
+	/// The rig's extranonce, empty before the first usable job.
+	string extraNonce(Session const& _s) const;
+	/// set_difficulty and notify lines of the current job.
+	string jobLines() const;
+
+	EthStratumClient& m_upstream;
+	ReactorStrand m_strand;  ///< Everything below is only touched on it.
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	std::map<unsigned, SessionPtr> m_sessions;  ///< By extranonce byte.
+
+	struct Job
+	{
+		string id;  ///< As sent to the rigs.
+		WorkPackage work;
+	};
+	/// Recent upstream jobs, newest last, for the rigs' shares.
+	std::deque<Job> m_jobs;
+	double m_difficulty = 1;
+	string m_extraNonce;  ///< The upstream extranonce as hex, of the newest job.
+
+	/// A rig's share waiting to be hashed.
+	struct Check
+	{
+		std::weak_ptr<Session> session;
+		string id;
+		Solution solution;
+	};
+	Mutex x_checks;
+	std::condition_variable m_checksQueued;
+	std::deque<Check> m_checks;
+	bool m_stopping = false;  ///< Guarded by x_checks.
+	std::thread m_checker;
+};
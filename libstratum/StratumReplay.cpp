@@ -0,0 +1,363 @@
+#include "StratumReplay.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <stdexcept>
+#include <libdevcore/Log.h>
+#include "EthStratumClient.h"
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+/// Recent jobs a share may still be for.
+size_t const c_jobs = 16;
+
+bool isSubmit(string const& _method)
+{
+	return _method == "mining.submit" || _method == "eth_submitWork";
+}
+
+/// Job ids the client pads or cuts to a length of its own.
+bool sameJob(string const& _a, string const& _b)
+{
+	size_t const n = min(_a.size(), _b.size());
+	return n && _a.compare(0, n, _b, 0, n) == 0;
+}
+
+string ms(uint64_t _us)
+{
+	ostringstream s;
+	s << fixed << setprecision(1) << _us / 1000.0 << " ms";
+	return s.str();
+}
+
+string percentiles(LatencyStats const& _s)
+{
+	return _s.count ? "median " + ms(_s.p50) + ", p90 " + ms(_s.p90) + ", max " + ms(_s.max) + " of " + to_string(_s.count) : string("none");
+}
+
+}
+
+const unsigned StratumReplay::c_graceMs;
+
+StratumReplay::StratumReplay(string const& _file, double _speed):
+	m_speed(_speed),
+	m_acceptor(m_strand.service(), tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+	m_socket(m_strand.service()),
+	m_timer(m_strand.service())
+{
+	load(_file);
+	m_port = m_acceptor.local_endpoint().port();
+	cnote << "Replaying" << m_events.size() << "lines of" << _file << "at" << _speed << "x on port" << m_port;
+	m_strand.post([this]() { accept(); });
+}
+
+StratumReplay::~StratumReplay()
+{
+	m_strand.post([this]()
+	{
+		boost::system::error_code ec;
+		m_timer.cancel(ec);
+		m_acceptor.close(ec);
+		m_socket.close(ec);
+	});
+	m_strand.drain();
+}
+
+string StratumReplay::jobKey(string const& _id)
+{
+	string key = _id.compare(0, 2, "0x") ? _id : _id.substr(2);
+	transform(key.begin(), key.end(), key.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+	return key;
+}
+
+string StratumReplay::idKey(Json::Value const& _id)
+{
+	string key = Json::FastWriter().write(_id);
+	while (!key.empty() && key.back() == '\n')
+		key.pop_back();
+	return key;
+}
+
+void StratumReplay::load(string const& _file)
+{
+	ifstream in(_file);
+	if (!in)
+		throw runtime_error("Cannot read " + _file);
+
+	// The client's requests by id: method and when.
+	map<string, pair<string, uint64_t>> requests;
+	bool started = false;
+	bool jobSeen = false;
+	string line;
+	while (getline(in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		size_t const tab = line.find('\t');
+		if (tab == string::npos || tab + 3 > line.size() || line[tab + 2] != '\t')
+			continue;
+		uint64_t const us = strtoull(line.c_str(), nullptr, 10);
+		char const kind = line[tab + 1];
+		string const text = line.substr(tab + 3);
+		if (kind == '*')
+		{
+			// A file holds one session.
+			if (started)
+				break;
+			started = true;
+			m_protocol = atoi(text.c_str());
+			continue;
+		}
+
+		Json::Value v;
+		bool const parsed = Json::Reader().parse(text, v, false) && v.isObject();
+		string const method = parsed && v["method"].isString() ? v["method"].asString() : string();
+		if (kind == '>')
+		{
+			if (!method.empty() && v.isMember("id"))
+				requests[idKey(v["id"])] = make_pair(method, us);
+			continue;
+		}
+		if (kind != '<')
+			continue;
+
+		Event e;
+		e.us = us;
+		e.line = text;
+		if (parsed && method.empty())
+		{
+			// A reply; eth-proxy jobs come as replies too.
+			auto const r = requests.find(idKey(v["id"]));
+			if (r != requests.end() && isSubmit(r->second.first))
+			{
+				m_recordedRtt.record(us > r->second.second ? us - r->second.second : 0);
+				requests.erase(r);
+				continue;
+			}
+			Json::Value const& result = v["result"];
+			if (result.isArray() && result.size() >= 3 && result[0u].isString())
+				e.job = jobKey(result[0u].asString());
+			if (r != requests.end())
+			{
+				if (!jobSeen)
+					e.waitFor = r->first;
+				requests.erase(r);
+			}
+			// Replies to what the live client need not ask again.
+			if (e.job.empty() && e.waitFor.empty())
+				continue;
+		}
+		else if (method == "mining.notify")
+		{
+			Json::Value const& params = v["params"];
+			if (params.isArray() && params.size() && params[0u].isString())
+				e.job = jobKey(params[0u].asString());
+		}
+		jobSeen = jobSeen || !e.job.empty();
+		m_events.push_back(e);
+	}
+	if (!started || m_events.empty())
+		throw runtime_error(_file + " holds no recorded stratum session");
+	m_replyUs = m_recordedRtt.stats().p50;
+}
+
+void StratumReplay::accept()
+{
+	m_acceptor.async_accept(m_socket, m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (_ec == boost::asio::error::operation_aborted)
+			return;
+		if (_ec)
+		{
+			cwarn << "Replay accept failed:" << _ec.message();
+			accept();
+			return;
+		}
+		// One client, for one session.
+		boost::system::error_code ec;
+		m_acceptor.close(ec);
+		m_socket.set_option(tcp::no_delay(true), ec);
+		m_connected = true;
+		m_start = std::chrono::steady_clock::now();
+		read();
+		play();
+	}));
+}
+
+void StratumReplay::read()
+{
+	boost::asio::async_read_until(m_socket, m_in, "\n", m_strand.wrap([this](boost::system::error_code const& _ec, size_t _n)
+	{
+		if (_ec)
+		{
+			if (_ec != boost::asio::error::operation_aborted && !done())
+			{
+				cwarn << "The client left the replay after" << m_next << "of" << m_events.size() << "lines";
+				finish();
+			}
+			return;
+		}
+		string const line(boost::asio::buffers_begin(m_in.data()), boost::asio::buffers_begin(m_in.data()) + _n);
+		m_in.consume(_n);
+		process(line);
+		read();
+	}));
+}
+
+void StratumReplay::play()
+{
+	auto const now = std::chrono::steady_clock::now();
+	while (m_next < m_events.size())
+	{
+		Event const& e = m_events[m_next];
+		// The handshake goes at the client's pace, and process() carries on.
+		if (!e.waitFor.empty() && !m_requested.count(e.waitFor))
+			return;
+		auto const due = m_start + std::chrono::microseconds(uint64_t(e.us / m_speed));
+		if (due > now)
+		{
+			m_timer.expires_from_now(boost::posix_time::microseconds(std::chrono::duration_cast<std::chrono::microseconds>(due - now).count()));
+			m_timer.async_wait(m_strand.wrap([this](boost::system::error_code const& _ec)
+			{
+				if (!_ec)
+					play();
+			}));
+			return;
+		}
+		if (!e.job.empty())
+		{
+			m_jobs.push_back(Job{e.job, now});
+			if (m_jobs.size() > c_jobs)
+				m_jobs.pop_front();
+		}
+		send(e.line + "\n");
+		++m_next;
+	}
+	m_timer.expires_from_now(boost::posix_time::milliseconds(c_graceMs));
+	m_timer.async_wait(m_strand.wrap([this](boost::system::error_code const& _ec)
+	{
+		if (!_ec)
+			finish();
+	}));
+}
+
+void StratumReplay::process(string const& _line)
+{
+	if (done())
+		return;
+	Json::Value v;
+	if (!Json::Reader().parse(_line, v, false) || !v.isObject())
+		return;
+	string const method = v["method"].isString() ? v["method"].asString() : string();
+	if (isSubmit(method))
+	{
+		submitted(v);
+		return;
+	}
+	string const id = idKey(v["id"]);
+	m_requested.insert(id);
+	if (m_next < m_events.size() && m_events[m_next].waitFor == id)
+		play();
+	else if (method == "eth_submitHashrate" || method == "mining.hashrate")
+		send("{\"id\":" + id + ",\"result\":true,\"error\":null}\n");
+}
+
+void StratumReplay::submitted(Json::Value const& _request)
+{
+	auto const now = std::chrono::steady_clock::now();
+	Json::Value const& params = _request["params"];
+	// mining.submit has the job second, after the user, but in
+	// EthereumStratum/2.0; eth_submitWork has the header there.
+	unsigned const at = m_protocol == STRATUM_PROTOCOL_ETHEREUMSTRATUM2 && _request["method"].asString() == "mining.submit" ? 0 : 1;
+	string const job = params.isArray() && params.size() > at && params[at].isString() ? jobKey(params[at].asString()) : string();
+
+	++m_shares;
+	size_t found = m_jobs.size();
+	for (size_t i = m_jobs.size(); i-- > 0;)
+		if (sameJob(m_jobs[i].id, job))
+		{
+			found = i;
+			break;
+		}
+	string verdict;
+	if (found == m_jobs.size())
+	{
+		++m_rejected;
+		verdict = "false,\"error\":[20,\"Unknown job\",null]";
+	}
+	else
+	{
+		m_shareAge.record<std::chrono::steady_clock>(m_jobs[found].sent, now);
+		if (found + 1 == m_jobs.size())
+		{
+			++m_accepted;
+			verdict = "true,\"error\":null";
+		}
+		else
+		{
+			++m_stale;
+			verdict = "false,\"error\":[21,\"Stale share\",null]";
+		}
+	}
+
+	// As late as the recorded pool answered, at the replay's pace.
+	string const reply = "{\"id\":" + idKey(_request["id"]) + ",\"result\":" + verdict + "}\n";
+	auto timer = make_shared<boost::asio::deadline_timer>(m_strand.service(), boost::posix_time::microseconds(uint64_t(m_replyUs / m_speed)));
+	timer->async_wait(m_strand.wrap([this, timer, reply](boost::system::error_code const& _ec)
+	{
+		if (!_ec && m_connected)
+			send(reply);
+	}));
+}
+
+void StratumReplay::send(string const& _line)
+{
+	m_queued += _line;
+	if (m_sending.empty())
+		write();
+}
+
+void StratumReplay::write()
+{
+	m_sending.swap(m_queued);
+	boost::asio::async_write(m_socket, boost::asio::buffer(m_sending), m_strand.wrap([this](boost::system::error_code const& _ec, size_t)
+	{
+		m_sending.clear();
+		if (_ec)
+		{
+			m_connected = false;
+			m_queued.clear();
+			return;
+		}
+		if (!m_queued.empty())
+			write();
+	}));
+}
+
+void StratumReplay::finish()
+{
+	// The counts are final from here on, for report().
+	m_done.store(true);
+}
+
+void StratumReplay::report(std::ostream& _out, LatencyReport const& _farm) const
+{
+	_out << "Replayed " << m_next << " of " << m_events.size() << " lines at " << m_speed << "x" << endl;
+	_out << "Share round trips recorded: " << percentiles(m_recordedRtt.stats()) << endl;
+	_out << "Shares: " << m_shares << " submitted, " << m_accepted << " would be accepted, " << m_stale << " stale, "
+		<< m_rejected << " rejected";
+	if (m_shares)
+		_out << " (" << fixed << setprecision(2) << (m_stale + m_rejected) * 100.0 / m_shares << "% lost)";
+	_out << endl;
+	_out << "Job sent to share in: " << percentiles(m_shareAge.stats()) << endl;
+	_out << "Job in to the farm's work set: " << percentiles(_farm.job) << endl;
+	for (MinerLatencyStats const& m: _farm.miners)
+		if (!m.name.empty())
+			_out << "  " << m.name << " work switch: " << percentiles(m.workSwitch) << endl;
+	for (PoolLatencyStats const& p: _farm.pools)
+		_out << "Share round trips seen by the client from " << p.pool << ": " << percentiles(p.submit) << endl;
+}
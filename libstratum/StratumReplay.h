@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <json/json.h>
+#include <libdevcore/Reactor.h>
+#include <libethcore/Farm.h>
+#include <libethcore/Latency.h>
+
+using namespace std;
+using namespace dev;
+using namespace dev::eth;
+
+/// A local fake pool playing a session SessionRecorder wrote to one client,
+/// at the recorded pace or faster, for repeatable measurements of the
+/// path from a pool's job to the share going back.
+///
+/// The pool's lines go out at their recorded times, scaled by the speed;
+/// its replies to the handshake wait for the client's requests of the same
+/// id. The recorded share replies are left out: the live shares get a reply
+/// after the median recorded round trip instead, telling which the pool
+/// would have accepted, had as stale or rejected by the job they were for.
+class StratumReplay
+{
+public:
+	/// Lines from the client after the recording's end are still taken for so long.
+	static const unsigned c_graceMs = 2000;
+
+	/// Loads _file and listens on a free port of 127.0.0.1 for the client; throws
+	/// if it cannot. _speed > 1 plays faster than recorded.
+	StratumReplay(string const& _file, double _speed);
+	~StratumReplay();
+
+	unsigned short port() const { return m_port; }
+	/// Of the recorded session, for the client.
+	int protocol() const { return m_protocol; }
+	/// All lines were played and the grace period is over.
+	bool done() const { return m_done.load(std::memory_order_relaxed); }
+
+	/// The recorded round trips and the live shares' outcomes, with where
+	/// _farm says the time from job to GPU went.
+	void report(std::ostream& _out, LatencyReport const& _farm) const;
+
+private:
+	struct Event
+	{
+		uint64_t us = 0;		///< Recorded, since the session began.
+		string line;
+		string waitFor;			///< A handshake reply: the id of its request.
+		string job;				///< The job this line gives, if any.
+	};
+
+	struct Job
+	{
+		string id;				///< Normalised, see jobKey().
+		std::chrono::steady_clock::time_point sent;
+	};
+
+	/// Compares as the client echoes job ids: without 0x, in lower case.
+	static string jobKey(string const& _id);
+	/// As written by Json::FastWriter, for matching ids.
+	static string idKey(Json::Value const& _id);
+
+	void load(string const& _file);
+	void accept();
+	void read();
+	/// Sends the events that are due, then waits for the next.
+	void play();
+	void process(string const& _line);
+	void submitted(Json::Value const& _request);
+	void send(string const& _line);
+	void write();
+	void finish();
+
+	double const m_speed;
+	int m_protocol = 0;
+	vector<Event> m_events;
+	LatencyHistogram m_recordedRtt;		///< Share to reply, as recorded.
+	uint64_t m_replyUs = 0;				///< The median of m_recordedRtt.
+
+	ReactorStrand m_strand;				///< Everything below is only touched on it.
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	boost::asio::ip::tcp::socket m_socket;
+	boost::asio::deadline_timer m_timer;
+	unsigned short m_port = 0;
+	boost::asio::streambuf m_in;
+	string m_queued;					///< Lines waiting for the write in flight.
+	string m_sending;
+	bool m_connected = false;
+	std::chrono::steady_clock::time_point m_start;	///< The client connected.
+	size_t m_next = 0;					///< Of m_events.
+	set<string> m_requested;			///< Ids of the client's handshake requests.
+	deque<Job> m_jobs;					///< Sent, newest last.
+
+	uint64_t m_shares = 0;
+	uint64_t m_accepted = 0;
+	uint64_t m_stale = 0;
+	uint64_t m_rejected = 0;
+	LatencyHistogram m_shareAge;		///< Job sent to the share for it in.
+	std::atomic<bool> m_done = {false};
+};
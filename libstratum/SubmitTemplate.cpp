@@ -0,0 +1,157 @@
+#include "SubmitTemplate.h"
+#include <libethcore/Miner.h>
+
+namespace
+{
+
+char const c_hexDigits[] = "0123456789abcdef";
+
+/// Fills the placeholder of a template, zero padded on the left like toHex().
+void hexInto(char* _out, uint64_t _n, unsigned _from)
+{
+	for (unsigned i = 16; i-- > _from; _n >>= 4)
+		_out[i - _from] = c_hexDigits[_n & 0xf];
+}
+
+void hexInto(char* _out, h256 const& _h)
+{
+	for (unsigned i = 0; i < 32; ++i)
+	{
+		_out[2 * i] = c_hexDigits[_h[i] >> 4];
+		_out[2 * i + 1] = c_hexDigits[_h[i] & 0xf];
+	}
+}
+
+}
+
+void SubmitTemplate::render(int _protocol, string const& _user, string const& _worker, WorkPackage const& _work, size_t _jobDigits, unsigned _extraNonceHexSize)
+{
+	header = _work.header;
+	job = _work.job;
+	m_nonceFrom = 0;
+	m_mixAt = string::npos;
+	string const nonce(16, '0');
+	string const mix(64, '0');
+	switch (_protocol)
+	{
+		case STRATUM_PROTOCOL_STRATUM:
+			text = ", \"method\": \"mining.submit\", \"params\": [\"" + _user + "\",\"" + _work.job.hex() + "\",\"0x";
+			m_nonceAt = text.size();
+			text += nonce + "\",\"0x" + _work.header.hex() + "\",\"0x";
+			m_mixAt = text.size();
+			text += mix + "\"]}\n";
+			break;
+		case STRATUM_PROTOCOL_ETHPROXY:
+			text = ", \"worker\":\"" + _worker + "\", \"method\": \"eth_submitWork\", \"params\": [\"0x";
+			m_nonceAt = text.size();
+			text += nonce + "\",\"0x" + _work.header.hex() + "\",\"0x";
+			m_mixAt = text.size();
+			text += mix + "\"]}\n";
+			break;
+		case STRATUM_PROTOCOL_ETHEREUMSTRATUM:
+			m_nonceFrom = min(_extraNonceHexSize, 16u);
+			text = ", \"method\": \"mining.submit\", \"params\": [\"" + _user + "\",\"" + _work.job.hex().substr(0, _jobDigits) + "\",\"";
+			m_nonceAt = text.size();
+			text += nonce.substr(m_nonceFrom) + "\"]}\n";
+			break;
+		case STRATUM_PROTOCOL_ETHEREUMSTRATUM2:
+			// _worker is the id the pool gave at authorization.
+			m_nonceFrom = min(_extraNonceHexSize, 16u);
+			text = ",\"method\":\"mining.submit\",\"params\":[\"" + _work.job.hex().substr(0, _jobDigits) + "\",\"";
+			m_nonceAt = text.size();
+			text += nonce.substr(m_nonceFrom) + "\",\"" + _worker + "\"]}\n";
+			break;
+	}
+}
+
+void SubmitTemplate::append(string& _out, unsigned _id, uint64_t _nonce, h256 const& _mixHash) const
+{
+	char id[16];
+	char* p = id + sizeof(id);
+	do
+		*--p = char('0' + _id % 10);
+	while (_id /= 10);
+	_out += "{\"id\": ";
+	_out.append(p, id + sizeof(id));
+	size_t const at = _out.size();
+	_out += text;
+	if (m_nonceAt != string::npos)
+		hexInto(&_out[at + m_nonceAt], _nonce, m_nonceFrom);
+	if (m_mixAt != string::npos)
+		hexInto(&_out[at + m_mixAt], _mixHash);
+}
+
+unsigned PendingShares::add(Solution const& _s, std::function<void(bool)> const& _replied)
+{
+	if (m_count == c_maxPending)
+	{
+		m_first = (m_first + 1) % c_maxPending;
+		--m_count;
+	}
+	unsigned const id = m_nextId;
+	// Kept within an int, as jsoncpp's asInt() reads the replies.
+	m_nextId = m_nextId == 0x7fffffff ? c_firstId : m_nextId + 1;
+	Share& s = m_shares[(m_first + m_count++) % c_maxPending];
+	s.id = id;
+	s.job = _s.work.job;
+	s.nonce = _s.nonce;
+	s.miner = _s.miner;
+	s.stale = _s.stale;
+	s.sent = std::chrono::steady_clock::now();
+	s.replied = _replied;
+	return id;
+}
+
+bool PendingShares::take(unsigned _id, Share& _share)
+{
+	if (!m_count)
+		return false;
+	size_t at = 0;
+	for (size_t i = 0; i < m_count; ++i)
+		if (m_shares[(m_first + i) % c_maxPending].id == _id)
+		{
+			at = i;
+			break;
+		}
+	_share = std::move(m_shares[(m_first + at) % c_maxPending]);
+	// Replies mostly come in order: the ones before it move up.
+	for (size_t i = at; i > 0; --i)
+		m_shares[(m_first + i) % c_maxPending] = std::move(m_shares[(m_first + i - 1) % c_maxPending]);
+	m_shares[m_first].replied = nullptr;
+	m_first = (m_first + 1) % c_maxPending;
+	--m_count;
+	return true;
+}
+
+void PendingShares::clear()
+{
+	for (Share& s: m_shares)
+		s.replied = nullptr;
+	m_first = 0;
+	m_count = 0;
+}
+
+void RecentJobs::add(h256 const& _header, h256 const& _job, bool _clean, std::chrono::steady_clock::time_point _received)
+{
+	if (m_jobs.size() >= c_jobs)
+		m_jobs.pop_front();
+	m_jobs.push_back(Job{_header, _job, _clean, _received});
+}
+
+RecentJobs::Verdict RecentJobs::check(WorkPackage const& _work, std::chrono::steady_clock::time_point _now, uint64_t& _ageMs) const
+{
+	_ageMs = 0;
+	if (m_jobs.empty())
+		return Current;
+	bool replaced = false;
+	for (auto i = m_jobs.rbegin(); i != m_jobs.rend(); ++i)
+	{
+		if (i->header == _work.header && i->job == _work.job)
+		{
+			_ageMs = std::chrono::duration_cast<std::chrono::milliseconds>(_now - i->received).count();
+			return replaced ? Obsolete : i == m_jobs.rbegin() ? Current : Stale;
+		}
+		replaced = replaced || i->clean;
+	}
+	return Obsolete;
+}
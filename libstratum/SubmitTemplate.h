@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <libdevcore/FixedHash.h>
+#include <libethcore/EthashAux.h>
+
+using namespace std;
+using namespace dev;
+using namespace dev::eth;
+
+/// A share submission rendered once per job, so a share only has its nonce
+/// and mix hash hex-encoded into the line.
+struct SubmitTemplate
+{
+	/// Renders the submit line of _work. _jobDigits of the job hex are sent;
+	/// with EthereumStratum the first _extraNonceHexSize nonce digits are the
+	/// pool's and left out.
+	void render(int _protocol, string const& _user, string const& _worker, WorkPackage const& _work, size_t _jobDigits, unsigned _extraNonceHexSize);
+	/// True if this is the template of _work.
+	bool matches(WorkPackage const& _work) const { return !text.empty() && header == _work.header && job == _work.job; }
+	/// Appends the line for one share, sent with request id _id, to _out.
+	void append(string& _out, unsigned _id, uint64_t _nonce, h256 const& _mixHash) const;
+
+	h256 header;
+	h256 job;
+	string text;  ///< The line after its id.
+
+private:
+	size_t m_nonceAt = string::npos;
+	unsigned m_nonceFrom = 0;  ///< First nonce digit sent.
+	size_t m_mixAt = string::npos;
+};
+
+/// Shares sent and not replied to yet, matched to the replies by request id.
+class PendingShares
+{
+public:
+	/// Share ids start here, above the fixed ids of the other requests.
+	static const unsigned c_firstId = 100;
+	/// Oldest shares are dropped beyond this, should a pool not reply at all.
+	static const size_t c_maxPending = 256;
+
+	struct Share
+	{
+		unsigned id;
+		h256 job;
+		uint64_t nonce;
+		unsigned miner;
+		bool stale;
+		std::chrono::steady_clock::time_point sent;
+		/// Takes the pool's verdict instead of the farm, for shares of others.
+		std::function<void(bool)> replied;
+	};
+
+	PendingShares(): m_shares(c_maxPending) {}
+
+	/// Notes a share about to be sent and returns its request id.
+	unsigned add(Solution const& _s, std::function<void(bool)> const& _replied = nullptr);
+	/// Takes the share replied to with _id, else the oldest one for pools
+	/// that mangle ids. False if none is pending.
+	bool take(unsigned _id, Share& _share);
+	void clear();
+
+private:
+	/// A ring of c_maxPending, taken once so bursts of shares do not allocate.
+	std::vector<Share> m_shares;
+	size_t m_first = 0;  ///< The oldest share.
+	size_t m_count = 0;
+	unsigned m_nextId = c_firstId;
+};
+
+/// The last jobs a pool sent, to tell before submitting what a share for
+/// one of them is still worth.
+class RecentJobs
+{
+public:
+	static const size_t c_jobs = 8;
+
+	enum Verdict
+	{
+		Current,   ///< For the newest job.
+		Stale,     ///< For an older job the pool may still take.
+		Obsolete   ///< Replaced by a clean job since, or older than any known.
+	};
+
+	/// Notes a job received at _received; _clean if the pool said older
+	/// jobs are void from now on.
+	void add(h256 const& _header, h256 const& _job, bool _clean, std::chrono::steady_clock::time_point _received);
+	/// What a share for _work is worth, and how long ago its job came in ms.
+	/// Shares are Current while no job is known.
+	Verdict check(WorkPackage const& _work, std::chrono::steady_clock::time_point _now, uint64_t& _ageMs) const;
+
+private:
+	struct Job
+	{
+		h256 header;
+		h256 job;
+		bool clean;
+		std::chrono::steady_clock::time_point received;
+	};
+	std::deque<Job> m_jobs;  ///< Newest last.
+};